@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# Startup benchmark
+# Builds each given commit and measures the time until kmscon shows its first
+# frame on a vkms virtual DRM device, taken from the "startup: first frame
+# after" line that kmscon logs. Prints the median of all runs per commit.
+#
+# Needs root, meson, ninja and the vkms kernel module. All GPUs of seat0 are
+# probed, so run this on a machine or VM where vkms is the only one.
+#
+# usage: scripts/startup-bench.sh [-r runs] [-v vt] <commit>...
+
+set -eu
+
+usage() {
+	echo "usage: $0 [-r runs] [-v vt] <commit>..." >&2
+	exit 1
+}
+
+runs=5
+vt=8
+while getopts r:v: opt; do
+	case "$opt" in
+	r) runs=$OPTARG ;;
+	v) vt=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ "$#" -gt 0 ] || usage
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "$0: must be run as root" >&2
+	exit 1
+fi
+
+modprobe vkms
+vkms=
+for card in /sys/class/drm/card[0-9]*; do
+	case "${card##*/}" in
+	*-*) continue ;;
+	esac
+	driver=$(basename "$(readlink "$card/device/driver")")
+	if [ "$driver" = vkms ]; then
+		vkms=${card##*/}
+	else
+		echo "$0: warning: ${card##*/} ($driver) is probed as well" >&2
+	fi
+done
+if [ -z "$vkms" ]; then
+	echo "$0: no vkms device found" >&2
+	exit 1
+fi
+
+repo=$(git rev-parse --show-toplevel)
+work=$(mktemp -d)
+trap 'git -C "$repo" worktree remove --force "$work/src" 2>/dev/null; rm -rf "$work"' EXIT
+
+# Prints the startup time of one run in ms, or "timeout" after 10 s.
+measure() {
+	log=$work/log
+	"$work/inst/bin/kmscon" --vt="$vt" --switchvt --verbose \
+		--startup-trace="$work/trace.json" >"$log" 2>&1 &
+	pid=$!
+	ms=
+	i=0
+	while [ $i -lt 100 ]; do
+		ms=$(sed -n 's/.*startup: first frame after \([0-9.]*\) ms.*/\1/p' "$log")
+		[ -n "$ms" ] && break
+		sleep 0.1
+		i=$((i + 1))
+	done
+	kill "$pid" 2>/dev/null || true
+	wait "$pid" 2>/dev/null || true
+	echo "${ms:-timeout}"
+}
+
+median() {
+	printf '%s\n' "$@" | grep -v timeout | sort -n |
+		awk '{ v[NR] = $1 } END { print NR ? v[int((NR + 1) / 2)] : "-" }'
+}
+
+printf '%-12s %8s  %s\n' commit median runs
+for commit in "$@"; do
+	rev=$(git -C "$repo" rev-parse --short "$commit")
+	git -C "$repo" worktree add --detach "$work/src" "$rev" >/dev/null 2>&1
+	meson setup "$work/build" "$work/src" --prefix="$work/inst" >/dev/null
+	meson install -C "$work/build" >/dev/null
+
+	results=
+	n=0
+	while [ $n -lt "$runs" ]; do
+		results="$results $(measure)"
+		n=$((n + 1))
+	done
+	# shellcheck disable=SC2086
+	printf '%-12s %8s  %s\n' "$rev" "$(median $results)" "${results# }"
+
+	rm -rf "$work/build" "$work/inst"
+	git -C "$repo" worktree remove --force "$work/src"
+done
@@ -39,10 +39,12 @@
  *
  * Sources can be one of:
  *  - File descriptors: An fd that is watched for readable/writeable events
+ *  - Readers: An fd that is read for you, with io_uring if available
  *  - Timers: An event that occurs after a relative timeout
  *  - Counters: An event that occurs when the counter is non-zero
  *  - Signals: An event that occurs when a signal is caught
  *  - Idle: An event that occurs when nothing else is done
+ *  - Queued: A callback queued from another thread with ev_eloop_queue_cb()
  *  - Eloop: An event loop itself can be a source of another event loop
  *
  * A source can be registered for a single event-loop only! You cannot add it
@@ -66,12 +68,14 @@
  * access to the whole event loop without any side-effects.
  *
  *
- * The whole eloop library does not use any global data. Therefore, it is fully
- * re-entrant and no synchronization needed. However, a single object is not
- * thread-safe. This means, if you access a single eloop object or registered
- * sources on this eloop object in two different threads, you need to
- * synchronize them. Furthermore, all callbacks are called from the thread that
- * calls ev_eloop_dispatch() or ev_eloop_run().
+ * The eloop library only uses global data for child reapers, see below.
+ * Therefore, it is re-entrant and no synchronization needed. However, a single
+ * object is not thread-safe. This means, if you access a single eloop object or
+ * registered sources on this eloop object in two different threads, you need
+ * to synchronize them. The only exception is ev_eloop_queue_cb(), which may be
+ * called from any thread to run a callback on the thread of the eloop.
+ * Furthermore, all callbacks are called from the thread that calls
+ * ev_eloop_dispatch() or ev_eloop_run().
  * This guarantees that you have full control over the eloop but that you also
  * have to implement additional functionality like thread-affinity yourself
  * (obviously, only if you need it).
@@ -142,6 +146,9 @@
  *   object will automatically reap all pending zombies _after_ your callback
  *   has been called. So if you need to check for them, then check for all of
  *   them in the callback. After you return, they will be gone.
+ *   Child reapers are the exception to the signal restriction: eloops on
+ *   different threads may all register them, whichever catches SIGCHLD reaps
+ *   the children and queues their status to the others.
  *   When adding a signal handler the signal is automatically added to the
  *   currently blocked signals. It is not removed when dropping the
  *   signal-source, though.
@@ -159,39 +166,68 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef BUILD_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#endif
 #include "eloop.h"
 #include "shl_dlist.h"
 #include "shl_hook.h"
 #include "shl_log.h"
 #include "shl_misc.h"
+#include "shl_timer.h"
 
 #define LOG_SUBSYSTEM "eloop"
 
+/* polls per dispatch while edge-triggered sources keep getting ready */
+#define EV_ELOOP_ROUNDS 4
+/* high priority fds dispatched per poll of \hi_efd */
+#define EV_ELOOP_HI_FDS 16
+/* times high priority fds may cut in before other sources per dispatch */
+#define EV_ELOOP_PREEMPT 8
+
 /**
  * ev_eloop:
  * @ref: refcnt of this object
  * @efd: The epoll file descriptor.
+ * @hi_efd: Epoll set of the %EV_PRIO_HIGH fds, itself part of \efd
  * @fd: Event source around \efd so you can nest event loops
  * @cnt: Counter source used for idle events
  * @sig_list: Shared signal sources
  * @idlers: List of idle sources
+ * @idle_armed: true if \idle_fd is readable because of idle sources
+ * @idle_pending: Idle sources were added while dispatching
  * @cur_fds: Current dispatch array of fds
  * @cur_fds_cnt: current length of \cur_fds
  * @cur_fds_size: absolute size of \cur_fds
+ * @fd_num: Number of fds in the epoll set besides \idle_fd
+ * @hi_fds: Dispatch array of \hi_efd
+ * @hi_fds_cnt: current length of \hi_fds
+ * @hi_num: Number of fds in \hi_efd
+ * @preempts: Times \hi_efd was dispatched in between other sources
+ * @stats: Dispatch counters
  * @exit: true if we should exit the main loop
+ * @repoll_list: fds to be dispatched again in the next round, see ev_fd_repoll()
+ * @queued: Lock-free stack of callbacks queued by other threads
+ * @chld_list: link into the global list of eloops with child reapers
+ * @uring: io_uring of the reader sources or NULL
+ * @uring_broken: io_uring cannot be used for reader sources
  *
  * An event loop is an object where you can register event sources. If you then
  * sleep on the event loop, you will be woken up if a single event source is
@@ -200,6 +236,7 @@
 struct ev_eloop {
 	unsigned long ref;
 	int efd;
+	int hi_efd;
 	struct ev_fd *fd;
 	int idle_fd;
 
@@ -210,10 +247,42 @@ struct ev_eloop {
 	struct shl_hook *posts;
 
 	bool dispatching;
+	bool idle_armed;
+	bool idle_pending;
 	struct epoll_event *cur_fds;
 	size_t cur_fds_cnt;
 	size_t cur_fds_size;
+	size_t fd_num;
+	struct epoll_event hi_fds[EV_ELOOP_HI_FDS];
+	size_t hi_fds_cnt;
+	size_t hi_num;
+	unsigned int preempts;
+	struct ev_eloop_stats stats;
 	bool exit;
+	struct shl_dlist repoll_list;
+
+	struct ev_queued *queued;
+	struct shl_dlist chld_list;
+
+	struct ev_uring *uring;
+	bool uring_broken;
+};
+
+/**
+ * ev_queued:
+ * @next: next older entry of the stack
+ * @cb: user callback
+ * @data: user data
+ * @chld: child status queued by a child reaper of another eloop
+ *
+ * A callback queued with ev_eloop_queue_cb(). Child reapers pass \chld as data
+ * so the status is freed with the entry.
+ */
+struct ev_queued {
+	struct ev_queued *next;
+	ev_idle_cb cb;
+	void *data;
+	struct ev_child_data chld;
 };
 
 /**
@@ -225,6 +294,8 @@ struct ev_eloop {
  * @data: the user data
  * @enabled: true if the object is currently enabled
  * @loop: NULL or pointer to eloop if bound
+ * @repoll: link into \repoll_list of @loop
+ * @repoll_mask: events to dispatch again, 0 if not queued
  *
  * File descriptors are the most basic event source. Internally, they are used
  * to implement all other kinds of event sources.
@@ -238,6 +309,8 @@ struct ev_fd {
 
 	bool enabled;
 	struct ev_eloop *loop;
+	struct shl_dlist repoll;
+	int repoll_mask;
 };
 
 /**
@@ -297,6 +370,10 @@ struct ev_signal_shared {
 	struct shl_hook *hook;
 };
 
+#ifdef BUILD_ENABLE_IO_URING
+static void uring_free(struct ev_eloop *loop);
+#endif
+
 /*
  * Shared signals
  * signalfd allows us to conveniently listen for incoming signals. However, if
@@ -313,6 +390,46 @@ struct ev_signal_shared {
  * can use signalfd only.
  */
 
+/* eloops with child reapers, they may be dispatched on different threads */
+static pthread_mutex_t chld_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shl_dlist chld_loops = SHL_DLIST_INIT(chld_loops);
+
+static void queue_entry(struct ev_eloop *loop, struct ev_queued *q);
+
+static void chld_queued(struct ev_eloop *loop, void *unused, void *data)
+{
+	shl_hook_call(loop->chlds, loop, data);
+}
+
+/*
+ * Only one of the signalfds of all eloops reads SIGCHLD and the children are
+ * reaped with it, so pass their status on to the eloops of the other threads.
+ */
+static void queue_child(struct ev_eloop *loop, const struct ev_child_data *d)
+{
+	struct shl_dlist *iter;
+	struct ev_eloop *l;
+	struct ev_queued *q;
+
+	pthread_mutex_lock(&chld_lock);
+	shl_dlist_for_each(iter, &chld_loops) {
+		l = shl_dlist_entry(iter, struct ev_eloop, chld_list);
+		if (l == loop)
+			continue;
+
+		q = malloc(sizeof(*q));
+		if (!q) {
+			log_warning("cannot queue status of child %d", d->pid);
+			continue;
+		}
+		q->cb = chld_queued;
+		q->chld = *d;
+		q->data = &q->chld;
+		queue_entry(l, q);
+	}
+	pthread_mutex_unlock(&chld_lock);
+}
+
 static void sig_child(struct ev_eloop *loop, struct signalfd_siginfo *info, void *data)
 {
 	pid_t pid;
@@ -340,6 +457,7 @@ static void sig_child(struct ev_eloop *loop, struct signalfd_siginfo *info, void
 		d.pid = pid;
 		d.status = status;
 		shl_hook_call(loop->chlds, loop, &d);
+		queue_child(loop, &d);
 	}
 }
 
@@ -351,6 +469,9 @@ static void shared_signal_cb(struct ev_fd *fd, int mask, void *data)
 
 	if (mask & EV_READABLE) {
 		len = read(fd->fd, &info, sizeof(info));
+		/* the signalfd of another thread may have read it first */
+		if (len < 0 && errno == EAGAIN)
+			return;
 		if (len != sizeof(info))
 			log_warn("cannot read signalfd (%d): %m", errno);
 		else
@@ -401,7 +522,9 @@ static int signal_new(struct ev_signal_shared **out, struct ev_eloop *loop, int
 		goto err_hook;
 	}
 
-	ret = ev_eloop_new_fd(loop, &sig->fd, fd, EV_READABLE, shared_signal_cb, sig);
+	/* signals like the VT switch requests must not wait behind other sources */
+	ret = ev_eloop_new_fd(loop, &sig->fd, fd, EV_READABLE | EV_PRIO_HIGH, shared_signal_cb,
+			      sig);
 	if (ret)
 		goto err_sig;
 
@@ -514,6 +637,62 @@ static int write_eventfd(int fd, uint64_t val)
 	return 0;
 }
 
+/* make the next dispatch, or the one of a parent loop, return right away */
+static void eloop_wake(struct ev_eloop *loop)
+{
+	if (!loop->idle_armed && !write_eventfd(loop->idle_fd, 1))
+		loop->idle_armed = true;
+}
+
+/* other threads push to @queued, the eloop takes all entries at once */
+static void queue_entry(struct ev_eloop *loop, struct ev_queued *q)
+{
+	struct ev_queued *head;
+
+	head = __atomic_load_n(&loop->queued, __ATOMIC_RELAXED);
+	do {
+		q->next = head;
+	} while (!__atomic_compare_exchange_n(&loop->queued, &head, q, true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/* the eventfd is still readable unless the stack was empty */
+	if (!head)
+		write_eventfd(loop->idle_fd, 1);
+}
+
+/* call the queued callbacks in the order they were queued */
+static void eloop_queued_run(struct ev_eloop *loop)
+{
+	struct ev_queued *q, *next, *list = NULL;
+
+	q = __atomic_exchange_n(&loop->queued, NULL, __ATOMIC_ACQUIRE);
+	while (q) {
+		next = q->next;
+		q->next = list;
+		list = q;
+		q = next;
+	}
+
+	while (list) {
+		next = list->next;
+		list->cb(loop, NULL, list->data);
+		free(list);
+		list = next;
+	}
+}
+
+/* call the idle sources and make sure the next dispatch finds those left */
+static void eloop_idle_run(struct ev_eloop *loop)
+{
+	shl_hook_call(loop->idlers, loop, NULL);
+	if (shl_hook_num(loop->idlers) > 0 && !loop->idle_armed &&
+	    !write_eventfd(loop->idle_fd, 1))
+		loop->idle_armed = true;
+	/* the eventfd covers sources added meanwhile, too */
+	if (loop->idle_armed)
+		loop->idle_pending = false;
+}
+
 static void eloop_idle_event(struct ev_eloop *loop, unsigned int mask)
 {
 	int ret;
@@ -527,6 +706,7 @@ static void eloop_idle_event(struct ev_eloop *loop, unsigned int mask)
 	if (!(mask & EV_READABLE))
 		return;
 
+	loop->idle_armed = false;
 	ret = read(loop->idle_fd, &val, sizeof(val));
 	if (ret < 0) {
 		if (errno != EAGAIN) {
@@ -540,9 +720,8 @@ static void eloop_idle_event(struct ev_eloop *loop, unsigned int mask)
 		log_warning("read %d bytes instead of 8 on eventfd", ret);
 		goto err_out;
 	} else if (val > 0) {
-		shl_hook_call(loop->idlers, loop, NULL);
-		if (shl_hook_num(loop->idlers) > 0)
-			write_eventfd(loop->idle_fd, 1);
+		eloop_queued_run(loop);
+		eloop_idle_run(loop);
 	}
 
 	return;
@@ -579,6 +758,8 @@ int ev_eloop_new(struct ev_eloop **out)
 	memset(loop, 0, sizeof(*loop));
 	loop->ref = 1;
 	shl_dlist_init(&loop->sig_list);
+	shl_dlist_init(&loop->repoll_list);
+	shl_dlist_init(&loop->chld_list);
 
 	loop->cur_fds_size = 32;
 	loop->cur_fds = malloc(sizeof(struct epoll_event) * loop->cur_fds_size);
@@ -632,10 +813,30 @@ int ev_eloop_new(struct ev_eloop **out)
 		goto err_idle_fd;
 	}
 
+	loop->hi_efd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->hi_efd < 0) {
+		ret = -errno;
+		log_error("cannot create epoll-fd");
+		goto err_idle_fd;
+	}
+
+	memset(&ep, 0, sizeof(ep));
+	ep.events |= EPOLLIN;
+	ep.data.ptr = &loop->hi_efd;
+
+	ret = epoll_ctl(loop->efd, EPOLL_CTL_ADD, loop->hi_efd, &ep);
+	if (ret) {
+		log_warning("cannot add fd %d to epoll set (%d): %m", loop->hi_efd, errno);
+		ret = -EFAULT;
+		goto err_hi_efd;
+	}
+
 	log_debug("new eloop object %p", loop);
 	*out = loop;
 	return 0;
 
+err_hi_efd:
+	close(loop->hi_efd);
 err_idle_fd:
 	close(loop->idle_fd);
 err_fd:
@@ -685,6 +886,7 @@ SHL_EXPORT
 void ev_eloop_unref(struct ev_eloop *loop)
 {
 	struct ev_signal_shared *sig;
+	struct ev_queued *q, *next;
 	int ret;
 
 	if (!loop)
@@ -699,14 +901,35 @@ void ev_eloop_unref(struct ev_eloop *loop)
 
 	log_debug("free eloop object %p", loop);
 
-	if (shl_hook_num(loop->chlds))
+	if (shl_hook_num(loop->chlds)) {
+		pthread_mutex_lock(&chld_lock);
+		shl_dlist_unlink(&loop->chld_list);
+		pthread_mutex_unlock(&chld_lock);
 		ev_eloop_unregister_signal_cb(loop, SIGCHLD, sig_child, loop);
+	}
+
+	/* callbacks queued after the last dispatch are dropped */
+	q = __atomic_exchange_n(&loop->queued, NULL, __ATOMIC_ACQUIRE);
+	for (; q; q = next) {
+		next = q->next;
+		free(q);
+	}
 
 	while (loop->sig_list.next != &loop->sig_list) {
 		sig = shl_dlist_entry(loop->sig_list.next, struct ev_signal_shared, list);
 		signal_free(sig);
 	}
 
+#ifdef BUILD_ENABLE_IO_URING
+	if (loop->uring)
+		uring_free(loop);
+#endif
+
+	ret = epoll_ctl(loop->efd, EPOLL_CTL_DEL, loop->hi_efd, NULL);
+	if (ret)
+		log_warning("cannot remove fd %d from epollset (%d): %m", loop->hi_efd, errno);
+	close(loop->hi_efd);
+
 	ret = epoll_ctl(loop->efd, EPOLL_CTL_DEL, loop->idle_fd, NULL);
 	if (ret)
 		log_warning("cannot remove fd %d from epollset (%d): %m", loop->idle_fd, errno);
@@ -722,6 +945,64 @@ void ev_eloop_unref(struct ev_eloop *loop)
 	free(loop);
 }
 
+/* drop pending events of @fd from the dispatch arrays */
+static void forget_fd(struct ev_eloop *loop, struct ev_fd *fd)
+{
+	size_t i;
+
+	for (i = 0; i < loop->cur_fds_cnt; ++i) {
+		if (loop->cur_fds[i].data.ptr == fd)
+			loop->cur_fds[i].data.ptr = NULL;
+	}
+	for (i = 0; i < loop->hi_fds_cnt; ++i) {
+		if (loop->hi_fds[i].data.ptr == fd)
+			loop->hi_fds[i].data.ptr = NULL;
+	}
+}
+
+static void fd_repoll_cancel(struct ev_fd *fd)
+{
+	if (!fd->repoll_mask)
+		return;
+
+	shl_dlist_unlink(&fd->repoll);
+	fd->repoll_mask = 0;
+}
+
+/* take the fds queued by ev_fd_repoll() so far, returns false if none */
+static bool take_repoll(struct ev_eloop *loop, struct shl_dlist *list)
+{
+	shl_dlist_init(list);
+	if (shl_dlist_empty(&loop->repoll_list))
+		return false;
+
+	shl_dlist_link(&loop->repoll_list, list);
+	shl_dlist_unlink(&loop->repoll_list);
+	shl_dlist_init(&loop->repoll_list);
+	return true;
+}
+
+/*
+ * Dispatch the fds taken from the queue before this round. Those queued
+ * meanwhile wait for the next round. Those that epoll reported in this round
+ * were dispatched already and are off the list.
+ */
+static void dispatch_repoll(struct ev_eloop *loop, struct shl_dlist *list)
+{
+	struct ev_fd *fd;
+	int mask;
+
+	while (!shl_dlist_empty(list)) {
+		fd = shl_dlist_first(list, struct ev_fd, repoll);
+		mask = fd->repoll_mask;
+		fd_repoll_cancel(fd);
+
+		++loop->stats.repolls;
+		if (fd->cb)
+			fd->cb(fd, mask, fd->data);
+	}
+}
+
 /**
  * ev_eloop_flush_fd:
  * @loop: The event loop where @fd is registered
@@ -733,15 +1014,10 @@ void ev_eloop_unref(struct ev_eloop *loop)
 SHL_EXPORT
 void ev_eloop_flush_fd(struct ev_eloop *loop, struct ev_fd *fd)
 {
-	int i;
-
 	if (!loop || !fd || !loop->dispatching)
 		return;
 
-	for (i = 0; i < loop->cur_fds_cnt; ++i) {
-		if (loop->cur_fds[i].data.ptr == fd)
-			loop->cur_fds[i].data.ptr = NULL;
-	}
+	forget_fd(loop, fd);
 }
 
 static unsigned int convert_mask(uint32_t mask)
@@ -760,6 +1036,119 @@ static unsigned int convert_mask(uint32_t mask)
 	return res;
 }
 
+/* size the dispatch array so a single poll returns every ready fd */
+static void grow_fds(struct ev_eloop *loop)
+{
+	struct epoll_event *ep;
+	size_t size = loop->cur_fds_size;
+
+	while (size < loop->fd_num + 1)
+		size *= 2;
+	if (size == loop->cur_fds_size)
+		return;
+
+	ep = realloc(loop->cur_fds, sizeof(struct epoll_event) * size);
+	if (!ep) {
+		log_warning("cannot reallocate dispatch cache to size %zu", size);
+		return;
+	}
+
+	loop->cur_fds = ep;
+	loop->cur_fds_size = size;
+}
+
+/*
+ * Dispatch the ready fds of \hi_efd. Returns the number of ready fds and sets
+ * @et if one of them is edge-triggered.
+ */
+static int dispatch_high(struct ev_eloop *loop, bool *et)
+{
+	struct ev_fd *fd;
+	unsigned int mask;
+	int i, count;
+
+	count = epoll_wait(loop->hi_efd, loop->hi_fds, EV_ELOOP_HI_FDS, 0);
+	if (count <= 0)
+		return 0;
+
+	loop->hi_fds_cnt = count;
+	for (i = 0; i < count; ++i) {
+		fd = loop->hi_fds[i].data.ptr;
+		if (!fd || !fd->cb || !fd->enabled)
+			continue;
+
+		if (fd->mask & EV_ET)
+			*et = true;
+		mask = convert_mask(loop->hi_fds[i].events) | fd->repoll_mask;
+		fd_repoll_cancel(fd);
+		fd->cb(fd, mask, fd->data);
+	}
+	loop->hi_fds_cnt = 0;
+
+	return count;
+}
+
+/*
+ * Let high priority fds that got ready meanwhile cut in. This is limited per
+ * dispatch so a busy input device cannot starve the other sources.
+ */
+static void preempt(struct ev_eloop *loop, bool *et)
+{
+	if (!loop->hi_num || loop->preempts >= EV_ELOOP_PREEMPT)
+		return;
+
+	if (dispatch_high(loop, et)) {
+		++loop->preempts;
+		++loop->stats.preempted;
+	}
+}
+
+/*
+ * Dispatch the @count ready fds in \cur_fds, high priority first. Returns true
+ * if one of them is edge-triggered, as it may be ready again right away.
+ */
+static bool dispatch_fds(struct ev_eloop *loop, int count)
+{
+	struct epoll_event *ep = loop->cur_fds;
+	struct ev_fd *fd;
+	unsigned int prio, mask;
+	bool et = false;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (ep[i].data.ptr == &loop->hi_efd)
+			dispatch_high(loop, &et);
+	}
+
+	for (prio = 0; prio < 2; ++prio) {
+		for (i = 0; i < count; ++i) {
+			if (ep[i].data.ptr == &loop->hi_efd)
+				continue;
+
+			if (ep[i].data.ptr == loop) {
+				if (!prio) {
+					mask = convert_mask(ep[i].events);
+					eloop_idle_event(loop, mask);
+				}
+				continue;
+			}
+
+			fd = ep[i].data.ptr;
+			if (!fd || !fd->cb || !fd->enabled || !!(fd->mask & EV_PRIO_LOW) != prio)
+				continue;
+
+			if (fd->mask & EV_ET)
+				et = true;
+			mask = convert_mask(ep[i].events) | fd->repoll_mask;
+			fd_repoll_cancel(fd);
+			fd->cb(fd, mask, fd->data);
+			preempt(loop, &et);
+		}
+	}
+
+	return et;
+}
+
 /**
  * ev_eloop_dispatch:
  * @loop: Event loop to be dispatched
@@ -773,6 +1162,13 @@ static unsigned int convert_mask(uint32_t mask)
  * This performs only a single dispatch round. That is, if all sources where
  * checked for events and there are no more pending events, this will return. If
  * it handled events and the timeout has not elapsed, this will still return.
+ * Ready sources are dispatched by priority, see %EV_PRIO_HIGH. High priority
+ * sources that get ready while others are dispatched are handled right after
+ * the current callback, a limited number of times per round. If edge-triggered
+ * sources were among them, the round polls again without waiting a few times,
+ * so sources that became ready meanwhile are handled in the same round. So do
+ * sources queued with ev_fd_repoll(). Idle sources added during the round run at
+ * its end.
  *
  * If ev_eloop_exit() was called on @loop, then this will return immediately.
  *
@@ -781,9 +1177,11 @@ static unsigned int convert_mask(uint32_t mask)
 SHL_EXPORT
 int ev_eloop_dispatch(struct ev_eloop *loop, int timeout)
 {
-	struct epoll_event *ep;
-	struct ev_fd *fd;
-	int i, count, mask, ret;
+	uint64_t start, latency;
+	unsigned int round;
+	int count, ret;
+	struct shl_dlist repoll_list;
+	bool et, repoll;
 
 	if (!loop)
 		return -EINVAL;
@@ -797,55 +1195,68 @@ int ev_eloop_dispatch(struct ev_eloop *loop, int timeout)
 	}
 
 	loop->dispatching = true;
+	loop->preempts = 0;
 
 	shl_hook_call(loop->pres, loop, NULL);
+	grow_fds(loop);
+
+	for (round = 0; round < EV_ELOOP_ROUNDS; ++round) {
+		count = epoll_wait(loop->efd, loop->cur_fds, loop->cur_fds_size,
+				   (round || !shl_dlist_empty(&loop->repoll_list)) ? 0 : timeout);
+		if (count < 0) {
+			if (errno == EINTR) {
+				if (!round)
+					++loop->stats.empty_wakeups;
+				ret = 0;
+				goto out_dispatch;
+			} else {
+				log_warn("epoll_wait dispatching failed: %m");
+				ret = -errno;
+				goto out_dispatch;
+			}
+		} else if (count > loop->cur_fds_size) {
+			count = loop->cur_fds_size;
+		}
 
-	count = epoll_wait(loop->efd, loop->cur_fds, loop->cur_fds_size, timeout);
-	if (count < 0) {
-		if (errno == EINTR) {
-			ret = 0;
-			goto out_dispatch;
-		} else {
-			log_warn("epoll_wait dispatching failed: %m");
-			ret = -errno;
-			goto out_dispatch;
+		repoll = take_repoll(loop, &repoll_list);
+		if (!count && !repoll) {
+			if (!round)
+				++loop->stats.empty_wakeups;
+			break;
 		}
-	} else if (count > loop->cur_fds_size) {
-		count = loop->cur_fds_size;
-	}
 
-	ep = loop->cur_fds;
-	loop->cur_fds_cnt = count;
+		start = shl_timer_now();
+		if (round)
+			++loop->stats.extra_rounds;
+		else
+			++loop->stats.wakeups;
+		loop->stats.events += count;
 
-	for (i = 0; i < count; ++i) {
-		if (ep[i].data.ptr == loop) {
-			mask = convert_mask(ep[i].events);
-			eloop_idle_event(loop, mask);
-		} else {
-			fd = ep[i].data.ptr;
-			if (!fd || !fd->cb || !fd->enabled)
-				continue;
+		loop->cur_fds_cnt = count;
+		et = dispatch_fds(loop, count);
+		loop->cur_fds_cnt = 0;
+		if (repoll)
+			dispatch_repoll(loop, &repoll_list);
 
-			mask = convert_mask(ep[i].events);
-			fd->cb(fd, mask, fd->data);
-		}
-	}
+		latency = shl_timer_now() - start;
+		loop->stats.latency_sum += latency;
+		if (latency > loop->stats.latency_max)
+			loop->stats.latency_max = latency;
 
-	if (count == loop->cur_fds_size) {
-		ep = realloc(loop->cur_fds, sizeof(struct epoll_event) * loop->cur_fds_size * 2);
-		if (!ep) {
-			log_warning("cannot reallocate dispatch cache to size %zu",
-				    loop->cur_fds_size * 2);
-		} else {
-			loop->cur_fds = ep;
-			loop->cur_fds_size *= 2;
-		}
+		if (!et && shl_dlist_empty(&loop->repoll_list))
+			break;
 	}
 
 	ret = 0;
 
 out_dispatch:
+	if (loop->idle_pending) {
+		++loop->stats.idle_coalesced;
+		eloop_idle_run(loop);
+	}
 	shl_hook_call(loop->posts, loop, NULL);
+	if (!shl_dlist_empty(&loop->repoll_list))
+		eloop_wake(loop);
 	loop->dispatching = false;
 	return ret;
 }
@@ -945,6 +1356,45 @@ int ev_eloop_get_fd(struct ev_eloop *loop)
 	return loop->efd;
 }
 
+/**
+ * ev_eloop_get_stats:
+ * @loop: Event loop
+ * @out: Storage for the counters
+ *
+ * Copies the dispatch counters of @loop to @out.
+ */
+SHL_EXPORT
+void ev_eloop_get_stats(struct ev_eloop *loop, struct ev_eloop_stats *out)
+{
+	if (!loop || !out)
+		return;
+
+	*out = loop->stats;
+}
+
+/**
+ * ev_eloop_high_pending:
+ * @loop: Event loop
+ *
+ * Long running callbacks can use this to return early when a source with
+ * %EV_PRIO_HIGH is waiting to be dispatched.
+ *
+ * Returns: true if a high priority source of @loop is ready, false otherwise.
+ */
+SHL_EXPORT
+bool ev_eloop_high_pending(struct ev_eloop *loop)
+{
+	struct pollfd pfd;
+
+	if (!loop || !loop->hi_num)
+		return false;
+
+	pfd.fd = loop->hi_efd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0;
+}
+
 /**
  * ev_eloop_new_eloop:
  * @loop: The parent event-loop where the new event loop is registered
@@ -1121,6 +1571,12 @@ void ev_fd_unref(struct ev_fd *fd)
 	free(fd);
 }
 
+/* high priority fds live in their own epoll set */
+static int fd_efd(const struct ev_fd *fd)
+{
+	return (fd->mask & EV_PRIO_HIGH) ? fd->loop->hi_efd : fd->loop->efd;
+}
+
 static int fd_epoll_add(struct ev_fd *fd)
 {
 	struct epoll_event ep;
@@ -1138,12 +1594,15 @@ static int fd_epoll_add(struct ev_fd *fd)
 		ep.events |= EPOLLET;
 	ep.data.ptr = fd;
 
-	ret = epoll_ctl(fd->loop->efd, EPOLL_CTL_ADD, fd->fd, &ep);
+	ret = epoll_ctl(fd_efd(fd), EPOLL_CTL_ADD, fd->fd, &ep);
 	if (ret) {
 		log_warning("cannot add fd %d to epoll set (%d): %m", fd->fd, errno);
 		return -EFAULT;
 	}
 
+	++fd->loop->fd_num;
+	if (fd->mask & EV_PRIO_HIGH)
+		++fd->loop->hi_num;
 	return 0;
 }
 
@@ -1154,9 +1613,13 @@ static void fd_epoll_remove(struct ev_fd *fd)
 	if (!fd->loop)
 		return;
 
-	ret = epoll_ctl(fd->loop->efd, EPOLL_CTL_DEL, fd->fd, NULL);
+	ret = epoll_ctl(fd_efd(fd), EPOLL_CTL_DEL, fd->fd, NULL);
 	if (ret && errno != EBADF)
 		log_warning("cannot remove fd %d from epoll set (%d): %m", fd->fd, errno);
+	if (fd->loop->fd_num)
+		--fd->loop->fd_num;
+	if ((fd->mask & EV_PRIO_HIGH) && fd->loop->hi_num)
+		--fd->loop->hi_num;
 }
 
 static int fd_epoll_update(struct ev_fd *fd)
@@ -1176,7 +1639,7 @@ static int fd_epoll_update(struct ev_fd *fd)
 		ep.events |= EPOLLET;
 	ep.data.ptr = fd;
 
-	ret = epoll_ctl(fd->loop->efd, EPOLL_CTL_MOD, fd->fd, &ep);
+	ret = epoll_ctl(fd_efd(fd), EPOLL_CTL_MOD, fd->fd, &ep);
 	if (ret) {
 		log_warning("cannot update epoll fd %d (%d): %m", fd->fd, errno);
 		return -EFAULT;
@@ -1227,6 +1690,7 @@ void ev_fd_disable(struct ev_fd *fd)
 
 	fd->enabled = false;
 	fd_epoll_remove(fd);
+	fd_repoll_cancel(fd);
 }
 
 /**
@@ -1303,6 +1767,19 @@ int ev_fd_update(struct ev_fd *fd, int mask)
 	if (!fd->enabled)
 		return 0;
 
+	/* changing %EV_PRIO_HIGH moves @fd to the other epoll set */
+	if ((omask ^ mask) & EV_PRIO_HIGH && fd->loop) {
+		fd->mask = omask;
+		fd_epoll_remove(fd);
+		fd->mask = mask;
+		ret = fd_epoll_add(fd);
+		if (ret) {
+			fd->mask = omask;
+			fd_epoll_add(fd);
+		}
+		return ret;
+	}
+
 	ret = fd_epoll_update(fd);
 	if (ret) {
 		fd->mask = omask;
@@ -1312,6 +1789,39 @@ int ev_fd_update(struct ev_fd *fd, int mask)
 	return 0;
 }
 
+/**
+ * ev_fd_repoll:
+ * @fd: FD object
+ * @mask: Bitmask of %EV_READABLE and %EV_WRITEABLE
+ *
+ * This dispatches @fd with @mask again after the current poll, as if the events
+ * were reported once more. That happens in the current ev_eloop_dispatch() if
+ * it polls again, otherwise in the next one, which doesn't wait then. It is
+ * meant for %EV_ET fds that stop handling an event before the fd is drained,
+ * say to give other sources a turn, and saves the syscall of re-arming them
+ * with ev_fd_update(). Queuing @fd again before that adds @mask to the pending
+ * events. Nothing is dispatched if @fd gets disabled or removed meanwhile.
+ *
+ * Returns: 0 on success, otherwise negative error code
+ */
+SHL_EXPORT
+int ev_fd_repoll(struct ev_fd *fd, int mask)
+{
+	if (!fd || !mask)
+		return -EINVAL;
+	if (!fd->loop || !fd->enabled)
+		return -EINVAL;
+
+	if (!fd->repoll_mask)
+		shl_dlist_link_tail(&fd->loop->repoll_list, &fd->repoll);
+	fd->repoll_mask |= mask;
+
+	if (!fd->loop->dispatching)
+		eloop_wake(fd->loop);
+
+	return 0;
+}
+
 /**
  * ev_eloop_new_fd:
  * @loop: Event loop
@@ -1402,7 +1912,6 @@ SHL_EXPORT
 void ev_eloop_rm_fd(struct ev_fd *fd)
 {
 	struct ev_eloop *loop;
-	size_t i;
 
 	if (!fd || !fd->loop)
 		return;
@@ -1410,17 +1919,14 @@ void ev_eloop_rm_fd(struct ev_fd *fd)
 	loop = fd->loop;
 	if (fd->enabled)
 		fd_epoll_remove(fd);
+	fd_repoll_cancel(fd);
 
 	/*
 	 * If we are currently dispatching events, we need to remove ourself
-	 * from the temporary event list.
+	 * from the temporary event lists.
 	 */
-	if (loop->dispatching) {
-		for (i = 0; i < loop->cur_fds_cnt; ++i) {
-			if (fd == loop->cur_fds[i].data.ptr)
-				loop->cur_fds[i].data.ptr = NULL;
-		}
-	}
+	if (loop->dispatching)
+		forget_fd(loop, fd);
 
 	fd->loop = NULL;
 	ev_fd_unref(fd);
@@ -1428,31 +1934,746 @@ void ev_eloop_rm_fd(struct ev_fd *fd)
 }
 
 /*
- * Timer sources
- * Timer sources allow delaying a specific event by an relative timeout. The
- * timeout can be set to trigger after a specific time. Optionally, you can
- * also make the timeout trigger every next time the timeout elapses so you
- * basically get a pulse that reliably calls the callback.
- * The callback gets as parameter the number of timeouts that elapsed since it
- * was last called (in case the application couldn't call the callback fast
- * enough). The timeout can be specified with nano-seconds precision. However,
- * real precision depends on the operating-system and hardware.
- */
+ * Reader sources
+ * A reader is an fd source that also reads the fd. Its callback gets the data
+ * instead of a readiness mask. By default, this is an edge-triggered fd source
+ * on a duplicate of the fd that reads until EAGAIN.
+ * With io_uring, every reader keeps a multishot read in flight instead. The
+ * kernel picks one of the reader's provided buffers for every chunk and posts
+ * it to a completion queue that is shared by all readers of the loop. So a busy
+ * fd costs neither a read() per chunk nor the final read() that returns
+ * EAGAIN. The ring is a level-triggered source of the loop and lives as long
+ * as readers do. Like the idle fd, it does not hold a reference on the loop.
+ * The fd source is kept while a read is in flight, it notices when the fd gets
+ * readable again after the read ended on EOF or an error.
+ * If the kernel doesn't support multishot reads, we stay with read().
+ *
+ * The callback may call ev_reader_yield() to stop delivering data for this
+ * dispatch round. The rest is delivered in the next round.
+ */
+
+/* provided buffers per reader, a power of two */
+#define EV_READER_BUFS 8
+#define EV_URING_ENTRIES 16
+
+/**
+ * ev_reader:
+ * @loop: the event loop this reader is bound to
+ * @fd: duplicate of the watched file descriptor
+ * @efd: fd-source for @fd
+ * @cb: user callback
+ * @data: user data
+ * @buf: read buffers, %EV_READER_BUFS of @size bytes with io_uring
+ * @size: size of a read buffer
+ * @yield: the callback asked to stop for this round
+ * @in_cb: the callback is running
+ * @dead: removed by the user, freed once no read is in flight
+ * @uring: reads are done by io_uring
+ * @armed: a multishot read is in flight
+ * @edge: @fd got readable while @armed
+ * @bgid: id of the provided buffer group
+ * @br: provided buffer ring
+ */
+struct ev_reader {
+	struct ev_eloop *loop;
+	int fd;
+	struct ev_fd *efd;
+	ev_reader_cb cb;
+	void *data;
 
-static int timer_drain(struct ev_timer *timer, uint64_t *out)
+	char *buf;
+	size_t size;
+	bool yield;
+	bool in_cb;
+	bool dead;
+
+	bool uring;
+	bool armed;
+	bool edge;
+	unsigned short bgid;
+	void *br;
+};
+
+static void reader_free(struct ev_reader *rd);
+
+/* call the user callback; returns true if @rd must not be used anymore */
+static bool reader_call(struct ev_reader *rd, const char *buf, ssize_t len)
 {
-	int len;
-	uint64_t expirations;
+	rd->yield = false;
+	rd->in_cb = true;
+	rd->cb(rd, buf, len, rd->data);
+	rd->in_cb = false;
 
-	if (out)
-		*out = 0;
+	if (rd->dead && !rd->armed) {
+		reader_free(rd);
+		return true;
+	}
 
-	len = read(timer->fd, &expirations, sizeof(expirations));
-	if (len < 0) {
-		if (errno == EAGAIN) {
-			return 0;
-		} else {
-			log_warning("cannot read timerfd (%d): %m", errno);
+	return false;
+}
+
+/* read() until EAGAIN, yield or error */
+static void reader_read(struct ev_reader *rd)
+{
+	ssize_t len;
+
+	do {
+		len = read(rd->fd, rd->buf, rd->size);
+		if (len < 0 && errno == EAGAIN)
+			return;
+		if (len < 0)
+			len = -errno;
+
+		if (reader_call(rd, len > 0 ? rd->buf : NULL, len))
+			return;
+	} while (len > 0 && !rd->yield);
+
+	/* edge-triggered, so ask for the event again next round */
+	if (rd->yield)
+		ev_fd_repoll(rd->efd, EV_READABLE);
+}
+
+#ifdef BUILD_ENABLE_IO_URING
+
+/**
+ * ev_uring:
+ * @loop: the event loop
+ * @fd: io_uring file descriptor
+ * @efd: fd-source for @fd
+ * @readers: readers with a buffer group, including dead ones
+ * @pending: multishot reads in flight
+ * @reaping: completions are being reaped
+ * @next_bgid: buffer group id for the next reader
+ *
+ * The rest are the mappings of the submission and completion queues.
+ */
+struct ev_uring {
+	struct ev_eloop *loop;
+	int fd;
+	struct ev_fd *efd;
+	unsigned int readers;
+	unsigned int pending;
+	bool reaping;
+	unsigned short next_bgid;
+
+	void *ring;
+	size_t ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int uring_submit(struct ev_uring *u, const struct io_uring_sqe *sqe)
+{
+	unsigned int tail, idx;
+	int ret;
+
+	tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+		return -EBUSY;
+
+	idx = tail & u->sq_mask;
+	u->sqes[idx] = *sqe;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ret = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+	if (ret < 0) {
+		ret = -errno;
+		/* take it back unless the kernel consumed it */
+		if (__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == tail)
+			__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* hand buffer @bid back to the kernel */
+static void reader_recycle(struct ev_reader *rd, unsigned int bid)
+{
+	struct io_uring_buf_ring *br = rd->br;
+	struct io_uring_buf *buf;
+	unsigned short tail = br->tail;
+
+	buf = &br->bufs[tail & (EV_READER_BUFS - 1)];
+	buf->addr = (uintptr_t)(rd->buf + bid * rd->size);
+	buf->len = rd->size;
+	buf->bid = bid;
+	__atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void reader_arm(struct ev_reader *rd)
+{
+	struct ev_uring *u = rd->loop->uring;
+	struct io_uring_sqe sqe;
+	int ret;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ_MULTISHOT;
+	sqe.flags = IOSQE_BUFFER_SELECT;
+	sqe.fd = rd->fd;
+	sqe.off = -1;
+	sqe.buf_group = rd->bgid;
+	sqe.user_data = (uintptr_t)rd;
+
+	ret = uring_submit(u, &sqe);
+	if (ret) {
+		log_warning("cannot submit read on fd %d (%d), using read()", rd->fd, ret);
+		rd->uring = false;
+		reader_read(rd);
+		return;
+	}
+
+	rd->armed = true;
+	rd->edge = false;
+	++u->pending;
+}
+
+/*
+ * Read once after the multishot read ended on EOF or an error, which was
+ * reported already. Re-arm it unless that is still the case. Returns true if
+ * @rd is gone.
+ */
+static bool reader_probe(struct ev_reader *rd)
+{
+	ssize_t len;
+
+	rd->edge = false;
+	len = read(rd->fd, rd->buf, rd->size);
+	if (len < 0 && errno == EAGAIN) {
+		reader_arm(rd);
+		return false;
+	} else if (len <= 0) {
+		return false;
+	}
+
+	if (reader_call(rd, rd->buf, len))
+		return true;
+
+	reader_arm(rd);
+	return false;
+}
+
+static void reader_cancel(struct ev_reader *rd)
+{
+	struct io_uring_sqe sqe;
+	int ret;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = (uintptr_t)rd;
+
+	ret = uring_submit(rd->loop->uring, &sqe);
+	if (ret)
+		log_warning("cannot cancel read on fd %d (%d)", rd->fd, ret);
+}
+
+/*
+ * Handle a completion of the multishot read of @rd. Returns true if reaping
+ * shall stop for this round.
+ */
+static bool reader_complete(struct ev_reader *rd, int res, unsigned int flags)
+{
+	struct ev_uring *u = rd->loop->uring;
+	unsigned int bid;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		rd->armed = false;
+		--u->pending;
+	}
+
+	if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!rd->dead) {
+			rd->in_cb = true;
+			rd->yield = false;
+			rd->cb(rd, rd->buf + bid * rd->size, res, rd->data);
+			rd->in_cb = false;
+		}
+		reader_recycle(rd, bid);
+	} else if (res == -EINVAL || res == -EOPNOTSUPP) {
+		if (!rd->dead) {
+			log_debug("no multishot reads on fd %d, using read()", rd->fd);
+			rd->loop->uring_broken = true;
+			rd->uring = false;
+			reader_read(rd);
+			return false;
+		}
+	} else if (res <= 0 && res != -ENOBUFS && res != -ECANCELED && !rd->dead) {
+		if (reader_call(rd, NULL, res))
+			return false;
+	}
+
+	if (rd->dead) {
+		if (!rd->armed && !rd->in_cb)
+			reader_free(rd);
+		return false;
+	}
+
+	/*
+	 * The read also ends when we run out of buffers or the kernel gives up
+	 * on it for other reasons. After EOF and errors we wait for the fd to
+	 * get readable again. If it did so before we got here, the edge may be
+	 * gone, so look for data once.
+	 */
+	if (!rd->armed) {
+		if (res > 0 || res == -ENOBUFS)
+			reader_arm(rd);
+		else if (rd->edge && reader_probe(rd))
+			return false;
+	}
+
+	return rd->yield;
+}
+
+/* reap completions up to the tail seen on entry */
+static void uring_reap(struct ev_uring *u)
+{
+	struct io_uring_cqe *cqe;
+	struct ev_reader *rd;
+	unsigned int head, tail, flags;
+	int res;
+
+	u->reaping = true;
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &u->cqes[head & u->cq_mask];
+		rd = (void *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+
+		/* cancel requests have no reader */
+		if (rd && reader_complete(rd, res, flags))
+			break;
+	}
+	u->reaping = false;
+}
+
+static void uring_free(struct ev_eloop *loop)
+{
+	struct ev_uring *u = loop->uring;
+	struct ev_fd *fd = u->efd;
+	struct io_uring_sqe sqe;
+	int ret;
+
+	/* only dead readers are left, wait for their reads to end */
+	if (u->pending) {
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_ASYNC_CANCEL;
+		sqe.fd = -1;
+		sqe.cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		uring_submit(u, &sqe);
+	}
+	while (u->pending) {
+		ret = syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR) {
+			log_warning("cannot wait for io_uring (%d): %m", errno);
+			break;
+		}
+		uring_reap(u);
+	}
+
+	/* like ev_eloop_rm_fd() but the ring holds no reference on @loop */
+	fd_epoll_remove(fd);
+	if (loop->dispatching)
+		forget_fd(loop, fd);
+	fd->loop = NULL;
+	ev_fd_unref(fd);
+
+	munmap(u->sqes, u->sqes_len);
+	munmap(u->ring, u->ring_len);
+	close(u->fd);
+	free(u);
+	loop->uring = NULL;
+}
+
+/* free the ring once the last reader is gone */
+static void uring_put(struct ev_eloop *loop)
+{
+	if (loop->uring && !loop->uring->readers && !loop->uring->reaping)
+		uring_free(loop);
+}
+
+static void uring_event(struct ev_fd *fd, int mask, void *data)
+{
+	struct ev_uring *u = data;
+
+	uring_reap(u);
+	uring_put(u->loop);
+}
+
+static int uring_new(struct ev_eloop *loop)
+{
+	struct io_uring_params p;
+	struct ev_uring *u;
+	char *ring;
+	size_t cq_len;
+	int ret;
+
+	u = malloc(sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+	memset(u, 0, sizeof(*u));
+	u->loop = loop;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, EV_URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		ret = -errno;
+		goto err_free;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ret = -EOPNOTSUPP;
+		goto err_close;
+	}
+
+	u->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > u->ring_len)
+		u->ring_len = cq_len;
+
+	u->ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+		       IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		ret = -errno;
+		goto err_close;
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+		       IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto err_ring;
+	}
+
+	ring = u->ring;
+	u->sq_head = (void *)(ring + p.sq_off.head);
+	u->sq_tail = (void *)(ring + p.sq_off.tail);
+	u->sq_array = (void *)(ring + p.sq_off.array);
+	u->sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (void *)(ring + p.cq_off.head);
+	u->cq_tail = (void *)(ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+	u->cqes = (void *)(ring + p.cq_off.cqes);
+
+	ret = ev_fd_new(&u->efd, u->fd, EV_READABLE, uring_event, u);
+	if (ret)
+		goto err_sqes;
+
+	u->efd->loop = loop;
+	ret = fd_epoll_add(u->efd);
+	if (ret)
+		goto err_fd;
+
+	loop->uring = u;
+	return 0;
+
+err_fd:
+	u->efd->loop = NULL;
+	ev_fd_unref(u->efd);
+err_sqes:
+	munmap(u->sqes, u->sqes_len);
+err_ring:
+	munmap(u->ring, u->ring_len);
+err_close:
+	close(u->fd);
+err_free:
+	free(u);
+	return ret;
+}
+
+/* set up io_uring reads for @rd, returns 0 or an error to use read() */
+static int reader_uring_init(struct ev_reader *rd)
+{
+	struct ev_eloop *loop = rd->loop;
+	struct io_uring_buf_reg reg;
+	struct ev_uring *u;
+	unsigned int i;
+	int ret;
+
+	if (loop->uring_broken)
+		return -EOPNOTSUPP;
+
+	if (!loop->uring) {
+		ret = uring_new(loop);
+		if (ret) {
+			log_debug("no io_uring (%d), using read()", ret);
+			loop->uring_broken = true;
+			return ret;
+		}
+	}
+	u = loop->uring;
+
+	rd->buf = malloc(EV_READER_BUFS * rd->size);
+	if (!rd->buf) {
+		ret = -ENOMEM;
+		goto err_put;
+	}
+
+	rd->br = mmap(NULL, EV_READER_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rd->br == MAP_FAILED) {
+		ret = -errno;
+		goto err_buf;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)rd->br;
+	reg.ring_entries = EV_READER_BUFS;
+	reg.bgid = u->next_bgid;
+
+	ret = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (ret < 0) {
+		ret = -errno;
+		log_debug("cannot register buffer ring (%d), using read()", ret);
+		if (ret == -EINVAL)
+			loop->uring_broken = true;
+		goto err_br;
+	}
+
+	rd->bgid = u->next_bgid++;
+	for (i = 0; i < EV_READER_BUFS; ++i)
+		reader_recycle(rd, i);
+
+	rd->uring = true;
+	++u->readers;
+	return 0;
+
+err_br:
+	munmap(rd->br, EV_READER_BUFS * sizeof(struct io_uring_buf));
+	rd->br = NULL;
+err_buf:
+	free(rd->buf);
+	rd->buf = NULL;
+err_put:
+	uring_put(loop);
+	return ret;
+}
+
+static void reader_uring_deinit(struct ev_reader *rd)
+{
+	struct ev_uring *u = rd->loop->uring;
+	struct io_uring_buf_reg reg;
+
+	if (!rd->br)
+		return;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = rd->bgid;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1) < 0)
+		log_warning("cannot unregister buffer ring (%d): %m", errno);
+
+	munmap(rd->br, EV_READER_BUFS * sizeof(struct io_uring_buf));
+	rd->br = NULL;
+	--u->readers;
+}
+
+#else /* !BUILD_ENABLE_IO_URING */
+
+static bool reader_probe(struct ev_reader *rd)
+{
+	return false;
+}
+
+static void reader_arm(struct ev_reader *rd)
+{
+}
+
+static void reader_cancel(struct ev_reader *rd)
+{
+}
+
+static void uring_put(struct ev_eloop *loop)
+{
+}
+
+static int reader_uring_init(struct ev_reader *rd)
+{
+	return -EOPNOTSUPP;
+}
+
+static void reader_uring_deinit(struct ev_reader *rd)
+{
+}
+
+#endif /* BUILD_ENABLE_IO_URING */
+
+static void reader_free(struct ev_reader *rd)
+{
+	struct ev_eloop *loop = rd->loop;
+
+	reader_uring_deinit(rd);
+	free(rd->buf);
+	free(rd);
+	uring_put(loop);
+}
+
+static void reader_event(struct ev_fd *fd, int mask, void *data)
+{
+	struct ev_reader *rd = data;
+
+	if (!rd->uring)
+		reader_read(rd);
+	else if (rd->armed)
+		rd->edge = true;
+	else
+		reader_probe(rd);
+}
+
+/**
+ * ev_eloop_new_reader:
+ * @loop: Event loop
+ * @out: Storage for result
+ * @fd: File descriptor to read from, must be non-blocking
+ * @size: Maximum number of bytes passed to a single callback
+ * @cb: User callback
+ * @data: User data
+ *
+ * This creates a new reader on @fd and registers it in @loop. Whenever data
+ * can be read from @fd, it is read and passed to @cb. End-of-file and read
+ * errors are passed to @cb, too, and the reader waits until @fd gets readable
+ * again. @fd is duplicated so it can still be watched by other sources.
+ * Use ev_eloop_rm_reader() to destroy the reader.
+ *
+ * Returns: 0 on success, otherwise negative error code
+ */
+SHL_EXPORT
+int ev_eloop_new_reader(struct ev_eloop *loop, struct ev_reader **out, int fd, size_t size,
+			ev_reader_cb cb, void *data)
+{
+	struct ev_reader *rd;
+	int ret;
+
+	if (!loop || !out || fd < 0 || !size || !cb)
+		return -EINVAL;
+
+	rd = malloc(sizeof(*rd));
+	if (!rd)
+		return -ENOMEM;
+	memset(rd, 0, sizeof(*rd));
+	rd->loop = loop;
+	rd->size = size;
+	rd->cb = cb;
+	rd->data = data;
+
+	rd->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (rd->fd < 0) {
+		log_error("cannot duplicate fd %d (%d): %m", fd, errno);
+		ret = -EFAULT;
+		goto err_free;
+	}
+
+	if (reader_uring_init(rd)) {
+		rd->buf = malloc(size);
+		if (!rd->buf) {
+			ret = -ENOMEM;
+			goto err_close;
+		}
+	}
+
+	ret = ev_eloop_new_fd(loop, &rd->efd, rd->fd, EV_READABLE | EV_ET, reader_event, rd);
+	if (ret)
+		goto err_buf;
+
+	if (rd->uring)
+		reader_arm(rd);
+
+	*out = rd;
+	return 0;
+
+err_buf:
+	reader_uring_deinit(rd);
+	free(rd->buf);
+err_close:
+	close(rd->fd);
+err_free:
+	free(rd);
+	uring_put(loop);
+	return ret;
+}
+
+/**
+ * ev_eloop_rm_reader:
+ * @rd: Reader object
+ *
+ * This removes @rd from its event loop and destroys it. The callback is not
+ * called anymore. It is safe to call this in any callback.
+ */
+SHL_EXPORT
+void ev_eloop_rm_reader(struct ev_reader *rd)
+{
+	if (!rd || rd->dead)
+		return;
+
+	rd->dead = true;
+	ev_eloop_rm_fd(rd->efd);
+	rd->efd = NULL;
+	close(rd->fd);
+
+	/* a read in flight still owns the buffers, free @rd once it ended */
+	if (rd->armed)
+		reader_cancel(rd);
+	if (!rd->armed && !rd->in_cb)
+		reader_free(rd);
+}
+
+/**
+ * ev_reader_yield:
+ * @rd: Reader object
+ *
+ * Call this from the callback of @rd to stop reading for this dispatch round.
+ * The remaining data is delivered in the next round.
+ */
+SHL_EXPORT
+void ev_reader_yield(struct ev_reader *rd)
+{
+	if (!rd)
+		return;
+
+	rd->yield = true;
+}
+
+/*
+ * Timer sources
+ * Timer sources allow delaying a specific event by an relative timeout. The
+ * timeout can be set to trigger after a specific time. Optionally, you can
+ * also make the timeout trigger every next time the timeout elapses so you
+ * basically get a pulse that reliably calls the callback.
+ * The callback gets as parameter the number of timeouts that elapsed since it
+ * was last called (in case the application couldn't call the callback fast
+ * enough). The timeout can be specified with nano-seconds precision. However,
+ * real precision depends on the operating-system and hardware.
+ */
+
+static int timer_drain(struct ev_timer *timer, uint64_t *out)
+{
+	int len;
+	uint64_t expirations;
+
+	if (out)
+		*out = 0;
+
+	len = read(timer->fd, &expirations, sizeof(expirations));
+	if (len < 0) {
+		if (errno == EAGAIN) {
+			return 0;
+		} else {
+			log_warning("cannot read timerfd (%d): %m", errno);
 			return errno;
 		}
 	} else if (len == 0) {
@@ -1708,6 +2929,25 @@ int ev_timer_update(struct ev_timer *timer, const struct itimerspec *spec)
 	return 0;
 }
 
+/**
+ * ev_timer_set_prio:
+ * @timer: Timer object
+ * @prio: %EV_PRIO_HIGH, %EV_PRIO_LOW or 0
+ *
+ * This changes the dispatch priority of @timer, see %EV_PRIO_HIGH. Timers are
+ * created with the default priority.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+SHL_EXPORT
+int ev_timer_set_prio(struct ev_timer *timer, int prio)
+{
+	if (!timer || (prio & ~(EV_PRIO_HIGH | EV_PRIO_LOW)))
+		return -EINVAL;
+
+	return ev_fd_update(timer->efd, EV_READABLE | prio);
+}
+
 /**
  * ev_timer_drain:
  * @timer: valid timer object
@@ -2250,6 +3490,10 @@ int ev_eloop_register_child_cb(struct ev_eloop *loop, ev_child_cb cb, void *data
 			shl_hook_rm_cast(loop->chlds, cb, data);
 			return ret;
 		}
+
+		pthread_mutex_lock(&chld_lock);
+		shl_dlist_link(&chld_loops, &loop->chld_list);
+		pthread_mutex_unlock(&chld_lock);
 	}
 
 	return 0;
@@ -2262,8 +3506,52 @@ void ev_eloop_unregister_child_cb(struct ev_eloop *loop, ev_child_cb cb, void *d
 		return;
 
 	shl_hook_rm_cast(loop->chlds, cb, data);
-	if (!shl_hook_num(loop->chlds))
+	if (!shl_hook_num(loop->chlds)) {
+		pthread_mutex_lock(&chld_lock);
+		shl_dlist_unlink(&loop->chld_list);
+		pthread_mutex_unlock(&chld_lock);
 		ev_eloop_unregister_signal_cb(loop, SIGCHLD, sig_child, loop);
+	}
+}
+
+/*
+ * Queued callbacks
+ * Other threads cannot touch an eloop, but they can queue callbacks that are
+ * called by its next dispatch. The entries are pushed onto a lock-free stack
+ * and the idle eventfd wakes the eloop up, so a thread never waits for the
+ * one dispatching the eloop.
+ */
+
+/**
+ * ev_eloop_queue_cb:
+ * @loop: event loop
+ * @cb: user-supplied callback
+ * @data: user-supplied data
+ *
+ * Queues @cb to be called with @data by the next dispatch of @loop, on the
+ * thread that dispatches it. Unlike all other functions, this may be called
+ * from any thread, but the caller must make sure @loop is not destroyed
+ * meanwhile. Callbacks are called in the order they were queued. If @loop is
+ * destroyed before, they are dropped.
+ *
+ * Returns: 0 on success, otherwise negative error code
+ */
+SHL_EXPORT
+int ev_eloop_queue_cb(struct ev_eloop *loop, ev_idle_cb cb, void *data)
+{
+	struct ev_queued *q;
+
+	if (!loop || !cb)
+		return -EINVAL;
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+
+	q->cb = cb;
+	q->data = data;
+	queue_entry(loop, q);
+	return 0;
 }
 
 /*
@@ -2303,12 +3591,21 @@ int ev_eloop_register_idle_cb(struct ev_eloop *eloop, ev_idle_cb cb, void *data,
 	if (ret)
 		return ret;
 
+	/* while dispatching, idle sources run at the end of the round */
+	if (eloop->idle_armed)
+		return 0;
+	if (eloop->dispatching) {
+		eloop->idle_pending = true;
+		return 0;
+	}
+
 	ret = write_eventfd(eloop->idle_fd, 1);
 	if (ret) {
 		log_warning("cannot increase eloop idle-counter");
 		shl_hook_rm_cast(eloop->idlers, cb, data);
 		return ret;
 	}
+	eloop->idle_armed = true;
 
 	return 0;
 }
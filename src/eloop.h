@@ -44,6 +44,7 @@
 
 struct ev_eloop;
 struct ev_fd;
+struct ev_reader;
 struct ev_timer;
 struct ev_counter;
 
@@ -57,6 +58,18 @@ struct ev_counter;
  */
 typedef void (*ev_fd_cb)(struct ev_fd *fd, int mask, void *data);
 
+/**
+ * ev_reader_cb:
+ * @rd: Reader source
+ * @buf: Data that was read or NULL
+ * @len: Number of bytes in @buf, 0 on end-of-file or a negative error code
+ * @data: user-supplied data
+ *
+ * This is the callback-type for reader event sources. @buf is only valid during
+ * the callback.
+ */
+typedef void (*ev_reader_cb)(struct ev_reader *rd, const char *buf, ssize_t len, void *data);
+
 /**
  * ev_timer_cb:
  * @timer: Timer source
@@ -131,12 +144,17 @@ typedef void (*ev_idle_cb)(struct ev_eloop *eloop, void *unused, void *data);
  * @EV_HUP: Hang-up on file-descriptor
  * @EV_ERR: I/O error on file-descriptor
  * @EV_ET: Edge-triggered mode
+ * @EV_PRIO_HIGH: Dispatch before other sources
+ * @EV_PRIO_LOW: Dispatch after other sources
  *
  * These flags are used for events on file-descriptors. You can combine them
  * with binary-operators like @EV_READABLE | @EV_WRITEABLE.
  * @EV_HUP and @EV_ERR are always raised for file-descriptors, even if not
  * requested explicitly.
  * @EV_ET enables edge-triggered mode for the operation
+ * Of the sources that are ready at the same time, those with @EV_PRIO_HIGH are
+ * dispatched first and those with @EV_PRIO_LOW last. @EV_PRIO_HIGH sources that
+ * get ready while others are dispatched may also cut in between them.
  */
 enum ev_eloop_flags {
 	EV_READABLE = 0x01,
@@ -144,6 +162,35 @@ enum ev_eloop_flags {
 	EV_HUP = 0x04,
 	EV_ERR = 0x08,
 	EV_ET = 0x10,
+	EV_PRIO_HIGH = 0x20,
+	EV_PRIO_LOW = 0x40,
+};
+
+/**
+ * ev_eloop_stats:
+ * @wakeups: Dispatch rounds that found ready sources
+ * @empty_wakeups: Dispatch rounds that timed out or were interrupted
+ * @events: Ready sources that were dispatched
+ * @extra_rounds: Additional polls for edge-triggered sources in a dispatch
+ * @idle_coalesced: Idle sources run at the end of a dispatch without a wakeup
+ * @repolls: Sources dispatched again through ev_fd_repoll()
+ * @preempted: Times high priority sources cut in between other sources
+ * @latency_sum: Sum over all wakeups of the time until the last ready source
+ *               was dispatched, in microseconds
+ * @latency_max: Maximum of that time, in microseconds
+ *
+ * Counters of an event loop since it was created.
+ */
+struct ev_eloop_stats {
+	uint64_t wakeups;
+	uint64_t empty_wakeups;
+	uint64_t events;
+	uint64_t extra_rounds;
+	uint64_t idle_coalesced;
+	uint64_t repolls;
+	uint64_t preempted;
+	uint64_t latency_sum;
+	uint64_t latency_max;
 };
 
 int ev_eloop_new(struct ev_eloop **out);
@@ -155,6 +202,8 @@ int ev_eloop_dispatch(struct ev_eloop *loop, int timeout);
 int ev_eloop_run(struct ev_eloop *loop, int timeout);
 void ev_eloop_exit(struct ev_eloop *loop);
 int ev_eloop_get_fd(struct ev_eloop *loop);
+void ev_eloop_get_stats(struct ev_eloop *loop, struct ev_eloop_stats *out);
+bool ev_eloop_high_pending(struct ev_eloop *loop);
 
 /* eloop sources */
 
@@ -174,12 +223,20 @@ bool ev_fd_is_enabled(struct ev_fd *fd);
 bool ev_fd_is_bound(struct ev_fd *fd);
 void ev_fd_set_cb_data(struct ev_fd *fd, ev_fd_cb cb, void *data);
 int ev_fd_update(struct ev_fd *fd, int mask);
+int ev_fd_repoll(struct ev_fd *fd, int mask);
 
 int ev_eloop_new_fd(struct ev_eloop *loop, struct ev_fd **out, int rfd, int mask, ev_fd_cb cb,
 		    void *data);
 int ev_eloop_add_fd(struct ev_eloop *loop, struct ev_fd *fd);
 void ev_eloop_rm_fd(struct ev_fd *fd);
 
+/* reader sources */
+
+int ev_eloop_new_reader(struct ev_eloop *loop, struct ev_reader **out, int fd, size_t size,
+			ev_reader_cb cb, void *data);
+void ev_eloop_rm_reader(struct ev_reader *rd);
+void ev_reader_yield(struct ev_reader *rd);
+
 /* timer sources */
 
 int ev_timer_new(struct ev_timer **out, const struct itimerspec *spec, ev_timer_cb cb, void *data);
@@ -192,6 +249,7 @@ bool ev_timer_is_enabled(struct ev_timer *timer);
 bool ev_timer_is_bound(struct ev_timer *timer);
 void ev_timer_set_cb_data(struct ev_timer *timer, ev_timer_cb cb, void *data);
 int ev_timer_update(struct ev_timer *timer, const struct itimerspec *spec);
+int ev_timer_set_prio(struct ev_timer *timer, int prio);
 int ev_timer_drain(struct ev_timer *timer, uint64_t *expirations);
 
 int ev_eloop_new_timer(struct ev_eloop *loop, struct ev_timer **out, const struct itimerspec *spec,
@@ -243,6 +301,10 @@ int ev_eloop_register_idle_cb(struct ev_eloop *eloop, ev_idle_cb cb, void *data,
 void ev_eloop_unregister_idle_cb(struct ev_eloop *eloop, ev_idle_cb cb, void *data,
 				 unsigned int flags);
 
+/* callbacks queued from other threads */
+
+int ev_eloop_queue_cb(struct ev_eloop *loop, ev_idle_cb cb, void *data);
+
 /* pre dispatch callbacks */
 
 int ev_eloop_register_pre_cb(struct ev_eloop *eloop, ev_idle_cb cb, void *data);
@@ -120,6 +120,32 @@ void kmscon_font_unregister(const char *name)
 	shl_register_remove(&font_reg, name);
 }
 
+/*
+ * Glyph coverage
+ * Backends like freetype answer has_glyph() by asking FreeType and then every
+ * fallback font of fontconfig, which is far too slow for every cell drawn. The
+ * answers for single codepoints are kept in a bitmap per plane with two bits
+ * per codepoint, allocated when the plane is first asked about. A font never
+ * gains or loses glyphs, so the answers never change.
+ */
+
+#define COVERAGE_KNOWN 0x1
+#define COVERAGE_HAS 0x2
+/* 2 bits for each of the 65536 codepoints of a plane */
+#define COVERAGE_SIZE (0x10000 / 4)
+
+static void free_coverage(struct kmscon_font *font)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 2; ++i) {
+		for (j = 0; j < KMSCON_FONT_PLANES; ++j) {
+			free(font->coverage[i][j]);
+			font->coverage[i][j] = NULL;
+		}
+	}
+}
+
 static const char *default_font[] = {"freetype", "pango", "unifont", "8x16"};
 
 static int init_font(struct kmscon_font *font, struct shl_register_record *record,
@@ -139,6 +165,10 @@ static int try_font(struct kmscon_font *font, const struct kmscon_font_attr *att
 		    const char *backend)
 {
 	struct shl_register_record *record = shl_register_find(&font_reg, backend);
+
+	/* backends are loaded on first use */
+	if (!record && !kmscon_load_module(backend))
+		record = shl_register_find(&font_reg, backend);
 	if (!record)
 		return -ENOENT;
 	return init_font(font, record, attr);
@@ -260,25 +290,28 @@ void kmscon_font_unref(struct kmscon_font *font)
 	log_debug("freeing font");
 	if (font->ops->destroy)
 		font->ops->destroy(font);
+	free_coverage(font);
 	shl_register_record_unref(font->record);
 	free(font);
 }
 
 /**
- * kmscon_font_render:
+ * kmscon_font_render_styled:
  * @font: Valid font object
  * @id: Unique ID that identifies @ch globally
  * @ch: Symbol to find a glyph for
  * @len: Length of @ch
+ * @style: KMSCON_GLYPH_* bits to render the glyph with
  *
- * Renders the glyph for symbol @ch and returns a pointer to the glyph.
+ * Renders the glyph for symbol @ch in the given @style and returns a pointer to
+ * the glyph. The font object is not modified, so renderers can share it.
  * If the glyph cannot be found or is invalid, NULL is returned.
  *
  * Returns: a new allocated glyph object on success, NULL on failure
  */
 SHL_EXPORT
-struct kmscon_glyph *kmscon_font_render(struct kmscon_font *font, uint64_t id, const uint32_t *ch,
-					size_t len)
+struct kmscon_glyph *kmscon_font_render_styled(struct kmscon_font *font, uint64_t id,
+					       const uint32_t *ch, size_t len, unsigned int style)
 {
 	uint32_t empty_char = ' ';
 	uint32_t replacement_char = 0xfffd;
@@ -289,24 +322,90 @@ struct kmscon_glyph *kmscon_font_render(struct kmscon_font *font, uint64_t id, c
 		return NULL;
 
 	if (!len) {
-		return font->ops->render(font, empty_char, &empty_char, 1);
+		return font->ops->render(font, empty_char, &empty_char, 1, style);
 	}
 
-	glyph = font->ops->render(font, id, ch, len);
+	glyph = font->ops->render(font, id, ch, len, style);
 	if (!glyph)
-		glyph = font->ops->render(font, replacement_char, &replacement_char, 1);
+		glyph = font->ops->render(font, replacement_char, &replacement_char, 1, style);
 	if (!glyph)
-		glyph = font->ops->render(font, invalid_char, &invalid_char, 1);
+		glyph = font->ops->render(font, invalid_char, &invalid_char, 1, style);
 	return glyph;
 }
 
+/**
+ * kmscon_font_render:
+ * @font: Valid font object
+ * @id: Unique ID that identifies @ch globally
+ * @ch: Symbol to find a glyph for
+ * @len: Length of @ch
+ *
+ * Same as kmscon_font_render_styled() with the style of the font attributes.
+ *
+ * Returns: a new allocated glyph object on success, NULL on failure
+ */
+SHL_EXPORT
+struct kmscon_glyph *kmscon_font_render(struct kmscon_font *font, uint64_t id, const uint32_t *ch,
+					size_t len)
+{
+	if (!font)
+		return NULL;
+
+	return kmscon_font_render_styled(font, id, ch, len, kmscon_font_attr_style(&font->attr));
+}
+
+/**
+ * kmscon_font_has_glyph_styled:
+ * @font: Valid font object
+ * @ch: Symbol to find a glyph for
+ * @len: Length of @ch
+ * @style: KMSCON_GLYPH_* bits the glyph would be rendered with
+ *
+ * Checks if the font has a glyph for the given symbol @ch in @style. The backend
+ * is asked only once for each single codepoint and weight, later calls are
+ * answered from the coverage bitmap of the font.
+ *
+ * Returns: true if the font has a glyph for the given symbol, false otherwise
+ */
+SHL_EXPORT
+bool kmscon_font_has_glyph_styled(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				  unsigned int style)
+{
+	uint8_t **map, bits;
+	unsigned int idx, shift;
+	bool has;
+
+	if (!font)
+		return false;
+
+	if (len != 1 || *ch >= KMSCON_FONT_PLANES << 16)
+		return font->ops->has_glyph(font, ch, len, style);
+
+	map = &font->coverage[!!(style & KMSCON_GLYPH_BOLD)][*ch >> 16];
+	if (!*map) {
+		*map = calloc(1, COVERAGE_SIZE);
+		if (!*map)
+			return font->ops->has_glyph(font, ch, len, style);
+	}
+
+	idx = *ch & 0xffff;
+	shift = (idx % 4) * 2;
+	bits = (*map)[idx / 4] >> shift;
+	if (bits & COVERAGE_KNOWN)
+		return bits & COVERAGE_HAS;
+
+	has = font->ops->has_glyph(font, ch, len, style);
+	(*map)[idx / 4] |= (COVERAGE_KNOWN | (has ? COVERAGE_HAS : 0)) << shift;
+	return has;
+}
+
 /**
  * kmscon_font_has_glyph:
  * @font: Valid font object
  * @ch: Symbol to find a glyph for
  * @len: Length of @ch
  *
- * Checks if the font has a glyph for the given symbol @ch.
+ * Same as kmscon_font_has_glyph_styled() with the style of the font attributes.
  *
  * Returns: true if the font has a glyph for the given symbol, false otherwise
  */
@@ -316,5 +415,35 @@ bool kmscon_font_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t
 	if (!font)
 		return false;
 
-	return font->ops->has_glyph(font, ch, len);
-}
\ No newline at end of file
+	return kmscon_font_has_glyph_styled(font, ch, len, kmscon_font_attr_style(&font->attr));
+}
+/**
+ * kmscon_font_shape:
+ * @font: Valid font object
+ * @ch: One codepoint for each cell of the run
+ * @num: Number of cells, at most KMSCON_FONT_MAX_RUN
+ * @style: KMSCON_GLYPH_* bits of the run
+ * @ids: Filled with an id for each cell
+ *
+ * Shapes the cells of @ch as one run, so ligatures and the contextual forms of
+ * complex scripts can span cells. A cell that looks the same as its codepoint
+ * on its own gets an id of 0 and is drawn as usual. The others get an id with
+ * KMSCON_GLYPH_RUN_ID set, which stands for the run, the style and the position
+ * in it; kmscon_font_render_styled() renders the part of the run that falls on
+ * that cell for it. Renderers cache these glyphs under that id like any other,
+ * so a run that is drawn again is neither shaped nor rendered again.
+ *
+ * Returns: 0 on success, -EOPNOTSUPP if the font doesn't shape runs or another
+ * negative error code on failure.
+ */
+SHL_EXPORT
+int kmscon_font_shape(struct kmscon_font *font, const uint32_t *ch, size_t num, unsigned int style,
+		      uint64_t *ids)
+{
+	if (!font || !ch || !ids || num > KMSCON_FONT_MAX_RUN)
+		return -EINVAL;
+	if (!kmscon_font_can_shape(font))
+		return -EOPNOTSUPP;
+
+	return font->ops->shape(font, ch, num, style, ids);
+}
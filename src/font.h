@@ -74,6 +74,27 @@ static inline unsigned int kmscon_glyph_cwidth(const struct kmscon_glyph *glyph)
 	return glyph->double_width ? 2 : 1;
 }
 
+/* style bits of a glyph, passed to the _styled() functions */
+#define KMSCON_GLYPH_BOLD 0x01
+#define KMSCON_GLYPH_ITALIC 0x02
+#define KMSCON_GLYPH_UNDERLINE 0x04
+#define KMSCON_GLYPH_STYLES 8 /* number of combinations of the bits above */
+
+static inline unsigned int kmscon_font_attr_style(const struct kmscon_font_attr *attr)
+{
+	return (attr->bold ? KMSCON_GLYPH_BOLD : 0) | (attr->italic ? KMSCON_GLYPH_ITALIC : 0) |
+	       (attr->underline ? KMSCON_GLYPH_UNDERLINE : 0);
+}
+
+/* most cells of a run shaped at once, see kmscon_font_shape() */
+#define KMSCON_FONT_MAX_RUN 256
+
+/* set in the ids of cells whose glyph depends on the rest of their run */
+#define KMSCON_GLYPH_RUN_ID (1ULL << 63)
+
+/* Unicode planes covered by the has_glyph() cache of a font */
+#define KMSCON_FONT_PLANES 17
+
 struct kmscon_font {
 	unsigned long ref;
 	struct shl_register_record *record;
@@ -81,6 +102,8 @@ struct kmscon_font {
 	struct kmscon_font_attr attr;
 	unsigned increase_step;
 	void *data;
+	/* has_glyph() answers of each plane, regular and bold, see font.c */
+	uint8_t *coverage[2][KMSCON_FONT_PLANES];
 };
 
 struct kmscon_font_ops {
@@ -88,11 +111,22 @@ struct kmscon_font_ops {
 	struct shl_module *owner;
 	int (*init)(struct kmscon_font *out, const struct kmscon_font_attr *attr);
 	void (*destroy)(struct kmscon_font *font);
-	bool (*has_glyph)(struct kmscon_font *font, const uint32_t *ch, size_t len);
+	bool (*has_glyph)(struct kmscon_font *font, const uint32_t *ch, size_t len,
+			  unsigned int style);
 	struct kmscon_glyph *(*render)(struct kmscon_font *font, uint64_t id, const uint32_t *ch,
-				       size_t len);
+				       size_t len, unsigned int style);
+	/* optional: shape a run of cells, see kmscon_font_shape() */
+	int (*shape)(struct kmscon_font *font, const uint32_t *ch, size_t num,
+		     unsigned int style, uint64_t *ids);
+	/* optional: file of the regular/bold face, used to key persistent caches */
+	const char *(*get_file)(const struct kmscon_font *font, bool bold);
 };
 
+static inline bool kmscon_font_can_shape(const struct kmscon_font *font)
+{
+	return font->ops && font->ops->shape;
+}
+
 int kmscon_font_register(const struct kmscon_font_ops *ops);
 void kmscon_font_unregister(const char *name);
 
@@ -104,6 +138,12 @@ void kmscon_font_unref(struct kmscon_font *font);
 struct kmscon_glyph *kmscon_font_render(struct kmscon_font *font, uint64_t id, const uint32_t *ch,
 					size_t len);
 bool kmscon_font_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len);
+struct kmscon_glyph *kmscon_font_render_styled(struct kmscon_font *font, uint64_t id,
+					       const uint32_t *ch, size_t len, unsigned int style);
+bool kmscon_font_has_glyph_styled(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				  unsigned int style);
+int kmscon_font_shape(struct kmscon_font *font, const uint32_t *ch, size_t num, unsigned int style,
+		      uint64_t *ids);
 
 /* modularized backends */
 
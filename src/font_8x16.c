@@ -75,47 +75,39 @@ static void kmscon_font_8x16_destroy(struct kmscon_font *font)
 	log_debug("unloading static 8x16 font");
 }
 
-static uint8_t unfold(uint8_t val)
-{
-	return 0xff * !!val;
-}
-
+/* the font data is a row per byte, which is the UTERM_FORMAT_MONO layout */
 static struct kmscon_glyph *new_glyph(uint32_t ch)
 {
 	const char *font_data;
 	struct kmscon_glyph *glyph;
-	uint8_t c;
-	int i, j;
 
 	font_data = &_binary_font_8x16_data_start[16 * ch];
 	if (font_data + 16 > _binary_font_8x16_data_end)
 		return NULL;
 
-	glyph = malloc(sizeof(*glyph) + 8 * 16);
+	glyph = malloc(sizeof(*glyph) + 16);
 	if (!glyph)
 		return NULL;
 
 	glyph->double_width = false;
 	glyph->buf.width = 8;
 	glyph->buf.height = 16;
-	glyph->buf.stride = 8;
-
-	for (i = 0; i < 16; i++) {
-		for (j = 0; j < 8; j++) {
-			c = (uint8_t)font_data[i];
-			glyph->buf.data[i * 8 + j] = unfold(c & (1 << (7 - j)));
-		}
-	}
+	glyph->buf.stride = 1;
+	glyph->buf.format = UTERM_FORMAT_MONO;
+	memcpy(glyph->buf.data, font_data, 16);
+
 	return glyph;
 }
 
-static bool kmscon_font_8x16_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len)
+static bool kmscon_font_8x16_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				       unsigned int style)
 {
 	return (len == 1 && *ch < 256);
 }
 
 static struct kmscon_glyph *kmscon_font_8x16_render(struct kmscon_font *font, uint64_t id,
-						    const uint32_t *ch, size_t len)
+						    const uint32_t *ch, size_t len,
+						    unsigned int style)
 {
 	uint32_t c = *ch;
 
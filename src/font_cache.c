@@ -0,0 +1,1181 @@
+/*
+ * kmscon - Glyph Cache
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * SECTION:font_cache
+ * @short_description: Glyph Cache
+ * @include: font_cache.h
+ *
+ * The text renderers look up a glyph for every cell they draw, so a lookup
+ * has to be cheap. The cache is a linear-probing hash table that stores the
+ * keys inline, next to the index of the slot that holds the glyph. A hit only
+ * sets the reference bit and the frame stamp of that slot; eviction uses the
+ * CLOCK algorithm and never picks a glyph that was used in the current frame,
+ * as the renderers keep pointers to them until the frame is rendered.
+ *
+ * Slots and glyph bitmaps are carved from chunks that are allocated on demand,
+ * so after warm-up inserting a glyph does not allocate anything. The glyph
+ * returned by the font is copied into its slot and freed. Glyphs that are
+ * larger than the slot size given at creation are kept as they are.
+ *
+ * kmscon_glyph_cache_get_shared() returns one cache per font face and size, so
+ * every display and session drawing with that font shares its glyphs. The
+ * cache grows to the largest size any of its users asked for. Only the list of
+ * shared caches is locked, the caches themselves are not, so a cache is only
+ * shared between users on the thread that created it. Seats running on their
+ * own thread get their own caches, and so does the render thread of a
+ * terminal.
+ *
+ * If a cache directory is set with kmscon_glyph_cache_set_dir(), shared caches
+ * of fonts that name their face files are saved there when the last user drops
+ * them, and mmap()ed on the next start. Glyphs found in that file are used in
+ * place, so the first frames after boot are drawn without rasterizing anything.
+ * The file is keyed on the backend, font name and size and on the identity of
+ * the face files, so updating a font invalidates it.
+ *
+ * Without such a file, kmscon_glyph_cache_prerender() renders the printable
+ * ASCII and Latin-1 glyphs on a worker thread with its own instance of the
+ * font, as font backends are not thread-safe. The worker publishes its result
+ * with a single release store; the main thread adopts the glyphs on the first
+ * cache miss after that and never waits for the worker.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "font_cache.h"
+#include "shl_dlist.h"
+#include "shl_log.h"
+#include "shl_misc.h"
+
+#define LOG_SUBSYSTEM "font_cache"
+
+/* number of slots carved from one slab chunk */
+#define SLAB_CHUNK 256
+
+#define STORE_MAGIC "KMSCGLY"
+#define STORE_VERSION 2
+/* upper bound of glyphs in a cache file, old glyphs are dropped beyond it */
+#define STORE_MAX_ENTRIES 65536
+
+/* printable ASCII and Latin-1, regular and bold */
+static const uint32_t warmup_ranges[][2] = {
+	{0x20, 0x7e},
+	{0xa0, 0xff},
+};
+#define WARMUP_NUM (2 * ((0x7e - 0x20 + 1) + (0xff - 0xa0 + 1)))
+
+struct warmup_glyph {
+	uint32_t ch;
+	uint32_t flags;
+	struct kmscon_glyph *glyph;
+};
+
+struct warmup {
+	pthread_t thread;
+	struct kmscon_font_attr attr;
+	const struct kmscon_font_ops *ops;
+	unsigned int width;
+	unsigned int height;
+
+	bool cancel; /* atomic, set by the main thread */
+	bool done;   /* atomic, the worker doesn't touch anything after setting it */
+	unsigned int num;
+	struct warmup_glyph glyphs[WARMUP_NUM];
+};
+
+/*
+ * Cache file layout: a header, the index sorted by id and flags, then the
+ * glyphs as struct kmscon_glyph followed by the bitmap, each 8-byte aligned so
+ * they can be used straight from the mapping. The file is only read by the
+ * machine that wrote it, so native endianness and struct layout are fine.
+ */
+struct store_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t glyph_header; /* sizeof(struct kmscon_glyph) */
+	uint64_t key;
+	uint32_t num;
+	uint32_t reserved;
+};
+
+struct store_entry {
+	uint64_t id;
+	uint32_t flags;
+	uint32_t size;
+	uint64_t offset;
+};
+
+struct bucket {
+	uint64_t id;
+	uint32_t flags;
+	uint32_t slot; /* slot index + 1, 0 if the bucket is empty */
+};
+
+struct slot {
+	struct kmscon_glyph *glyph;
+	uint64_t id;
+	uint32_t flags;
+	uint32_t frame;
+	bool ref;
+	bool external; /* malloc()ed glyph, neither in the slab nor in the mapping */
+};
+
+struct kmscon_glyph_cache {
+	unsigned long ref;
+	struct shl_dlist list;
+	bool shared;
+	pthread_t thread;
+	const struct kmscon_font_ops *ops;
+	struct kmscon_font_attr attr;
+
+	unsigned int max_entries;
+	unsigned int num;
+	unsigned int hand;
+	uint32_t frame;
+
+	unsigned int mask;
+	struct bucket *buckets;
+
+	size_t glyph_size;
+	struct slot *slots;
+	uint8_t **chunks;
+
+	/* persistent store, key is 0 if the font cannot be persisted */
+	uint64_t key;
+	bool dirty;
+	uint8_t *map;
+	size_t map_size;
+	const struct store_entry *index;
+	uint32_t index_num;
+
+	bool warm_started;
+	struct warmup *warm;
+
+	unsigned long batch;
+};
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shl_dlist shared_caches = SHL_DLIST_INIT(shared_caches);
+static char *store_dir;
+/* frames started while a batch is open share one frame stamp, per thread */
+static __thread unsigned long batch_depth;
+static __thread unsigned long batch_seq;
+
+static inline unsigned int hash_key(uint64_t id, uint32_t flags)
+{
+	uint64_t h;
+
+	h = (id ^ (flags * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 32);
+}
+
+/* returns the bucket of @id/@flags or the empty bucket where it belongs */
+static inline unsigned int find_bucket(struct kmscon_glyph_cache *cache, uint64_t id,
+				       uint32_t flags)
+{
+	unsigned int i = hash_key(id, flags) & cache->mask;
+	struct bucket *b;
+
+	for (;; i = (i + 1) & cache->mask) {
+		b = &cache->buckets[i];
+		if (!b->slot || (b->id == id && b->flags == flags))
+			return i;
+	}
+}
+
+/* backward-shift deletion, so lookups never have to skip tombstones */
+static void remove_bucket(struct kmscon_glyph_cache *cache, unsigned int i)
+{
+	unsigned int j = i, k;
+	struct bucket *b;
+
+	for (;;) {
+		j = (j + 1) & cache->mask;
+		b = &cache->buckets[j];
+		if (!b->slot)
+			break;
+
+		/* move @j into the hole unless its home lies cyclically in (i, j] */
+		k = hash_key(b->id, b->flags) & cache->mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		cache->buckets[i] = *b;
+		i = j;
+	}
+
+	cache->buckets[i].slot = 0;
+}
+
+static void *slot_mem(struct kmscon_glyph_cache *cache, unsigned int idx)
+{
+	return cache->chunks[idx / SLAB_CHUNK] + (idx % SLAB_CHUNK) * cache->glyph_size;
+}
+
+/* CLOCK: give referenced slots a second chance, never evict the current frame */
+static int evict(struct kmscon_glyph_cache *cache)
+{
+	struct slot *s;
+	unsigned int n, idx;
+
+	for (n = 0; n < 2 * cache->num; ++n) {
+		idx = cache->hand;
+		cache->hand = (cache->hand + 1) % cache->num;
+		s = &cache->slots[idx];
+
+		if (s->frame == cache->frame)
+			continue;
+		if (s->ref) {
+			s->ref = false;
+			continue;
+		}
+
+		remove_bucket(cache, find_bucket(cache, s->id, s->flags));
+		if (s->external)
+			free(s->glyph);
+		s->glyph = NULL;
+		return idx;
+	}
+
+	return -ENOSPC;
+}
+
+static int alloc_slot(struct kmscon_glyph_cache *cache)
+{
+	unsigned int idx, chunk;
+
+	if (cache->num >= cache->max_entries)
+		return evict(cache);
+
+	idx = cache->num;
+	chunk = idx / SLAB_CHUNK;
+	if (!cache->chunks[chunk]) {
+		cache->chunks[chunk] = malloc(SLAB_CHUNK * cache->glyph_size);
+		if (!cache->chunks[chunk])
+			return -ENOMEM;
+	}
+
+	++cache->num;
+	return idx;
+}
+
+/* make room for @max_entries glyphs, existing glyphs stay where they are */
+static int cache_grow(struct kmscon_glyph_cache *cache, unsigned int max_entries)
+{
+	struct bucket *buckets;
+	struct slot *slots;
+	uint8_t **chunks;
+	unsigned int i, mask, old_chunks, new_chunks;
+
+	old_chunks = SHL_DIV_ROUND_UP(cache->max_entries, SLAB_CHUNK);
+	new_chunks = SHL_DIV_ROUND_UP(max_entries, SLAB_CHUNK);
+	mask = shl_next_pow2(2 * max_entries) - 1;
+
+	buckets = calloc(mask + 1, sizeof(*buckets));
+	if (!buckets)
+		return -ENOMEM;
+
+	slots = realloc(cache->slots, max_entries * sizeof(*slots));
+	if (!slots)
+		goto err_buckets;
+	memset(&slots[cache->max_entries], 0,
+	       (max_entries - cache->max_entries) * sizeof(*slots));
+	cache->slots = slots;
+
+	chunks = realloc(cache->chunks, new_chunks * sizeof(*chunks));
+	if (!chunks)
+		goto err_buckets;
+	memset(&chunks[old_chunks], 0, (new_chunks - old_chunks) * sizeof(*chunks));
+	cache->chunks = chunks;
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->mask = mask;
+	cache->max_entries = max_entries;
+
+	for (i = 0; i < cache->num; ++i) {
+		if (!cache->slots[i].glyph)
+			continue;
+		buckets = &cache->buckets[find_bucket(cache, slots[i].id, slots[i].flags)];
+		buckets->id = slots[i].id;
+		buckets->flags = slots[i].flags;
+		buckets->slot = i + 1;
+	}
+
+	return 0;
+
+err_buckets:
+	free(buckets);
+	return -ENOMEM;
+}
+
+static inline size_t glyph_size(const struct kmscon_glyph *glyph)
+{
+	return sizeof(*glyph) + (size_t)glyph->buf.stride * glyph->buf.height;
+}
+
+/* the renderers keep pointers, so mapped glyphs are referenced in place */
+static struct kmscon_glyph *cache_add(struct kmscon_glyph_cache *cache, uint64_t id,
+				      uint32_t flags, struct kmscon_glyph *glyph, bool mapped)
+{
+	struct bucket *b;
+	struct slot *s;
+	size_t size;
+	int idx;
+
+	idx = alloc_slot(cache);
+	if (idx < 0) {
+		if (mapped)
+			return glyph;
+		log_warning("cannot cache glyph %" PRIu64 " (%d)", id, idx);
+		free(glyph);
+		return NULL;
+	}
+
+	s = &cache->slots[idx];
+	size = glyph_size(glyph);
+	if (mapped) {
+		s->glyph = glyph;
+		s->external = false;
+	} else if (size <= cache->glyph_size) {
+		s->glyph = memcpy(slot_mem(cache, idx), glyph, size);
+		s->external = false;
+		free(glyph);
+	} else {
+		s->glyph = glyph;
+		s->external = true;
+	}
+	s->id = id;
+	s->flags = flags;
+	s->frame = cache->frame;
+	s->ref = false;
+
+	/* eviction may have shifted our bucket */
+	b = &cache->buckets[find_bucket(cache, id, flags)];
+	b->id = id;
+	b->flags = flags;
+	b->slot = idx + 1;
+
+	return s->glyph;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* returns 0 if the font does not tell which files it renders from */
+static uint64_t store_key(const struct kmscon_font *font)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t v[3];
+	const char *path;
+	struct stat st;
+	int bold;
+
+	if (!font->ops->get_file)
+		return 0;
+
+	h = fnv1a(h, font->ops->name, strlen(font->ops->name) + 1);
+	h = fnv1a(h, font->attr.name, strlen(font->attr.name) + 1);
+	v[0] = font->attr.width;
+	v[1] = font->attr.height;
+	v[2] = sizeof(struct kmscon_glyph);
+	h = fnv1a(h, v, sizeof(v));
+
+	for (bold = 0; bold < 2; ++bold) {
+		path = font->ops->get_file(font, bold);
+		if (!path || stat(path, &st))
+			return 0;
+
+		h = fnv1a(h, path, strlen(path) + 1);
+		h = fnv1a(h, &st.st_dev, sizeof(st.st_dev));
+		h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+		h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+		h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+	}
+
+	return h ? h : 1;
+}
+
+static void store_path(char *buf, size_t size, const char *dir, uint64_t key, const char *suffix)
+{
+	snprintf(buf, size, "%s/%016" PRIx64 ".glyphs%s", dir, key, suffix);
+}
+
+static void store_load(struct kmscon_glyph_cache *cache, const char *dir)
+{
+	char path[PATH_MAX];
+	const struct store_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	store_path(path, sizeof(path), dir, cache->key, "");
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log_warning("cannot open glyph cache %s (%d): %m", path, errno);
+		return;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warning("cannot map glyph cache %s (%d): %m", path, errno);
+		return;
+	}
+
+	hdr = map;
+	if (memcmp(hdr->magic, STORE_MAGIC, sizeof(hdr->magic)) || hdr->version != STORE_VERSION ||
+	    hdr->glyph_header != sizeof(struct kmscon_glyph) || hdr->key != cache->key ||
+	    hdr->num > STORE_MAX_ENTRIES ||
+	    (size_t)st.st_size < sizeof(*hdr) + hdr->num * sizeof(struct store_entry)) {
+		log_warning("ignoring invalid glyph cache %s", path);
+		munmap(map, st.st_size);
+		return;
+	}
+
+	cache->map = map;
+	cache->map_size = st.st_size;
+	cache->index = (const void *)(cache->map + sizeof(*hdr));
+	cache->index_num = hdr->num;
+	log_debug("mapped %u glyphs from %s", cache->index_num, path);
+}
+
+static inline int key_cmp(uint64_t id1, uint32_t flags1, uint64_t id2, uint32_t flags2)
+{
+	if (id1 != id2)
+		return id1 < id2 ? -1 : 1;
+	if (flags1 != flags2)
+		return flags1 < flags2 ? -1 : 1;
+	return 0;
+}
+
+/* the file may be truncated or corrupted, so every glyph is checked on use */
+static struct kmscon_glyph *store_find(struct kmscon_glyph_cache *cache, uint64_t id,
+				       uint32_t flags)
+{
+	const struct store_entry *e;
+	struct kmscon_glyph *glyph;
+	unsigned int lo = 0, hi = cache->index_num, mid;
+	int r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &cache->index[mid];
+		r = key_cmp(id, flags, e->id, e->flags);
+		if (!r)
+			break;
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo >= hi)
+		return NULL;
+
+	if (e->offset % 8 || e->offset > cache->map_size || e->size > cache->map_size - e->offset ||
+	    e->size < sizeof(*glyph))
+		return NULL;
+
+	glyph = (void *)(cache->map + e->offset);
+	if (glyph->buf.format > UTERM_FORMAT_ARGB32 ||
+	    uterm_video_buffer_row_size(&glyph->buf) > glyph->buf.stride ||
+	    (size_t)glyph->buf.stride * glyph->buf.height > e->size - sizeof(*glyph))
+		return NULL;
+
+	return glyph;
+}
+
+struct store_item {
+	uint64_t id;
+	uint32_t flags;
+	const struct kmscon_glyph *glyph;
+};
+
+static int item_cmp(const void *a, const void *b)
+{
+	const struct store_item *i1 = a, *i2 = b;
+
+	return key_cmp(i1->id, i1->flags, i2->id, i2->flags);
+}
+
+/* write to a temporary file first so a crash never leaves a partial cache */
+static void store_save(struct kmscon_glyph_cache *cache, const char *dir)
+{
+	static const uint8_t zero[8];
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct store_header hdr;
+	struct store_entry e;
+	struct store_item *items;
+	const struct store_entry *old;
+	struct kmscon_glyph *glyph;
+	unsigned int i, n = 0, max;
+	uint64_t off;
+	size_t size;
+	FILE *f;
+	int fd;
+
+	/* glyphs of this run first, then the ones that only live in the file */
+	max = min(cache->num + cache->index_num, STORE_MAX_ENTRIES);
+	if (!max)
+		return;
+
+	items = malloc(max * sizeof(*items));
+	if (!items)
+		return;
+
+	for (i = 0; i < cache->num && n < max; ++i) {
+		if (!cache->slots[i].glyph)
+			continue;
+		items[n].id = cache->slots[i].id;
+		items[n].flags = cache->slots[i].flags;
+		items[n++].glyph = cache->slots[i].glyph;
+	}
+
+	for (i = 0; i < cache->index_num && n < max; ++i) {
+		old = &cache->index[i];
+		if (cache->buckets[find_bucket(cache, old->id, old->flags)].slot)
+			continue;
+		glyph = store_find(cache, old->id, old->flags);
+		if (!glyph)
+			continue;
+		items[n].id = old->id;
+		items[n].flags = old->flags;
+		items[n++].glyph = glyph;
+	}
+
+	qsort(items, n, sizeof(*items), item_cmp);
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		log_warning("cannot create glyph cache directory %s (%d): %m", dir, errno);
+		goto out;
+	}
+
+	store_path(path, sizeof(path), dir, cache->key, "");
+	store_path(tmp, sizeof(tmp), dir, cache->key, ".tmp");
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_warning("cannot create glyph cache %s (%d): %m", tmp, errno);
+		goto out;
+	}
+
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		goto err_unlink;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STORE_MAGIC, sizeof(hdr.magic));
+	hdr.version = STORE_VERSION;
+	hdr.glyph_header = sizeof(struct kmscon_glyph);
+	hdr.key = cache->key;
+	hdr.num = n;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	off = sizeof(hdr) + (uint64_t)n * sizeof(e);
+	for (i = 0; i < n; ++i) {
+		size = glyph_size(items[i].glyph);
+		memset(&e, 0, sizeof(e));
+		e.id = items[i].id;
+		e.flags = items[i].flags;
+		e.size = size;
+		e.offset = off;
+		fwrite(&e, sizeof(e), 1, f);
+		off += (size + 7) & ~(size_t)7;
+	}
+
+	for (i = 0; i < n; ++i) {
+		size = glyph_size(items[i].glyph);
+		fwrite(items[i].glyph, size, 1, f);
+		fwrite(zero, ((size + 7) & ~(size_t)7) - size, 1, f);
+	}
+
+	if (ferror(f) | fclose(f)) {
+		log_warning("cannot write glyph cache %s", tmp);
+		goto err_unlink;
+	}
+
+	if (rename(tmp, path)) {
+		log_warning("cannot rename glyph cache %s (%d): %m", tmp, errno);
+		goto err_unlink;
+	}
+
+	log_debug("saved %u glyphs to %s", n, path);
+	goto out;
+
+err_unlink:
+	unlink(tmp);
+out:
+	free(items);
+}
+
+static void *warmup_thread(void *data)
+{
+	struct warmup *w = data;
+	struct kmscon_font *font;
+	struct kmscon_glyph *glyph;
+	unsigned int i, style;
+	uint32_t ch;
+
+	/* glyphs are only rendered ahead of time, don't delay drawing */
+	shl_thread_set_background();
+
+	if (kmscon_font_find(&font, &w->attr, w->ops->name))
+		goto out;
+
+	/* the fallback backend may have been picked, its glyphs don't fit */
+	if (font->ops != w->ops || font->attr.width != w->width || font->attr.height != w->height)
+		goto out_font;
+
+	for (style = 0; style <= KMSCON_GLYPH_BOLD; style += KMSCON_GLYPH_BOLD) {
+		for (i = 0; i < sizeof(warmup_ranges) / sizeof(*warmup_ranges); ++i) {
+			for (ch = warmup_ranges[i][0]; ch <= warmup_ranges[i][1]; ++ch) {
+				if (__atomic_load_n(&w->cancel, __ATOMIC_RELAXED))
+					goto out_font;
+				if (!kmscon_font_has_glyph_styled(font, &ch, 1, style))
+					continue;
+				glyph = kmscon_font_render_styled(font, ch, &ch, 1, style);
+				if (!glyph)
+					continue;
+				w->glyphs[w->num].ch = ch;
+				w->glyphs[w->num].flags = style;
+				w->glyphs[w->num++].glyph = glyph;
+			}
+		}
+	}
+
+out_font:
+	kmscon_font_unref(font);
+out:
+	__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void warmup_free(struct warmup *w)
+{
+	unsigned int i;
+
+	pthread_join(w->thread, NULL);
+	for (i = 0; i < w->num; ++i)
+		free(w->glyphs[i].glyph);
+	free(w);
+}
+
+/* takes the glyphs of a finished worker, returns immediately otherwise */
+static void warmup_adopt(struct kmscon_glyph_cache *cache)
+{
+	struct warmup *w = cache->warm;
+	struct warmup_glyph *g;
+	unsigned int i;
+
+	if (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE))
+		return;
+
+	for (i = 0; i < w->num; ++i) {
+		g = &w->glyphs[i];
+		/* the main thread may have rendered it meanwhile */
+		if (cache->buckets[find_bucket(cache, g->ch, g->flags)].slot)
+			continue;
+		cache->dirty = true;
+		cache_add(cache, g->ch, g->flags, g->glyph, false);
+		g->glyph = NULL;
+	}
+
+	log_debug("adopted %u prerendered glyphs", w->num);
+	cache->warm = NULL;
+	warmup_free(w);
+}
+
+/**
+ * kmscon_glyph_cache_new:
+ * @out: Pointer where the new cache is stored
+ * @max_entries: Maximum number of glyphs kept in the cache
+ * @max_glyph_size: Size of a slab slot, that is the size of the largest glyph
+ *                  (including the struct kmscon_glyph header) expected
+ *
+ * Creates a new private cache with a reference count of 1.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+SHL_EXPORT
+int kmscon_glyph_cache_new(struct kmscon_glyph_cache **out, unsigned int max_entries,
+			   size_t max_glyph_size)
+{
+	struct kmscon_glyph_cache *cache;
+
+	if (!out || !max_entries)
+		return -EINVAL;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return -ENOMEM;
+	memset(cache, 0, sizeof(*cache));
+
+	cache->ref = 1;
+	cache->max_entries = max_entries;
+	cache->mask = shl_next_pow2(2 * max_entries) - 1;
+	cache->glyph_size = (max(max_glyph_size, sizeof(struct kmscon_glyph)) + 7) & ~(size_t)7;
+
+	cache->buckets = calloc(cache->mask + 1, sizeof(*cache->buckets));
+	if (!cache->buckets)
+		goto err_free;
+
+	cache->slots = calloc(max_entries, sizeof(*cache->slots));
+	if (!cache->slots)
+		goto err_buckets;
+
+	cache->chunks = calloc(SHL_DIV_ROUND_UP(max_entries, SLAB_CHUNK), sizeof(*cache->chunks));
+	if (!cache->chunks)
+		goto err_slots;
+
+	*out = cache;
+	return 0;
+
+err_slots:
+	free(cache->slots);
+err_buckets:
+	free(cache->buckets);
+err_free:
+	free(cache);
+	return -ENOMEM;
+}
+
+/**
+ * kmscon_glyph_cache_set_dir:
+ * @dir: Directory for cache files or NULL to disable them
+ *
+ * Sets the directory shared caches are saved to and loaded from. This only
+ * affects caches created afterwards. The directory is created on first save.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+SHL_EXPORT
+int kmscon_glyph_cache_set_dir(const char *dir)
+{
+	char *copy = NULL;
+
+	if (dir && *dir) {
+		copy = strdup(dir);
+		if (!copy)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&shared_lock);
+	free(store_dir);
+	store_dir = copy;
+	pthread_mutex_unlock(&shared_lock);
+
+	return 0;
+}
+
+/**
+ * kmscon_glyph_cache_prerender:
+ * @out: Pointer where the cache is stored
+ * @font: Font the glyphs are rendered with
+ * @attr: Attributes @font was found with
+ *
+ * Like kmscon_glyph_cache_get_shared(), but if the cache is new and no cache
+ * file was found for it, the common Latin glyphs are rendered in the background
+ * so the first screens don't wait on the font backend. @attr must be what was
+ * passed to kmscon_font_find(), the worker uses it to load its own copy of
+ * @font.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+SHL_EXPORT
+int kmscon_glyph_cache_prerender(struct kmscon_glyph_cache **out, const struct kmscon_font *font,
+				 const struct kmscon_font_attr *attr)
+{
+	struct kmscon_glyph_cache *cache;
+	struct warmup *w;
+	int ret;
+
+	if (!out || !font || !attr)
+		return -EINVAL;
+
+	ret = kmscon_glyph_cache_get_shared(out, font, 2 * WARMUP_NUM,
+					    sizeof(struct kmscon_glyph) +
+						    2 * font->attr.width * font->attr.height);
+	if (ret)
+		return ret;
+
+	cache = *out;
+	if (cache->warm_started || cache->index_num)
+		return 0;
+	cache->warm_started = true;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return 0;
+	memset(w, 0, sizeof(*w));
+	kmscon_copy_attr(&w->attr, attr);
+	w->ops = font->ops;
+	w->width = font->attr.width;
+	w->height = font->attr.height;
+
+	ret = pthread_create(&w->thread, NULL, warmup_thread, w);
+	if (ret) {
+		log_warning("cannot start glyph prerendering (%d)", ret);
+		free(w);
+		return 0;
+	}
+
+	cache->warm = w;
+	return 0;
+}
+
+static bool font_matches(const struct kmscon_glyph_cache *cache, const struct kmscon_font *font)
+{
+	/* bold/italic/underline are part of the glyph key, not of the cache */
+	return pthread_equal(cache->thread, pthread_self()) && cache->ops == font->ops &&
+	       cache->attr.width == font->attr.width &&
+	       cache->attr.height == font->attr.height &&
+	       !strcmp(cache->attr.name, font->attr.name);
+}
+
+/**
+ * kmscon_glyph_cache_get_shared:
+ * @out: Pointer where the cache is stored
+ * @font: Font the glyphs are rendered with
+ * @max_entries: Minimum number of glyphs the cache must be able to hold
+ * @max_glyph_size: Size of a slab slot, see kmscon_glyph_cache_new()
+ *
+ * Returns a new reference to the cache shared by all users of fonts with the
+ * same backend, name and size as @font, creating it if needed. Drop it with
+ * kmscon_glyph_cache_unref().
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+SHL_EXPORT
+int kmscon_glyph_cache_get_shared(struct kmscon_glyph_cache **out, const struct kmscon_font *font,
+				  unsigned int max_entries, size_t max_glyph_size)
+{
+	struct kmscon_glyph_cache *cache;
+	struct shl_dlist *iter;
+	int ret = 0;
+
+	if (!out || !font || !max_entries)
+		return -EINVAL;
+
+	pthread_mutex_lock(&shared_lock);
+
+	shl_dlist_for_each(iter, &shared_caches)
+	{
+		cache = shl_dlist_entry(iter, struct kmscon_glyph_cache, list);
+		if (!font_matches(cache, font))
+			continue;
+
+		if (cache->max_entries < max_entries) {
+			ret = cache_grow(cache, max_entries);
+			if (ret)
+				goto out;
+		}
+
+		++cache->ref;
+		*out = cache;
+		goto out;
+	}
+
+	ret = kmscon_glyph_cache_new(&cache, max_entries, max_glyph_size);
+	if (ret)
+		goto out;
+
+	cache->shared = true;
+	cache->thread = pthread_self();
+	cache->ops = font->ops;
+	kmscon_copy_attr(&cache->attr, &font->attr);
+	if (store_dir) {
+		cache->key = store_key(font);
+		if (cache->key)
+			store_load(cache, store_dir);
+	}
+	shl_dlist_link(&shared_caches, &cache->list);
+	log_debug("new shared glyph cache for %s %ux%u", cache->attr.name, cache->attr.width,
+		  cache->attr.height);
+	*out = cache;
+
+out:
+	pthread_mutex_unlock(&shared_lock);
+	return ret;
+}
+
+/**
+ * kmscon_glyph_cache_ref:
+ * @cache: Glyph cache
+ *
+ * Increases the reference count of @cache by one.
+ */
+SHL_EXPORT
+void kmscon_glyph_cache_ref(struct kmscon_glyph_cache *cache)
+{
+	if (!cache || !cache->ref)
+		return;
+
+	pthread_mutex_lock(&shared_lock);
+	++cache->ref;
+	pthread_mutex_unlock(&shared_lock);
+}
+
+/**
+ * kmscon_glyph_cache_unref:
+ * @cache: Glyph cache or NULL
+ *
+ * Decreases the reference count of @cache by one. If it drops to zero, the
+ * cache and all glyphs in it are freed. Shared caches that got new glyphs are
+ * saved to the cache directory first.
+ */
+SHL_EXPORT
+void kmscon_glyph_cache_unref(struct kmscon_glyph_cache *cache)
+{
+	char *dir = NULL;
+	unsigned int i;
+
+	if (!cache || !cache->ref)
+		return;
+
+	pthread_mutex_lock(&shared_lock);
+	if (--cache->ref) {
+		pthread_mutex_unlock(&shared_lock);
+		return;
+	}
+	if (cache->shared)
+		shl_dlist_unlink(&cache->list);
+	if (cache->key && cache->dirty && store_dir)
+		dir = strdup(store_dir);
+	pthread_mutex_unlock(&shared_lock);
+
+	if (cache->warm) {
+		__atomic_store_n(&cache->warm->cancel, true, __ATOMIC_RELAXED);
+		warmup_free(cache->warm);
+	}
+	if (dir) {
+		store_save(cache, dir);
+		free(dir);
+	}
+	if (cache->map)
+		munmap(cache->map, cache->map_size);
+
+	for (i = 0; i < cache->num; ++i) {
+		if (cache->slots[i].external)
+			free(cache->slots[i].glyph);
+	}
+
+	for (i = 0; i < SHL_DIV_ROUND_UP(cache->max_entries, SLAB_CHUNK); ++i)
+		free(cache->chunks[i]);
+
+	free(cache->chunks);
+	free(cache->slots);
+	free(cache->buckets);
+	free(cache);
+}
+
+/**
+ * kmscon_glyph_cache_get_stats:
+ * @cache: Glyph cache
+ * @out: Filled with the stats
+ *
+ * Counts the glyphs of @cache and the memory they take, for the memory report.
+ * Glyphs used straight from the persistent store are counted in @mapped_bytes
+ * only.
+ */
+SHL_EXPORT
+void kmscon_glyph_cache_get_stats(struct kmscon_glyph_cache *cache,
+				  struct kmscon_glyph_cache_stats *out)
+{
+	unsigned int i, chunks;
+
+	memset(out, 0, sizeof(*out));
+	if (!cache)
+		return;
+
+	chunks = SHL_DIV_ROUND_UP(cache->max_entries, SLAB_CHUNK);
+	out->max_entries = cache->max_entries;
+	out->shared = cache->shared;
+	out->mapped_bytes = cache->map_size;
+	out->bytes = sizeof(*cache) + (cache->mask + 1) * sizeof(*cache->buckets) +
+		     cache->max_entries * sizeof(*cache->slots) + chunks * sizeof(*cache->chunks);
+
+	for (i = 0; i < chunks; ++i) {
+		if (cache->chunks[i])
+			out->bytes += SLAB_CHUNK * cache->glyph_size;
+	}
+
+	for (i = 0; i < cache->num; ++i) {
+		if (!cache->slots[i].glyph)
+			continue;
+		++out->entries;
+		if (cache->slots[i].external)
+			out->bytes += glyph_size(cache->slots[i].glyph);
+	}
+}
+
+/**
+ * kmscon_glyph_cache_next_frame:
+ * @cache: Glyph cache
+ *
+ * Glyphs returned during a frame are never evicted before this is called, so
+ * renderers can keep pointers to them until the frame is rendered. Call this
+ * when starting a new frame.
+ *
+ * Between kmscon_glyph_cache_begin_batch() and kmscon_glyph_cache_end_batch(),
+ * only the first call per cache starts a new frame.
+ */
+SHL_EXPORT
+void kmscon_glyph_cache_next_frame(struct kmscon_glyph_cache *cache)
+{
+	if (!cache)
+		return;
+
+	if (batch_depth) {
+		if (cache->batch == batch_seq)
+			return;
+		cache->batch = batch_seq;
+	}
+
+	++cache->frame;
+}
+
+/**
+ * kmscon_glyph_cache_begin_batch:
+ *
+ * Starts a batch of frames whose glyphs stay valid until the batch ends. This
+ * is needed if several renderers draw their frames first and render them all
+ * afterwards, as the glyphs of the first renderer could otherwise be evicted
+ * while the others draw. Batches may nest.
+ */
+SHL_EXPORT
+void kmscon_glyph_cache_begin_batch(void)
+{
+	if (!batch_depth++)
+		++batch_seq;
+}
+
+/**
+ * kmscon_glyph_cache_end_batch:
+ *
+ * Ends a batch started with kmscon_glyph_cache_begin_batch().
+ */
+SHL_EXPORT
+void kmscon_glyph_cache_end_batch(void)
+{
+	if (batch_depth)
+		--batch_depth;
+}
+
+/**
+ * kmscon_glyph_cache_get:
+ * @cache: Glyph cache
+ * @id: tsm id of the glyph
+ * @flags: KMSCON_GLYPH_* attribute bits the glyph was rendered with
+ *
+ * Glyphs returned by the cache must not be modified, they may be mapped
+ * read-only from the cache file.
+ *
+ * Returns: The cached glyph or NULL if it is not in the cache.
+ */
+SHL_EXPORT
+struct kmscon_glyph *kmscon_glyph_cache_get(struct kmscon_glyph_cache *cache, uint64_t id,
+					    uint32_t flags)
+{
+	struct kmscon_glyph *glyph;
+	struct bucket *b;
+	struct slot *s;
+
+	if (!cache)
+		return NULL;
+
+	b = &cache->buckets[find_bucket(cache, id, flags)];
+	if (!b->slot && cache->warm) {
+		warmup_adopt(cache);
+		b = &cache->buckets[find_bucket(cache, id, flags)];
+	}
+	if (!b->slot) {
+		if (!cache->index_num)
+			return NULL;
+		glyph = store_find(cache, id, flags);
+		if (!glyph)
+			return NULL;
+		return cache_add(cache, id, flags, glyph, true);
+	}
+
+	s = &cache->slots[b->slot - 1];
+	s->ref = true;
+	s->frame = cache->frame;
+	return s->glyph;
+}
+
+/**
+ * kmscon_glyph_cache_insert:
+ * @cache: Glyph cache
+ * @id: tsm id of the glyph
+ * @flags: KMSCON_GLYPH_* attribute bits the glyph was rendered with
+ * @glyph: Glyph as returned by kmscon_font_render()
+ *
+ * Adds @glyph to the cache, evicting an older glyph if the cache is full. The
+ * cache takes ownership of @glyph in any case, use the returned pointer to
+ * access it afterwards.
+ *
+ * Returns: The cached glyph or NULL on failure.
+ */
+SHL_EXPORT
+struct kmscon_glyph *kmscon_glyph_cache_insert(struct kmscon_glyph_cache *cache, uint64_t id,
+					       uint32_t flags, struct kmscon_glyph *glyph)
+{
+	if (!cache || !glyph) {
+		free(glyph);
+		return NULL;
+	}
+
+	if (cache->buckets[find_bucket(cache, id, flags)].slot) {
+		free(glyph);
+		return kmscon_glyph_cache_get(cache, id, flags);
+	}
+
+	cache->dirty = true;
+	return cache_add(cache, id, flags, glyph, false);
+}
@@ -0,0 +1,78 @@
+/*
+ * kmscon - Glyph Cache
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Glyph Cache
+ * Bounded cache of rendered glyphs for the text renderers. Lookups are keyed on
+ * the tsm id plus the attribute bits the glyph was rendered with. Renderers
+ * using the same font share one cache.
+ */
+
+#ifndef KMSCON_FONT_CACHE_H
+#define KMSCON_FONT_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "font.h"
+
+/*
+ * glyph flags are the KMSCON_GLYPH_* style bits of font.h; glyphs rotated to an
+ * enum Orientation are cached alongside the upright ones
+ */
+#define KMSCON_GLYPH_ORIENTATION(o) ((uint32_t)(o) << 8)
+
+struct kmscon_glyph_cache;
+
+/* what a cache holds, see kmscon_glyph_cache_get_stats() */
+struct kmscon_glyph_cache_stats {
+	unsigned int entries;
+	unsigned int max_entries;
+	size_t bytes;	     /* heap memory, glyphs and tables */
+	size_t mapped_bytes; /* of the persistent store */
+	bool shared;
+};
+
+int kmscon_glyph_cache_set_dir(const char *dir);
+
+int kmscon_glyph_cache_new(struct kmscon_glyph_cache **out, unsigned int max_entries,
+			   size_t max_glyph_size);
+int kmscon_glyph_cache_get_shared(struct kmscon_glyph_cache **out, const struct kmscon_font *font,
+				  unsigned int max_entries, size_t max_glyph_size);
+int kmscon_glyph_cache_prerender(struct kmscon_glyph_cache **out, const struct kmscon_font *font,
+				 const struct kmscon_font_attr *attr);
+void kmscon_glyph_cache_ref(struct kmscon_glyph_cache *cache);
+void kmscon_glyph_cache_unref(struct kmscon_glyph_cache *cache);
+
+void kmscon_glyph_cache_get_stats(struct kmscon_glyph_cache *cache,
+				  struct kmscon_glyph_cache_stats *out);
+
+void kmscon_glyph_cache_next_frame(struct kmscon_glyph_cache *cache);
+void kmscon_glyph_cache_begin_batch(void);
+void kmscon_glyph_cache_end_batch(void);
+struct kmscon_glyph *kmscon_glyph_cache_get(struct kmscon_glyph_cache *cache, uint64_t id,
+					    uint32_t flags);
+struct kmscon_glyph *kmscon_glyph_cache_insert(struct kmscon_glyph_cache *cache, uint64_t id,
+					       uint32_t flags, struct kmscon_glyph *glyph);
+
+#endif /* KMSCON_FONT_CACHE_H */
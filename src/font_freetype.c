@@ -38,13 +38,28 @@
 
 #define LOG_SUBSYSTEM "font_freetype"
 
+/* fallback faces kept open for each of the regular and bold font */
+#define FALLBACK_FACES 8
+/* fontconfig charsets are made of pages of 256 codepoints */
+#define FALLBACK_PAGES (0x110000 / 256)
+
+struct ft_fallback {
+	FT_Face face; /* NULL if the slot is unused */
+	int index;    /* in the font set */
+	unsigned long used;
+};
+
 struct ft_font {
 	FT_Face face;
+	char *path;
 	/* FontSet and Pattern are used for fallback glyphs */
 	FcFontSet *fc;
 	FcPattern *pattern;
-	FT_Face fallback;
-	int fallback_index;
+	/* open fallback faces, the least recently used one is replaced */
+	struct ft_fallback fallbacks[FALLBACK_FACES];
+	unsigned long fallback_tick;
+	/* first font of the set with any codepoint of each page, -1 if none */
+	int16_t *fallback_pages;
 };
 
 struct ft_data {
@@ -65,19 +80,26 @@ static void print_font_name(FcPattern *pattern)
 
 static void free_ft_font(struct ft_font *ftfont)
 {
+	unsigned int i;
+
 	if (ftfont->face)
 		FT_Done_Face(ftfont->face);
 	ftfont->face = NULL;
+	free(ftfont->path);
+	ftfont->path = NULL;
 	if (ftfont->fc)
 		FcFontSetDestroy(ftfont->fc);
 	ftfont->fc = NULL;
 	if (ftfont->pattern)
 		FcPatternDestroy(ftfont->pattern);
 	ftfont->pattern = NULL;
-	if (ftfont->fallback)
-		FT_Done_Face(ftfont->fallback);
-	ftfont->fallback = NULL;
-	ftfont->fallback_index = -1;
+	for (i = 0; i < FALLBACK_FACES; ++i) {
+		if (ftfont->fallbacks[i].face)
+			FT_Done_Face(ftfont->fallbacks[i].face);
+		ftfont->fallbacks[i].face = NULL;
+	}
+	free(ftfont->fallback_pages);
+	ftfont->fallback_pages = NULL;
 }
 
 static int prepare_face(FT_Library ft, struct ft_font *ftfont)
@@ -104,6 +126,11 @@ static int prepare_face(FT_Library ft, struct ft_font *ftfont)
 
 	err = FT_New_Face(ft, (char *)path, index, &ftfont->face);
 	ret = err ? -EINVAL : 0;
+	if (!ret) {
+		ftfont->path = strdup((char *)path);
+		if (!ftfont->path)
+			ret = -ENOMEM;
+	}
 
 err_pattern:
 	FcPatternDestroy(pattern);
@@ -166,6 +193,37 @@ static int compute_font_size(struct ft_font *ftfont, struct kmscon_font_attr *at
 	return 0;
 }
 
+/*
+ * Mixed-script output asks for fallback glyphs all the time. Instead of testing
+ * the charset of every font in the set for each of them, the search starts at
+ * the first font that has anything in the page of the codepoint, and pages no
+ * font has anything in are skipped right away. Without the index, if it can't
+ * be allocated, every font is tested.
+ */
+static void index_fallbacks(struct ft_font *ftfont)
+{
+	FcChar32 map[FC_CHARSET_MAP_SIZE], next, page;
+	FcCharSet *cs;
+	int i;
+
+	ftfont->fallback_pages = malloc(FALLBACK_PAGES * sizeof(*ftfont->fallback_pages));
+	if (!ftfont->fallback_pages)
+		return;
+	for (i = 0; i < FALLBACK_PAGES; ++i)
+		ftfont->fallback_pages[i] = -1;
+
+	for (i = 0; i < ftfont->fc->nfont && i <= INT16_MAX; ++i) {
+		if (FcPatternGetCharSet(ftfont->fc->fonts[i], FC_CHARSET, 0, &cs) != FcResultMatch)
+			continue;
+
+		for (page = FcCharSetFirstPage(cs, map, &next); page != FC_CHARSET_DONE;
+		     page = FcCharSetNextPage(cs, map, &next)) {
+			if (page / 256 < FALLBACK_PAGES && ftfont->fallback_pages[page / 256] < 0)
+				ftfont->fallback_pages[page / 256] = i;
+		}
+	}
+}
+
 static int prepare_font(FT_Library ft, struct ft_font *ftfont, struct kmscon_font_attr *attr)
 {
 	FcResult result;
@@ -201,8 +259,7 @@ static int prepare_font(FT_Library ft, struct ft_font *ftfont, struct kmscon_fon
 	if (compute_font_size(ftfont, attr))
 		goto err;
 
-	ftfont->fallback_index = -1;
-	ftfont->fallback = NULL;
+	index_fallbacks(ftfont);
 	return 0;
 err:
 	free_ft_font(ftfont);
@@ -277,6 +334,7 @@ static bool glyph_is_wide(FT_GlyphSlot glyph, int width)
 	return real_width > (width * 6) / 5;
 }
 
+/* @buf is UTERM_FORMAT_MONO, the bits are moved to their place in the cell */
 static void copy_mono(struct uterm_video_buffer *buf, FT_GlyphSlot glyph, unsigned int ascender,
 		      bool underline)
 {
@@ -284,7 +342,7 @@ static void copy_mono(struct uterm_video_buffer *buf, FT_GlyphSlot glyph, unsign
 	int top = ascender - glyph->bitmap_top;
 	int left = glyph->bitmap_left;
 	uint8_t *src = map->buffer;
-	uint8_t *dst = buf->data;
+	uint8_t *dst;
 	int i, j, w, h;
 
 	if (top < 0)
@@ -295,17 +353,19 @@ static void copy_mono(struct uterm_video_buffer *buf, FT_GlyphSlot glyph, unsign
 	w = min(buf->width - left, map->width);
 	h = min(buf->height - top, map->rows);
 
+	dst = &buf->data[top * buf->stride];
 	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++)
-			dst[j + top * buf->stride + left] =
-				!!(src[j / 8] & (1 << (7 - (j % 8)))) * 0xff;
+		for (j = 0; j < w; j++) {
+			if (src[j / 8] & (0x80 >> (j % 8)))
+				dst[(left + j) / 8] |= 0x80 >> ((left + j) % 8);
+		}
 
 		dst += buf->stride;
 		src += map->pitch;
 	}
 	if (underline)
-		for (j = 0; j < buf->width; j++)
-			buf->data[(buf->height - 1) * buf->stride + j] = 0xff;
+		memset(&buf->data[(buf->height - 1) * buf->stride], 0xff,
+		       uterm_video_buffer_row_size(buf));
 }
 
 static void draw_underline(struct uterm_video_buffer *buf, FT_Face face)
@@ -367,17 +427,83 @@ static void copy_glyph(struct uterm_video_buffer *buf, FT_Face face, FT_Bitmap *
 		draw_underline(buf, face);
 }
 
+/*
+ * @buf is UTERM_FORMAT_ARGB32. Color bitmaps come premultiplied as BGRA bytes.
+ * Strikes of emoji fonts are much larger than a cell, so a bitmap that doesn't
+ * fit is scaled down with a box filter and centered; one that fits is placed
+ * like any other glyph.
+ */
+static void copy_color(struct uterm_video_buffer *buf, FT_Face face, FT_Bitmap *map)
+{
+	unsigned int w = map->width, h = map->rows, tw, th, left, top;
+	unsigned int x, y, i, j, k, x0, x1, y0, y1, n, sum[4];
+	const uint8_t *src;
+	uint32_t *dst;
+	int pos;
+
+	if (!w || !h)
+		return;
+
+	if (w <= buf->width && h <= buf->height) {
+		tw = w;
+		th = h;
+		pos = face->glyph->bitmap_left;
+		left = min((unsigned int)max(pos, 0), buf->width - tw);
+		pos = (face->size->metrics.ascender >> 6) - face->glyph->bitmap_top;
+		top = min((unsigned int)max(pos, 0), buf->height - th);
+	} else {
+		/* the larger of the two ratios decides, so both sides fit */
+		if ((uint64_t)w * buf->height > (uint64_t)h * buf->width) {
+			tw = buf->width;
+			th = max((uint64_t)h * buf->width / w, (uint64_t)1);
+		} else {
+			th = buf->height;
+			tw = max((uint64_t)w * buf->height / h, (uint64_t)1);
+		}
+		left = (buf->width - tw) / 2;
+		top = (buf->height - th) / 2;
+	}
+
+	for (y = 0; y < th; ++y) {
+		y0 = y * h / th;
+		y1 = (y + 1) * h / th;
+		dst = (uint32_t *)&buf->data[(top + y) * buf->stride] + left;
+
+		for (x = 0; x < tw; ++x) {
+			x0 = x * w / tw;
+			x1 = (x + 1) * w / tw;
+			n = (x1 - x0) * (y1 - y0);
+			memset(sum, 0, sizeof(sum));
+
+			for (i = y0; i < y1; ++i) {
+				src = &map->buffer[i * map->pitch + x0 * 4];
+				for (j = x0; j < x1; ++j, src += 4)
+					for (k = 0; k < 4; ++k)
+						sum[k] += src[k];
+			}
+
+			for (k = 0; k < 4; ++k)
+				sum[k] = (sum[k] + n / 2) / n;
+			dst[x] = sum[3] << 24 | sum[2] << 16 | sum[1] << 8 | sum[0];
+		}
+	}
+}
+
 static struct kmscon_glyph *render_glyph(FT_Face face, FT_UInt index, const uint32_t *ch,
-					 const struct kmscon_font_attr *attr)
+					 const struct kmscon_font_attr *attr, bool underline)
 {
-	unsigned int cwidth;
+	unsigned int cwidth, stride;
 	struct kmscon_glyph *glyph;
+	size_t size;
+	bool mono, color;
 
 	cwidth = tsm_ucs4_get_width(*ch);
 	if (!cwidth)
 		return NULL;
 
-	if (FT_Load_Glyph(face, index, FT_LOAD_NO_HINTING)) {
+	/* color fonts give BGRA bitmaps, from CBDT strikes or COLR layers */
+	if (FT_Load_Glyph(face, index,
+			  FT_LOAD_NO_HINTING | (FT_HAS_COLOR(face) ? FT_LOAD_COLOR : 0))) {
 		log_err("Failed to load glyph\n");
 		return NULL;
 	}
@@ -387,24 +513,46 @@ static struct kmscon_glyph *render_glyph(FT_Face face, FT_UInt index, const uint
 		return NULL;
 	}
 
-	cwidth = glyph_is_wide(face->glyph, attr->width) ? 2 : cwidth;
-	glyph = malloc(sizeof(*glyph) + cwidth * attr->width * attr->height);
+	/* color glyphs are scaled to the cells the terminal gives them */
+	color = face->glyph->bitmap.pixel_mode == FT_PIXEL_MODE_BGRA;
+	if (!color)
+		cwidth = glyph_is_wide(face->glyph, attr->width) ? 2 : cwidth;
+
+	/* bitmap strikes come as mono, keep them at one bit per pixel */
+	mono = face->glyph->bitmap.pixel_mode == FT_PIXEL_MODE_MONO;
+	if (mono)
+		stride = (attr->width * cwidth + 7) / 8;
+	else if (color)
+		stride = attr->width * cwidth * 4;
+	else
+		stride = attr->width * cwidth;
+	size = sizeof(*glyph) + stride * attr->height;
+	glyph = malloc(size);
 	if (!glyph) {
 		log_error("cannot allocate memory for new glyph");
 		return NULL;
 	}
-	memset(glyph, 0, sizeof(*glyph) + cwidth * attr->width * attr->height);
+	memset(glyph, 0, size);
 
 	glyph->double_width = cwidth == 2;
 	glyph->buf.width = attr->width * cwidth;
 	glyph->buf.height = attr->height;
-	glyph->buf.stride = glyph->buf.width;
+	glyph->buf.stride = stride;
+	if (mono)
+		glyph->buf.format = UTERM_FORMAT_MONO;
+	else if (color)
+		glyph->buf.format = UTERM_FORMAT_ARGB32;
+	else
+		glyph->buf.format = UTERM_FORMAT_GREY;
 
-	if (face->glyph->bitmap.pixel_mode == FT_PIXEL_MODE_MONO)
+	/* the underline of a color glyph would need the foreground color */
+	if (mono)
 		copy_mono(&glyph->buf, face->glyph, face->size->metrics.ascender >> 6,
-			  attr->underline);
+			  underline);
+	else if (color)
+		copy_color(&glyph->buf, face, &face->glyph->bitmap);
 	else
-		copy_glyph(&glyph->buf, face, &face->glyph->bitmap, attr->underline);
+		copy_glyph(&glyph->buf, face, &face->glyph->bitmap, underline);
 
 	return glyph;
 }
@@ -463,9 +611,15 @@ err_pattern:
 
 static int get_fallback(uint32_t ch, struct ft_font *ftf)
 {
-	int i;
+	int i = 0;
 
-	for (i = 0; i < ftf->fc->nfont; i++) {
+	if (ftf->fallback_pages) {
+		if (ch / 256 >= FALLBACK_PAGES || ftf->fallback_pages[ch / 256] < 0)
+			return -ENOENT;
+		i = ftf->fallback_pages[ch / 256];
+	}
+
+	for (; i < ftf->fc->nfont; i++) {
 		FcCharSet *cs;
 		if (FcPatternGetCharSet(ftf->fc->fonts[i], FC_CHARSET, 0, &cs) == FcResultMatch)
 			if (FcCharSetHasChar(cs, ch))
@@ -474,10 +628,42 @@ static int get_fallback(uint32_t ch, struct ft_font *ftf)
 	return -ENOENT;
 }
 
-static bool kmscon_font_freetype_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len)
+/* returns the open face of fallback font @index, opening it if needed */
+static FT_Face get_fallback_face(FT_Library ft, struct ft_font *ftfont, int index,
+				 struct kmscon_font_attr *attr)
+{
+	struct ft_fallback *fb, *lru = &ftfont->fallbacks[0];
+	FT_Face face;
+	unsigned int i;
+
+	for (i = 0; i < FALLBACK_FACES; ++i) {
+		fb = &ftfont->fallbacks[i];
+		if (fb->face && fb->index == index) {
+			fb->used = ++ftfont->fallback_tick;
+			return fb->face;
+		}
+		if (lru->face && (!fb->face || fb->used < lru->used))
+			lru = fb;
+	}
+
+	face = prepare_tmp_face(ft, ftfont, index);
+	if (!face)
+		return NULL;
+	select_font_size(face, attr);
+
+	if (lru->face)
+		FT_Done_Face(lru->face);
+	lru->face = face;
+	lru->index = index;
+	lru->used = ++ftfont->fallback_tick;
+	return face;
+}
+
+static bool kmscon_font_freetype_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len,
+					   unsigned int style)
 {
 	struct ft_data *ftd = font->data;
-	struct ft_font *ftfont = font->attr.bold ? &ftd->bold : &ftd->regular;
+	struct ft_font *ftfont = (style & KMSCON_GLYPH_BOLD) ? &ftd->bold : &ftd->regular;
 	FT_UInt glyph_index = FT_Get_Char_Index(ftfont->face, *ch);
 
 	if (glyph_index)
@@ -487,42 +673,42 @@ static bool kmscon_font_freetype_has_glyph(struct kmscon_font *font, const uint3
 }
 
 static struct kmscon_glyph *kmscon_font_freetype_render(struct kmscon_font *font, uint64_t id,
-							const uint32_t *ch, size_t len)
+							const uint32_t *ch, size_t len,
+							unsigned int style)
 {
 	struct ft_data *ftd = font->data;
-	struct ft_font *ftfont = font->attr.bold ? &ftd->bold : &ftd->regular;
+	struct ft_font *ftfont = (style & KMSCON_GLYPH_BOLD) ? &ftd->bold : &ftd->regular;
 	FT_UInt glyph_index = FT_Get_Char_Index(ftfont->face, *ch);
+	bool underline = style & KMSCON_GLYPH_UNDERLINE;
+	FT_Face face;
 	int fallback_index;
 
 	if (!len)
 		return NULL;
 
 	if (glyph_index)
-		return render_glyph(ftfont->face, glyph_index, ch, &font->attr);
+		return render_glyph(ftfont->face, glyph_index, ch, &font->attr, underline);
 
 	/* Fallback, if the glyph is not found in the regular font */
 	fallback_index = get_fallback(*ch, ftfont);
 	if (fallback_index < 0)
 		return NULL;
 
-	if (ftfont->fallback_index != fallback_index) {
-		if (ftfont->fallback)
-			FT_Done_Face(ftfont->fallback);
-		ftfont->fallback = NULL;
-		ftfont->fallback_index = fallback_index;
-	}
-
-	if (!ftfont->fallback) {
-		ftfont->fallback = prepare_tmp_face(ftd->ft, ftfont, fallback_index);
-		if (!ftfont->fallback)
-			return NULL;
-		select_font_size(ftfont->fallback, &font->attr);
-	}
+	face = get_fallback_face(ftd->ft, ftfont, fallback_index, &font->attr);
+	if (!face)
+		return NULL;
 
-	glyph_index = FT_Get_Char_Index(ftfont->fallback, *ch);
+	glyph_index = FT_Get_Char_Index(face, *ch);
 	if (!glyph_index)
 		return NULL;
-	return render_glyph(ftfont->fallback, glyph_index, ch, &font->attr);
+	return render_glyph(face, glyph_index, ch, &font->attr, underline);
+}
+
+static const char *kmscon_font_freetype_get_file(const struct kmscon_font *font, bool bold)
+{
+	const struct ft_data *ftd = font->data;
+
+	return bold ? ftd->bold.path : ftd->regular.path;
 }
 
 struct kmscon_font_ops kmscon_font_freetype_ops = {
@@ -532,4 +718,5 @@ struct kmscon_font_ops kmscon_font_freetype_ops = {
 	.destroy = kmscon_font_freetype_destroy,
 	.has_glyph = kmscon_font_freetype_has_glyph,
 	.render = kmscon_font_freetype_render,
+	.get_file = kmscon_font_freetype_get_file,
 };
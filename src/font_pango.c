@@ -41,9 +41,28 @@
  * italic/bold fonts correctly and more.
  * However, this also means it pulls in a lot of dependencies including glib,
  * pango, freetype2 and more.
+ *
+ * Pango objects must not be used by two threads at once. Instead of rendering
+ * under one global lock, every thread that renders glyphs of a face gets its
+ * own font map, context and layout for it, which are reused for all of its
+ * glyphs. The global lock is only taken to create and destroy those.
+ * A thread finds them in its own list, so no other thread touches it. They
+ * keep their face alive; once it is destroyed they are dropped the next time
+ * the thread needs a new one, or when it exits.
+ *
+ * Runs of cells are shaped as one line, see kmscon_font_shape(), so ligatures
+ * and the contextual forms of complex scripts can span cells. Each cluster is
+ * moved onto the cells of its characters. Cells that show the nominal glyph of
+ * their codepoint are left to the glyph of their own; the others get an id that
+ * names the run and their place in it, and are rendered by drawing the whole
+ * line clipped to their cell. Every face keeps the runs it shaped in an LRU
+ * cache, keyed by a hash of the codepoints and the style, so a run that is
+ * drawn again is not shaped again. A run that was dropped before one of its
+ * cells was rendered shows the glyph of that cell on its own.
  */
 
 #include <glib.h>
+#include <hb.h>
 #include <libtsm.h>
 #include <pango/pango.h>
 #include <pango/pangoft2.h>
@@ -52,21 +71,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include "font.h"
+#include "shl_dlist.h"
 #include "shl_log.h"
+#include "shl_lru.h"
 #include "uterm_video.h"
 
 #define LOG_SUBSYSTEM "font_pango"
 
+/* runs each face remembers, shaped or not */
+#define RUN_CACHE_SIZE 4096
+
+/* ids of shaped cells carry the key of their run and their place in it */
+#define RUN_KEY_MASK ((1ULL << 55) - 1)
+#define RUN_ID(key, idx) (KMSCON_GLYPH_RUN_ID | (key) << 8 | (idx))
+#define RUN_ID_KEY(id) (((id) >> 8) & RUN_KEY_MASK)
+#define RUN_ID_CELL(id) ((id) & 0xff)
+
+/* a run of cells shaped at once; freed by the LRU cache */
+struct run {
+	unsigned int style;
+	size_t num;
+	uint8_t shaped[KMSCON_FONT_MAX_RUN / 8]; /* a bit for each cell */
+	uint32_t ch[];
+};
+
 struct face {
 	struct kmscon_font_attr attr;
 	struct kmscon_font_attr real_attr;
 	unsigned int baseline;
+	PangoFontDescription *desc;
+	unsigned long ref; /* the font and each face_thread, under manager_mutex */
+	bool dead;	   /* the font is gone, under manager_mutex */
+	pthread_mutex_t run_lock;
+	struct shl_lru *runs; /* struct run by key, under run_lock */
+};
+
+/* what one thread renders the glyphs of a face with */
+struct face_thread {
+	struct shl_dlist list; /* in the list of the thread */
+	struct face *face;
+	PangoFontMap *map;
 	PangoContext *ctx;
+	PangoLayout *layout;
+	PangoAttrList *attrs[KMSCON_GLYPH_STYLES];
 };
 
 static pthread_mutex_t manager_mutex = PTHREAD_MUTEX_INITIALIZER;
 static unsigned long manager__refcnt;
 static PangoFontMap *manager__lib;
+/* the struct shl_dlist of face_thread objects of each thread */
+static pthread_key_t manager_thread_key;
+static pthread_once_t manager_thread_once = PTHREAD_ONCE_INIT;
+static int manager_thread_err;
 
 static void manager_lock()
 {
@@ -100,12 +156,194 @@ static void manager__unref()
 	}
 }
 
+static PangoContext *new_context(PangoFontMap *map, const PangoFontDescription *desc)
+{
+	PangoContext *ctx;
+
+	ctx = pango_font_map_create_context(map);
+	pango_context_set_base_dir(ctx, PANGO_DIRECTION_LTR);
+	pango_context_set_language(ctx, pango_language_get_default());
+	pango_context_set_font_description(ctx, desc);
+	return ctx;
+}
+
+static PangoLayout *new_layout(PangoContext *ctx)
+{
+	PangoLayout *layout;
+
+	layout = pango_layout_new(ctx);
+
+	/* render one line only */
+	pango_layout_set_height(layout, 0);
+
+	/* no line spacing */
+	pango_layout_set_spacing(layout, 0);
+
+	return layout;
+}
+
+static void face__unref(struct face *face)
+{
+	if (--face->ref)
+		return;
+
+	shl_lru_free(face->runs);
+	pthread_mutex_destroy(&face->run_lock);
+	pango_font_description_free(face->desc);
+	free(face);
+}
+
+static void face_thread__free(struct face_thread *thr)
+{
+	unsigned int i;
+
+	shl_dlist_unlink(&thr->list);
+	for (i = 0; i < sizeof(thr->attrs) / sizeof(*thr->attrs); ++i) {
+		if (thr->attrs[i])
+			pango_attr_list_unref(thr->attrs[i]);
+	}
+	g_object_unref(thr->layout);
+	g_object_unref(thr->ctx);
+	g_object_unref(thr->map);
+	face__unref(thr->face);
+	free(thr);
+}
+
+/* destructor of manager_thread_key, runs in the exiting thread */
+static void manager_thread_exit(void *data)
+{
+	struct shl_dlist *head = data;
+
+	manager_lock();
+	while (!shl_dlist_empty(head))
+		face_thread__free(shl_dlist_first(head, struct face_thread, list));
+	manager_unlock();
+	free(head);
+}
+
+static void manager_thread_init(void)
+{
+	manager_thread_err = pthread_key_create(&manager_thread_key, manager_thread_exit);
+	if (manager_thread_err)
+		log_error("cannot create thread key");
+}
+
+static struct face_thread *face_get_thread(struct face *face)
+{
+	struct shl_dlist *head, *iter, *tmp;
+	struct face_thread *thr, *old;
+
+	pthread_once(&manager_thread_once, manager_thread_init);
+	if (manager_thread_err)
+		return NULL;
+
+	head = pthread_getspecific(manager_thread_key);
+	if (head) {
+		shl_dlist_for_each(iter, head) {
+			thr = shl_dlist_entry(iter, struct face_thread, list);
+			if (thr->face == face)
+				return thr;
+		}
+	} else {
+		head = malloc(sizeof(*head));
+		if (!head)
+			return NULL;
+		shl_dlist_init(head);
+		if (pthread_setspecific(manager_thread_key, head)) {
+			free(head);
+			return NULL;
+		}
+	}
+
+	thr = malloc(sizeof(*thr));
+	if (!thr)
+		return NULL;
+	memset(thr, 0, sizeof(*thr));
+
+	manager_lock();
+
+	/* drop what this thread has of destroyed faces */
+	shl_dlist_for_each_safe(iter, tmp, head) {
+		old = shl_dlist_entry(iter, struct face_thread, list);
+		if (old->face->dead)
+			face_thread__free(old);
+	}
+
+	thr->map = pango_ft2_font_map_new();
+	if (!thr->map) {
+		manager_unlock();
+		log_warn("cannot create font map");
+		free(thr);
+		return NULL;
+	}
+	thr->ctx = new_context(thr->map, face->desc);
+	thr->layout = new_layout(thr->ctx);
+	thr->face = face;
+	++face->ref;
+	shl_dlist_link(head, &thr->list);
+
+	manager_unlock();
+
+	return thr;
+}
+
+/* the attributes of @style, made once per thread and style */
+static PangoAttrList *face_thread_attrs(struct face_thread *thr, unsigned int style)
+{
+	unsigned int idx = style % KMSCON_GLYPH_STYLES;
+	PangoAttrList *attrlist = thr->attrs[idx];
+
+	if (attrlist)
+		return attrlist;
+
+	attrlist = pango_attr_list_new();
+	pango_attr_list_insert(attrlist, pango_attr_underline_new(style & KMSCON_GLYPH_UNDERLINE ?
+									  PANGO_UNDERLINE_SINGLE :
+									  PANGO_UNDERLINE_NONE));
+	pango_attr_list_insert(attrlist, pango_attr_style_new(style & KMSCON_GLYPH_ITALIC ?
+								      PANGO_STYLE_ITALIC :
+								      PANGO_STYLE_NORMAL));
+	pango_attr_list_insert(attrlist, pango_attr_weight_new(style & KMSCON_GLYPH_BOLD ?
+								       PANGO_WEIGHT_BOLD :
+								       PANGO_WEIGHT_NORMAL));
+	thr->attrs[idx] = attrlist;
+	return attrlist;
+}
+
+/* a blank glyph of @cwidth cells and a bitmap to render into it */
+static struct kmscon_glyph *new_glyph(struct face *face, unsigned int cwidth, FT_Bitmap *bitmap)
+{
+	struct kmscon_glyph *glyph;
+	size_t size = cwidth * face->real_attr.width * face->real_attr.height;
+
+	glyph = malloc(sizeof(*glyph) + size);
+	if (!glyph) {
+		log_error("cannot allocate memory for new glyph");
+		return NULL;
+	}
+	memset(glyph, 0, sizeof(*glyph) + size);
+
+	glyph->double_width = cwidth == 2;
+	glyph->buf.width = face->real_attr.width * cwidth;
+	glyph->buf.height = face->real_attr.height;
+	glyph->buf.stride = glyph->buf.width;
+
+	bitmap->rows = glyph->buf.height;
+	bitmap->width = glyph->buf.width;
+	bitmap->pitch = glyph->buf.stride;
+	bitmap->num_grays = 256;
+	bitmap->pixel_mode = FT_PIXEL_MODE_GRAY;
+	bitmap->buffer = glyph->buf.data;
+
+	return glyph;
+}
+
 static struct kmscon_glyph *get_glyph(struct face *face, uint64_t id, const uint32_t *ch,
-				      size_t len, const struct kmscon_font_attr *attr)
+				      size_t len, unsigned int style)
 {
 	struct kmscon_glyph *glyph = NULL;
+	struct face_thread *thr;
 	PangoLayout *layout;
-	PangoAttrList *attrlist;
 	PangoRectangle rec, logical_rec;
 	PangoLayoutLine *line;
 	FT_Bitmap bitmap;
@@ -119,50 +357,23 @@ static struct kmscon_glyph *get_glyph(struct face *face, uint64_t id, const uint
 	if (!cwidth)
 		return NULL;
 
-	manager_lock();
-
-	layout = pango_layout_new(face->ctx);
-	attrlist = pango_layout_get_attributes(layout);
-	if (attrlist == NULL) {
-		attrlist = pango_attr_list_new();
-		pango_layout_set_attributes(layout, attrlist);
-		pango_attr_list_unref(attrlist);
-	}
-
-	/* render one line only */
-	pango_layout_set_height(layout, 0);
-
-	/* no line spacing */
-	pango_layout_set_spacing(layout, 0);
-
-	/* underline if requested */
-	if (attr->underline)
-		pango_attr_list_change(attrlist, pango_attr_underline_new(PANGO_UNDERLINE_SINGLE));
-	else
-		pango_attr_list_change(attrlist, pango_attr_underline_new(PANGO_UNDERLINE_NONE));
-
-	/* italic if requested */
-	if (attr->italic)
-		pango_attr_list_change(attrlist, pango_attr_style_new(PANGO_STYLE_ITALIC));
-	else
-		pango_attr_list_change(attrlist, pango_attr_style_new(PANGO_STYLE_NORMAL));
+	thr = face_get_thread(face);
+	if (!thr)
+		return NULL;
 
-	/* bold if requested */
-	if (attr->bold)
-		pango_attr_list_change(attrlist, pango_attr_weight_new(PANGO_WEIGHT_BOLD));
-	else
-		pango_attr_list_change(attrlist, pango_attr_weight_new(PANGO_WEIGHT_NORMAL));
+	layout = thr->layout;
+	pango_layout_set_attributes(layout, face_thread_attrs(thr, style));
 
 	val = tsm_ucs4_to_utf8_alloc(ch, len, &ulen);
 	if (!val)
-		goto out_layout;
+		return NULL;
 
 	pango_layout_set_text(layout, val, ulen);
 	free(val);
 
 	cnt = pango_layout_get_line_count(layout);
 	if (cnt == 0)
-		goto out_layout;
+		return NULL;
 
 	line = pango_layout_get_line_readonly(layout, 0);
 
@@ -172,31 +383,207 @@ static struct kmscon_glyph *get_glyph(struct face *face, uint64_t id, const uint
 	if (logical_rec.x + logical_rec.width > rec.x + face->real_attr.width)
 		cwidth = 2;
 
-	glyph = malloc(sizeof(*glyph) + cwidth * face->real_attr.width * face->real_attr.height);
-	if (!glyph) {
-		log_error("cannot allocate memory for new glyph");
-		goto out_unlock;
+	glyph = new_glyph(face, cwidth, &bitmap);
+	if (!glyph)
+		return NULL;
+
+	pango_ft2_render_layout_line(&bitmap, line, -rec.x, face->baseline);
+
+	return glyph;
+}
+
+static uint64_t run_key(const uint32_t *ch, size_t num, unsigned int style)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const uint8_t *p = (const uint8_t *)ch;
+	size_t i;
+
+	for (i = 0; i < num * sizeof(*ch); ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
 	}
-	memset(glyph, 0, sizeof(*glyph) + cwidth * face->real_attr.width * face->real_attr.height);
+	h ^= style;
+	h *= 0x100000001b3ULL;
 
-	glyph->double_width = cwidth == 2;
-	glyph->buf.width = face->real_attr.width * cwidth;
-	glyph->buf.height = face->real_attr.height;
-	glyph->buf.stride = glyph->buf.width;
+	return h & RUN_KEY_MASK;
+}
 
-	bitmap.rows = glyph->buf.height;
-	bitmap.width = glyph->buf.width;
-	bitmap.pitch = glyph->buf.stride;
-	bitmap.num_grays = 256;
-	bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
-	bitmap.buffer = glyph->buf.data;
+static bool run_shaped(const struct run *run, size_t idx)
+{
+	return run->shaped[idx / 8] & (1 << (idx % 8));
+}
 
-	pango_ft2_render_layout_line(&bitmap, line, -rec.x, face->baseline);
+/*
+ * Lays out the @num cells of @ch as one line of the layout of @thr and moves
+ * every cluster onto the cells of its characters, so the line is exactly as
+ * wide as the cells. The bits of @shaped are set for the cells that don't show
+ * the nominal glyph of their codepoint. Returns the line, which stays valid
+ * until the layout is used again, or NULL.
+ */
+static PangoLayoutLine *layout_run(struct face_thread *thr, const uint32_t *ch, size_t num,
+				   unsigned int style, uint8_t *shaped)
+{
+	PangoLayout *layout = thr->layout;
+	PangoLayoutLine *line;
+	PangoGlyphItemIter iter;
+	PangoGlyphItem *item;
+	PangoGlyphInfo *glyphs;
+	hb_codepoint_t nominal;
+	hb_font_t *hb;
+	const char *text;
+	GSList *l;
+	size_t ulen, base, i;
+	int lo, hi, g, width;
+	bool rtl, more, plain;
+	char *val;
+
+	val = tsm_ucs4_to_utf8_alloc(ch, num, &ulen);
+	if (!val)
+		return NULL;
+
+	pango_layout_set_attributes(layout, face_thread_attrs(thr, style));
+	pango_layout_set_text(layout, val, ulen);
+	free(val);
+
+	if (pango_layout_get_line_count(layout) != 1)
+		return NULL;
+
+	/* unlike the readonly one, this line may be changed */
+	line = pango_layout_get_line(layout, 0);
+	text = pango_layout_get_text(layout);
+	memset(shaped, 0, KMSCON_FONT_MAX_RUN / 8);
+
+	for (l = line->runs; l; l = l->next) {
+		item = l->data;
+		glyphs = item->glyphs->glyphs;
+		hb = pango_font_get_hb_font(item->item->analysis.font);
+		rtl = item->item->analysis.level % 2;
+		base = g_utf8_pointer_to_offset(text, text + item->item->offset);
+
+		for (more = pango_glyph_item_iter_init_start(&iter, item, text); more;
+		     more = pango_glyph_item_iter_next_cluster(&iter)) {
+			/* glyphs of the cluster in visual order, the characters
+			 * are counted from the start of the item */
+			lo = rtl ? iter.end_glyph + 1 : iter.start_glyph;
+			hi = rtl ? iter.start_glyph : iter.end_glyph - 1;
+			if (lo > hi || base + iter.end_char > num)
+				continue;
+
+			plain = !rtl && lo == hi && iter.end_char - iter.start_char == 1 &&
+				!glyphs[lo].geometry.x_offset && !glyphs[lo].geometry.y_offset &&
+				((glyphs[lo].glyph & PANGO_GLYPH_UNKNOWN_FLAG) ||
+				 (hb && hb_font_get_nominal_glyph(hb, ch[base + iter.start_char],
+								  &nominal) &&
+				  nominal == glyphs[lo].glyph));
+			if (!plain) {
+				for (i = base + iter.start_char; i < base + iter.end_char; ++i)
+					shaped[i / 8] |= 1 << (i % 8);
+			}
+
+			/* the last glyph ends the cluster at the end of its cells,
+			 * the others keep their places */
+			width = (iter.end_char - iter.start_char) * thr->face->real_attr.width *
+				PANGO_SCALE;
+			for (g = lo; g < hi; ++g)
+				width -= glyphs[g].geometry.width;
+			glyphs[hi].geometry.width = width;
+		}
+	}
+
+	return line;
+}
+
+/* the ids of the cells of @num codepoints of @ch shaped as a run */
+static int face_shape(struct face *face, const uint32_t *ch, size_t num, unsigned int style,
+		      uint64_t *ids)
+{
+	struct face_thread *thr;
+	struct run *run;
+	uint64_t key;
+	size_t i;
+	bool found;
+
+	key = run_key(ch, num, style);
+
+	pthread_mutex_lock(&face->run_lock);
+	run = shl_lru_get(face->runs, key);
+	if (run) {
+		/* another run with the same key is drawn as it is */
+		found = run->style == style && run->num == num &&
+			!memcmp(run->ch, ch, num * sizeof(*ch));
+		for (i = 0; i < num; ++i)
+			ids[i] = found && run_shaped(run, i) ? RUN_ID(key, i) : 0;
+	}
+	pthread_mutex_unlock(&face->run_lock);
+	if (run)
+		return 0;
+
+	thr = face_get_thread(face);
+	if (!thr)
+		return -ENOMEM;
+
+	run = malloc(sizeof(*run) + num * sizeof(*ch));
+	if (!run)
+		return -ENOMEM;
+	run->style = style;
+	run->num = num;
+	memcpy(run->ch, ch, num * sizeof(*ch));
+
+	if (!layout_run(thr, ch, num, style, run->shaped)) {
+		free(run);
+		return -EFAULT;
+	}
+	for (i = 0; i < num; ++i)
+		ids[i] = run_shaped(run, i) ? RUN_ID(key, i) : 0;
+
+	pthread_mutex_lock(&face->run_lock);
+	if (shl_lru_get(face->runs, key) || shl_lru_insert(face->runs, key, run))
+		free(run);
+	pthread_mutex_unlock(&face->run_lock);
+
+	return 0;
+}
+
+/* the part of a shaped run that falls on the cell of @id */
+static struct kmscon_glyph *get_run_glyph(struct face *face, uint64_t id, const uint32_t *ch,
+					  size_t len, unsigned int style)
+{
+	uint32_t run_ch[KMSCON_FONT_MAX_RUN];
+	uint8_t shaped[KMSCON_FONT_MAX_RUN / 8];
+	size_t idx = RUN_ID_CELL(id), num = 0;
+	struct kmscon_glyph *glyph;
+	struct face_thread *thr;
+	PangoLayoutLine *line;
+	struct run *run;
+	FT_Bitmap bitmap;
+
+	pthread_mutex_lock(&face->run_lock);
+	run = shl_lru_get(face->runs, RUN_ID_KEY(id));
+	if (run && run->style == style && idx < run->num && run_shaped(run, idx)) {
+		num = run->num;
+		memcpy(run_ch, run->ch, num * sizeof(*run_ch));
+	}
+	pthread_mutex_unlock(&face->run_lock);
+
+	if (!num)
+		return get_glyph(face, id, ch, len, style);
+
+	thr = face_get_thread(face);
+	if (!thr)
+		return NULL;
+
+	line = layout_run(thr, run_ch, num, style, shaped);
+	if (!line)
+		return NULL;
+
+	glyph = new_glyph(face, 1, &bitmap);
+	if (!glyph)
+		return NULL;
+
+	/* the line is clipped to the cell */
+	pango_ft2_render_layout_line(&bitmap, line, -(int)(idx * face->real_attr.width),
+				     face->baseline);
 
-out_layout:
-	g_object_unref(layout);
-out_unlock:
-	manager_unlock();
 	return glyph;
 }
 
@@ -253,6 +640,7 @@ static int manager_get_face(struct face **out, struct kmscon_font_attr *attr)
 {
 	struct face *face;
 	PangoFontDescription *desc;
+	PangoContext *ctx;
 	PangoLayout *layout;
 	PangoRectangle rec;
 	int ret, num;
@@ -273,9 +661,8 @@ static int manager_get_face(struct face **out, struct kmscon_font_attr *attr)
 	memset(face, 0, sizeof(*face));
 	memcpy(&face->attr, attr, sizeof(*attr));
 
-	face->ctx = pango_font_map_create_context(manager__lib);
-	pango_context_set_base_dir(face->ctx, PANGO_DIRECTION_LTR);
-	pango_context_set_language(face->ctx, pango_language_get_default());
+	face->ref = 1;
+	pthread_mutex_init(&face->run_lock, NULL);
 
 	desc = new_pango_description(attr->name);
 
@@ -287,13 +674,18 @@ static int manager_get_face(struct face **out, struct kmscon_font_attr *attr)
 	pango_font_description_set_variant(desc, PANGO_VARIANT_NORMAL);
 	pango_font_description_set_stretch(desc, PANGO_STRETCH_NORMAL);
 	pango_font_description_set_gravity(desc, PANGO_GRAVITY_SOUTH);
-	pango_context_set_font_description(face->ctx, desc);
-	pango_font_description_free(desc);
+	face->desc = desc;
+
+	face->runs = shl_lru_new(RUN_CACHE_SIZE);
+	if (!face->runs) {
+		log_error("cannot allocate memory for run cache");
+		ret = -ENOMEM;
+		goto err_face;
+	}
 
 	/* measure font */
-	layout = pango_layout_new(face->ctx);
-	pango_layout_set_height(layout, 0);
-	pango_layout_set_spacing(layout, 0);
+	ctx = new_context(manager__lib, desc);
+	layout = new_layout(ctx);
 	str = "abcdefghijklmnopqrstuvwxyz"
 	      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 	      "@!\"$%&/()=?\\}][{°^~+*#'<>|-_.:,;`´";
@@ -307,6 +699,7 @@ static int manager_get_face(struct face **out, struct kmscon_font_attr *attr)
 	face->real_attr.width = rec.width / num + 1;
 	face->baseline = PANGO_PIXELS_CEIL(pango_layout_get_baseline(layout));
 	g_object_unref(layout);
+	g_object_unref(ctx);
 
 	if (!face->real_attr.height || !face->real_attr.width) {
 		log_warning("invalid scaled font sizes");
@@ -318,8 +711,7 @@ static int manager_get_face(struct face **out, struct kmscon_font_attr *attr)
 	goto out_unlock;
 
 err_face:
-	g_object_unref(face->ctx);
-	free(face);
+	face__unref(face);
 err_manager:
 	manager__unref();
 out_unlock:
@@ -368,22 +760,32 @@ static void kmscon_font_pango_destroy(struct kmscon_font *font)
 
 	manager_lock();
 
-	g_object_unref(face->ctx);
-	free(face);
+	face->dead = true;
+	face__unref(face);
 	manager__unref();
 
 	manager_unlock();
 }
 
-static bool kmscon_font_pango_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len)
+static bool kmscon_font_pango_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len,
+					unsigned int style)
 {
 	return true;
 }
 
 static struct kmscon_glyph *kmscon_font_pango_render(struct kmscon_font *font, uint64_t id,
-						     const uint32_t *ch, size_t len)
+						     const uint32_t *ch, size_t len,
+						     unsigned int style)
+{
+	if (id & KMSCON_GLYPH_RUN_ID)
+		return get_run_glyph(font->data, id, ch, len, style);
+	return get_glyph(font->data, id, ch, len, style);
+}
+
+static int kmscon_font_pango_shape(struct kmscon_font *font, const uint32_t *ch, size_t num,
+				   unsigned int style, uint64_t *ids)
 {
-	return get_glyph(font->data, id, ch, len, &font->attr);
+	return face_shape(font->data, ch, num, style, ids);
 }
 
 struct kmscon_font_ops kmscon_font_pango_ops = {
@@ -393,4 +795,5 @@ struct kmscon_font_ops kmscon_font_pango_ops = {
 	.destroy = kmscon_font_pango_destroy,
 	.has_glyph = kmscon_font_pango_has_glyph,
 	.render = kmscon_font_pango_render,
+	.shape = kmscon_font_pango_shape,
 };
@@ -36,6 +36,14 @@
  *   http://unifoundry.com/unifont.html
  *
  * This file is heavily based on font_8x16.c
+ *
+ * The glyph data is split into chunks of 256 codepoints that are compressed on
+ * their own, see genunifont.c. A chunk is decompressed the first time one of
+ * its glyphs is rendered and kept until the last unifont font is destroyed, so
+ * a session only pays for the scripts it shows. Chunks stored uncompressed are
+ * used in place, straight from the mapped module.
+ * Glyphs are found through a table indexed by the page of the codepoint and the
+ * bitmaps of its chunk, so neither has_glyph() nor a cache miss has to search.
  */
 
 #include <libtsm.h>
@@ -51,70 +59,93 @@
 
 #define LOG_SUBSYSTEM "font_unifont"
 
-/*
- * We regroup all glyphs into blocks, of contiguous codepoints, and same width.
- * This allows to better pack the data, and handle some codepoints that are
- * not in the 0xffff range
- */
-struct unifont_glyph_block {
-	uint32_t codepoint; // First codepoint of the block
-	uint32_t offset;    // offset of the data
-	uint16_t len;	    // number of glyph in this block
-	uint8_t cwidth;	    // glyph width (1 or 2 for double-width glyph)
+/* pages of 256 codepoints, each one has its own chunk, see genunifont.c */
+#define UNIFONT_PAGES (0x110000 / 256)
+#define UNIFONT_NO_CHUNK 0xffff
+
+struct unifont_chunk {
+	uint32_t offset;     // offset of the data in the file
+	uint32_t size;	     // size of the stored data
+	uint32_t len;	     // size of the data once uncompressed, same as size if stored
+	uint64_t present[4]; // bitmap of the codepoints with a glyph
+	uint64_t wide[4];    // bitmap of the double-width glyphs
 } __attribute__((__packed__));
 
-struct unifont_data {
-	unsigned char *font_data;
-	unsigned long len;
-};
+struct unifont_header {
+	uint32_t n_chunks;
+	uint16_t pages[UNIFONT_PAGES]; // chunk of each page or UNIFONT_NO_CHUNK
+} __attribute__((__packed__));
+
+/* shared by all unifont fonts, protected by @unifont_lock */
+static pthread_mutex_t unifont_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long unifont_users;
+static const struct unifont_header *unifont_hdr;
+static const struct unifont_chunk *unifont_chunks;
+static const uint8_t **unifont_cache;
 
-static uint8_t apply_attr(uint8_t c, const struct kmscon_font_attr *attr, bool last_line)
+static uint8_t apply_style(uint8_t c, unsigned int style, bool last_line)
 {
-	if (attr->bold)
+	if (style & KMSCON_GLYPH_BOLD)
 		c |= c >> 1;
-	if (attr->underline && last_line)
+	if ((style & KMSCON_GLYPH_UNDERLINE) && last_line)
 		c = 0xff;
 	return c;
 }
 
-static uint8_t unfold(uint8_t val)
+/* stretches each of the 8 pixels of @c to @scale pixels, that is @scale bytes */
+static void scale_byte(uint8_t *dst, uint8_t c, int scale)
 {
-	return 0xff * !!val;
+	int j;
+
+	if (scale == 1) {
+		*dst = c;
+		return;
+	}
+
+	memset(dst, 0, scale);
+	for (j = 0; j < 8 * scale; j++) {
+		if (c & (0x80 >> (j / scale)))
+			dst[j / 8] |= 0x80 >> (j % 8);
+	}
 }
 
-static bool is_in_block(const struct unifont_glyph_block *idx, uint32_t ch)
+/* the chunk with the glyph of @ch, or NULL if there is none */
+static const struct unifont_chunk *lookup_chunk(uint32_t ch)
 {
-	return (ch >= idx->codepoint && ch < idx->codepoint + idx->len);
+	const struct unifont_chunk *chunk;
+	uint16_t idx;
+
+	if (ch >= UNIFONT_PAGES * 256)
+		return NULL;
+
+	idx = unifont_hdr->pages[ch / 256];
+	if (idx == UNIFONT_NO_CHUNK)
+		return NULL;
+
+	chunk = &unifont_chunks[idx];
+	ch %= 256;
+	if (!(chunk->present[ch / 64] & (1ULL << (ch % 64))))
+		return NULL;
+	return chunk;
 }
 
-static int lookup_block(const struct unifont_glyph_block *blocks, uint32_t len, uint32_t ch)
+/* glyphs before @idx, double-width ones count twice; the table is packed */
+static unsigned int count_before(const struct unifont_chunk *chunk, unsigned int idx)
 {
-	int look = 1 + ((ch * len) / 0xffff); /* opportunist first look*/
-	int min = 0;
-	int max = len - 1;
-
-	if (look > max)
-		look = max;
-
-	while (min < max) {
-		if (is_in_block(&blocks[look], ch))
-			return look;
-
-		if (ch < blocks[look].codepoint) {
-			max = look - 1;
-			look = min + (max - min) / 2;
-		} else {
-			min = look + 1;
-			look = max - (max - min) / 2;
-		}
-	}
-	if (is_in_block(&blocks[look], ch))
-		return look;
-	return -1;
+	unsigned int i, n = 0;
+	uint64_t mask;
+
+	for (i = 0; i < idx / 64; ++i)
+		n += __builtin_popcountll(chunk->present[i]) + __builtin_popcountll(chunk->wide[i]);
+
+	mask = (1ULL << (idx % 64)) - 1;
+	n += __builtin_popcountll(chunk->present[i] & mask);
+	n += __builtin_popcountll(chunk->wide[i] & mask);
+	return n;
 }
 
-static struct kmscon_glyph *new_glyph(const struct kmscon_font_attr *attr, const uint8_t *data,
-				      int cwidth)
+static struct kmscon_glyph *new_glyph(const struct kmscon_font_attr *attr, unsigned int style,
+				      const uint8_t *data, int cwidth)
 {
 	struct kmscon_glyph *g;
 	uint8_t c;
@@ -122,29 +153,24 @@ static struct kmscon_glyph *new_glyph(const struct kmscon_font_attr *attr, const
 	int i, j, k;
 	int off = 0;
 
+	/* glyphs stay at one bit per pixel, each scaled row is @scale bytes */
 	scale = attr->height / 16;
-	g = malloc(sizeof(*g) + cwidth * attr->width * attr->height);
+	g = malloc(sizeof(*g) + cwidth * scale * attr->height);
 	if (!g)
 		return NULL;
 	memset(g, 0, sizeof(*g));
 	g->double_width = (cwidth == 2);
 	g->buf.width = cwidth * attr->width;
 	g->buf.height = attr->height;
-	g->buf.stride = g->buf.width;
+	g->buf.stride = cwidth * scale;
+	g->buf.format = UTERM_FORMAT_MONO;
 
-	/* Unpack the glyph and apply scaling */
+	/* Apply the style and scaling */
 	for (i = 0; i < 16; i++) {
-		c = apply_attr(data[cwidth * i], attr, i == 15);
-		for (j = 0; j < g->buf.width / cwidth; j++) {
-			k = j / scale;
-			g->buf.data[off++] = unfold(c & (1 << (7 - k)));
-		}
-		if (g->double_width) {
-			c = apply_attr(data[cwidth * i + 1], attr, i == 15);
-			for (j = 0; j < g->buf.width / cwidth; j++) {
-				k = j / scale;
-				g->buf.data[off++] = unfold(c & (1 << (7 - k)));
-			}
+		for (j = 0; j < cwidth; j++) {
+			c = apply_style(data[cwidth * i + j], style, i == 15);
+			scale_byte(&g->buf.data[off], c, scale);
+			off += scale;
 		}
 		for (k = 1; k < scale; k++) {
 			memcpy(&g->buf.data[off], &g->buf.data[i * scale * g->buf.stride],
@@ -155,53 +181,118 @@ static struct kmscon_glyph *new_glyph(const struct kmscon_font_attr *attr, const
 	return g;
 }
 
-static bool kmscon_font_unifont_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len)
+static bool kmscon_font_unifont_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len,
+					  unsigned int style)
+{
+	return lookup_chunk(*ch);
+}
+
+static bool chunk_is_stored(const struct unifont_chunk *chunk)
 {
-	struct unifont_data *uf = font->data;
-	uint32_t block_len;
-	const struct unifont_glyph_block *blocks;
+	return chunk->size == chunk->len;
+}
 
-	/* First the length of the block index */
-	block_len = *((uint32_t *)uf->font_data);
-	/* Then the block index */
-	blocks = (struct unifont_glyph_block *)(uf->font_data + 4);
+static const uint8_t *get_chunk(const struct unifont_chunk *chunk)
+{
+	unsigned int idx = chunk - unifont_chunks;
+	unsigned long len = chunk->len;
+	uint8_t *data;
+
+	if (chunk_is_stored(chunk))
+		return (const uint8_t *)_binary_font_unifont_data_start + chunk->offset;
+
+	pthread_mutex_lock(&unifont_lock);
+	if (unifont_cache[idx])
+		goto out;
+
+	data = malloc(len);
+	if (!data)
+		goto out;
+
+	if (uncompress(data, &len, (const unsigned char *)_binary_font_unifont_data_start +
+				     chunk->offset, chunk->size) != Z_OK ||
+	    len != chunk->len) {
+		log_warning("cannot decompress unifont chunk %u", idx);
+		free(data);
+		goto out;
+	}
+	unifont_cache[idx] = data;
 
-	return lookup_block(blocks, block_len, *ch) >= 0;
+out:
+	data = (uint8_t *)unifont_cache[idx];
+	pthread_mutex_unlock(&unifont_lock);
+	return data;
 }
 
-static struct kmscon_glyph *find_glyph(uint64_t id, const struct kmscon_font *font)
+static struct kmscon_glyph *find_glyph(uint64_t id, const struct kmscon_font *font,
+				       unsigned int style)
 {
-	struct unifont_data *uf = font->data;
 	uint32_t ch = id & TSM_UCS4_MAX;
+	const struct unifont_chunk *chunk;
 	const uint8_t *data;
-	uint32_t len;
-	const struct unifont_glyph_block *blocks;
-
-	/* First the length of the block index */
-	len = *((uint32_t *)uf->font_data);
-	/* Then the block index */
-	blocks = (struct unifont_glyph_block *)(uf->font_data + 4);
-	/* Then the glyph data */
-	data = (uint8_t *)uf->font_data + 4 + len * sizeof(struct unifont_glyph_block);
-
-	int idx = lookup_block(blocks, len, ch);
-	if (idx < 0)
+	unsigned int idx, cwidth;
+	uint32_t off;
+
+	chunk = lookup_chunk(ch);
+	if (!chunk)
 		return NULL;
 
-	data += blocks[idx].offset + (ch - blocks[idx].codepoint) * blocks[idx].cwidth * 16;
-	if (data + 16 * blocks[idx].cwidth > uf->font_data + uf->len) {
-		log_warning("glyph out of range %p %p", data, uf->font_data + uf->len);
+	/* glyphs are stored in order, double-width ones take 32 bytes */
+	idx = ch % 256;
+	off = count_before(chunk, idx) * 16;
+	cwidth = (chunk->wide[idx / 64] & (1ULL << (idx % 64))) ? 2 : 1;
+	if (off + 16 * cwidth > chunk->len) {
+		log_warning("glyph out of range %u %u", off, chunk->len);
 		return NULL;
 	}
 
-	return new_glyph(&font->attr, data, blocks[idx].cwidth);
+	data = get_chunk(chunk);
+	if (!data)
+		return NULL;
+
+	return new_glyph(&font->attr, style, data + off, cwidth);
+}
+
+/* checks that the index and every chunk are within the embedded data */
+static int load_index(void)
+{
+	const struct unifont_header *hdr;
+	size_t size = _binary_font_unifont_data_size, off;
+	uint32_t i;
+
+	if (size < sizeof(*hdr))
+		return -EINVAL;
+
+	hdr = (const struct unifont_header *)_binary_font_unifont_data_start;
+	off = sizeof(*hdr) + (size_t)hdr->n_chunks * sizeof(*unifont_chunks);
+	if (off > size)
+		return -EINVAL;
+
+	for (i = 0; i < UNIFONT_PAGES; ++i) {
+		if (hdr->pages[i] != UNIFONT_NO_CHUNK && hdr->pages[i] >= hdr->n_chunks)
+			return -EINVAL;
+	}
+
+	unifont_chunks = (const struct unifont_chunk *)(hdr + 1);
+	for (i = 0; i < hdr->n_chunks; ++i) {
+		if (unifont_chunks[i].offset < off ||
+		    unifont_chunks[i].offset + (size_t)unifont_chunks[i].size > size)
+			return -EINVAL;
+	}
+
+	unifont_cache = calloc(hdr->n_chunks, sizeof(*unifont_cache));
+	if (!unifont_cache)
+		return -ENOMEM;
+
+	unifont_hdr = hdr;
+	return 0;
 }
 
 static int kmscon_font_unifont_init(struct kmscon_font *out, const struct kmscon_font_attr *attr)
 {
 	static const char name[] = "static-unifont";
-	struct unifont_data *uf;
 	unsigned int scale;
+	int ret = 0;
 
 	log_debug("loading static unifont font");
 	if (_binary_font_unifont_data_size == 0) {
@@ -209,19 +300,17 @@ static int kmscon_font_unifont_init(struct kmscon_font *out, const struct kmscon
 		return -EINVAL;
 	}
 
-	uf = malloc(sizeof(*uf));
-	if (!uf)
-		return -ENOMEM;
-
-	uf->len = *((uint32_t *)_binary_font_unifont_data_start);
-	uf->font_data = malloc(uf->len);
-	if (!uf->font_data)
-		goto err_free;
-
-	if (uncompress(uf->font_data, &uf->len,
-		       (unsigned char *)_binary_font_unifont_data_start + 4,
-		       _binary_font_unifont_data_size - 4) != Z_OK)
-		goto err_free_data;
+	pthread_mutex_lock(&unifont_lock);
+	if (!unifont_users) {
+		ret = load_index();
+		if (ret)
+			log_error("invalid unifont glyph information in binary (%d)", ret);
+	}
+	if (!ret)
+		++unifont_users;
+	pthread_mutex_unlock(&unifont_lock);
+	if (ret)
+		return ret;
 
 	memset(&out->attr, 0, sizeof(out->attr));
 	memcpy(out->attr.name, name, sizeof(name));
@@ -235,33 +324,33 @@ static int kmscon_font_unifont_init(struct kmscon_font *out, const struct kmscon
 	out->attr.width = 8 * scale;
 	out->attr.height = 16 * scale;
 	out->increase_step = 16;
-	out->data = uf;
 
 	return 0;
-
-err_free_data:
-	free(uf->font_data);
-err_free:
-	free(uf);
-	return -EFAULT;
 }
 
 static void kmscon_font_unifont_destroy(struct kmscon_font *font)
 {
-	struct unifont_data *uf = font->data;
+	uint32_t i;
 
 	log_debug("unloading static unifont font");
-	free(uf->font_data);
-	free(uf);
+	pthread_mutex_lock(&unifont_lock);
+	if (!--unifont_users) {
+		for (i = 0; i < unifont_hdr->n_chunks; ++i)
+			free((void *)unifont_cache[i]);
+		free(unifont_cache);
+		unifont_cache = NULL;
+	}
+	pthread_mutex_unlock(&unifont_lock);
 }
 
 static struct kmscon_glyph *kmscon_font_unifont_render(struct kmscon_font *font, uint64_t id,
-						       const uint32_t *ch, size_t len)
+						       const uint32_t *ch, size_t len,
+						       unsigned int style)
 {
 	if (len > 1)
 		return NULL;
 
-	return find_glyph(id, font);
+	return find_glyph(id, font, style);
 }
 
 struct kmscon_font_ops kmscon_font_unifont_ops = {
@@ -28,6 +28,14 @@
  * Unifont Generator
  * This converts the hex-encoded Unifont data into a C-array that is used by the
  * unifont-font-renderer.
+ * Glyphs are stored in chunks of 256 codepoints, each of them compressed on its
+ * own, so the renderer only decompresses the chunks that are actually used.
+ * The file starts with a header and a table with the chunk of each page of 256
+ * codepoints, then the chunk table and the data of all chunks. The chunk table
+ * has a bitmap of the glyphs of the page and one of its double-width glyphs, so
+ * a glyph is found with two array lookups and its offset is the number of
+ * bits set before it. A chunk that doesn't get smaller is stored uncompressed
+ * and used in place.
  */
 
 #include <errno.h>
@@ -39,6 +47,10 @@
 
 #define MAX_DATA_SIZE 255
 
+/* pages of 256 codepoints, each one has its own chunk */
+#define UNIFONT_PAGES (0x110000 / 256)
+#define UNIFONT_NO_CHUNK 0xffff
+
 struct unifont_glyph {
 	struct unifont_glyph *next;
 	uint32_t codepoint;
@@ -46,16 +58,17 @@ struct unifont_glyph {
 	char data[MAX_DATA_SIZE];
 };
 
-/*
- * We regroup all glyphs into blocks, of contiguous codepoints, and same width.
- * This allows to better pack the data, and handle some codepoints that are
- * not in the 0xffff range
- */
-struct unifont_glyph_block {
-	uint32_t codepoint; // First codepoint of the block
-	uint32_t offset;    // offset of the data
-	uint16_t len;	    // number of glyph in this block
-	uint8_t cwidth;	    // glyph width (1 or 2 for double-width glyph)
+struct unifont_chunk {
+	uint32_t offset;     // offset of the data in the file
+	uint32_t size;	     // size of the stored data
+	uint32_t len;	     // size of the data once uncompressed, same as size if stored
+	uint64_t present[4]; // bitmap of the codepoints with a glyph
+	uint64_t wide[4];    // bitmap of the double-width glyphs
+} __attribute__((__packed__));
+
+struct unifont_header {
+	uint32_t n_chunks;
+	uint16_t pages[UNIFONT_PAGES]; // chunk of each page or UNIFONT_NO_CHUNK
 } __attribute__((__packed__));
 
 static uint8_t hex_val(char c)
@@ -107,117 +120,89 @@ static uint8_t get_width(int len)
 	return 0;
 }
 
-static void compress_and_write(unsigned char *buf, unsigned long size, FILE *out)
+/* packs the glyphs of the page of @g, returns the first glyph of the next page */
+static struct unifont_glyph *pack_page(struct unifont_glyph *g, struct unifont_chunk *chunk,
+				       unsigned char *buf)
 {
-	unsigned char *zbuf;
-	unsigned long zlen = size;
-	uint32_t uncompressed_size;
+	uint32_t page = g->codepoint / 256;
+	unsigned int i, idx, off = 0, cwidth;
 
-	zbuf = malloc(zlen);
-	if (!zbuf)
-		return;
+	memset(chunk, 0, sizeof(*chunk));
+	for (; g && g->codepoint / 256 == page; g = g->next) {
+		cwidth = get_width(g->len);
+		if (!cwidth)
+			continue;
 
-	compress(zbuf, &zlen, buf, size);
-	fprintf(stderr, "genuifont: compressed %ld to %ld\n", size, zlen);
+		idx = g->codepoint % 256;
+		chunk->present[idx / 64] |= 1ULL << (idx % 64);
+		if (cwidth == 2)
+			chunk->wide[idx / 64] |= 1ULL << (idx % 64);
+		for (i = 0; i < g->len; i += 2)
+			buf[off++] = hex_val(g->data[i]) << 4 | hex_val(g->data[i + 1]);
+	}
 
-	uncompressed_size = size;
-	fwrite(&uncompressed_size, sizeof(uncompressed_size), 1, out);
-	fwrite(zbuf, zlen, 1, out);
-	free(zbuf);
+	chunk->len = off;
+	return g;
 }
 
-static struct unifont_glyph_block *gen_blocks(struct unifont_glyph *list, uint32_t *n_blocks)
+static void pack_glyph(struct unifont_glyph *list, FILE *out)
 {
+	static struct unifont_header hdr;
+	static struct unifont_chunk chunks[UNIFONT_PAGES];
+	static unsigned char *data[UNIFONT_PAGES];
+	/* 256 double-width glyphs */
+	unsigned char buf[256 * 32];
 	struct unifont_glyph *g = list;
-	struct unifont_glyph_block *blocks;
-	uint32_t i = 0;
-	int table_size = 256;
-	uint32_t offset = 0;
-
-	blocks = malloc(table_size * sizeof(*blocks));
-	if (!blocks) {
-		fprintf(stderr, "genunifont: out of memory\n");
-		return NULL;
-	}
+	unsigned long zlen, size = 0, stored = 0;
+	uint32_t offset, c, n = 0;
+
+	for (c = 0; c < UNIFONT_PAGES; ++c)
+		hdr.pages[c] = UNIFONT_NO_CHUNK;
 
-	blocks[i].len = 0;
-	blocks[i].offset = 0;
-	blocks[i].codepoint = g->codepoint;
-	blocks[i].cwidth = get_width(g->len);
 	while (g) {
-		if (blocks[i].cwidth == get_width(g->len) &&
-		    g->codepoint == blocks[i].codepoint + blocks[i].len) {
-			/* This glyph can fit in current block */
-			blocks[i].len++;
-		} else {
-			/* Start a new block with this glyph as first glyph */
-			offset += blocks[i].len * 16 * blocks[i].cwidth;
-			i++;
-			if (i >= table_size) {
-				table_size *= 2;
-				void *tmp = realloc(blocks, table_size * sizeof(*blocks));
-				if (!tmp) {
-					free(blocks);
-					return NULL;
-				}
-				blocks = tmp;
-			}
-			blocks[i].len = 1;
-			blocks[i].codepoint = g->codepoint;
-			blocks[i].cwidth = get_width(g->len);
-			blocks[i].offset = offset;
+		if (g->codepoint >= UNIFONT_PAGES * 256) {
+			fprintf(stderr, "genunifont: codepoint %x out of range\n", g->codepoint);
+			g = g->next;
+			continue;
 		}
-		g = g->next;
-	}
-	*n_blocks = i + 1;
-	return blocks;
-}
 
-static void pack_glyph(struct unifont_glyph *list, FILE *out)
-{
-	struct unifont_glyph *g;
-	struct unifont_glyph_block *blocks;
-	uint32_t n_blocks = 0;
-	uint32_t offset = 0;
-	unsigned char *buf;
-	uint32_t size;
-
-	blocks = gen_blocks(list, &n_blocks);
-	if (!blocks || !n_blocks)
-		return;
-
-	size = 4 + n_blocks * sizeof(*blocks);
-	for (g = list; g; g = g->next)
-		size += g->len / 2;
-
-	buf = malloc(size);
-	if (!buf) {
-		free(blocks);
-		return;
-	}
+		hdr.pages[g->codepoint / 256] = n;
+		g = pack_page(g, &chunks[n], buf);
 
-	*(uint32_t *)buf = n_blocks;
-	offset += 4;
-	memcpy(buf + offset, blocks, sizeof(*blocks) * n_blocks);
-	offset += sizeof(*blocks) * n_blocks;
-	for (g = list; g; g = g->next) {
-		uint8_t val;
-		int i;
-
-		for (i = 0; i < g->len; i += 2) {
-			val = hex_val(g->data[i]) << 4;
-			val |= hex_val(g->data[i + 1]);
-			buf[offset++] = val;
+		zlen = compressBound(chunks[n].len);
+		data[n] = malloc(zlen);
+		if (!data[n]) {
+			fprintf(stderr, "genunifont: out of memory\n");
+			goto out;
 		}
+
+		if (compress2(data[n], &zlen, buf, chunks[n].len, Z_BEST_COMPRESSION) != Z_OK ||
+		    zlen >= chunks[n].len) {
+			memcpy(data[n], buf, chunks[n].len);
+			zlen = chunks[n].len;
+		}
+		chunks[n].size = zlen;
+		size += chunks[n].len;
+		stored += zlen;
+		++n;
 	}
-	if (offset != size)
-		fprintf(stderr, "genunifont: wrong size\n");
 
-	free(blocks);
+	offset = sizeof(hdr) + n * sizeof(*chunks);
+	for (c = 0; c < n; ++c) {
+		chunks[c].offset = offset;
+		offset += chunks[c].size;
+	}
+	fprintf(stderr, "genunifont: compressed %lu to %lu in %u chunks\n", size, stored, n);
 
-	compress_and_write(buf, size, out);
+	hdr.n_chunks = n;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fwrite(chunks, sizeof(*chunks), n, out);
+	for (c = 0; c < n; ++c)
+		fwrite(data[c], chunks[c].size, 1, out);
 
-	free(buf);
+out:
+	for (c = 0; c < n; ++c)
+		free(data[c]);
 }
 
 static int parse_single_file(FILE *out, FILE *in)
@@ -0,0 +1,344 @@
+/*
+ * kmscon - Renderer Benchmark
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Renderer Benchmark
+ * The frames are fed through kmscon_text_draw_cb() with made-up tsm ages, so
+ * the renderers skip unchanged cells as they do for a real screen. Each frame
+ * is waited for with uterm_display_finish(), so GPU renderers count the time
+ * of the GPU, too.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kmscon_bench.h"
+#include "shl_log.h"
+#include "shl_timer.h"
+#include "text.h"
+
+#define LOG_SUBSYSTEM "bench"
+
+/* GPUs remembered in memory, more are timed again */
+#define BENCH_CACHE_SIZE 16
+
+struct bench_pick {
+	uint64_t key;
+	char name[32];
+};
+
+static pthread_mutex_t pick_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bench_pick picks[BENCH_CACHE_SIZE];
+static unsigned int pick_num;
+
+static uint64_t fnv1a_str(uint64_t h, const char *str)
+{
+	if (!str)
+		str = "";
+
+	do {
+		h ^= (uint8_t)*str;
+		h *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return h;
+}
+
+/* the GPU, the video backend and the candidates, in this order */
+static uint64_t pick_key(struct uterm_display *disp, const char *const *names, unsigned int num)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	h = fnv1a_str(h, uterm_display_get_gpu(disp));
+	h = fnv1a_str(h, uterm_display_backend_name(disp));
+	for (i = 0; i < num; ++i)
+		h = fnv1a_str(h, names[i]);
+
+	return h;
+}
+
+static const char *find_name(const char *name, const char *const *names, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; ++i) {
+		if (!strcmp(name, names[i]))
+			return names[i];
+	}
+
+	return NULL;
+}
+
+static const char *cache_get(uint64_t key, const char *const *names, unsigned int num)
+{
+	const char *ret = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&pick_lock);
+	for (i = 0; i < pick_num; ++i) {
+		if (picks[i].key == key) {
+			ret = find_name(picks[i].name, names, num);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pick_lock);
+
+	return ret;
+}
+
+static void cache_put(uint64_t key, const char *name)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pick_lock);
+	for (i = 0; i < pick_num; ++i) {
+		if (picks[i].key == key)
+			break;
+	}
+	if (i < BENCH_CACHE_SIZE) {
+		picks[i].key = key;
+		snprintf(picks[i].name, sizeof(picks[i].name), "%s", name);
+		if (i == pick_num)
+			++pick_num;
+	}
+	pthread_mutex_unlock(&pick_lock);
+}
+
+static void file_path(char *buf, size_t size, const char *dir, uint64_t key)
+{
+	snprintf(buf, size, "%s/%016" PRIx64 ".renderer", dir, key);
+}
+
+static const char *file_load(const char *dir, uint64_t key, const char *const *names,
+			     unsigned int num)
+{
+	char path[PATH_MAX], name[32];
+	FILE *f;
+	bool ok;
+
+	file_path(path, sizeof(path), dir, key);
+	f = fopen(path, "re");
+	if (!f) {
+		if (errno != ENOENT)
+			log_warning("cannot open renderer cache %s (%d): %m", path, errno);
+		return NULL;
+	}
+
+	ok = fgets(name, sizeof(name), f);
+	fclose(f);
+	if (!ok)
+		return NULL;
+
+	name[strcspn(name, "\n")] = 0;
+	return find_name(name, names, num);
+}
+
+/* written to a temporary file first, so a crash leaves no half of it */
+static void file_save(const char *dir, uint64_t key, const char *name)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	FILE *f;
+	bool ok;
+
+	file_path(path, sizeof(path), dir, key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "we");
+	if (!f) {
+		log_warning("cannot create renderer cache %s (%d): %m", tmp, errno);
+		return;
+	}
+
+	ok = fprintf(f, "%s\n", name) > 0;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp, path)) {
+		log_warning("cannot write renderer cache %s (%d): %m", path, errno);
+		unlink(tmp);
+	}
+}
+
+/*
+ * Draw a frame of letters that depend on the age of their cell, after giving
+ * the cells of @row, or all of them if it is UINT_MAX, the age @seq.
+ */
+static int bench_frame(struct kmscon_text *txt, struct uterm_display *disp, tsm_age_t *ages,
+		       tsm_age_t seq, unsigned int row)
+{
+	unsigned int cols = kmscon_text_get_cols(txt);
+	unsigned int rows = kmscon_text_get_rows(txt);
+	struct tsm_screen_attr attr, def;
+	unsigned int x, y;
+	tsm_age_t age;
+	uint32_t ch;
+	int ret;
+
+	memset(&def, 0, sizeof(def));
+	def.fccode = -1;
+	def.bccode = -1;
+	def.fr = def.fg = def.fb = 0xff;
+
+	ret = kmscon_text_prepare(txt, &def);
+	if (ret)
+		return ret;
+
+	for (y = 0; y < rows; ++y) {
+		for (x = 0; x < cols; ++x) {
+			if (row == UINT_MAX || row == y)
+				ages[y * cols + x] = seq;
+			age = ages[y * cols + x];
+
+			ch = 'A' + (x + y + age) % 26;
+			attr = def;
+			attr.fr = 0x40 + (age * 37) % 0xc0;
+			attr.bb = (x * 7 + age) % 0x40;
+			ret = kmscon_text_draw_cb(NULL, ch, &ch, 1, 1, x, y, &attr, age, txt);
+			if (ret)
+				goto err_abort;
+		}
+	}
+
+	ret = kmscon_text_render(txt);
+	if (ret)
+		return ret;
+
+	return uterm_display_finish(disp);
+
+err_abort:
+	kmscon_text_abort(txt);
+	return ret;
+}
+
+/* microseconds the frames take with renderer @name, after one untimed frame */
+static int bench_run(uint64_t *out, const char *name, struct uterm_display *disp,
+		     struct kmscon_font *font, const char *rotate)
+{
+	struct kmscon_text *txt;
+	tsm_age_t *ages, seq = 1;
+	uint64_t start;
+	unsigned int i, rows;
+	int ret;
+
+	ret = kmscon_text_new(&txt, name, rotate);
+	if (ret)
+		return ret;
+
+	ret = kmscon_text_set(txt, font, disp);
+	if (ret)
+		goto out_txt;
+
+	rows = kmscon_text_get_rows(txt);
+	ages = calloc((size_t)kmscon_text_get_cols(txt) * rows, sizeof(*ages));
+	if (!ages) {
+		ret = -ENOMEM;
+		goto out_txt;
+	}
+
+	ret = bench_frame(txt, disp, ages, seq++, UINT_MAX);
+
+	start = shl_timer_now();
+	for (i = 0; !ret && i < KMSCON_BENCH_FULL; ++i)
+		ret = bench_frame(txt, disp, ages, seq++, UINT_MAX);
+	for (i = 0; !ret && i < KMSCON_BENCH_PARTIAL; ++i)
+		ret = bench_frame(txt, disp, ages, seq++, i % rows);
+	*out = shl_timer_now() - start;
+
+	free(ages);
+out_txt:
+	kmscon_text_unref(txt);
+	return ret;
+}
+
+/**
+ * kmscon_bench_pick:
+ * @out: Set to the faster renderer, one of @names
+ * @disp: Display to time them on
+ * @font: Font of the terminal
+ * @rotate: Orientation of the terminal
+ * @names: Text renderers to choose from
+ * @num: Number of @names
+ *
+ * Each renderer in @names is timed on @disp, unless there is a pick for the
+ * GPU of @disp already. The display is redrawn completely by its next frame.
+ *
+ * Returns: 0 on success, or a negative error code if no renderer worked.
+ */
+int kmscon_bench_pick(const char **out, struct uterm_display *disp, struct kmscon_font *font,
+		      const char *rotate, const char *const *names, unsigned int num)
+{
+	const char *dir = uterm_display_get_shader_cache(disp);
+	const char *gpu = uterm_display_get_gpu(disp);
+	const char *best = NULL;
+	uint64_t key, usec, best_usec = 0;
+	unsigned int i;
+	int ret;
+
+	if (!out || !disp || !font || !names || !num)
+		return -EINVAL;
+
+	key = pick_key(disp, names, num);
+	best = cache_get(key, names, num);
+	if (!best && dir) {
+		best = file_load(dir, key, names, num);
+		if (best)
+			cache_put(key, best);
+	}
+	if (best) {
+		*out = best;
+		return 0;
+	}
+
+	for (i = 0; i < num; ++i) {
+		ret = bench_run(&usec, names[i], disp, font, rotate);
+		if (ret) {
+			log_warning("cannot time renderer %s on display %s: %d", names[i],
+				    uterm_display_name(disp), ret);
+			continue;
+		}
+
+		log_info("renderer %s took %" PRIu64 " us on display %s (%s)", names[i], usec,
+			 uterm_display_name(disp), gpu ? gpu : "unknown GPU");
+		if (!best || usec < best_usec) {
+			best = names[i];
+			best_usec = usec;
+		}
+	}
+
+	/* the back buffer holds our frames now */
+	uterm_display_set_need_redraw(disp);
+
+	if (!best)
+		return -ENODEV;
+
+	cache_put(key, best);
+	if (dir)
+		file_save(dir, key, best);
+
+	*out = best;
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * kmscon - Renderer Benchmark
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Renderer Benchmark
+ * Which text renderer is faster on a display depends on the GPU and its
+ * driver, so with --renderer=auto each candidate draws a few synthetic frames
+ * into the back buffer when a terminal gets the display: full frames with
+ * every cell changed, then frames with a single changed row, like a shell
+ * does. The fastest one is used. Nothing is swapped, the display is redrawn
+ * completely by the next frame instead.
+ *
+ * The pick is kept for the GPU, so each GPU is only timed once per process,
+ * and as a file in the shader cache directory for the next start.
+ */
+
+#ifndef KMSCON_BENCH_H
+#define KMSCON_BENCH_H
+
+#include "font.h"
+#include "uterm_video.h"
+
+/* frames timed for each candidate, after one that is not */
+#define KMSCON_BENCH_FULL 4
+#define KMSCON_BENCH_PARTIAL 16
+
+int kmscon_bench_pick(const char **out, struct uterm_display *disp, struct kmscon_font *font,
+		      const char *rotate, const char *const *names, unsigned int num);
+
+#endif /* KMSCON_BENCH_H */
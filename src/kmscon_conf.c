@@ -35,6 +35,7 @@
 #include "conf.h"
 #include "kmscon_conf.h"
 #include "shl_githead.h"
+#include "shl_hashtable.h"
 #include "shl_log.h"
 #include "shl_misc.h"
 #include "uterm_video.h"
@@ -71,16 +72,30 @@ static void print_help()
 		"\t                                    Path to config directory\n"
 		"\t    --listen                [off]   Listen for new seats and spawn\n"
 		"\t                                    sessions accordingly (daemon mode)\n"
+		"\t    --sched <policy>        [other] Scheduling policy of kmscon:\n"
+		"\t                                    other, fifo or rr\n"
+		"\t    --sched-priority <prio> [10]    Real-time priority with fifo or rr\n"
+		"\t    --nice <level>          [keep]  Nice level of kmscon\n"
+		"\t    --cpus <list>           [all]   Run kmscon on these CPUs, like 0-1,4\n"
+		"\t    --mlock                 [off]   Keep kmscon's memory in RAM\n"
 		"\n"
 		"Seat Options:\n"
 		"\t    --vt <vt>               [auto]  Select which VT to run on\n"
 		"\t    --switchvt              [on]    Automatically switch to VT\n"
 		"\t    --seats <list,of,seats> [current] Select seats to run on\n"
+		"\t    --seat-threads          [off]   Run seats without VTs on their own\n"
+		"\t                                    thread\n"
+		"\t    --export-dir <dir>      [off]   Share the frames of each display on\n"
+		"\t                                    a socket in <dir>\n"
 		"\n"
 		"Session Options:\n"
 		"\t    --session-max <max>         [50]  Maximum number of sessions\n"
 		"\t    --session-control           [off] Allow keyboard session-control\n"
 		"\t    --terminal-session          [on]  Enable terminal session\n"
+		"\t    --session-release <secs>    [60]  Free the renderers of sessions\n"
+		"\t                                      in the background this long\n"
+		"\t    --session-frames <MiB>      [64]  Keep the last frames of sessions\n"
+		"\t                                      in the background up to this size\n"
 		"\n"
 		"Terminal Options:\n"
 		"\t    --issue                 [on]\n"
@@ -108,8 +123,30 @@ static void print_help()
 		"\t                              pressed\n"
 		"\t    --sb-size <num>         [1000]\n"
 		"\t                              Size of the scrollback-buffer in lines\n"
+		"\t    --pty-buffer <KiB>      [1024]\n"
+		"\t                              Input buffered for a child process that\n"
+		"\t                              doesn't read it, more is dropped\n"
+		"\t    --image-cache <MiB>     [32]\n"
+		"\t                              Decoded sixel and kitty images kept for\n"
+		"\t                              all terminals, 0 ignores images\n"
 		"\t    --bell                  [off]\n"
 		"\t                              Enable bell forwarding to the VT\n"
+		"\t    --redraw-latency <msecs> [16]\n"
+		"\t                              Maximum delay before output of a busy\n"
+		"\t                              application is drawn\n"
+		"\t    --frame-deadline <usecs> [0]\n"
+		"\t                              Start drawing pty output this long\n"
+		"\t                              before the next vblank, 0 draws it\n"
+		"\t                              right away\n"
+		"\t    --record-dir <dir>      [off]\n"
+		"\t                              Append the output of each terminal\n"
+		"\t                              to a ttyrec file in <dir>\n"
+		"\t    --replay <file>         [off]\n"
+		"\t                              Play back a ttyrec file in each\n"
+		"\t                              terminal instead of a login\n"
+		"\t    --replay-fast           [off]\n"
+		"\t                              Play it back as fast as possible\n"
+		"\t                              instead of with the recorded timing\n"
 		"\n"
 		"Input Options:\n"
 		"\t    --xkb-model <model>        [-]  Set XkbModel for input devices\n"
@@ -120,6 +157,9 @@ static void print_help()
 		"\t                                    input devices\n"
 		"\t    --xkb-compose-file <FILE>  [-]  Use a predefined compose file for\n"
 		"\t                                    input devices\n"
+		"\t    --xkb-cache-dir <dir>      [off]\n"
+		"\t                                 Keep compiled keymaps in <dir>\n"
+		"\t                                 for faster startup\n"
 		"\t    --xkb-repeat-delay <msecs> [250]\n"
 		"\t                                 Initial delay for key-repeat in ms\n"
 		"\t    --xkb-repeat-rate <msecs>  [50]\n"
@@ -158,6 +198,8 @@ static void print_help()
 		"\t                                  Rotate output clock-wise\n"
 		"\t    --grab-rotate-ccw <grab>    [<Logo>Minus]\n"
 		"\t                                  Rotate output counter-clock-wise\n"
+		"\t    --grab-search <grab>        [<Ctrl><Logo>f]\n"
+		"\t                                  Search the scrollback\n"
 		"\t    --grab-reboot <grab>        []\n"
 		"\t                                  Reboot the system (disabled by default)\n"
 		"\n"
@@ -174,6 +216,38 @@ static void print_help()
 		"\t                                     This option is incompatible with\n"
 		"\t                                     --use-original-mode.\n"
 		"\t    --rotate <orientation>  [normal] normal, right, upside-down, left\n"
+		"\t    --render-workers        [off]   Render each display on its own\n"
+		"\t                                    thread\n"
+		"\t    --render-thread         [off]   Draw the screen on a background\n"
+		"\t                                    thread\n"
+		"\t    --render-threads <num>  [1]     Threads blending each frame of the\n"
+		"\t                                    bbulk renderer\n"
+		"\t    --mailbox               [off]   Keep drawing while a page-flip is\n"
+		"\t                                    pending and show the newest frame\n"
+		"\t    --batch-flips           [off]   Flip all displays of a GPU in one\n"
+		"\t                                    atomic commit\n"
+		"\t    --vrr                   [off]   Use variable refresh rate on\n"
+		"\t                                    displays that support it\n"
+		"\t    --stats                 [off]   Log the latency from key presses\n"
+		"\t                                    to the screen every 10 seconds\n"
+		"\t    --startup-trace <file>  [off]   Write the startup phases as Chrome\n"
+		"\t                                    trace-event JSON to <file>\n"
+		"\t    --gbm-scanout           [off]   Allocate drm2d framebuffers as\n"
+		"\t                                    linear GBM buffers\n"
+		"\t    --cell-cache <KiB>      [0]     Keep blended cells of the bbulk\n"
+		"\t                                    renderer on drm2d\n"
+		"\t    --damage-rects <num>    [32]    Most damage rectangles per frame,\n"
+		"\t                                    0 for no limit\n"
+		"\t    --shadow-fb {auto,on,off} [auto]\n"
+		"\t                                    Draw drm2d and fbdev frames into\n"
+		"\t                                    system RAM and copy the damage\n"
+		"\t    --shader-cache-dir <dir> [off]\n"
+		"\t                                    Keep linked GL shaders in <dir>\n"
+		"\t                                    for faster startup\n"
+		"\t    --renderer {default,auto,bbulk,gltex} [default]\n"
+		"\t                                    Text renderer; auto times both on\n"
+		"\t                                    OpenGL displays and keeps the\n"
+		"\t                                    faster one in --shader-cache-dir\n"
 		"\n"
 		"Font Options:\n"
 		"\t    --font-engine <engine>  [pango]\n"
@@ -182,6 +256,15 @@ static void print_help()
 		"\t                              Font size in pixels\n"
 		"\t    --font-name <name>      [monospace]\n"
 		"\t                              Font name\n"
+		"\t    --font-cache-dir <dir>  [off]\n"
+		"\t                              Keep rendered glyphs in <dir>\n"
+		"\t                              for faster startup\n"
+		"\t    --font-prerender        [on]\n"
+		"\t                              Render Latin glyphs in the\n"
+		"\t                              background after loading a font\n"
+		"\t    --font-async            [on]\n"
+		"\t                              Draw with the built-in 8x16 font\n"
+		"\t                              until the font is loaded\n"
 		"\n"
 		"Palette Options:\n"
 		"\t    --palette <name>                [default]\n"
@@ -474,6 +557,155 @@ static const struct conf_type conf_gpus = {
 	.copy = conf_copy_gpus,
 };
 
+/*
+ * Scheduling policy type
+ * Like the GPU selection mode, a simple string to enum parser.
+ */
+
+static void conf_default_sched(struct conf_option *opt)
+{
+	conf_uint.set_default(opt);
+}
+
+static void conf_free_sched(struct conf_option *opt)
+{
+	conf_uint.free(opt);
+}
+
+static int conf_parse_sched(struct conf_option *opt, bool on, const char *arg)
+{
+	struct kmscon_conf_t *conf = KMSCON_CONF_FROM_FIELD(opt->mem, sched);
+	unsigned int mode;
+
+	if (!strcmp(arg, "other")) {
+		mode = KMSCON_SCHED_OTHER;
+	} else if (!strcmp(arg, "fifo")) {
+		mode = KMSCON_SCHED_FIFO;
+	} else if (!strcmp(arg, "rr")) {
+		mode = KMSCON_SCHED_RR;
+	} else {
+		log_error("invalid scheduling policy --sched='%s'", arg);
+		return -EFAULT;
+	}
+
+	opt->type->free(opt);
+	conf->sched = mode;
+	return 0;
+}
+
+static int conf_copy_sched(struct conf_option *opt, const struct conf_option *src)
+{
+	return conf_uint.copy(opt, src);
+}
+
+static const struct conf_type conf_sched = {
+	.flags = CONF_HAS_ARG,
+	.set_default = conf_default_sched,
+	.free = conf_free_sched,
+	.parse = conf_parse_sched,
+	.copy = conf_copy_sched,
+};
+
+/*
+ * Shadow framebuffer type
+ * Like the GPU selection mode, a simple string to enum parser.
+ */
+
+static void conf_default_shadow_fb(struct conf_option *opt)
+{
+	conf_uint.set_default(opt);
+}
+
+static void conf_free_shadow_fb(struct conf_option *opt)
+{
+	conf_uint.free(opt);
+}
+
+static int conf_parse_shadow_fb(struct conf_option *opt, bool on, const char *arg)
+{
+	struct kmscon_conf_t *conf = KMSCON_CONF_FROM_FIELD(opt->mem, shadow_fb);
+	unsigned int mode;
+
+	if (!strcmp(arg, "auto")) {
+		mode = UTERM_SHADOW_AUTO;
+	} else if (!strcmp(arg, "on")) {
+		mode = UTERM_SHADOW_ON;
+	} else if (!strcmp(arg, "off")) {
+		mode = UTERM_SHADOW_OFF;
+	} else {
+		log_error("invalid shadow framebuffer mode --shadow-fb='%s'", arg);
+		return -EFAULT;
+	}
+
+	opt->type->free(opt);
+	conf->shadow_fb = mode;
+	return 0;
+}
+
+static int conf_copy_shadow_fb(struct conf_option *opt, const struct conf_option *src)
+{
+	return conf_uint.copy(opt, src);
+}
+
+static const struct conf_type conf_shadow_fb = {
+	.flags = CONF_HAS_ARG,
+	.set_default = conf_default_shadow_fb,
+	.free = conf_free_shadow_fb,
+	.parse = conf_parse_shadow_fb,
+	.copy = conf_copy_shadow_fb,
+};
+
+/*
+ * Renderer type
+ * Like the GPU selection mode, a simple string to enum parser.
+ */
+
+static void conf_default_renderer(struct conf_option *opt)
+{
+	conf_uint.set_default(opt);
+}
+
+static void conf_free_renderer(struct conf_option *opt)
+{
+	conf_uint.free(opt);
+}
+
+static int conf_parse_renderer(struct conf_option *opt, bool on, const char *arg)
+{
+	struct kmscon_conf_t *conf = KMSCON_CONF_FROM_FIELD(opt->mem, renderer);
+	unsigned int mode;
+
+	if (!strcmp(arg, "default")) {
+		mode = KMSCON_RENDERER_DEFAULT;
+	} else if (!strcmp(arg, "auto")) {
+		mode = KMSCON_RENDERER_AUTO;
+	} else if (!strcmp(arg, "bbulk")) {
+		mode = KMSCON_RENDERER_BBULK;
+	} else if (!strcmp(arg, "gltex")) {
+		mode = KMSCON_RENDERER_GLTEX;
+	} else {
+		log_error("invalid renderer --renderer='%s'", arg);
+		return -EFAULT;
+	}
+
+	opt->type->free(opt);
+	conf->renderer = mode;
+	return 0;
+}
+
+static int conf_copy_renderer(struct conf_option *opt, const struct conf_option *src)
+{
+	return conf_uint.copy(opt, src);
+}
+
+static const struct conf_type conf_renderer = {
+	.flags = CONF_HAS_ARG,
+	.set_default = conf_default_renderer,
+	.free = conf_free_renderer,
+	.parse = conf_parse_renderer,
+	.copy = conf_copy_renderer,
+};
+
 /*
  * Color type
  * The color parser parses three comma-separated numbers into an RGB color.
@@ -703,6 +935,9 @@ static struct conf_grab def_grab_rotate_cw =
 
 static struct conf_grab def_grab_rotate_ccw = CONF_SINGLE_GRAB(SHL_LOGO_MASK, XKB_KEY_minus);
 
+static struct conf_grab def_grab_search =
+	CONF_SINGLE_GRAB(SHL_CONTROL_MASK | SHL_LOGO_MASK, XKB_KEY_f);
+
 static palette_t def_palette = {
 	[TSM_COLOR_BLACK] = {0, 0, 0},		   /* black */
 	[TSM_COLOR_RED] = {205, 0, 0},		   /* red */
@@ -725,6 +960,206 @@ static palette_t def_palette = {
 	[TSM_COLOR_BACKGROUND] = {0, 0, 0},	  /* black */
 };
 
+/*
+ * Grab Table
+ * The grabs of a seat are compiled into a table when its configuration is
+ * loaded, so a key press does not walk every grab. A grab matches if the
+ * pressed modifiers contain its modifiers, so the table is keyed by the keysym
+ * and the modifiers are only checked for the few grabs of that keysym. Grabs
+ * without exactly one keysym are rare and are matched one by one.
+ */
+
+struct grab_entry {
+	uint32_t keysym;
+	unsigned int mods;
+	enum kmscon_grab grab;
+};
+
+struct grab_other {
+	enum kmscon_grab grab;
+	const struct conf_grab *conf;
+	unsigned int idx;
+};
+
+struct kmscon_grab_table {
+	struct shl_hashtable *keysyms;
+	struct grab_entry *entries;
+	size_t num;
+	struct grab_other *others;
+	size_t others_num;
+};
+
+static void get_grabs(const struct kmscon_conf_t *conf, struct conf_grab **grabs)
+{
+	grabs[KMSCON_GRAB_NONE] = NULL;
+	grabs[KMSCON_GRAB_SESSION_NEXT] = conf->grab_session_next;
+	grabs[KMSCON_GRAB_SESSION_PREV] = conf->grab_session_prev;
+	grabs[KMSCON_GRAB_SESSION_DUMMY] = conf->grab_session_dummy;
+	grabs[KMSCON_GRAB_SESSION_CLOSE] = conf->grab_session_close;
+	grabs[KMSCON_GRAB_TERMINAL_NEW] = conf->grab_terminal_new;
+	grabs[KMSCON_GRAB_REBOOT] = conf->grab_reboot;
+	grabs[KMSCON_GRAB_SCROLL_UP] = conf->grab_scroll_up;
+	grabs[KMSCON_GRAB_SCROLL_DOWN] = conf->grab_scroll_down;
+	grabs[KMSCON_GRAB_PAGE_UP] = conf->grab_page_up;
+	grabs[KMSCON_GRAB_PAGE_DOWN] = conf->grab_page_down;
+	grabs[KMSCON_GRAB_ZOOM_IN] = conf->grab_zoom_in;
+	grabs[KMSCON_GRAB_ZOOM_OUT] = conf->grab_zoom_out;
+	grabs[KMSCON_GRAB_ROTATE_CW] = conf->grab_rotate_cw;
+	grabs[KMSCON_GRAB_ROTATE_CCW] = conf->grab_rotate_ccw;
+	grabs[KMSCON_GRAB_SEARCH] = conf->grab_search;
+}
+
+/* by keysym, then in match order */
+static int grab_entry_cmp(const void *a, const void *b)
+{
+	const struct grab_entry *ea = a, *eb = b;
+
+	if (ea->keysym != eb->keysym)
+		return ea->keysym < eb->keysym ? -1 : 1;
+	return (int)ea->grab - (int)eb->grab;
+}
+
+static void grab_table_free(struct kmscon_grab_table *tbl)
+{
+	if (!tbl)
+		return;
+
+	shl_hashtable_free(tbl->keysyms);
+	free(tbl->others);
+	free(tbl->entries);
+	free(tbl);
+}
+
+static int grab_table_new(struct kmscon_grab_table **out, const struct kmscon_conf_t *conf)
+{
+	struct conf_grab *grabs[KMSCON_GRAB_NUM];
+	struct kmscon_grab_table *tbl;
+	struct grab_entry *e;
+	struct grab_other *o;
+	unsigned int g, i;
+	size_t num = 0, others_num = 0;
+	int ret;
+
+	get_grabs(conf, grabs);
+	for (g = KMSCON_GRAB_NONE + 1; g < KMSCON_GRAB_NUM; ++g) {
+		for (i = 0; grabs[g] && i < grabs[g]->num; ++i) {
+			if (grabs[g]->num_syms[i] == 1)
+				++num;
+			else
+				++others_num;
+		}
+	}
+
+	tbl = malloc(sizeof(*tbl));
+	if (!tbl)
+		return -ENOMEM;
+	memset(tbl, 0, sizeof(*tbl));
+
+	tbl->entries = malloc(sizeof(*tbl->entries) * (num + 1));
+	tbl->others = malloc(sizeof(*tbl->others) * (others_num + 1));
+	if (!tbl->entries || !tbl->others) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	/* the others stay in match order */
+	for (g = KMSCON_GRAB_NONE + 1; g < KMSCON_GRAB_NUM; ++g) {
+		for (i = 0; grabs[g] && i < grabs[g]->num; ++i) {
+			if (grabs[g]->num_syms[i] == 1) {
+				e = &tbl->entries[tbl->num++];
+				e->keysym = grabs[g]->keysyms[i][0];
+				e->mods = grabs[g]->mods[i];
+				e->grab = g;
+			} else {
+				o = &tbl->others[tbl->others_num++];
+				o->grab = g;
+				o->conf = grabs[g];
+				o->idx = i;
+			}
+		}
+	}
+	qsort(tbl->entries, tbl->num, sizeof(*tbl->entries), grab_entry_cmp);
+
+	ret = shl_hashtable_new(&tbl->keysyms, shl_direct_hash, shl_direct_equal, NULL);
+	if (ret)
+		goto err_free;
+
+	/* each keysym points to the first of its entries */
+	for (i = 0; i < tbl->num; ++i) {
+		if (i && tbl->entries[i].keysym == tbl->entries[i - 1].keysym)
+			continue;
+
+		ret = shl_hashtable_insert(tbl->keysyms, tbl->entries[i].keysym, &tbl->entries[i]);
+		if (ret)
+			goto err_free;
+	}
+
+	*out = tbl;
+	return 0;
+
+err_free:
+	grab_table_free(tbl);
+	return ret;
+}
+
+/**
+ * kmscon_conf_find_grab:
+ * @conf: Seat configuration
+ * @first: First grab to consider
+ * @last: Last grab to consider
+ * @mods: Pressed modifiers
+ * @num_syms: Number of pressed keysyms
+ * @syms: Pressed keysyms
+ *
+ * This looks up the grab that matches a key press in the grabs compiled by
+ * kmscon_conf_load_seat(). Only grabs between @first and @last are considered,
+ * so the seat and the terminal can share the table. If more than one grab
+ * matches, the first in the order of enum kmscon_grab is returned, which is the
+ * order grabs were always checked in.
+ *
+ * Returns: The matching grab or KMSCON_GRAB_NONE
+ */
+enum kmscon_grab kmscon_conf_find_grab(const struct kmscon_conf_t *conf, enum kmscon_grab first,
+				       enum kmscon_grab last, unsigned int mods,
+				       unsigned int num_syms, const uint32_t *syms)
+{
+	struct kmscon_grab_table *tbl;
+	const struct grab_entry *e, *end;
+	const struct grab_other *o;
+	enum kmscon_grab res = KMSCON_GRAB_NONE;
+	size_t i;
+
+	if (!conf || !conf->grab_table)
+		return KMSCON_GRAB_NONE;
+
+	tbl = conf->grab_table;
+	if (num_syms == 1 && shl_hashtable_find(tbl->keysyms, (void **)&e, syms[0])) {
+		end = &tbl->entries[tbl->num];
+		for (; e < end && e->keysym == syms[0]; ++e) {
+			if (e->grab >= first && e->grab <= last && SHL_HAS_BITS(mods, e->mods)) {
+				res = e->grab;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < tbl->others_num; ++i) {
+		o = &tbl->others[i];
+		if (res != KMSCON_GRAB_NONE && o->grab >= res)
+			break;
+		if (o->grab < first || o->grab > last)
+			continue;
+
+		if (shl_grab_matches(mods, num_syms, syms, o->conf->mods[o->idx],
+				     o->conf->num_syms[o->idx], o->conf->keysyms[o->idx])) {
+			res = o->grab;
+			break;
+		}
+	}
+
+	return res;
+}
+
 int kmscon_conf_new(struct conf_ctx **out)
 {
 	struct conf_ctx *ctx;
@@ -751,16 +1186,26 @@ int kmscon_conf_new(struct conf_ctx **out)
 		CONF_OPTION_STRING('c', "configdir", &conf->configdir, BUILD_CONFIG_DIR),
 		CONF_OPTION_BOOL_FULL(0, "listen", aftercheck_listen, NULL, NULL, &conf->listen,
 				      false),
+		CONF_OPTION(0, 0, "sched", &conf_sched, NULL, NULL, NULL, &conf->sched,
+			    (void *)KMSCON_SCHED_OTHER),
+		CONF_OPTION_UINT(0, "sched-priority", &conf->sched_priority, 10),
+		CONF_OPTION_INT(0, "nice", &conf->nice, KMSCON_NICE_KEEP),
+		CONF_OPTION_STRING(0, "cpus", &conf->cpus, ""),
+		CONF_OPTION_BOOL(0, "mlock", &conf->mlock, false),
 
 		/* Seat Options */
 		CONF_OPTION(0, 0, "vt", &conf_vt, aftercheck_vt, NULL, NULL, &conf->vt, NULL),
 		CONF_OPTION_BOOL(0, "switchvt", &conf->switchvt, true),
 		CONF_OPTION_STRING_LIST(0, "seats", &conf->seats, def_seats),
+		CONF_OPTION_BOOL(0, "seat-threads", &conf->seat_threads, false),
+		CONF_OPTION_STRING(0, "export-dir", &conf->export_dir, NULL),
 
 		/* Session Options */
 		CONF_OPTION_UINT(0, "session-max", &conf->session_max, 50),
 		CONF_OPTION_BOOL(0, "session-control", &conf->session_control, false),
 		CONF_OPTION_BOOL(0, "terminal-session", &conf->terminal_session, true),
+		CONF_OPTION_UINT(0, "session-release", &conf->session_release, 60),
+		CONF_OPTION_UINT(0, "session-frames", &conf->session_frames, 64),
 
 		/* Terminal Options */
 		CONF_OPTION_BOOL(0, "issue", &conf->issue, true),
@@ -771,7 +1216,14 @@ int kmscon_conf_new(struct conf_ctx **out)
 		CONF_OPTION_BOOL(0, "reset-env", &conf->reset_env, true),
 		CONF_OPTION_BOOL(0, "backspace-delete", &conf->backspace_delete, true),
 		CONF_OPTION_UINT(0, "sb-size", &conf->sb_size, 1000),
+		CONF_OPTION_UINT(0, "pty-buffer", &conf->pty_buffer, 1024),
+		CONF_OPTION_UINT(0, "image-cache", &conf->image_cache, 32),
 		CONF_OPTION_BOOL(0, "bell", &conf->bell, false),
+		CONF_OPTION_UINT(0, "redraw-latency", &conf->redraw_latency, 16),
+		CONF_OPTION_UINT(0, "frame-deadline", &conf->frame_deadline, 0),
+		CONF_OPTION_STRING(0, "record-dir", &conf->record_dir, NULL),
+		CONF_OPTION_STRING(0, "replay", &conf->replay, NULL),
+		CONF_OPTION_BOOL(0, "replay-fast", &conf->replay_fast, false),
 
 		/* Input Options */
 		CONF_OPTION_STRING(0, "xkb-model", &conf->xkb_model, ""),
@@ -780,6 +1232,7 @@ int kmscon_conf_new(struct conf_ctx **out)
 		CONF_OPTION_STRING(0, "xkb-options", &conf->xkb_options, ""),
 		CONF_OPTION_STRING(0, "xkb-keymap", &conf->xkb_keymap, ""),
 		CONF_OPTION_STRING(0, "xkb-compose-file", &conf->xkb_compose_file, ""),
+		CONF_OPTION_STRING(0, "xkb-cache-dir", &conf->xkb_cache_dir, NULL),
 		CONF_OPTION_UINT(0, "xkb-repeat-delay", &conf->xkb_repeat_delay, 250),
 		CONF_OPTION_UINT(0, "xkb-repeat-rate", &conf->xkb_repeat_rate, 50),
 		CONF_OPTION_BOOL(0, "mouse", &conf->mouse, true),
@@ -807,6 +1260,7 @@ int kmscon_conf_new(struct conf_ctx **out)
 		CONF_OPTION_GRAB(0, "grab-rotate-cw", &conf->grab_rotate_cw, &def_grab_rotate_cw),
 		CONF_OPTION_GRAB(0, "grab-rotate-ccw", &conf->grab_rotate_ccw,
 				 &def_grab_rotate_ccw),
+		CONF_OPTION_GRAB(0, "grab-search", &conf->grab_search, &def_grab_search),
 		CONF_OPTION_GRAB(0, "grab-reboot", &conf->grab_reboot, NULL),
 
 		/* Video Options */
@@ -817,12 +1271,31 @@ int kmscon_conf_new(struct conf_ctx **out)
 		CONF_OPTION_BOOL(0, "use-original-mode", &conf->use_original_mode, true),
 		CONF_OPTION_STRING(0, "mode", &conf->mode, NULL),
 		CONF_OPTION_STRING(0, "multi-monitor", &conf->multi_monitor, "clone"),
+		CONF_OPTION_BOOL(0, "render-workers", &conf->render_workers, false),
+		CONF_OPTION_BOOL(0, "render-thread", &conf->render_thread, false),
+		CONF_OPTION_UINT(0, "render-threads", &conf->render_threads, 1),
+		CONF_OPTION_BOOL(0, "mailbox", &conf->mailbox, false),
+		CONF_OPTION_BOOL(0, "batch-flips", &conf->batch_flips, false),
+		CONF_OPTION_BOOL(0, "vrr", &conf->vrr, false),
+		CONF_OPTION_BOOL(0, "stats", &conf->stats, false),
+		CONF_OPTION_STRING(0, "startup-trace", &conf->startup_trace, NULL),
+		CONF_OPTION_BOOL(0, "gbm-scanout", &conf->gbm_scanout, false),
+		CONF_OPTION_UINT(0, "cell-cache", &conf->cell_cache, 0),
+		CONF_OPTION_UINT(0, "damage-rects", &conf->damage_rects, 32),
+		CONF_OPTION(0, 0, "shadow-fb", &conf_shadow_fb, NULL, NULL, NULL, &conf->shadow_fb,
+			    (void *)UTERM_SHADOW_AUTO),
+		CONF_OPTION_STRING(0, "shader-cache-dir", &conf->shader_cache_dir, NULL),
+		CONF_OPTION(0, 0, "renderer", &conf_renderer, NULL, NULL, NULL, &conf->renderer,
+			    (void *)KMSCON_RENDERER_DEFAULT),
 		CONF_OPTION_STRING(0, "rotate", &conf->rotate, "normal"),
 
 		/* Font Options */
 		CONF_OPTION_STRING(0, "font-engine", &conf->font_engine, NULL),
 		CONF_OPTION_UINT(0, "font-size", &conf->font_size, 16),
 		CONF_OPTION_STRING(0, "font-name", &conf->font_name, "monospace"),
+		CONF_OPTION_STRING(0, "font-cache-dir", &conf->font_cache_dir, NULL),
+		CONF_OPTION_BOOL(0, "font-prerender", &conf->font_prerender, true),
+		CONF_OPTION_BOOL(0, "font-async", &conf->font_async, true),
 
 		/* Palette Options */
 		CONF_OPTION_STRING(0, "palette", &conf->palette, NULL),
@@ -861,12 +1334,13 @@ int kmscon_conf_new(struct conf_ctx **out)
 
 void kmscon_conf_free(struct conf_ctx *ctx)
 {
-	void *conf;
+	struct kmscon_conf_t *conf;
 	if (!ctx)
 		return;
 
 	conf = conf_ctx_get_mem(ctx);
 	conf_ctx_free(ctx);
+	grab_table_free(conf->grab_table);
 	free(conf);
 }
 
@@ -941,5 +1415,13 @@ int kmscon_conf_load_seat(struct conf_ctx *ctx, const struct conf_ctx *main, con
 	if (ret)
 		return ret;
 
+	grab_table_free(conf->grab_table);
+	conf->grab_table = NULL;
+	ret = grab_table_new(&conf->grab_table, conf);
+	if (ret) {
+		log_error("cannot compile grabs of seat %s: %d", seat, ret);
+		return ret;
+	}
+
 	return 0;
 }
@@ -32,8 +32,10 @@
 #define KMSCON_MAIN_H
 
 #include <libtsm.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "conf.h"
 #include "shl_dlist.h"
@@ -44,11 +46,63 @@ enum kmscon_conf_gpu_selection {
 	KMSCON_GPU_PRIMARY,
 };
 
+enum kmscon_conf_renderer {
+	KMSCON_RENDERER_DEFAULT, /* gltex with OpenGL, bbulk otherwise */
+	KMSCON_RENDERER_AUTO,	 /* the faster one, see kmscon_bench_pick() */
+	KMSCON_RENDERER_BBULK,
+	KMSCON_RENDERER_GLTEX,
+};
+
+enum kmscon_conf_sched {
+	KMSCON_SCHED_OTHER,
+	KMSCON_SCHED_FIFO,
+	KMSCON_SCHED_RR,
+};
+
+/* --nice default, the nice level kmscon was started with is kept */
+#define KMSCON_NICE_KEEP INT_MIN
+
 typedef uint8_t palette_t[TSM_COLOR_NUM][3];
 
+/*
+ * Grab actions in the order they are matched. The seat handles its grabs
+ * before the terminal sees the key.
+ */
+enum kmscon_grab {
+	KMSCON_GRAB_NONE,
+
+	KMSCON_GRAB_SESSION_NEXT,
+	KMSCON_GRAB_SESSION_PREV,
+	KMSCON_GRAB_SESSION_DUMMY,
+	KMSCON_GRAB_SESSION_CLOSE,
+	KMSCON_GRAB_TERMINAL_NEW,
+	KMSCON_GRAB_REBOOT,
+
+	KMSCON_GRAB_SCROLL_UP,
+	KMSCON_GRAB_SCROLL_DOWN,
+	KMSCON_GRAB_PAGE_UP,
+	KMSCON_GRAB_PAGE_DOWN,
+	KMSCON_GRAB_ZOOM_IN,
+	KMSCON_GRAB_ZOOM_OUT,
+	KMSCON_GRAB_ROTATE_CW,
+	KMSCON_GRAB_ROTATE_CCW,
+	KMSCON_GRAB_SEARCH,
+
+	KMSCON_GRAB_NUM,
+};
+
+#define KMSCON_GRAB_SEAT_FIRST KMSCON_GRAB_SESSION_NEXT
+#define KMSCON_GRAB_SEAT_LAST KMSCON_GRAB_REBOOT
+#define KMSCON_GRAB_TERMINAL_FIRST KMSCON_GRAB_SCROLL_UP
+#define KMSCON_GRAB_TERMINAL_LAST KMSCON_GRAB_SEARCH
+
+struct kmscon_grab_table;
+
 struct kmscon_conf_t {
 	/* header information */
 	bool seat_config;
+	/* grabs compiled by kmscon_conf_load_seat() */
+	struct kmscon_grab_table *grab_table;
 
 	/* General Options */
 	/* show help/usage information */
@@ -67,6 +121,16 @@ struct kmscon_conf_t {
 	char *configdir;
 	/* listen mode */
 	bool listen;
+	/* scheduling policy of kmscon's threads, one of KMSCON_SCHED_* */
+	unsigned int sched;
+	/* real-time priority with a real-time policy */
+	unsigned int sched_priority;
+	/* nice level of kmscon's threads, KMSCON_NICE_KEEP to leave it */
+	int nice;
+	/* CPUs kmscon's threads run on, empty for all */
+	char *cpus;
+	/* keep kmscon's memory in RAM once used */
+	bool mlock;
 
 	/* Seat Options */
 	/* VT number to run on */
@@ -75,6 +139,10 @@ struct kmscon_conf_t {
 	bool switchvt;
 	/* seats */
 	char **seats;
+	/* run seats without VTs on their own thread */
+	bool seat_threads;
+	/* directory with a socket per display that shares its frames */
+	char *export_dir;
 
 	/* Session Options */
 	/* sessions */
@@ -83,6 +151,10 @@ struct kmscon_conf_t {
 	bool session_control;
 	/* run terminal session */
 	bool terminal_session;
+	/* secs in the background before renderers are freed, 0 for never */
+	unsigned int session_release;
+	/* MiB of last frames kept by sessions in the background, 0 for none */
+	unsigned int session_frames;
 
 	/* Terminal Options */
 	/* display /etc/issue before login prompt */
@@ -101,8 +173,22 @@ struct kmscon_conf_t {
 	bool backspace_delete;
 	/* terminal scroll-back buffer size */
 	unsigned int sb_size;
+	/* KiB of input buffered for a child that doesn't read it, 0 for no limit */
+	unsigned int pty_buffer;
+	/* MiB of decoded inline images, 0 to ignore them */
+	unsigned int image_cache;
 	/* enable bell forwarding */
 	bool bell;
+	/* max delay in ms before pending pty output is drawn */
+	unsigned int redraw_latency;
+	/* usecs before the next vblank that pty output is drawn, 0 for right away */
+	unsigned int frame_deadline;
+	/* directory the output of each terminal is recorded to */
+	char *record_dir;
+	/* ttyrec file played back instead of running a child */
+	char *replay;
+	/* play back without the recorded timing */
+	bool replay_fast;
 
 	/* Input Options */
 	/* input KBD model */
@@ -117,6 +203,8 @@ struct kmscon_conf_t {
 	char *xkb_keymap;
 	/* input predefined KBD compose file */
 	char *xkb_compose_file;
+	/* directory for compiled KBD keymaps */
+	char *xkb_cache_dir;
 	/* keyboard key-repeat delay */
 	unsigned int xkb_repeat_delay;
 	/* keyboard key-repeat rate */
@@ -155,6 +243,8 @@ struct kmscon_conf_t {
 	struct conf_grab *grab_rotate_cw;
 	/* rotate output counter-clock-wise grab */
 	struct conf_grab *grab_rotate_ccw;
+	/* scrollback search grab */
+	struct conf_grab *grab_search;
 	/* reboot system grab */
 	struct conf_grab *grab_reboot;
 
@@ -173,6 +263,34 @@ struct kmscon_conf_t {
 	char *multi_monitor;
 	/* orientation/rotation of output */
 	char *rotate;
+	/* render each display on its own thread */
+	bool render_workers;
+	/* draw screen snapshots on a background thread */
+	bool render_thread;
+	/* threads blending each bbulk frame */
+	unsigned int render_threads;
+	/* draw while a page-flip is pending, newer frames replace queued ones */
+	bool mailbox;
+	/* flip all displays of a GPU in one atomic commit */
+	bool batch_flips;
+	/* variable refresh rate on capable displays */
+	bool vrr;
+	/* log input-to-screen latencies */
+	bool stats;
+	/* write a trace of the startup phases to this file */
+	char *startup_trace;
+	/* allocate drm2d framebuffers with GBM */
+	bool gbm_scanout;
+	/* KiB of blended cells each bbulk renderer keeps */
+	unsigned int cell_cache;
+	/* most damage rectangles bbulk passes per frame, 0 for no limit */
+	unsigned int damage_rects;
+	/* draw into system RAM and copy the damage, one of UTERM_SHADOW_* */
+	unsigned int shadow_fb;
+	/* directory for linked GL shader programs */
+	char *shader_cache_dir;
+	/* text renderer, one of KMSCON_RENDERER_* */
+	unsigned int renderer;
 
 	/* Font Options */
 	/* font engine */
@@ -181,6 +299,12 @@ struct kmscon_conf_t {
 	unsigned int font_size;
 	/* font name */
 	char *font_name;
+	/* glyph cache directory */
+	char *font_cache_dir;
+	/* render common glyphs in the background */
+	bool font_prerender;
+	/* look up the font in the background, drawing with 8x16 meanwhile */
+	bool font_async;
 
 	/* Palette Options */
 	/* color palette */
@@ -193,6 +317,9 @@ int kmscon_conf_new(struct conf_ctx **out);
 void kmscon_conf_free(struct conf_ctx *ctx);
 int kmscon_conf_load_main(struct conf_ctx *ctx, int argc, char **argv);
 int kmscon_conf_load_seat(struct conf_ctx *ctx, const struct conf_ctx *main, const char *seat);
+enum kmscon_grab kmscon_conf_find_grab(const struct kmscon_conf_t *conf, enum kmscon_grab first,
+				       enum kmscon_grab last, unsigned int mods,
+				       unsigned int num_syms, const uint32_t *syms);
 
 static inline bool kmscon_conf_is_current_seat(struct kmscon_conf_t *conf)
 {
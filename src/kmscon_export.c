@@ -0,0 +1,508 @@
+/*
+ * kmscon - Frame Export
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Frame Export
+ * The display copies its frames into the memfd through a uterm mirror, see
+ * uterm_display_set_mirror(), which only copies the damage of each frame. The
+ * mirror and the memfd only exist while clients are connected. Messages are
+ * sent without blocking; a client whose socket is full is marked lost and
+ * gets the whole screen as damage once it can take messages again.
+ *
+ * Screenshots don't need the mirror; the display hands out its last frame,
+ * see uterm_display_export_frame().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "eloop.h"
+#include "kmscon_export.h"
+#include "shl_dlist.h"
+#include "shl_log.h"
+#include "uterm_video.h"
+
+#define LOG_SUBSYSTEM "export"
+
+#define EXPORT_RECTS_MAX 128
+
+struct export_client {
+	struct shl_dlist list;
+	struct kmscon_export *exp;
+	struct ev_fd *efd;
+	int fd;
+	bool lost; /* missed a frame, the next one covers everything */
+};
+
+struct kmscon_export {
+	struct ev_eloop *eloop;
+	struct uterm_display *disp;
+	char *path;
+	int fd;
+	struct ev_fd *efd;
+	struct shl_dlist clients;
+	bool unsupported;
+
+	/* buffer of the mirror, or -1 while not mirroring */
+	int memfd;
+	uint8_t *map;
+	size_t size;
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+	uint32_t seq;
+};
+
+static void client_free(struct export_client *client)
+{
+	log_debug("client %d of %s disconnected", client->fd, client->exp->path);
+
+	shl_dlist_unlink(&client->list);
+	ev_eloop_rm_fd(client->efd);
+	close(client->fd);
+	free(client);
+}
+
+static int client_send(struct export_client *client, const struct kmscon_export_msg *msg,
+		       const void *payload, size_t size, int memfd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov[2];
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&mh, 0, sizeof(mh));
+	iov[0].iov_base = (void *)msg;
+	iov[0].iov_len = sizeof(*msg);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = size;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = size ? 2 : 1;
+
+	if (memfd >= 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	}
+
+	len = sendmsg(client->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (len < 0)
+		return -errno;
+	return 0;
+}
+
+static int send_mode(struct export_client *client)
+{
+	struct kmscon_export *exp = client->exp;
+	struct kmscon_export_msg msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = KMSCON_EXPORT_MODE;
+	msg.seq = exp->seq;
+	msg.width = exp->width;
+	msg.height = exp->height;
+	msg.stride = exp->stride;
+
+	/* without the new buffer, the client can't go on */
+	ret = client_send(client, &msg, NULL, 0, exp->memfd);
+	if (ret)
+		log_warning("cannot send mode to client %d of %s (%d)", client->fd, exp->path,
+			    ret);
+	return ret;
+}
+
+static void send_frame(struct export_client *client, const struct uterm_video_rect *rects,
+		       size_t num)
+{
+	struct kmscon_export *exp = client->exp;
+	struct uterm_video_rect all = {0, 0, exp->width, exp->height};
+	struct kmscon_export_msg msg;
+	int ret;
+
+	if (client->lost || num > EXPORT_RECTS_MAX) {
+		rects = &all;
+		num = 1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = KMSCON_EXPORT_FRAME;
+	msg.seq = exp->seq;
+	msg.width = exp->width;
+	msg.height = exp->height;
+	msg.stride = exp->stride;
+	msg.num = num;
+
+	ret = client_send(client, &msg, rects, num * sizeof(*rects), -1);
+	if (ret == -EAGAIN) {
+		if (!client->lost)
+			log_debug("client %d of %s is lagging behind", client->fd, exp->path);
+		client->lost = true;
+	} else if (ret) {
+		client_free(client);
+	} else {
+		client->lost = false;
+	}
+}
+
+static void unmap_buffer(struct kmscon_export *exp)
+{
+	if (exp->memfd < 0)
+		return;
+
+	uterm_display_set_mirror(exp->disp, NULL, 0, NULL, NULL);
+	munmap(exp->map, exp->size);
+	close(exp->memfd);
+	exp->memfd = -1;
+	exp->map = NULL;
+}
+
+static void mirror_event(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			 size_t num, void *data);
+
+/*
+ * Create the buffer the frames are copied to and tell all clients about it.
+ * This fails while the display is offline, which is retried when it comes
+ * back, see kmscon_export_refresh().
+ */
+static void map_buffer(struct kmscon_export *exp)
+{
+	struct shl_dlist *iter, *tmp;
+	struct export_client *client;
+	int ret;
+
+	if (exp->memfd >= 0 || exp->unsupported || shl_dlist_empty(&exp->clients))
+		return;
+
+	exp->width = uterm_display_get_width(exp->disp);
+	exp->height = uterm_display_get_height(exp->disp);
+	exp->stride = exp->width * 4;
+	exp->size = (size_t)exp->stride * exp->height;
+	if (!exp->size)
+		return;
+
+	exp->memfd = memfd_create("kmscon-export", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (exp->memfd < 0) {
+		log_error("cannot create buffer for %s (%d): %m", exp->path, errno);
+		return;
+	}
+
+	if (ftruncate(exp->memfd, exp->size)) {
+		log_error("cannot resize buffer for %s (%d): %m", exp->path, errno);
+		goto err_close;
+	}
+
+	exp->map = mmap(NULL, exp->size, PROT_READ | PROT_WRITE, MAP_SHARED, exp->memfd, 0);
+	if (exp->map == MAP_FAILED) {
+		log_error("cannot map buffer for %s (%d): %m", exp->path, errno);
+		goto err_close;
+	}
+
+	/* clients may map it, but neither resize nor write it */
+	fcntl(exp->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+	fcntl(exp->memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+
+	ret = uterm_display_set_mirror(exp->disp, exp->map, exp->stride, mirror_event, exp);
+	if (ret == -EOPNOTSUPP) {
+		log_warning("display %s cannot export its frames",
+			    uterm_display_name(exp->disp));
+		exp->unsupported = true;
+		while (!shl_dlist_empty(&exp->clients)) {
+			client = shl_dlist_first(&exp->clients, struct export_client, list);
+			client_free(client);
+		}
+		goto err_unmap;
+	} else if (ret) {
+		goto err_unmap;
+	}
+
+	log_debug("exporting %ux%u frames to %s", exp->width, exp->height, exp->path);
+
+	shl_dlist_for_each_safe(iter, tmp, &exp->clients)
+	{
+		client = shl_dlist_entry(iter, struct export_client, list);
+		if (send_mode(client))
+			client_free(client);
+	}
+	return;
+
+err_unmap:
+	munmap(exp->map, exp->size);
+	exp->map = NULL;
+err_close:
+	close(exp->memfd);
+	exp->memfd = -1;
+}
+
+static void mirror_event(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			 size_t num, void *data)
+{
+	struct kmscon_export *exp = data;
+	struct shl_dlist *iter, *tmp;
+	struct export_client *client;
+
+	/* the size changed, so the clients get a new buffer for this frame */
+	if (!rects) {
+		unmap_buffer(exp);
+		map_buffer(exp);
+		return;
+	}
+
+	++exp->seq;
+	shl_dlist_for_each_safe(iter, tmp, &exp->clients)
+	{
+		client = shl_dlist_entry(iter, struct export_client, list);
+		send_frame(client, rects, num);
+	}
+
+	if (shl_dlist_empty(&exp->clients))
+		unmap_buffer(exp);
+}
+
+static int send_screenshot(struct export_client *client)
+{
+	struct kmscon_export *exp = client->exp;
+	struct kmscon_export_shot shot;
+	struct kmscon_export_msg msg;
+	struct uterm_video_export ve;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&shot, 0, sizeof(shot));
+	msg.type = KMSCON_EXPORT_SCREENSHOT;
+	msg.seq = exp->seq;
+
+	ret = uterm_display_export_frame(exp->disp, &ve);
+	if (ret) {
+		log_debug("cannot export frame of display %s (%d)",
+			  uterm_display_name(exp->disp), ret);
+		return client_send(client, &msg, &shot, sizeof(shot), -1);
+	}
+
+	msg.width = ve.width;
+	msg.height = ve.height;
+	msg.stride = ve.stride;
+	shot.format = ve.format;
+	shot.offset = ve.offset;
+	shot.modifier = ve.modifier;
+	shot.dmabuf = ve.dmabuf;
+
+	ret = client_send(client, &msg, &shot, sizeof(shot), ve.fd);
+	close(ve.fd);
+	return ret;
+}
+
+static void client_event(struct ev_fd *efd, int mask, void *data)
+{
+	struct export_client *client = data;
+	struct kmscon_export *exp = client->exp;
+	struct kmscon_export_msg msg;
+	ssize_t len;
+
+	if (mask & EV_READABLE) {
+		len = recv(client->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (len == sizeof(msg) && msg.type == KMSCON_EXPORT_SCREENSHOT) {
+			if (!send_screenshot(client))
+				return;
+		} else if (len > 0) {
+			return;
+		}
+	}
+
+	client_free(client);
+	if (shl_dlist_empty(&exp->clients))
+		unmap_buffer(exp);
+}
+
+static void export_event(struct ev_fd *efd, int mask, void *data)
+{
+	struct kmscon_export *exp = data;
+	struct export_client *client;
+	int fd, ret;
+
+	if (mask & (EV_HUP | EV_ERR)) {
+		log_warning("socket %s hung up", exp->path);
+		ev_fd_disable(efd);
+		return;
+	}
+
+	fd = accept4(exp->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			log_warning("cannot accept client on %s (%d): %m", exp->path, errno);
+		return;
+	}
+
+	if (exp->unsupported) {
+		close(fd);
+		return;
+	}
+
+	client = malloc(sizeof(*client));
+	if (!client) {
+		close(fd);
+		return;
+	}
+	memset(client, 0, sizeof(*client));
+	client->exp = exp;
+	client->fd = fd;
+
+	ret = ev_eloop_new_fd(exp->eloop, &client->efd, fd, EV_READABLE, client_event, client);
+	if (ret) {
+		close(fd);
+		free(client);
+		return;
+	}
+
+	shl_dlist_link_tail(&exp->clients, &client->list);
+	log_debug("client %d of %s connected", fd, exp->path);
+
+	if (exp->memfd >= 0) {
+		if (send_mode(client))
+			client_free(client);
+	} else {
+		map_buffer(exp);
+	}
+}
+
+int kmscon_export_new(struct kmscon_export **out, struct ev_eloop *eloop,
+		      struct uterm_display *disp, const char *path)
+{
+	struct kmscon_export *exp;
+	struct sockaddr_un addr;
+	int ret;
+
+	if (!out || !eloop || !disp || !path)
+		return -EINVAL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("socket path %s is too long", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	exp = malloc(sizeof(*exp));
+	if (!exp)
+		return -ENOMEM;
+	memset(exp, 0, sizeof(*exp));
+	exp->eloop = eloop;
+	exp->disp = disp;
+	exp->memfd = -1;
+	shl_dlist_init(&exp->clients);
+
+	exp->path = strdup(path);
+	if (!exp->path) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	exp->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (exp->fd < 0) {
+		ret = -errno;
+		log_error("cannot create socket %s (%d): %m", path, errno);
+		goto err_path;
+	}
+
+	/* a socket left over by a crash would make bind() fail */
+	unlink(path);
+	if (bind(exp->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		log_error("cannot bind socket %s (%d): %m", path, errno);
+		goto err_fd;
+	}
+
+	/* the screen shows whatever is typed, so it's for root only */
+	if (chmod(path, 0600) || listen(exp->fd, 4)) {
+		ret = -errno;
+		log_error("cannot listen on socket %s (%d): %m", path, errno);
+		goto err_unlink;
+	}
+
+	ret = ev_eloop_new_fd(eloop, &exp->efd, exp->fd, EV_READABLE, export_event, exp);
+	if (ret)
+		goto err_unlink;
+
+	uterm_display_ref(disp);
+	log_info("exporting frames of display %s to %s", uterm_display_name(disp), path);
+	*out = exp;
+	return 0;
+
+err_unlink:
+	unlink(path);
+err_fd:
+	close(exp->fd);
+err_path:
+	free(exp->path);
+err_free:
+	free(exp);
+	return ret;
+}
+
+void kmscon_export_free(struct kmscon_export *exp)
+{
+	struct export_client *client;
+
+	if (!exp)
+		return;
+
+	while (!shl_dlist_empty(&exp->clients)) {
+		client = shl_dlist_first(&exp->clients, struct export_client, list);
+		client_free(client);
+	}
+	unmap_buffer(exp);
+
+	ev_eloop_rm_fd(exp->efd);
+	close(exp->fd);
+	unlink(exp->path);
+	uterm_display_unref(exp->disp);
+	free(exp->path);
+	free(exp);
+}
+
+/* retry mapping the buffer once the display is back online */
+void kmscon_export_refresh(struct kmscon_export *exp)
+{
+	if (!exp)
+		return;
+
+	map_buffer(exp);
+}
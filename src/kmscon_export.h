@@ -0,0 +1,87 @@
+/*
+ * kmscon - Frame Export
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Frame Export
+ * Shares the frames of a display with local clients, like a VNC bridge for
+ * remote console access. Each display listens on a SOCK_SEQPACKET unix socket.
+ * The frames are copied into a memfd that is passed to the clients, and after
+ * each frame they get the rects that changed, so only those are read and sent
+ * on.
+ *
+ * A MODE message carries the memfd as SCM_RIGHTS and the size of the frames,
+ * which are XRGB8888 in host byte order with @stride bytes per line. It is
+ * sent on connect and whenever the display changes its size, with a new memfd
+ * each time; the buffer is filled with the next frame. A FRAME message follows
+ * each frame with @num rects after the header. A client that doesn't keep up
+ * misses frames, and its next one covers the whole screen.
+ *
+ * The only message clients send is SCREENSHOT, anything else is ignored. The
+ * reply is a SCREENSHOT message followed by a struct kmscon_export_shot, with
+ * the last frame as SCM_RIGHTS. DRM backends pass the buffer on screen as a
+ * dma-buf, so nothing is read back, but it only holds the frame until the
+ * display draws into it again. Others pass a sealed memfd with a copy. On
+ * failure, the reply has no fd and a size of 0.
+ *
+ * The frames are only copied while clients are connected.
+ */
+
+#ifndef KMSCON_EXPORT_H
+#define KMSCON_EXPORT_H
+
+#include <stdint.h>
+#include "eloop.h"
+#include "uterm_video.h"
+
+enum kmscon_export_type {
+	KMSCON_EXPORT_MODE = 1,
+	KMSCON_EXPORT_FRAME = 2,
+	KMSCON_EXPORT_SCREENSHOT = 3,
+};
+
+struct kmscon_export_msg {
+	uint32_t type;
+	uint32_t seq; /* number of the frame */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t num; /* struct uterm_video_rect following the header */
+};
+
+/* follows the header of SCREENSHOT replies */
+struct kmscon_export_shot {
+	uint32_t format; /* DRM fourcc */
+	uint32_t offset;
+	uint64_t modifier; /* DRM format modifier */
+	uint32_t dmabuf;   /* 1 for a dma-buf, 0 for a memfd */
+	uint32_t padding;
+};
+
+struct kmscon_export;
+
+int kmscon_export_new(struct kmscon_export **out, struct ev_eloop *eloop,
+		      struct uterm_display *disp, const char *path);
+void kmscon_export_free(struct kmscon_export *exp);
+void kmscon_export_refresh(struct kmscon_export *exp);
+
+#endif /* KMSCON_EXPORT_H */
@@ -0,0 +1,1235 @@
+/*
+ * kmscon - Inline Images
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Inline Images
+ * The cache is used by the main thread, which adds and drops images, and by
+ * the threads rendering the terminals, which hold the read lock from drawing
+ * the first cell of a frame until it is blended, as the blend requests point
+ * into the tiles. Drawing a tile marks its image as used, with a clock that
+ * is only ever increased, so that doesn't need the write lock.
+ *
+ * Of the kitty graphics protocol, direct transmission of RGB and RGBA pixels
+ * (f=24, f=32) is supported, in chunks or not, and the actions transmit, put,
+ * query and delete. PNG, compression and files are answered with an error.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmscon_image.h"
+#include "shl_dlist.h"
+#include "shl_hashtable.h"
+#include "shl_log.h"
+#include "shl_misc.h"
+
+#define LOG_SUBSYSTEM "image"
+
+/* most bytes of a single sequence, larger ones are dropped */
+#define IMAGE_MAX_INPUT (64 * 1024 * 1024)
+/* ids a parser remembers placing, older ones are drawn as text again */
+#define IMAGE_MAX_PLACED 1024
+
+struct image {
+	struct shl_dlist list;
+	uint32_t id;
+	const void *owner; /* the parser that made it */
+	unsigned int cols;
+	unsigned int rows;
+	unsigned int cell_w;
+	unsigned int cell_h;
+	uint64_t used; /* cache clock when it was last drawn */
+	size_t tile_size;
+	size_t size;
+	uint8_t *tiles; /* a struct uterm_video_buffer every @tile_size bytes */
+};
+
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct shl_hashtable *cache_images; /* by id, protected by @cache_lock */
+static struct shl_dlist cache_list = SHL_DLIST_INIT(cache_list);
+static size_t cache_size;
+static size_t cache_max_size;
+static uint32_t cache_next_id;
+static uint64_t cache_clock;
+
+static void image_free(struct image *img)
+{
+	free(img->tiles);
+	free(img);
+}
+
+static struct uterm_video_buffer *image_tile(const struct image *img, unsigned int col,
+					     unsigned int row)
+{
+	return (void *)&img->tiles[(row * img->cols + col) * img->tile_size];
+}
+
+/* called with the write lock held */
+static void cache_remove(struct image *img)
+{
+	shl_hashtable_remove(cache_images, img->id);
+	shl_dlist_unlink(&img->list);
+	cache_size -= img->size;
+	image_free(img);
+}
+
+/* drop the image that wasn't drawn for the longest time */
+static bool cache_evict(void)
+{
+	struct shl_dlist *iter;
+	struct image *img, *oldest = NULL;
+
+	shl_dlist_for_each(iter, &cache_list) {
+		img = shl_dlist_entry(iter, struct image, list);
+		if (!oldest || img->used < oldest->used)
+			oldest = img;
+	}
+	if (!oldest)
+		return false;
+
+	log_debug("dropping image %u of %zu bytes", oldest->id, oldest->size);
+	cache_remove(oldest);
+	return true;
+}
+
+/* Adds @img to the cache and gives it an id, or frees it on failure */
+static int cache_add(struct image *img)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&cache_lock);
+
+	if (img->size > cache_max_size) {
+		ret = -EFBIG;
+		goto err_unlock;
+	}
+
+	if (!cache_images) {
+		ret = shl_hashtable_new(&cache_images, shl_direct_hash, shl_direct_equal, NULL);
+		if (ret)
+			goto err_unlock;
+	}
+
+	while (cache_size + img->size > cache_max_size)
+		cache_evict();
+
+	/* ids are 24 bits to fit into a color, 0 is never used */
+	do {
+		cache_next_id = (cache_next_id + 1) & 0xffffff;
+	} while (!cache_next_id || shl_hashtable_find(cache_images, NULL, cache_next_id));
+	img->id = cache_next_id;
+
+	ret = shl_hashtable_insert(cache_images, img->id, img);
+	if (ret)
+		goto err_unlock;
+
+	img->used = __atomic_add_fetch(&cache_clock, 1, __ATOMIC_RELAXED);
+	shl_dlist_link(&cache_list, &img->list);
+	cache_size += img->size;
+	pthread_rwlock_unlock(&cache_lock);
+	return 0;
+
+err_unlock:
+	pthread_rwlock_unlock(&cache_lock);
+	image_free(img);
+	return ret;
+}
+
+/* drop the images of @owner, all of them if @id is 0 */
+static void cache_drop(const void *owner, uint32_t id)
+{
+	struct shl_dlist *iter, *tmp;
+	struct image *img;
+
+	pthread_rwlock_wrlock(&cache_lock);
+	shl_dlist_for_each_safe(iter, tmp, &cache_list) {
+		img = shl_dlist_entry(iter, struct image, list);
+		if (img->owner == owner && (!id || img->id == id))
+			cache_remove(img);
+	}
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * kmscon_image_set_cache_size:
+ * @size: Bytes of decoded images kept for all terminals, 0 to disable
+ *
+ * Images are dropped right away if the cache is now too small for them.
+ */
+void kmscon_image_set_cache_size(size_t size)
+{
+	pthread_rwlock_wrlock(&cache_lock);
+	cache_max_size = size;
+	while (cache_size > cache_max_size)
+		cache_evict();
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * kmscon_image_get_cache_usage:
+ * @images: Set to the number of images in the cache
+ * @size: Set to the bytes they take
+ * @max_size: Set to the size of the cache
+ */
+void kmscon_image_get_cache_usage(unsigned int *images, size_t *size, size_t *max_size)
+{
+	struct shl_dlist *iter;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	*images = 0;
+	shl_dlist_for_each(iter, &cache_list)
+		++*images;
+	*size = cache_size;
+	*max_size = cache_max_size;
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * kmscon_image_lock:
+ *
+ * Keep the tiles from being freed until kmscon_image_unlock(). This is a read
+ * lock, renderers of all terminals may hold it at once.
+ */
+void kmscon_image_lock(void)
+{
+	pthread_rwlock_rdlock(&cache_lock);
+}
+
+void kmscon_image_unlock(void)
+{
+	pthread_rwlock_unlock(&cache_lock);
+}
+
+/**
+ * kmscon_image_get_tile:
+ * @parser: Image parser of the terminal drawing the cell
+ * @id: Image id, the foreground color of the cell
+ * @col: Column of the cell in the image
+ * @row: Row of the cell in the image
+ *
+ * This must be called with kmscon_image_lock() held, which keeps the tile
+ * valid. It is XRGB32 of the cell size the image was decoded for.
+ *
+ * Returns: The tile, or NULL if the image was dropped, is smaller or is one of
+ * another terminal.
+ */
+const struct uterm_video_buffer *kmscon_image_get_tile(const struct kmscon_image_parser *parser,
+							uint32_t id, unsigned int col,
+							unsigned int row)
+{
+	struct image *img;
+
+	if (!parser || !shl_hashtable_find(cache_images, (void **)&img, id))
+		return NULL;
+	if (img->owner != parser || col >= img->cols || row >= img->rows)
+		return NULL;
+
+	__atomic_store_n(&img->used, __atomic_add_fetch(&cache_clock, 1, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	return image_tile(img, col, row);
+}
+
+/*
+ * Decoding
+ * Images are drawn into a canvas of XRGB32 on the background color first,
+ * which grows as sixels are drawn beyond its size, and then cut into tiles.
+ */
+
+struct canvas {
+	uint32_t *pix;
+	unsigned int width;  /* allocated */
+	unsigned int height; /* allocated */
+	unsigned int used_w;
+	unsigned int used_h;
+	unsigned int max_w;
+	unsigned int max_h;
+	uint32_t bg;
+};
+
+static void canvas_init(struct canvas *c, unsigned int max_w, unsigned int max_h, uint32_t bg)
+{
+	memset(c, 0, sizeof(*c));
+	c->max_w = max_w;
+	c->max_h = max_h;
+	c->bg = bg;
+}
+
+/* make room for @width x @height pixels, which must be within the maximum */
+static int canvas_grow(struct canvas *c, unsigned int width, unsigned int height)
+{
+	unsigned int w, h, x, y;
+	uint32_t *pix;
+
+	if (width <= c->width && height <= c->height)
+		return 0;
+
+	w = max(width, min(c->width * 2, c->max_w));
+	h = max(height, min(c->height * 2, c->max_h));
+	pix = malloc(sizeof(*pix) * w * h);
+	if (!pix)
+		return -ENOMEM;
+
+	for (y = 0; y < h; ++y) {
+		for (x = 0; x < w; ++x) {
+			if (x < c->width && y < c->height)
+				pix[y * w + x] = c->pix[y * c->width + x];
+			else
+				pix[y * w + x] = c->bg;
+		}
+	}
+
+	free(c->pix);
+	c->pix = pix;
+	c->width = w;
+	c->height = h;
+	return 0;
+}
+
+/* Cuts @c into tiles of @cell_w x @cell_h */
+static struct image *canvas_to_image(const struct canvas *c, unsigned int cell_w,
+				     unsigned int cell_h)
+{
+	struct uterm_video_buffer *tile;
+	struct image *img;
+	unsigned int col, row, x, y, px, py;
+	uint32_t *dst;
+
+	img = malloc(sizeof(*img));
+	if (!img)
+		return NULL;
+	memset(img, 0, sizeof(*img));
+	img->cols = min((c->used_w + cell_w - 1) / cell_w, KMSCON_IMAGE_MAX_CELLS);
+	img->rows = min((c->used_h + cell_h - 1) / cell_h, KMSCON_IMAGE_MAX_CELLS);
+	img->cell_w = cell_w;
+	img->cell_h = cell_h;
+	img->tile_size = (sizeof(*tile) + cell_w * cell_h * 4 + 15) & ~(size_t)15;
+	img->size = sizeof(*img) + img->tile_size * img->cols * img->rows;
+
+	img->tiles = malloc(img->tile_size * img->cols * img->rows);
+	if (!img->tiles) {
+		free(img);
+		return NULL;
+	}
+
+	for (row = 0; row < img->rows; ++row) {
+		for (col = 0; col < img->cols; ++col) {
+			tile = image_tile(img, col, row);
+			tile->width = cell_w;
+			tile->height = cell_h;
+			tile->stride = cell_w * 4;
+			tile->format = 0;
+			for (y = 0; y < cell_h; ++y) {
+				dst = (uint32_t *)&tile->data[y * tile->stride];
+				py = row * cell_h + y;
+				for (x = 0; x < cell_w; ++x) {
+					px = col * cell_w + x;
+					if (px < c->used_w && py < c->used_h)
+						dst[x] = c->pix[py * c->width + px];
+					else
+						dst[x] = c->bg;
+				}
+			}
+		}
+	}
+
+	return img;
+}
+
+static uint32_t blend(uint32_t fg, uint32_t bg, unsigned int alpha)
+{
+	unsigned int i, f, b, out = 0;
+
+	for (i = 0; i < 24; i += 8) {
+		f = (fg >> i) & 0xff;
+		b = (bg >> i) & 0xff;
+		out |= ((f * alpha + b * (255 - alpha) + 127) / 255) << i;
+	}
+	return out;
+}
+
+/*
+ * Sixel
+ * Six rows of pixels at a time, each character sets the pixels of one column
+ * in the current color. Colors are defined in RGB or HLS percentages, the
+ * registers nobody defined are those of the VT340.
+ */
+
+#define SIXEL_COLORS 256
+
+static const uint8_t sixel_vt340[16][3] = {
+	{0, 0, 0},    {20, 20, 80}, {80, 13, 13}, {20, 80, 20}, {80, 20, 80}, {20, 80, 80},
+	{80, 80, 20}, {53, 53, 53}, {26, 26, 26}, {33, 33, 60}, {60, 26, 26}, {33, 60, 33},
+	{60, 33, 60}, {33, 60, 60}, {60, 60, 33}, {80, 80, 80},
+};
+
+static uint32_t sixel_rgb(unsigned int r, unsigned int g, unsigned int b)
+{
+	r = min(r, 100U) * 255 / 100;
+	g = min(g, 100U) * 255 / 100;
+	b = min(b, 100U) * 255 / 100;
+	return r << 16 | g << 8 | b;
+}
+
+static unsigned int hls_channel(int m1, int m2, int h)
+{
+	h = (h + 360) % 360;
+	if (h < 60)
+		return m1 + (m2 - m1) * h / 60;
+	if (h < 180)
+		return m2;
+	if (h < 240)
+		return m1 + (m2 - m1) * (240 - h) / 60;
+	return m1;
+}
+
+/* the hue of DEC HLS starts at blue, where the usual one starts at red */
+static uint32_t sixel_hls(unsigned int h, unsigned int l, unsigned int s)
+{
+	int m1, m2;
+
+	l = min(l, 100U);
+	s = min(s, 100U);
+	h = (h + 240) % 360;
+	if (!s)
+		return sixel_rgb(l, l, l);
+
+	m2 = l <= 50 ? l * (100 + s) / 100 : l + s - l * s / 100;
+	m1 = 2 * l - m2;
+	return sixel_rgb(hls_channel(m1, m2, h + 120), hls_channel(m1, m2, h),
+			 hls_channel(m1, m2, h - 120));
+}
+
+/* Reads up to @max numbers separated by ';' at @pos, returns how many */
+static unsigned int parse_nums(const char *s, size_t len, size_t *pos, unsigned int *nums,
+			       unsigned int max)
+{
+	unsigned int num = 0;
+	size_t i = *pos;
+
+	for (;;) {
+		nums[num] = 0;
+		while (i < len && s[i] >= '0' && s[i] <= '9') {
+			if (nums[num] < 1000000)
+				nums[num] = nums[num] * 10 + s[i] - '0';
+			++i;
+		}
+		if (++num >= max || i >= len || s[i] != ';')
+			break;
+		++i;
+	}
+
+	*pos = i;
+	return num;
+}
+
+static int sixel_draw(struct canvas *c, unsigned int x, unsigned int y, unsigned int bits,
+		      unsigned int count, uint32_t color)
+{
+	unsigned int i, b, last;
+	int ret;
+
+	if (!bits || x >= c->max_w || y >= c->max_h)
+		return 0;
+	count = min(count, c->max_w - x);
+	last = 6;
+	while (!(bits & (1 << (last - 1))))
+		--last;
+	last = min(last, c->max_h - y);
+
+	ret = canvas_grow(c, x + count, y + last);
+	if (ret)
+		return ret;
+
+	for (b = 0; b < last; ++b) {
+		if (!(bits & (1 << b)))
+			continue;
+		for (i = 0; i < count; ++i)
+			c->pix[(y + b) * c->width + x + i] = color;
+	}
+	c->used_w = max(c->used_w, x + count);
+	c->used_h = max(c->used_h, y + last);
+	return 0;
+}
+
+static int sixel_decode(struct canvas *c, const char *data, size_t len)
+{
+	uint32_t palette[SIXEL_COLORS];
+	unsigned int nums[5], num, x = 0, y = 0, count, reg = 0, i;
+	size_t pos = 0;
+	int ret;
+	char ch;
+
+	for (i = 0; i < SIXEL_COLORS; ++i)
+		palette[i] = i < 16 ? sixel_rgb(sixel_vt340[i][0], sixel_vt340[i][1],
+						sixel_vt340[i][2]) : 0;
+
+	while (pos < len) {
+		ch = data[pos++];
+		count = 1;
+
+		switch (ch) {
+		case '"':
+			/* the aspect ratio is ignored, but the size is kept */
+			num = parse_nums(data, len, &pos, nums, 4);
+			if (num == 4 && nums[2] && nums[3]) {
+				nums[2] = min(nums[2], c->max_w);
+				nums[3] = min(nums[3], c->max_h);
+				ret = canvas_grow(c, nums[2], nums[3]);
+				if (ret)
+					return ret;
+				c->used_w = max(c->used_w, nums[2]);
+				c->used_h = max(c->used_h, nums[3]);
+			}
+			continue;
+		case '#':
+			num = parse_nums(data, len, &pos, nums, 5);
+			reg = nums[0] % SIXEL_COLORS;
+			if (num == 5 && nums[1] == 1)
+				palette[reg] = sixel_hls(nums[2], nums[3], nums[4]);
+			else if (num == 5 && nums[1] == 2)
+				palette[reg] = sixel_rgb(nums[2], nums[3], nums[4]);
+			continue;
+		case '$':
+			x = 0;
+			continue;
+		case '-':
+			x = 0;
+			y += 6;
+			continue;
+		case '!':
+			parse_nums(data, len, &pos, &count, 1);
+			if (pos >= len)
+				return 0;
+			ch = data[pos++];
+			count = max(count, 1U);
+			break;
+		}
+
+		if (ch < '?' || ch > '~')
+			continue;
+		ret = sixel_draw(c, x, y, ch - '?', count, palette[reg]);
+		if (ret)
+			return ret;
+		x = min(x + count, c->max_w);
+	}
+
+	return 0;
+}
+
+/*
+ * Kitty graphics
+ * The control data are key=value pairs before the ';', the payload after it is
+ * base64. A transmission in chunks has m=1 in all but the last one, which only
+ * the first one has the other keys of.
+ */
+
+struct kitty_cmd {
+	char action;	 /* a */
+	char medium;	 /* t */
+	char compressed; /* o */
+	char del;	 /* d */
+	unsigned int format;
+	unsigned int width;  /* s */
+	unsigned int height; /* v */
+	unsigned int id;     /* i */
+	unsigned int quiet;  /* q */
+	unsigned int more;   /* m */
+	unsigned int stay;   /* C */
+};
+
+/* what a client id of a terminal stands for */
+struct kitty_image {
+	uint32_t id;
+	unsigned int cols;
+	unsigned int rows;
+};
+
+enum parser_state {
+	STATE_GROUND,
+	STATE_ESC,
+	STATE_DCS,  /* ESC P, collecting the parameters */
+	STATE_APC,  /* ESC _ */
+	STATE_BODY, /* of a sixel or kitty sequence, up to ST */
+	STATE_BODY_ESC,
+};
+
+struct kmscon_image_parser {
+	const struct kmscon_image_ops *ops;
+	void *data;
+	unsigned int cell_w;
+	unsigned int cell_h;
+	uint32_t bg;
+
+	enum parser_state state;
+	bool kitty;   /* the body is a kitty command, not sixel */
+	bool dropped; /* the body is too long and is skipped */
+	char params[32];
+	size_t params_len;
+	char *body;
+	size_t body_len;
+	size_t body_size;
+
+	/* a kitty transmission in chunks */
+	bool chunked;
+	struct kitty_cmd chunk_cmd;
+	uint8_t *payload;
+	size_t payload_len;
+	size_t payload_size;
+
+	struct shl_hashtable *kitty_ids; /* struct kitty_image by client id */
+
+	/* ids of the last images placed, protected by @cache_lock */
+	struct shl_hashtable *placed_ids;
+	uint32_t placed[IMAGE_MAX_PLACED];
+	unsigned int placed_next;
+};
+
+/*
+ * Write the placeholders of image @id. It is remembered, as only cells of ids
+ * the parser placed itself are drawn as images, see kmscon_image_placed().
+ */
+static void place(struct kmscon_image_parser *p, uint32_t id, unsigned int cols,
+		  unsigned int rows, enum kmscon_image_cursor cursor)
+{
+	uint32_t *slot = &p->placed[p->placed_next];
+
+	pthread_rwlock_wrlock(&cache_lock);
+	if (!shl_hashtable_find(p->placed_ids, NULL, id) &&
+	    !shl_hashtable_insert(p->placed_ids, id, NULL)) {
+		if (*slot)
+			shl_hashtable_remove(p->placed_ids, *slot);
+		*slot = id;
+		p->placed_next = (p->placed_next + 1) % IMAGE_MAX_PLACED;
+	}
+	pthread_rwlock_unlock(&cache_lock);
+
+	p->ops->place(p->data, id, cols, rows, cursor);
+}
+
+static int buf_append(void *pbuf, size_t *len, size_t *size, const void *data, size_t num)
+{
+	char **buf = pbuf;
+	size_t nsize;
+	char *n;
+
+	if (!num)
+		return 0;
+	if (*len + num > *size) {
+		nsize = max(*size * 2, *len + num);
+		n = realloc(*buf, nsize);
+		if (!n)
+			return -ENOMEM;
+		*buf = n;
+		*size = nsize;
+	}
+
+	memcpy(*buf + *len, data, num);
+	*len += num;
+	return 0;
+}
+
+static int base64_value(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+/* Appends the decoded @len bytes at @s to the payload, skipping padding */
+static int base64_append(struct kmscon_image_parser *p, const char *s, size_t len)
+{
+	uint8_t out[3 * 256];
+	unsigned int bits = 0, num = 0, n = 0;
+	size_t i;
+	int v, ret;
+
+	for (i = 0; i < len; ++i) {
+		v = base64_value(s[i]);
+		if (v < 0)
+			continue;
+		bits = (bits << 6) | v;
+		if (++num < 4)
+			continue;
+		out[n++] = bits >> 16;
+		out[n++] = bits >> 8;
+		out[n++] = bits;
+		bits = 0;
+		num = 0;
+		if (n == sizeof(out)) {
+			ret = buf_append(&p->payload, &p->payload_len, &p->payload_size, out, n);
+			if (ret)
+				return ret;
+			n = 0;
+		}
+	}
+
+	/* what is left of a group shortened by padding */
+	if (num >= 2) {
+		bits <<= 6 * (4 - num);
+		out[n++] = bits >> 16;
+		if (num == 3)
+			out[n++] = bits >> 8;
+	}
+
+	return buf_append(&p->payload, &p->payload_len, &p->payload_size, out, n);
+}
+
+/* Parses the control data up to ';', returns where the payload starts */
+static size_t kitty_parse(const char *s, size_t len, struct kitty_cmd *cmd)
+{
+	unsigned int *num;
+	size_t pos = 0;
+	char key;
+
+	while (pos < len && s[pos] != ';') {
+		key = s[pos++];
+		if (pos >= len || s[pos] != '=')
+			break;
+		++pos;
+
+		num = NULL;
+		switch (key) {
+		case 'a':
+			cmd->action = s[pos];
+			break;
+		case 't':
+			cmd->medium = s[pos];
+			break;
+		case 'o':
+			cmd->compressed = s[pos];
+			break;
+		case 'd':
+			cmd->del = s[pos];
+			break;
+		case 'f':
+			num = &cmd->format;
+			break;
+		case 's':
+			num = &cmd->width;
+			break;
+		case 'v':
+			num = &cmd->height;
+			break;
+		case 'i':
+			num = &cmd->id;
+			break;
+		case 'q':
+			num = &cmd->quiet;
+			break;
+		case 'm':
+			num = &cmd->more;
+			break;
+		case 'C':
+			num = &cmd->stay;
+			break;
+		}
+
+		if (num)
+			parse_nums(s, len, &pos, num, 1);
+		while (pos < len && s[pos] != ',' && s[pos] != ';')
+			++pos;
+		if (pos < len && s[pos] == ',')
+			++pos;
+	}
+
+	return pos < len ? pos + 1 : len;
+}
+
+static void kitty_reply(struct kmscon_image_parser *p, const struct kitty_cmd *cmd,
+			const char *err)
+{
+	char buf[128];
+	int len;
+
+	if (!cmd->id || (!err && cmd->quiet >= 1) || cmd->quiet >= 2)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "\033_Gi=%u;%s\033\\", cmd->id, err ? err : "OK");
+	p->ops->reply(p->data, buf, len);
+}
+
+static void kitty_forget(struct kmscon_image_parser *p, unsigned int client_id, bool drop)
+{
+	struct kitty_image *ki;
+
+	if (!shl_hashtable_find(p->kitty_ids, (void **)&ki, client_id))
+		return;
+	shl_hashtable_remove(p->kitty_ids, client_id);
+	if (drop)
+		cache_drop(p, ki->id);
+	free(ki);
+}
+
+static void kitty_delete(struct kmscon_image_parser *p, const struct kitty_cmd *cmd)
+{
+	bool drop = cmd->del == 'A' || cmd->del == 'I';
+
+	if (cmd->del == 'i' || cmd->del == 'I') {
+		kitty_forget(p, cmd->id, drop);
+		return;
+	}
+
+	/* all of them, anything else isn't tracked */
+	shl_hashtable_free(p->kitty_ids);
+	p->kitty_ids = NULL;
+	shl_hashtable_new(&p->kitty_ids, shl_direct_hash, shl_direct_equal, free);
+	if (drop)
+		cache_drop(p, 0);
+}
+
+static struct image *kitty_decode(struct kmscon_image_parser *p, const struct kitty_cmd *cmd)
+{
+	unsigned int bpp = cmd->format == 24 ? 3 : 4;
+	unsigned int x, y, w, h;
+	const uint8_t *src;
+	struct canvas c;
+	struct image *img;
+	uint32_t rgb;
+
+	if (!cmd->width || !cmd->height ||
+	    (size_t)cmd->width * cmd->height * bpp > p->payload_len)
+		return NULL;
+
+	canvas_init(&c, p->cell_w * KMSCON_IMAGE_MAX_CELLS, p->cell_h * KMSCON_IMAGE_MAX_CELLS,
+		    p->bg);
+	w = min(cmd->width, c.max_w);
+	h = min(cmd->height, c.max_h);
+	if (canvas_grow(&c, w, h))
+		return NULL;
+	c.used_w = w;
+	c.used_h = h;
+
+	for (y = 0; y < h; ++y) {
+		src = &p->payload[(size_t)y * cmd->width * bpp];
+		for (x = 0; x < w; ++x, src += bpp) {
+			rgb = src[0] << 16 | src[1] << 8 | src[2];
+			if (bpp == 4)
+				rgb = blend(rgb, p->bg, src[3]);
+			c.pix[y * c.width + x] = rgb;
+		}
+	}
+
+	img = canvas_to_image(&c, p->cell_w, p->cell_h);
+	free(c.pix);
+	return img;
+}
+
+static void kitty_transmit(struct kmscon_image_parser *p, const struct kitty_cmd *cmd)
+{
+	struct kitty_image *ki;
+	struct image *img;
+	int ret;
+
+	if (cmd->medium != 'd' || cmd->compressed || (cmd->format != 24 && cmd->format != 32)) {
+		kitty_reply(p, cmd, "ENOTSUP:only direct RGB and RGBA data is supported");
+		return;
+	}
+
+	ki = malloc(sizeof(*ki));
+	if (!ki) {
+		kitty_reply(p, cmd, "ENOMEM:out of memory");
+		return;
+	}
+
+	img = kitty_decode(p, cmd);
+	if (!img) {
+		free(ki);
+		kitty_reply(p, cmd, "EINVAL:bad image data");
+		return;
+	}
+	img->owner = p;
+	ki->cols = img->cols;
+	ki->rows = img->rows;
+
+	ret = cache_add(img);
+	if (ret) {
+		free(ki);
+		kitty_reply(p, cmd, ret == -EFBIG ? "EFBIG:image cache too small" :
+						      "ENOMEM:out of memory");
+		return;
+	}
+	ki->id = img->id;
+
+	if (cmd->action == 'T')
+		place(p, ki->id, ki->cols, ki->rows,
+		      cmd->stay ? KMSCON_IMAGE_STAY : KMSCON_IMAGE_AFTER);
+
+	/* a new image replaces the one of the same id */
+	if (cmd->id)
+		kitty_forget(p, cmd->id, true);
+	if (!cmd->id || shl_hashtable_insert(p->kitty_ids, cmd->id, ki))
+		free(ki);
+	kitty_reply(p, cmd, NULL);
+}
+
+static void kitty_put(struct kmscon_image_parser *p, const struct kitty_cmd *cmd)
+{
+	struct kitty_image *ki;
+
+	if (!shl_hashtable_find(p->kitty_ids, (void **)&ki, cmd->id)) {
+		kitty_reply(p, cmd, "ENOENT:no such image");
+		return;
+	}
+
+	kitty_reply(p, cmd, NULL);
+	place(p, ki->id, ki->cols, ki->rows, cmd->stay ? KMSCON_IMAGE_STAY : KMSCON_IMAGE_AFTER);
+}
+
+static void kitty_command(struct kmscon_image_parser *p, const char *s, size_t len)
+{
+	struct kitty_cmd cmd;
+	size_t pos;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.action = 't';
+	cmd.medium = 'd';
+	cmd.format = 32;
+	pos = kitty_parse(s, len, &cmd);
+
+	if (p->chunked) {
+		/* only m and q may change */
+		p->chunk_cmd.more = cmd.more;
+		cmd = p->chunk_cmd;
+	} else {
+		p->payload_len = 0;
+	}
+
+	if (base64_append(p, &s[pos], len - pos)) {
+		p->chunked = false;
+		kitty_reply(p, &cmd, "ENOMEM:out of memory");
+		return;
+	}
+	if (cmd.more) {
+		if (p->payload_len > IMAGE_MAX_INPUT) {
+			p->chunked = false;
+			kitty_reply(p, &cmd, "EFBIG:image too large");
+			return;
+		}
+		p->chunked = true;
+		p->chunk_cmd = cmd;
+		return;
+	}
+	p->chunked = false;
+
+	switch (cmd.action) {
+	case 't':
+	case 'T':
+		kitty_transmit(p, &cmd);
+		break;
+	case 'p':
+		kitty_put(p, &cmd);
+		break;
+	case 'q':
+		if (cmd.medium != 'd' || cmd.compressed ||
+		    (cmd.format != 24 && cmd.format != 32))
+			kitty_reply(p, &cmd, "ENOTSUP:only direct RGB and RGBA data is supported");
+		else
+			kitty_reply(p, &cmd, NULL);
+		break;
+	case 'd':
+		kitty_delete(p, &cmd);
+		break;
+	default:
+		kitty_reply(p, &cmd, "EINVAL:unsupported action");
+		break;
+	}
+}
+
+static void sixel_command(struct kmscon_image_parser *p)
+{
+	struct canvas c;
+	struct image *img;
+	int ret;
+
+	canvas_init(&c, p->cell_w * KMSCON_IMAGE_MAX_CELLS, p->cell_h * KMSCON_IMAGE_MAX_CELLS,
+		    p->bg);
+	ret = sixel_decode(&c, p->body, p->body_len);
+	if (ret || !c.used_w || !c.used_h) {
+		free(c.pix);
+		return;
+	}
+
+	img = canvas_to_image(&c, p->cell_w, p->cell_h);
+	free(c.pix);
+	if (!img)
+		return;
+	img->owner = p;
+
+	ret = cache_add(img);
+	if (ret) {
+		log_debug("cannot keep sixel image (%d)", ret);
+		return;
+	}
+	place(p, img->id, img->cols, img->rows, KMSCON_IMAGE_BELOW);
+}
+
+/**
+ * kmscon_image_parser_new:
+ * @out: Where to store the new parser
+ * @ops: Where the output goes
+ * @data: User data for @ops
+ *
+ * The parser decodes the images of one terminal. Their cells are of the size
+ * given by kmscon_image_parser_set_cell().
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+int kmscon_image_parser_new(struct kmscon_image_parser **out, const struct kmscon_image_ops *ops,
+			    void *data)
+{
+	struct kmscon_image_parser *p;
+	int ret;
+
+	p = malloc(sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+	memset(p, 0, sizeof(*p));
+	p->ops = ops;
+	p->data = data;
+	p->cell_w = 8;
+	p->cell_h = 16;
+
+	ret = shl_hashtable_new(&p->kitty_ids, shl_direct_hash, shl_direct_equal, free);
+	if (ret)
+		goto err_free;
+
+	ret = shl_hashtable_new(&p->placed_ids, shl_direct_hash, shl_direct_equal, NULL);
+	if (ret)
+		goto err_kitty;
+
+	*out = p;
+	return 0;
+
+err_kitty:
+	shl_hashtable_free(p->kitty_ids);
+err_free:
+	free(p);
+	return ret;
+}
+
+/* The images of @parser are dropped as well */
+void kmscon_image_parser_free(struct kmscon_image_parser *parser)
+{
+	if (!parser)
+		return;
+
+	cache_drop(parser, 0);
+	shl_hashtable_free(parser->placed_ids);
+	shl_hashtable_free(parser->kitty_ids);
+	free(parser->payload);
+	free(parser->body);
+	free(parser);
+}
+
+/**
+ * kmscon_image_placed:
+ * @parser: Image parser of the terminal drawing the cell, or NULL
+ * @id: Image id, the foreground color of the cell
+ *
+ * Placeholders are plain text in the grid, programs can write them as well. A
+ * cell is only drawn as an image if @parser placed an image of its id, all
+ * other cells in plane 16 are text. Unlike kmscon_image_get_tile() this takes
+ * the lock itself.
+ *
+ * Returns: true if @parser wrote the placeholders of image @id
+ */
+bool kmscon_image_placed(const struct kmscon_image_parser *parser, uint32_t id)
+{
+	bool ret;
+
+	if (!parser)
+		return false;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	ret = shl_hashtable_find(parser->placed_ids, NULL, id);
+	pthread_rwlock_unlock(&cache_lock);
+	return ret;
+}
+
+/**
+ * kmscon_image_parser_set_cell:
+ * @parser: Image parser
+ * @width: Width of a cell in pixels
+ * @height: Height of a cell in pixels
+ * @r: Red of the default background
+ * @g: Green of the default background
+ * @b: Blue of the default background
+ *
+ * Images decoded from now on are cut into cells of this size and their
+ * transparent pixels show this background.
+ */
+void kmscon_image_parser_set_cell(struct kmscon_image_parser *parser, unsigned int width,
+				  unsigned int height, uint8_t r, uint8_t g, uint8_t b)
+{
+	if (!width || !height)
+		return;
+
+	parser->cell_w = width;
+	parser->cell_h = height;
+	parser->bg = r << 16 | g << 8 | b;
+}
+
+static void emit(struct kmscon_image_parser *p, const char *buf, size_t len)
+{
+	if (len)
+		p->ops->text(p->data, buf, len);
+}
+
+static void body_begin(struct kmscon_image_parser *p, bool kitty)
+{
+	p->state = STATE_BODY;
+	p->kitty = kitty;
+	p->dropped = false;
+	p->body_len = 0;
+}
+
+static void body_append(struct kmscon_image_parser *p, const char *buf, size_t len)
+{
+	if (p->dropped)
+		return;
+	if (p->body_len + len > IMAGE_MAX_INPUT ||
+	    buf_append(&p->body, &p->body_len, &p->body_size, buf, len)) {
+		log_warning("dropping inline image of more than %zu bytes", p->body_len + len);
+		p->dropped = true;
+	}
+}
+
+static void body_end(struct kmscon_image_parser *p)
+{
+	if (p->dropped)
+		return;
+	if (p->kitty)
+		kitty_command(p, p->body, p->body_len);
+	else
+		sixel_command(p);
+}
+
+/**
+ * kmscon_image_parser_input:
+ * @parser: Image parser
+ * @buf: Output of the pty
+ * @len: Bytes in @buf
+ *
+ * Sixel and kitty sequences are decoded, everything else is passed on to the
+ * text callback as it is. Sequences may be split across calls.
+ */
+void kmscon_image_parser_input(struct kmscon_image_parser *parser, const char *buf, size_t len)
+{
+	struct kmscon_image_parser *p = parser;
+	size_t i = 0, start = 0;
+	const char *esc;
+	char c;
+
+	while (i < len) {
+		c = buf[i];
+
+		switch (p->state) {
+		case STATE_GROUND:
+			esc = memchr(&buf[i], 0x1b, len - i);
+			if (!esc) {
+				i = len;
+				continue;
+			}
+			i = esc - buf;
+			emit(p, &buf[start], i - start);
+			p->state = STATE_ESC;
+			break;
+		case STATE_ESC:
+			if (c == 'P') {
+				p->params_len = 0;
+				p->state = STATE_DCS;
+			} else if (c == '_') {
+				p->state = STATE_APC;
+			} else {
+				emit(p, "\033", 1);
+				p->state = STATE_GROUND;
+				start = i;
+				continue;
+			}
+			break;
+		case STATE_DCS:
+			if (((c >= '0' && c <= '9') || c == ';') &&
+			    p->params_len < sizeof(p->params)) {
+				p->params[p->params_len++] = c;
+			} else if (c == 'q') {
+				body_begin(p, false);
+			} else {
+				/* any other DCS is for libtsm */
+				emit(p, "\033P", 2);
+				emit(p, p->params, p->params_len);
+				p->state = STATE_GROUND;
+				start = i;
+				continue;
+			}
+			break;
+		case STATE_APC:
+			if (c == 'G') {
+				body_begin(p, true);
+			} else {
+				emit(p, "\033_", 2);
+				p->state = STATE_GROUND;
+				start = i;
+				continue;
+			}
+			break;
+		case STATE_BODY:
+			esc = memchr(&buf[i], 0x1b, len - i);
+			if (!esc) {
+				body_append(p, &buf[i], len - i);
+				i = len;
+				continue;
+			}
+			body_append(p, &buf[i], esc - &buf[i]);
+			i = esc - buf;
+			p->state = STATE_BODY_ESC;
+			break;
+		case STATE_BODY_ESC:
+			if (c == '\\') {
+				body_end(p);
+				p->state = STATE_GROUND;
+				start = i + 1;
+			} else {
+				/* the sequence was cut off by another one */
+				p->chunked = false;
+				p->state = STATE_ESC;
+				continue;
+			}
+			break;
+		}
+
+		++i;
+	}
+
+	if (p->state == STATE_GROUND)
+		emit(p, &buf[start], len - start);
+}
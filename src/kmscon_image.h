@@ -0,0 +1,103 @@
+/*
+ * kmscon - Inline Images
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Inline Images
+ * Sixel (DCS q) and kitty graphics (APC G) sequences are taken out of the pty
+ * output before libtsm sees it, see kmscon_image_parser_input(). An image is
+ * decoded once, blended on the default background and cut into XRGB32 tiles
+ * of one cell each, which are kept in a cache shared by all terminals.
+ *
+ * libtsm knows nothing about images, so the terminal writes placeholders into
+ * the grid instead: each cell of an image is the codepoint
+ * KMSCON_IMAGE_CP_BASE + (row << 8 | col) in the RGB foreground color of the
+ * image id. The cells scroll, are cleared and are overwritten like any text,
+ * and the renderers look their tile up by id, see kmscon_image_get_tile().
+ * Programs can write such cells as well, so they are only drawn as images if
+ * the parser of the terminal placed that id, and only with tiles of its own
+ * images. Any other cell in plane 16 is drawn as text.
+ *
+ * The cache is limited to a number of bytes, the least recently drawn images
+ * are dropped to make room. Cells of a dropped image are drawn blank, as are
+ * the cells of images decoded for another cell size.
+ */
+
+#ifndef KMSCON_IMAGE_H
+#define KMSCON_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "uterm_video.h"
+
+/* codepoint of the top left cell of an image, in plane 16 for private use */
+#define KMSCON_IMAGE_CP_BASE 0x100000
+/* most cells of an image in each direction, larger ones are cut */
+#define KMSCON_IMAGE_MAX_CELLS 256
+
+/* where the cursor goes after an image was placed */
+enum kmscon_image_cursor {
+	KMSCON_IMAGE_BELOW, /* start of the line below, like sixel */
+	KMSCON_IMAGE_AFTER, /* after its last cell, like kitty */
+	KMSCON_IMAGE_STAY,  /* where it was, kitty with C=1 */
+};
+
+/* Returns true if @ch is the placeholder of the image cell at @col, @row */
+static inline bool kmscon_image_cell(uint32_t ch, unsigned int *col, unsigned int *row)
+{
+	if (ch < KMSCON_IMAGE_CP_BASE || ch >= KMSCON_IMAGE_CP_BASE + 0x10000)
+		return false;
+	*col = ch & 0xff;
+	*row = (ch >> 8) & 0xff;
+	return true;
+}
+
+void kmscon_image_set_cache_size(size_t size);
+void kmscon_image_get_cache_usage(unsigned int *images, size_t *size, size_t *max_size);
+void kmscon_image_lock(void);
+void kmscon_image_unlock(void);
+
+struct kmscon_image_ops {
+	/* output that isn't an image, in order */
+	void (*text)(void *data, const char *buf, size_t len);
+	/* draw placeholders for image @id at the cursor */
+	void (*place)(void *data, uint32_t id, unsigned int cols, unsigned int rows,
+		      enum kmscon_image_cursor cursor);
+	/* answer of a kitty command, to be written to the pty */
+	void (*reply)(void *data, const char *buf, size_t len);
+};
+
+struct kmscon_image_parser;
+
+int kmscon_image_parser_new(struct kmscon_image_parser **out, const struct kmscon_image_ops *ops,
+			    void *data);
+void kmscon_image_parser_free(struct kmscon_image_parser *parser);
+void kmscon_image_parser_set_cell(struct kmscon_image_parser *parser, unsigned int width,
+				  unsigned int height, uint8_t r, uint8_t g, uint8_t b);
+void kmscon_image_parser_input(struct kmscon_image_parser *parser, const char *buf, size_t len);
+bool kmscon_image_placed(const struct kmscon_image_parser *parser, uint32_t id);
+const struct uterm_video_buffer *kmscon_image_get_tile(const struct kmscon_image_parser *parser,
+							uint32_t id, unsigned int col,
+							unsigned int row);
+
+#endif /* KMSCON_IMAGE_H */
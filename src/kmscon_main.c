@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <paths.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -33,12 +34,17 @@
 #include <sys/signalfd.h>
 #include "conf.h"
 #include "eloop.h"
+#include "font_cache.h"
 #include "kmscon_conf.h"
+#include "kmscon_image.h"
+#include "kmscon_sched.h"
 #include "kmscon_seat.h"
 #include "shl_dlist.h"
 #include "shl_log.h"
 #include "shl_misc.h"
 #include "shl_module.h"
+#include "shl_timer.h"
+#include "shl_trace.h"
 #include "text.h"
 #include "uterm_input.h"
 #include "uterm_monitor.h"
@@ -51,6 +57,7 @@ struct app_video {
 	struct uterm_monitor_dev *udev;
 
 	char *node;
+	bool primary;
 	struct uterm_video *video;
 };
 
@@ -65,6 +72,13 @@ struct app_seat {
 	struct conf_ctx *conf_ctx;
 	struct kmscon_conf_t *conf;
 	struct shl_dlist videos;
+
+	/* seats without VTs may run on their own thread, see app_seat_thread() */
+	bool threaded;
+	bool stopped;
+	struct ev_eloop *eloop;
+	struct uterm_vt_master *vtm;
+	pthread_t thread;
 };
 
 struct kmscon_app {
@@ -85,6 +99,104 @@ const char be_drm3d[] = "drm3d";
 const char be_drm2d[] = "drm2d";
 const char be_fbdev[] = "fbdev";
 
+/* seat threads read this, too */
+static bool app_is_exiting(struct kmscon_app *app)
+{
+	return __atomic_load_n(&app->exiting, __ATOMIC_RELAXED);
+}
+
+/*
+ * Seat Threads
+ * With --seat-threads, seats without VTs get their own eloop and VT master and
+ * run on their own thread, so a busy seat does not delay the others. The main
+ * thread keeps the device monitor and the signals and passes the monitor
+ * events of the seat on as messages queued to its eloop. The monitor device is
+ * only the key of a video device then, the seat thread never touches it. The
+ * other way round, seat HUPs are queued to the main eloop.
+ */
+
+struct app_msg {
+	struct kmscon_app *app;
+	struct app_seat *seat;
+	unsigned int type;
+	unsigned int dev_type;
+	unsigned int dev_flags;
+	struct uterm_monitor_dev *dev;
+	char str[];
+};
+
+static struct app_msg *app_msg_new(struct kmscon_app *app, struct app_seat *seat,
+				   unsigned int type, const char *str)
+{
+	struct app_msg *msg;
+
+	if (!str)
+		str = "";
+
+	msg = malloc(sizeof(*msg) + strlen(str) + 1);
+	if (!msg)
+		return NULL;
+	memset(msg, 0, sizeof(*msg));
+	msg->app = app;
+	msg->seat = seat;
+	msg->type = type;
+	strcpy(msg->str, str);
+
+	return msg;
+}
+
+static void app_seat_hup(struct kmscon_app *app, const char *name)
+{
+	if (!app->conf->listen) {
+		--app->running_seats;
+		if (!app->running_seats) {
+			log_debug("seat HUP on %s in default-mode; exiting...", name);
+			ev_eloop_exit(app->eloop);
+		} else {
+			log_debug("seat HUP on %s in default-mode; %u more running seats", name,
+				  app->running_seats);
+		}
+	} else {
+		/* Seat HUP here means that we are running in
+		 * listen-mode on a modular-VT like kmscon-fake-VTs. But
+		 * this is an invalid setup. In listen-mode we
+		 * exclusively run as seat-VT-master without a
+		 * controlling VT and we effectively prevent other
+		 * setups during startup. Hence, we can safely drop the
+		 * seat here and ignore it.
+		 * You can destroy and recreate the seat to make kmscon
+		 * pick it up again in listen-mode. */
+		log_warning("seat HUP on %s in listen-mode; dropping seat...", name);
+	}
+}
+
+/* the seat may be gone already, so the message carries its name */
+static void app_seat_hup_event(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct app_msg *msg = data;
+
+	app_seat_hup(msg->app, msg->str);
+	free(msg);
+}
+
+static void app_seat_queue_hup(struct app_seat *seat)
+{
+	struct app_msg *msg;
+	int ret;
+
+	msg = app_msg_new(seat->app, NULL, KMSCON_SEAT_HUP, seat->name);
+	if (!msg) {
+		log_error("cannot allocate memory for HUP of seat %s", seat->name);
+		return;
+	}
+
+	ret = ev_eloop_queue_cb(seat->app->eloop, app_seat_hup_event, msg);
+	if (ret) {
+		log_error("cannot pass HUP of seat %s on: %d", seat->name, ret);
+		free(msg);
+	}
+}
+
 static int app_seat_event(struct kmscon_seat *s, unsigned int event, void *data)
 {
 	struct app_seat *seat = data;
@@ -112,48 +224,113 @@ static int app_seat_event(struct kmscon_seat *s, unsigned int event, void *data)
 		seat->awake = false;
 		break;
 	case KMSCON_SEAT_SLEEP:
-		if (app->vt_exit_count > 0) {
+		/* VTs of seat threads are not deactivated on exit */
+		if (!seat->threaded && app->vt_exit_count > 0) {
 			log_debug("deactivating VT on exit, %d to go", app->vt_exit_count - 1);
 			if (!--app->vt_exit_count)
 				ev_eloop_exit(app->eloop);
 		}
 		break;
 	case KMSCON_SEAT_WAKE_UP:
-		if (app->exiting)
+		if (app_is_exiting(app))
 			return -EBUSY;
 		break;
 	case KMSCON_SEAT_HUP:
 		kmscon_seat_free(seat->seat);
 		seat->seat = NULL;
 
-		if (!app->conf->listen) {
-			--app->running_seats;
-			if (!app->running_seats) {
-				log_debug("seat HUP on %s in default-mode; exiting...", seat->name);
-				ev_eloop_exit(app->eloop);
-			} else {
-				log_debug("seat HUP on %s in default-mode; %u more running seats",
-					  seat->name, app->running_seats);
-			}
-		} else {
-			/* Seat HUP here means that we are running in
-			 * listen-mode on a modular-VT like kmscon-fake-VTs. But
-			 * this is an invalid setup. In listen-mode we
-			 * exclusively run as seat-VT-master without a
-			 * controlling VT and we effectively prevent other
-			 * setups during startup. Hence, we can safely drop the
-			 * seat here and ignore it.
-			 * You can destroy and recreate the seat to make kmscon
-			 * pick it up again in listen-mode. */
-			log_warning("seat HUP on %s in listen-mode; dropping seat...", seat->name);
-		}
-
+		if (seat->threaded)
+			app_seat_queue_hup(seat);
+		else
+			app_seat_hup(app, seat->name);
 		break;
 	}
 
 	return 0;
 }
 
+static void *app_seat_thread(void *data)
+{
+	struct app_seat *seat = data;
+
+	log_debug("seat %s runs on its own thread", seat->name);
+
+	while (!seat->stopped)
+		ev_eloop_run(seat->eloop, -1);
+
+	uterm_vt_master_unref(seat->vtm);
+	ev_eloop_unref(seat->eloop);
+	return NULL;
+}
+
+/* the last message a seat thread gets */
+static void app_seat_stop_event(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct app_seat *seat = data;
+
+	kmscon_seat_free(seat->seat);
+	seat->seat = NULL;
+	seat->stopped = true;
+	ev_eloop_exit(eloop);
+}
+
+/* creates the seat on its own eloop, only fake VTs are allowed there */
+static int app_seat_new_threaded(struct app_seat *seat)
+{
+	struct kmscon_app *app = seat->app;
+	int ret;
+
+	ret = ev_eloop_new(&seat->eloop);
+	if (ret)
+		return ret;
+
+	ret = uterm_vt_master_new(&seat->vtm, seat->eloop);
+	if (ret)
+		goto err_eloop;
+
+	ret = kmscon_seat_new(&seat->seat, app->conf_ctx, seat->eloop, seat->vtm, UTERM_VT_FAKE,
+			      seat->name, app_seat_event, seat);
+	if (ret)
+		goto err_vtm;
+
+	seat->threaded = true;
+	return 0;
+
+err_vtm:
+	uterm_vt_master_unref(seat->vtm);
+	seat->vtm = NULL;
+err_eloop:
+	ev_eloop_unref(seat->eloop);
+	seat->eloop = NULL;
+	return ret;
+}
+
+static int app_seat_start_thread(struct app_seat *seat)
+{
+	sigset_t mask, old;
+	int ret;
+
+	/* signals are handled by the main eloop, so the thread blocks them all */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+	ret = pthread_create(&seat->thread, NULL, app_seat_thread, seat);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return -ret;
+}
+
+static int app_seat_stop_thread(struct app_seat *seat)
+{
+	int ret;
+
+	ret = ev_eloop_queue_cb(seat->eloop, app_seat_stop_event, seat);
+	if (ret)
+		return ret;
+
+	pthread_join(seat->thread, NULL);
+	return 0;
+}
+
 static int app_seat_new(struct kmscon_app *app, const char *sname, struct uterm_monitor_seat *useat)
 {
 	struct app_seat *seat;
@@ -162,7 +339,7 @@ static int app_seat_new(struct kmscon_app *app, const char *sname, struct uterm_
 	bool found;
 	char *cseat;
 
-	if (app->exiting)
+	if (app_is_exiting(app))
 		return -EBUSY;
 
 	found = false;
@@ -211,8 +388,15 @@ static int app_seat_new(struct kmscon_app *app, const char *sname, struct uterm_
 	if (!app->conf->listen)
 		types |= UTERM_VT_REAL;
 
-	ret = kmscon_seat_new(&seat->seat, app->conf_ctx, app->eloop, app->vtm, types, sname,
-			      app_seat_event, seat);
+	/* seats with a real VT stay on the main thread, which handles the signals */
+	ret = -ERANGE;
+	if (app->conf->seat_threads)
+		ret = app_seat_new_threaded(seat);
+	if (ret == -ERANGE) {
+		seat->eloop = app->eloop;
+		ret = kmscon_seat_new(&seat->seat, app->conf_ctx, app->eloop, app->vtm, types,
+				      sname, app_seat_event, seat);
+	}
 	if (ret) {
 		if (ret == -ERANGE)
 			log_debug("ignoring seat %s as it already has a seat manager", sname);
@@ -223,14 +407,29 @@ static int app_seat_new(struct kmscon_app *app, const char *sname, struct uterm_
 	seat->conf_ctx = kmscon_seat_get_conf(seat->seat);
 	seat->conf = conf_ctx_get_mem(seat->conf_ctx);
 
+	/* the thread takes over the seat once it is started up */
+	if (seat->threaded) {
+		kmscon_seat_startup(seat->seat);
+		ret = app_seat_start_thread(seat);
+		if (ret) {
+			log_error("cannot start thread of seat %s: %d", sname, ret);
+			goto err_seat;
+		}
+	}
+
 	uterm_monitor_set_seat_data(seat->useat, seat);
 	shl_dlist_link(&app->seats, &seat->list);
 	++app->running_seats;
 
-	kmscon_seat_startup(seat->seat);
+	if (!seat->threaded)
+		kmscon_seat_startup(seat->seat);
 
 	return 0;
 
+err_seat:
+	kmscon_seat_free(seat->seat);
+	uterm_vt_master_unref(seat->vtm);
+	ev_eloop_unref(seat->eloop);
 err_name:
 	free(seat->name);
 err_free:
@@ -244,7 +443,15 @@ static void app_seat_free(struct app_seat *seat)
 
 	shl_dlist_unlink(&seat->list);
 	uterm_monitor_set_seat_data(seat->useat, NULL);
-	kmscon_seat_free(seat->seat);
+
+	if (!seat->threaded) {
+		kmscon_seat_free(seat->seat);
+	} else if (app_seat_stop_thread(seat)) {
+		/* the thread still uses @seat, so it is leaked */
+		log_error("cannot stop thread of seat %s", seat->name);
+		return;
+	}
+
 	free(seat->name);
 	free(seat);
 }
@@ -256,14 +463,14 @@ static void app_seat_video_event(struct uterm_video *video, struct uterm_video_h
 
 	switch (ev->action) {
 	case UTERM_NEW:
-		if (!vid->seat->app->exiting)
+		if (!app_is_exiting(vid->seat->app))
 			kmscon_seat_add_display(vid->seat->seat, ev->display);
 		break;
 	case UTERM_GONE:
 		kmscon_seat_remove_display(vid->seat->seat, ev->display);
 		break;
 	case UTERM_REFRESH:
-		if (!vid->seat->app->exiting)
+		if (!app_is_exiting(vid->seat->app))
 			kmscon_seat_refresh_display(vid->seat->seat, ev->display);
 		break;
 	}
@@ -311,14 +518,32 @@ static bool app_seat_gpu_is_ignored(struct app_seat *seat, unsigned int type, bo
 	return false;
 }
 
+/* USB displays render on the primary GPU of the seat, once it was added */
+static const char *app_seat_render_node(struct app_seat *seat)
+{
+	struct shl_dlist *iter;
+	struct app_video *vid;
+
+	shl_dlist_for_each(iter, &seat->videos)
+	{
+		vid = shl_dlist_entry(iter, struct app_video, list);
+		if (vid->primary)
+			return vid->node;
+	}
+
+	return NULL;
+}
+
 static int app_seat_add_video(struct app_seat *seat, unsigned int type, unsigned int flags,
 			      const char *node, struct uterm_monitor_dev *udev)
 {
 	int ret;
 	const char *backend;
+	const char *render_node = NULL;
 	struct app_video *vid;
+	uint64_t start;
 
-	if (seat->app->exiting)
+	if (app_is_exiting(seat->app))
 		return -EBUSY;
 
 	if (app_seat_gpu_is_ignored(seat, type, flags & UTERM_MONITOR_DRM_BACKED,
@@ -336,6 +561,7 @@ static int app_seat_add_video(struct app_seat *seat, unsigned int type, unsigned
 	memset(vid, 0, sizeof(*vid));
 	vid->seat = seat;
 	vid->udev = udev;
+	vid->primary = type == UTERM_MONITOR_DRM && (flags & UTERM_MONITOR_PRIMARY);
 
 	vid->node = strdup(node);
 	if (!vid->node) {
@@ -365,13 +591,27 @@ static int app_seat_add_video(struct app_seat *seat, unsigned int type, unsigned
 			desired_height = 0;
 		}
 	}
-	ret = uterm_video_new(&vid->video, seat->app->eloop, node, backend, desired_width,
-			      desired_height, seat->conf->use_original_mode);
+	/* the drm3d module is only loaded once a device uses it */
+	start = shl_timer_now();
+	if (backend == be_drm3d) {
+		kmscon_load_module(backend);
+		if (flags & UTERM_MONITOR_AUX)
+			render_node = app_seat_render_node(seat);
+	}
+	ret = uterm_video_new_offload(&vid->video, seat->eloop, node, render_node, backend,
+				      desired_width, desired_height,
+				      seat->conf->use_original_mode);
+	if (ret && render_node) {
+		log_info("cannot render frames of %s on %s (%d); rendering on the device itself",
+			 vid->node, render_node, ret);
+		ret = uterm_video_new(&vid->video, seat->eloop, node, backend, desired_width,
+				      desired_height, seat->conf->use_original_mode);
+	}
 	if (ret) {
 		if (backend == be_drm3d) {
 			log_info("cannot create drm3d device %s on seat %s (%d); trying drm2d mode",
 				 vid->node, seat->name, ret);
-			ret = uterm_video_new(&vid->video, seat->app->eloop, node, be_drm2d,
+			ret = uterm_video_new(&vid->video, seat->eloop, node, be_drm2d,
 					      desired_width, desired_height,
 					      seat->conf->use_original_mode);
 			if (ret)
@@ -380,6 +620,13 @@ static int app_seat_add_video(struct app_seat *seat, unsigned int type, unsigned
 			goto err_node;
 		}
 	}
+	shl_trace_span("video", vid->node, start);
+	uterm_video_set_mailbox(vid->video, seat->conf->mailbox);
+	uterm_video_set_batch_flips(vid->video, seat->conf->batch_flips);
+	uterm_video_set_vrr(vid->video, seat->conf->vrr);
+	uterm_video_set_gbm_scanout(vid->video, seat->conf->gbm_scanout);
+	uterm_video_set_shadow(vid->video, seat->conf->shadow_fb);
+	uterm_video_set_shader_cache(vid->video, seat->conf->shader_cache_dir);
 
 	ret = uterm_video_register_cb(vid->video, app_seat_video_event, vid);
 	if (ret) {
@@ -391,7 +638,8 @@ static int app_seat_add_video(struct app_seat *seat, unsigned int type, unsigned
 	if (seat->awake)
 		uterm_video_wake_up(vid->video);
 
-	uterm_monitor_set_dev_data(vid->udev, vid);
+	if (!seat->threaded)
+		uterm_monitor_set_dev_data(vid->udev, vid);
 	shl_dlist_link(&seat->videos, &vid->list);
 	return 0;
 
@@ -411,7 +659,8 @@ static void app_seat_remove_video(struct app_seat *seat, struct app_video *vid)
 	log_debug("free video device %s on seat %s", vid->node, seat->name);
 
 	shl_dlist_unlink(&vid->list);
-	uterm_monitor_set_dev_data(vid->udev, NULL);
+	if (!seat->threaded)
+		uterm_monitor_set_dev_data(vid->udev, NULL);
 	uterm_video_unregister_cb(vid->video, app_seat_video_event, vid);
 
 	disp = uterm_video_get_displays(vid->video);
@@ -425,18 +674,118 @@ static void app_seat_remove_video(struct app_seat *seat, struct app_video *vid)
 	free(vid);
 }
 
+static void app_seat_new_dev(struct app_seat *seat, unsigned int type, unsigned int flags,
+			     const char *node, struct uterm_monitor_dev *udev)
+{
+	switch (type) {
+	case UTERM_MONITOR_DRM:
+	case UTERM_MONITOR_FBDEV:
+		app_seat_add_video(seat, type, flags, node, udev);
+		break;
+	case UTERM_MONITOR_INPUT:
+		log_debug("new input device %s on seat %s", node, seat->name);
+		kmscon_seat_add_input(seat->seat, node);
+		break;
+	}
+}
+
+static void app_seat_free_dev(struct app_seat *seat, unsigned int type, const char *node,
+			      struct app_video *vid)
+{
+	switch (type) {
+	case UTERM_MONITOR_DRM:
+	case UTERM_MONITOR_FBDEV:
+		if (vid)
+			app_seat_remove_video(seat, vid);
+		break;
+	case UTERM_MONITOR_INPUT:
+		log_debug("free input device %s on seat %s", node, seat->name);
+		kmscon_seat_remove_input(seat->seat, node);
+		break;
+	}
+}
+
+static void app_seat_hotplug_dev(struct app_seat *seat, unsigned int type, struct app_video *vid)
+{
+	switch (type) {
+	case UTERM_MONITOR_DRM:
+	case UTERM_MONITOR_FBDEV:
+		if (!vid)
+			return;
+
+		log_debug("video hotplug event on device %s on seat %s", vid->node, seat->name);
+		uterm_video_poll(vid->video);
+		break;
+	}
+}
+
+/* seat threads do not set the device data, so they look the video up */
+static struct app_video *app_seat_find_video(struct app_seat *seat,
+					     struct uterm_monitor_dev *udev)
+{
+	struct shl_dlist *iter;
+	struct app_video *vid;
+
+	shl_dlist_for_each(iter, &seat->videos)
+	{
+		vid = shl_dlist_entry(iter, struct app_video, list);
+		if (vid->udev == udev)
+			return vid;
+	}
+
+	return NULL;
+}
+
+static void app_seat_msg_event(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct app_msg *msg = data;
+	struct app_seat *seat = msg->seat;
+
+	switch (msg->type) {
+	case UTERM_MONITOR_NEW_DEV:
+		app_seat_new_dev(seat, msg->dev_type, msg->dev_flags, msg->str, msg->dev);
+		break;
+	case UTERM_MONITOR_FREE_DEV:
+		app_seat_free_dev(seat, msg->dev_type, msg->str,
+				  app_seat_find_video(seat, msg->dev));
+		break;
+	case UTERM_MONITOR_HOTPLUG_DEV:
+		app_seat_hotplug_dev(seat, msg->dev_type, app_seat_find_video(seat, msg->dev));
+		break;
+	}
+
+	free(msg);
+}
+
+static void app_seat_queue_event(struct app_seat *seat, struct uterm_monitor_event *ev)
+{
+	struct app_msg *msg;
+	int ret;
+
+	msg = app_msg_new(seat->app, seat, ev->type, ev->dev_node);
+	if (!msg) {
+		log_error("cannot allocate memory for event of seat %s", seat->name);
+		return;
+	}
+	msg->dev_type = ev->dev_type;
+	msg->dev_flags = ev->dev_flags;
+	msg->dev = ev->dev;
+
+	ret = ev_eloop_queue_cb(seat->eloop, app_seat_msg_event, msg);
+	if (ret) {
+		log_error("cannot pass event on to seat %s: %d", seat->name, ret);
+		free(msg);
+	}
+}
+
 static void app_monitor_event(struct uterm_monitor *mon, struct uterm_monitor_event *ev, void *data)
 {
 	struct kmscon_app *app = data;
 	struct app_seat *seat;
-	struct app_video *vid;
-	int ret;
 
 	switch (ev->type) {
 	case UTERM_MONITOR_NEW_SEAT:
-		ret = app_seat_new(app, ev->seat_name, ev->seat);
-		if (ret)
-			return;
+		app_seat_new(app, ev->seat_name, ev->seat);
 		break;
 	case UTERM_MONITOR_FREE_SEAT:
 		if (ev->seat_data)
@@ -447,54 +796,30 @@ static void app_monitor_event(struct uterm_monitor *mon, struct uterm_monitor_ev
 		if (!seat)
 			return;
 
-		switch (ev->dev_type) {
-		case UTERM_MONITOR_DRM:
-		case UTERM_MONITOR_FBDEV:
-			ret = app_seat_add_video(seat, ev->dev_type, ev->dev_flags, ev->dev_node,
-						 ev->dev);
-			if (ret)
-				return;
-			break;
-		case UTERM_MONITOR_INPUT:
-			log_debug("new input device %s on seat %s", ev->dev_node, seat->name);
-			kmscon_seat_add_input(seat->seat, ev->dev_node);
-			break;
-		}
+		if (seat->threaded)
+			app_seat_queue_event(seat, ev);
+		else
+			app_seat_new_dev(seat, ev->dev_type, ev->dev_flags, ev->dev_node, ev->dev);
 		break;
 	case UTERM_MONITOR_FREE_DEV:
 		seat = ev->seat_data;
 		if (!seat)
 			return;
 
-		switch (ev->dev_type) {
-		case UTERM_MONITOR_DRM:
-		case UTERM_MONITOR_FBDEV:
-			if (ev->dev_data)
-				app_seat_remove_video(seat, ev->dev_data);
-			break;
-		case UTERM_MONITOR_INPUT:
-			log_debug("free input device %s on seat %s", ev->dev_node, seat->name);
-			kmscon_seat_remove_input(seat->seat, ev->dev_node);
-			break;
-		}
+		if (seat->threaded)
+			app_seat_queue_event(seat, ev);
+		else
+			app_seat_free_dev(seat, ev->dev_type, ev->dev_node, ev->dev_data);
 		break;
 	case UTERM_MONITOR_HOTPLUG_DEV:
 		seat = ev->seat_data;
 		if (!seat)
 			return;
 
-		switch (ev->dev_type) {
-		case UTERM_MONITOR_DRM:
-		case UTERM_MONITOR_FBDEV:
-			vid = ev->dev_data;
-			if (!vid)
-				return;
-
-			log_debug("video hotplug event on device %s on seat %s", vid->node,
-				  seat->name);
-			uterm_video_poll(vid->video);
-			break;
-		}
+		if (seat->threaded)
+			app_seat_queue_event(seat, ev);
+		else
+			app_seat_hotplug_dev(seat, ev->dev_type, ev->dev_data);
 		break;
 	}
 }
@@ -509,10 +834,55 @@ static void app_sig_generic(struct ev_eloop *eloop, struct signalfd_siginfo *inf
 
 static void app_sig_ignore(struct ev_eloop *eloop, struct signalfd_siginfo *info, void *data) {}
 
+static void app_child_ignore(struct ev_eloop *eloop, struct ev_child_data *chld, void *data) {}
+
+static void app_seat_report(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct app_seat *seat = data;
+
+	kmscon_seat_report(seat->seat);
+}
+
+/*
+ * SIGUSR1/SIGUSR2 belong to VT switching, so the memory report is logged on
+ * SIGURG, along with the profile if it is built in. Seats on their own thread
+ * log theirs from there.
+ */
+static void app_sig_report(struct ev_eloop *eloop, struct signalfd_siginfo *info, void *data)
+{
+	struct kmscon_app *app = data;
+	struct shl_dlist *iter;
+	struct app_seat *seat;
+	unsigned int images;
+	size_t size, max_size;
+	int ret;
+
+	kmscon_text_profile_dump();
+
+	kmscon_image_get_cache_usage(&images, &size, &max_size);
+	log_info("image cache: %u images, %zu of %zu KiB", images, size / 1024, max_size / 1024);
+
+	shl_dlist_for_each(iter, &app->seats)
+	{
+		seat = shl_dlist_entry(iter, struct app_seat, list);
+		if (!seat->threaded) {
+			kmscon_seat_report(seat->seat);
+			continue;
+		}
+
+		ret = ev_eloop_queue_cb(seat->eloop, app_seat_report, seat);
+		if (ret)
+			log_error("cannot ask seat %s for its report: %d", seat->name, ret);
+	}
+}
+
 static void destroy_app(struct kmscon_app *app)
 {
 	uterm_monitor_unref(app->mon);
 	uterm_vt_master_unref(app->vtm);
+	kmscon_text_profile_dump();
+	ev_eloop_unregister_signal_cb(app->eloop, SIGURG, app_sig_report, app);
+	ev_eloop_unregister_child_cb(app->eloop, app_child_ignore, app);
 	ev_eloop_unregister_signal_cb(app->eloop, SIGPIPE, app_sig_ignore, app);
 	ev_eloop_unregister_signal_cb(app->eloop, SIGINT, app_sig_generic, app);
 	ev_eloop_unregister_signal_cb(app->eloop, SIGTERM, app_sig_generic, app);
@@ -522,6 +892,7 @@ static void destroy_app(struct kmscon_app *app)
 static int setup_app(struct kmscon_app *app)
 {
 	int ret;
+	uint64_t start;
 	bool use_vt = (app->conf->vt != 0);
 
 	shl_dlist_init(&app->seats);
@@ -550,17 +921,35 @@ static int setup_app(struct kmscon_app *app)
 		goto err_app;
 	}
 
+	/* seat threads block all signals, so their children are reaped here and
+	 * the eloop passes their status on */
+	if (app->conf->seat_threads) {
+		ret = ev_eloop_register_child_cb(app->eloop, app_child_ignore, app);
+		if (ret) {
+			log_error("cannot register child handler: %d", ret);
+			goto err_app;
+		}
+	}
+
+	ret = ev_eloop_register_signal_cb(app->eloop, SIGURG, app_sig_report, app);
+	if (ret) {
+		log_error("cannot register SIGURG signal handler: %d", ret);
+		goto err_app;
+	}
+
 	ret = uterm_vt_master_new(&app->vtm, app->eloop);
 	if (ret) {
 		log_error("cannot create VT master: %d", ret);
 		goto err_app;
 	}
 
+	start = shl_timer_now();
 	ret = uterm_monitor_new(&app->mon, app->eloop, app_monitor_event, use_vt, app);
 	if (ret) {
 		log_error("cannot create device monitor: %d", ret);
 		goto err_app;
 	}
+	shl_trace_span("monitor", NULL, start);
 
 	log_debug("scanning for devices...");
 	uterm_monitor_scan(app->mon);
@@ -579,6 +968,8 @@ int main(int argc, char **argv)
 	struct kmscon_conf_t *conf;
 	struct kmscon_app app;
 
+	shl_trace_begin();
+
 	ret = kmscon_conf_new(&conf_ctx);
 	if (ret) {
 		log_error("cannot create configuration: %d", ret);
@@ -589,15 +980,36 @@ int main(int argc, char **argv)
 	ret = kmscon_conf_load_main(conf_ctx, argc, argv);
 	if (ret)
 		log_error("cannot load configuration: %d", ret);
+	shl_trace_span("conf", NULL, 0);
 
 	if (conf->exit) {
 		kmscon_conf_free(conf_ctx);
 		return 0;
 	}
 
-	kmscon_load_modules();
+	/* before any thread is started, so they all inherit it */
+	ret = kmscon_sched_setup(conf);
+	if (ret)
+		log_warning("cannot read scheduling settings (%d)", ret);
+
+	ret = log_start_writer();
+	if (ret)
+		log_warning("cannot start log writer (%d), logging synchronously", ret);
+
+	if (shl_trace_set_file(conf->startup_trace))
+		log_warning("cannot set startup trace file");
+
+	/* modules are loaded when their backend is first used */
+	kmscon_glyph_cache_set_dir(conf->font_cache_dir);
+	uterm_input_set_keymap_cache(conf->xkb_cache_dir);
 	kmscon_font_register(&kmscon_font_8x16_ops);
 	kmscon_text_register(&kmscon_text_bbulk_ops);
+	ret = kmscon_text_bbulk_set_threads(conf->render_threads);
+	if (ret)
+		log_warning("cannot start blend threads (%d), blending on one thread", ret);
+	kmscon_text_bbulk_set_cell_cache((size_t)conf->cell_cache * 1024);
+	kmscon_text_bbulk_set_damage_rects(conf->damage_rects);
+	kmscon_image_set_cache_size((size_t)conf->image_cache * 1024 * 1024);
 	uterm_register_drm2d();
 	uterm_register_fbdev();
 
@@ -616,7 +1028,7 @@ int main(int argc, char **argv)
 		ev_eloop_run(app.eloop, -1);
 	}
 
-	app.exiting = true;
+	__atomic_store_n(&app.exiting, true, __ATOMIC_RELAXED);
 
 	if (app.conf->switchvt) {
 		/* The VT subsystem needs to acknowledge the VT-leave so if it
@@ -639,9 +1051,12 @@ int main(int argc, char **argv)
 
 	destroy_app(&app);
 err_unload:
+	kmscon_text_bbulk_set_threads(0);
 	kmscon_text_unregister(kmscon_text_bbulk_ops.name);
 	kmscon_font_unregister(kmscon_font_8x16_ops.name);
 	kmscon_unload_modules();
+	kmscon_glyph_cache_set_dir(NULL);
+	uterm_input_set_keymap_cache(NULL);
 	kmscon_conf_free(conf_ctx);
 err_out:
 	if (ret)
@@ -0,0 +1,295 @@
+/*
+ * kmscon - Session Replay
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Session Replay
+ * A timer plays back the chunks that are due and then yields to the event
+ * loop, at the latest after REPLAY_BUDGET microseconds, so frames are drawn
+ * and page-flips handled in between like with a real child. In fast mode, all
+ * chunks are due right away.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "eloop.h"
+#include "kmscon_replay.h"
+#include "shl_log.h"
+#include "shl_timer.h"
+
+#define LOG_SUBSYSTEM "replay"
+
+#define REPLAY_BUDGET 4000
+#define REPLAY_HEADER 12
+
+struct kmscon_replay {
+	struct ev_eloop *eloop;
+	struct ev_timer *timer;
+	kmscon_replay_cb cb;
+	void *data;
+	bool fast;
+	bool running;
+	bool done;
+
+	char *buf;
+	size_t size;
+	size_t pos;
+
+	uint64_t first;	 /* recorded time of the first chunk */
+	uint64_t last;	 /* recorded time of the last chunk played */
+	uint64_t base;	 /* when the first chunk was due, moved by pauses */
+	uint64_t paused; /* when the playback was stopped */
+	uint64_t start;	 /* when the playback was started or resumed */
+	struct kmscon_replay_stats stats;
+};
+
+static int read_file(struct kmscon_replay *rp, const char *file)
+{
+	struct stat st;
+	ssize_t len;
+	int fd, ret;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_error("cannot open recording %s (%d): %m", file, errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		log_error("cannot stat recording %s (%d): %m", file, errno);
+		goto err_close;
+	}
+
+	rp->size = st.st_size;
+	rp->buf = malloc(rp->size ? rp->size : 1);
+	if (!rp->buf) {
+		ret = -ENOMEM;
+		goto err_close;
+	}
+
+	while (rp->pos < rp->size) {
+		len = read(fd, &rp->buf[rp->pos], rp->size - rp->pos);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			ret = len ? -errno : -EIO;
+			log_error("cannot read recording %s (%d): %m", file, errno);
+			goto err_buf;
+		}
+		rp->pos += len;
+	}
+
+	rp->pos = 0;
+	close(fd);
+	return 0;
+
+err_buf:
+	free(rp->buf);
+	rp->buf = NULL;
+err_close:
+	close(fd);
+	return ret;
+}
+
+/* the chunk at the current position, false at the end or if it is cut off */
+static bool next_chunk(struct kmscon_replay *rp, uint64_t *time, const char **u8, size_t *len)
+{
+	uint32_t hdr[3];
+
+	if (rp->size - rp->pos < REPLAY_HEADER)
+		return false;
+
+	memcpy(hdr, &rp->buf[rp->pos], sizeof(hdr));
+	*len = le32toh(hdr[2]);
+	if (rp->size - rp->pos - REPLAY_HEADER < *len)
+		return false;
+
+	*time = le32toh(hdr[0]) * 1000000ULL + le32toh(hdr[1]);
+	*u8 = &rp->buf[rp->pos + REPLAY_HEADER];
+	return true;
+}
+
+static void schedule(struct kmscon_replay *rp, uint64_t usecs)
+{
+	struct itimerspec spec;
+
+	if (!usecs)
+		usecs = 1;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = usecs / 1000000;
+	spec.it_value.tv_nsec = usecs % 1000000 * 1000;
+	ev_timer_update(rp->timer, &spec);
+}
+
+static void finish(struct kmscon_replay *rp)
+{
+	if (rp->pos < rp->size)
+		log_warning("recording is cut off, ignoring its last %zu bytes",
+			    rp->size - rp->pos);
+
+	ev_timer_update(rp->timer, NULL);
+	rp->stats.elapsed += shl_timer_now() - rp->start;
+	rp->stats.recorded = rp->last - rp->first;
+	rp->running = false;
+	rp->done = true;
+	rp->cb(rp, NULL, 0, rp->data);
+}
+
+static void replay_timeout(struct ev_timer *timer, uint64_t exp, void *data)
+{
+	struct kmscon_replay *rp = data;
+	uint64_t begin, now, time, due;
+	const char *u8;
+	size_t len;
+
+	begin = shl_timer_now();
+	while (rp->running) {
+		if (!next_chunk(rp, &time, &u8, &len)) {
+			finish(rp);
+			return;
+		}
+
+		now = shl_timer_now();
+		if (!rp->stats.chunks)
+			rp->first = time;
+		if (!rp->fast) {
+			due = rp->base + (time > rp->first ? time - rp->first : 0);
+			if (due > now) {
+				schedule(rp, due - now);
+				return;
+			}
+		}
+		if (now - begin >= REPLAY_BUDGET) {
+			schedule(rp, 0);
+			return;
+		}
+
+		rp->pos += REPLAY_HEADER + len;
+		rp->last = time > rp->last ? time : rp->last;
+		++rp->stats.chunks;
+		rp->stats.bytes += len;
+		if (len)
+			rp->cb(rp, u8, len, rp->data);
+		rp->stats.usec += shl_timer_now() - now;
+	}
+}
+
+int kmscon_replay_new(struct kmscon_replay **out, struct ev_eloop *eloop, const char *file,
+		      bool fast, kmscon_replay_cb cb, void *data)
+{
+	struct kmscon_replay *rp;
+	int ret;
+
+	if (!out || !eloop || !file || !cb)
+		return -EINVAL;
+
+	rp = malloc(sizeof(*rp));
+	if (!rp)
+		return -ENOMEM;
+	memset(rp, 0, sizeof(*rp));
+	rp->eloop = eloop;
+	rp->fast = fast;
+	rp->cb = cb;
+	rp->data = data;
+
+	ret = read_file(rp, file);
+	if (ret)
+		goto err_free;
+
+	ret = ev_eloop_new_timer(eloop, &rp->timer, NULL, replay_timeout, rp);
+	if (ret)
+		goto err_buf;
+
+	log_debug("replaying %zu bytes of %s%s", rp->size, file,
+		  fast ? " as fast as possible" : "");
+	*out = rp;
+	return 0;
+
+err_buf:
+	free(rp->buf);
+err_free:
+	free(rp);
+	return ret;
+}
+
+void kmscon_replay_free(struct kmscon_replay *rp)
+{
+	if (!rp)
+		return;
+
+	ev_eloop_rm_timer(rp->timer);
+	free(rp->buf);
+	free(rp);
+}
+
+int kmscon_replay_start(struct kmscon_replay *rp)
+{
+	uint64_t now;
+
+	if (!rp)
+		return -EINVAL;
+	if (rp->running || rp->done)
+		return 0;
+
+	now = shl_timer_now();
+	if (!rp->base)
+		rp->base = now;
+	else
+		rp->base += now - rp->paused;
+	rp->start = now;
+	rp->running = true;
+	schedule(rp, 0);
+	return 0;
+}
+
+void kmscon_replay_stop(struct kmscon_replay *rp)
+{
+	if (!rp || !rp->running)
+		return;
+
+	ev_timer_update(rp->timer, NULL);
+	rp->paused = shl_timer_now();
+	rp->stats.elapsed += rp->paused - rp->start;
+	rp->running = false;
+}
+
+bool kmscon_replay_is_done(struct kmscon_replay *rp)
+{
+	return rp && rp->done;
+}
+
+void kmscon_replay_get_stats(struct kmscon_replay *rp, struct kmscon_replay_stats *out)
+{
+	if (!rp || !out)
+		return;
+
+	memcpy(out, &rp->stats, sizeof(*out));
+}
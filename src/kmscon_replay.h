@@ -0,0 +1,70 @@
+/*
+ * kmscon - Session Replay
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Session Replay
+ * Plays back pty output recorded in the ttyrec format, see "Recording" in
+ * pty.c, either with the recorded timing or as fast as it can be parsed. The
+ * chunks are handed to a callback like the output of a child, so the whole
+ * terminal pipeline can be measured on canned workloads.
+ *
+ * The file is read into memory up front so disk I/O doesn't disturb the
+ * timing. kmscon_replay_start() starts the playback or resumes it where
+ * kmscon_replay_stop() paused it; paused time doesn't count as recorded time.
+ * At the end of the file, the callback gets a chunk of length 0.
+ */
+
+#ifndef KMSCON_REPLAY_H
+#define KMSCON_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "eloop.h"
+
+struct kmscon_replay;
+
+struct kmscon_replay_stats {
+	/* chunks and bytes played back */
+	uint64_t chunks;
+	uint64_t bytes;
+	/* time spent in the callback in us */
+	uint64_t usec;
+	/* time from the first to the last chunk in us, without pauses */
+	uint64_t elapsed;
+	/* time the recording took in us */
+	uint64_t recorded;
+};
+
+typedef void (*kmscon_replay_cb)(struct kmscon_replay *rp, const char *u8, size_t len,
+				 void *data);
+
+int kmscon_replay_new(struct kmscon_replay **out, struct ev_eloop *eloop, const char *file,
+		      bool fast, kmscon_replay_cb cb, void *data);
+void kmscon_replay_free(struct kmscon_replay *rp);
+int kmscon_replay_start(struct kmscon_replay *rp);
+void kmscon_replay_stop(struct kmscon_replay *rp);
+bool kmscon_replay_is_done(struct kmscon_replay *rp);
+void kmscon_replay_get_stats(struct kmscon_replay *rp, struct kmscon_replay_stats *out);
+
+#endif /* KMSCON_REPLAY_H */
@@ -0,0 +1,204 @@
+/*
+ * kmscon - Scheduling
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Scheduling
+ * On Linux, the policy, the nice level and the affinity belong to a thread,
+ * not to the process, which is why they must be set before other threads are
+ * started. Failing to set any of them is not fatal, kmscon just runs like
+ * without the option.
+ *
+ * Memory is locked with MCL_ONFAULT where available: pages stay in RAM once
+ * they were used, but the stacks of all threads and other reserved memory
+ * aren't faulted in up front.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "kmscon_conf.h"
+#include "kmscon_sched.h"
+#include "shl_log.h"
+
+#define LOG_SUBSYSTEM "sched"
+
+/* the settings kmscon was started with, for children */
+static bool sched_saved;
+static int sched_policy;
+static struct sched_param sched_param;
+static int sched_nice;
+static bool sched_cpus_saved;
+static cpu_set_t sched_cpus;
+
+/* parse a list of CPUs like "0-3,6" */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*list) {
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -ERANGE;
+
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			++end;
+		else if (*end)
+			return -EINVAL;
+		list = end;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+static void setup_cpus(const char *list)
+{
+	cpu_set_t set;
+	int ret;
+
+	ret = parse_cpus(list, &set);
+	if (ret) {
+		log_error("invalid CPU list --cpus='%s' (%d)", list, ret);
+		return;
+	}
+
+	if (sched_getaffinity(0, sizeof(sched_cpus), &sched_cpus)) {
+		log_warning("cannot get CPU affinity (%d): %m", errno);
+		return;
+	}
+
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		log_warning("cannot run on CPUs %s (%d): %m", list, errno);
+		return;
+	}
+
+	sched_cpus_saved = true;
+	log_debug("running on CPUs %s", list);
+}
+
+static void setup_policy(unsigned int sched, unsigned int priority)
+{
+	struct sched_param param;
+	int policy, min, max, ret;
+
+	policy = sched == KMSCON_SCHED_FIFO ? SCHED_FIFO : SCHED_RR;
+	min = sched_get_priority_min(policy);
+	max = sched_get_priority_max(policy);
+	if ((int)priority < min || (int)priority > max) {
+		log_error("invalid real-time priority --sched-priority=%u, must be in %d-%d",
+			  priority, min, max);
+		return;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	ret = pthread_setschedparam(pthread_self(), policy, &param);
+	if (ret) {
+		log_warning("cannot set real-time policy (%d): %s", ret, strerror(ret));
+		return;
+	}
+
+	log_debug("running with real-time priority %u", priority);
+}
+
+/*
+ * kmscon_sched_setup:
+ * @conf: the main configuration
+ *
+ * Apply the scheduling options of @conf to the calling thread, which must be
+ * the only one yet, and lock the memory if asked to.
+ *
+ * Returns: 0 on success, negative error code if the current settings cannot be
+ * read. Options that cannot be applied are only warned about.
+ */
+int kmscon_sched_setup(const struct kmscon_conf_t *conf)
+{
+	int ret, flags;
+
+	ret = pthread_getschedparam(pthread_self(), &sched_policy, &sched_param);
+	if (ret)
+		return -ret;
+	errno = 0;
+	sched_nice = getpriority(PRIO_PROCESS, 0);
+	if (errno)
+		return -errno;
+	sched_saved = true;
+
+	if (conf->nice != KMSCON_NICE_KEEP && conf->nice != sched_nice) {
+		if (setpriority(PRIO_PROCESS, 0, conf->nice))
+			log_warning("cannot set nice level %d (%d): %m", conf->nice, errno);
+	}
+
+	if (conf->sched != KMSCON_SCHED_OTHER)
+		setup_policy(conf->sched, conf->sched_priority);
+
+	if (conf->cpus && *conf->cpus)
+		setup_cpus(conf->cpus);
+
+	if (conf->mlock) {
+		flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+		flags |= MCL_ONFAULT;
+#endif
+		if (mlockall(flags))
+			log_warning("cannot lock memory (%d): %m", errno);
+	}
+
+	return 0;
+}
+
+/*
+ * kmscon_sched_restore:
+ *
+ * Give the calling thread back the settings kmscon was started with. This is
+ * meant for forked children before they exec; memory locks are not inherited
+ * anyway.
+ */
+void kmscon_sched_restore(void)
+{
+	if (!sched_saved)
+		return;
+
+	pthread_setschedparam(pthread_self(), sched_policy, &sched_param);
+	setpriority(PRIO_PROCESS, 0, sched_nice);
+	if (sched_cpus_saved)
+		sched_setaffinity(0, sizeof(sched_cpus), &sched_cpus);
+}
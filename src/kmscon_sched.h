@@ -0,0 +1,45 @@
+/*
+ * kmscon - Scheduling
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Scheduling
+ * Runs kmscon with a real-time policy or another nice level, on a set of
+ * CPUs and with its memory locked, so it isn't delayed by other load on the
+ * machine. This is applied to the main thread before any other thread is
+ * started, so the seat, render and blend threads inherit it. Threads doing
+ * background work drop a real-time policy again, see
+ * shl_thread_set_background().
+ *
+ * Children of terminals must not inherit any of it, so they get the settings
+ * kmscon was started with back with kmscon_sched_restore().
+ */
+
+#ifndef KMSCON_SCHED_H
+#define KMSCON_SCHED_H
+
+struct kmscon_conf_t;
+
+int kmscon_sched_setup(const struct kmscon_conf_t *conf);
+void kmscon_sched_restore(void);
+
+#endif /* KMSCON_SCHED_H */
@@ -0,0 +1,194 @@
+/*
+ * kmscon - Scrollback Search
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Scrollback Search
+ * One bit per byte pair is a coarse filter, but it is 8 bytes per line and it
+ * drops most lines once the query is a few characters long. Lines are
+ * numbered from the oldest one in the scrollback down to the last screen row.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmscon_search.h"
+
+static inline unsigned char fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static inline uint64_t pair_bit(unsigned char a, unsigned char b)
+{
+	return 1ULL << ((fold(a) * 31 + fold(b)) & 63);
+}
+
+static uint64_t pairs_of(const char *str, size_t len)
+{
+	uint64_t mask = 0;
+	size_t i;
+
+	for (i = 1; i < len; ++i)
+		mask |= pair_bit(str[i - 1], str[i]);
+
+	return mask;
+}
+
+static size_t line_len(const struct kmscon_search *search, size_t line)
+{
+	if (line + 1 < search->num_lines)
+		return search->lines[line + 1] - 1 - search->lines[line];
+	return search->len - search->lines[line];
+}
+
+static int build_index(struct kmscon_search *search)
+{
+	size_t num = 1, i, *lines;
+	uint64_t *pairs;
+	const char *pos;
+
+	for (pos = search->text; (pos = memchr(pos, '\n', search->text + search->len - pos));
+	     ++pos)
+		++num;
+
+	if (num > search->size) {
+		lines = realloc(search->lines, num * sizeof(*lines));
+		if (!lines)
+			return -ENOMEM;
+		search->lines = lines;
+		pairs = realloc(search->pairs, num * sizeof(*pairs));
+		if (!pairs)
+			return -ENOMEM;
+		search->pairs = pairs;
+		search->size = num;
+	}
+
+	search->lines[0] = 0;
+	for (i = 1, pos = search->text;
+	     (pos = memchr(pos, '\n', search->text + search->len - pos)); ++pos)
+		search->lines[i++] = pos + 1 - search->text;
+
+	search->num_lines = num;
+	for (i = 0; i < num; ++i)
+		search->pairs[i] = pairs_of(&search->text[search->lines[i]], line_len(search, i));
+
+	search->indexed = true;
+	return 0;
+}
+
+/* last match in a line, as byte offset, or -1 */
+static long find_in_line(const char *str, size_t len, const char *query, size_t qlen)
+{
+	size_t i, j;
+
+	if (qlen > len)
+		return -1;
+
+	i = len - qlen + 1;
+	while (i--) {
+		for (j = 0; j < qlen && fold(str[i + j]) == fold(query[j]); ++j)
+			;
+		if (j == qlen)
+			return i;
+	}
+
+	return -1;
+}
+
+/* takes ownership of @text, which must be allocated with malloc() */
+void kmscon_search_set_text(struct kmscon_search *search, char *text, size_t len)
+{
+	free(search->text);
+	search->text = text;
+	search->len = len;
+	search->num_lines = 0;
+	search->indexed = false;
+}
+
+void kmscon_search_clear(struct kmscon_search *search)
+{
+	kmscon_search_set_text(search, NULL, 0);
+}
+
+void kmscon_search_destroy(struct kmscon_search *search)
+{
+	kmscon_search_clear(search);
+	free(search->lines);
+	free(search->pairs);
+	search->lines = NULL;
+	search->pairs = NULL;
+	search->size = 0;
+}
+
+/*
+ * Find the last match of @query in the lines before @before. Lines after the
+ * last one are taken as the last one, so (size_t)-1 searches everything.
+ * @col is the match's position in characters rather than bytes, which is its
+ * cell as long as the line has no wide characters.
+ * Returns -ENOENT if there is no match.
+ */
+int kmscon_search_find(struct kmscon_search *search, const char *query, size_t len,
+		       size_t before, size_t *line, unsigned int *col)
+{
+	const char *str;
+	uint64_t mask;
+	size_t i;
+	long off;
+	int ret;
+
+	if (!search->text || !len)
+		return -ENOENT;
+
+	if (!search->indexed) {
+		ret = build_index(search);
+		if (ret)
+			return ret;
+	}
+
+	if (before > search->num_lines)
+		before = search->num_lines;
+
+	mask = pairs_of(query, len);
+	for (i = before; i--;) {
+		if ((search->pairs[i] & mask) != mask)
+			continue;
+
+		str = &search->text[search->lines[i]];
+		off = find_in_line(str, line_len(search, i), query, len);
+		if (off < 0)
+			continue;
+
+		*line = i;
+		*col = 0;
+		while (off--) {
+			if ((str[off] & 0xc0) != 0x80)
+				++*col;
+		}
+		return 0;
+	}
+
+	return -ENOENT;
+}
@@ -0,0 +1,57 @@
+/*
+ * kmscon - Scrollback Search
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Scrollback Search
+ * Finds text in a copy of the scrollback and the screen, line by line and
+ * ignoring ASCII case. A query is typed one key at a time and searched again
+ * after each key, so the lines get an index of the byte pairs they contain
+ * the first time they are searched. Only lines that have every pair of the
+ * query are compared.
+ */
+
+#ifndef KMSCON_SEARCH_H
+#define KMSCON_SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct kmscon_search {
+	char *text; /* lines separated by \n, NULL if none is set */
+	size_t len;
+	size_t *lines;	 /* offset of each line in text */
+	uint64_t *pairs; /* byte pairs of each line, see pair_bit() */
+	size_t num_lines;
+	size_t size; /* allocated entries of lines and pairs */
+	bool indexed;
+};
+
+void kmscon_search_set_text(struct kmscon_search *search, char *text, size_t len);
+void kmscon_search_clear(struct kmscon_search *search);
+void kmscon_search_destroy(struct kmscon_search *search);
+int kmscon_search_find(struct kmscon_search *search, const char *query, size_t len,
+		       size_t before, size_t *line, unsigned int *col);
+
+#endif /* KMSCON_SEARCH_H */
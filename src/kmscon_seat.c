@@ -30,6 +30,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,16 +41,21 @@
 #include "eloop.h"
 #include "kmscon_conf.h"
 #include "kmscon_dummy.h"
+#include "kmscon_export.h"
 #include "kmscon_seat.h"
 #include "kmscon_terminal.h"
 #include "shl_dlist.h"
 #include "shl_log.h"
+#include "shl_timer.h"
 #include "uterm_input.h"
 #include "uterm_video.h"
 #include "uterm_vt.h"
 
 #define LOG_SUBSYSTEM "seat"
 
+/* input comes at up to 1000 Hz, re-arming the DPMS timer once a second is enough */
+#define SEAT_DPMS_REARM_USEC 1000000ULL
+
 struct kmscon_session {
 	struct shl_dlist list;
 	unsigned long ref;
@@ -70,6 +76,7 @@ struct kmscon_display {
 	struct kmscon_seat *seat;
 	struct uterm_display *disp;
 	bool activated;
+	struct kmscon_export *export;
 };
 
 enum kmscon_async_schedule {
@@ -103,6 +110,7 @@ struct kmscon_seat {
 	/* DPMS timeout management */
 	struct ev_timer *dpms_timer;
 	bool dpms_blanked;
+	uint64_t dpms_armed; /* when the timer was last armed, 0 if it is not */
 
 	kmscon_seat_cb_t cb;
 	void *data;
@@ -180,6 +188,8 @@ static void activate_display(struct kmscon_display *d)
 			s = shl_dlist_entry(iter, struct kmscon_session, list);
 			session_call_display_new(s, d->disp);
 		}
+
+		kmscon_export_refresh(d->export);
 	}
 }
 
@@ -478,6 +488,26 @@ static void seat_prev(struct kmscon_seat *seat)
 	seat_switch(seat);
 }
 
+/* the frames of each display are shared on <export-dir>/<seat>-<display>.sock */
+static void seat_export_display(struct kmscon_seat *seat, struct kmscon_display *d)
+{
+	char *path;
+	int ret;
+
+	if (!seat->conf->export_dir)
+		return;
+
+	if (asprintf(&path, "%s/%s-%s.sock", seat->conf->export_dir, seat->name,
+		     uterm_display_name(d->disp)) < 0)
+		return;
+
+	ret = kmscon_export_new(&d->export, seat->eloop, d->disp, path);
+	if (ret)
+		log_warning("cannot export display %s of seat %s (%d)",
+			    uterm_display_name(d->disp), seat->name, ret);
+	free(path);
+}
+
 static int seat_add_display(struct kmscon_seat *seat, struct uterm_display *disp)
 {
 	struct kmscon_display *d;
@@ -493,6 +523,7 @@ static int seat_add_display(struct kmscon_seat *seat, struct uterm_display *disp
 
 	uterm_display_ref(d->disp);
 	shl_dlist_link(&seat->displays, &d->list);
+	seat_export_display(seat, d);
 	activate_display(d);
 	return 0;
 }
@@ -514,6 +545,7 @@ static void seat_remove_display(struct kmscon_seat *seat, struct kmscon_display
 		}
 	}
 
+	kmscon_export_free(d->export);
 	uterm_display_unref(d->disp);
 	free(d);
 }
@@ -525,6 +557,8 @@ static void seat_refresh_display(struct kmscon_seat *seat, struct kmscon_display
 
 	log_debug("refresh display %p from seat %s", d->disp, seat->name);
 
+	kmscon_export_refresh(d->export);
+
 	if (d->activated) {
 		shl_dlist_for_each(iter, &seat->sessions)
 		{
@@ -609,6 +643,7 @@ static void seat_dpms_timeout(struct ev_timer *timer, uint64_t num, void *data)
 	struct kmscon_display *d;
 	int ret;
 
+	seat->dpms_armed = 0;
 	if (!seat->conf->dpms_timeout)
 		return;
 
@@ -635,11 +670,17 @@ static void seat_dpms_reset_timer(struct kmscon_seat *seat)
 	struct shl_dlist *iter;
 	struct kmscon_display *d;
 	struct itimerspec spec;
+	uint64_t now;
 	int ret;
 
 	if (!seat->conf->dpms_timeout || !seat->dpms_timer)
 		return;
 
+	/* the timer fires at most a second early, unless the screen is blank */
+	now = shl_timer_now();
+	if (seat->dpms_armed && now - seat->dpms_armed < SEAT_DPMS_REARM_USEC)
+		return;
+
 	/* If screen is blanked, unblank it */
 	if (seat->dpms_blanked) {
 		log_debug("DPMS: unblanking screen");
@@ -661,7 +702,8 @@ static void seat_dpms_reset_timer(struct kmscon_seat *seat)
 	memset(&spec, 0, sizeof(spec));
 	spec.it_value.tv_sec = seat->conf->dpms_timeout;
 	spec.it_value.tv_nsec = 0;
-	ev_timer_update(seat->dpms_timer, &spec);
+	if (!ev_timer_update(seat->dpms_timer, &spec))
+		seat->dpms_armed = now;
 }
 
 static void seat_pointer_event(struct uterm_input *input, struct uterm_input_pointer_event *ev,
@@ -680,6 +722,7 @@ static void seat_input_event(struct uterm_input *input, struct uterm_input_key_e
 {
 	struct kmscon_seat *seat = data;
 	struct kmscon_session *s;
+	enum kmscon_grab grab;
 	int ret;
 
 	/* Reset DPMS timer on any input event */
@@ -688,34 +731,31 @@ static void seat_input_event(struct uterm_input *input, struct uterm_input_key_e
 	if (ev->handled || !seat->awake)
 		return;
 
-	if (conf_grab_matches(seat->conf->grab_session_next, ev->mods, ev->num_syms, ev->keysyms)) {
-		ev->handled = true;
-		if (!seat->conf->session_control)
-			return;
-		seat_next(seat);
+	grab = kmscon_conf_find_grab(seat->conf, KMSCON_GRAB_SEAT_FIRST, KMSCON_GRAB_SEAT_LAST,
+				     ev->mods, ev->num_syms, ev->keysyms);
+	if (grab == KMSCON_GRAB_NONE)
 		return;
-	}
-	if (conf_grab_matches(seat->conf->grab_session_prev, ev->mods, ev->num_syms, ev->keysyms)) {
-		ev->handled = true;
-		if (!seat->conf->session_control)
-			return;
-		seat_prev(seat);
+
+	ev->handled = true;
+	if (grab == KMSCON_GRAB_REBOOT) {
+		seat_trigger_reboot(seat);
 		return;
 	}
-	if (conf_grab_matches(seat->conf->grab_session_dummy, ev->mods, ev->num_syms,
-			      ev->keysyms)) {
-		ev->handled = true;
-		if (!seat->conf->session_control)
-			return;
+	if (!seat->conf->session_control)
+		return;
+
+	switch (grab) {
+	case KMSCON_GRAB_SESSION_NEXT:
+		seat_next(seat);
+		break;
+	case KMSCON_GRAB_SESSION_PREV:
+		seat_prev(seat);
+		break;
+	case KMSCON_GRAB_SESSION_DUMMY:
 		seat->scheduled_sess = seat->dummy_sess;
 		seat_switch(seat);
-		return;
-	}
-	if (conf_grab_matches(seat->conf->grab_session_close, ev->mods, ev->num_syms,
-			      ev->keysyms)) {
-		ev->handled = true;
-		if (!seat->conf->session_control)
-			return;
+		break;
+	case KMSCON_GRAB_SESSION_CLOSE:
 		s = seat->current_sess;
 		if (!s)
 			return;
@@ -735,12 +775,8 @@ static void seat_input_event(struct uterm_input *input, struct uterm_input_key_e
 		}
 
 		kmscon_session_unregister(s);
-		return;
-	}
-	if (conf_grab_matches(seat->conf->grab_terminal_new, ev->mods, ev->num_syms, ev->keysyms)) {
-		ev->handled = true;
-		if (!seat->conf->session_control)
-			return;
+		break;
+	case KMSCON_GRAB_TERMINAL_NEW:
 		ret = kmscon_terminal_register(&s, seat, uterm_vt_get_num(seat->vt));
 		if (ret == -EOPNOTSUPP) {
 			log_notice("terminal support not compiled in");
@@ -751,13 +787,9 @@ static void seat_input_event(struct uterm_input *input, struct uterm_input_key_e
 			seat->scheduled_sess = s;
 			seat_switch(seat);
 		}
-		return;
-	}
-	if (seat->conf->grab_reboot &&
-	    conf_grab_matches(seat->conf->grab_reboot, ev->mods, ev->num_syms, ev->keysyms)) {
-		ev->handled = true;
-		seat_trigger_reboot(seat);
-		return;
+		break;
+	default:
+		break;
 	}
 }
 
@@ -870,20 +902,16 @@ int kmscon_seat_new(struct kmscon_seat **out, struct conf_ctx *main_conf, struct
 	/* Initialize DPMS timeout management */
 	seat->dpms_timer = NULL;
 	seat->dpms_blanked = false;
+	seat->dpms_armed = 0;
 
 	/* Create DPMS timer if timeout is configured */
 	if (seat->conf->dpms_timeout > 0) {
-		struct itimerspec spec;
 		ret = ev_eloop_new_timer(seat->eloop, &seat->dpms_timer, NULL, seat_dpms_timeout,
 					 seat);
-		if (ret) {
+		if (ret)
 			log_warning("cannot create DPMS timer: %d", ret);
-		} else {
-			/* Start the timer */
-			memset(&spec, 0, sizeof(spec));
-			spec.it_value.tv_sec = seat->conf->dpms_timeout;
-			ev_timer_update(seat->dpms_timer, &spec);
-		}
+		else
+			seat_dpms_reset_timer(seat);
 	}
 
 	ret = uterm_vt_allocate(seat->vtm, &seat->vt, vt_types, seat->name, seat->input,
@@ -1052,6 +1080,44 @@ void kmscon_seat_remove_input(struct kmscon_seat *seat, const char *node)
 	uterm_input_remove_dev(seat->input, node);
 }
 
+/*
+ * Log the memory of the displays and the sessions of @seat. This runs on the
+ * thread of the seat, so the sessions look at their own state without locks.
+ */
+void kmscon_seat_report(struct kmscon_seat *seat)
+{
+	struct shl_dlist *iter, *tmp;
+	struct kmscon_display *d;
+	struct kmscon_session *s;
+	struct uterm_display_memory mem;
+
+	if (!seat)
+		return;
+
+	log_info("seat %s: %zu sessions", seat->name, seat->session_count);
+
+	shl_dlist_for_each(iter, &seat->displays)
+	{
+		d = shl_dlist_entry(iter, struct kmscon_display, list);
+		if (uterm_display_get_memory(d->disp, &mem)) {
+			log_info("display %s: %ux%u, buffer memory unknown",
+				 uterm_display_name(d->disp), uterm_display_get_width(d->disp),
+				 uterm_display_get_height(d->disp));
+			continue;
+		}
+		log_info("display %s: %ux%u, %u buffers in %" PRIu64 " KiB, shadow %" PRIu64 " KiB",
+			 uterm_display_name(d->disp), uterm_display_get_width(d->disp),
+			 uterm_display_get_height(d->disp), mem.buffers, mem.bytes / 1024,
+			 mem.shadow / 1024);
+	}
+
+	shl_dlist_for_each_safe(iter, tmp, &seat->sessions)
+	{
+		s = shl_dlist_entry(iter, struct kmscon_session, list);
+		session_call(s, KMSCON_SESSION_REPORT, NULL);
+	}
+}
+
 const char *kmscon_seat_get_name(struct kmscon_seat *seat)
 {
 	if (!seat)
@@ -60,6 +60,7 @@ enum kmscon_session_event_type {
 	KMSCON_SESSION_ACTIVATE,
 	KMSCON_SESSION_DEACTIVATE,
 	KMSCON_SESSION_UNREGISTER,
+	KMSCON_SESSION_REPORT, /* log the memory of the session */
 };
 
 struct kmscon_session_event {
@@ -88,6 +89,7 @@ struct ev_eloop *kmscon_seat_get_eloop(struct kmscon_seat *seat);
 struct conf_ctx *kmscon_seat_get_conf(struct kmscon_seat *seat);
 
 void kmscon_seat_schedule(struct kmscon_seat *seat, unsigned int id);
+void kmscon_seat_report(struct kmscon_seat *seat);
 
 int kmscon_seat_register_session(struct kmscon_seat *seat, struct kmscon_session **out,
 				 kmscon_session_cb_t cb, void *data);
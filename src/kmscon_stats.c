@@ -0,0 +1,144 @@
+/*
+ * kmscon - Latency Statistics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Latency Statistics
+ * Timestamps are CLOCK_MONOTONIC microseconds. The input layer and the
+ * page-flip events pass the kernel timestamps, every other stage is stamped
+ * when we get to it. Stages are recorded in order only, so output that was
+ * already on its way when the key was pressed doesn't count as its echo.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "kmscon_stats.h"
+#include "shl_log.h"
+#include "shl_timer.h"
+
+#define LOG_SUBSYSTEM "stats"
+
+static const char *stage_names[KMSCON_STATS_NUM] = {
+	[KMSCON_STATS_WRITE] = "write",
+	[KMSCON_STATS_READ] = "read",
+	[KMSCON_STATS_RENDER] = "render",
+	[KMSCON_STATS_FLIP] = "flip",
+};
+
+static void hist_add(struct kmscon_stats_hist *hist, uint64_t usec)
+{
+	unsigned int i = 0;
+
+	while (i < KMSCON_STATS_BUCKETS - 1 && usec >> (i + 1))
+		++i;
+
+	++hist->buckets[i];
+	++hist->count;
+	hist->sum += usec;
+	if (usec > hist->max)
+		hist->max = usec;
+}
+
+/* start following a key press at @time, 0 if unknown */
+void kmscon_stats_input(struct kmscon_stats *stats, uint64_t time)
+{
+	uint64_t now = shl_timer_now();
+
+	/* the kernel may stamp input with another clock */
+	if (!time || time > now)
+		time = now;
+
+	if (stats->start && now - stats->start < KMSCON_STATS_TIMEOUT)
+		return;
+
+	stats->start = time;
+	stats->next = KMSCON_STATS_WRITE;
+}
+
+/* the followed key reached @stage at @time, 0 for now */
+void kmscon_stats_mark(struct kmscon_stats *stats, enum kmscon_stats_stage stage, uint64_t time)
+{
+	if (!stats->start || stats->next != stage)
+		return;
+
+	if (!time)
+		time = shl_timer_now();
+
+	if (time < stats->start)
+		time = stats->start;
+	if (time - stats->start >= KMSCON_STATS_TIMEOUT) {
+		stats->start = 0;
+		return;
+	}
+
+	hist_add(&stats->hist[stage], time - stats->start);
+	if (stage == KMSCON_STATS_FLIP)
+		stats->start = 0;
+	else
+		stats->next = stage + 1;
+}
+
+/* upper bound of the bucket holding the @pct percentile, in microseconds */
+uint64_t kmscon_stats_percentile(const struct kmscon_stats_hist *hist, unsigned int pct)
+{
+	uint64_t sum = 0, want;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+
+	want = ((uint64_t)hist->count * pct + 99) / 100;
+	for (i = 0; i < KMSCON_STATS_BUCKETS - 1; ++i) {
+		sum += hist->buckets[i];
+		if (sum >= want)
+			break;
+	}
+
+	return 2ULL << i;
+}
+
+/* log a summary of all stages and start over */
+void kmscon_stats_log(struct kmscon_stats *stats)
+{
+	const struct kmscon_stats_hist *hist;
+	char buf[256];
+	size_t len = 0;
+	unsigned int i;
+
+	if (!stats->hist[KMSCON_STATS_WRITE].count)
+		return;
+
+	for (i = 0; i < KMSCON_STATS_NUM && len < sizeof(buf); ++i) {
+		hist = &stats->hist[i];
+		if (!hist->count)
+			continue;
+		len += snprintf(&buf[len], sizeof(buf) - len, ", %s %.2f/%.2f/%.2f",
+				stage_names[i], hist->sum / (hist->count * 1000.0),
+				kmscon_stats_percentile(hist, 99) / 1000.0, hist->max / 1000.0);
+	}
+
+	log_info("latency of %u keys in ms (avg/p99/max)%s", stats->hist[KMSCON_STATS_WRITE].count,
+		 buf);
+	memset(stats->hist, 0, sizeof(stats->hist));
+}
@@ -0,0 +1,70 @@
+/*
+ * kmscon - Latency Statistics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Latency Statistics
+ * Follows a key press until its echo is on screen and keeps histograms of the
+ * time from the key press to each stage on the way. Only one key is followed
+ * at a time; keys pressed meanwhile are answered by the same output.
+ */
+
+#ifndef KMSCON_STATS_H
+#define KMSCON_STATS_H
+
+#include <stdint.h>
+
+/* keys that aren't on screen after this many microseconds are dropped */
+#define KMSCON_STATS_TIMEOUT 1000000ULL
+/* seconds between two summaries in the log */
+#define KMSCON_STATS_INTERVAL 10
+/* log2 buckets of microseconds */
+#define KMSCON_STATS_BUCKETS 32
+
+enum kmscon_stats_stage {
+	KMSCON_STATS_WRITE,  /* written to the pty */
+	KMSCON_STATS_READ,   /* pty output read back */
+	KMSCON_STATS_RENDER, /* frame with the output rendered */
+	KMSCON_STATS_FLIP,   /* frame on screen */
+	KMSCON_STATS_NUM,
+};
+
+struct kmscon_stats_hist {
+	unsigned int count;
+	uint64_t sum;
+	uint64_t max;
+	unsigned int buckets[KMSCON_STATS_BUCKETS];
+};
+
+struct kmscon_stats {
+	uint64_t start; /* time of the followed key press, 0 if none */
+	enum kmscon_stats_stage next;
+	struct kmscon_stats_hist hist[KMSCON_STATS_NUM];
+};
+
+void kmscon_stats_input(struct kmscon_stats *stats, uint64_t time);
+void kmscon_stats_mark(struct kmscon_stats *stats, enum kmscon_stats_stage stage, uint64_t time);
+uint64_t kmscon_stats_percentile(const struct kmscon_stats_hist *hist, unsigned int pct);
+void kmscon_stats_log(struct kmscon_stats *stats);
+
+#endif /* KMSCON_STATS_H */
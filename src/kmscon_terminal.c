@@ -33,25 +33,48 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <libtsm.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <xkbcommon/xkbcommon-keysyms.h>
 #include "conf.h"
 #include "eloop.h"
 #include "font.h"
+#include "font_cache.h"
+#include "kmscon_bench.h"
 #include "kmscon_conf.h"
+#include "kmscon_image.h"
 #include "kmscon_issue.h"
+#include "kmscon_replay.h"
+#include "kmscon_search.h"
 #include "kmscon_seat.h"
+#include "kmscon_stats.h"
 #include "kmscon_terminal.h"
 #include "pty.h"
 #include "shl_dlist.h"
 #include "shl_log.h"
+#include "shl_timer.h"
+#include "shl_trace.h"
 #include "text.h"
 #include "uterm_input.h"
 #include "uterm_video.h"
 
 #define LOG_SUBSYSTEM "terminal"
 
+/* characters of a scrollback search query */
+#define SEARCH_MAX 64
+
+/* font sizes kept for zooming back, see font_zoom() */
+#define ZOOM_CACHE_SIZE 4
+
+struct zoom_entry {
+	unsigned int height;
+	struct kmscon_font *font;
+	struct kmscon_glyph_cache *glyphs;
+};
+
 struct screen {
 	struct shl_dlist list;
 	struct kmscon_terminal *term;
@@ -62,11 +85,28 @@ struct screen {
 	bool pending;
 	bool hw_cursor;
 	bool enabled;
+	/* when the last frame was swapped, for the profiler */
+	uint64_t swap_start;
+
+	/* the last frame, kept while the session is in the background */
+	bool shown; /* the frame swapped last on the display is ours */
+	struct uterm_frame *frame;
+	struct shl_dlist frame_list;
+
+	/* render worker, see redraw_all() */
+	bool has_worker;
+	bool drawn;
+	pthread_t worker;
+	pthread_mutex_t worker_lock;
+	pthread_cond_t worker_cond;
+	bool worker_busy;
+	bool worker_exit;
 };
 
 struct kmscon_pointer {
 	bool visible;
 	bool select;
+	bool redraw; /* the pointer frame changed more than the cursor planes */
 	int32_t x;
 	int32_t y;
 	unsigned int posx;
@@ -75,6 +115,49 @@ struct kmscon_pointer {
 	int copy_len;
 };
 
+/* one cell as passed to the tsm_screen_draw() callback */
+struct snapshot_cell {
+	uint64_t id;
+	size_t ch; /* offset into the chars array */
+	size_t len;
+	unsigned int width;
+	unsigned int posx;
+	unsigned int posy;
+	struct tsm_screen_attr attr;
+	tsm_age_t age;
+};
+
+struct snapshot {
+	struct tsm_screen_attr def_attr;
+	bool pointer_visible;
+	int32_t pointer_x;
+	int32_t pointer_y;
+
+	struct snapshot_cell *cells;
+	size_t num_cells;
+	size_t size_cells;
+	uint32_t *chars;
+	size_t num_chars;
+	size_t size_chars;
+};
+
+struct render_thread {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool busy; /* protected by @lock */
+	bool exit; /* protected by @lock */
+	struct ev_counter *done;
+
+	/* main thread only */
+	bool running;
+	bool ready;
+
+	/* the render thread reads snaps[front], the main thread writes the other */
+	unsigned int front;
+	struct snapshot snaps[2];
+};
+
 struct kmscon_terminal {
 	unsigned long ref;
 	struct ev_eloop *eloop;
@@ -94,11 +177,49 @@ struct kmscon_terminal {
 	struct tsm_vte *vte;
 	struct kmscon_pty *pty;
 	struct ev_fd *ptyfd;
+	struct ev_timer *pty_timer; /* polls @ptyfd again once it may be read */
+	struct kmscon_replay *replay; /* played back instead of the pty, see --replay */
+	struct kmscon_image_parser *images; /* NULL without --image-cache */
+	uint64_t replay_frames; /* frames swapped, logged when the replay is done */
+	uint64_t replay_draw;	/* main thread time spent drawing them in us */
+	bool pasting; /* the vte writes a paste, see paste() */
+
+	bool dirty;
+	struct shl_timer dirty_age;
+	struct ev_timer *frame_timer;
+
+	/* the text renderers are unset while the session is in the background */
+	bool released;
+	struct ev_timer *release_timer;
 
 	struct kmscon_font_attr font_attr;
 	struct kmscon_font *font;
+	struct kmscon_glyph_cache *glyphs;
+	/* background font lookup, see font_load_async() */
+	struct font_loader *loader;
+	struct kmscon_font *font_pending;
+	bool first_frame; /* spans are traced until the first page-flip */
+	struct zoom_entry zoom[ZOOM_CACHE_SIZE]; /* most recently used first */
 
 	struct kmscon_pointer pointer;
+
+	/* scrollback search, see search_update() */
+	bool searching;
+	bool search_found;  /* the view shows a match */
+	bool search_failed; /* the last search found nothing */
+	struct kmscon_search search;
+	uint32_t search_query[SEARCH_MAX];
+	unsigned int search_len;
+	size_t search_line;	 /* line of the match shown */
+	unsigned int search_row; /* row the prompt is drawn in */
+
+	struct render_thread *render;
+
+	struct kmscon_stats stats;
+	struct ev_timer *stats_timer;
+	/* wakeups of the event loop at the last stats log, for the rate */
+	uint64_t stats_wakeups;
+	uint64_t stats_time;
 };
 
 static int font_set(struct kmscon_terminal *term);
@@ -129,6 +250,47 @@ static void draw_pointer(struct screen *scr)
 	kmscon_text_draw_pointer(scr->txt, scr->term->pointer.x, scr->term->pointer.y);
 }
 
+/*
+ * The search prompt covers a whole row and is drawn after the tsm screen, by
+ * the same callback. Its cells have no age, so frames with the prompt are never
+ * used as reference and the row is drawn again once the prompt is gone.
+ */
+static void draw_search(struct kmscon_terminal *term, tsm_screen_draw_cb cb, void *data)
+{
+	static const char prompt[] = "search: ", failed[] = " (not found)";
+	unsigned int cols = tsm_screen_get_width(term->console);
+	struct tsm_screen_attr attr;
+	unsigned int x = 0, i, w;
+	uint32_t ch;
+
+	if (!term->searching)
+		return;
+
+	tsm_vte_get_def_attr(term->vte, &attr);
+	attr.inverse = 1;
+
+	for (i = 0; prompt[i] && x < cols; ++i, ++x) {
+		ch = prompt[i];
+		cb(term->console, ch, &ch, 1, 1, x, term->search_row, &attr, 0, data);
+	}
+	for (i = 0; i < term->search_len; ++i) {
+		ch = term->search_query[i];
+		w = tsm_ucs4_get_width(ch);
+		if (!w)
+			continue;
+		if (x + w > cols)
+			break;
+		cb(term->console, ch, &ch, 1, w, x, term->search_row, &attr, 0, data);
+		x += w;
+	}
+	for (i = 0; term->search_failed && failed[i] && x < cols; ++i, ++x) {
+		ch = failed[i];
+		cb(term->console, ch, &ch, 1, 1, x, term->search_row, &attr, 0, data);
+	}
+	for (; x < cols; ++x)
+		cb(term->console, 0, NULL, 0, 1, x, term->search_row, &attr, 0, data);
+}
+
 static inline uint32_t argb(uint8_t a, uint8_t r, uint8_t g, uint8_t b)
 {
 	return ((uint32_t)a << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
@@ -278,38 +440,615 @@ static void disable_screen(struct screen *scr)
 	scr->enabled = false;
 }
 
-static void do_redraw_screen(struct screen *scr)
+/* background sessions only parse, their screen is drawn once they are shown */
+static bool term_visible(struct kmscon_terminal *term)
+{
+	return term->awake && kmscon_session_get_foreground(term->session);
+}
+
+/* returns true if the frame was drawn and needs to be rendered and swapped */
+static bool draw_screen(struct screen *scr)
 {
 	struct tsm_screen_attr attr;
-	int ret;
+	uint64_t start;
 
-	if (!scr->term->awake || !kmscon_session_get_foreground(scr->term->session))
-		return;
+	if (!term_visible(scr->term))
+		return false;
 
 	if (!scr->enabled) {
 		/* make sure to clear unused screen */
 		if (scr->pending)
 			disable_screen(scr);
-		return;
+		return false;
 	}
 
 	scr->pending = false;
 
+	start = scr->term->first_frame ? 0 : shl_timer_now();
 	tsm_vte_get_def_attr(scr->term->vte, &attr);
 	kmscon_text_prepare(scr->txt, &attr);
 	tsm_screen_draw(scr->term->console, kmscon_text_draw_cb, scr->txt);
+	draw_search(scr->term, kmscon_text_draw_cb, scr->txt);
 	draw_pointer(scr);
-	kmscon_text_render(scr->txt);
+
+	if (start)
+		shl_trace_span("draw", uterm_display_name(scr->disp), start);
+	return true;
+}
+
+static void swap_screen(struct screen *scr)
+{
+	int ret;
 
 	ret = uterm_display_swap(scr->disp);
+	scr->shown = !ret;
 	if (ret) {
 		if (ret != -EBUSY)
 			log_warning("cannot swap display [%s] %d", uterm_display_name(scr->disp),
 				    ret);
 		return;
-	}
+	}
+
+	kmscon_stats_mark(&scr->term->stats, KMSCON_STATS_RENDER, 0);
+	scr->swap_start = KMSCON_TEXT_PROFILE_NOW();
+	++scr->term->replay_frames;
+
+	/* in mailbox mode, we may draw the next frame right away */
+	scr->swapping = uterm_display_is_swapping(scr->disp);
+}
+
+/*
+ * A cursor plane commit keeps the display busy until its flip event, without
+ * us swapping. Frames drawn meanwhile wait for that event like after a swap.
+ */
+static bool screen_swapping(struct screen *scr)
+{
+	if (!scr->swapping && scr->hw_cursor)
+		scr->swapping = uterm_display_is_swapping(scr->disp);
+	return scr->swapping;
+}
+
+static void do_redraw_screen(struct screen *scr)
+{
+	if (!draw_screen(scr))
+		return;
+
+	kmscon_text_render(scr->txt);
+	swap_screen(scr);
+}
+
+/*
+ * Kept frames
+ * When a session goes to the background, each screen keeps its last frame in
+ * the display. Switching back is then a page-flip to it and the renderers go
+ * on from there, instead of drawing the whole screen again. The frames of all
+ * sessions share the session-frames budget, the oldest are dropped first.
+ * Seats running on their own thread keep their frames apart, so each thread
+ * has its own list and budget.
+ */
+static __thread struct shl_dlist kept_frames;
+static __thread uint64_t kept_size;
+
+static void forget_frame(struct screen *scr)
+{
+	shl_dlist_unlink(&scr->frame_list);
+	kept_size -= uterm_frame_get_size(scr->frame);
+	scr->frame = NULL;
+}
+
+static void drop_frame(struct screen *scr)
+{
+	struct uterm_frame *frame = scr->frame;
+
+	if (!frame)
+		return;
+
+	forget_frame(scr);
+	uterm_display_drop_frame(scr->disp, frame);
+}
+
+static void drop_frames(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		drop_frame(scr);
+	}
+}
+
+static void keep_frame(struct screen *scr)
+{
+	uint64_t max = scr->term->conf->session_frames * 1024ULL * 1024ULL;
+	struct screen *old;
+	int ret;
+
+	/* a frame that was never shown again is still the last one */
+	if (scr->frame || !scr->shown || !scr->enabled || !max)
+		return;
+
+	ret = uterm_display_keep_frame(scr->disp, &scr->frame);
+	if (ret) {
+		if (ret != -EOPNOTSUPP)
+			log_debug("cannot keep frame of display [%s]: %d",
+				  uterm_display_name(scr->disp), ret);
+		return;
+	}
+
+	if (!kept_frames.next)
+		shl_dlist_init(&kept_frames);
+
+	kept_size += uterm_frame_get_size(scr->frame);
+	shl_dlist_link_tail(&kept_frames, &scr->frame_list);
+	while (kept_size > max) {
+		old = shl_dlist_entry(kept_frames.next, struct screen, frame_list);
+		drop_frame(old);
+	}
+}
+
+/*
+ * Flip to the kept frame of @scr. Without one, the buffers of the display hold
+ * frames of other sessions and the next frame is drawn completely. If the
+ * display is busy, the frame is shown on its page-flip, see display_event().
+ */
+static void show_frame(struct screen *scr)
+{
+	int ret;
+
+	if (!scr->frame) {
+		uterm_display_set_need_redraw(scr->disp);
+		scr->pending = true;
+		return;
+	}
+
+	ret = uterm_display_show_frame(scr->disp, scr->frame);
+	if (ret == -EBUSY) {
+		scr->swapping = true;
+		return;
+	}
+
+	forget_frame(scr);
+	if (ret) {
+		log_debug("cannot show kept frame on display [%s]: %d",
+			  uterm_display_name(scr->disp), ret);
+		uterm_display_set_need_redraw(scr->disp);
+		scr->pending = true;
+		return;
+	}
+
+	scr->shown = true;
+	scr->swapping = uterm_display_is_swapping(scr->disp);
+}
+
+/*
+ * Render workers
+ * Blending a frame into a dumb buffer is the expensive part of a redraw and
+ * each display has its own back buffer, so with several displays every one of
+ * them gets a worker thread that only runs kmscon_text_render(). Everything
+ * else, including glyph lookup, stays on the main thread. OpenGL displays are
+ * always rendered on the main thread as their context is bound to it.
+ */
+
+static void *render_worker(void *data)
+{
+	struct screen *scr = data;
+
+	pthread_mutex_lock(&scr->worker_lock);
+	for (;;) {
+		while (!scr->worker_busy && !scr->worker_exit)
+			pthread_cond_wait(&scr->worker_cond, &scr->worker_lock);
+		if (scr->worker_exit)
+			break;
+
+		pthread_mutex_unlock(&scr->worker_lock);
+		kmscon_text_render(scr->txt);
+		pthread_mutex_lock(&scr->worker_lock);
+
+		scr->worker_busy = false;
+		pthread_cond_broadcast(&scr->worker_cond);
+	}
+	pthread_mutex_unlock(&scr->worker_lock);
+
+	return NULL;
+}
+
+static bool start_worker(struct screen *scr)
+{
+	int ret;
+
+	if (scr->has_worker)
+		return true;
+	if (uterm_display_has_opengl(scr->disp))
+		return false;
+
+	pthread_mutex_init(&scr->worker_lock, NULL);
+	pthread_cond_init(&scr->worker_cond, NULL);
+	scr->worker_busy = false;
+	scr->worker_exit = false;
+
+	ret = pthread_create(&scr->worker, NULL, render_worker, scr);
+	if (ret) {
+		log_warning("cannot start render worker for display [%s] (%d)",
+			    uterm_display_name(scr->disp), ret);
+		pthread_cond_destroy(&scr->worker_cond);
+		pthread_mutex_destroy(&scr->worker_lock);
+		return false;
+	}
+
+	scr->has_worker = true;
+	return true;
+}
+
+static void stop_worker(struct screen *scr)
+{
+	if (!scr->has_worker)
+		return;
+
+	pthread_mutex_lock(&scr->worker_lock);
+	scr->worker_exit = true;
+	pthread_cond_broadcast(&scr->worker_cond);
+	pthread_mutex_unlock(&scr->worker_lock);
+
+	pthread_join(scr->worker, NULL);
+	pthread_cond_destroy(&scr->worker_cond);
+	pthread_mutex_destroy(&scr->worker_lock);
+	scr->has_worker = false;
+}
+
+static void kick_worker(struct screen *scr)
+{
+	pthread_mutex_lock(&scr->worker_lock);
+	scr->worker_busy = true;
+	pthread_cond_broadcast(&scr->worker_cond);
+	pthread_mutex_unlock(&scr->worker_lock);
+}
+
+static void wait_worker(struct screen *scr)
+{
+	pthread_mutex_lock(&scr->worker_lock);
+	while (scr->worker_busy)
+		pthread_cond_wait(&scr->worker_cond, &scr->worker_lock);
+	pthread_mutex_unlock(&scr->worker_lock);
+}
+
+/*
+ * Draw all screens on the main thread and hand each one to its worker right
+ * away, so blending overlaps with drawing the next screen. The glyph cache
+ * batch keeps the glyphs of all screens alive until the last one is rendered.
+ * Page-flips are issued once all workers are done.
+ */
+static void redraw_all_parallel(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	kmscon_glyph_cache_begin_batch();
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		scr->drawn = false;
+		if (!scr->enabled)
+			continue;
+		if (screen_swapping(scr)) {
+			scr->pending = true;
+			continue;
+		}
+
+		scr->drawn = draw_screen(scr);
+		if (scr->drawn && start_worker(scr))
+			kick_worker(scr);
+	}
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (scr->drawn && !scr->has_worker)
+			kmscon_text_render(scr->txt);
+	}
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (!scr->drawn)
+			continue;
+		if (scr->has_worker)
+			wait_worker(scr);
+		swap_screen(scr);
+		scr->drawn = false;
+	}
+
+	kmscon_glyph_cache_end_batch();
+}
+
+/*
+ * Render thread
+ * With --render-thread, the main thread only parses pty output, handles input
+ * and issues page-flips. When a frame is due, it copies the cells of the tsm
+ * screen into a snapshot and hands that to the render thread, which replays it
+ * into the text renderers and blends the result. While that runs, the main
+ * thread keeps parsing and captures the next frame into the other snapshot.
+ * Whenever the main thread needs the text renderers itself (resize, rotate,
+ * font change, hotplug), it first waits for the render thread with
+ * render_sync(). Glyph caches are not locked, so the text renderers draw with
+ * caches of the render thread there, shared by the screens of this terminal
+ * only. OpenGL displays are bound to the main thread, so terminals with such a
+ * display render there as usual.
+ */
+
+static int snapshot_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch, size_t len,
+		       unsigned int width, unsigned int posx, unsigned int posy,
+		       const struct tsm_screen_attr *attr, tsm_age_t age, void *data)
+{
+	struct snapshot *snap = data;
+	struct snapshot_cell *cell;
+	void *tmp;
+	size_t size;
+
+	if (snap->num_cells >= snap->size_cells) {
+		size = snap->size_cells ? snap->size_cells * 2 : 4096;
+		tmp = realloc(snap->cells, size * sizeof(*snap->cells));
+		if (!tmp)
+			return -ENOMEM;
+		snap->cells = tmp;
+		snap->size_cells = size;
+	}
+
+	if (snap->num_chars + len > snap->size_chars) {
+		size = max(snap->size_chars * 2, snap->num_chars + len + 4096);
+		tmp = realloc(snap->chars, size * sizeof(*snap->chars));
+		if (!tmp)
+			return -ENOMEM;
+		snap->chars = tmp;
+		snap->size_chars = size;
+	}
+
+	cell = &snap->cells[snap->num_cells++];
+	cell->id = id;
+	cell->ch = snap->num_chars;
+	cell->len = len;
+	cell->width = width;
+	cell->posx = posx;
+	cell->posy = posy;
+	cell->attr = *attr;
+	cell->age = age;
+
+	memcpy(&snap->chars[snap->num_chars], ch, len * sizeof(*ch));
+	snap->num_chars += len;
+
+	return 0;
+}
+
+static void render_snapshot(struct screen *scr, struct snapshot *snap)
+{
+	struct snapshot_cell *cell;
+	size_t i;
+
+	kmscon_text_prepare(scr->txt, &snap->def_attr);
+	for (i = 0; i < snap->num_cells; ++i) {
+		cell = &snap->cells[i];
+		kmscon_text_draw_cb(NULL, cell->id, &snap->chars[cell->ch], cell->len, cell->width,
+				    cell->posx, cell->posy, &cell->attr, cell->age, scr->txt);
+	}
+	if (snap->pointer_visible && !scr->hw_cursor)
+		kmscon_text_draw_pointer(scr->txt, snap->pointer_x, snap->pointer_y);
+	kmscon_text_render(scr->txt);
+}
+
+static void *render_thread(void *data)
+{
+	struct kmscon_terminal *term = data;
+	struct render_thread *rt = term->render;
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	pthread_mutex_lock(&rt->lock);
+	for (;;) {
+		while (!rt->busy && !rt->exit)
+			pthread_cond_wait(&rt->cond, &rt->lock);
+		if (rt->exit)
+			break;
+		pthread_mutex_unlock(&rt->lock);
+
+		/* the main thread doesn't touch the screens until we are done */
+		shl_dlist_for_each(iter, &term->screens)
+		{
+			scr = shl_dlist_entry(iter, struct screen, list);
+			if (scr->drawn)
+				render_snapshot(scr, &rt->snaps[rt->front]);
+		}
+
+		pthread_mutex_lock(&rt->lock);
+		rt->busy = false;
+		pthread_cond_broadcast(&rt->cond);
+		ev_counter_inc(rt->done, 1);
+	}
+	pthread_mutex_unlock(&rt->lock);
+
+	return NULL;
+}
+
+static bool render_thread_usable(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	if (!term->render)
+		return false;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (uterm_display_has_opengl(scr->disp))
+			return false;
+	}
+
+	return true;
+}
+
+static void render_dispatch(struct kmscon_terminal *term)
+{
+	struct render_thread *rt = term->render;
+	struct shl_dlist *iter;
+	struct screen *scr;
+	bool any = false;
+
+	if (!term_visible(term))
+		return;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		scr->drawn = false;
+		if (!scr->enabled) {
+			if (scr->pending)
+				disable_screen(scr);
+			continue;
+		}
+		if (screen_swapping(scr)) {
+			scr->pending = true;
+			continue;
+		}
+
+		scr->pending = false;
+		scr->drawn = true;
+		any = true;
+	}
+
+	/* screens that are still swapping pick up the snapshot on page-flip */
+	if (!any)
+		return;
+
+	rt->front ^= 1;
+	rt->ready = false;
+	rt->running = true;
+
+	pthread_mutex_lock(&rt->lock);
+	rt->busy = true;
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->lock);
+}
+
+/* wait for the frame in flight and flip it */
+static void render_sync(struct kmscon_terminal *term)
+{
+	struct render_thread *rt = term->render;
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	if (!rt || !rt->running)
+		return;
+
+	pthread_mutex_lock(&rt->lock);
+	while (rt->busy)
+		pthread_cond_wait(&rt->cond, &rt->lock);
+	pthread_mutex_unlock(&rt->lock);
+	rt->running = false;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (!scr->drawn)
+			continue;
+		scr->drawn = false;
+		if (term_visible(term))
+			swap_screen(scr);
+	}
+}
+
+static void render_done(struct ev_counter *cnt, uint64_t num, void *data)
+{
+	struct kmscon_terminal *term = data;
+
+	render_sync(term);
+	if (term->render->ready)
+		render_dispatch(term);
+}
+
+static void render_request(struct kmscon_terminal *term)
+{
+	struct render_thread *rt = term->render;
+	struct snapshot *snap = &rt->snaps[rt->front ^ 1];
+	uint64_t start = term->first_frame ? 0 : shl_timer_now();
+
+	snap->num_cells = 0;
+	snap->num_chars = 0;
+	tsm_vte_get_def_attr(term->vte, &snap->def_attr);
+	tsm_screen_draw(term->console, snapshot_cb, snap);
+	draw_search(term, snapshot_cb, snap);
+	if (start)
+		shl_trace_span("draw", "snapshot", start);
+	snap->pointer_visible = term->pointer.visible;
+	snap->pointer_x = term->pointer.x;
+	snap->pointer_y = term->pointer.y;
+	rt->ready = true;
+
+	if (!rt->running)
+		render_dispatch(term);
+}
+
+static int render_start(struct kmscon_terminal *term)
+{
+	struct render_thread *rt;
+	int ret;
+
+	rt = malloc(sizeof(*rt));
+	if (!rt)
+		return -ENOMEM;
+	memset(rt, 0, sizeof(*rt));
+	pthread_mutex_init(&rt->lock, NULL);
+	pthread_cond_init(&rt->cond, NULL);
+
+	ret = ev_eloop_new_counter(term->eloop, &rt->done, render_done, term);
+	if (ret)
+		goto err_free;
+
+	term->render = rt;
+	ret = pthread_create(&rt->thread, NULL, render_thread, term);
+	if (ret) {
+		ret = -ret;
+		goto err_counter;
+	}
+
+	return 0;
+
+err_counter:
+	term->render = NULL;
+	ev_eloop_rm_counter(rt->done);
+err_free:
+	pthread_cond_destroy(&rt->cond);
+	pthread_mutex_destroy(&rt->lock);
+	free(rt);
+	return ret;
+}
+
+static void render_stop(struct kmscon_terminal *term)
+{
+	struct render_thread *rt = term->render;
+	unsigned int i;
+
+	if (!rt)
+		return;
+
+	render_sync(term);
 
-	scr->swapping = true;
+	pthread_mutex_lock(&rt->lock);
+	rt->exit = true;
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->lock);
+	pthread_join(rt->thread, NULL);
+
+	ev_eloop_rm_counter(rt->done);
+	for (i = 0; i < 2; ++i) {
+		free(rt->snaps[i].cells);
+		free(rt->snaps[i].chars);
+	}
+	pthread_cond_destroy(&rt->cond);
+	pthread_mutex_destroy(&rt->lock);
+	free(rt);
+	term->render = NULL;
 }
 
 static void redraw_screen(struct screen *scr)
@@ -317,7 +1056,7 @@ static void redraw_screen(struct screen *scr)
 	if (!scr->term->awake || !scr->enabled)
 		return;
 
-	if (scr->swapping)
+	if (screen_swapping(scr))
 		scr->pending = true;
 	else
 		do_redraw_screen(scr);
@@ -331,6 +1070,17 @@ static void redraw_all(struct kmscon_terminal *term)
 	if (!term->awake)
 		return;
 
+	if (render_thread_usable(term)) {
+		render_request(term);
+		return;
+	}
+	render_sync(term);
+
+	if (term->conf->render_workers && term->screens.next->next != &term->screens) {
+		redraw_all_parallel(term);
+		return;
+	}
+
 	shl_dlist_for_each(iter, &term->screens)
 	{
 		scr = shl_dlist_entry(iter, struct screen, list);
@@ -338,6 +1088,104 @@ static void redraw_all(struct kmscon_terminal *term)
 	}
 }
 
+/*
+ * PTY output is not drawn right away. We parse everything the pty has to offer
+ * in one dispatch round and then draw a single frame. If a screen is still
+ * swapping, the frame is drawn on the next page-flip of that screen. While the
+ * application keeps writing faster than we can read, we skip drawing entirely
+ * until the pty is drained or the oldest update is older than the configured
+ * redraw-latency.
+ */
+static void draw_frame(struct kmscon_terminal *term)
+{
+	uint64_t start = term->replay ? shl_timer_now() : 0;
+
+	ev_timer_update(term->frame_timer, NULL);
+	term->dirty = false;
+	redraw_all(term);
+	if (start)
+		term->replay_draw += shl_timer_now() - start;
+}
+
+static void delay_frame(struct kmscon_terminal *term, uint64_t usecs)
+{
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = usecs / 1000000;
+	spec.it_value.tv_nsec = (usecs % 1000000) * 1000;
+	ev_timer_update(term->frame_timer, &spec);
+}
+
+/*
+ * With a frame deadline, the frame is drawn that long before the next vblank
+ * of the screens instead of right away, so output written until then is shown
+ * with it. Returns how long to wait, or 0 to draw now, like when the vblank is
+ * too close or a screen can't predict it. Swapping screens draw on page-flip.
+ */
+static uint64_t frame_wait(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+	uint64_t now, vblank, start = UINT64_MAX;
+	unsigned int deadline = term->conf->frame_deadline;
+
+	if (!deadline)
+		return 0;
+
+	now = shl_timer_now();
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (!scr->enabled || scr->swapping)
+			continue;
+
+		vblank = uterm_display_next_vblank(scr->disp, now);
+		if (!vblank || vblank < now + deadline)
+			return 0;
+		if (vblank - deadline < start)
+			start = vblank - deadline;
+	}
+
+	return start == UINT64_MAX ? 0 : start - now;
+}
+
+static void schedule_frame(struct kmscon_terminal *term)
+{
+	uint64_t age, latency, wait;
+
+	/* no timers and no render state until the session is shown */
+	if (!term->dirty || !term_visible(term))
+		return;
+
+	latency = term->conf->redraw_latency * 1000ULL;
+	age = shl_timer_elapsed(&term->dirty_age);
+	if (kmscon_pty_is_busy(term->pty) && age < latency) {
+		/* The pty fd is re-armed while busy, but if the application
+		 * stops right at the read budget we would never wake up. */
+		delay_frame(term, latency - age);
+		return;
+	}
+
+	wait = frame_wait(term);
+	if (wait) {
+		delay_frame(term, wait);
+		return;
+	}
+
+	draw_frame(term);
+}
+
+static void frame_timeout(struct ev_timer *timer, uint64_t exp, void *data)
+{
+	struct kmscon_terminal *term = data;
+
+	if (term->dirty && term_visible(term))
+		draw_frame(term);
+	else
+		ev_timer_update(term->frame_timer, NULL);
+}
+
 static bool has_kms_display(struct kmscon_terminal *term)
 {
 	struct shl_dlist *iter;
@@ -401,25 +1249,54 @@ static void redraw_all_text(struct kmscon_terminal *term)
 	if (!term->awake)
 		return;
 
+	/* this draws all output parsed in the background */
+	if (term_visible(term))
+		term->dirty = false;
+	render_sync(term);
 	shl_dlist_for_each(iter, &term->screens)
 	{
 		scr = shl_dlist_entry(iter, struct screen, list);
 		if (uterm_display_is_swapping(scr->disp))
 			scr->swapping = true;
-		redraw_screen(scr);
+		/* other sessions may have drawn into the framebuffers */
+		kmscon_text_invalidate(scr->txt);
 	}
+	redraw_all(term);
 }
 
 static void display_event(struct uterm_display *disp, struct uterm_display_event *ev, void *data)
 {
 	struct screen *scr = data;
+	uint64_t start;
 
 	if (ev->action != UTERM_PAGE_FLIP)
 		return;
 
+	kmscon_stats_mark(&scr->term->stats, KMSCON_STATS_FLIP, ev->time);
+	if (!scr->term->first_frame) {
+		scr->term->first_frame = true;
+		shl_trace_finish(ev->time);
+	}
+	if (scr->swap_start) {
+		kmscon_text_profile_swap(scr->txt, KMSCON_TEXT_PROFILE_NOW() - scr->swap_start);
+		scr->swap_start = 0;
+	}
 	scr->swapping = false;
-	if (scr->pending)
+	if (scr->frame && term_visible(scr->term)) {
+		show_frame(scr);
+		if (scr->swapping)
+			return;
+	}
+	if (!scr->pending)
+		return;
+
+	start = scr->term->replay ? shl_timer_now() : 0;
+	if (render_thread_usable(scr->term))
+		render_request(scr->term);
+	else
 		do_redraw_screen(scr);
+	if (start)
+		scr->term->replay_draw += shl_timer_now() - start;
 }
 
 static void osc_event(struct tsm_vte *vte, const char *osc_string, size_t osc_len, void *data)
@@ -507,6 +1384,8 @@ static bool terminal_update_size_largest(struct kmscon_terminal *term)
 	struct screen *scr;
 	unsigned int rows, cols, cells;
 	unsigned int max_cells = 0;
+	unsigned int min_cols = 0, min_rows = 0;
+	bool changed;
 
 	shl_dlist_for_each(iter, &term->screens)
 	{
@@ -516,10 +1395,17 @@ static bool terminal_update_size_largest(struct kmscon_terminal *term)
 		cells = rows * cols;
 		if (cells > max_cells) {
 			max_cells = cells;
-			term->min_cols = cols;
-			term->min_rows = rows;
+			min_cols = cols;
+			min_rows = rows;
 		}
 	}
+	if (!max_cells)
+		return false;
+
+	/* a monitor that is added or removed may leave the grid as it is */
+	changed = min_cols != term->min_cols || min_rows != term->min_rows;
+	term->min_cols = min_cols;
+	term->min_rows = min_rows;
 	shl_dlist_for_each(iter, &term->screens)
 	{
 		scr = shl_dlist_entry(iter, struct screen, list);
@@ -532,7 +1418,7 @@ static bool terminal_update_size_largest(struct kmscon_terminal *term)
 			scr->enabled = true;
 		}
 	}
-	return max_cells > 0;
+	return changed;
 }
 
 static bool terminal_update_size(struct kmscon_terminal *term)
@@ -541,6 +1427,7 @@ static bool terminal_update_size(struct kmscon_terminal *term)
 	struct screen *scr;
 	bool ret;
 
+	render_sync(term);
 	if (term->conf->multi_monitor && !strcmp(term->conf->multi_monitor, "largest")) {
 		ret = terminal_update_size_largest(term);
 	} else {
@@ -561,25 +1448,35 @@ static bool terminal_update_size(struct kmscon_terminal *term)
 static void terminal_update_size_notify(struct kmscon_terminal *term)
 {
 	if (terminal_update_size(term)) {
+		drop_frames(term);
 		tsm_screen_resize(term->console, term->min_cols, term->min_rows);
 		kmscon_pty_resize(term->pty, term->min_cols, term->min_rows);
 		redraw_all(term);
 	}
 }
 
-static int font_set(struct kmscon_terminal *term)
+/* takes over the reference of @font */
+static void font_install(struct kmscon_terminal *term, struct kmscon_font *font, bool prerender)
 {
 	int ret;
-	struct kmscon_font *font;
+	struct kmscon_glyph_cache *glyphs = NULL;
 	struct shl_dlist *iter;
 	struct screen *scr;
 
-	ret = kmscon_font_find(&font, &term->font_attr, term->conf->font_engine);
-	if (ret)
-		return ret;
+	render_sync(term);
+
+	/* hold the cache so the renderers pick up the prerendered glyphs */
+	if (prerender) {
+		ret = kmscon_glyph_cache_prerender(&glyphs, font, &term->font_attr);
+		if (ret)
+			log_warning("cannot prerender glyphs: %d", ret);
+	}
 
+	kmscon_glyph_cache_unref(term->glyphs);
+	term->glyphs = glyphs;
 	kmscon_font_unref(term->font);
 	term->font = font;
+	drop_frames(term);
 
 	term->min_cols = 0;
 	term->min_rows = 0;
@@ -593,7 +1490,256 @@ static int font_set(struct kmscon_terminal *term)
 		refresh_hw_cursor(scr);
 	}
 	terminal_update_size_notify(term);
+}
+
+/*
+ * Background font loading
+ * Looking up a font initializes the font engine on first use, which includes
+ * the fontconfig scan of all font directories. With --font-async, a new
+ * terminal starts with the built-in 8x16 font and a thread looks up the
+ * configured one meanwhile, so the displays are probed and the first frame is
+ * drawn without waiting for it. The thread signals a counter on the event loop
+ * when it is done and the font is installed from there. Terminals in the
+ * background keep it until they are shown.
+ */
+
+struct font_loader {
+	pthread_t thread;
+	struct ev_counter *cnt;
+	struct kmscon_font_attr attr;
+	char *engine;
+	struct kmscon_font *font;
+	int ret;
+};
+
+static void *font_loader_thread(void *data)
+{
+	struct font_loader *fl = data;
+	uint64_t start = shl_timer_now();
+
+	fl->ret = kmscon_font_find(&fl->font, &fl->attr, fl->engine);
+	if (!fl->ret)
+		shl_trace_span("font", fl->font->ops->name, start);
+	ev_counter_inc(fl->cnt, 1);
+	return NULL;
+}
+
+/* waits for the thread, returns the font it found or NULL */
+static struct kmscon_font *font_loader_finish(struct kmscon_terminal *term)
+{
+	struct font_loader *fl = term->loader;
+	struct kmscon_font *font;
+
+	if (!fl)
+		return NULL;
+
+	pthread_join(fl->thread, NULL);
+	ev_eloop_rm_counter(fl->cnt);
+	font = fl->ret ? NULL : fl->font;
+	free(fl->engine);
+	free(fl);
+	term->loader = NULL;
+	return font;
+}
+
+static void font_loader_event(struct ev_counter *cnt, uint64_t num, void *data)
+{
+	struct kmscon_terminal *term = data;
+	struct kmscon_font *font;
+
+	font = font_loader_finish(term);
+	if (!font) {
+		log_warning("cannot load font, keeping 8x16");
+		return;
+	}
+
+	if (term->released) {
+		kmscon_font_unref(term->font_pending);
+		term->font_pending = font;
+		return;
+	}
+
+	font_install(term, font, term->conf->font_prerender);
+}
+
+static void font_load_cancel(struct kmscon_terminal *term)
+{
+	kmscon_font_unref(font_loader_finish(term));
+	kmscon_font_unref(term->font_pending);
+	term->font_pending = NULL;
+}
+
+static int font_set(struct kmscon_terminal *term)
+{
+	int ret;
+	struct kmscon_font *font;
+	uint64_t start;
+
+	/* an explicit change wins over a lookup that is still running */
+	font_load_cancel(term);
+
+	start = shl_timer_now();
+	ret = kmscon_font_find(&font, &term->font_attr, term->conf->font_engine);
+	if (ret)
+		return ret;
+	shl_trace_span("font", font->ops->name, start);
+
+	font_install(term, font, term->conf->font_prerender);
+	return 0;
+}
+
+/*
+ * Zoom cache
+ * A zoom step looks up the font at the new size, and the renderers start with
+ * an empty glyph cache for it. So the fonts of the last ZOOM_CACHE_SIZE sizes
+ * are kept together with a reference to their shared glyph cache. Zooming back
+ * to one of them skips the font lookup, and the renderers draw with the glyphs
+ * rasterized before. Terminals drop the cache when their renderers are
+ * released.
+ */
+
+static void zoom_entry_clear(struct zoom_entry *e)
+{
+	kmscon_glyph_cache_unref(e->glyphs);
+	kmscon_font_unref(e->font);
+	memset(e, 0, sizeof(*e));
+}
+
+static void zoom_clear(struct kmscon_terminal *term)
+{
+	unsigned int i;
+
+	for (i = 0; i < ZOOM_CACHE_SIZE; ++i)
+		zoom_entry_clear(&term->zoom[i]);
+}
+
+/* removes the entry of @height from the cache and returns it in @out */
+static bool zoom_take(struct kmscon_terminal *term, unsigned int height, struct zoom_entry *out)
+{
+	unsigned int i;
+
+	for (i = 0; i < ZOOM_CACHE_SIZE; ++i) {
+		if (term->zoom[i].font && term->zoom[i].height == height)
+			break;
+	}
+	if (i == ZOOM_CACHE_SIZE)
+		return false;
+
+	*out = term->zoom[i];
+	memmove(&term->zoom[i], &term->zoom[i + 1],
+		sizeof(*term->zoom) * (ZOOM_CACHE_SIZE - i - 1));
+	memset(&term->zoom[ZOOM_CACHE_SIZE - 1], 0, sizeof(*term->zoom));
+	return true;
+}
+
+/* takes over the references of @e, the least recently used entry is dropped */
+static void zoom_push(struct kmscon_terminal *term, const struct zoom_entry *e)
+{
+	zoom_entry_clear(&term->zoom[ZOOM_CACHE_SIZE - 1]);
+	memmove(&term->zoom[1], &term->zoom[0], sizeof(*term->zoom) * (ZOOM_CACHE_SIZE - 1));
+	term->zoom[0] = *e;
+}
+
+static int font_zoom(struct kmscon_terminal *term, unsigned int height)
+{
+	struct zoom_entry old, cached;
+	struct kmscon_font *font = term->font;
+	unsigned int prev = term->font_attr.height;
+	size_t glyph_size;
+	int ret;
+
+	/* the 8x16 font shown while the real one is loaded is not worth keeping */
+	memset(&old, 0, sizeof(old));
+	if (!term->loader && !term->font_pending && !term->released) {
+		old.height = prev;
+		old.font = font;
+		kmscon_font_ref(font);
+
+		/* the renderers still hold the cache of @font, this only adds a reference */
+		glyph_size = sizeof(struct kmscon_glyph) + 2 * font->attr.width * font->attr.height;
+		if (term->glyphs) {
+			old.glyphs = term->glyphs;
+			kmscon_glyph_cache_ref(old.glyphs);
+		} else {
+			kmscon_glyph_cache_get_shared(&old.glyphs, font, 1, glyph_size);
+		}
+	}
+
+	term->font_attr.height = height;
+	if (zoom_take(term, height, &cached)) {
+		log_debug("zooming to cached font size %u", height);
+		font_load_cancel(term);
+		/* the cached glyphs stay alive until the renderers took them */
+		font_install(term, cached.font, false);
+		kmscon_glyph_cache_unref(term->glyphs);
+		term->glyphs = cached.glyphs;
+	} else {
+		ret = font_set(term);
+		if (ret) {
+			term->font_attr.height = prev;
+			zoom_entry_clear(&old);
+			return ret;
+		}
+	}
+
+	if (old.font)
+		zoom_push(term, &old);
+	return 0;
+}
+
+static int font_load_async(struct kmscon_terminal *term)
+{
+	struct font_loader *fl;
+	struct kmscon_font *font;
+	const char *engine = term->conf->font_engine;
+	int ret;
+
+	if (engine && !strcmp(engine, "8x16"))
+		return font_set(term);
+
+	fl = malloc(sizeof(*fl));
+	if (!fl)
+		return -ENOMEM;
+	memset(fl, 0, sizeof(*fl));
+	memcpy(&fl->attr, &term->font_attr, sizeof(fl->attr));
+
+	if (engine) {
+		fl->engine = strdup(engine);
+		if (!fl->engine) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+	}
+
+	ret = kmscon_font_find(&font, &term->font_attr, "8x16");
+	if (ret)
+		goto err_engine;
+
+	ret = ev_eloop_new_counter(term->eloop, &fl->cnt, font_loader_event, term);
+	if (ret)
+		goto err_font;
+
+	ret = pthread_create(&fl->thread, NULL, font_loader_thread, fl);
+	if (ret) {
+		log_warning("cannot start font loader (%d), loading the font directly", ret);
+		ev_eloop_rm_counter(fl->cnt);
+		kmscon_font_unref(font);
+		free(fl->engine);
+		free(fl);
+		return font_set(term);
+	}
+
+	term->loader = fl;
+	font_install(term, font, false);
 	return 0;
+
+err_font:
+	kmscon_font_unref(font);
+err_engine:
+	free(fl->engine);
+err_free:
+	free(fl);
+	return ret;
 }
 
 static void rotate_cw_screen(struct screen *scr)
@@ -609,6 +1755,7 @@ static void rotate_cw_all(struct kmscon_terminal *term)
 	struct shl_dlist *iter;
 	struct screen *scr;
 
+	render_sync(term);
 	shl_dlist_for_each(iter, &term->screens)
 	{
 		scr = shl_dlist_entry(iter, struct screen, list);
@@ -634,6 +1781,7 @@ static void rotate_ccw_all(struct kmscon_terminal *term)
 	struct shl_dlist *iter;
 	struct screen *scr;
 
+	render_sync(term);
 	shl_dlist_for_each(iter, &term->screens)
 	{
 		scr = shl_dlist_entry(iter, struct screen, list);
@@ -643,14 +1791,38 @@ static void rotate_ccw_all(struct kmscon_terminal *term)
 	update_pointer_max_all(term);
 }
 
+/* gltex needs OpenGL, bbulk works everywhere */
+static const char *pick_renderer(struct kmscon_terminal *term, struct uterm_display *disp)
+{
+	static const char *const names[] = {"gltex", "bbulk"};
+	const char *be;
+
+	if (!uterm_display_has_opengl(disp))
+		return "bbulk";
+
+	switch (term->conf->renderer) {
+	case KMSCON_RENDERER_BBULK:
+		return "bbulk";
+	case KMSCON_RENDERER_AUTO:
+		if (!kmscon_bench_pick(&be, disp, term->font, term->conf->rotate, names,
+				       sizeof(names) / sizeof(*names)))
+			return be;
+		log_warning("cannot time the renderers on display %s, using gltex",
+			    uterm_display_name(disp));
+		return "gltex";
+	default:
+		return "gltex";
+	}
+}
+
 static int add_display(struct kmscon_terminal *term, struct uterm_display *disp)
 {
 	struct shl_dlist *iter;
 	struct screen *scr;
 	int ret;
 	const char *be;
-	bool opengl;
 
+	render_sync(term);
 	shl_dlist_for_each(iter, &term->screens)
 	{
 		scr = shl_dlist_entry(iter, struct screen, list);
@@ -674,17 +1846,13 @@ static int add_display(struct kmscon_terminal *term, struct uterm_display *disp)
 		goto err_free;
 	}
 
-	opengl = uterm_display_has_opengl(scr->disp);
-	if (opengl)
-		be = "gltex";
-	else
-		be = "bbulk";
-
+	be = pick_renderer(term, scr->disp);
 	ret = kmscon_text_new(&scr->txt, be, term->conf->rotate);
 	if (ret) {
 		log_error("cannot create text-renderer");
 		goto err_cb;
 	}
+	kmscon_text_set_images(scr->txt, term->images);
 
 	ret = kmscon_text_set(scr->txt, term->font, scr->disp);
 	if (ret) {
@@ -707,7 +1875,11 @@ static int add_display(struct kmscon_terminal *term, struct uterm_display *disp)
 	kmscon_text_resize(scr->txt, term->min_cols, term->min_rows);
 	update_pointer_max_all(term);
 	uterm_display_ref(scr->disp);
-	do_redraw_screen(scr);
+	/* the renderer was only set up to know the size of the screen */
+	if (term->released)
+		kmscon_text_unset(scr->txt);
+	else
+		do_redraw_screen(scr);
 	return 0;
 
 err_text:
@@ -724,6 +1896,9 @@ static void free_screen(struct screen *scr, bool update)
 	struct kmscon_terminal *term = scr->term;
 
 	log_debug("destroying terminal screen %p", scr);
+	render_sync(term);
+	stop_worker(scr);
+	drop_frame(scr);
 	if (scr->hw_cursor)
 		uterm_display_destroy_cursor(scr->disp);
 	shl_dlist_unlink(&scr->list);
@@ -751,77 +1926,239 @@ static void rm_display(struct kmscon_terminal *term, struct uterm_display *disp)
 			break;
 	}
 
-	if (iter == &term->screens)
+	if (iter == &term->screens)
+		return;
+
+	log_debug("removed display %p from terminal %p", disp, term);
+	free_screen(scr, true);
+}
+
+/*
+ * Scrollback search
+ * libtsm has no way to read the scrollback other than copying a selection, so
+ * the first search selects everything from the oldest scrollback line to the
+ * last screen row and keeps a copy of it. The copy is dropped whenever new
+ * output arrives and taken again on the next search. Lines of the copy are
+ * numbered like the scrollback, so a match is shown by scrolling up from the
+ * bottom and selecting it.
+ */
+
+static int search_load(struct kmscon_terminal *term)
+{
+	struct tsm_screen *con = term->console;
+	char *text;
+	int len;
+
+	tsm_screen_selection_reset(con);
+	tsm_screen_sb_up(con, term->conf->sb_size);
+	tsm_screen_selection_start(con, 0, 0);
+	tsm_screen_sb_reset(con);
+	tsm_screen_selection_target(con, tsm_screen_get_width(con) - 1,
+				    tsm_screen_get_height(con) - 1);
+	len = tsm_screen_selection_copy(con, &text);
+	tsm_screen_selection_reset(con);
+	if (len < 0)
+		return len;
+
+	kmscon_search_set_text(&term->search, text, len);
+	return 0;
+}
+
+static void search_show(struct kmscon_terminal *term, size_t line, unsigned int col)
+{
+	struct tsm_screen *con = term->console;
+	unsigned int rows = tsm_screen_get_height(con), y;
+	size_t sb = 0;
+
+	if (term->search.num_lines > rows)
+		sb = term->search.num_lines - rows;
+
+	tsm_screen_sb_reset(con);
+	if (line < sb) {
+		tsm_screen_sb_up(con, sb - line);
+		y = 0;
+	} else {
+		y = line - sb;
+	}
+
+	tsm_screen_selection_reset(con);
+	tsm_screen_selection_start(con, col, y);
+	tsm_screen_selection_target(con, col + term->search_len - 1, y);
+
+	/* don't cover the match with the prompt */
+	term->search_row = (y == rows - 1) ? 0 : rows - 1;
+}
+
+/*
+ * Search for the query from the bottom or, with @older, for the next match
+ * above the one shown. If there is no older match, the view stays where it is.
+ */
+static void search_update(struct kmscon_terminal *term, bool older)
+{
+	char query[SEARCH_MAX * 4];
+	size_t len = 0, line, before = -1;
+	unsigned int i, col;
+	int ret;
+
+	for (i = 0; i < term->search_len; ++i)
+		len += tsm_ucs4_to_utf8(term->search_query[i], &query[len]);
+
+	if (len && !term->search.text) {
+		ret = search_load(term);
+		if (ret)
+			log_warning("cannot copy scrollback for search (%d)", ret);
+	}
+
+	if (older && term->search_found)
+		before = term->search_line;
+
+	ret = kmscon_search_find(&term->search, query, len, before, &line, &col);
+	term->search_failed = ret && len;
+	if (!ret) {
+		term->search_found = true;
+		term->search_line = line;
+		search_show(term, line, col);
+	} else if (!older || !term->search_found) {
+		term->search_found = false;
+		term->search_row = tsm_screen_get_height(term->console) - 1;
+		tsm_screen_selection_reset(term->console);
+		tsm_screen_sb_reset(term->console);
+	}
+
+	redraw_all(term);
+}
+
+static void search_open(struct kmscon_terminal *term)
+{
+	term->searching = true;
+	term->search_len = 0;
+	term->search_found = false;
+	search_update(term, false);
+}
+
+/* Return keeps the view and the match selected, Escape goes back to the bottom */
+static void search_close(struct kmscon_terminal *term, bool reset)
+{
+	term->searching = false;
+	kmscon_search_clear(&term->search);
+	if (reset) {
+		tsm_screen_selection_reset(term->console);
+		tsm_screen_sb_reset(term->console);
+	}
+	redraw_all(term);
+}
+
+static void search_input(struct kmscon_terminal *term, struct uterm_input_key_event *ev)
+{
+	enum kmscon_grab grab;
+	uint32_t ch;
+
+	grab = kmscon_conf_find_grab(term->conf, KMSCON_GRAB_SEARCH, KMSCON_GRAB_SEARCH,
+				     ev->mods, ev->num_syms, ev->keysyms);
+	if (grab == KMSCON_GRAB_SEARCH) {
+		search_update(term, true);
+		return;
+	}
+
+	if (ev->num_syms > 1)
+		return;
+
+	switch (ev->keysyms[0]) {
+	case XKB_KEY_Escape:
+		search_close(term, true);
+		return;
+	case XKB_KEY_Return:
+	case XKB_KEY_KP_Enter:
+		search_close(term, false);
+		return;
+	case XKB_KEY_BackSpace:
+		if (term->search_len) {
+			--term->search_len;
+			search_update(term, false);
+		}
+		return;
+	}
+
+	ch = ev->codepoints[0];
+	if (ch == UTERM_INPUT_INVALID || ch < 0x20 || ch == 0x7f ||
+	    (ev->mods & (SHL_CONTROL_MASK | SHL_ALT_MASK | SHL_LOGO_MASK)) ||
+	    term->search_len >= SEARCH_MAX)
 		return;
 
-	log_debug("removed display %p from terminal %p", disp, term);
-	free_screen(scr, true);
+	term->search_query[term->search_len++] = ch;
+	search_update(term, false);
 }
 
 static void input_event(struct uterm_input *input, struct uterm_input_key_event *ev, void *data)
 {
 	struct kmscon_terminal *term = data;
+	enum kmscon_grab grab;
 
 	if (!term->opened || !term->awake || ev->handled ||
 	    !kmscon_session_get_foreground(term->session))
 		return;
 
+	/* the search prompt takes all keys until it is closed */
+	if (term->searching) {
+		search_input(term, ev);
+		ev->handled = true;
+		return;
+	}
+
 	// reset mouse selection on keypress
 	tsm_screen_selection_reset(term->console);
 
-	if (conf_grab_matches(term->conf->grab_scroll_up, ev->mods, ev->num_syms, ev->keysyms)) {
+	grab = kmscon_conf_find_grab(term->conf, KMSCON_GRAB_TERMINAL_FIRST,
+				     KMSCON_GRAB_TERMINAL_LAST, ev->mods, ev->num_syms, ev->keysyms);
+	switch (grab) {
+	case KMSCON_GRAB_SCROLL_UP:
 		tsm_screen_sb_up(term->console, 1);
 		redraw_all(term);
 		ev->handled = true;
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_scroll_down, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_SCROLL_DOWN:
 		tsm_screen_sb_down(term->console, 1);
 		redraw_all(term);
 		ev->handled = true;
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_page_up, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_PAGE_UP:
 		tsm_screen_sb_page_up(term->console, 1);
 		redraw_all(term);
 		ev->handled = true;
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_page_down, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_PAGE_DOWN:
 		tsm_screen_sb_page_down(term->console, 1);
 		redraw_all(term);
 		ev->handled = true;
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_zoom_in, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_ZOOM_IN:
 		ev->handled = true;
 		if (term->font_attr.height + term->font->increase_step < term->font_attr.height)
 			return;
 
-		term->font_attr.height += term->font->increase_step;
-		if (font_set(term))
-			term->font_attr.height -= term->font->increase_step;
+		font_zoom(term, term->font_attr.height + term->font->increase_step);
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_zoom_out, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_ZOOM_OUT:
 		ev->handled = true;
 		if (term->font_attr.height <= term->font->increase_step)
 			return;
 
-		term->font_attr.height -= term->font->increase_step;
-		if (font_set(term))
-			term->font_attr.height += term->font->increase_step;
+		font_zoom(term, term->font_attr.height - term->font->increase_step);
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_rotate_cw, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_ROTATE_CW:
 		rotate_cw_all(term);
 		ev->handled = true;
 		return;
-	}
-	if (conf_grab_matches(term->conf->grab_rotate_ccw, ev->mods, ev->num_syms, ev->keysyms)) {
+	case KMSCON_GRAB_ROTATE_CCW:
 		rotate_ccw_all(term);
 		ev->handled = true;
 		return;
+	case KMSCON_GRAB_SEARCH:
+		search_open(term);
+		ev->handled = true;
+		return;
+	default:
+		break;
 	}
 
 	/* TODO: xkbcommon supports multiple keysyms, but it is currently
@@ -830,6 +2167,8 @@ static void input_event(struct uterm_input *input, struct uterm_input_key_event
 	if (ev->num_syms > 1)
 		return;
 
+	if (term->stats_timer)
+		kmscon_stats_input(&term->stats, ev->time);
 	if (tsm_vte_handle_keyboard(term->vte, ev->keysyms[0], ev->ascii, ev->mods,
 				    ev->codepoints[0])) {
 		tsm_screen_sb_reset(term->console);
@@ -859,6 +2198,14 @@ static void copy_selection(struct kmscon_terminal *term)
 	term->pointer.copy_len = tsm_screen_selection_copy(term->console, &term->pointer.copy);
 }
 
+/* the vte adds the bracketed paste markers, then all of it is streamed by the pty */
+static void paste(struct kmscon_terminal *term, const char *text)
+{
+	term->pasting = true;
+	tsm_vte_paste(term->vte, text);
+	term->pasting = false;
+}
+
 static void forward_pointer_event(struct kmscon_terminal *term,
 				  struct uterm_input_pointer_event *ev)
 {
@@ -925,7 +2272,7 @@ static void handle_pointer_button(struct kmscon_terminal *term,
 	case 2:
 		if (ev->pressed) {
 			if (term->pointer.copy && term->pointer.copy_len)
-				tsm_vte_paste(term->vte, term->pointer.copy);
+				paste(term, term->pointer.copy);
 			tsm_screen_selection_reset(term->console);
 		}
 	}
@@ -966,6 +2313,21 @@ static void hw_cursor_show(struct kmscon_terminal *term, int32_t x, int32_t y)
 	}
 }
 
+/* motion only moves the cursor planes, if every screen has one */
+static bool hw_cursor_all(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (scr->enabled && !scr->hw_cursor)
+			return false;
+	}
+	return true;
+}
+
 static void hw_cursor_hide(struct kmscon_terminal *term)
 {
 	struct shl_dlist *iter;
@@ -979,6 +2341,27 @@ static void hw_cursor_hide(struct kmscon_terminal *term)
 	}
 }
 
+/*
+ * A pointer frame is drawn at the end of the dispatch it arrived in, so a fast
+ * mouse that delivers several frames per wakeup causes a single redraw. Screens
+ * that are still swapping draw it on their next page-flip, which throttles
+ * motion to the display refresh. Plain motion over screens with a cursor plane
+ * draws nothing, the planes are committed on their own.
+ */
+static void pointer_redraw_idle(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct kmscon_terminal *term = data;
+
+	redraw_all(term);
+}
+
+static void schedule_pointer_redraw(struct kmscon_terminal *term)
+{
+	if (ev_eloop_register_idle_cb(term->eloop, pointer_redraw_idle, term,
+				      EV_ONESHOT | EV_SINGLE))
+		redraw_all(term);
+}
+
 static void pointer_event(struct uterm_input *input, struct uterm_input_pointer_event *ev,
 			  void *data)
 {
@@ -992,6 +2375,8 @@ static void pointer_event(struct uterm_input *input, struct uterm_input_pointer_
 			      &term->pointer.posy);
 		term->pointer.visible = true;
 		hw_cursor_show(term, ev->pointer_x, ev->pointer_y);
+		if (!hw_cursor_all(term))
+			term->pointer.redraw = true;
 	}
 
 	if (tsm_vte_get_mouse_mode(term->vte) != TSM_MOUSE_TRACK_DISABLE &&
@@ -1004,13 +2389,17 @@ static void pointer_event(struct uterm_input *input, struct uterm_input_pointer_
 	default:
 		break;
 	case UTERM_MOVED:
-		if (term->pointer.select)
+		if (term->pointer.select) {
 			update_selection(term->console, term->pointer.posx, term->pointer.posy);
+			term->pointer.redraw = true;
+		}
 		break;
 	case UTERM_BUTTON:
 		handle_pointer_button(term, ev);
+		term->pointer.redraw = true;
 		break;
 	case UTERM_WHEEL:
+		term->pointer.redraw = true;
 		tsm_screen_selection_reset(term->console);
 		if (ev->wheel > 0)
 			tsm_screen_sb_up(term->console, 3);
@@ -1018,7 +2407,10 @@ static void pointer_event(struct uterm_input *input, struct uterm_input_pointer_
 			tsm_screen_sb_down(term->console, 3);
 		break;
 	case UTERM_SYNC:
-		redraw_all(term);
+		if (term->pointer.redraw) {
+			term->pointer.redraw = false;
+			schedule_pointer_redraw(term);
+		}
 		break;
 	case UTERM_HIDE_TIMEOUT:
 		tsm_screen_selection_reset(term->console);
@@ -1042,6 +2434,125 @@ static void rm_all_screens(struct kmscon_terminal *term)
 	term->min_rows = 0;
 }
 
+/*
+ * A terminal in the background only parses pty output, but its renderers keep
+ * cells, blend requests and glyphs of every screen. After session-release
+ * seconds they are unset, which keeps the size of the screens, and they are
+ * set up again when the session is activated.
+ */
+static void release_screens(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	if (term->released)
+		return;
+
+	log_debug("releasing text renderers of terminal %p", term);
+	render_sync(term);
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		stop_worker(scr);
+		kmscon_text_unset(scr->txt);
+	}
+	kmscon_glyph_cache_unref(term->glyphs);
+	term->glyphs = NULL;
+	zoom_clear(term);
+	term->released = true;
+}
+
+static void restore_screens(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+	struct kmscon_font *font;
+	int ret;
+
+	ev_timer_update(term->release_timer, NULL);
+	if (!term->released)
+		return;
+
+	term->released = false;
+
+	/* a font loaded in the background meanwhile sets up the renderers itself */
+	if (term->font_pending) {
+		font = term->font_pending;
+		term->font_pending = NULL;
+		font_install(term, font, term->conf->font_prerender);
+		return;
+	}
+
+	if (term->conf->font_prerender) {
+		ret = kmscon_glyph_cache_prerender(&term->glyphs, term->font, &term->font_attr);
+		if (ret)
+			log_warning("cannot prerender glyphs: %d", ret);
+	}
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		ret = kmscon_text_set(scr->txt, term->font, scr->disp);
+		if (ret) {
+			log_warning("cannot set up text-renderer again: %d", ret);
+			continue;
+		}
+		kmscon_text_resize(scr->txt, term->min_cols, term->min_rows);
+	}
+}
+
+/* show the frames kept when the session was deactivated and draw what changed */
+static void show_frames(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+	bool redraw = term->dirty;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		scr->shown = false;
+		show_frame(scr);
+		if (scr->pending)
+			redraw = true;
+	}
+
+	if (redraw)
+		redraw_all_text(term);
+}
+
+static void keep_frames(struct kmscon_terminal *term)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		keep_frame(scr);
+	}
+}
+
+static void release_timeout(struct ev_timer *timer, uint64_t exp, void *data)
+{
+	struct kmscon_terminal *term = data;
+
+	if (!term->awake)
+		release_screens(term);
+}
+
+static void schedule_release(struct kmscon_terminal *term)
+{
+	struct itimerspec spec;
+
+	if (!term->conf->session_release)
+		return;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = term->conf->session_release;
+	ev_timer_update(term->release_timer, &spec);
+}
+
 static int terminal_open(struct kmscon_terminal *term)
 {
 	int ret;
@@ -1051,6 +2562,13 @@ static int terminal_open(struct kmscon_terminal *term)
 		return -EALREADY;
 
 	tsm_vte_hard_reset(term->vte);
+	if (term->replay) {
+		term->opened = true;
+		kmscon_replay_start(term->replay);
+		redraw_all(term);
+		return 0;
+	}
+
 	width = tsm_screen_get_width(term->console);
 	height = tsm_screen_get_height(term->console);
 	ret = kmscon_pty_open(term->pty, width, height, has_kms_display(term));
@@ -1068,6 +2586,7 @@ static int terminal_open(struct kmscon_terminal *term)
 
 static void terminal_close(struct kmscon_terminal *term)
 {
+	kmscon_replay_stop(term->replay);
 	kmscon_pty_close(term->pty);
 	term->opened = false;
 }
@@ -1078,18 +2597,102 @@ static void terminal_destroy(struct kmscon_terminal *term)
 
 	terminal_close(term);
 	rm_all_screens(term);
+	render_stop(term);
+	font_load_cancel(term);
+	zoom_clear(term);
 	uterm_input_unregister_pointer_cb(term->input, pointer_event, term);
 	uterm_input_unregister_key_cb(term->input, input_event, term);
+	ev_eloop_unregister_idle_cb(term->eloop, pointer_redraw_idle, term, EV_SINGLE);
+	ev_eloop_rm_timer(term->stats_timer);
+	ev_eloop_rm_timer(term->release_timer);
+	ev_eloop_rm_timer(term->frame_timer);
+	ev_eloop_rm_timer(term->pty_timer);
 	ev_eloop_rm_fd(term->ptyfd);
+	kmscon_replay_free(term->replay);
+	kmscon_image_parser_free(term->images);
 	kmscon_pty_unref(term->pty);
+	kmscon_glyph_cache_unref(term->glyphs);
 	kmscon_font_unref(term->font);
 	tsm_vte_unref(term->vte);
 	tsm_screen_unref(term->console);
 	uterm_input_unref(term->input);
 	ev_eloop_unref(term->eloop);
+	kmscon_search_destroy(&term->search);
 	free(term);
 }
 
+/* @disp was set up again, the other displays kept their contents */
+static void refresh_display(struct kmscon_terminal *term, struct uterm_display *disp)
+{
+	struct shl_dlist *iter;
+	struct screen *scr;
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		if (scr->disp != disp)
+			continue;
+
+		drop_frame(scr);
+		if (!term->awake)
+			return;
+
+		if (term->pointer.visible)
+			hw_cursor_show(term, term->pointer.x, term->pointer.y);
+		render_sync(term);
+		if (uterm_display_is_swapping(disp))
+			scr->swapping = true;
+		kmscon_text_invalidate(scr->txt);
+		redraw_screen(scr);
+		return;
+	}
+}
+
+/*
+ * libtsm keeps no count of its scrollback lines and doesn't export its cells,
+ * so the report tells what a full scrollback of the current width takes with
+ * cells of a codepoint, a width, the attributes and the age.
+ */
+#define SB_CELL_SIZE (2 * sizeof(uint32_t) + sizeof(struct tsm_screen_attr) + sizeof(tsm_age_t))
+
+static void terminal_report(struct kmscon_terminal *term)
+{
+	struct kmscon_glyph_cache_stats gs;
+	struct kmscon_text_memory tm;
+	struct kmscon_pty_stats ps;
+	struct shl_dlist *iter;
+	struct screen *scr;
+	char name[64];
+	uint64_t sb;
+
+	if (kmscon_pty_get_slave_name(term->pty, name, sizeof(name)))
+		snprintf(name, sizeof(name), "%p", (void *)term);
+
+	/* the renderers must not draw while we look at them */
+	render_sync(term);
+
+	kmscon_glyph_cache_get_stats(term->glyphs, &gs);
+	log_info("terminal %s: glyph cache %u/%u entries, %zu KiB, %zu KiB mapped%s", name,
+		 gs.entries, gs.max_entries, gs.bytes / 1024, gs.mapped_bytes / 1024,
+		 gs.shared ? " (shared)" : "");
+
+	sb = (uint64_t)term->conf->sb_size * tsm_screen_get_width(term->console) * SB_CELL_SIZE;
+	kmscon_pty_get_stats(term->pty, &ps);
+	log_info("terminal %s: scrollback of %u lines up to %" PRIu64 " KiB, pty backlog %" PRIu64
+		 " bytes in %" PRIu64 " KiB",
+		 name, term->conf->sb_size, sb / 1024, ps.backlog, ps.backlog_size / 1024);
+
+	shl_dlist_for_each(iter, &term->screens)
+	{
+		scr = shl_dlist_entry(iter, struct screen, list);
+		kmscon_text_get_memory(scr->txt, &tm);
+		log_info("terminal %s on %s: %u requests in the last frame, %u tiles of %zu KiB, "
+			 "%zu KiB of buffers%s",
+			 name, uterm_display_name(scr->disp), tm.reqs, tm.tiles,
+			 tm.tile_bytes / 1024, tm.bytes / 1024, term->released ? " (released)" : "");
+	}
+}
+
 static int session_event(struct kmscon_session *session, struct kmscon_session_event *ev,
 			 void *data)
 {
@@ -1103,30 +2706,130 @@ static int session_event(struct kmscon_session *session, struct kmscon_session_e
 		rm_display(term, ev->disp);
 		break;
 	case KMSCON_SESSION_DISPLAY_REFRESH:
-		if (term->pointer.visible)
-			hw_cursor_show(term, term->pointer.x, term->pointer.y);
-		redraw_all_text(term);
+		refresh_display(term, ev->disp);
 		break;
 	case KMSCON_SESSION_ACTIVATE:
+		restore_screens(term);
 		term->awake = true;
-		if (!term->opened)
-			terminal_open(term);
+		kmscon_pty_set_background(term->pty, false);
 		if (term->pointer.visible)
 			hw_cursor_show(term, term->pointer.x, term->pointer.y);
-		redraw_all_text(term);
+		show_frames(term);
+		if (!term->opened)
+			terminal_open(term);
+		else
+			kmscon_replay_start(term->replay);
 		break;
 	case KMSCON_SESSION_DEACTIVATE:
+		render_sync(term);
+		keep_frames(term);
 		term->awake = false;
+		kmscon_pty_set_background(term->pty, true);
+		/* the replay measures the foreground only */
+		kmscon_replay_stop(term->replay);
 		hw_cursor_hide(term);
+		schedule_release(term);
 		break;
 	case KMSCON_SESSION_UNREGISTER:
 		terminal_destroy(term);
 		break;
+	case KMSCON_SESSION_REPORT:
+		terminal_report(term);
+		break;
 	}
 
 	return 0;
 }
 
+static void image_text(void *data, const char *buf, size_t len)
+{
+	struct kmscon_terminal *term = data;
+
+	tsm_vte_input(term->vte, buf, len);
+}
+
+static void image_reply(void *data, const char *buf, size_t len)
+{
+	struct kmscon_terminal *term = data;
+
+	kmscon_pty_write(term->pty, buf, len);
+}
+
+/*
+ * Write the placeholders of an image into the grid, see kmscon_image.h. Each
+ * row starts below the last one in the column of the cursor, scrolling at the
+ * bottom like text would. The attributes are restored afterwards.
+ */
+static void image_place(void *data, uint32_t id, unsigned int cols, unsigned int rows,
+			enum kmscon_image_cursor cursor)
+{
+	struct kmscon_terminal *term = data;
+	unsigned int width = tsm_screen_get_width(term->console);
+	unsigned int x, y, row, col;
+	uint32_t cp;
+	size_t len = 0;
+	char *buf;
+
+	x = min(tsm_screen_get_cursor_x(term->console), width - 1);
+	cols = min(cols, width - x);
+	buf = malloc(rows * (32 + 4 * cols) + 8);
+	if (!buf)
+		return;
+
+	len += sprintf(&buf[len], "\0337");
+	for (row = 0; row < rows; ++row) {
+		if (row)
+			len += sprintf(&buf[len], "\033D\033[%uG", x + 1);
+		len += sprintf(&buf[len], "\033[0;38;2;%u;%u;%um", (id >> 16) & 0xff,
+			       (id >> 8) & 0xff, id & 0xff);
+		for (col = 0; col < cols; ++col) {
+			/* 4 bytes of UTF-8 in plane 16 */
+			cp = KMSCON_IMAGE_CP_BASE + (row << 8 | col);
+			buf[len++] = 0xf0 | (cp >> 18);
+			buf[len++] = 0x80 | ((cp >> 12) & 0x3f);
+			buf[len++] = 0x80 | ((cp >> 6) & 0x3f);
+			buf[len++] = 0x80 | (cp & 0x3f);
+		}
+	}
+	tsm_vte_input(term->vte, buf, len);
+	y = tsm_screen_get_cursor_y(term->console);
+
+	len = sprintf(buf, "\0338");
+	if (cursor == KMSCON_IMAGE_BELOW)
+		len += sprintf(&buf[len], "\033[%u;%uH\033D", y + 1, x + 1);
+	else if (cursor == KMSCON_IMAGE_AFTER)
+		len += sprintf(&buf[len], "\033[%u;%uH", y + 1, x + cols + 1);
+	tsm_vte_input(term->vte, buf, len);
+	free(buf);
+}
+
+static const struct kmscon_image_ops image_ops = {
+	.text = image_text,
+	.place = image_place,
+	.reply = image_reply,
+};
+
+static void terminal_input(struct kmscon_terminal *term, const char *u8, size_t len)
+{
+	struct tsm_screen_attr attr;
+
+	kmscon_stats_mark(&term->stats, KMSCON_STATS_READ, 0);
+	if (term->images) {
+		tsm_vte_get_def_attr(term->vte, &attr);
+		kmscon_image_parser_set_cell(term->images, term->font->attr.width,
+					     term->font->attr.height, attr.br, attr.bg, attr.bb);
+		kmscon_image_parser_input(term->images, u8, len);
+	} else {
+		tsm_vte_input(term->vte, u8, len);
+	}
+	/* the copy of the scrollback is out of date */
+	kmscon_search_clear(&term->search);
+	if (!term->dirty) {
+		term->dirty = true;
+		shl_timer_reset(&term->dirty_age);
+	}
+}
+
 static void pty_input(struct kmscon_pty *pty, const char *u8, size_t len, void *data)
 {
 	struct kmscon_terminal *term = data;
@@ -1135,29 +2838,130 @@ static void pty_input(struct kmscon_pty *pty, const char *u8, size_t len, void *
 		terminal_close(term);
 		terminal_open(term);
 	} else {
-		tsm_vte_input(term->vte, u8, len);
-		redraw_all(term);
+		terminal_input(term, u8, len);
+	}
+}
+
+static void replay_input(struct kmscon_replay *rp, const char *u8, size_t len, void *data)
+{
+	struct kmscon_terminal *term = data;
+	struct kmscon_replay_stats rs;
+	double secs;
+
+	if (len) {
+		terminal_input(term, u8, len);
+		schedule_frame(term);
+		return;
 	}
+
+	/* the last output is on screen with the next frame */
+	if (term->dirty && term_visible(term))
+		draw_frame(term);
+
+	kmscon_replay_get_stats(rp, &rs);
+	secs = rs.elapsed / 1000000.0;
+	log_notice("replay done: %" PRIu64 " bytes in %.1f ms (recorded %.1f ms), parsed in "
+		   "%.1f ms, %" PRIu64 " frames drawn in %.1f ms, %.1f fps",
+		   rs.bytes, rs.elapsed / 1000.0, rs.recorded / 1000.0, rs.usec / 1000.0,
+		   term->replay_frames, term->replay_draw / 1000.0,
+		   secs > 0 ? term->replay_frames / secs : 0.0);
 }
 
 static void pty_event(struct ev_fd *fd, int mask, void *data)
+{
+	struct kmscon_terminal *term = data;
+	struct itimerspec spec;
+	uint64_t delay;
+
+	delay = kmscon_pty_dispatch(term->pty);
+	if (delay) {
+		/* the output stays in the kernel until the pty earned its next slice */
+		memset(&spec, 0, sizeof(spec));
+		spec.it_value.tv_sec = delay / 1000000;
+		spec.it_value.tv_nsec = delay % 1000000 * 1000;
+		if (!ev_timer_update(term->pty_timer, &spec))
+			ev_fd_disable(term->ptyfd);
+	}
+	schedule_frame(term);
+}
+
+static void pty_timeout(struct ev_timer *timer, uint64_t exp, void *data)
 {
 	struct kmscon_terminal *term = data;
 
-	kmscon_pty_dispatch(term->pty);
+	ev_timer_update(term->pty_timer, NULL);
+	ev_fd_enable(term->ptyfd);
 }
 
 static void write_event(struct tsm_vte *vte, const char *u8, size_t len, void *data)
 {
 	struct kmscon_terminal *term = data;
 
-	kmscon_pty_write(term->pty, u8, len);
+	if (term->pasting)
+		kmscon_pty_paste(term->pty, u8, len);
+	else
+		kmscon_pty_write(term->pty, u8, len);
+	kmscon_stats_mark(&term->stats, KMSCON_STATS_WRITE, 0);
+}
+
+static void stats_timeout(struct ev_timer *timer, uint64_t exp, void *data)
+{
+	struct kmscon_terminal *term = data;
+	struct ev_eloop_stats es;
+	struct kmscon_pty_stats ps;
+	uint64_t now, wakeups;
+
+	kmscon_stats_log(&term->stats);
+
+	kmscon_pty_get_stats(term->pty, &ps);
+	log_info("pty: %.1f KiB/s, %" PRIu64 " bytes parsed in %.1f ms, %" PRIu64
+		 " yields, %" PRIu64 " throttled%s",
+		 ps.bytes_per_sec / 1024.0, ps.bytes, ps.usec / 1000.0, ps.yields, ps.throttles,
+		 term->awake ? "" : " (background)");
+
+	ev_eloop_get_stats(term->eloop, &es);
+	now = shl_timer_now();
+	wakeups = es.wakeups + es.empty_wakeups;
+	if (now > term->stats_time)
+		log_info("eloop: %.2f wakeups/s",
+			 (wakeups - term->stats_wakeups) * 1000000.0 / (now - term->stats_time));
+	term->stats_wakeups = wakeups;
+	term->stats_time = now;
+
+	if (es.wakeups)
+		log_info("eloop: %" PRIu64 " wakeups, %" PRIu64 " empty, %.1f events per wakeup, "
+			 "%" PRIu64 " extra rounds, %" PRIu64 " coalesced idles, "
+			 "%" PRIu64 " preempted, latency %.2f/%.2f ms (avg/max)",
+			 es.wakeups, es.empty_wakeups, (double)es.events / es.wakeups,
+			 es.extra_rounds, es.idle_coalesced, es.preempted,
+			 es.latency_sum / (es.wakeups * 1000.0), es.latency_max / 1000.0);
+}
+
+/* terminals of all seats are numbered, so each records to a file of its own */
+static void record_start(struct kmscon_terminal *term, const char *seat)
+{
+	static unsigned int num;
+	char *file;
+
+	if (asprintf(&file, "%s/%s-%d-%u.ttyrec", term->conf->record_dir, seat, (int)getpid(),
+		     __atomic_add_fetch(&num, 1, __ATOMIC_RELAXED)) < 0) {
+		log_warning("cannot allocate the name of a recording");
+		return;
+	}
+
+	if (kmscon_pty_set_record(term->pty, file))
+		log_warning("cannot record terminal output to %s", file);
+	else
+		log_info("recording terminal output to %s", file);
+	free(file);
 }
 
 int kmscon_terminal_register(struct kmscon_session **out, struct kmscon_seat *seat,
 			     unsigned int vtnr)
 {
 	struct kmscon_terminal *term;
+	struct itimerspec spec;
+	struct ev_eloop_stats es;
 	int ret;
 
 	if (!out || !seat)
@@ -1203,7 +3007,10 @@ int kmscon_terminal_register(struct kmscon_session **out, struct kmscon_seat *se
 	if (ret)
 		goto err_vte;
 
-	ret = font_set(term);
+	if (term->conf->font_async)
+		ret = font_load_async(term);
+	else
+		ret = font_set(term);
 	if (ret)
 		goto err_vte;
 
@@ -1216,16 +3023,72 @@ int kmscon_terminal_register(struct kmscon_session **out, struct kmscon_seat *se
 				  term->conf->backspace_delete);
 	if (ret)
 		goto err_pty;
+	kmscon_pty_set_write_max(term->pty, (size_t)term->conf->pty_buffer * 1024);
+	/* sessions start in the background */
+	kmscon_pty_set_background(term->pty, true);
+
+	if (term->conf->image_cache) {
+		ret = kmscon_image_parser_new(&term->images, &image_ops, term);
+		if (ret)
+			goto err_pty;
+	}
+
+	if (term->conf->replay) {
+		ret = kmscon_replay_new(&term->replay, term->eloop, term->conf->replay,
+					term->conf->replay_fast, replay_input, term);
+		if (ret)
+			goto err_pty;
+	} else if (term->conf->record_dir) {
+		record_start(term, kmscon_seat_get_name(seat));
+	}
 
 	ret = ev_eloop_new_fd(term->eloop, &term->ptyfd, kmscon_pty_get_fd(term->pty), EV_READABLE,
 			      pty_event, term);
 	if (ret)
 		goto err_pty;
 
-	ret = uterm_input_register_key_cb(term->input, input_event, term);
+	ret = ev_eloop_new_timer(term->eloop, &term->pty_timer, NULL, pty_timeout, term);
 	if (ret)
 		goto err_ptyfd;
 
+	ret = ev_eloop_new_timer(term->eloop, &term->frame_timer, NULL, frame_timeout, term);
+	if (ret)
+		goto err_pty_timer;
+
+	ret = ev_eloop_new_timer(term->eloop, &term->release_timer, NULL, release_timeout, term);
+	if (ret)
+		goto err_timer;
+	/* sessions that start in the background set up renderers when shown */
+	if (term->conf->session_release) {
+		term->released = true;
+		kmscon_glyph_cache_unref(term->glyphs);
+		term->glyphs = NULL;
+	}
+
+	if (term->conf->stats) {
+		ev_eloop_get_stats(term->eloop, &es);
+		term->stats_wakeups = es.wakeups + es.empty_wakeups;
+		term->stats_time = shl_timer_now();
+		memset(&spec, 0, sizeof(spec));
+		spec.it_value.tv_sec = KMSCON_STATS_INTERVAL;
+		spec.it_interval.tv_sec = KMSCON_STATS_INTERVAL;
+		ret = ev_eloop_new_timer(term->eloop, &term->stats_timer, &spec, stats_timeout,
+					 term);
+		if (ret)
+			goto err_timer;
+	}
+
+	if (term->conf->render_thread) {
+		ret = render_start(term);
+		if (ret)
+			log_warning("cannot start render thread (%d), rendering on the main thread",
+				    ret);
+	}
+
+	ret = uterm_input_register_key_cb(term->input, input_event, term);
+	if (ret)
+		goto err_timer;
+
 	if (term->conf->mouse) {
 		ret = uterm_input_register_pointer_cb(term->input, pointer_event, term);
 		if (ret)
@@ -1248,11 +3111,22 @@ err_pointer:
 	uterm_input_unregister_pointer_cb(term->input, pointer_event, term);
 err_input:
 	uterm_input_unregister_key_cb(term->input, input_event, term);
+err_timer:
+	render_stop(term);
+	ev_eloop_rm_timer(term->stats_timer);
+	ev_eloop_rm_timer(term->release_timer);
+	ev_eloop_rm_timer(term->frame_timer);
+err_pty_timer:
+	ev_eloop_rm_timer(term->pty_timer);
 err_ptyfd:
 	ev_eloop_rm_fd(term->ptyfd);
 err_pty:
+	kmscon_replay_free(term->replay);
+	kmscon_image_parser_free(term->images);
 	kmscon_pty_unref(term->pty);
 err_font:
+	font_load_cancel(term);
+	kmscon_glyph_cache_unref(term->glyphs);
 	kmscon_font_unref(term->font);
 err_vte:
 	tsm_vte_unref(term->vte);
@@ -23,6 +23,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -30,22 +31,71 @@
 #include <pty.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/signalfd.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include "eloop.h"
+#include "kmscon_sched.h"
 #include "pty.h"
 #include "shl_log.h"
 #include "shl_misc.h"
 #include "shl_ring.h"
+#include "shl_timer.h"
 
 #define LOG_SUBSYSTEM "pty"
 
-#define KMSCON_NREAD 16384
+/*
+ * Read Policy
+ * The pty is read by an eloop reader, which uses io_uring multishot reads if
+ * available, in chunks of up to KMSCON_NREAD bytes. We parse chunks until the
+ * pty is drained or until the parse time the pty saved up is spent, at most
+ * KMSCON_READ_BUDGET microseconds, see "Read Shares". Then we yield back to
+ * the main loop so input and other seats don't starve. We also yield
+ * as soon as a high priority source, like a key press or a VT switch, is
+ * waiting.
+ */
+#define KMSCON_NREAD 32768
+
+/*
+ * Write Policy
+ * What the child doesn't take right away is queued in msgbuf, which is limited
+ * by kmscon_pty_set_write_max(). Pastes are always queued and don't count
+ * against the limit, so typing during a paste larger than it still works.
+ * Once the pty is writeable we send at most KMSCON_WRITE_BUDGET bytes and
+ * yield, so a huge paste into a slow child is streamed across main loop
+ * iterations while its output is still read and drawn.
+ */
+#define KMSCON_WRITE_BUDGET 65536
+#define KMSCON_READ_BUDGET 4000
+
+/*
+ * Read Shares
+ * Each pty earns parse time at a share of the wall clock, KMSCON_SHARE_FG per
+ * mille or KMSCON_SHARE_BG while its session is in the background. Unused time
+ * is saved up to KMSCON_READ_BUDGET, so a pty that was idle gets a full slice,
+ * and a slice never uses more than was saved. Once a pty used up its time,
+ * kmscon_pty_dispatch() tells the caller to stop polling it until it earned
+ * KMSCON_READ_MIN again. Meanwhile the output stays in the kernel and the child
+ * blocks when the pty buffer is full, so a runaway child in one session cannot
+ * take the parse time of all others.
+ */
+#define KMSCON_SHARE_FG 600
+#define KMSCON_SHARE_BG 100
+#define KMSCON_READ_MIN 1000
+
+/*
+ * Recording
+ * With kmscon_pty_set_record(), each chunk read from the child is appended to
+ * a file in the ttyrec format: the wall-clock time in seconds and microseconds
+ * and the length of the chunk, each as 32bit little-endian, then its bytes.
+ * kmscon_replay plays such files back into a terminal.
+ */
 
 #define MAX_RETRY_TIME 2
 #define MAX_RETRY_COUNT 5
@@ -57,11 +107,25 @@ struct kmscon_pty {
 	int fd;
 	pid_t child;
 	struct ev_fd *efd;
+	int mask;
+	struct ev_reader *reader;
 	struct shl_ring *msgbuf;
-	char io_buf[KMSCON_NREAD];
 
 	kmscon_pty_input_cb input_cb;
 	void *data;
+	bool busy;
+	bool reading;
+	struct shl_timer slice;
+	bool background;
+	int64_t tokens; /* saved parse time in us, see kmscon_pty_dispatch() */
+	uint64_t limit; /* parse time of this slice */
+	uint64_t refill;
+
+	FILE *record;
+
+	struct kmscon_pty_stats stats;
+	struct shl_timer rate_timer;
+	uint64_t rate_bytes;
 
 	char *term;
 	char *colorterm;
@@ -94,6 +158,8 @@ int kmscon_pty_new(struct kmscon_pty **out, kmscon_pty_input_cb input_cb, void *
 	pty->last_spawn_time = time(NULL);
 	pty->retry_count = 0;
 	pty->data = data;
+	pty->tokens = KMSCON_READ_BUDGET;
+	pty->refill = shl_timer_now();
 
 	ret = ev_eloop_new(&pty->eloop);
 	if (ret)
@@ -103,6 +169,8 @@ int kmscon_pty_new(struct kmscon_pty **out, kmscon_pty_input_cb input_cb, void *
 	if (ret)
 		goto err_eloop;
 
+	shl_timer_reset(&pty->rate_timer);
+
 	log_debug("new pty object");
 	*out = pty;
 	return 0;
@@ -129,6 +197,7 @@ void kmscon_pty_unref(struct kmscon_pty *pty)
 
 	log_debug("free pty object");
 	kmscon_pty_close(pty);
+	kmscon_pty_set_record(pty, NULL);
 	free(pty->vtnr);
 	free(pty->seat);
 	free(pty->argv);
@@ -176,6 +245,29 @@ int kmscon_pty_set_conf(struct kmscon_pty *pty, const char *term, const char *co
 	return 0;
 }
 
+/* appends the output of the child to @file, or stops recording if it is NULL */
+int kmscon_pty_set_record(struct kmscon_pty *pty, const char *file)
+{
+	if (!pty)
+		return -EINVAL;
+
+	if (pty->record) {
+		fclose(pty->record);
+		pty->record = NULL;
+	}
+	if (!file)
+		return 0;
+
+	pty->record = fopen(file, "ae");
+	if (!pty->record) {
+		log_err("cannot open recording %s (%d): %m", file, errno);
+		return -errno;
+	}
+
+	log_debug("recording pty output to %s", file);
+	return 0;
+}
+
 int kmscon_pty_get_fd(struct kmscon_pty *pty)
 {
 	if (!pty)
@@ -184,12 +276,67 @@ int kmscon_pty_get_fd(struct kmscon_pty *pty)
 	return ev_eloop_get_fd(pty->eloop);
 }
 
-void kmscon_pty_dispatch(struct kmscon_pty *pty)
+static unsigned int pty_share(struct kmscon_pty *pty)
 {
+	return pty->background ? KMSCON_SHARE_BG : KMSCON_SHARE_FG;
+}
+
+/* returns 0 or the time in us until the pty may be polled again, see "Read Shares" */
+uint64_t kmscon_pty_dispatch(struct kmscon_pty *pty)
+{
+	uint64_t now, used;
+
 	if (!pty)
-		return;
+		return 0;
+
+	now = shl_timer_now();
+	pty->tokens += (now - pty->refill) * pty_share(pty) / 1000;
+	if (pty->tokens > KMSCON_READ_BUDGET)
+		pty->tokens = KMSCON_READ_BUDGET;
+	pty->refill = now;
 
+	/* the read slice starts with the first chunk of this round */
+	pty->reading = false;
+	pty->limit = pty->tokens > 0 ? pty->tokens : 0;
 	ev_eloop_dispatch(pty->eloop, 0);
+	if (!pty->reading)
+		return 0;
+
+	used = shl_timer_elapsed(&pty->slice);
+	pty->stats.usec += used;
+	pty->tokens -= used;
+	/* yielded for a high priority source or with time left */
+	if (!pty->busy || pty->tokens > 0)
+		return 0;
+
+	++pty->stats.throttles;
+	return (KMSCON_READ_MIN - pty->tokens) * 1000 / pty_share(pty);
+}
+
+void kmscon_pty_set_background(struct kmscon_pty *pty, bool set)
+{
+	if (!pty)
+		return;
+
+	pty->background = set;
+}
+
+bool kmscon_pty_is_busy(struct kmscon_pty *pty)
+{
+	if (!pty)
+		return false;
+
+	return pty->busy;
+}
+
+void kmscon_pty_get_stats(struct kmscon_pty *pty, struct kmscon_pty_stats *out)
+{
+	if (!pty || !out)
+		return;
+
+	memcpy(out, &pty->stats, sizeof(*out));
+	out->backlog = pty->msgbuf->used;
+	out->backlog_size = pty->msgbuf->size;
 }
 
 static bool pty_is_open(struct kmscon_pty *pty)
@@ -269,6 +416,9 @@ static void setup_child(int master, bool backspace_delete, struct winsize *ws)
 	for (i = 1; i < SIGSYS; ++i)
 		signal(i, SIG_DFL);
 
+	/* Nor our priority or CPUs. */
+	kmscon_sched_restore();
+
 	ret = grantpt(master);
 	if (ret < 0) {
 		log_err("grantpt failed: %m");
@@ -381,16 +531,48 @@ static int pty_spawn(struct kmscon_pty *pty, int master, unsigned short width,
 	return 0;
 }
 
+/*
+ * @efd is edge-triggered, so an EPOLL_CTL_MOD re-arms it. We don't need that
+ * while EV_WRITEABLE is set: we either got EWOULDBLOCK, and the next wakeup
+ * reports the fd again, or we queued it with ev_fd_repoll(). So only tell
+ * epoll about real changes of the mask.
+ */
+static void pty_set_writeable(struct kmscon_pty *pty, bool on)
+{
+	int mask = EV_ET | (on ? EV_WRITEABLE : 0);
+
+	if (mask == pty->mask)
+		return;
+	if (!ev_fd_update(pty->efd, mask))
+		pty->mask = mask;
+}
+
 static int send_buf(struct kmscon_pty *pty)
 {
-	const char *buf;
-	size_t len;
-	int ret;
+	struct iovec vec[2];
+	size_t num, room, sent = 0;
+	ssize_t ret;
+
+	while ((num = shl_ring_peek(pty->msgbuf, vec))) {
+		if (sent >= KMSCON_WRITE_BUDGET) {
+			/* We are edge-triggered so ask for the EV_WRITEABLE
+			 * event again next round. */
+			ev_fd_repoll(pty->efd, EV_WRITEABLE);
+			return 0;
+		}
 
-	while ((buf = shl_ring_peek(pty->msgbuf, &len, 0))) {
-		ret = write(pty->fd, buf, len);
+		room = KMSCON_WRITE_BUDGET - sent;
+		if (vec[0].iov_len >= room) {
+			vec[0].iov_len = room;
+			num = 1;
+		} else if (num > 1 && vec[1].iov_len > room - vec[0].iov_len) {
+			vec[1].iov_len = room - vec[0].iov_len;
+		}
+
+		ret = writev(pty->fd, vec, num);
 		if (ret > 0) {
 			shl_ring_drop(pty->msgbuf, ret);
+			sent += ret;
 			continue;
 		}
 
@@ -403,45 +585,72 @@ static int send_buf(struct kmscon_pty *pty)
 		return 0;
 	}
 
-	ev_fd_update(pty->efd, EV_READABLE | EV_ET);
+	pty_set_writeable(pty, false);
 	return 0;
 }
 
-static int read_buf(struct kmscon_pty *pty)
+static void account_read(struct kmscon_pty *pty, size_t len)
 {
-	ssize_t len, num;
-	int mask;
+	uint64_t elapsed;
 
-	/* Use a maximum of 50 steps to avoid staying here forever.
-	 * TODO: recheck where else a user might flush our queues and try to
-	 * install an explicit policy. */
-	num = 50;
-	do {
-		len = read(pty->fd, pty->io_buf, sizeof(pty->io_buf));
-		if (len > 0) {
-			if (pty->input_cb)
-				pty->input_cb(pty, pty->io_buf, len, pty->data);
-		} else if (len == 0) {
-			log_debug("HUP during read on pty of child %d", pty->child);
-			break;
-		} else if (errno != EWOULDBLOCK) {
-			log_debug("cannot read from pty of child %d (%d): %m", pty->child, errno);
-			break;
-		}
-	} while (len > 0 && --num);
+	pty->stats.bytes += len;
+	pty->rate_bytes += len;
 
-	if (!num) {
-		log_debug("cannot read application data fast enough");
+	elapsed = shl_timer_elapsed(&pty->rate_timer);
+	if (elapsed >= 1000000) {
+		pty->stats.bytes_per_sec = pty->rate_bytes * 1000000 / elapsed;
+		pty->rate_bytes = 0;
+		shl_timer_reset(&pty->rate_timer);
+	}
+}
+
+static void record_chunk(struct kmscon_pty *pty, const char *buf, size_t len)
+{
+	struct timespec ts;
+	uint32_t hdr[3];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr[0] = htole32(ts.tv_sec);
+	hdr[1] = htole32(ts.tv_nsec / 1000);
+	hdr[2] = htole32(len);
+	if (fwrite(hdr, sizeof(hdr), 1, pty->record) == 1 &&
+	    fwrite(buf, len, 1, pty->record) == 1)
+		return;
+
+	log_warn("cannot write recording of child %d, stopping it", pty->child);
+	kmscon_pty_set_record(pty, NULL);
+}
 
-		/* We are edge-triggered so update the mask to get the
-		 * EV_READABLE event again next round. */
-		mask = EV_READABLE | EV_ET;
-		if (!shl_ring_is_empty(pty->msgbuf))
-			mask |= EV_WRITEABLE;
-		ev_fd_update(pty->efd, mask);
+static void pty_read(struct ev_reader *rd, const char *buf, ssize_t len, void *data)
+{
+	struct kmscon_pty *pty = data;
+
+	if (len == 0) {
+		log_debug("HUP during read on pty of child %d", pty->child);
+		return;
+	} else if (len < 0) {
+		errno = -len;
+		log_debug("cannot read from pty of child %d (%d): %m", pty->child, errno);
+		return;
 	}
 
-	return 0;
+	if (!pty->reading) {
+		pty->reading = true;
+		pty->busy = false;
+		shl_timer_reset(&pty->slice);
+	}
+
+	account_read(pty, len);
+	if (pty->record)
+		record_chunk(pty, buf, len);
+	if (pty->input_cb)
+		pty->input_cb(pty, buf, len, pty->data);
+
+	if (shl_timer_elapsed(&pty->slice) >= pty->limit || ev_eloop_high_pending(pty->eloop)) {
+		pty->busy = true;
+		++pty->stats.yields;
+		ev_reader_yield(rd);
+	}
 }
 
 static void pty_input(struct ev_fd *fd, int mask, void *data)
@@ -462,7 +671,8 @@ static void pty_input(struct ev_fd *fd, int mask, void *data)
 	 * This gets worse if the client closes the TTY but doesn't exit.
 	 * Therefore, we set the fd as edge-triggered in the epoll-set so we
 	 * only get the events once they change. This has to be taken into
-	 * account at all places of kmscon_pty to avoid missing events. */
+	 * account at all places of kmscon_pty to avoid missing events. The
+	 * reader does the same, so reads are not handled here. */
 
 	if (mask & EV_ERR)
 		log_warn("error on pty socket of child %d", pty->child);
@@ -470,8 +680,6 @@ static void pty_input(struct ev_fd *fd, int mask, void *data)
 		log_debug("HUP on pty of child %d", pty->child);
 	if (mask & EV_WRITEABLE)
 		send_buf(pty);
-	if (mask & EV_READABLE)
-		read_buf(pty);
 }
 
 static void sig_child(struct ev_eloop *eloop, struct ev_child_data *chld, void *data)
@@ -518,14 +726,19 @@ int kmscon_pty_open(struct kmscon_pty *pty, unsigned short width, unsigned short
 		return -errno;
 	}
 
-	ret = ev_eloop_new_fd(pty->eloop, &pty->efd, master, EV_ET | EV_READABLE, pty_input, pty);
+	ret = ev_eloop_new_fd(pty->eloop, &pty->efd, master, EV_ET, pty_input, pty);
 	if (ret)
 		goto err_master;
+	pty->mask = EV_ET;
 
-	ret = ev_eloop_register_child_cb(pty->eloop, sig_child, pty);
+	ret = ev_eloop_new_reader(pty->eloop, &pty->reader, master, KMSCON_NREAD, pty_read, pty);
 	if (ret)
 		goto err_fd;
 
+	ret = ev_eloop_register_child_cb(pty->eloop, sig_child, pty);
+	if (ret)
+		goto err_reader;
+
 	ret = pty_spawn(pty, master, width, height, drm);
 	if (ret)
 		goto err_sig;
@@ -534,6 +747,9 @@ int kmscon_pty_open(struct kmscon_pty *pty, unsigned short width, unsigned short
 
 err_sig:
 	ev_eloop_unregister_child_cb(pty->eloop, sig_child, pty);
+err_reader:
+	ev_eloop_rm_reader(pty->reader);
+	pty->reader = NULL;
 err_fd:
 	ev_eloop_rm_fd(pty->efd);
 	pty->efd = NULL;
@@ -547,11 +763,20 @@ void kmscon_pty_close(struct kmscon_pty *pty)
 	if (!pty || !pty_is_open(pty))
 		return;
 
+	log_debug("closing pty of child %d: read %" PRIu64 " bytes in %" PRIu64
+		  " us, yielded %" PRIu64 " times, throttled %" PRIu64 " times",
+		  pty->child, pty->stats.bytes, pty->stats.usec, pty->stats.yields,
+		  pty->stats.throttles);
+
+	ev_eloop_rm_reader(pty->reader);
+	pty->reader = NULL;
 	ev_eloop_rm_fd(pty->efd);
 	pty->efd = NULL;
 	ev_eloop_unregister_child_cb(pty->eloop, sig_child, pty);
 	close(pty->fd);
 	pty->fd = -1;
+	if (pty->record)
+		fflush(pty->record);
 }
 
 int kmscon_pty_write(struct kmscon_pty *pty, const char *u8, size_t len)
@@ -577,16 +802,44 @@ int kmscon_pty_write(struct kmscon_pty *pty, const char *u8, size_t len)
 		u8 = &u8[ret];
 	}
 
-	ev_fd_update(pty->efd, EV_READABLE | EV_WRITEABLE | EV_ET);
+	pty_set_writeable(pty, true);
 
 buf:
 	ret = shl_ring_write(pty->msgbuf, u8, len);
-	if (ret)
+	if (ret == -ENOBUFS)
+		log_warn("child process doesn't read its input; dropping %zu bytes", len);
+	else if (ret)
 		log_warn("cannot allocate buffer; dropping output");
 
 	return 0;
 }
 
+int kmscon_pty_paste(struct kmscon_pty *pty, const char *u8, size_t len)
+{
+	int ret;
+
+	if (!pty || !pty_is_open(pty) || !u8 || !len)
+		return -EINVAL;
+
+	ret = shl_ring_append(pty->msgbuf, u8, len);
+	if (ret) {
+		log_warn("cannot allocate buffer; dropping paste");
+		return ret;
+	}
+
+	/* sent from the main loop, see send_buf() */
+	pty_set_writeable(pty, true);
+	return 0;
+}
+
+void kmscon_pty_set_write_max(struct kmscon_pty *pty, size_t max)
+{
+	if (!pty)
+		return;
+
+	shl_ring_set_max(pty->msgbuf, max);
+}
+
 void kmscon_pty_signal(struct kmscon_pty *pty, int signum)
 {
 	int ret;
@@ -43,10 +43,27 @@
 #define KMSCON_PTY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 struct kmscon_pty;
 
+struct kmscon_pty_stats {
+	/* total bytes read from the child */
+	uint64_t bytes;
+	/* read throughput over the last second */
+	uint64_t bytes_per_sec;
+	/* number of times we yielded with data left to read */
+	uint64_t yields;
+	/* time spent reading and parsing in us */
+	uint64_t usec;
+	/* number of times the pty used up its share, see kmscon_pty_dispatch() */
+	uint64_t throttles;
+	/* bytes waiting to be written to the child, and the buffer holding them */
+	uint64_t backlog;
+	uint64_t backlog_size;
+};
+
 typedef void (*kmscon_pty_input_cb)(struct kmscon_pty *pty, const char *u8, size_t len, void *data);
 
 int kmscon_pty_new(struct kmscon_pty **out, kmscon_pty_input_cb input_cb, void *data);
@@ -56,13 +73,20 @@ int kmscon_pty_set_conf(struct kmscon_pty *pty, const char *term, const char *co
 			char **argv, const char *seat, unsigned int vtnr, bool do_reset,
 			bool backspace);
 
+int kmscon_pty_set_record(struct kmscon_pty *pty, const char *file);
+
 int kmscon_pty_get_fd(struct kmscon_pty *pty);
-void kmscon_pty_dispatch(struct kmscon_pty *pty);
+uint64_t kmscon_pty_dispatch(struct kmscon_pty *pty);
+void kmscon_pty_set_background(struct kmscon_pty *pty, bool set);
+bool kmscon_pty_is_busy(struct kmscon_pty *pty);
+void kmscon_pty_get_stats(struct kmscon_pty *pty, struct kmscon_pty_stats *out);
 
 int kmscon_pty_open(struct kmscon_pty *pty, unsigned short width, unsigned short height, bool drm);
 void kmscon_pty_close(struct kmscon_pty *pty);
 
 int kmscon_pty_write(struct kmscon_pty *pty, const char *u8, size_t len);
+int kmscon_pty_paste(struct kmscon_pty *pty, const char *u8, size_t len);
+void kmscon_pty_set_write_max(struct kmscon_pty *pty, size_t max);
 void kmscon_pty_signal(struct kmscon_pty *pty, int signum);
 void kmscon_pty_resize(struct kmscon_pty *pty, unsigned short width, unsigned short height);
 
@@ -0,0 +1,246 @@
+/*
+ * shl - Arena and Pool Allocators
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Arena and pool allocators
+ * An arena hands out scratch memory that lives until the next reset, like the
+ * temporary buffers of one frame. Allocations bump a pointer in the current
+ * chunk and a new chunk is only taken from the heap when it is full. A reset
+ * keeps a single chunk that is large enough for everything allocated since the
+ * last one, so once the frames are of a steady size, no more heap memory is
+ * allocated.
+ *
+ * A pool hands out objects of one size, which are freed one by one, like the
+ * glyphs of a cache. Free objects are kept on a list for reuse and the heap is
+ * only asked for a slab of SHL_POOL_SLAB objects when the list is empty.
+ *
+ * Both count how often they allocated from the heap in @allocs, so callers can
+ * check that they don't in the steady state.
+ */
+
+#ifndef SHL_ARENA_H
+#define SHL_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* smallest chunk an arena takes from the heap */
+#define SHL_ARENA_CHUNK 4096
+
+/* objects in each slab of a pool */
+#define SHL_POOL_SLAB 64
+
+/* every allocation is aligned for any type */
+#define SHL_ARENA_ALIGN(_size) (((_size) + 15) & ~(size_t)15)
+
+struct shl_arena_chunk {
+	struct shl_arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(16)));
+};
+
+struct shl_arena {
+	struct shl_arena_chunk *chunk; /* current one, the older ones follow */
+	size_t total;		       /* bytes allocated since the last reset */
+	uint64_t allocs;	       /* chunks taken from the heap */
+};
+
+static inline void shl_arena_init(struct shl_arena *arena)
+{
+	memset(arena, 0, sizeof(*arena));
+}
+
+static inline void shl_arena_free_chunks(struct shl_arena_chunk *chunk)
+{
+	struct shl_arena_chunk *next;
+
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+static inline void shl_arena_deinit(struct shl_arena *arena)
+{
+	shl_arena_free_chunks(arena->chunk);
+	arena->chunk = NULL;
+	arena->total = 0;
+}
+
+/* returns @size bytes that stay valid until the next reset, or NULL */
+static inline void *shl_arena_alloc(struct shl_arena *arena, size_t size)
+{
+	struct shl_arena_chunk *chunk = arena->chunk;
+	size_t chunk_size;
+	void *ret;
+
+	size = SHL_ARENA_ALIGN(size);
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = SHL_ARENA_CHUNK;
+		if (chunk && chunk_size < chunk->size * 2)
+			chunk_size = chunk->size * 2;
+		if (chunk_size < size)
+			chunk_size = size;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->chunk;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunk = chunk;
+		++arena->allocs;
+	}
+
+	ret = &chunk->data[chunk->used];
+	chunk->used += size;
+	arena->total += size;
+	return ret;
+}
+
+static inline void *shl_arena_zalloc(struct shl_arena *arena, size_t size)
+{
+	void *ret;
+
+	ret = shl_arena_alloc(arena, size);
+	if (ret)
+		memset(ret, 0, size);
+	return ret;
+}
+
+/* frees everything allocated since the last reset */
+static inline void shl_arena_reset(struct shl_arena *arena)
+{
+	struct shl_arena_chunk *chunk = arena->chunk;
+
+	if (!chunk)
+		return;
+
+	/* the memory of this round didn't fit into one chunk; drop them all
+	 * and make the next one large enough for it */
+	if (chunk->next) {
+		shl_arena_free_chunks(chunk);
+		arena->chunk = NULL;
+		chunk = malloc(sizeof(*chunk) + arena->total);
+		if (chunk) {
+			chunk->next = NULL;
+			chunk->size = arena->total;
+			arena->chunk = chunk;
+			++arena->allocs;
+		}
+	}
+
+	if (chunk)
+		chunk->used = 0;
+	arena->total = 0;
+}
+
+struct shl_pool_slab {
+	struct shl_pool_slab *next;
+	uint8_t data[] __attribute__((aligned(16)));
+};
+
+struct shl_pool {
+	size_t size;		     /* of each object */
+	struct shl_pool_slab *slabs;
+	void *free;		     /* list of free objects, linked through them */
+	uint64_t allocs;	     /* slabs taken from the heap */
+};
+
+static inline void shl_pool_init(struct shl_pool *pool, size_t size)
+{
+	memset(pool, 0, sizeof(*pool));
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	pool->size = SHL_ARENA_ALIGN(size);
+}
+
+static inline void shl_pool_deinit(struct shl_pool *pool)
+{
+	struct shl_pool_slab *slab, *next;
+
+	for (slab = pool->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	pool->slabs = NULL;
+	pool->free = NULL;
+}
+
+/* puts all objects of all slabs back on the free list */
+static inline void shl_pool_clear(struct shl_pool *pool)
+{
+	struct shl_pool_slab *slab;
+	unsigned int i;
+	void *obj;
+
+	pool->free = NULL;
+	for (slab = pool->slabs; slab; slab = slab->next) {
+		for (i = 0; i < SHL_POOL_SLAB; ++i) {
+			obj = &slab->data[i * pool->size];
+			*(void **)obj = pool->free;
+			pool->free = obj;
+		}
+	}
+}
+
+/* returns an uninitialized object, or NULL */
+static inline void *shl_pool_alloc(struct shl_pool *pool)
+{
+	struct shl_pool_slab *slab;
+	unsigned int i;
+	void *obj;
+
+	if (!pool->free) {
+		slab = malloc(sizeof(*slab) + SHL_POOL_SLAB * pool->size);
+		if (!slab)
+			return NULL;
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		++pool->allocs;
+
+		for (i = 0; i < SHL_POOL_SLAB; ++i) {
+			obj = &slab->data[i * pool->size];
+			*(void **)obj = pool->free;
+			pool->free = obj;
+		}
+	}
+
+	obj = pool->free;
+	pool->free = *(void **)obj;
+	return obj;
+}
+
+static inline void shl_pool_free(struct shl_pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	*(void **)obj = pool->free;
+	pool->free = obj;
+}
+
+#endif /* SHL_ARENA_H */
@@ -75,6 +75,9 @@ struct gl_shader;
 
 int gl_shader_new(struct gl_shader **out, const char *vert, int vert_len, const char *frag,
 		  int frag_len, char **attr, size_t attr_count);
+int gl_shader_new_cached(struct gl_shader **out, const char *cache_dir, const char *vert,
+			 int vert_len, const char *frag, int frag_len, char **attr,
+			 size_t attr_count);
 void gl_shader_ref(struct gl_shader *shader);
 void gl_shader_unref(struct gl_shader *shader);
 GLuint gl_shader_get_uniform(struct gl_shader *shader, const char *name);
@@ -27,6 +27,14 @@
  * Shader API
  * This provides basic shader objects that are used to draw sprites and
  * textures.
+ *
+ * Compiling and linking the shaders takes hundreds of milliseconds on some
+ * embedded GPUs. With GL_OES_get_program_binary, gl_shader_new_cached() saves
+ * the linked program in a cache directory and loads it from there on the next
+ * start. The file is keyed by the GL vendor, renderer and version strings and
+ * the shader sources, so a driver update or a changed shader never loads a
+ * stale binary. Drivers may still reject a binary, then the shaders are
+ * compiled as usual and the file is replaced.
  */
 
 #define GL_GLEXT_PROTOTYPES
@@ -34,12 +42,22 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "shl_gl.h"
 #include "shl_log.h"
 
+#ifdef BUILD_ENABLE_VIDEO_DRM3D
+#include <EGL/egl.h>
+#endif
+
 #define LOG_SUBSYSTEM "gl_shader"
 
 struct gl_shader {
@@ -103,6 +121,224 @@ bool gl_has_error(struct gl_shader *shader)
 	return false;
 }
 
+#define CACHE_MAGIC "KMSHADER"
+#define CACHE_MAX_SIZE (16 * 1024 * 1024)
+
+struct cache_header {
+	char magic[8];
+	uint64_t key;
+	uint32_t format;
+	uint32_t size;
+};
+
+/*
+ * The OES entry points are not exported by every libGLESv2, so they are looked
+ * up through EGL. Without EGL, there is no context to load binaries into
+ * either, so the cache is simply disabled then.
+ */
+static PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+static PFNGLPROGRAMBINARYOESPROC program_binary;
+
+/* checked for the current context, every GPU may have a different driver */
+static bool cache_supported(void)
+{
+	const char *ext;
+	GLint num = 0;
+
+	ext = (const char *)glGetString(GL_EXTENSIONS);
+	if (!ext || !strstr(ext, "GL_OES_get_program_binary"))
+		return false;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num);
+	gl_clear_error();
+	if (num <= 0)
+		return false;
+
+#ifdef BUILD_ENABLE_VIDEO_DRM3D
+	if (!get_program_binary)
+		get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress(
+			"glGetProgramBinaryOES");
+	if (!program_binary)
+		program_binary =
+			(PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+#endif
+
+	return get_program_binary && program_binary;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static uint64_t fnv1a_str(uint64_t h, const char *str)
+{
+	if (!str)
+		str = "";
+	return fnv1a(h, str, strlen(str) + 1);
+}
+
+static uint64_t cache_key(const char *vert, int vert_len, const char *frag, int frag_len,
+			  char **attr, size_t attr_count)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	h = fnv1a_str(h, (const char *)glGetString(GL_VENDOR));
+	h = fnv1a_str(h, (const char *)glGetString(GL_RENDERER));
+	h = fnv1a_str(h, (const char *)glGetString(GL_VERSION));
+	h = fnv1a(h, &vert_len, sizeof(vert_len));
+	h = fnv1a(h, vert, vert_len);
+	h = fnv1a(h, &frag_len, sizeof(frag_len));
+	h = fnv1a(h, frag, frag_len);
+	for (i = 0; i < attr_count; ++i)
+		h = fnv1a_str(h, attr[i]);
+
+	return h;
+}
+
+static void cache_path(char *buf, size_t size, const char *dir, uint64_t key, const char *suffix)
+{
+	snprintf(buf, size, "%s/%016" PRIx64 ".program%s", dir, key, suffix);
+}
+
+/* returns the linked program or GL_NONE if there is no usable binary */
+static GLuint cache_load(const char *dir, uint64_t key)
+{
+	char path[PATH_MAX];
+	struct cache_header hdr;
+	void *bin;
+	GLuint program;
+	GLint status = 0;
+	FILE *f;
+
+	cache_path(path, sizeof(path), dir, key, "");
+	f = fopen(path, "rbe");
+	if (!f) {
+		if (errno != ENOENT)
+			log_warning("cannot open shader cache %s (%d): %m", path, errno);
+		return GL_NONE;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) || hdr.key != key || !hdr.size ||
+	    hdr.size > CACHE_MAX_SIZE) {
+		log_warning("ignoring invalid shader cache %s", path);
+		fclose(f);
+		return GL_NONE;
+	}
+
+	bin = malloc(hdr.size);
+	if (!bin) {
+		fclose(f);
+		return GL_NONE;
+	}
+
+	if (fread(bin, hdr.size, 1, f) != 1) {
+		log_warning("ignoring truncated shader cache %s", path);
+		free(bin);
+		fclose(f);
+		return GL_NONE;
+	}
+	fclose(f);
+
+	program = glCreateProgram();
+	program_binary(program, hdr.format, bin, hdr.size);
+	free(bin);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		log_debug("driver rejected shader cache %s", path);
+		glDeleteProgram(program);
+		gl_clear_error();
+		return GL_NONE;
+	}
+
+	log_debug("loaded shader program from %s", path);
+	return program;
+}
+
+/* write to a temporary file first so a crash never leaves a partial binary */
+static void cache_save(const char *dir, uint64_t key, GLuint program)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct cache_header hdr;
+	GLint len = 0;
+	GLsizei size = 0;
+	GLenum format = 0;
+	void *bin;
+	FILE *f;
+	int fd;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &len);
+	if (len <= 0 || len > CACHE_MAX_SIZE) {
+		gl_clear_error();
+		return;
+	}
+
+	bin = malloc(len);
+	if (!bin)
+		return;
+
+	get_program_binary(program, len, &size, &format, bin);
+	if (glGetError() != GL_NO_ERROR || size <= 0 || size > len) {
+		gl_clear_error();
+		goto out;
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		log_warning("cannot create shader cache directory %s (%d): %m", dir, errno);
+		goto out;
+	}
+
+	cache_path(path, sizeof(path), dir, key, "");
+	cache_path(tmp, sizeof(tmp), dir, key, ".tmp");
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_warning("cannot create shader cache %s (%d): %m", tmp, errno);
+		goto out;
+	}
+
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		goto err_unlink;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.key = key;
+	hdr.format = format;
+	hdr.size = size;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(bin, size, 1, f);
+
+	if (ferror(f) | fclose(f)) {
+		log_warning("cannot write shader cache %s", tmp);
+		goto err_unlink;
+	}
+
+	if (rename(tmp, path)) {
+		log_warning("cannot rename shader cache %s (%d): %m", tmp, errno);
+		goto err_unlink;
+	}
+
+	log_debug("saved shader program to %s", path);
+	goto out;
+
+err_unlink:
+	unlink(tmp);
+out:
+	free(bin);
+}
+
 static int compile_shader(struct gl_shader *shader, GLenum type, const char *source, int len)
 {
 	char msg[512];
@@ -132,11 +368,20 @@ static int compile_shader(struct gl_shader *shader, GLenum type, const char *sou
 
 int gl_shader_new(struct gl_shader **out, const char *vert, int vert_len, const char *frag,
 		  int frag_len, char **attr, size_t attr_count)
+{
+	return gl_shader_new_cached(out, NULL, vert, vert_len, frag, frag_len, attr, attr_count);
+}
+
+/* like gl_shader_new() but keeps the linked program in @cache_dir if not NULL */
+int gl_shader_new_cached(struct gl_shader **out, const char *cache_dir, const char *vert,
+			 int vert_len, const char *frag, int frag_len, char **attr,
+			 size_t attr_count)
 {
 	struct gl_shader *shader;
 	int ret, i;
 	char msg[512];
 	GLint status = 1;
+	uint64_t key = 0;
 
 	if (!out || !vert || !frag)
 		return -EINVAL;
@@ -149,6 +394,18 @@ int gl_shader_new(struct gl_shader **out, const char *vert, int vert_len, const
 
 	log_debug("new shader");
 
+	if (cache_dir && !cache_supported())
+		cache_dir = NULL;
+
+	if (cache_dir) {
+		key = cache_key(vert, vert_len, frag, frag_len, attr, attr_count);
+		shader->program = cache_load(cache_dir, key);
+		if (shader->program != GL_NONE) {
+			*out = shader;
+			return 0;
+		}
+	}
+
 	shader->vshader = compile_shader(shader, GL_VERTEX_SHADER, vert, vert_len);
 	if (shader->vshader == GL_NONE) {
 		ret = -EFAULT;
@@ -184,6 +441,9 @@ int gl_shader_new(struct gl_shader **out, const char *vert, int vert_len, const
 		goto err_link;
 	}
 
+	if (cache_dir)
+		cache_save(cache_dir, key, shader->program);
+
 	*out = shader;
 	return 0;
 
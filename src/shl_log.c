@@ -6,26 +6,33 @@
 
 /*
  * Log/Debug API Implementation
- * We provide thread-safety so we need a global lock. Function which
- * are prefixed with log__* need the lock to be held. All other functions must
- * be called without the lock held.
+ * Every thread formats its messages itself. Once log_start_writer() was
+ * called, it queues them in its own lock-free ring and a background thread
+ * writes them to stderr, so a slow or blocked log reader never stalls the
+ * caller. Before that, or if the writer cannot be started, messages are
+ * written directly with a single write() each.
  */
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 #include "shl_githead.h"
 #include "shl_log.h"
 #include "shl_misc.h"
 
 /*
  * Locking
- * We need a global locking mechanism. Use pthread here.
+ * The lock protects the configuration, the list of rings and the sleep of the
+ * writer. Messages are queued without it.
  */
 
 static pthread_mutex_t log__mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -46,118 +53,382 @@ static inline void log_unlock()
  * log-message.
  */
 
-static struct timeval log__ftime;
+static long long log__ftime;
 
-static void log__time(long long *sec, long long *usec)
+static long long log__now(void)
 {
-	struct timeval t;
-
-	if (log__ftime.tv_sec == 0 && log__ftime.tv_usec == 0) {
-		gettimeofday(&log__ftime, NULL);
-		*sec = 0;
-		*usec = 0;
-	} else {
-		gettimeofday(&t, NULL);
-		*sec = t.tv_sec - log__ftime.tv_sec;
-		*usec = (long long)t.tv_usec - (long long)log__ftime.tv_usec;
-		if (*usec < 0) {
-			*sec -= 1;
-			*usec = 1000000 + *usec;
-		}
-	}
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* microseconds since the first log-message */
+static long long log__time(void)
+{
+	long long first = 0, now = log__now();
+
+	if (!__atomic_compare_exchange_n(&log__ftime, &first, now, false, __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED))
+		return now - first;
+	return 0;
 }
 
 const char *LOG_SUBSYSTEM = NULL;
 
+/* default log-subsystem for all logging inside this API */
+#define LOG_SUBSYSTEM "log"
+
 /*
  * Filters
- * By default DEBUG and INFO messages are disabled. If LOG_ENABLE_DEBUG is not
- * defined, then all log_debug() statements compile to zero-code and they cannot
- * be enabled on runtime.
- * To enable DEBUG or INFO messages at runtime, you can either specify that they
- * should be enabled globally, per file or specify a custom filter. Other
- * messages than DEBUG and INFO cannot be configured. However, additional
- * configuration options may be added later.
- *
- * Use log_set_config() to enable debug/info messages globally. If you
- * enable a global message type, then all other filters are skipped. If you
- * disable a global message type then fine-grained filters can take effect.
- *
- * To enable DEBUG/INFO messages for a specific source-file, you can add
- * this line to the top of the source file:
- *   #define LOG_CONFIG LOG_STATIC_CONFIG(true, true)
- * So info and debug messages are enabled for this file on compile-time. First
- * parameter of LOG_STATIC_CONFIG is for debug, second one for info.
+ * By default DEBUG and INFO messages are disabled. Messages less severe than
+ * LOG_SEV_FLOOR compile to zero-code and they cannot be enabled on runtime.
+ * Unless changed, that are all log_debug() statements if BUILD_ENABLE_DEBUG is
+ * not defined.
  *
- * Or you can add new configurations on runtime. Runtime configurations take a
- * filter parameter and a config parameter. The filter specifies what messages
- * are affected and the config parameter specifies what action is performed.
+ * Use log_set_config() to enable debug/info messages globally. The result is
+ * kept as a bitmask of enabled severities, which log_enabled() checks before
+ * the arguments of a message are even evaluated.
  */
 
-static struct log_config log__gconfig = {.sev = {
-						 [LOG_DEBUG] = 0,
-						 [LOG_INFO] = 0,
-						 [LOG_NOTICE] = 1,
-						 [LOG_WARNING] = 1,
-						 [LOG_ERROR] = 1,
-						 [LOG_CRITICAL] = 1,
-						 [LOG_ALERT] = 1,
-						 [LOG_FATAL] = 1,
-					 }};
-
-struct log_dynconf {
-	struct log_dynconf *next;
-	int handle;
-	struct log_config config;
-};
+SHL_EXPORT
+unsigned int log__enabled = (1U << LOG_NOTICE) | (1U << LOG_WARNING) | (1U << LOG_ERROR) |
+			    (1U << LOG_CRITICAL) | (1U << LOG_ALERT) | (1U << LOG_FATAL);
 
 void log_set_config(const struct log_config *config)
 {
+	unsigned int i, mask = 0;
+
 	if (!config)
 		return;
 
+	for (i = 0; i < LOG_SEV_NUM; ++i) {
+		if (config->sev[i])
+			mask |= 1U << i;
+	}
+
 	log_lock();
-	log__gconfig = *config;
+	__atomic_store_n(&log__enabled, mask, __ATOMIC_RELAXED);
 	log_unlock();
 }
 
-static bool log__omit(const char *file, int line, const char *func, const char *subs,
-		      enum log_severity sev)
+/*
+ * Rings
+ * Every thread that logs while the writer runs gets a ring. The thread is the
+ * only producer and the writer the only consumer, so head and tail are enough
+ * to share it. If a ring is full, messages are dropped and counted instead of
+ * waiting for the writer. The writer reports the number later.
+ * Rings are prepended to the global list under the lock and only the writer
+ * unlinks them, once their thread exited and they are drained.
+ * A thread marks its ring busy before it checks that the writer runs and
+ * clears it once the message is queued. log_stop_writer() waits for the busy
+ * rings before it drains them itself, so it is the only consumer by then.
+ */
+
+#define LOG_LINE_MAX 1024
+#define LOG_RING_SIZE (64 * 1024)
+
+struct log_ring {
+	struct log_ring *next;
+	char buf[LOG_RING_SIZE];
+	size_t head;
+	size_t tail;
+	unsigned int dropped;
+	bool dead;
+	bool busy; /* the thread is queueing a message */
+};
+
+static struct log_ring *log__rings;
+static __thread struct log_ring *log__ring;
+static pthread_key_t log__key;
+static pthread_cond_t log__cond = PTHREAD_COND_INITIALIZER;
+static pthread_t log__thread;
+static bool log__running;
+static bool log__sleeping;
+static bool log__stop;
+
+static void log__write(const char *buf, size_t len)
+{
+	ssize_t l;
+
+	while (len) {
+		l = write(STDERR_FILENO, buf, len);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			return;
+		buf += l;
+		len -= l;
+	}
+}
+
+/* write both parts of a ring in one go if possible */
+static void log__writev(struct iovec *vec, int num)
 {
-	int val;
+	ssize_t l;
+
+	do {
+		l = writev(STDERR_FILENO, vec, num);
+	} while (l < 0 && errno == EINTR);
+	if (l < 0)
+		return;
+
+	/* on short writes, drop what stderr refuses like the direct path does */
+	for (; num; --num, ++vec) {
+		if ((size_t)l < vec->iov_len) {
+			log__write((char *)vec->iov_base + l, vec->iov_len - l);
+			l = 0;
+		} else {
+			l -= vec->iov_len;
+		}
+	}
+}
 
-	if (sev >= LOG_SEV_NUM)
+static void log__ring_exit(void *data)
+{
+	struct log_ring *ring = data;
+
+	__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *log__ring_get(void)
+{
+	struct log_ring *ring = log__ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	log_lock();
+	ring->next = log__rings;
+	log__rings = ring;
+	log_unlock();
+
+	pthread_setspecific(log__key, ring);
+	log__ring = ring;
+	return ring;
+}
+
+/* queue @len bytes, returns false if the writer is not running */
+static bool log__queue(const char *buf, size_t len)
+{
+	struct log_ring *ring;
+	size_t head, tail, pos, n;
+
+	if (!__atomic_load_n(&log__running, __ATOMIC_ACQUIRE))
 		return false;
 
-	val = log__gconfig.sev[sev];
-	if (val == 0)
-		return true;
-	if (val == 1)
+	ring = log__ring_get();
+	if (!ring)
 		return false;
 
+	/* pairs with log_stop_writer(), which clears log__running first */
+	__atomic_store_n(&ring->busy, true, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&log__running, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&ring->busy, false, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (LOG_RING_SIZE - (head - tail) < len) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&ring->busy, false, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	pos = head & (LOG_RING_SIZE - 1);
+	n = LOG_RING_SIZE - pos;
+	if (n > len)
+		n = len;
+	memcpy(&ring->buf[pos], buf, n);
+	memcpy(ring->buf, buf + n, len - n);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ring->busy, false, __ATOMIC_RELEASE);
+
+	/* pairs with the check of log__writer() before it sleeps */
+	if (__atomic_load_n(&log__sleeping, __ATOMIC_SEQ_CST)) {
+		log_lock();
+		pthread_cond_signal(&log__cond);
+		log_unlock();
+	}
+
+	return true;
+}
+
+static bool log__pending(void)
+{
+	struct log_ring *ring;
+
+	for (ring = log__rings; ring; ring = ring->next) {
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail ||
+		    __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED))
+			return true;
+	}
+
 	return false;
 }
 
-/*
- * Forward declaration so we can use the locked-versions in other functions
- * here. Be careful to avoid deadlocks, though.
- * Also set default log-subsystem to "log" for all logging inside this API.
- */
+static __attribute__((format(printf, 7, 8))) size_t
+log__linef(char *buf, const char *file, int line, const char *func, const char *subs,
+	   unsigned int sev, const char *format, ...);
 
-static void log__submit(const char *file, int line, const char *func, const char *subs,
-			unsigned int sev, const char *format, va_list args);
+/* write out what is queued in @ring, returns true if there was something */
+static bool log__drain(struct log_ring *ring)
+{
+	char note[LOG_LINE_MAX];
+	struct iovec vec[2];
+	size_t head, tail, pos, len;
+	unsigned int dropped;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	len = head - tail;
+	if (len) {
+		pos = tail & (LOG_RING_SIZE - 1);
+		vec[0].iov_base = &ring->buf[pos];
+		vec[0].iov_len = LOG_RING_SIZE - pos < len ? LOG_RING_SIZE - pos : len;
+		vec[1].iov_base = ring->buf;
+		vec[1].iov_len = len - vec[0].iov_len;
+		log__writev(vec, vec[1].iov_len ? 2 : 1);
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	}
 
-#define LOG_SUBSYSTEM "log"
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		log__write(note, log__linef(note, LOG_DEFAULT, LOG_WARNING,
+					    "log writer too slow, dropped %u messages\n", dropped));
+
+	return len || dropped;
+}
+
+static void *log__writer(void *data)
+{
+	struct log_ring *ring, **iter;
+	bool busy;
+
+	log_lock();
+	for (;;) {
+		/* new rings are prepended, so this part of the list is stable */
+		ring = log__rings;
+		log_unlock();
+
+		busy = false;
+		for (; ring; ring = ring->next)
+			busy |= log__drain(ring);
+
+		log_lock();
+		if (busy)
+			continue;
+
+		/* free rings of exited threads */
+		for (iter = &log__rings; *iter;) {
+			ring = *iter;
+			if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+				*iter = ring->next;
+				free(ring);
+			} else {
+				iter = &ring->next;
+			}
+		}
+
+		if (log__stop)
+			break;
+
+		__atomic_store_n(&log__sleeping, true, __ATOMIC_SEQ_CST);
+		if (!log__pending())
+			pthread_cond_wait(&log__cond, &log__mutex);
+		__atomic_store_n(&log__sleeping, false, __ATOMIC_SEQ_CST);
+	}
+	log_unlock();
+
+	return NULL;
+}
+
+/* a forked child has no writer, it logs directly */
+static void log__atfork_child(void)
+{
+	log__running = false;
+	log__ring = NULL;
+}
+
+SHL_EXPORT
+int log_start_writer(void)
+{
+	static bool once;
+	sigset_t all, old;
+	int ret;
+
+	if (__atomic_load_n(&log__running, __ATOMIC_ACQUIRE))
+		return 0;
+
+	if (!once) {
+		ret = pthread_key_create(&log__key, log__ring_exit);
+		if (ret)
+			return -ret;
+		pthread_atfork(NULL, NULL, log__atfork_child);
+		atexit(log_stop_writer);
+		once = true;
+	}
+
+	/* signals are for the threads that handle them, see signalfd */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	log__stop = false;
+	ret = pthread_create(&log__thread, NULL, log__writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret)
+		return -ret;
+
+	__atomic_store_n(&log__running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+SHL_EXPORT
+void log_stop_writer(void)
+{
+	struct log_ring *ring;
+
+	if (!__atomic_load_n(&log__running, __ATOMIC_ACQUIRE))
+		return;
+
+	/* log directly from now on, the writer drains what's queued */
+	__atomic_store_n(&log__running, false, __ATOMIC_SEQ_CST);
+
+	log_lock();
+	log__stop = true;
+	pthread_cond_signal(&log__cond);
+	log_unlock();
+
+	pthread_join(log__thread, NULL);
+
+	/*
+	 * Catch messages queued while we stopped. Threads that saw the writer
+	 * running may still be queueing, wait for them. Rings added from now on
+	 * stay empty.
+	 */
+	log_lock();
+	ring = log__rings;
+	log_unlock();
+	for (; ring; ring = ring->next) {
+		while (__atomic_load_n(&ring->busy, __ATOMIC_SEQ_CST))
+			sched_yield();
+		log__drain(ring);
+	}
+}
 
 /*
  * Basic logger
- * The log__submit function writes the message into the current log-target. It
- * must be called with log__mutex locked.
- * log__format does the same but first converts the argument list into a
- * va_list.
+ * log__vline formats a message into a buffer of LOG_LINE_MAX bytes and returns
+ * its length. Messages that don't fit are truncated. log__submit hands it to
+ * the writer or writes it directly, it must be called without log__mutex held.
  * By default the current time elapsed since the first message was logged is
  * prepended to the message. file, line and func information are appended to the
- * message if sev == LOG_DEBUG.
+ * message if it doesn't end with a newline.
  * The subsystem, if not NULL, is prepended as "SUBS: " to the message and a
  * newline is always appended by default. Multiline-messages are not allowed and
  * do not make sense here.
@@ -169,40 +440,55 @@ static const char *log__sev2str[] = {
 	[LOG_ALERT] = "ALERT",	   [LOG_FATAL] = "FATAL",
 };
 
-static void log__submit(const char *file, int line, const char *func, const char *subs,
-			unsigned int sev, const char *format, va_list args)
+/* append to @buf of LOG_LINE_MAX bytes that holds @len bytes so far */
+static __attribute__((format(printf, 3, 0))) size_t log__vappend(char *buf, size_t len,
+								  const char *format,
+								  va_list args)
 {
-	const char *prefix = NULL;
-	FILE *out;
-	long long sec, usec;
-	bool nl;
-	size_t len;
+	int n;
 
-	if (log__omit(file, line, func, subs, sev))
-		return;
+	if (len >= LOG_LINE_MAX - 1)
+		return len;
+
+	n = vsnprintf(&buf[len], LOG_LINE_MAX - len, format, args);
+	if (n < 0)
+		return len;
+	len += n;
+	return len < LOG_LINE_MAX - 1 ? len : LOG_LINE_MAX - 1;
+}
+
+static __attribute__((format(printf, 3, 4))) size_t log__append(char *buf, size_t len,
+								 const char *format, ...)
+{
+	va_list args;
 
-	out = stderr;
+	va_start(args, format);
+	len = log__vappend(buf, len, format, args);
+	va_end(args);
+	return len;
+}
 
-	log__time(&sec, &usec);
+static __attribute__((format(printf, 7, 0))) size_t
+log__vline(char *buf, const char *file, int line, const char *func, const char *subs,
+	   unsigned int sev, const char *format, va_list args)
+{
+	const char *prefix = NULL;
+	long long time;
+	size_t len, flen;
+	bool nl;
 
+	time = log__time();
 	if (sev < LOG_SEV_NUM)
 		prefix = log__sev2str[sev];
 
-	if (prefix) {
-		if (subs)
-			fprintf(out, "[%.4lld.%.6lld] %s: %s: ", sec, usec, prefix, subs);
-		else
-			fprintf(out, "[%.4lld.%.6lld] %s: ", sec, usec, prefix);
-	} else {
-		if (subs)
-			fprintf(out, "[%.4lld.%.6lld] %s: ", sec, usec, subs);
-		else
-			fprintf(out, "[%.4lld.%.6lld] ", sec, usec);
-	}
-
-	len = strlen(format);
-	nl = format[len - 1] == '\n';
+	len = log__append(buf, 0, "[%.4lld.%.6lld] ", time / 1000000, time % 1000000);
+	if (prefix)
+		len = log__append(buf, len, "%s: ", prefix);
+	if (subs)
+		len = log__append(buf, len, "%s: ", subs);
 
+	flen = strlen(format);
+	nl = flen && format[flen - 1] == '\n';
 	if (!func)
 		func = "<unknown>";
 	if (!file)
@@ -210,10 +496,41 @@ static void log__submit(const char *file, int line, const char *func, const char
 	if (line < 0)
 		line = 0;
 
-	vfprintf(out, format, args);
-
+	len = log__vappend(buf, len, format, args);
 	if (!nl)
-		fprintf(out, " (%s() in %s:%d)\n", func, file, line);
+		len = log__append(buf, len, " (%s() in %s:%d)\n", func, file, line);
+
+	/* keep the newline of truncated messages */
+	if (len == LOG_LINE_MAX - 1)
+		buf[len - 1] = '\n';
+
+	return len;
+}
+
+static size_t log__linef(char *buf, const char *file, int line, const char *func,
+			 const char *subs, unsigned int sev, const char *format, ...)
+{
+	va_list args;
+	size_t len;
+
+	va_start(args, format);
+	len = log__vline(buf, file, line, func, subs, sev, format, args);
+	va_end(args);
+	return len;
+}
+
+static void log__submit(const char *file, int line, const char *func, const char *subs,
+			unsigned int sev, const char *format, va_list args)
+{
+	char buf[LOG_LINE_MAX];
+	size_t len;
+
+	if (!log_enabled(sev))
+		return;
+
+	len = log__vline(buf, file, line, func, subs, sev, format, args);
+	if (!log__queue(buf, len))
+		log__write(buf, len);
 }
 
 SHL_EXPORT
@@ -222,10 +539,7 @@ void log_submit(const char *file, int line, const char *func, const char *subs,
 {
 	int saved_errno = errno;
 
-	log_lock();
 	log__submit(file, line, func, subs, sev, format, args);
-	log_unlock();
-
 	errno = saved_errno;
 }
 
@@ -237,9 +551,51 @@ void log_format(const char *file, int line, const char *func, const char *subs,
 	int saved_errno = errno;
 
 	va_start(list, format);
-	log_lock();
 	log__submit(file, line, func, subs, sev, format, list);
-	log_unlock();
+	va_end(list);
+
+	errno = saved_errno;
+}
+
+/*
+ * Rate limits
+ * Every log_printf() call site may log LOG_RATE_BURST messages per
+ * LOG_RATE_INTERVAL microseconds. The rest is counted and the count reported
+ * with the first message of the next interval. Call sites are shared by all
+ * threads without locking, which can only blur the limit a bit.
+ */
+
+#define LOG_RATE_INTERVAL 5000000LL
+#define LOG_RATE_BURST 50
+
+SHL_EXPORT
+void log_site_format(struct log_site *site, const char *file, int line, const char *func,
+		     const char *subs, unsigned int sev, const char *format, ...)
+{
+	va_list list;
+	unsigned int missed = 0;
+	long long now;
+	int saved_errno = errno;
+
+	now = log__now();
+	if (!site->begin || now - site->begin >= LOG_RATE_INTERVAL) {
+		missed = site->missed;
+		site->begin = now;
+		site->num = 0;
+		site->missed = 0;
+	}
+
+	if (site->num >= LOG_RATE_BURST) {
+		++site->missed;
+		return;
+	}
+	++site->num;
+
+	if (missed)
+		log_format(file, line, func, subs, sev, "%u similar messages suppressed", missed);
+
+	va_start(list, format);
+	log__submit(file, line, func, subs, sev, format, list);
 	va_end(list);
 
 	errno = saved_errno;
@@ -19,7 +19,8 @@
  * filtered.
  *
  * Define BUILD_ENABLE_DEBUG before including this header to enable
- * debug-messages for this file.
+ * debug-messages for this file. Define LOG_SEV_FLOOR to pick a different
+ * least severe level that is compiled in at all.
  */
 
 #ifndef SHL_LOG_H_INCLUDED
@@ -131,6 +132,16 @@ struct log_config {
 
 void log_set_config(const struct log_config *config);
 
+/* bitmask of enabled severities, only written by log_set_config() */
+extern unsigned int log__enabled;
+
+static inline bool log_enabled(unsigned int sev)
+{
+	if (sev >= LOG_SEV_NUM)
+		return true;
+	return __atomic_load_n(&log__enabled, __ATOMIC_RELAXED) & (1U << sev);
+}
+
 /*
  * Log-Functions
  * These functions pass a log-message to the log-subsystem. Handy helpers are
@@ -143,10 +154,26 @@ void log_set_config(const struct log_config *config);
  * log_format:
  * Same as log_submit but first converts the arguments into a va_list object.
  *
+ * log_site_format:
+ * Same as log_format but rate-limited per call site. \site must be a static
+ * object that is only used by a single call site. This is what log_printf()
+ * uses.
+ *
  * log_llog:
  * Same as log_submit but used as connection to llog. It uses the default config
  * for every message.
  *
+ * log_start_writer():
+ * Starts a background thread that writes all messages. Afterwards, logging
+ * threads only copy their messages into a per-thread ring and never block on
+ * stderr. If a ring is full, messages are dropped and counted. Returns 0 on
+ * success or a negative error code, in which case messages are still written
+ * directly.
+ *
+ * log_stop_writer():
+ * Writes all queued messages and stops the writer thread. This is also called
+ * on exit().
+ *
  * log_set_file(file):
  * This opens the file specified by \file and redirects all new messages to this
  * file. If \file is NULL, then the default is used which is stderr.
@@ -163,6 +190,12 @@ void log_set_config(const struct log_config *config);
  * some log-message at application start. This is a handy-helper to do this.
  */
 
+struct log_site {
+	long long begin;
+	unsigned int num;
+	unsigned int missed;
+};
+
 __attribute__((format(printf, 6, 0))) void log_submit(const char *file, int line, const char *func,
 						      const char *subs, unsigned int sev,
 						      const char *format, va_list args);
@@ -176,6 +209,14 @@ __attribute__((format(printf, 7, 0))) void log_llog(void *data, const char *file
 						    unsigned int sev, const char *format,
 						    va_list args);
 
+__attribute__((format(printf, 7, 8))) void log_site_format(struct log_site *site, const char *file,
+							     int line, const char *func,
+							     const char *subs, unsigned int sev,
+							     const char *format, ...);
+
+int log_start_writer(void);
+void log_stop_writer(void);
+
 void log_print_init(const char *appname);
 
 static inline __attribute__((format(printf, 2, 3))) void log_dummyf(unsigned int sev,
@@ -210,7 +251,9 @@ static inline __attribute__((format(printf, 2, 3))) void log_dummyf(unsigned int
  *              LOG_ERROR, "your format string: %s %d", "some args", 5, ...);
  *
  * log_printf is the same as log_format(LOG_DEFAULT, sev, format, ...) and is
- * the most basic wrapper that you can use.
+ * the most basic wrapper that you can use. It is rate-limited per call site,
+ * checks the filters before evaluating any argument and compiles to zero-code
+ * for severities below LOG_SEV_FLOOR.
  */
 
 #ifndef LOG_CONFIG
@@ -224,7 +267,21 @@ extern const char *LOG_SUBSYSTEM;
 #define LOG_DEFAULT_BASE __FILE__, __LINE__, __func__
 #define LOG_DEFAULT LOG_DEFAULT_BASE, LOG_SUBSYSTEM
 
-#define log_printf(sev, format, ...) log_format(LOG_DEFAULT, (sev), (format), ##__VA_ARGS__)
+#ifndef LOG_SEV_FLOOR
+#ifdef BUILD_ENABLE_DEBUG
+#define LOG_SEV_FLOOR LOG_DEBUG
+#else
+#define LOG_SEV_FLOOR LOG_INFO
+#endif
+#endif
+
+#define log_printf(sev, format, ...)                                                               \
+	do {                                                                                       \
+		static struct log_site log__site;                                                  \
+		if ((sev) <= LOG_SEV_FLOOR && log_enabled(sev))                                    \
+			log_site_format(&log__site, LOG_DEFAULT, (sev), (format),                  \
+					##__VA_ARGS__);                                            \
+	} while (0)
 
 /*
  * Helpers
@@ -234,11 +291,7 @@ extern const char *LOG_SUBSYSTEM;
  * debugging and will not have any side-effects.
  */
 
-#ifdef BUILD_ENABLE_DEBUG
 #define log_debug(format, ...) log_printf(LOG_DEBUG, (format), ##__VA_ARGS__)
-#else
-#define log_debug(format, ...) log_dummyf(LOG_DEBUG, (format), ##__VA_ARGS__)
-#endif
 
 #define log_info(format, ...) log_printf(LOG_INFO, (format), ##__VA_ARGS__)
 #define log_notice(format, ...) log_printf(LOG_NOTICE, (format), ##__VA_ARGS__)
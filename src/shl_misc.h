@@ -34,6 +34,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -616,6 +618,22 @@ err_close:
 	return ret;
 }
 
+/*
+ * Drop a real-time policy the calling thread inherited, for threads that do
+ * background work and must not compete with the threads they were started by.
+ */
+static inline void shl_thread_set_background(void)
+{
+	struct sched_param param;
+	int policy;
+
+	if (pthread_getschedparam(pthread_self(), &policy, &param) || policy == SCHED_OTHER)
+		return;
+
+	memset(&param, 0, sizeof(param));
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
+
 /* TODO: xkbcommon should provide these flags!
  * We currently copy them into each library API we use so we need  to keep
  * them in sync. Currently, they're used in uterm-input and tsm-vte. */
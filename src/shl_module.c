@@ -23,19 +23,23 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-#include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "shl_dlist.h"
 #include "shl_githead.h"
 #include "shl_log.h"
 #include "shl_misc.h"
 #include "shl_module.h"
 #include "shl_module_interface.h"
+#include "shl_timer.h"
+#include "shl_trace.h"
 
 #define LOG_SUBSYSTEM "module"
 
@@ -171,81 +175,107 @@ void shl_module_unload(struct shl_module *module)
 	module->loaded = false;
 }
 
-void kmscon_load_modules(void)
-{
+/*
+ * Modules are loaded on first use instead of all at startup, so backends that
+ * are never used do not cost any startup time. A lookup of a backend that is
+ * not registered calls kmscon_load_module() with the backend name, which loads
+ * "mod-<name>.so" from the module directory. Every name is tried only once.
+ * Lookups may happen on worker threads, like the background font loader.
+ */
+
+struct module_name {
+	struct shl_dlist list;
 	int ret;
-	DIR *ent;
-	struct dirent *de;
-	char *file;
-	struct shl_module *mod;
+	char name[];
+};
 
-	log_debug("loading global modules from %s", BUILD_MODULE_DIR);
+static pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shl_dlist name_list = SHL_DLIST_INIT(name_list);
 
-	if (!shl_dlist_empty(&module_list)) {
-		log_error("trying to load global modules twice");
-		return;
-	}
+static int load_module(const char *name)
+{
+	struct shl_module *mod;
+	char *file;
+	uint64_t start;
+	int ret;
 
-	ent = opendir(BUILD_MODULE_DIR);
-	if (!ent) {
-		if (errno == ENOTDIR || errno == ENOENT)
-			log_debug("module directory %s not available", BUILD_MODULE_DIR);
-		else
-			log_error("cannot open module directory %s (%d): %m", BUILD_MODULE_DIR,
-				  errno);
-		return;
+	ret = asprintf(&file, "%s/mod-%s.so", BUILD_MODULE_DIR, name);
+	if (ret < 0) {
+		log_error("cannot allocate memory for module file name");
+		return -ENOMEM;
 	}
 
-	while (true) {
-		errno = 0;
-		de = readdir(ent);
-		if (!de && errno != 0) {
-			int errsv = errno;
-			log_error("cannot read directory %s: %d", BUILD_MODULE_DIR, errsv);
-			break;
-		} else if (!de) {
-			break;
-		}
+	if (access(file, F_OK)) {
+		log_debug("no module for %s in %s", name, BUILD_MODULE_DIR);
+		free(file);
+		return -ENOENT;
+	}
 
-		if (de->d_type == DT_DIR)
-			continue;
+	start = shl_timer_now();
+	ret = shl_module_open(&mod, file);
+	free(file);
+	if (ret)
+		return ret;
 
-		if (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) {
-			log_warning("non-module file %s in module dir %s", de->d_name,
-				    BUILD_MODULE_DIR);
-			continue;
-		}
+	ret = shl_module_load(mod);
+	if (ret) {
+		shl_module_unref(mod);
+		return ret;
+	}
 
-		if (!shl_ends_with(de->d_name, ".so"))
-			continue;
+	shl_dlist_link(&module_list, &mod->list);
+	shl_trace_span("modules", name, start);
+	return 0;
+}
 
-		ret = asprintf(&file, "%s/%s", BUILD_MODULE_DIR, de->d_name);
-		if (ret < 0) {
-			log_error("cannot allocate memory for module file name");
-			continue;
-		}
+/**
+ * kmscon_load_module:
+ * @name: Name of the backend that is looked up
+ *
+ * Loads the module providing @name unless that was tried before.
+ *
+ * Returns: 0 if the module was loaded now, -EALREADY if it was tried before,
+ * other negative error codes if it cannot be loaded.
+ */
+int kmscon_load_module(const char *name)
+{
+	struct shl_dlist *iter;
+	struct module_name *n;
+	int ret;
 
-		ret = shl_module_open(&mod, file);
-		free(file);
+	if (!name || strchr(name, '/'))
+		return -EINVAL;
 
-		if (ret)
-			continue;
+	pthread_mutex_lock(&module_lock);
 
-		ret = shl_module_load(mod);
-		if (ret) {
-			shl_module_unref(mod);
-			continue;
+	shl_dlist_for_each(iter, &name_list)
+	{
+		n = shl_dlist_entry(iter, struct module_name, list);
+		if (!strcmp(n->name, name)) {
+			ret = -EALREADY;
+			goto out;
 		}
+	}
 
-		shl_dlist_link(&module_list, &mod->list);
+	n = malloc(sizeof(*n) + strlen(name) + 1);
+	if (!n) {
+		ret = -ENOMEM;
+		goto out;
 	}
+	strcpy(n->name, name);
+	n->ret = load_module(name);
+	shl_dlist_link(&name_list, &n->list);
+	ret = n->ret;
 
-	closedir(ent);
+out:
+	pthread_mutex_unlock(&module_lock);
+	return ret;
 }
 
 void kmscon_unload_modules(void)
 {
 	struct shl_module *module;
+	struct module_name *n;
 
 	log_debug("unloading modules");
 
@@ -255,4 +285,10 @@ void kmscon_unload_modules(void)
 		shl_module_unload(module);
 		shl_module_unref(module);
 	}
+
+	while (!shl_dlist_empty(&name_list)) {
+		n = shl_dlist_entry(name_list.next, struct module_name, list);
+		shl_dlist_unlink(&n->list);
+		free(n);
+	}
 }
@@ -65,7 +65,7 @@ void shl_module_unref(struct shl_module *module);
 int shl_module_load(struct shl_module *module);
 void shl_module_unload(struct shl_module *module);
 
-void kmscon_load_modules(void);
+int kmscon_load_module(const char *name);
 void kmscon_unload_modules(void);
 
 #endif /* SHL_MODULE_H */
@@ -26,27 +26,33 @@
 
 /*
  * A circular memory ring implementation
+ * The data lives in one buffer of a power-of-two size that doubles when it is
+ * full. As the content may wrap around the end of the buffer, it is peeked as
+ * up to two iovecs that can be passed to writev() at once. An optional limit
+ * makes writes fail once the ring would grow beyond it.
  */
 
 #ifndef SHL_RING_H
 #define SHL_RING_H
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
-#define SHL_RING_SIZE 512
-
-struct shl_ring_entry {
-	struct shl_ring_entry *next;
-	size_t len;
-	char buf[];
-};
+/* initial size of the buffer, allocated on the first write */
+#define SHL_RING_SIZE 4096
 
 struct shl_ring {
-	struct shl_ring_entry *first;
-	struct shl_ring_entry *last;
+	char *buf;
+	size_t size;  /* power of two, or 0 before the first write */
+	size_t start; /* offset of the first byte */
+	size_t used;
+	size_t max;	 /* most bytes the ring may hold, 0 for no limit */
+	size_t appended; /* bytes of shl_ring_append() still held, not limited */
 };
 
 static inline int shl_ring_new(struct shl_ring **out)
@@ -68,133 +74,166 @@ static inline int shl_ring_new(struct shl_ring **out)
 
 static inline void shl_ring_free(struct shl_ring *ring)
 {
-	struct shl_ring_entry *tmp;
-
 	if (!ring)
 		return;
 
-	while (ring->first) {
-		tmp = ring->first;
-		ring->first = tmp->next;
-		free(tmp);
-	}
+	free(ring->buf);
 	free(ring);
 }
 
+/* limit the ring to @max bytes, 0 removes the limit; the content is kept */
+static inline void shl_ring_set_max(struct shl_ring *ring, size_t max)
+{
+	if (ring)
+		ring->max = max;
+}
+
 static inline bool shl_ring_is_empty(struct shl_ring *ring)
 {
 	if (!ring)
 		return true;
 
-	return ring->first == NULL;
+	return ring->used == 0;
 }
 
-static inline int shl_ring_write(struct shl_ring *ring, const char *val, size_t len)
+/* fill @vec with the content in order; returns the number of iovecs, 0 to 2 */
+static inline size_t shl_ring_peek(struct shl_ring *ring, struct iovec *vec)
+{
+	size_t len;
+
+	if (!ring || !ring->used)
+		return 0;
+
+	len = ring->size - ring->start;
+	vec[0].iov_base = &ring->buf[ring->start];
+	if (ring->used <= len) {
+		vec[0].iov_len = ring->used;
+		return 1;
+	}
+
+	vec[0].iov_len = len;
+	vec[1].iov_base = ring->buf;
+	vec[1].iov_len = ring->used - len;
+	return 2;
+}
+
+static inline int shl_ring_grow(struct shl_ring *ring, size_t need)
 {
-	struct shl_ring_entry *ent;
-	size_t space, cp;
+	struct iovec vec[2];
+	size_t size, i, n, off = 0;
+	char *buf;
+
+	size = ring->size ? ring->size : SHL_RING_SIZE;
+	while (size < need) {
+		if (size > SIZE_MAX / 2)
+			return -ENOMEM;
+		size *= 2;
+	}
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	n = shl_ring_peek(ring, vec);
+	for (i = 0; i < n; ++i) {
+		memcpy(&buf[off], vec[i].iov_base, vec[i].iov_len);
+		off += vec[i].iov_len;
+	}
+
+	free(ring->buf);
+	ring->buf = buf;
+	ring->size = size;
+	ring->start = 0;
+	return 0;
+}
+
+static inline int shl_ring_push(struct shl_ring *ring, const char *val, size_t len)
+{
+	size_t pos, cp;
+	int ret;
 
 	if (!ring || !val || !len)
 		return -EINVAL;
 
-next:
-	ent = ring->last;
-	if (!ent || ent->len >= SHL_RING_SIZE) {
-		ent = malloc(sizeof(*ent) + SHL_RING_SIZE);
-		if (!ent)
-			return -ENOMEM;
+	if (len > SIZE_MAX - ring->used)
+		return -ENOMEM;
 
-		ent->len = 0;
-		ent->next = NULL;
-		if (ring->last)
-			ring->last->next = ent;
-		else
-			ring->first = ent;
-		ring->last = ent;
+	if (ring->used + len > ring->size) {
+		ret = shl_ring_grow(ring, ring->used + len);
+		if (ret)
+			return ret;
 	}
 
-	space = SHL_RING_SIZE - ent->len;
-	if (len >= space)
-		cp = space;
-	else
+	pos = (ring->start + ring->used) & (ring->size - 1);
+	cp = ring->size - pos;
+	if (cp > len)
 		cp = len;
 
-	memcpy(&ent->buf[ent->len], val, cp);
-	ent->len += cp;
-
-	val = &val[cp];
-	len -= cp;
-	if (len > 0)
-		goto next;
+	memcpy(&ring->buf[pos], val, cp);
+	memcpy(ring->buf, &val[cp], len - cp);
+	ring->used += len;
 
 	return 0;
 }
 
-static inline const char *shl_ring_peek(struct shl_ring *ring, size_t *len, size_t offset)
+/* append @len bytes of @val regardless of the limit, they don't count against it */
+static inline int shl_ring_append(struct shl_ring *ring, const char *val, size_t len)
 {
-	struct shl_ring_entry *iter;
+	int ret;
 
-	if (!ring || !ring->first || !len) {
-		if (len)
-			*len = 0;
-		return NULL;
-	}
+	ret = shl_ring_push(ring, val, len);
+	if (!ret)
+		ring->appended += len;
+	return ret;
+}
 
-	iter = ring->first;
-	while (iter->len <= offset) {
-		if (!iter->next) {
-			*len = 0;
-			return NULL;
-		}
+/*
+ * Append @len bytes of @val; nothing is written if they don't fit. Bytes of
+ * shl_ring_append() are not counted. Dropped bytes are taken from the counted
+ * ones first, so a write is never refused because of appended bytes.
+ */
+static inline int shl_ring_write(struct shl_ring *ring, const char *val, size_t len)
+{
+	size_t used;
 
-		offset -= iter->len;
-		iter = iter->next;
+	if (ring && ring->max) {
+		used = ring->used - ring->appended;
+		if (len > ring->max || used > ring->max - len)
+			return -ENOBUFS;
 	}
 
-	*len = iter->len - offset;
-	return &iter->buf[offset];
+	return shl_ring_push(ring, val, len);
 }
 
 static inline void shl_ring_drop(struct shl_ring *ring, size_t len)
 {
-	struct shl_ring_entry *ent;
-
 	if (!ring || !len)
 		return;
 
-next:
-	ent = ring->first;
-	if (!ent)
+	if (len >= ring->used) {
+		ring->start = 0;
+		ring->used = 0;
+		ring->appended = 0;
 		return;
-
-	if (len >= ent->len) {
-		len -= ent->len;
-		ring->first = ent->next;
-		free(ent);
-		if (!ring->first)
-			ring->last = NULL;
-
-		if (len)
-			goto next;
-	} else {
-		memmove(ent->buf, &ent->buf[len], ent->len - len);
-		ent->len -= len;
 	}
+
+	ring->start = (ring->start + len) & (ring->size - 1);
+	ring->used -= len;
+	if (ring->appended > ring->used)
+		ring->appended = ring->used;
 }
 
 static inline void shl_ring_flush(struct shl_ring *ring)
 {
-	struct shl_ring_entry *tmp;
-
 	if (!ring)
 		return;
 
-	while (ring->first) {
-		tmp = ring->first;
-		ring->first = tmp->next;
-		free(tmp);
-	}
-	ring->last = NULL;
+	free(ring->buf);
+	ring->buf = NULL;
+	ring->size = 0;
+	ring->start = 0;
+	ring->used = 0;
+	ring->appended = 0;
 }
 
 #endif /* SHL_RING_H */
@@ -108,6 +108,15 @@ static inline uint64_t shl_timer_stop(struct shl_timer *timer)
 	return timer->elapsed;
 }
 
+/* current CLOCK_MONOTONIC time in microseconds, the clock the timers use */
+static inline uint64_t shl_timer_now(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
 static inline uint64_t shl_timer_elapsed(struct shl_timer *timer)
 {
 	struct timespec spec;
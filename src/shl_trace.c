@@ -0,0 +1,237 @@
+/*
+ * shl - Startup Tracing
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Startup Tracing
+ * Spans are kept in a fixed array under a lock. There are only a few dozen of
+ * them during startup, one per device, module or frame, so neither matters.
+ * Spans beyond the array are counted and left out.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "shl_log.h"
+#include "shl_misc.h"
+#include "shl_timer.h"
+#include "shl_trace.h"
+
+#define LOG_SUBSYSTEM "trace"
+
+#define TRACE_MAX 128
+#define TRACE_PHASE 16
+#define TRACE_NAME 48
+
+struct trace_span {
+	char phase[TRACE_PHASE];
+	char name[TRACE_NAME];
+	uint64_t start;
+	uint64_t end;
+	int tid;
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start; /* 0 unless tracing */
+static char *trace_file;
+static struct trace_span trace_spans[TRACE_MAX];
+static unsigned int trace_num;
+static unsigned int trace_dropped;
+
+SHL_EXPORT
+void shl_trace_begin(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	trace_start = shl_timer_now();
+	trace_num = 0;
+	trace_dropped = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+SHL_EXPORT
+int shl_trace_set_file(const char *file)
+{
+	char *copy = NULL;
+
+	if (file) {
+		copy = strdup(file);
+		if (!copy)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	free(trace_file);
+	trace_file = copy;
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+SHL_EXPORT
+void shl_trace_span(const char *phase, const char *name, uint64_t start)
+{
+	uint64_t now = shl_timer_now();
+	struct trace_span *span;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_start)
+		goto out;
+
+	if (trace_num >= TRACE_MAX) {
+		++trace_dropped;
+		goto out;
+	}
+
+	span = &trace_spans[trace_num++];
+	snprintf(span->phase, sizeof(span->phase), "%s", phase);
+	snprintf(span->name, sizeof(span->name), "%s", name ? name : "");
+	span->start = start < trace_start ? trace_start : start;
+	span->end = now < span->start ? span->start : now;
+	span->tid = (int)syscall(SYS_gettid);
+
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* JSON strings only need quotes, backslashes and control characters escaped */
+static void write_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/* Chrome trace-event format, see chrome://tracing or ui.perfetto.dev */
+static void write_trace(const char *file, uint64_t end)
+{
+	struct trace_span *span;
+	unsigned int i;
+	FILE *f;
+	int pid = getpid();
+
+	f = fopen(file, "we");
+	if (!f) {
+		log_warning("cannot open startup trace %s (%d): %m", file, errno);
+		return;
+	}
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i = 0; i < trace_num; ++i) {
+		span = &trace_spans[i];
+		fprintf(f, "{\"name\":");
+		write_string(f, *span->name ? span->name : span->phase);
+		fprintf(f, ",\"cat\":");
+		write_string(f, span->phase);
+		fprintf(f,
+			",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64
+			",\"pid\":%d,\"tid\":%d},\n",
+			span->start - trace_start, span->end - span->start, pid, span->tid);
+	}
+	fprintf(f,
+		"{\"name\":\"first frame\",\"cat\":\"flip\",\"ph\":\"i\",\"s\":\"g\","
+		"\"ts\":%" PRIu64 ",\"pid\":%d,\"tid\":%d}\n]}\n",
+		end - trace_start, pid, (int)syscall(SYS_gettid));
+
+	if (ferror(f) | fclose(f))
+		log_warning("cannot write startup trace %s", file);
+	else
+		log_info("wrote startup trace to %s", file);
+}
+
+/* total milliseconds of each phase, in the order they first showed up */
+static size_t format_summary(char *buf, size_t size)
+{
+	const char *phase;
+	uint64_t sum;
+	unsigned int i, j;
+	size_t len = 0;
+	int n;
+
+	buf[0] = 0;
+	for (i = 0; i < trace_num && len < size; ++i) {
+		phase = trace_spans[i].phase;
+		for (j = 0; j < i; ++j) {
+			if (!strcmp(trace_spans[j].phase, phase))
+				break;
+		}
+		if (j < i)
+			continue;
+
+		sum = 0;
+		for (j = i; j < trace_num; ++j) {
+			if (!strcmp(trace_spans[j].phase, phase))
+				sum += trace_spans[j].end - trace_spans[j].start;
+		}
+
+		n = snprintf(&buf[len], size - len, "%s%s %.1f", len ? ", " : "", phase,
+			     sum / 1000.0);
+		if (n < 0)
+			break;
+		len += n;
+	}
+
+	return len < size ? len : size - 1;
+}
+
+SHL_EXPORT
+void shl_trace_finish(uint64_t time)
+{
+	char buf[512];
+
+	if (!time)
+		time = shl_timer_now();
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_start)
+		goto out;
+
+	if (time < trace_start)
+		time = trace_start;
+
+	format_summary(buf, sizeof(buf));
+	log_notice("startup: first frame after %.1f ms (%s ms)", (time - trace_start) / 1000.0,
+		   buf);
+	if (trace_dropped)
+		log_notice("startup: %u spans not traced", trace_dropped);
+
+	if (trace_file)
+		write_trace(trace_file, time);
+
+	trace_start = 0;
+	free(trace_file);
+	trace_file = NULL;
+
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
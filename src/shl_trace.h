@@ -0,0 +1,59 @@
+/*
+ * shl - Startup Tracing
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Startup Tracing
+ * Records how long each phase of the startup takes until the first frame is on
+ * screen. A phase is a group of spans, like "video" for the initialization of
+ * every GPU. Spans may come from any thread and may overlap.
+ *
+ * shl_trace_begin():
+ * Starts tracing. Call this first thing in main(); spans are only recorded
+ * between this and shl_trace_finish().
+ *
+ * shl_trace_set_file(file):
+ * Also write the spans as Chrome trace-event JSON to @file when finishing.
+ *
+ * shl_trace_span(phase, name, start):
+ * Records a span of @phase from @start until now. @name describes it further,
+ * like the device node, and may be NULL.
+ *
+ * shl_trace_finish(time):
+ * The first frame was shown at @time, 0 for now. Logs a summary line with the
+ * total time of each phase and writes the trace file. Only the first call has
+ * an effect.
+ *
+ * All times are CLOCK_MONOTONIC microseconds, see shl_timer_now().
+ */
+
+#ifndef SHL_TRACE_H
+#define SHL_TRACE_H
+
+#include <stdint.h>
+
+void shl_trace_begin(void);
+int shl_trace_set_file(const char *file);
+void shl_trace_span(const char *phase, const char *name, uint64_t start);
+void shl_trace_finish(uint64_t time);
+
+#endif /* SHL_TRACE_H */
@@ -32,11 +32,15 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include "font.h"
+#include "kmscon_image.h"
 #include "shl_log.h"
 #include "shl_misc.h"
+#include "shl_module.h"
 #include "shl_register.h"
 #include "text.h"
 #include "uterm_video.h"
@@ -109,9 +113,12 @@ static int new_text(struct kmscon_text *text, const char *backend, enum Orientat
 	memset(text, 0, sizeof(*text));
 	text->ref = 1;
 
-	if (backend)
+	if (backend) {
 		record = shl_register_find(&text_reg, backend);
-	else
+		/* backends are loaded on first use */
+		if (!record && !kmscon_load_module(backend))
+			record = shl_register_find(&text_reg, backend);
+	} else
 		record = shl_register_first(&text_reg);
 
 	if (!record) {
@@ -226,6 +233,8 @@ void kmscon_text_unref(struct kmscon_text *text)
 	if (text->ops->destroy)
 		text->ops->destroy(text);
 	shl_register_record_unref(text->record);
+	free(text->row_chars);
+	free(text->row);
 	free(text);
 }
 
@@ -277,7 +286,9 @@ int kmscon_text_set(struct kmscon_text *txt, struct kmscon_font *font, struct ut
  *
  * This redos kmscon_text_set() by dropping the internal references to the font
  * and screen and invalidating the object. You need to call kmscon_text_set()
- * again to make use of this text renderer.
+ * again to make use of this text renderer. The size computed for the last
+ * screen is still returned by kmscon_text_get_cols() and
+ * kmscon_text_get_rows().
  * This is automatically called when the text renderer is destroyed.
  */
 void kmscon_text_unset(struct kmscon_text *txt)
@@ -295,6 +306,7 @@ void kmscon_text_unset(struct kmscon_text *txt)
 	txt->cols = 0;
 	txt->rows = 0;
 	txt->rendering = false;
+	kmscon_text_invalidate(txt);
 }
 
 /**
@@ -307,11 +319,13 @@ void kmscon_text_unset(struct kmscon_text *txt)
  * the number of columns/rows of the console that it can display on the screen.
  * But in case of multi-screen setup the actual size of the terminal might be
  * smaller, so call this function to set the current terminal size.
+ * This does nothing while @txt is unset.
  */
 void kmscon_text_resize(struct kmscon_text *txt, unsigned int cols, unsigned int rows)
 {
-	if (!txt || !cols || cols > txt->max_cols || !rows || rows > txt->max_rows)
+	if (!txt || !txt->disp || !cols || cols > txt->max_cols || !rows || rows > txt->max_rows)
 		return;
+	kmscon_text_invalidate(txt);
 	if (txt->ops->resize)
 		txt->ops->resize(txt, cols, rows);
 }
@@ -392,11 +406,136 @@ enum Orientation kmscon_text_get_orientation(struct kmscon_text *txt)
  */
 int kmscon_text_rotate(struct kmscon_text *txt, enum Orientation orientation)
 {
+	kmscon_text_invalidate(txt);
 	if (txt->ops->rotate)
 		return txt->ops->rotate(txt, orientation);
 	return 0;
 }
 
+/**
+ * kmscon_text_invalidate:
+ * @txt: valid text renderer
+ *
+ * Forget which cells were drawn into the framebuffers of the display. Call
+ * this whenever somebody else might have drawn into them, so the next frames
+ * pass every cell to the backend again.
+ */
+void kmscon_text_invalidate(struct kmscon_text *txt)
+{
+	if (!txt)
+		return;
+
+	memset(txt->ages, 0, sizeof(txt->ages));
+}
+
+/**
+ * kmscon_text_set_images:
+ * @txt: valid text renderer
+ * @images: image parser of the terminal, or NULL to draw no inline images
+ *
+ * Only cells of images that @images placed are drawn as images, see
+ * kmscon_image_placed().
+ */
+void kmscon_text_set_images(struct kmscon_text *txt, const struct kmscon_image_parser *images)
+{
+	if (!txt)
+		return;
+
+	txt->images = images;
+	kmscon_text_invalidate(txt);
+}
+
+#ifdef BUILD_ENABLE_PROFILE
+
+/* Renderers of all screens add up here, possibly from the render thread. */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kmscon_text_profile profile_total;
+static struct kmscon_text_profile profile_worst;
+
+static uint64_t profile_frame_time(const struct kmscon_text_profile *p)
+{
+	return p->raster_time + p->blend_time;
+}
+
+static void profile_frame(struct kmscon_text *txt)
+{
+	struct kmscon_text_profile *p = &txt->profile;
+
+	pthread_mutex_lock(&profile_lock);
+	++profile_total.frames;
+	profile_total.cells_visited += p->cells_visited;
+	profile_total.cells_drawn += p->cells_drawn;
+	profile_total.cells_blended += p->cells_blended;
+	profile_total.glyph_hits += p->glyph_hits;
+	profile_total.glyph_misses += p->glyph_misses;
+	profile_total.tile_hits += p->tile_hits;
+	profile_total.tile_misses += p->tile_misses;
+	profile_total.heap_allocs += p->heap_allocs;
+	profile_total.raster_time += p->raster_time;
+	profile_total.blend_time += p->blend_time;
+	if (profile_frame_time(p) >= profile_frame_time(&profile_worst))
+		profile_worst = *p;
+	pthread_mutex_unlock(&profile_lock);
+
+	memset(p, 0, sizeof(*p));
+}
+
+/**
+ * kmscon_text_profile_swap:
+ * @txt: text renderer whose frame was swapped
+ * @usec: time from the swap until the display flipped to the frame
+ */
+void kmscon_text_profile_swap(struct kmscon_text *txt, uint64_t usec)
+{
+	pthread_mutex_lock(&profile_lock);
+	profile_total.swap_time += usec;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * kmscon_text_profile_dump:
+ *
+ * Log what an average frame cost since the last dump, along with the slowest
+ * frame, and start over.
+ */
+void kmscon_text_profile_dump(void)
+{
+	struct kmscon_text_profile t, w;
+	uint64_t n;
+
+	pthread_mutex_lock(&profile_lock);
+	t = profile_total;
+	w = profile_worst;
+	memset(&profile_total, 0, sizeof(profile_total));
+	memset(&profile_worst, 0, sizeof(profile_worst));
+	pthread_mutex_unlock(&profile_lock);
+
+	if (!t.frames) {
+		log_info("profile: no frames drawn");
+		return;
+	}
+
+	n = t.frames;
+	log_info("profile: %" PRIu64 " frames, %" PRIu64 " heap allocations, per frame: %" PRIu64
+		 " cells visited, %" PRIu64 " drawn, %" PRIu64 " blended, glyph cache %" PRIu64
+		 " hits %" PRIu64 " misses, cell cache %" PRIu64 " hits %" PRIu64
+		 " misses, raster %" PRIu64 "us, blend %" PRIu64 "us, swap wait %" PRIu64 "us",
+		 n, t.heap_allocs, t.cells_visited / n, t.cells_drawn / n, t.cells_blended / n,
+		 t.glyph_hits / n, t.glyph_misses / n, t.tile_hits / n, t.tile_misses / n,
+		 t.raster_time / n, t.blend_time / n, t.swap_time / n);
+	log_info("profile: slowest frame: %" PRIu64 " cells drawn, %" PRIu64 " blended, %" PRIu64
+		 " misses, raster %" PRIu64 "us, blend %" PRIu64 "us",
+		 w.cells_drawn, w.cells_blended, w.glyph_misses, w.raster_time, w.blend_time);
+}
+
+#else
+
+static inline void profile_frame(struct kmscon_text *txt)
+{
+}
+
+#endif
+
 /**
  * kmscon_text_prepare:
  * @txt: valid text renderer
@@ -419,10 +558,162 @@ int kmscon_text_prepare(struct kmscon_text *txt, struct tsm_screen_attr *attr)
 		return -EINVAL;
 
 	txt->rendering = true;
+	txt->buffer_age = 0;
+	txt->row_len = 0;
+	txt->row_changed = false;
 	if (txt->ops->prepare)
 		ret = txt->ops->prepare(txt, attr);
-	if (ret)
+	if (ret) {
 		txt->rendering = false;
+		return ret;
+	}
+
+	++txt->frame;
+	txt->ages[txt->frame % KMSCON_TEXT_AGES] = 0;
+	txt->frame_age = 0;
+	txt->frame_reset = false;
+	if (txt->buffer_age && txt->buffer_age < KMSCON_TEXT_AGES)
+		txt->skip_age = txt->ages[(txt->frame - txt->buffer_age) % KMSCON_TEXT_AGES];
+	else
+		txt->skip_age = 0;
+
+	return 0;
+}
+
+static unsigned int cell_style(const struct tsm_screen_attr *attr)
+{
+	return (attr->bold ? KMSCON_GLYPH_BOLD : 0) | (attr->italic ? KMSCON_GLYPH_ITALIC : 0) |
+	       (attr->underline ? KMSCON_GLYPH_UNDERLINE : 0);
+}
+
+/* a cell that can be part of a shaped run: one codepoint in one column, but
+ * no space, which never joins its neighbours, and no tile of an image */
+static bool cell_shapes(const struct kmscon_text_cell *cell)
+{
+	unsigned int col, row;
+
+	return cell->len == 1 && cell->width == 1 && *cell->ch != ' ' &&
+	       !kmscon_image_cell(*cell->ch, &col, &row);
+}
+
+/*
+ * Gives the cells of the row whose glyph depends on their neighbours the ids
+ * the font shaped them with, see kmscon_font_shape(). A run is made of cells
+ * next to each other with the same style; spaces, wide cells and cells of more
+ * than one codepoint end it.
+ */
+static void shape_row(struct kmscon_text *txt, size_t num)
+{
+	struct kmscon_text_cell *cells = txt->row;
+	uint64_t ids[KMSCON_FONT_MAX_RUN];
+	unsigned int style;
+	size_t start, end, i;
+
+	for (start = 0; start < num; start = end) {
+		end = start + 1;
+		if (!cell_shapes(&cells[start]))
+			continue;
+
+		style = cell_style(&cells[start].attr);
+		while (end < num && end - start < KMSCON_FONT_MAX_RUN && cell_shapes(&cells[end]) &&
+		       cells[end].posx == cells[end - 1].posx + 1 &&
+		       cell_style(&cells[end].attr) == style)
+			++end;
+		if (end - start < 2)
+			continue;
+		if (kmscon_font_shape(txt->font, &txt->row_chars[start], end - start, style, ids))
+			continue;
+
+		for (i = start; i < end; ++i) {
+			if (ids[i - start])
+				cells[i].id = ids[i - start];
+		}
+	}
+}
+
+/* passes the collected cells to the backend */
+static int flush_row(struct kmscon_text *txt)
+{
+	size_t num = txt->row_len;
+	bool changed = txt->row_changed;
+
+	txt->row_len = 0;
+	txt->row_changed = false;
+	if (!num || !changed)
+		return 0;
+
+	if (kmscon_font_can_shape(txt->font))
+		shape_row(txt, num);
+	KMSCON_TEXT_COUNT(txt, cells_drawn, num);
+	return txt->ops->draw_row(txt, txt->row_posy, txt->row, num);
+}
+
+static int grow_row(struct kmscon_text *txt)
+{
+	struct kmscon_text_cell *row;
+	uint32_t *chars;
+	size_t size = txt->cols;
+	size_t i;
+
+	if (size <= txt->row_size)
+		size = txt->row_size * 2;
+
+	row = realloc(txt->row, size * sizeof(*row));
+	if (!row)
+		return -ENOMEM;
+	txt->row = row;
+
+	chars = realloc(txt->row_chars, size * sizeof(*chars));
+	if (!chars)
+		return -ENOMEM;
+
+	/* single codepoints point into the buffer that just moved */
+	for (i = 0; i < txt->row_len; ++i) {
+		if (row[i].len == 1)
+			row[i].ch = &chars[i];
+	}
+	txt->row_chars = chars;
+	txt->row_size = size;
+	return 0;
+}
+
+/* Collects the cells of a row so the backend gets them in one call. A cell of
+ * another row passes the collected ones on first, unless none of them was
+ * @changed. */
+static int draw_batched(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
+			unsigned int width, unsigned int posx, unsigned int posy,
+			const struct tsm_screen_attr *attr, bool changed)
+{
+	struct kmscon_text_cell *cell;
+	int ret = 0, r;
+
+	if (posx >= txt->cols || posy >= txt->rows || !attr)
+		return -EINVAL;
+
+	if (txt->row_len && posy != txt->row_posy)
+		ret = flush_row(txt);
+	if (txt->row_len >= txt->row_size) {
+		r = grow_row(txt);
+		if (r)
+			return r;
+	}
+
+	txt->row_posy = posy;
+	cell = &txt->row[txt->row_len];
+	cell->id = id;
+	cell->len = len;
+	cell->width = width;
+	cell->posx = posx;
+	cell->attr = *attr;
+	/* the caller may reuse the codepoint right after returning */
+	if (len == 1) {
+		txt->row_chars[txt->row_len] = *ch;
+		cell->ch = &txt->row_chars[txt->row_len];
+	} else {
+		cell->ch = ch;
+	}
+	++txt->row_len;
+	txt->row_changed |= changed;
 
 	return ret;
 }
@@ -453,7 +744,10 @@ int kmscon_text_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, s
 		return -EINVAL;
 	if (posx >= txt->cols || posy >= txt->rows || !attr)
 		return -EINVAL;
+	if (txt->row_len)
+		flush_row(txt);
 
+	KMSCON_TEXT_COUNT(txt, cells_drawn, 1);
 	return txt->ops->draw(txt, id, ch, len, width, posx, posy, attr);
 }
 
@@ -474,6 +768,8 @@ int kmscon_text_draw_pointer(struct kmscon_text *txt, unsigned int x, unsigned i
 {
 	if (!txt || !txt->rendering || !txt->ops->draw_pointer)
 		return -EINVAL;
+	if (txt->row_len)
+		flush_row(txt);
 
 	return txt->ops->draw_pointer(txt, x, y);
 }
@@ -489,15 +785,24 @@ int kmscon_text_draw_pointer(struct kmscon_text *txt, unsigned int x, unsigned i
  */
 int kmscon_text_render(struct kmscon_text *txt)
 {
-	int ret = 0;
+	int ret = 0, r;
 
 	if (!txt || !txt->rendering)
 		return -EINVAL;
 
-	if (txt->ops->render)
-		ret = txt->ops->render(txt);
+	if (txt->row_len)
+		ret = flush_row(txt);
+	if (txt->ops->render) {
+		r = txt->ops->render(txt);
+		if (r)
+			ret = r;
+	}
 	txt->rendering = false;
 
+	if (!ret && !txt->frame_reset)
+		txt->ages[txt->frame % KMSCON_TEXT_AGES] = txt->frame_age;
+
+	profile_frame(txt);
 	return ret;
 }
 
@@ -519,11 +824,77 @@ void kmscon_text_abort(struct kmscon_text *txt)
 	if (txt->ops->abort)
 		txt->ops->abort(txt);
 	txt->rendering = false;
+	txt->row_len = 0;
+	txt->row_changed = false;
+}
+
+/**
+ * kmscon_text_get_memory:
+ * @txt: valid text renderer
+ * @out: Filled with the memory of @txt
+ *
+ * Tells what @txt keeps besides the glyph cache, for the memory report. Backends
+ * add their own memory to the row buffer of the text layer while they are set.
+ * Must not be called while the renderer draws a frame on another thread.
+ */
+void kmscon_text_get_memory(struct kmscon_text *txt, struct kmscon_text_memory *out)
+{
+	memset(out, 0, sizeof(*out));
+	if (!txt)
+		return;
+
+	out->bytes = txt->row_size * (sizeof(*txt->row) + sizeof(*txt->row_chars));
+	if (txt->disp && txt->ops->get_memory)
+		txt->ops->get_memory(txt, out);
 }
 
+/**
+ * kmscon_text_draw_cb:
+ * @con: tsm screen that is drawn
+ * @age: age of the cell as reported by libtsm, 0 if unknown
+ * @data: the text renderer
+ *
+ * Draw-callback for tsm_screen_draw(). The other arguments are the same as for
+ * kmscon_text_draw(). If the backend reported a buffer age in its prepare
+ * callback, cells that did not change since that buffer was drawn are skipped
+ * here and never reach the backend. Backends with a draw_row callback get the
+ * remaining cells of a row in a single call, once the next row starts or the
+ * frame is rendered. If the font shapes runs of cells, they get all cells of a
+ * row that has any changed cell, with the ids of shaped cells replaced.
+ *
+ * Returns: 0 on success or negative error code if this glyph couldn't be drawn.
+ */
 int kmscon_text_draw_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch, size_t len,
 			unsigned int width, unsigned int posx, unsigned int posy,
 			const struct tsm_screen_attr *attr, tsm_age_t age, void *data)
 {
-	return kmscon_text_draw(data, id, ch, len, width, posx, posy, attr);
+	struct kmscon_text *txt = data;
+	bool skip;
+
+	if (!txt || !txt->rendering)
+		return -EINVAL;
+
+	KMSCON_TEXT_COUNT(txt, cells_visited, 1);
+
+	/* An age of 0 means libtsm lost track, so this frame can't be used as
+	 * a reference later. Otherwise the newest age we see is the age of
+	 * this frame: everything that changes afterwards gets a higher one. */
+	if (!age)
+		txt->frame_reset = true;
+	else if (age > txt->frame_age)
+		txt->frame_age = age;
+
+	/* unchanged since the target buffer was drawn */
+	skip = age && age <= txt->skip_age;
+
+	/* a changed cell can change how its neighbours are shaped, so the
+	 * whole row is drawn again */
+	if (txt->ops->draw_row && kmscon_font_can_shape(txt->font))
+		return draw_batched(txt, id, ch, len, width, posx, posy, attr, !skip);
+	if (skip)
+		return 0;
+
+	if (txt->ops->draw_row)
+		return draw_batched(txt, id, ch, len, width, posx, posy, attr, true);
+	return kmscon_text_draw(txt, id, ch, len, width, posx, posy, attr);
 }
\ No newline at end of file
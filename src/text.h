@@ -38,6 +38,7 @@
 #include <stdlib.h>
 #include "font.h"
 #include "shl_module.h"
+#include "shl_timer.h"
 #include "uterm_video.h"
 
 /* text renderer */
@@ -49,9 +50,58 @@ enum Orientation {
 	OR_LEFT,	// 270 Degree
 };
 
+struct kmscon_image_parser;
 struct kmscon_text;
 struct kmscon_text_ops;
 
+/*
+ * Frame profiler
+ * With -Dprofile=true, every renderer counts what its frames cost and
+ * kmscon_text_profile_dump() logs the totals. Without it, the macros below
+ * compile to nothing. Times are in microseconds.
+ */
+struct kmscon_text_profile {
+	uint64_t frames;
+	uint64_t cells_visited;
+	uint64_t cells_drawn;
+	uint64_t cells_blended;
+	uint64_t glyph_hits;
+	uint64_t glyph_misses;
+	uint64_t tile_hits;
+	uint64_t tile_misses;
+	uint64_t heap_allocs; /* by the allocators of the renderer */
+	uint64_t raster_time;
+	uint64_t blend_time;
+	uint64_t swap_time;
+};
+
+#ifdef BUILD_ENABLE_PROFILE
+#define KMSCON_TEXT_PROFILE_NOW() shl_timer_now()
+#define KMSCON_TEXT_COUNT(txt, field, val) ((txt)->profile.field += (val))
+/* the field is off by the start time until the matching _END */
+#define KMSCON_TEXT_TIME_BEGIN(txt, field) ((txt)->profile.field -= shl_timer_now())
+#define KMSCON_TEXT_TIME_END(txt, field) ((txt)->profile.field += shl_timer_now())
+#else
+#define KMSCON_TEXT_PROFILE_NOW() 0
+#define KMSCON_TEXT_COUNT(txt, field, val) ((void)0)
+#define KMSCON_TEXT_TIME_BEGIN(txt, field) ((void)0)
+#define KMSCON_TEXT_TIME_END(txt, field) ((void)0)
+#endif
+
+/* number of past frames whose tsm age is remembered */
+#define KMSCON_TEXT_AGES 4
+
+/* A cell of a row passed to ->draw_row(). @ch of a single codepoint is only
+ * valid during the call, longer ones until ->render(). */
+struct kmscon_text_cell {
+	uint64_t id;
+	const uint32_t *ch;
+	size_t len;
+	unsigned int width;
+	unsigned int posx;
+	struct tsm_screen_attr attr;
+};
+
 struct kmscon_text {
 	unsigned long ref;
 	struct shl_register_record *record;
@@ -66,6 +116,38 @@ struct kmscon_text {
 	unsigned int max_rows;
 	bool rendering;
 	enum Orientation orientation;
+	/* parser of the inline images drawn, NULL without, see kmscon_image.h */
+	const struct kmscon_image_parser *images;
+
+	/* Set by the backend in ->prepare() to the number of frames since the
+	 * current target buffer was drawn, or 0 if it needs all cells. */
+	unsigned int buffer_age;
+	unsigned int frame;
+	bool frame_reset;
+	tsm_age_t frame_age;
+	tsm_age_t skip_age;
+	tsm_age_t ages[KMSCON_TEXT_AGES];
+
+	/* cells of row @row_posy collected for ->draw_row() */
+	struct kmscon_text_cell *row;
+	uint32_t *row_chars;
+	size_t row_len;
+	size_t row_size;
+	unsigned int row_posy;
+	bool row_changed; /* unchanged rows are dropped when shaping */
+
+#ifdef BUILD_ENABLE_PROFILE
+	/* counters of the frame being drawn */
+	struct kmscon_text_profile profile;
+#endif
+};
+
+/* memory of a renderer besides the glyph cache, see kmscon_text_get_memory() */
+struct kmscon_text_memory {
+	unsigned int tiles; /* glyphs or cells kept by the renderer itself */
+	size_t tile_bytes;  /* of those, in textures for GL renderers */
+	size_t bytes;	    /* cell arrays, vertices and other buffers */
+	unsigned int reqs;  /* blend requests or quads of the last frame */
 };
 
 struct kmscon_text_ops {
@@ -81,9 +163,14 @@ struct kmscon_text_ops {
 	int (*draw)(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
 		    unsigned int width, unsigned int posx, unsigned int posy,
 		    const struct tsm_screen_attr *attr);
+	/* optional, @num cells of row @posy from left to right */
+	int (*draw_row)(struct kmscon_text *txt, unsigned int posy,
+			const struct kmscon_text_cell *cells, size_t num);
 	int (*draw_pointer)(struct kmscon_text *txt, unsigned int x, unsigned int y);
 	int (*render)(struct kmscon_text *txt);
 	void (*abort)(struct kmscon_text *txt);
+	/* optional */
+	void (*get_memory)(struct kmscon_text *txt, struct kmscon_text_memory *out);
 };
 
 #define FONT_WIDTH(txt) ((txt)->font->attr.width)
@@ -104,6 +191,8 @@ unsigned int kmscon_text_get_rows(struct kmscon_text *txt);
 enum Orientation kmscon_text_get_orientation(struct kmscon_text *txt);
 void kmscon_text_resize(struct kmscon_text *txt, unsigned int cols, unsigned int rows);
 int kmscon_text_rotate(struct kmscon_text *txt, enum Orientation orientation);
+void kmscon_text_invalidate(struct kmscon_text *txt);
+void kmscon_text_set_images(struct kmscon_text *txt, const struct kmscon_image_parser *images);
 
 int kmscon_text_prepare(struct kmscon_text *txt, struct tsm_screen_attr *attr);
 int kmscon_text_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
@@ -112,14 +201,31 @@ int kmscon_text_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, s
 int kmscon_text_draw_pointer(struct kmscon_text *txt, unsigned int x, unsigned int y);
 int kmscon_text_render(struct kmscon_text *txt);
 void kmscon_text_abort(struct kmscon_text *txt);
+void kmscon_text_get_memory(struct kmscon_text *txt, struct kmscon_text_memory *out);
 
 int kmscon_text_draw_cb(struct tsm_screen *con, uint64_t id, const uint32_t *ch, size_t len,
 			unsigned int width, unsigned int posx, unsigned int posy,
 			const struct tsm_screen_attr *attr, tsm_age_t age, void *data);
 
+#ifdef BUILD_ENABLE_PROFILE
+void kmscon_text_profile_swap(struct kmscon_text *txt, uint64_t usec);
+void kmscon_text_profile_dump(void);
+#else
+static inline void kmscon_text_profile_swap(struct kmscon_text *txt, uint64_t usec)
+{
+}
+
+static inline void kmscon_text_profile_dump(void)
+{
+}
+#endif
+
 /* modularized backends */
 
 extern struct kmscon_text_ops kmscon_text_bbulk_ops;
+int kmscon_text_bbulk_set_threads(unsigned int num);
+void kmscon_text_bbulk_set_cell_cache(size_t size);
+void kmscon_text_bbulk_set_damage_rects(unsigned int num);
 extern struct kmscon_text_ops kmscon_text_gltex_ops;
 
 #endif /* KMSCON_TEXT_H */
@@ -31,19 +31,45 @@
  * Similar to the bblit renderer but assembles an array of blit-requests and
  * pushes all of them at once to the video device.
  *
- * Only push cells that have changed from previous frame, and the frame before
- * as kmscon uses double buffering.
- * bbulk->prev holds the previous cell content, bbulk->damaged tells if the
- * previous cell content was different from its predecessor.
+ * Only push cells that have changed since the target buffer was drawn.
+ * bbulk->prev holds the previous cell content, bbulk->changed the frame each
+ * cell last changed in. Cells that changed in a frame the target buffer missed
+ * are copied from the last drawn frame with uterm_display_fake_copyv() instead
+ * of blending them again, the buffer age tells how many frames it missed.
+ *
+ * Cells are collected while libtsm draws and compared in bbulk_render(). Rows
+ * are hashed to find a block of lines that moved up or down, like a scroll of
+ * the whole screen or of a scroll region between fixed status lines. The block
+ * is copied from the frame on screen with uterm_display_fake_move() and
+ * bbulk->prev is shifted along, so only the newly exposed lines get blended.
+ *
+ * Large frames can be blended by a pool of threads shared by all bbulk
+ * renderers, see kmscon_text_bbulk_set_threads(). The requests of a frame are
+ * split into horizontal bands, each thread works through its own queue of
+ * bands and steals from the others once it runs dry.
+ *
+ * On drm2d, cells can be kept blended in a cache of XRGB32 tiles keyed by
+ * glyph and colors, see kmscon_text_bbulk_set_cell_cache(). A hit is copied to
+ * the framebuffer row by row instead of being blended again.
+ *
+ * Cells of inline images the terminal placed are copied from the XRGB32 tiles
+ * of the image cache, see kmscon_image.h. The cache is read-locked from the
+ * first cell of a frame until it is blended. Displays with OpenGL cannot take
+ * XRGB32, there these cells are blank.
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include "font.h"
+#include "font_cache.h"
+#include "kmscon_image.h"
+#include "shl_dlist.h"
 #include "shl_log.h"
-#include "shl_lru.h"
 #include "shl_misc.h"
 #include "text.h"
 #include "uterm_video.h"
@@ -56,10 +82,83 @@
 // Max horizontal distance of two damaged cells to be merged in a damage rectangle
 #define DAMAGE_MERGE_LEN 3
 
+#define BLEND_MAX_THREADS 32
+#define BLEND_BANDS_PER_THREAD 4
+#define BLEND_MAX_BANDS (BLEND_MAX_THREADS * BLEND_BANDS_PER_THREAD)
+// Below this many requests, waking up the pool costs more than it saves
+#define BLEND_MIN_REQS 256
+
+// Frames whose mouse pointer tile we remember, larger buffer ages redraw all
+#define POINTER_HISTORY 4
+// Cells below a pointer tile
+#define POINTER_CELLS 4
+
+/* an XRGB32 cell blended with the colors in its key */
+struct cell_tile {
+	struct cell_tile *next; /* in the hash bucket */
+	struct shl_dlist list;	/* most recently used first */
+	uint64_t id;
+	uint32_t flags;
+	uint32_t fg;
+	uint32_t bg;
+	uint32_t frame; /* last frame that used it, which keeps it alive */
+	size_t size;
+	struct uterm_video_buffer buf;
+};
+
+struct cell_cache {
+	struct cell_tile **buckets;
+	unsigned int mask;
+	struct shl_dlist lru;
+	size_t size;
+	size_t max_size;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/*
+ * What a cell shows: its glyph and its attributes packed by pack_attr(), so
+ * telling whether a cell changed is two integer compares. The bits above
+ * CELL_ATTR tell how it was drawn.
+ */
 struct bbcell {
 	uint64_t id;
+	uint64_t attr;
+};
+
+#define CELL_ATTR ((1ULL << 56) - 1)
+#define CELL_OVERFLOW (1ULL << 56) /* the glyph covers the next cell, too */
+#define CELL_BLANK (1ULL << 57)	   /* drawn as a fill of its background */
+#define CELL_IMAGE (1ULL << 58)	   /* a tile of an inline image */
+
+/* a cell below an old pointer, as prev showed it in bbulk_prepare() */
+struct bbrestore {
+	unsigned int off;
+	struct bbcell cell;
+	struct kmscon_glyph *glyph; /* NULL for blank cells */
+};
+
+/* the cells a frame drew the mouse pointer over */
+struct bbtile {
+	uint32_t frame;
+	unsigned int num;
+	unsigned int cells[POINTER_CELLS];
+};
+
+/* a cell passed to bbulk_draw(), libtsm keeps @ch valid until we render */
+struct bbpending {
+	uint64_t id;
+	const uint32_t *ch;
+	uint32_t c; /* @ch of a single codepoint, the caller's may be gone */
+	size_t len;
+	unsigned int width;
+	unsigned int posx;
+	unsigned int posy;
 	struct tsm_screen_attr attr;
-	bool overflow;
+	struct kmscon_glyph *glyph; /* NULL for blank and image cells */
+	struct kmscon_glyph *space; /* right half of a wide cell the font draws narrow */
+	bool image; /* a placeholder of an image the terminal placed */
 };
 
 struct bbulk {
@@ -67,19 +166,275 @@ struct bbulk {
 	unsigned int req_len;
 	unsigned int req_total_len;
 	struct tsm_screen_attr attr;
-	struct shl_lru *glyphs;
+	struct kmscon_glyph_cache *glyphs;
+	pthread_t glyphs_thread; /* the thread @glyphs is shared on */
 	struct bbcell *prev;
 	unsigned int cells;
 	unsigned int sw;
 	unsigned int sh;
-	bool *damages;
+	uint32_t frame;
+	uint32_t *changed; /* frame each cell's content last changed in */
+	uint64_t *damaged;	/* cells written to the buffer in this frame */
+	uint64_t *damaged_words; /* words of @damaged with a bit set */
+	unsigned int damaged_len; /* words in @damaged */
+	int age;	   /* frames since the target buffer was drawn */
+	bool copy;	   /* the display supports fake_copyv */
+	struct uterm_video_rect *copy_rects;
+	unsigned int copy_len;
 	struct uterm_video_rect *damage_rects;
 	unsigned int damage_rect_len;
-	uint8_t redraw;
+	/* rects reaching the row before, then room for the next such list */
+	unsigned int *damage_open;
+	unsigned int open_len;
+	unsigned int open_size;
+	struct bbpending *pending;
+	unsigned int pending_len;
+	unsigned int *slots; /* index into pending for each cell, if it is drawn */
+	bool pointer;
+	unsigned int pointer_x;
+	unsigned int pointer_y;
+	struct kmscon_glyph *pointer_glyph;
+	uint64_t *old_hash; /* per row of prev, 0 if unknown */
+	uint64_t *new_hash; /* per row of this frame, 0 if unknown */
+	bool redraw;		/* redraw everything in the next frame */
+	uint32_t redraw_frame;	/* last frame that was redrawn completely */
+	uint32_t pointer_frame; /* last frame that drew the pointer */
+	struct bbtile pointers[POINTER_HISTORY]; /* indexed by frame */
+	/* cells to blend again, the target buffer shows a pointer over them */
+	struct bbrestore restore[2 * POINTER_HISTORY * POINTER_CELLS];
+	unsigned int restore_len;
 	unsigned int off_x;
 	unsigned int off_y;
+	/* reqs sorted into bands for the blend pool, allocated on first use */
+	struct uterm_video_blend_req *band_reqs;
+	struct cell_cache *tiles; /* NULL if the cell cache is off */
+	/* glyphs of the spans in reqs, the last span's are at the end */
+	const struct uterm_video_buffer **span_bufs;
+	unsigned int span_len;
+	/* holds the arrays above, from reqs to span_bufs */
+	uint8_t *arrays;
+	size_t arrays_size;
+	/* rows kept by a resize, and where the grid was on screen before it */
+	unsigned int resize_rows;
+	unsigned int resize_off_y;
+	uint32_t resize_frame; /* last frame that moved rows after a resize */
+	bool images; /* the display takes the XRGB32 tiles of inline images */
+};
+
+struct blend_band {
+	struct uterm_video_blend_req *reqs;
+	size_t num;
+};
+
+struct blend_queue {
+	pthread_mutex_t lock;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int bands[BLEND_BANDS_PER_THREAD];
+};
+
+struct blend_pool;
+
+struct blend_worker {
+	struct blend_pool *pool;
+	unsigned int idx;
+	pthread_t thread;
+};
+
+struct blend_pool {
+	/* one frame at a time, other renderers blend on their own meanwhile */
+	pthread_mutex_t job_lock;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	unsigned int gen;    /* protected by @lock */
+	unsigned int active; /* protected by @lock */
+	bool exit;	     /* protected by @lock */
+
+	unsigned int num;    /* threads including the caller */
+	struct blend_worker workers[BLEND_MAX_THREADS];
+
+	/* the current frame */
+	struct uterm_display *disp;
+	struct blend_band bands[BLEND_MAX_BANDS];
+	struct blend_queue queues[BLEND_MAX_THREADS];
+	int ret;
 };
 
+static struct blend_pool *blend_pool;
+static size_t cell_cache_size;
+static unsigned int damage_rects_max = 32;
+
+/*
+ * Cell cache
+ * Tiles are pinned by the frame that last used them, like glyphs, as the
+ * requests of a frame point into them until it is blended. If everything is
+ * pinned, the cell is blended as usual.
+ */
+
+static int cell_cache_new(struct cell_cache **out, size_t max_size, size_t tile_size)
+{
+	struct cell_cache *cc;
+	unsigned int num = 64;
+
+	while (num < max_size / tile_size && num < (1U << 20))
+		num <<= 1;
+
+	cc = malloc(sizeof(*cc));
+	if (!cc)
+		return -ENOMEM;
+	memset(cc, 0, sizeof(*cc));
+	cc->max_size = max_size;
+	cc->mask = num - 1;
+	shl_dlist_init(&cc->lru);
+
+	cc->buckets = calloc(num, sizeof(*cc->buckets));
+	if (!cc->buckets) {
+		free(cc);
+		return -ENOMEM;
+	}
+
+	*out = cc;
+	return 0;
+}
+
+static void cell_cache_free(struct cell_cache *cc)
+{
+	struct cell_tile *tile;
+
+	if (!cc)
+		return;
+
+	log_debug("cell cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+		  " evictions, %zu bytes",
+		  cc->hits, cc->misses, cc->evictions, cc->size);
+
+	while (!shl_dlist_empty(&cc->lru)) {
+		tile = shl_dlist_first(&cc->lru, struct cell_tile, list);
+		shl_dlist_unlink(&tile->list);
+		free(tile);
+	}
+	free(cc->buckets);
+	free(cc);
+}
+
+static unsigned int tile_hash(const struct cell_cache *cc, uint64_t id, uint32_t flags,
+			      uint32_t fg, uint32_t bg)
+{
+	uint64_t h;
+
+	h = (id ^ ((uint64_t)flags << 48)) * 0x9e3779b97f4a7c15ULL;
+	h ^= (((uint64_t)fg << 24) | bg) * 0xc2b2ae3d27d4eb4fULL;
+	return (h >> 32) & cc->mask;
+}
+
+static bool cell_cache_evict(struct cell_cache *cc, uint32_t frame)
+{
+	struct cell_tile *tile, **iter;
+
+	if (shl_dlist_empty(&cc->lru))
+		return false;
+	tile = shl_dlist_last(&cc->lru, struct cell_tile, list);
+	if (tile->frame == frame)
+		return false;
+
+	iter = &cc->buckets[tile_hash(cc, tile->id, tile->flags, tile->fg, tile->bg)];
+	while (*iter != tile)
+		iter = &(*iter)->next;
+	*iter = tile->next;
+
+	shl_dlist_unlink(&tile->list);
+	cc->size -= tile->size;
+	++cc->evictions;
+	free(tile);
+	return true;
+}
+
+/* Point @req at the blended tile of its glyph and colors, blending it first
+ * if it isn't cached. */
+static void use_tile(struct kmscon_text *txt, struct uterm_video_blend_req *req, uint64_t id,
+		     uint32_t flags)
+{
+	struct bbulk *bb = txt->data;
+	struct cell_cache *cc = bb->tiles;
+	struct cell_tile *tile;
+	uint32_t fg, bg;
+	unsigned int h;
+	size_t size;
+
+	fg = (req->fr << 16) | (req->fg << 8) | req->fb;
+	bg = (req->br << 16) | (req->bg << 8) | req->bb;
+	h = tile_hash(cc, id, flags, fg, bg);
+
+	for (tile = cc->buckets[h]; tile; tile = tile->next) {
+		if (tile->id == id && tile->flags == flags && tile->fg == fg && tile->bg == bg)
+			break;
+	}
+
+	if (tile) {
+		++cc->hits;
+		KMSCON_TEXT_COUNT(txt, tile_hits, 1);
+		shl_dlist_unlink(&tile->list);
+	} else {
+		++cc->misses;
+		KMSCON_TEXT_COUNT(txt, tile_misses, 1);
+
+		size = sizeof(*tile) + (size_t)req->buf->width * req->buf->height * 4;
+		if (size > cc->max_size)
+			return;
+		while (cc->size + size > cc->max_size) {
+			if (!cell_cache_evict(cc, bb->frame))
+				return;
+		}
+
+		tile = malloc(size);
+		if (!tile)
+			return;
+		tile->id = id;
+		tile->flags = flags;
+		tile->fg = fg;
+		tile->bg = bg;
+		tile->size = size;
+		tile->buf.width = req->buf->width;
+		tile->buf.height = req->buf->height;
+		tile->buf.stride = req->buf->width * 4;
+		uterm_blend_to_xrgb32((uint32_t *)tile->buf.data, tile->buf.stride, req);
+
+		tile->next = cc->buckets[h];
+		cc->buckets[h] = tile;
+		cc->size += size;
+	}
+
+	tile->frame = bb->frame;
+	shl_dlist_link(&cc->lru, &tile->list);
+	req->buf = &tile->buf;
+	req->flags = UTERM_BLEND_XRGB32;
+}
+
+/**
+ * kmscon_text_bbulk_set_cell_cache:
+ * @size: Bytes of blended cells each bbulk renderer may keep, 0 to disable
+ *
+ * This takes effect for renderers that are set up afterwards. The cache is only
+ * used on displays without OpenGL that draw XRGB32, which is drm2d.
+ */
+void kmscon_text_bbulk_set_cell_cache(size_t size)
+{
+	cell_cache_size = size;
+}
+
+/**
+ * kmscon_text_bbulk_set_damage_rects:
+ * @num: Most damage rectangles passed to the display per frame, 0 for no limit
+ *
+ * Rectangles beyond that are merged into bounding boxes of their neighbors.
+ */
+void kmscon_text_bbulk_set_damage_rects(unsigned int num)
+{
+	damage_rects_max = num;
+}
+
 static int bbulk_init(struct kmscon_text *txt)
 {
 	struct bbulk *bb;
@@ -97,13 +452,43 @@ static void bbulk_destroy(struct kmscon_text *txt)
 {
 	struct bbulk *bb = txt->data;
 
+	free(bb->arrays);
 	free(bb);
 }
 
+static void mark_damaged(struct bbulk *bb, unsigned int off)
+{
+	unsigned int word = off / 64;
+
+	bb->damaged[word] |= 1ULL << (off % 64);
+	bb->damaged_words[word / 64] |= 1ULL << (word % 64);
+}
+
+/* forgets the damage of the last frame, only the words that have any */
+static void reset_damaged(struct bbulk *bb)
+{
+	unsigned int i, n = SHL_DIV_ROUND_UP(bb->damaged_len, 64);
+	uint64_t words;
+
+	for (i = 0; i < n; ++i) {
+		for (words = bb->damaged_words[i]; words; words &= words - 1)
+			bb->damaged[i * 64 + __builtin_ctzll(words)] = 0;
+		bb->damaged_words[i] = 0;
+	}
+}
+
 static void damage_cell(struct bbulk *bb, unsigned int off)
 {
 	bb->prev[off].id = ID_DAMAGED;
-	bb->damages[off] = true;
+	mark_damaged(bb, off);
+}
+
+/* the cell changed in one of the frames the target buffer missed */
+static bool cell_stale(struct bbulk *bb, unsigned int off)
+{
+	uint32_t d = bb->frame - bb->changed[off];
+
+	return d && d < (uint32_t)bb->age;
 }
 
 static void compute_border(struct kmscon_text *txt)
@@ -120,13 +505,84 @@ static void compute_border(struct kmscon_text *txt)
 	uterm_display_set_cursor_offset(txt->disp, bb->off_x, bb->off_y);
 }
 
+/* returns @num elements of @size at *@pos of @mem and moves *@pos past them */
+static void *carve(uint8_t *mem, size_t *pos, size_t num, size_t size)
+{
+	void *ret = mem ? &mem[*pos] : NULL;
+
+	*pos += (num * size + 15) & ~(size_t)15;
+	return ret;
+}
+
+/*
+ * The per-cell arrays live in one block that is kept over unset, so setting
+ * the renderer again on a session switch, rotation or font change only
+ * allocates when the grid got larger. Lay them out for @cols x @rows in @mem,
+ * or only compute the size of the block if @mem is NULL.
+ */
+static size_t layout_arrays(struct bbulk *bb, uint8_t *mem, unsigned int cols, unsigned int rows)
+{
+	unsigned int words;
+	size_t pos = 0;
+
+	bb->cells = cols * rows;
+	bb->req_total_len = bb->cells + 1; /* + 1 for the mouse pointer */
+	bb->damaged_len = SHL_DIV_ROUND_UP(bb->cells, 64);
+	words = SHL_DIV_ROUND_UP(bb->damaged_len, 64);
+	bb->open_size = SHL_DIV_ROUND_UP(cols, DAMAGE_MERGE_LEN + 1);
+
+	bb->reqs = carve(mem, &pos, bb->req_total_len, sizeof(*bb->reqs));
+	bb->prev = carve(mem, &pos, bb->cells, sizeof(*bb->prev));
+	bb->damaged = carve(mem, &pos, bb->damaged_len + words, sizeof(*bb->damaged));
+	bb->damaged_words = mem ? &bb->damaged[bb->damaged_len] : NULL;
+	bb->changed = carve(mem, &pos, bb->cells, sizeof(*bb->changed));
+	bb->copy_rects = carve(mem, &pos, bb->cells, sizeof(*bb->copy_rects));
+	bb->damage_rects = carve(mem, &pos, bb->open_size * rows, sizeof(*bb->damage_rects));
+	bb->damage_open = carve(mem, &pos, 2 * bb->open_size, sizeof(*bb->damage_open));
+	bb->pending = carve(mem, &pos, bb->cells, sizeof(*bb->pending));
+	bb->slots = carve(mem, &pos, bb->cells, sizeof(*bb->slots));
+	bb->old_hash = carve(mem, &pos, 2 * rows, sizeof(*bb->old_hash));
+	bb->new_hash = mem ? &bb->old_hash[rows] : NULL;
+	/* a span holds at most the glyphs of the requests it replaces */
+	bb->span_bufs = carve(mem, &pos, bb->req_total_len, sizeof(*bb->span_bufs));
+
+	return pos;
+}
+
+/*
+ * Glyph caches are not locked, so they are only shared between the renderers
+ * drawing on the thread that got them. Whenever another thread takes over the
+ * drawing, like the render thread of the terminal, it gets a cache of its own.
+ */
+static int get_glyphs(struct kmscon_text *txt)
+{
+	struct bbulk *bb = txt->data;
+	struct kmscon_glyph_cache *glyphs;
+	int ret;
+
+	/* cache size should be at least bb->cells large, rotation keeps the area */
+	ret = kmscon_glyph_cache_get_shared(&glyphs, txt->font, 2 * bb->cells,
+					    sizeof(struct kmscon_glyph) +
+						    2 * FONT_WIDTH(txt) * FONT_HEIGHT(txt));
+	if (ret)
+		return ret;
+
+	kmscon_glyph_cache_unref(bb->glyphs);
+	bb->glyphs = glyphs;
+	bb->glyphs_thread = pthread_self();
+	return 0;
+}
+
 static int bbulk_set(struct kmscon_text *txt)
 {
 	struct bbulk *bb = txt->data;
-	int max_damage_rects;
+	uint8_t *arrays = bb->arrays;
+	size_t arrays_size = bb->arrays_size, size;
 	int i;
 
 	memset(bb, 0, sizeof(*bb));
+	bb->arrays = arrays;
+	bb->arrays_size = arrays_size;
 
 	bb->sw = uterm_display_get_width(txt->disp);
 	bb->sh = uterm_display_get_height(txt->disp);
@@ -145,97 +601,134 @@ static int bbulk_set(struct kmscon_text *txt)
 	txt->rows = txt->max_rows;
 	compute_border(txt);
 
-	bb->cells = txt->max_cols * txt->max_rows;
-	bb->req_total_len = bb->cells + 1; /* + 1 for the mouse pointer */
-	max_damage_rects = SHL_DIV_ROUND_UP(txt->max_cols, DAMAGE_MERGE_LEN + 1) * txt->max_rows;
-
-	bb->reqs = malloc(sizeof(*bb->reqs) * bb->req_total_len);
-	if (!bb->reqs)
-		return -ENOMEM;
-	memset(bb->reqs, 0, sizeof(*bb->reqs) * bb->req_total_len);
-
-	bb->prev = malloc(sizeof(*bb->prev) * bb->cells);
-	if (!bb->prev)
-		goto free_reqs;
-	memset(bb->prev, 0, sizeof(*bb->prev) * bb->cells);
-
-	bb->damages = malloc(sizeof(*bb->damages) * bb->cells);
-	if (!bb->damages)
-		goto free_prev;
-
-	bb->damage_rects = malloc(sizeof(*bb->damage_rects) * max_damage_rects);
-	if (!bb->damage_rects)
-		goto free_damages;
+	size = layout_arrays(bb, NULL, txt->max_cols, txt->max_rows);
+	if (size > bb->arrays_size) {
+		free(bb->arrays);
+		bb->arrays_size = 0;
+		bb->arrays = malloc(size);
+		if (!bb->arrays)
+			return -ENOMEM;
+		bb->arrays_size = size;
+	}
+	layout_arrays(bb, bb->arrays, txt->max_cols, txt->max_rows);
+	memset(bb->arrays, 0, size);
 
 	for (i = 0; i < (int)bb->cells; i++)
 		damage_cell(bb, i);
+	/* the buffers show whatever was there before */
+	bb->redraw = true;
 
-	/* lru size should be at least bb->cells large */
-	bb->glyphs = shl_lru_new(2 * bb->cells);
-	if (!bb->glyphs)
-		goto free_r_damages;
-	return 0;
+	bb->images = !uterm_display_has_opengl(txt->disp);
 
-free_r_damages:
-	free(bb->damage_rects);
-free_damages:
-	free(bb->damages);
-free_prev:
-	free(bb->prev);
-free_reqs:
-	free(bb->reqs);
-	return -ENOMEM;
+	if (get_glyphs(txt))
+		return -ENOMEM;
+
+	if (cell_cache_size && uterm_display_is_drm(txt->disp) &&
+	    !uterm_display_has_opengl(txt->disp) &&
+	    cell_cache_new(&bb->tiles, cell_cache_size,
+			   sizeof(struct cell_tile) + FONT_WIDTH(txt) * FONT_HEIGHT(txt) * 4))
+		log_warning("cannot allocate the cell cache, blending every cell");
+	return 0;
 }
 
+/* the arrays are kept for the next bbulk_set() */
 static void bbulk_unset(struct kmscon_text *txt)
 {
 	struct bbulk *bb = txt->data;
 
-	shl_lru_free(bb->glyphs);
-	free(bb->damage_rects);
-	free(bb->reqs);
-	free(bb->damages);
-	free(bb->prev);
+	cell_cache_free(bb->tiles);
+	kmscon_glyph_cache_unref(bb->glyphs);
+	free(bb->band_reqs);
+	bb->tiles = NULL;
 	bb->glyphs = NULL;
-	bb->damage_rects = NULL;
-	bb->reqs = NULL;
-	bb->damages = NULL;
-	bb->prev = NULL;
+	bb->band_reqs = NULL;
 }
 
+/*
+ * If only the number of rows changed, the columns stay where they are on
+ * screen and the rows both grids have are moved along with the border in the
+ * next frame, see move_resized(). Only the new rows are drawn. Other resizes
+ * move every cell sideways, so everything is redrawn.
+ */
 static void bbulk_resize(struct kmscon_text *txt, unsigned int cols, unsigned int rows)
 {
 	struct bbulk *bb = txt->data;
+	unsigned int i, keep = 0;
+
+	if (cols == txt->cols && rows == txt->rows)
+		return;
+
+	/* a second resize before the frame would have to move twice */
+	if (cols == txt->cols && !bb->redraw && !bb->resize_rows &&
+	    (txt->orientation == OR_NORMAL || txt->orientation == OR_UPSIDE_DOWN)) {
+		keep = min(rows, txt->rows);
+		for (i = txt->rows * cols; i < rows * cols; ++i)
+			damage_cell(bb, i);
+	}
 
+	bb->resize_off_y = bb->off_y;
 	txt->cols = cols;
 	txt->rows = rows;
 	compute_border(txt);
-	bb->redraw = 2;
+
+	bb->resize_rows = keep;
+	if (!keep)
+		bb->redraw = true;
 }
 
 static int bbulk_rotate(struct kmscon_text *txt, enum Orientation orientation)
 {
+	struct bbulk *bb = txt->data;
+	struct kmscon_glyph_cache *glyphs = bb->glyphs;
+	int ret;
+
+	/* hold the glyph cache so it survives, other orientations stay cached */
+	kmscon_glyph_cache_ref(glyphs);
 	bbulk_unset(txt);
 	txt->orientation = orientation;
-	return bbulk_set(txt);
+	ret = bbulk_set(txt);
+	kmscon_glyph_cache_unref(glyphs);
+	return ret;
+}
+
+/* pixel @x of the row at @row of @buf as alpha */
+static uint8_t glyph_alpha(const struct uterm_video_buffer *buf, const uint8_t *row,
+			   unsigned int x)
+{
+	if (buf->format == UTERM_FORMAT_MONO)
+		return (row[x / 8] & (0x80 >> (x % 8))) ? 0xff : 0x00;
+	return row[x];
+}
+
+/* pixel @x of the row at @row of @buf to pixel @i of @dst */
+static void put_pixel(uint8_t *dst, unsigned int i, const struct uterm_video_buffer *buf,
+		      const uint8_t *row, unsigned int x)
+{
+	if (buf->format == UTERM_FORMAT_ARGB32)
+		((uint32_t *)dst)[i] = ((const uint32_t *)row)[x];
+	else
+		dst[i] = glyph_alpha(buf, row, x);
 }
 
 /*
  * Rotate a glyph to the given orientation
- * Return a new rotated glyph, and free the original glyph
+ * Return a new rotated glyph, or NULL on failure. The rotated glyph has one
+ * byte of alpha per pixel, or stays UTERM_FORMAT_ARGB32 if it is a color one.
  */
-static struct kmscon_glyph *bbulk_rotate_glyph(struct kmscon_glyph *glyph,
+static struct kmscon_glyph *bbulk_rotate_glyph(const struct kmscon_glyph *glyph,
 					       enum Orientation orientation)
 {
-	struct uterm_video_buffer *buf = &glyph->buf;
+	const struct uterm_video_buffer *buf = &glyph->buf;
 	struct kmscon_glyph *rglyph;
 	int width, height, i, j;
-	uint8_t *dst, *src;
-	unsigned int size = sizeof(*rglyph) + glyph->buf.width * glyph->buf.height;
+	uint8_t *dst;
+	const uint8_t *src;
+	unsigned int bpp = buf->format == UTERM_FORMAT_ARGB32 ? 4 : 1;
+	unsigned int size = sizeof(*rglyph) + glyph->buf.width * glyph->buf.height * bpp;
 
 	rglyph = malloc(size);
 	if (!rglyph)
-		goto err_free;
+		return NULL;
 
 	memset(rglyph, 0, size);
 
@@ -257,7 +750,7 @@ static struct kmscon_glyph *bbulk_rotate_glyph(struct kmscon_glyph *glyph,
 	case OR_RIGHT:
 		for (i = 0; i < buf->height; i++) {
 			for (j = 0; j < buf->width; j++) {
-				dst[j * width + (width - i - 1)] = src[j];
+				put_pixel(dst, j * width + (width - i - 1), buf, src, j);
 			}
 			src += buf->stride;
 		}
@@ -266,63 +759,120 @@ static struct kmscon_glyph *bbulk_rotate_glyph(struct kmscon_glyph *glyph,
 		src += (buf->height - 1) * buf->stride;
 		for (i = 0; i < buf->height; i++) {
 			for (j = 0; j < buf->width; j++)
-				dst[j] = src[buf->width - j - 1];
-			dst += width;
+				put_pixel(dst, j, buf, src, buf->width - j - 1);
+			dst += width * bpp;
 			src -= buf->stride;
 		}
 		break;
 	case OR_LEFT:
 		for (i = 0; i < buf->height; i++) {
 			for (j = 0; j < buf->width; j++) {
-				dst[(height - j - 1) * width + i] = src[j];
+				put_pixel(dst, (height - j - 1) * width + i, buf, src, j);
 			}
 			src += buf->stride;
 		}
 	}
 	rglyph->buf.width = width;
 	rglyph->buf.height = height;
-	rglyph->buf.stride = width;
+	rglyph->buf.stride = width * bpp;
+	rglyph->buf.format = bpp == 4 ? UTERM_FORMAT_ARGB32 : UTERM_FORMAT_GREY;
 	rglyph->double_width = glyph->double_width;
 
-err_free:
-	free(glyph);
 	return rglyph;
 }
 
+static unsigned int glyph_style(const struct tsm_screen_attr *attr)
+{
+	unsigned int style = 0;
+
+	if (attr->bold)
+		style |= KMSCON_GLYPH_BOLD;
+	if (attr->italic)
+		style |= KMSCON_GLYPH_ITALIC;
+	if (attr->underline)
+		style |= KMSCON_GLYPH_UNDERLINE;
+
+	return style;
+}
+
+static uint32_t glyph_flags(struct kmscon_text *txt, const struct tsm_screen_attr *attr)
+{
+	return glyph_style(attr) | KMSCON_GLYPH_ORIENTATION(txt->orientation);
+}
+
+/* the attributes that make a difference on screen, the colors as rgb */
+static uint64_t pack_attr(const struct tsm_screen_attr *attr)
+{
+	return (uint64_t)attr->fr | (uint64_t)attr->fg << 8 | (uint64_t)attr->fb << 16 |
+	       (uint64_t)attr->br << 24 | (uint64_t)attr->bg << 32 | (uint64_t)attr->bb << 40 |
+	       (uint64_t)attr->bold << 48 | (uint64_t)attr->italic << 49 |
+	       (uint64_t)attr->underline << 50 | (uint64_t)attr->inverse << 51;
+}
+
+static void unpack_attr(struct tsm_screen_attr *attr, uint64_t a)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->fr = a;
+	attr->fg = a >> 8;
+	attr->fb = a >> 16;
+	attr->br = a >> 24;
+	attr->bg = a >> 32;
+	attr->bb = a >> 40;
+	attr->bold = a >> 48;
+	attr->italic = a >> 49;
+	attr->underline = a >> 50;
+	attr->inverse = a >> 51;
+}
+
 static struct kmscon_glyph *find_glyph(struct kmscon_text *txt, uint64_t id, const uint32_t *ch,
 				       size_t len, const struct tsm_screen_attr *attr)
 {
 	struct bbulk *bb = txt->data;
-	struct kmscon_glyph *glyph;
+	struct kmscon_glyph *glyph, *upright;
 	struct kmscon_font *font = txt->font;
 	const uint32_t replacement_char = 0xfffd;
+	unsigned int style = glyph_style(attr);
+	uint32_t flags = style | KMSCON_GLYPH_ORIENTATION(txt->orientation);
 
-	font->attr.underline = !!attr->underline;
-	font->attr.italic = !!attr->italic;
-	font->attr.bold = !!attr->bold;
-
-	if (len == 1 && !kmscon_font_has_glyph(font, ch, len)) {
+	/* symbols without a glyph are never cached under their own id, so a hit
+	 * doesn't need to ask the font */
+	glyph = kmscon_glyph_cache_get(bb->glyphs, id, flags);
+	if (!glyph && len == 1 && !kmscon_font_has_glyph_styled(font, ch, len, style)) {
 		id = (id & ~0xffffffff) | replacement_char;
 		ch = &replacement_char;
-		len = 1;
+		glyph = kmscon_glyph_cache_get(bb->glyphs, id, flags);
 	}
-
-	glyph = shl_lru_get(bb->glyphs, id);
-	if (glyph)
+	if (glyph) {
+		KMSCON_TEXT_COUNT(txt, glyph_hits, 1);
 		return glyph;
+	}
+	KMSCON_TEXT_COUNT(txt, glyph_misses, 1);
+
+	/* glyphs cached before a rotation, or prerendered, are rotated without
+	 * asking the font again */
+	if (txt->orientation != OR_NORMAL) {
+		upright = kmscon_glyph_cache_get(bb->glyphs, id, style);
+		if (upright) {
+			glyph = bbulk_rotate_glyph(upright, txt->orientation);
+			return kmscon_glyph_cache_insert(bb->glyphs, id, flags, glyph);
+		}
+	}
 
-	glyph = kmscon_font_render(font, id, ch, len);
+	KMSCON_TEXT_TIME_BEGIN(txt, raster_time);
+	glyph = kmscon_font_render_styled(font, id, ch, len, style);
+	KMSCON_TEXT_TIME_END(txt, raster_time);
 	if (!glyph)
 		return NULL;
 
-	if (txt->orientation != OR_NORMAL)
-		glyph = bbulk_rotate_glyph(glyph, txt->orientation);
-
-	if (shl_lru_insert(bb->glyphs, id, glyph)) {
-		free(glyph);
-		return NULL;
+	if (txt->orientation != OR_NORMAL) {
+		upright = glyph;
+		glyph = bbulk_rotate_glyph(upright, txt->orientation);
+		free(upright);
+		if (!glyph)
+			return NULL;
 	}
-	return glyph;
+
+	return kmscon_glyph_cache_insert(bb->glyphs, id, flags, glyph);
 }
 
 /*
@@ -374,63 +924,274 @@ static void set_color(struct uterm_video_blend_req *req, const struct tsm_screen
 	}
 }
 
-static int bbulk_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
-		      unsigned int width, unsigned int posx, unsigned int posy,
-		      const struct tsm_screen_attr *attr)
+/* size of a cell on the display */
+static void cell_size(struct kmscon_text *txt, unsigned int *w, unsigned int *h)
+{
+	if (txt->orientation == OR_NORMAL || txt->orientation == OR_UPSIDE_DOWN) {
+		*w = FONT_WIDTH(txt);
+		*h = FONT_HEIGHT(txt);
+	} else {
+		*w = FONT_HEIGHT(txt);
+		*h = FONT_WIDTH(txt);
+	}
+}
+
+/*
+ * Restore @num cells starting at @posx from the last drawn frame. Neighbouring
+ * cells are merged into one rectangle.
+ */
+static void copy_cells(struct kmscon_text *txt, unsigned int posx, unsigned int posy,
+		       unsigned int num)
 {
 	struct bbulk *bb = txt->data;
-	struct kmscon_glyph *glyph;
+	struct uterm_video_rect r, *last;
+	unsigned int x1, y1, x2, y2, w, h, i;
+
+	cell_size(txt, &w, &h);
+	set_coordinate(txt, &x1, &y1, posx, posy);
+	set_coordinate(txt, &x2, &y2, posx + num - 1, posy);
+	r.x1 = min(x1, x2);
+	r.y1 = min(y1, y2);
+	r.x2 = max(x1, x2) + w;
+	r.y2 = max(y1, y2) + h;
+
+	for (i = 0; i < num; ++i)
+		mark_damaged(bb, posx + i + posy * txt->cols);
+
+	if (bb->copy_len) {
+		last = &bb->copy_rects[bb->copy_len - 1];
+		if (last->y1 == r.y1 && last->y2 == r.y2 && (last->x2 == r.x1 || r.x2 == last->x1)) {
+			last->x1 = min(last->x1, r.x1);
+			last->x2 = max(last->x2, r.x2);
+			return;
+		}
+		if (last->x1 == r.x1 && last->x2 == r.x2 && (last->y2 == r.y1 || r.y2 == last->y1)) {
+			last->y1 = min(last->y1, r.y1);
+			last->y2 = max(last->y2, r.y2);
+			return;
+		}
+	}
+	bb->copy_rects[bb->copy_len++] = r;
+}
+
+static unsigned int req_width(const struct uterm_video_blend_req *req)
+{
+	return (req->flags & UTERM_BLEND_SPAN) ? req->width : req->buf->width;
+}
+
+static unsigned int req_height(const struct uterm_video_blend_req *req)
+{
+	return (req->flags & UTERM_BLEND_SPAN) ? req->height : req->buf->height;
+}
+
+/*
+ * Merge the glyph just added to reqs into the request before it, if that is a
+ * glyph or span of the same colors that ends where it starts. A row of text
+ * then needs a single request, blended one display row at a time.
+ * Only left to right works, so this is for the normal orientation.
+ */
+static void merge_span(struct bbulk *bb)
+{
+	struct uterm_video_blend_req *req, *last;
+
+	if (bb->req_len < 2)
+		return;
+	req = &bb->reqs[bb->req_len - 1];
+	last = req - 1;
+
+	if (req->flags || (last->flags && last->flags != UTERM_BLEND_SPAN) ||
+	    (!last->flags && !last->buf))
+		return;
+	if (last->y != req->y || last->x + req_width(last) != req->x ||
+	    req_height(last) != req->buf->height)
+		return;
+	if (last->fr != req->fr || last->fg != req->fg || last->fb != req->fb ||
+	    last->br != req->br || last->bg != req->bg || last->bb != req->bb)
+		return;
+
+	if (!last->flags) {
+		last->bufs = &bb->span_bufs[bb->span_len];
+		last->buf_num = 1;
+		last->width = last->buf->width;
+		last->height = last->buf->height;
+		last->flags = UTERM_BLEND_SPAN;
+		bb->span_bufs[bb->span_len++] = last->buf;
+		last->buf = NULL;
+	}
+	bb->span_bufs[bb->span_len++] = req->buf;
+	++last->buf_num;
+	last->width += req->buf->width;
+	--bb->req_len;
+}
+
+/* a cell that shows nothing but its background */
+static bool cell_blank(const uint32_t *ch, size_t len, unsigned int width,
+		       const struct tsm_screen_attr *attr)
+{
+	return width == 1 && !attr->underline && (!len || (len == 1 && *ch == ' '));
+}
+
+/*
+ * Fill a blank cell with its background. Fills of the same color that continue
+ * the last one are merged, so a run of blank cells is a single request.
+ */
+static void draw_blank(struct kmscon_text *txt, unsigned int posx, unsigned int posy,
+		       const struct tsm_screen_attr *attr)
+{
+	struct bbulk *bb = txt->data;
+	struct uterm_video_blend_req *req, *last;
+
+	req = &bb->reqs[bb->req_len];
+	set_coordinate(txt, &req->x, &req->y, posx, posy);
+	cell_size(txt, &req->width, &req->height);
+	req->buf = NULL;
+	req->flags = UTERM_BLEND_FILL;
+	set_color(req, attr);
+
+	if (bb->req_len) {
+		last = req - 1;
+		if (!(last->flags & UTERM_BLEND_FILL) || last->br != req->br ||
+		    last->bg != req->bg || last->bb != req->bb) {
+			++bb->req_len;
+			return;
+		}
+		if (last->y == req->y && last->height == req->height) {
+			if (last->x + last->width == req->x) {
+				last->width += req->width;
+				return;
+			}
+			if (req->x + req->width == last->x) {
+				last->x = req->x;
+				last->width += req->width;
+				return;
+			}
+		}
+		if (last->x == req->x && last->width == req->width) {
+			if (last->y + last->height == req->y) {
+				last->height += req->height;
+				return;
+			}
+			if (req->y + req->height == last->y) {
+				last->y = req->y;
+				last->height += req->height;
+				return;
+			}
+		}
+	}
+	++bb->req_len;
+}
+
+/*
+ * Copy the tile of an inline image cell, whose foreground color is the image
+ * id. If the image was dropped, or decoded for another cell size, or the cell
+ * is rotated, the cell shows its background.
+ */
+static void draw_image(struct kmscon_text *txt, unsigned int posx, unsigned int posy,
+		       unsigned int col, unsigned int row, const struct tsm_screen_attr *attr)
+{
+	struct bbulk *bb = txt->data;
+	const struct uterm_video_buffer *tile = NULL;
+	struct uterm_video_blend_req *req;
+	struct tsm_screen_attr blank;
+
+	if (bb->images && txt->orientation == OR_NORMAL)
+		tile = kmscon_image_get_tile(txt->images, attr->fr << 16 | attr->fg << 8 | attr->fb,
+					     col, row);
+	if (!tile || tile->width != FONT_WIDTH(txt) || tile->height != FONT_HEIGHT(txt)) {
+		blank = *attr;
+		blank.inverse = 0;
+		draw_blank(txt, posx, posy, &blank);
+		return;
+	}
+
+	req = &bb->reqs[bb->req_len++];
+	set_coordinate(txt, &req->x, &req->y, posx, posy);
+	req->buf = tile;
+	req->flags = UTERM_BLEND_XRGB32;
+}
+
+static int draw_cell(struct kmscon_text *txt, const struct bbpending *p)
+{
+	struct bbulk *bb = txt->data;
+	const struct tsm_screen_attr *attr = &p->attr;
+	const uint32_t *ch = p->ch;
+	uint64_t id = p->id;
+	size_t len = p->len;
+	unsigned int width = p->width, posx = p->posx, posy = p->posy;
+	struct kmscon_glyph *glyph = p->glyph;
 	struct uterm_video_blend_req *req;
 	struct bbcell *prev;
 	unsigned int offset = posx + posy * txt->cols;
 	bool last_col = (posx == txt->cols - 1);
+	uint64_t key = pack_attr(attr);
+	unsigned int col, row;
+	bool wide;
 
 	if (!width)
 		return 0;
 
-	if (!len && posx && bb->prev[offset - 1].overflow)
+	if (!len && posx && (bb->prev[offset - 1].attr & CELL_OVERFLOW))
 		return 0;
 
 	prev = &bb->prev[offset];
-
-	if (prev->id == id && !memcmp(&prev->attr, attr, sizeof(*attr))) {
-		if ((prev->overflow || width == 2) && !last_col) {
-			if (bb->damages[offset] || bb->damages[offset + 1] ||
-			    bb->prev[offset + 1].id == ID_DAMAGED) {
-				bb->damages[offset] = false;
-				if (bb->prev[offset + 1].id == ID_OVERFLOW)
-					bb->damages[offset + 1] = false;
-				bb->prev[offset + 1].id = ID_OVERFLOW;
-			} else {
+	wide = ((prev->attr & CELL_OVERFLOW) || width == 2) && !last_col;
+
+	if (prev->id == id && (prev->attr & CELL_ATTR) == key) {
+		if (wide && bb->prev[offset + 1].id == ID_DAMAGED) {
+			/* something drew over the right half */
+			bb->changed[offset] = bb->frame;
+			bb->changed[offset + 1] = bb->frame;
+			bb->prev[offset + 1].id = ID_OVERFLOW;
+		} else if (wide) {
+			if (!cell_stale(bb, offset) && !cell_stale(bb, offset + 1))
+				return 0;
+			if (bb->copy) {
+				copy_cells(txt, posx, posy, 2);
 				return 0;
 			}
 		} else {
-			if (!bb->damages[offset])
+			if (!cell_stale(bb, offset))
 				return 0;
-			bb->damages[offset] = false;
+			if (bb->copy) {
+				copy_cells(txt, posx, posy, 1);
+				return 0;
+			}
 		}
 	} else {
-		bb->damages[offset] = true;
-		if ((prev->overflow || width == 2) && !last_col)
+		bb->changed[offset] = bb->frame;
+		if (wide)
 			damage_cell(bb, offset + 1);
 	}
+	mark_damaged(bb, offset);
 
 	prev->id = id;
-	memcpy(&prev->attr, attr, sizeof(*attr));
+	prev->attr = key;
+
+	if (p->image && kmscon_image_cell(*ch, &col, &row)) {
+		prev->attr |= CELL_IMAGE;
+		draw_image(txt, posx, posy, col, row, attr);
+		return 0;
+	}
+
+	if (cell_blank(ch, len, width, attr)) {
+		prev->attr |= CELL_BLANK;
+		draw_blank(txt, posx, posy, attr);
+		return 0;
+	}
 
-	glyph = find_glyph(txt, id, ch, len, attr);
 	if (!glyph)
 		return -ENOMEM;
 
 	if (glyph->double_width && !last_col) {
-		prev->overflow = true;
-		bb->prev[offset + 1].overflow = false;
-	} else
-		prev->overflow = false;
+		prev->attr |= CELL_OVERFLOW;
+		bb->prev[offset + 1].attr &= ~CELL_OVERFLOW;
+		mark_damaged(bb, offset + 1);
+	}
 
 	req = &bb->reqs[bb->req_len++];
 
-	if (prev->overflow && (txt->orientation == OR_LEFT || txt->orientation == OR_UPSIDE_DOWN))
+	if ((prev->attr & CELL_OVERFLOW) &&
+	    (txt->orientation == OR_LEFT || txt->orientation == OR_UPSIDE_DOWN))
 		/*
 		 * In case of left or upside down orientation, we need to draw to the
 		 * next cell, as the glyph is already rotated, so start on the next cell
@@ -441,37 +1202,384 @@ static int bbulk_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch,
 		set_coordinate(txt, &req->x, &req->y, posx, posy);
 
 	req->buf = &glyph->buf;
+	req->flags = 0;
 	set_color(req, attr);
+	if (bb->tiles)
+		use_tile(txt, req, id, glyph_flags(txt, attr));
+	if (txt->orientation == OR_NORMAL)
+		merge_span(bb);
 
 	if (width == 2 && !glyph->double_width && !last_col) {
 		/* libtsm thinks this glyph is wide, but the font uses a single
 		 * width character. So draw a space on next cell to avoid a
 		 * graphical glitch
 		 */
-		glyph = find_glyph(txt, ' ', NULL, 0, attr);
+		glyph = p->space;
 		if (!glyph)
 			return -ENOMEM;
 
 		req = &bb->reqs[bb->req_len++];
 		set_coordinate(txt, &req->x, &req->y, posx + 1, posy);
 		req->buf = &glyph->buf;
+		req->flags = 0;
 		set_color(req, attr);
+		if (bb->tiles)
+			use_tile(txt, req, ' ', glyph_flags(txt, attr));
+		if (txt->orientation == OR_NORMAL)
+			merge_span(bb);
+		mark_damaged(bb, offset + 1);
+		/* libtsm doesn't tell us about the right half */
+		bb->prev[offset + 1].id = ID_OVERFLOW;
 	}
 	return 0;
 }
 
 /*
- * When the pointer move over, mark the 4 underlying cells as damaged.
+ * Cells are drawn in bbulk_render(), after scrolling. Their glyphs are looked up
+ * here already, as bbulk_render() may run on a render worker and the glyph
+ * cache belongs to the thread drawing the frame.
  */
-static void mark_damaged(struct kmscon_text *txt, struct bbulk *bb, unsigned int x, unsigned int y)
+static void queue_cell(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
+		       unsigned int width, unsigned int posx, unsigned int posy,
+		       const struct tsm_screen_attr *attr)
 {
-	unsigned int posx = 0;
-	unsigned int posy = 0;
-	unsigned int fw, fh, off;
-	fw = SHL_DIV_ROUND_UP(FONT_WIDTH(txt), 2);
-	fh = SHL_DIV_ROUND_UP(FONT_HEIGHT(txt), 2);
+	struct bbulk *bb = txt->data;
+	struct bbpending *p;
+	unsigned int col, row;
+
+	p = &bb->pending[bb->pending_len];
+	bb->slots[posx + posy * txt->cols] = bb->pending_len++;
+	p->id = id;
+	if (len == 1) {
+		p->c = *ch;
+		p->ch = &p->c;
+	} else {
+		p->ch = ch;
+	}
+	p->len = len;
+	p->width = width;
+	p->posx = posx;
+	p->posy = posy;
+	p->attr = *attr;
+	p->glyph = NULL;
+	p->space = NULL;
+	p->image = len == 1 && attr->fccode < 0 && kmscon_image_cell(*ch, &col, &row) &&
+		   kmscon_image_placed(txt->images, attr->fr << 16 | attr->fg << 8 | attr->fb);
+
+	/* the cells draw_cell() blends a glyph for */
+	if (!width || p->image || cell_blank(ch, len, width, attr))
+		return;
+
+	p->glyph = find_glyph(txt, id, p->ch, len, attr);
+	if (p->glyph && width == 2 && !p->glyph->double_width && posx != txt->cols - 1)
+		p->space = find_glyph(txt, ' ', NULL, 0, attr);
+}
 
-	if (x > fw)
+static int bbulk_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
+		      unsigned int width, unsigned int posx, unsigned int posy,
+		      const struct tsm_screen_attr *attr)
+{
+	struct bbulk *bb = txt->data;
+
+	if (posx >= txt->cols || posy >= txt->rows || bb->pending_len >= bb->cells)
+		return -EINVAL;
+
+	queue_cell(txt, id, ch, len, width, posx, posy, attr);
+	return 0;
+}
+
+static int bbulk_draw_row(struct kmscon_text *txt, unsigned int posy,
+			  const struct kmscon_text_cell *cells, size_t num)
+{
+	struct bbulk *bb = txt->data;
+	const struct kmscon_text_cell *c;
+	size_t i;
+
+	if (posy >= txt->rows || num > bb->cells - bb->pending_len)
+		return -EINVAL;
+
+	for (i = 0; i < num; ++i) {
+		c = &cells[i];
+		if (c->posx >= txt->cols)
+			return -EINVAL;
+		queue_cell(txt, c->id, c->ch, c->len, c->width, c->posx, posy, &c->attr);
+	}
+	return 0;
+}
+
+/* the cell that is drawn at @off in this frame, NULL if it is unchanged */
+static struct bbpending *pending_cell(struct kmscon_text *txt, unsigned int off)
+{
+	struct bbulk *bb = txt->data;
+	unsigned int slot = bb->slots[off];
+	struct bbpending *p;
+
+	if (slot >= bb->pending_len)
+		return NULL;
+	p = &bb->pending[slot];
+	if (p->posx + p->posy * txt->cols != off)
+		return NULL;
+	return p;
+}
+
+static bool cell_unknown(const struct bbcell *cell)
+{
+	return cell->id == ID_DAMAGED || cell->id == ID_OVERFLOW || (cell->attr & CELL_OVERFLOW);
+}
+
+/*
+ * Returns true if row @row of this frame shows what row @src of the frame on
+ * screen shows. Wide glyphs and cells whose content we lost track of never
+ * match.
+ */
+static bool row_moved_from(struct kmscon_text *txt, unsigned int row, unsigned int src)
+{
+	struct bbulk *bb = txt->data;
+	const struct bbcell *old, *cur;
+	const struct bbpending *p;
+	unsigned int x, off;
+
+	for (x = 0; x < txt->cols; ++x) {
+		old = &bb->prev[x + src * txt->cols];
+		if (cell_unknown(old))
+			return false;
+
+		off = x + row * txt->cols;
+		p = pending_cell(txt, off);
+		if (p) {
+			if (p->width != 1 || p->id != old->id ||
+			    pack_attr(&p->attr) != (old->attr & CELL_ATTR))
+				return false;
+		} else {
+			cur = &bb->prev[off];
+			if (cell_unknown(cur) || cur->id != old->id ||
+			    ((cur->attr ^ old->attr) & CELL_ATTR))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* @attr as packed by pack_attr() */
+static uint64_t hash_cell(uint64_t h, uint64_t id, uint64_t attr)
+{
+	h = (h ^ id) * 0x100000001b3ULL;
+	return (h ^ attr) * 0x100000001b3ULL;
+}
+
+/* hash row @row of prev, or of this frame if @drawn is set */
+static uint64_t hash_row(struct kmscon_text *txt, unsigned int row, bool drawn)
+{
+	struct bbulk *bb = txt->data;
+	const struct bbpending *p;
+	const struct bbcell *cell;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned int x, off;
+
+	for (x = 0; x < txt->cols; ++x) {
+		off = x + row * txt->cols;
+		p = drawn ? pending_cell(txt, off) : NULL;
+		if (p) {
+			if (p->width != 1)
+				return 0;
+			h = hash_cell(h, p->id, pack_attr(&p->attr));
+		} else {
+			cell = &bb->prev[off];
+			if (cell_unknown(cell))
+				return 0;
+			h = hash_cell(h, cell->id, cell->attr & CELL_ATTR);
+		}
+	}
+
+	/* 0 means unknown */
+	return h | 1;
+}
+
+/*
+ * Find the longest block of rows that shows rows of the frame on screen at
+ * another position. Rows that stay where they are only count if the block
+ * also moves others, blank lines often match everywhere. Returns the number
+ * of rows in the block, or 0.
+ */
+static unsigned int find_move(struct kmscon_text *txt, unsigned int *top, int *delta)
+{
+	struct bbulk *bb = txt->data;
+	unsigned int rows = txt->rows, r, start, len, moved, best = 0, best_moved = 0;
+	int d;
+
+	for (d = 1 - (int)rows; d < (int)rows; ++d) {
+		if (!d)
+			continue;
+		start = d < 0 ? -d : 0;
+		len = 0;
+		moved = 0;
+		for (r = start; r < rows && (int)r + d < (int)rows; ++r) {
+			if (bb->new_hash[r] && bb->new_hash[r] == bb->old_hash[r + d]) {
+				++len;
+				if (bb->new_hash[r] != bb->old_hash[r])
+					++moved;
+				if (moved > best_moved || (moved == best_moved && len > best)) {
+					best = len;
+					best_moved = moved;
+					*top = r + 1 - len;
+					*delta = d;
+				}
+			} else {
+				len = 0;
+				moved = 0;
+			}
+		}
+	}
+
+	/* moving a single line isn't worth a copy */
+	return best_moved >= 2 ? best : 0;
+}
+
+/* pixel row of the topmost scanline of rows [@top, @top + @num) */
+static unsigned int block_y(struct kmscon_text *txt, unsigned int top, unsigned int num)
+{
+	unsigned int x, y;
+
+	if (txt->orientation == OR_UPSIDE_DOWN)
+		set_coordinate(txt, &x, &y, 0, top + num - 1);
+	else
+		set_coordinate(txt, &x, &y, 0, top);
+	return y;
+}
+
+/* @a and @b show the same */
+static bool same_cell(const struct bbcell *a, const struct bbcell *b)
+{
+	return a->id == b->id && a->attr == b->attr;
+}
+
+/*
+ * Blend the cell at @off again after the cells, it is below an old pointer.
+ * @cell is what it shows and @glyph the glyph of that.
+ */
+static void add_restore(struct bbulk *bb, unsigned int off, const struct bbcell *cell,
+			struct kmscon_glyph *glyph)
+{
+	struct bbrestore *r;
+	unsigned int i;
+
+	for (i = 0; i < bb->restore_len; ++i) {
+		r = &bb->restore[i];
+		if (r->off == off && same_cell(&r->cell, cell))
+			return;
+	}
+	if (bb->restore_len < sizeof(bb->restore) / sizeof(*bb->restore)) {
+		r = &bb->restore[bb->restore_len++];
+		r->off = off;
+		r->cell = *cell;
+		r->glyph = glyph;
+	}
+}
+
+/*
+ * If a block of lines moved up or down, copy it from the frame on screen and
+ * shift prev along, so drawing the cells afterwards only blends the lines
+ * that are new.
+ */
+static void scroll_screen(struct kmscon_text *txt)
+{
+	struct bbulk *bb = txt->data;
+	unsigned int rows = txt->rows, cols = txt->cols;
+	unsigned int r, top = 0, num;
+	struct bbrestore *res;
+	int d = 0;
+
+	if (txt->orientation != OR_NORMAL && txt->orientation != OR_UPSIDE_DOWN)
+		return;
+	if (rows < 3 || bb->pending_len < 2 * cols)
+		return;
+
+	for (r = 0; r < rows; ++r) {
+		bb->old_hash[r] = hash_row(txt, r, false);
+		bb->new_hash[r] = hash_row(txt, r, true);
+	}
+
+	num = find_move(txt, &top, &d);
+	if (!num)
+		return;
+
+	/* don't trust the hashes for what we copy */
+	for (r = top; r < top + num; ++r) {
+		if (!row_moved_from(txt, r, r + d))
+			return;
+	}
+
+	if (uterm_display_fake_move(txt->disp, block_y(txt, top + d, num), block_y(txt, top, num),
+				    num * FONT_HEIGHT(txt)))
+		return;
+
+	/* the moved rows are now up to date in the buffer we draw to */
+	memmove(&bb->prev[top * cols], &bb->prev[(top + d) * cols],
+		sizeof(*bb->prev) * num * cols);
+	for (r = top * cols; r < (top + num) * cols; ++r) {
+		bb->changed[r] = bb->frame;
+		mark_damaged(bb, r);
+	}
+
+	/* a pointer in the moved rows moved along */
+	for (r = bb->restore_len; r--;) {
+		res = &bb->restore[r];
+		if (res->off >= (top + d) * cols && res->off < (top + d + num) * cols)
+			add_restore(bb, res->off - d * cols, &res->cell, res->glyph);
+	}
+}
+
+/*
+ * After a resize that kept the columns, clear the buffer and move the rows both
+ * grids have from the frame on screen to where they are now. prev still holds
+ * what they show, so only the cells that differ are drawn.
+ */
+static void move_resized(struct kmscon_text *txt, const struct tsm_screen_attr *attr)
+{
+	struct bbulk *bb = txt->data;
+	unsigned int keep = bb->resize_rows, dst, i, j;
+	const struct bbtile *tile;
+
+	bb->resize_rows = 0;
+	bb->redraw_frame = bb->frame;
+	bb->resize_frame = bb->frame;
+	uterm_display_clear(txt->disp, attr->br, attr->bg, attr->bb);
+
+	dst = block_y(txt, 0, keep);
+	if (uterm_display_fake_move(txt->disp, dst - bb->off_y + bb->resize_off_y, dst,
+				    keep * FONT_HEIGHT(txt))) {
+		for (i = 0; i < bb->cells; i++)
+			damage_cell(bb, i);
+		return;
+	}
+
+	/* the pointer on screen was moved along */
+	for (i = 0; i < POINTER_HISTORY; ++i) {
+		tile = &bb->pointers[i];
+		for (j = 0; j < tile->num; ++j) {
+			if (tile->cells[j] < bb->cells)
+				damage_cell(bb, tile->cells[j]);
+		}
+	}
+}
+
+/*
+ * The mouse pointer is a tile blended over the cells when rendering, it never
+ * changes what we know about them. Remember the up to 4 cells below it, so the
+ * frames drawn into the same buffer later can blend them again.
+ */
+static void set_pointer_tile(struct kmscon_text *txt, struct bbulk *bb, unsigned int x,
+			     unsigned int y)
+{
+	struct bbtile *tile = &bb->pointers[bb->frame % POINTER_HISTORY];
+	unsigned int posx = 0;
+	unsigned int posy = 0;
+	unsigned int fw, fh, off, i;
+	fw = SHL_DIV_ROUND_UP(FONT_WIDTH(txt), 2);
+	fh = SHL_DIV_ROUND_UP(FONT_HEIGHT(txt), 2);
+
+	if (x > fw)
 		posx = (x - fw) / FONT_WIDTH(txt);
 	if (y > fh)
 		posy = (y - fh) / FONT_HEIGHT(txt);
@@ -484,16 +1592,121 @@ static void mark_damaged(struct kmscon_text *txt, struct bbulk *bb, unsigned int
 
 	off = posx + posy * txt->cols;
 
-	damage_cell(bb, posx + posy * txt->cols);
+	tile->frame = bb->frame;
+	tile->num = 0;
+	tile->cells[tile->num++] = off;
 
 	if (posx + 1 < txt->cols)
-		damage_cell(bb, off + 1);
+		tile->cells[tile->num++] = off + 1;
 
 	if (posy + 1 < txt->rows)
-		damage_cell(bb, off + txt->cols);
+		tile->cells[tile->num++] = off + txt->cols;
 
 	if (posx + 1 < txt->cols && posy + 1 < txt->rows)
-		damage_cell(bb, off + 1 + txt->cols);
+		tile->cells[tile->num++] = off + 1 + txt->cols;
+
+	for (i = 0; i < tile->num; ++i)
+		mark_damaged(bb, tile->cells[i]);
+	bb->pointer_frame = bb->frame;
+}
+
+/*
+ * We know enough about the cell at @off to blend it without libtsm. Its glyph is
+ * stored in @glyph, NULL if it is blank.
+ */
+static bool cell_restorable(struct kmscon_text *txt, unsigned int off, struct kmscon_glyph **glyph)
+{
+	struct bbulk *bb = txt->data;
+	const struct bbcell *cell = &bb->prev[off];
+	struct tsm_screen_attr attr;
+
+	*glyph = NULL;
+	if (cell_unknown(cell) || (off % txt->cols && (bb->prev[off - 1].attr & CELL_OVERFLOW)))
+		return false;
+	if (cell->attr & CELL_BLANK)
+		return true;
+	if (cell->attr & CELL_IMAGE)
+		return false;
+	unpack_attr(&attr, cell->attr);
+	*glyph = kmscon_glyph_cache_get(bb->glyphs, cell->id, glyph_flags(txt, &attr));
+	return *glyph;
+}
+
+/*
+ * Collect the cells below the pointer tiles the target buffer may show. The
+ * ones we cannot blend on our own are damaged, and libtsm has to draw them
+ * again, so false is returned.
+ */
+static bool prepare_pointer(struct kmscon_text *txt)
+{
+	struct bbulk *bb = txt->data;
+	const struct bbtile *tile;
+	struct kmscon_glyph *glyph;
+	unsigned int i, j;
+	uint32_t frame;
+	bool ret = true;
+
+	bb->restore_len = 0;
+	if (bb->redraw_frame == bb->frame)
+		return true;
+
+	for (i = 1; i <= (unsigned int)bb->age; ++i) {
+		frame = bb->frame - i;
+		tile = &bb->pointers[frame % POINTER_HISTORY];
+		if (tile->frame != frame)
+			continue;
+		for (j = 0; j < tile->num; ++j) {
+			if (cell_restorable(txt, tile->cells[j], &glyph)) {
+				add_restore(bb, tile->cells[j], &bb->prev[tile->cells[j]], glyph);
+			} else {
+				damage_cell(bb, tile->cells[j]);
+				ret = false;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Blend the cells below old pointer tiles again, with the glyphs prepare found
+ * for them. Cells drawn in this frame are blended twice, which is cheaper than
+ * telling whether they were copied from a frame showing the pointer. Cells that
+ * changed since prepare were blended over the pointer by draw_cell() already.
+ */
+static void restore_pointer(struct kmscon_text *txt)
+{
+	struct bbulk *bb = txt->data;
+	struct uterm_video_blend_req *req;
+	const struct bbrestore *res;
+	const struct bbcell *cell;
+	struct tsm_screen_attr attr;
+	unsigned int i, off, posx, posy;
+
+	for (i = 0; i < bb->restore_len && bb->req_len + 1 < bb->req_total_len; ++i) {
+		res = &bb->restore[i];
+		off = res->off;
+		cell = &bb->prev[off];
+		if (!same_cell(cell, &res->cell))
+			continue;
+		posx = off % txt->cols;
+		posy = off / txt->cols;
+		mark_damaged(bb, off);
+		unpack_attr(&attr, cell->attr);
+
+		if (cell->attr & CELL_BLANK) {
+			draw_blank(txt, posx, posy, &attr);
+			continue;
+		}
+
+		req = &bb->reqs[bb->req_len++];
+		set_coordinate(txt, &req->x, &req->y, posx, posy);
+		req->buf = &res->glyph->buf;
+		req->flags = 0;
+		set_color(req, &attr);
+		if (bb->tiles)
+			use_tile(txt, req, cell->id, glyph_flags(txt, &attr));
+	}
 }
 
 static unsigned int clamp(unsigned int val, unsigned int min, unsigned int max)
@@ -552,29 +1765,22 @@ static void set_pointer_coordinate(struct bbulk *bb, struct kmscon_text *txt,
 	req->y = y;
 }
 
-static int bbulk_draw_pointer(struct kmscon_text *txt, unsigned int pointer_x,
-			      unsigned int pointer_y)
+static int draw_pointer(struct kmscon_text *txt, unsigned int pointer_x, unsigned int pointer_y)
 {
 	struct bbulk *bb = txt->data;
 	struct uterm_video_blend_req *req;
-	struct kmscon_glyph *bb_glyph;
-	uint32_t ch = 'I';
-	uint64_t id = ch;
 
-	if (bb->req_len >= bb->req_total_len)
+	if (!bb->pointer_glyph || bb->req_len >= bb->req_total_len)
 		return -ENOMEM;
 
 	pointer_x = min(pointer_x, txt->cols * FONT_WIDTH(txt) - (FONT_WIDTH(txt) / 2));
 	pointer_y = min(pointer_y, txt->rows * FONT_HEIGHT(txt) - (FONT_HEIGHT(txt) / 2));
 
 	req = &bb->reqs[bb->req_len++];
-	mark_damaged(txt, bb, pointer_x, pointer_y);
+	set_pointer_tile(txt, bb, pointer_x, pointer_y);
 
-	bb_glyph = find_glyph(txt, id, &ch, 1, &bb->attr);
-	if (!bb_glyph)
-		return -ENOMEM;
-
-	req->buf = &bb_glyph->buf;
+	req->buf = &bb->pointer_glyph->buf;
+	req->flags = 0;
 	set_pointer_coordinate(bb, txt, req, pointer_x, pointer_y);
 
 	req->fr = bb->attr.fr;
@@ -586,6 +1792,20 @@ static int bbulk_draw_pointer(struct kmscon_text *txt, unsigned int pointer_x,
 	return 0;
 }
 
+static int bbulk_draw_pointer(struct kmscon_text *txt, unsigned int pointer_x,
+			      unsigned int pointer_y)
+{
+	struct bbulk *bb = txt->data;
+	uint32_t ch = 'I';
+
+	/* drawn on top of the cells in bbulk_render(), see queue_cell() */
+	bb->pointer_glyph = find_glyph(txt, ch, &ch, 1, &bb->attr);
+	bb->pointer = true;
+	bb->pointer_x = pointer_x;
+	bb->pointer_y = pointer_y;
+	return 0;
+}
+
 static void add_damage(struct bbulk *bb, struct uterm_video_rect *r)
 {
 	struct uterm_video_rect *out = &bb->damage_rects[bb->damage_rect_len];
@@ -594,28 +1814,97 @@ static void add_damage(struct bbulk *bb, struct uterm_video_rect *r)
 	bb->damage_rect_len++;
 }
 
-static void merge_damage(struct bbulk *bb, struct uterm_video_rect *r)
+static void union_rect(struct uterm_video_rect *out, const struct uterm_video_rect *r)
 {
-	struct uterm_video_rect *out = &bb->damage_rects[bb->damage_rect_len - 1];
-
 	out->x1 = min(out->x1, r->x1);
 	out->x2 = max(out->x2, r->x2);
 	out->y1 = min(out->y1, r->y1);
 	out->y2 = max(out->y2, r->y2);
 }
 
+static void merge_damage(struct bbulk *bb, struct uterm_video_rect *r)
+{
+	union_rect(&bb->damage_rects[bb->damage_rect_len - 1], r);
+}
+
+/* true if @a and @b share a complete edge, so their union is a rectangle */
+static bool rects_adjacent(const struct uterm_video_rect *a, const struct uterm_video_rect *b)
+{
+	if (a->x1 == b->x1 && a->x2 == b->x2)
+		return a->y2 == b->y1 || b->y2 == a->y1;
+	if (a->y1 == b->y1 && a->y2 == b->y2)
+		return a->x2 == b->x1 || b->x2 == a->x1;
+	return false;
+}
+
+/*
+ * The rects from @start on are those of the row just done. Each one that
+ * continues a rect reaching the previous row is merged into it, so a block of
+ * changed lines becomes a single rect. Rows and the rects within them come in
+ * the same order, so the search goes on after the last match.
+ */
+static void merge_rows(struct bbulk *bb, unsigned int start)
+{
+	unsigned int *open = bb->damage_open;
+	unsigned int *next = &bb->damage_open[bb->open_size];
+	unsigned int i, k, c = 0, len = start, num = 0;
+	struct uterm_video_rect *r;
+
+	for (i = start; i < bb->damage_rect_len; ++i) {
+		r = &bb->damage_rects[i];
+		for (k = c; k < bb->open_len; ++k) {
+			if (rects_adjacent(&bb->damage_rects[open[k]], r))
+				break;
+		}
+		if (k < bb->open_len) {
+			union_rect(&bb->damage_rects[open[k]], r);
+			next[num++] = open[k];
+			c = k + 1;
+		} else {
+			bb->damage_rects[len] = *r;
+			next[num++] = len++;
+		}
+	}
+
+	bb->damage_rect_len = len;
+	memcpy(open, next, sizeof(*open) * num);
+	bb->open_len = num;
+}
+
+/* Too many rects cost drivers more than the area they save, so neighbors are
+ * joined into their bounding box until at most damage_rects_max are left. */
+static void limit_damage(struct bbulk *bb)
+{
+	unsigned int i, n, group;
+
+	if (!damage_rects_max || bb->damage_rect_len <= damage_rects_max)
+		return;
+
+	group = SHL_DIV_ROUND_UP(bb->damage_rect_len, damage_rects_max);
+	for (i = 0, n = 0; i < bb->damage_rect_len; ++i) {
+		if (i % group)
+			union_rect(&bb->damage_rects[n - 1], &bb->damage_rects[i]);
+		else
+			bb->damage_rects[n++] = bb->damage_rects[i];
+	}
+	bb->damage_rect_len = n;
+}
+
 /*
  * Simple merge algorithm, on each line, if two damaged cells are less than
- * DAMAGE_MERGE_LEN away, include the two cells in one damage rectangle.
+ * DAMAGE_MERGE_LEN away, include the two cells in one damage rectangle. Rects
+ * of consecutive lines with the same columns are merged, too.
+ * Only the words of the damage bitset that have a bit set are visited.
  */
 static void bbulk_compute_damage(struct kmscon_text *txt)
 {
 	struct bbulk *bb = txt->data;
-	int posx, posy, off;
+	unsigned int posx, posy, off, i, w;
+	unsigned int last_x = 0, last_y = UINT_MAX, row = 0;
 	struct uterm_video_rect r;
 	unsigned int x1 = 0, y1 = 0;
 	unsigned int fw, fh;
-	int prev;
+	uint64_t words, bits;
 
 	if (txt->orientation == OR_NORMAL || txt->orientation == OR_UPSIDE_DOWN) {
 		fw = FONT_WIDTH(txt);
@@ -625,36 +1914,329 @@ static void bbulk_compute_damage(struct kmscon_text *txt)
 		fh = FONT_WIDTH(txt);
 	}
 
-	for (posy = 0; posy < txt->rows; posy++) {
-		prev = 0;
-		for (posx = 0; posx < txt->cols; posx++) {
-			off = posx + posy * txt->cols;
-			if (!bb->damages[off]) {
-				if (prev)
-					prev--;
-				continue;
+	bb->open_len = 0;
+	for (i = 0; i < SHL_DIV_ROUND_UP(bb->damaged_len, 64); ++i) {
+		for (words = bb->damaged_words[i]; words; words &= words - 1) {
+			w = i * 64 + __builtin_ctzll(words);
+			for (bits = bb->damaged[w]; bits; bits &= bits - 1) {
+				off = w * 64 + __builtin_ctzll(bits);
+				posx = off % txt->cols;
+				posy = off / txt->cols;
+				if (posy >= txt->rows)
+					goto done;
+
+				set_coordinate(txt, &x1, &y1, posx, posy);
+				r.x1 = x1;
+				r.y1 = y1;
+				r.x2 = x1 + fw;
+				r.y2 = y1 + fh;
+				if (posy == last_y && posx - last_x <= DAMAGE_MERGE_LEN) {
+					merge_damage(bb, &r);
+				} else {
+					if (posy != last_y) {
+						merge_rows(bb, row);
+						row = bb->damage_rect_len;
+						/* only the next row continues rects */
+						if (posy != last_y + 1)
+							bb->open_len = 0;
+					}
+					add_damage(bb, &r);
+				}
+				last_x = posx;
+				last_y = posy;
 			}
-			set_coordinate(txt, &x1, &y1, posx, posy);
-			r.x1 = x1;
-			r.y1 = y1;
-			r.x2 = x1 + fw;
-			r.y2 = y1 + fh;
-			if (prev)
-				merge_damage(bb, &r);
-			else
-				add_damage(bb, &r);
-			prev = DAMAGE_MERGE_LEN;
 		}
 	}
+
+done:
+	merge_rows(bb, row);
+	limit_damage(bb);
+}
+
+static bool blend_take(struct blend_queue *q, bool steal, unsigned int *band)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		/* the owner works from the back, thieves take from the front */
+		*band = steal ? q->bands[q->head++] : q->bands[--q->tail];
+		ret = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+static void blend_run(struct blend_pool *pool, unsigned int idx)
+{
+	struct blend_band *band;
+	unsigned int i, b;
+	int ret;
+
+	for (i = 0; i < pool->num; ++i) {
+		while (blend_take(&pool->queues[(idx + i) % pool->num], i != 0, &b)) {
+			band = &pool->bands[b];
+			ret = uterm_display_fake_blendv(pool->disp, band->reqs, band->num);
+			if (ret)
+				__atomic_store_n(&pool->ret, ret, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void *blend_thread(void *data)
+{
+	struct blend_worker *w = data;
+	struct blend_pool *pool = w->pool;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->gen == gen && !pool->exit)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->exit)
+			break;
+		gen = pool->gen;
+		pthread_mutex_unlock(&pool->lock);
+
+		blend_run(pool, w->idx);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->active)
+			pthread_cond_signal(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void blend_pool_free(struct blend_pool *pool, unsigned int started)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 1; i < started; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	for (i = 0; i < BLEND_MAX_THREADS; ++i)
+		pthread_mutex_destroy(&pool->queues[i].lock);
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->job_lock);
+	free(pool);
+}
+
+/**
+ * kmscon_text_bbulk_set_threads:
+ * @num: Number of threads blending a frame, including the rendering thread
+ *
+ * Starts a pool of @num - 1 helper threads that all bbulk renderers use to
+ * blend large frames. 0 or 1 stops the pool and blends every frame on the
+ * thread rendering it. This must not be called while a bbulk renderer draws.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+int kmscon_text_bbulk_set_threads(unsigned int num)
+{
+	struct blend_pool *pool;
+	unsigned int i;
+	int ret;
+
+	if (blend_pool) {
+		blend_pool_free(blend_pool, blend_pool->num);
+		blend_pool = NULL;
+	}
+
+	if (num <= 1)
+		return 0;
+	if (num > BLEND_MAX_THREADS) {
+		log_warning("limiting blend threads from %u to %u", num, BLEND_MAX_THREADS);
+		num = BLEND_MAX_THREADS;
+	}
+
+	pool = malloc(sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->job_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	for (i = 0; i < BLEND_MAX_THREADS; ++i)
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+	pool->num = num;
+
+	for (i = 1; i < num; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].idx = i;
+		ret = pthread_create(&pool->workers[i].thread, NULL, blend_thread,
+				     &pool->workers[i]);
+		if (ret) {
+			log_error("cannot start blend thread: %d", ret);
+			blend_pool_free(pool, i);
+			return -ret;
+		}
+	}
+
+	blend_pool = pool;
+	log_debug("blending frames on %u threads", num);
+	return 0;
+}
+
+static unsigned int blend_band_of(struct bbulk *bb, const struct uterm_video_blend_req *req,
+				  unsigned int nbands)
+{
+	unsigned int y = req->y < bb->sh ? req->y : bb->sh - 1;
+
+	return (uint64_t)y * nbands / bb->sh;
+}
+
+/*
+ * Sort the first @num requests into horizontal bands of the display and queue
+ * the bands round-robin, so neighbouring bands start on different threads.
+ * These are cells, which only overlap the requests of the same cell and so of
+ * the same band, so the bands can be blended in any order.
+ */
+static void blend_split(struct bbulk *bb, struct blend_pool *pool, unsigned int num)
+{
+	unsigned int count[BLEND_MAX_BANDS];
+	unsigned int nbands = pool->num * BLEND_BANDS_PER_THREAD;
+	unsigned int i, b, pos;
+	struct blend_band *band;
+	struct blend_queue *q;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < num; ++i)
+		++count[blend_band_of(bb, &bb->reqs[i], nbands)];
+
+	for (b = 0, pos = 0; b < nbands; ++b) {
+		pool->bands[b].reqs = &bb->band_reqs[pos];
+		pool->bands[b].num = 0;
+		pos += count[b];
+	}
+
+	for (i = 0; i < num; ++i) {
+		band = &pool->bands[blend_band_of(bb, &bb->reqs[i], nbands)];
+		band->reqs[band->num++] = bb->reqs[i];
+	}
+
+	for (i = 0; i < pool->num; ++i) {
+		pool->queues[i].head = 0;
+		pool->queues[i].tail = 0;
+	}
+	for (b = 0; b < nbands; ++b) {
+		if (!pool->bands[b].num)
+			continue;
+		q = &pool->queues[b % pool->num];
+		q->bands[q->tail++] = b;
+	}
+}
+
+/*
+ * Blend the first @num requests on the pool. Returns false if the frame has to
+ * be blended without the pool.
+ */
+static bool blend_parallel(struct kmscon_text *txt, unsigned int num, int *ret)
+{
+	struct bbulk *bb = txt->data;
+	struct blend_pool *pool = blend_pool;
+
+	/*
+	 * Only some backends can blend on several threads at once, fbdev
+	 * dithers with state of the display and OpenGL blends through a context
+	 * bound to this thread. If another renderer uses the pool, blend on our
+	 * own.
+	 */
+	if (!pool || num < BLEND_MIN_REQS || !uterm_display_supports_threaded_blend(txt->disp))
+		return false;
+
+	if (!bb->band_reqs) {
+		bb->band_reqs = malloc(sizeof(*bb->band_reqs) * bb->req_total_len);
+		if (!bb->band_reqs)
+			return false;
+	}
+
+	if (pthread_mutex_trylock(&pool->job_lock))
+		return false;
+
+	blend_split(bb, pool, num);
+	pool->disp = txt->disp;
+	pool->ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	++pool->gen;
+	pool->active = pool->num - 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	blend_run(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	*ret = __atomic_load_n(&pool->ret, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->job_lock);
+	return true;
 }
+
 static int bbulk_render(struct kmscon_text *txt)
 {
 	struct bbulk *bb = txt->data;
-	int ret;
+	struct bbpending *p;
+	unsigned int i, cells;
+	int ret = 0, r;
+
+	scroll_screen(txt);
+
+	/* the requests point into image tiles until they are blended */
+	kmscon_image_lock();
+	for (i = 0; i < bb->pending_len; ++i) {
+		p = &bb->pending[i];
+		r = draw_cell(txt, p);
+		if (r)
+			ret = r;
+	}
+	restore_pointer(txt);
+	cells = bb->req_len;
+	if (bb->pointer) {
+		r = draw_pointer(txt, bb->pointer_x, bb->pointer_y);
+		if (r)
+			ret = r;
+	}
 
-	ret = uterm_display_fake_blendv(txt->disp, bb->reqs, bb->req_len);
+	if (ret)
+		log_warning("cannot draw all cells: %d", ret);
+
+	/* restored cells go first, the pointer may be blended over them */
+	if (bb->copy_len) {
+		r = uterm_display_fake_copyv(txt->disp, bb->copy_rects, bb->copy_len);
+		if (r) {
+			log_warning("cannot restore cells from the last frame: %d", r);
+			bb->redraw = true;
+		}
+	}
+
+	KMSCON_TEXT_TIME_BEGIN(txt, blend_time);
+	/* the pointer overlaps the cells, so it waits for the pool */
+	if (!blend_parallel(txt, cells, &ret))
+		ret = uterm_display_fake_blendv(txt->disp, bb->reqs, bb->req_len);
+	else if (!ret && bb->req_len > cells)
+		ret = uterm_display_fake_blendv(txt->disp, &bb->reqs[cells], bb->req_len - cells);
+	KMSCON_TEXT_TIME_END(txt, blend_time);
+	kmscon_image_unlock();
+	KMSCON_TEXT_COUNT(txt, cells_blended, bb->req_len);
 	// log_debug("bbulk, redraw %d cells", bb->req_len);
-	if (uterm_display_supports_damage(txt->disp)) {
+	/* the border moved as well */
+	if (bb->resize_frame == bb->frame) {
+		uterm_display_set_damage(txt->disp, 0, NULL);
+	} else if (uterm_display_supports_damage(txt->disp)) {
 		bbulk_compute_damage(txt);
 		uterm_display_set_damage(txt->disp, bb->damage_rect_len, bb->damage_rects);
 	}
@@ -664,41 +2246,96 @@ static int bbulk_render(struct kmscon_text *txt)
 static int bbulk_prepare(struct kmscon_text *txt, struct tsm_screen_attr *attr)
 {
 	struct bbulk *bb = txt->data;
-	int i;
+	int i, ret;
 
-	// Clear previous requests
-	for (i = 0; i < bb->req_total_len; ++i)
+	if (!pthread_equal(bb->glyphs_thread, pthread_self())) {
+		ret = get_glyphs(txt);
+		if (ret)
+			return ret;
+	}
+
+	/* only the requests of the last frame were used */
+	for (i = 0; i < bb->req_len; ++i)
 		bb->reqs[i].buf = NULL;
+	reset_damaged(bb);
 
 	bb->req_len = 0;
+	bb->span_len = 0;
 	bb->damage_rect_len = 0;
+	bb->copy_len = 0;
+	bb->pending_len = 0;
+	bb->pointer = false;
+	++bb->frame;
+	kmscon_glyph_cache_next_frame(bb->glyphs);
+
+	/* claim the back buffer before asking for its age */
+	uterm_display_use(txt->disp);
+
+	/* without a buffer age, assume we flip between two buffers */
+	bb->age = uterm_display_get_buffer_age(txt->disp);
+	if (bb->age <= 0)
+		bb->age = 2;
+	bb->copy = !uterm_display_fake_copyv(txt->disp, NULL, 0);
 
 	/*
 	 * if default colors have changed, or we switch from a dirty screen,
-	 * redraw completely the next 2 frames.
+	 * redraw completely. Buffers that were drawn before that only get the
+	 * border cleared and the cells restored from the last frame, if we can.
 	 */
 	if (memcmp(&bb->attr, attr, sizeof(*attr)) || uterm_display_need_redraw(txt->disp))
-		bb->redraw = 2;
+		bb->redraw = true;
+	/* the buffer may show a pointer we don't remember */
+	if (bb->age > POINTER_HISTORY && bb->frame - bb->pointer_frame <= (uint32_t)bb->age)
+		bb->redraw = true;
 
 	bb->attr = *attr;
 
 	if (bb->redraw) {
+		bb->redraw = false;
+		bb->resize_rows = 0;
+		bb->redraw_frame = bb->frame;
 		uterm_display_clear(txt->disp, attr->br, attr->bg, attr->bb);
 		for (i = 0; i < bb->cells; i++)
 			damage_cell(bb, i);
-	} else if (uterm_display_has_damage(txt->disp)) {
-		log_debug("Carry over damage from previous frame");
+	} else if (bb->resize_rows) {
+		move_resized(txt, attr);
+	} else if (bb->frame - bb->redraw_frame < (uint32_t)bb->age) {
+		uterm_display_clear(txt->disp, attr->br, attr->bg, attr->bb);
 		for (i = 0; i < bb->cells; i++) {
-			if (bb->damages[i])
-				bb->prev[i].id = ID_DAMAGED;
+			if (!bb->copy)
+				damage_cell(bb, i);
+			else
+				bb->changed[i] = bb->frame - 1;
 		}
 	}
-	if (bb->redraw)
-		bb->redraw--;
+	/*
+	 * Let the text layer skip cells that didn't change since the target
+	 * buffer was drawn, unless the buffer misses a complete redraw, or
+	 * cells below an old pointer have to be drawn again.
+	 */
+	if (prepare_pointer(txt) && bb->frame - bb->redraw_frame >= (uint32_t)bb->age)
+		txt->buffer_age = uterm_display_get_buffer_age(txt->disp);
 
 	return 0;
 }
 
+static void bbulk_get_memory(struct kmscon_text *txt, struct kmscon_text_memory *out)
+{
+	struct bbulk *bb = txt->data;
+	struct shl_dlist *iter;
+
+	out->bytes += bb->arrays_size;
+	if (bb->band_reqs)
+		out->bytes += bb->req_total_len * sizeof(*bb->band_reqs);
+	if (bb->tiles) {
+		shl_dlist_for_each(iter, &bb->tiles->lru)
+			++out->tiles;
+		out->tile_bytes = bb->tiles->size;
+		out->bytes += (bb->tiles->mask + 1) * sizeof(*bb->tiles->buckets);
+	}
+	out->reqs = bb->req_len;
+}
+
 struct kmscon_text_ops kmscon_text_bbulk_ops = {
 	.name = "bbulk",
 	.owner = NULL,
@@ -710,7 +2347,9 @@ struct kmscon_text_ops kmscon_text_bbulk_ops = {
 	.rotate = bbulk_rotate,
 	.prepare = bbulk_prepare,
 	.draw = bbulk_draw,
+	.draw_row = bbulk_draw_row,
 	.draw_pointer = bbulk_draw_pointer,
 	.render = bbulk_render,
 	.abort = NULL,
+	.get_memory = bbulk_get_memory,
 };
@@ -34,6 +34,33 @@
  * texture sizes so we need to use multiple atlases. As there is no way to pass
  * a varying amount of textures to a shader, we need to render the screen for
  * each atlas we have.
+ *
+ * Atlases are square textures packed in shelves: each shelf is one glyph high
+ * and glyphs fill it from left to right, a double-width glyph takes two
+ * neighbouring slots. The first atlas holds ATLAS_MIN_GLYPHS, enough for most
+ * screens to be drawn from one texture, and each new one has twice its side,
+ * up to the texture size limit. All atlases together stay within ATLAS_BUDGET. Once it
+ * is reached, the glyphs drawn least recently are evicted and their slots
+ * reused. Every ATLAS_COMPACT_FRAMES frames the emptiest atlas is dropped if
+ * its glyphs fit into the others; they are uploaded there when drawn again.
+ *
+ * Color glyphs (UTERM_FORMAT_ARGB32) go into atlases of their own with RGBA
+ * textures, which start at ATLAS_MIN_COLOR_GLYPHS, so text keeps its alpha
+ * atlases of a quarter of the size. The shader draws the premultiplied texels
+ * of those over the background instead of blending the colors of the cell.
+ *
+ * All atlases share one persistent vertex buffer object. Quads are collected
+ * while drawing and sorted by atlas when rendering, so each atlas is drawn
+ * from one range of the buffer. A vertex only stores the cell position, the
+ * glyph slot in the atlas and packed RGB8 colors; the vertex shader expands it
+ * into screen coordinates. The CPU side keeps a shadow copy of the buffer and
+ * only the range of vertices that changed since the last frame is uploaded.
+ *
+ * Damage is tracked per cell. Each cell remembers the frame it last changed in
+ * and together with the buffer age reported by the display only the bounding
+ * box of what changed since the back buffer was last used gets repainted. The
+ * cells that changed in this frame are forwarded to the display so it can pass
+ * them on to EGL and to the plane FB_DAMAGE_CLIPS.
  */
 
 #define GL_GLEXT_PROTOTYPES
@@ -43,9 +70,13 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "font.h"
+#include "font_cache.h"
+#include "kmscon_image.h"
+#include "shl_arena.h"
 #include "shl_dlist.h"
 #include "shl_gl.h"
 #include "shl_hashtable.h"
@@ -63,30 +94,77 @@
 #define GL_UNPACK_ROW_LENGTH GL_UNPACK_ROW_LENGTH_EXT
 #endif
 
+/* Max horizontal distance of two damaged cells to be merged in a damage rectangle */
+#define DAMAGE_MERGE_LEN 3
+
+/* Number of past pointer positions we remember, limits the usable buffer age */
+#define POINTER_HISTORY 4
+
+/* Bytes of texture memory all atlases may take, one atlas is always allowed */
+#define ATLAS_BUDGET (16 * 1024 * 1024)
+
+/* Glyphs the first atlas holds at least, each new atlas has twice its side */
+#define ATLAS_MIN_GLYPHS 512
+
+/* Glyphs the first color atlas holds at least */
+#define ATLAS_MIN_COLOR_GLYPHS 64
+
+/* Frames between two attempts to drop an atlas */
+#define ATLAS_COMPACT_FRAMES 256
+
+struct vertex {
+	GLfloat pos[2];	 /* in cell units */
+	GLushort tex[2]; /* in glyph units */
+	GLubyte fg[4];
+	GLubyte bg[4];
+};
+
 struct atlas {
 	struct shl_dlist list;
 
 	GLuint tex;
+	bool color; /* RGBA for color glyphs, alpha otherwise */
 	unsigned int height;
 	unsigned int width;
-	unsigned int count;
-	unsigned int fill;
-
-	unsigned int cache_size;
-	unsigned int cache_num;
-	GLfloat *cache_pos;
-	GLfloat *cache_texpos;
-	GLfloat *cache_fgcol;
-	GLfloat *cache_bgcol;
+	unsigned int cols;	 /* slots of a shelf */
+	unsigned int shelves;	 /* shelves of glyph height */
+	struct gl_glyph **slots; /* glyph in each slot, shelf after shelf */
+	unsigned int next;	 /* slots from here on were never used */
+	unsigned int used;	 /* slots taken by glyphs */
+
+	/* quads of this frame, in the shared vertex buffer */
+	unsigned int first;
+	unsigned int num;
 
 	GLfloat advance_htex;
 	GLfloat advance_vtex;
 };
 
+struct gl_quad {
+	struct atlas *atlas;
+	GLfloat x;
+	GLfloat y;
+	unsigned int width;
+	unsigned int slot;
+	GLubyte fg[4];
+	GLubyte bg[4];
+};
+
+struct gl_cell {
+	uint64_t id;
+	struct tsm_screen_attr attr;
+	unsigned int width;
+	unsigned int frame;
+};
+
 struct gl_glyph {
+	struct shl_dlist lru; /* in gltex.lru */
+	uint64_t id;
+	uint32_t style;
+	unsigned int frame; /* last frame the glyph was drawn in */
 	bool double_width;
 	struct atlas *atlas;
-	unsigned int texoff;
+	unsigned int slot;
 };
 
 #define GLYPH_WIDTH(gly) ((gly)->buf.width)
@@ -95,23 +173,49 @@ struct gl_glyph {
 #define GLYPH_DATA(gly) ((gly)->buf.data)
 
 struct gltex {
-	struct shl_hashtable *glyphs;
+	struct shl_hashtable *glyphs[KMSCON_GLYPH_STYLES]; /* by style, keyed on the id */
+	struct kmscon_glyph_cache *cache;
 	unsigned int max_tex_size;
 	bool supports_rowlen;
 	bool previous_overflow;
 
 	struct shl_dlist atlases;
+	struct shl_dlist lru; /* glyphs in atlases, least recently drawn first */
+	size_t atlas_mem;
+	size_t atlas_budget;
+	unsigned int atlas_size;       /* side of the next new atlas */
+	unsigned int color_atlas_size; /* side of the next new color atlas */
+
+	/* glyphs come from a pool and upload scratch from the frame arena, so
+	 * once all glyphs are cached a frame allocates nothing */
+	struct shl_pool glyph_pool;
+	struct shl_arena frame_arena;
+	uint64_t heap_allocs; /* of both, up to the last frame */
+
+	/* vertices of all atlases, and the quads of this frame they are made of */
+	GLuint vbo;
+	struct vertex *vertices;
+	struct gl_quad *quads;
+	unsigned int max_quads;
+	unsigned int quad_num;
+	unsigned int dirty_start;
+	unsigned int dirty_end;
 
 	GLfloat advance_x;
 	GLfloat advance_y;
 	GLfloat off_x;
 	GLfloat off_y;
+	unsigned int border_x;
+	unsigned int border_y;
 
 	struct gl_shader *shader;
 	GLuint uni_cos;
 	GLuint uni_sin;
 	GLuint uni_proj;
+	GLuint uni_advance;
+	GLuint uni_offset;
 	GLuint uni_atlas;
+	GLuint uni_color;
 	GLuint uni_advance_htex;
 	GLuint uni_advance_vtex;
 
@@ -122,6 +226,15 @@ struct gltex {
 	GLfloat sin;
 
 	struct tsm_screen_attr attr;
+
+	struct gl_cell *cells;
+	unsigned int frame;
+	unsigned int full_frame;
+	bool force_redraw;
+	int age;
+	struct uterm_video_rect pointer[POINTER_HISTORY];
+	struct uterm_video_rect *damage_rects;
+	unsigned int damage_rect_len;
 };
 
 static int gltex_init(struct kmscon_text *txt)
@@ -143,11 +256,12 @@ static void gltex_destroy(struct kmscon_text *txt)
 	free(gt);
 }
 
-static void free_glyph(void *data)
+static void free_atlas(struct atlas *atlas, bool gl)
 {
-	struct gl_glyph *glyph = data;
-
-	free(glyph);
+	if (gl)
+		gl_tex_free(&atlas->tex, 1);
+	free(atlas->slots);
+	free(atlas);
 }
 
 static void gltex_set_cos(struct gltex *gt, enum Orientation orientation)
@@ -170,6 +284,8 @@ static void compute_advance_and_offset(struct kmscon_text *txt)
 		off_y = (gt->sh - txt->rows * FONT_HEIGHT(txt)) / 2;
 		gt->off_x = (float)2.0 * off_x / gt->sw;
 		gt->off_y = (float)2.0 * off_y / gt->sh;
+		gt->border_x = off_x;
+		gt->border_y = off_y;
 	} else {
 		gt->advance_x = 2.0 / gt->sh * FONT_WIDTH(txt);
 		gt->advance_y = 2.0 / gt->sw * FONT_HEIGHT(txt);
@@ -177,6 +293,8 @@ static void compute_advance_and_offset(struct kmscon_text *txt)
 		off_y = (gt->sh - txt->cols * FONT_WIDTH(txt)) / 2;
 		gt->off_x = (float)2.0 * off_y / gt->sh;
 		gt->off_y = (float)2.0 * off_x / gt->sw;
+		gt->border_x = off_y;
+		gt->border_y = off_x;
 	}
 	uterm_display_set_cursor_offset(txt->disp, off_x, off_y);
 }
@@ -189,6 +307,7 @@ static int gltex_set(struct kmscon_text *txt)
 	static char *attr[] = {"position", "texture_position", "fgcolor", "bgcolor"};
 	GLint s;
 	const char *ext;
+	unsigned int i;
 
 	if (!uterm_display_has_opengl(txt->disp))
 		return -EINVAL;
@@ -199,10 +318,17 @@ static int gltex_set(struct kmscon_text *txt)
 
 	memset(gt, 0, sizeof(*gt));
 	shl_dlist_init(&gt->atlases);
-
-	ret = shl_hashtable_new(&gt->glyphs, shl_direct_hash, shl_direct_equal, free_glyph);
-	if (ret)
-		return ret;
+	shl_dlist_init(&gt->lru);
+	gt->atlas_budget = ATLAS_BUDGET;
+	shl_pool_init(&gt->glyph_pool, sizeof(struct gl_glyph));
+	shl_arena_init(&gt->frame_arena);
+
+	/* the glyphs are freed with their pool */
+	for (i = 0; i < KMSCON_GLYPH_STYLES; ++i) {
+		ret = shl_hashtable_new(&gt->glyphs[i], shl_direct_hash, shl_direct_equal, NULL);
+		if (ret)
+			goto err_htable;
+	}
 
 	vert = _binary_text_gltex_atlas_vert_start;
 	vlen = _binary_text_gltex_atlas_vert_size;
@@ -210,14 +336,18 @@ static int gltex_set(struct kmscon_text *txt)
 	flen = _binary_text_gltex_atlas_frag_size;
 	gl_clear_error();
 
-	ret = gl_shader_new(&gt->shader, vert, vlen, frag, flen, attr, 4);
+	ret = gl_shader_new_cached(&gt->shader, uterm_display_get_shader_cache(txt->disp), vert,
+				   vlen, frag, flen, attr, 4);
 	if (ret)
 		goto err_htable;
 
 	gt->uni_cos = gl_shader_get_uniform(gt->shader, "cos");
 	gt->uni_sin = gl_shader_get_uniform(gt->shader, "sin");
 	gt->uni_proj = gl_shader_get_uniform(gt->shader, "projection");
+	gt->uni_advance = gl_shader_get_uniform(gt->shader, "advance");
+	gt->uni_offset = gl_shader_get_uniform(gt->shader, "offset");
 	gt->uni_atlas = gl_shader_get_uniform(gt->shader, "atlas");
+	gt->uni_color = gl_shader_get_uniform(gt->shader, "color");
 	gt->uni_advance_htex = gl_shader_get_uniform(gt->shader, "advance_htex");
 	gt->uni_advance_vtex = gl_shader_get_uniform(gt->shader, "advance_vtex");
 
@@ -248,6 +378,64 @@ static int gltex_set(struct kmscon_text *txt)
 		s = 2048;
 	gt->max_tex_size = s;
 
+	/* the first atlas is square and big enough for the glyphs of most screens */
+	gt->atlas_size = 1;
+	while (gt->atlas_size * 2 <= gt->max_tex_size &&
+	       (gt->atlas_size / FONT_WIDTH(txt)) * (gt->atlas_size / FONT_HEIGHT(txt)) <
+		       ATLAS_MIN_GLYPHS)
+		gt->atlas_size *= 2;
+	gt->color_atlas_size = 1;
+	while (gt->color_atlas_size * 2 <= gt->max_tex_size &&
+	       (gt->color_atlas_size / FONT_WIDTH(txt)) *
+			       (gt->color_atlas_size / FONT_HEIGHT(txt)) <
+		       ATLAS_MIN_COLOR_GLYPHS)
+		gt->color_atlas_size *= 2;
+
+	/* the textures are per display, but the rasterized glyphs are shared */
+	ret = kmscon_glyph_cache_get_shared(&gt->cache, txt->font,
+					    2 * txt->max_cols * txt->max_rows,
+					    sizeof(struct kmscon_glyph) +
+						    2 * FONT_WIDTH(txt) * FONT_HEIGHT(txt));
+	if (ret)
+		goto err_shader;
+
+	gt->cells = calloc(txt->max_cols * txt->max_rows, sizeof(*gt->cells));
+	if (!gt->cells) {
+		ret = -ENOMEM;
+		goto err_cache;
+	}
+
+	/* +1 for the mouse pointer */
+	gt->damage_rects = calloc(txt->max_cols * txt->max_rows + 1, sizeof(*gt->damage_rects));
+	if (!gt->damage_rects) {
+		ret = -ENOMEM;
+		goto err_cells;
+	}
+	gt->force_redraw = true;
+
+	gt->max_quads = txt->max_cols * txt->max_rows + 1;
+	gt->quads = calloc(gt->max_quads, sizeof(*gt->quads));
+	gt->vertices = calloc(gt->max_quads * 6, sizeof(*gt->vertices));
+	if (!gt->quads || !gt->vertices) {
+		ret = -ENOMEM;
+		goto err_vertices;
+	}
+
+	gl_clear_error();
+
+	glGenBuffers(1, &gt->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, gt->vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(*gt->vertices) * gt->max_quads * 6, gt->vertices,
+		     GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (glGetError() != GL_NO_ERROR) {
+		gl_clear_error();
+		log_warning("cannot create OpenGL vertex buffer");
+		ret = -EFAULT;
+		goto err_vbo;
+	}
+
 	gl_clear_error();
 
 	ext = (const char *)glGetString(GL_EXTENSIONS);
@@ -260,10 +448,21 @@ static int gltex_set(struct kmscon_text *txt)
 
 	return 0;
 
+err_vbo:
+	glDeleteBuffers(1, &gt->vbo);
+err_vertices:
+	free(gt->vertices);
+	free(gt->quads);
+	free(gt->damage_rects);
+err_cells:
+	free(gt->cells);
+err_cache:
+	kmscon_glyph_cache_unref(gt->cache);
 err_shader:
 	gl_shader_unref(gt->shader);
 err_htable:
-	shl_hashtable_free(gt->glyphs);
+	for (i = 0; i < KMSCON_GLYPH_STYLES; ++i)
+		shl_hashtable_free(gt->glyphs[i]);
 	return ret;
 }
 
@@ -274,6 +473,7 @@ static void gltex_unset(struct kmscon_text *txt)
 	struct shl_dlist *iter;
 	struct atlas *atlas;
 	bool gl = true;
+	unsigned int i;
 
 	ret = uterm_display_use(txt->disp);
 	if (ret) {
@@ -281,51 +481,116 @@ static void gltex_unset(struct kmscon_text *txt)
 		log_warning("cannot activate OpenGL-CTX during destruction");
 	}
 
-	shl_hashtable_free(gt->glyphs);
+	for (i = 0; i < KMSCON_GLYPH_STYLES; ++i)
+		shl_hashtable_free(gt->glyphs[i]);
+	shl_pool_deinit(&gt->glyph_pool);
+	shl_arena_deinit(&gt->frame_arena);
+	kmscon_glyph_cache_unref(gt->cache);
+	free(gt->damage_rects);
+	free(gt->cells);
+	free(gt->vertices);
+	free(gt->quads);
 
 	while (!shl_dlist_empty(&gt->atlases)) {
 		iter = gt->atlases.next;
 		shl_dlist_unlink(iter);
 		atlas = shl_dlist_entry(iter, struct atlas, list);
-
-		free(atlas->cache_pos);
-		free(atlas->cache_texpos);
-		free(atlas->cache_fgcol);
-		free(atlas->cache_bgcol);
-
-		if (gl)
-			gl_tex_free(&atlas->tex, 1);
-		free(atlas);
+		free_atlas(atlas, gl);
 	}
 
 	if (gl) {
+		glDeleteBuffers(1, &gt->vbo);
 		gl_shader_unref(gt->shader);
 
 		gl_clear_error();
 	}
 }
 
-/* returns an atlas with at least 1 free glyph position; NULL on error */
-static struct atlas *get_atlas(struct kmscon_text *txt, unsigned int num)
+static size_t atlas_mem(const struct atlas *atlas)
 {
-	struct gltex *gt = txt->data;
-	struct atlas *atlas;
-	size_t newsize;
-	unsigned int width, height, nsize;
-	GLenum err;
+	return (size_t)atlas->width * atlas->height * (atlas->color ? 4 : 1);
+}
 
-	/* check whether the last added atlas has still room for one glyph */
-	if (!shl_dlist_empty(&gt->atlases)) {
-		atlas = shl_dlist_entry(gt->atlases.next, struct atlas, list);
-		if (atlas->fill + num <= atlas->count)
-			return atlas;
+/* @num slots from @slot on are in one shelf, handed out before and free */
+static bool slots_free(const struct atlas *atlas, unsigned int slot, unsigned int num)
+{
+	unsigned int i;
+
+	if (slot % atlas->cols + num > atlas->cols || slot + num > atlas->next)
+		return false;
+
+	for (i = 0; i < num; ++i) {
+		if (atlas->slots[slot + i])
+			return false;
+	}
+
+	return true;
+}
+
+/* returns the first of @num free slots in one shelf of @atlas, -1 if full */
+static int atlas_alloc(struct atlas *atlas, unsigned int num)
+{
+	unsigned int slot = atlas->next;
+
+	/* fill the shelves in order, a slot left at the end of one is a hole */
+	if (slot % atlas->cols + num > atlas->cols)
+		slot += atlas->cols - slot % atlas->cols;
+	if (slot + num <= atlas->cols * atlas->shelves) {
+		atlas->next = slot + num;
+		atlas->used += num;
+		return slot;
 	}
 
-	/* all atlases are full so we have to create a new atlas */
+	/* then reuse the holes evicted glyphs left behind */
+	if (atlas->next - atlas->used < num)
+		return -1;
+
+	for (slot = 0; slot + num <= atlas->next; ++slot) {
+		if (slots_free(atlas, slot, num)) {
+			atlas->used += num;
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+static void atlas_release(struct atlas *atlas, unsigned int slot, unsigned int num)
+{
+	memset(&atlas->slots[slot], 0, num * sizeof(*atlas->slots));
+	atlas->used -= num;
+}
+
+static void evict_glyph(struct gltex *gt, struct gl_glyph *glyph)
+{
+	atlas_release(glyph->atlas, glyph->slot, glyph->double_width ? 2 : 1);
+	shl_dlist_unlink(&glyph->lru);
+	shl_hashtable_remove(gt->glyphs[glyph->style], glyph->id);
+	shl_pool_free(&gt->glyph_pool, glyph);
+}
+
+/* returns a new atlas if it fits into the budget; NULL otherwise */
+static struct atlas *new_atlas(struct kmscon_text *txt, bool color)
+{
+	struct gltex *gt = txt->data;
+	struct atlas *atlas;
+	unsigned int width, height, *size;
+	GLenum err, format = color ? GL_RGBA : GL_ALPHA;
+	size_t bpp = color ? 4 : 1;
+
 	atlas = malloc(sizeof(*atlas));
 	if (!atlas)
 		return NULL;
 	memset(atlas, 0, sizeof(*atlas));
+	atlas->color = color;
+
+	size = color ? &gt->color_atlas_size : &gt->atlas_size;
+	width = *size;
+	height = *size;
+	if (width < 2 * FONT_WIDTH(txt) || height < FONT_HEIGHT(txt)) {
+		log_warning("OpenGL textures too small for a double-width glyph");
+		goto err_free;
+	}
 
 	gl_clear_error();
 
@@ -337,69 +602,58 @@ static struct atlas *get_atlas(struct kmscon_text *txt, unsigned int num)
 		goto err_free;
 	}
 
-	newsize = gt->max_tex_size / FONT_WIDTH(txt);
-	if (newsize < 1)
-		newsize = 1;
-
 	/* OpenGL texture sizes are heavily restricted so we need to find a
-	 * valid texture size that is big enough to hold as many glyphs as
-	 * possible but at least 1 */
+	 * valid power-of-two size that is big enough to hold as many glyphs as
+	 * possible but at least 2; halving the height first keeps whole shelves */
 try_next:
-	width = shl_next_pow2(FONT_WIDTH(txt) * newsize);
-	height = shl_next_pow2(FONT_HEIGHT(txt));
+	if (!shl_dlist_empty(&gt->atlases) &&
+	    gt->atlas_mem + (size_t)width * height * bpp > gt->atlas_budget) {
+		if (height / 2 >= FONT_HEIGHT(txt)) {
+			height /= 2;
+			goto try_next;
+		}
+		goto err_tex;
+	}
 
 	gl_clear_error();
 
 	glBindTexture(GL_TEXTURE_2D, atlas->tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE,
-		     NULL);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, NULL);
 
 	err = glGetError();
 	if (err != GL_NO_ERROR) {
-		if (newsize > 1) {
-			--newsize;
+		if (height / 2 >= FONT_HEIGHT(txt)) {
+			height /= 2;
+			goto try_next;
+		} else if (width / 2 >= 2 * FONT_WIDTH(txt)) {
+			width /= 2;
 			goto try_next;
 		}
 		gl_clear_error();
-		log_warning("OpenGL textures too small for a single glyph (%d)", err);
+		log_warning("OpenGL textures too small for a double-width glyph (%d)", err);
 		goto err_tex;
 	}
 
-	log_debug("new atlas of size %ux%u for %zu", width, height, newsize);
-
-	nsize = txt->max_cols * txt->max_rows + 1; // +1 for the mouse pointer
-
-	atlas->cache_pos = malloc(sizeof(GLfloat) * nsize * 2 * 6);
-	if (!atlas->cache_pos)
-		goto err_mem;
-
-	atlas->cache_texpos = malloc(sizeof(GLfloat) * nsize * 2 * 6);
-	if (!atlas->cache_texpos)
-		goto err_mem;
-
-	atlas->cache_fgcol = malloc(sizeof(GLfloat) * nsize * 3 * 6);
-	if (!atlas->cache_fgcol)
-		goto err_mem;
-
-	atlas->cache_bgcol = malloc(sizeof(GLfloat) * nsize * 3 * 6);
-	if (!atlas->cache_bgcol)
-		goto err_mem;
-
-	atlas->cache_size = nsize;
-	atlas->count = newsize;
 	atlas->width = width;
 	atlas->height = height;
+	atlas->cols = width / FONT_WIDTH(txt);
+	atlas->shelves = height / FONT_HEIGHT(txt);
+	atlas->slots = calloc(atlas->cols * atlas->shelves, sizeof(*atlas->slots));
+	if (!atlas->slots)
+		goto err_tex;
+
+	log_debug("new %satlas of size %ux%u for %ux%u glyphs", color ? "color " : "", width,
+		  height, atlas->cols, atlas->shelves);
+
 	atlas->advance_htex = 1.0 / atlas->width * FONT_WIDTH(txt);
 	atlas->advance_vtex = 1.0 / atlas->height * FONT_HEIGHT(txt);
 
-	shl_dlist_link(&gt->atlases, &atlas->list);
+	gt->atlas_mem += atlas_mem(atlas);
+	if (*size * 2 <= gt->max_tex_size)
+		*size *= 2;
+	shl_dlist_link_tail(&gt->atlases, &atlas->list);
 	return atlas;
 
-err_mem:
-	free(atlas->cache_pos);
-	free(atlas->cache_texpos);
-	free(atlas->cache_fgcol);
-	free(atlas->cache_bgcol);
 err_tex:
 	gl_tex_free(&atlas->tex, 1);
 err_free:
@@ -407,6 +661,137 @@ err_free:
 	return NULL;
 }
 
+/* finds @num free slots for a new glyph in an atlas of the @color kind, stores
+ * the first in @slot; NULL on error */
+static struct atlas *get_slot(struct kmscon_text *txt, unsigned int num, bool color,
+			      unsigned int *slot)
+{
+	struct gltex *gt = txt->data;
+	struct atlas *atlas;
+	struct gl_glyph *old;
+	struct shl_dlist *iter, *tmp;
+	unsigned int s, start, end;
+	int ret;
+
+	shl_dlist_for_each(iter, &gt->atlases) {
+		atlas = shl_dlist_entry(iter, struct atlas, list);
+		if (atlas->color != color)
+			continue;
+		ret = atlas_alloc(atlas, num);
+		if (ret >= 0) {
+			*slot = ret;
+			return atlas;
+		}
+	}
+
+	atlas = new_atlas(txt, color);
+	if (atlas) {
+		*slot = atlas_alloc(atlas, num);
+		return atlas;
+	}
+
+	/* over budget, evict what was drawn least recently but not in this frame
+	 * as the quads of this frame refer to their slots */
+	shl_dlist_for_each_safe(iter, tmp, &gt->lru) {
+		old = shl_dlist_entry(iter, struct gl_glyph, lru);
+		if (old->frame == gt->frame)
+			break;
+
+		atlas = old->atlas;
+		if (atlas->color != color)
+			continue;
+		start = old->slot >= num - 1 ? old->slot - (num - 1) : 0;
+		end = old->slot + (old->double_width ? 2 : 1);
+		evict_glyph(gt, old);
+
+		for (s = start; s < end; ++s) {
+			if (slots_free(atlas, s, num)) {
+				atlas->used += num;
+				*slot = s;
+				return atlas;
+			}
+		}
+	}
+
+	log_warning("glyph atlases are full, cannot load glyph");
+	return NULL;
+}
+
+/* this frame's glyphs are never evicted, the others by when they were last drawn */
+static void use_glyph(struct gltex *gt, struct gl_glyph *glyph)
+{
+	if (glyph->frame == gt->frame)
+		return;
+
+	glyph->frame = gt->frame;
+	shl_dlist_unlink(&glyph->lru);
+	shl_dlist_link_tail(&gt->lru, &glyph->lru);
+}
+
+/* drops the emptiest atlas of the @color kind if the others of that kind have
+ * room for its glyphs */
+static void compact_atlases(struct kmscon_text *txt, bool color)
+{
+	struct gltex *gt = txt->data;
+	struct atlas *atlas, *emptiest = NULL;
+	struct shl_dlist *iter;
+	struct gl_glyph *glyph;
+	unsigned int room = 0, slot;
+
+	shl_dlist_for_each(iter, &gt->atlases) {
+		atlas = shl_dlist_entry(iter, struct atlas, list);
+		if (atlas->color != color)
+			continue;
+		room += atlas->cols * atlas->shelves - atlas->used;
+		if (!emptiest || atlas->used < emptiest->used)
+			emptiest = atlas;
+	}
+
+	if (!emptiest)
+		return;
+	room -= emptiest->cols * emptiest->shelves - emptiest->used;
+	if (emptiest->used > room)
+		return;
+
+	for (slot = 0; slot < emptiest->next; ++slot) {
+		glyph = emptiest->slots[slot];
+		if (glyph && glyph->slot == slot)
+			evict_glyph(gt, glyph);
+	}
+
+	log_debug("dropping atlas of size %ux%u", emptiest->width, emptiest->height);
+	shl_dlist_unlink(&emptiest->list);
+	gt->atlas_mem -= atlas_mem(emptiest);
+	free_atlas(emptiest, true);
+}
+
+/* upload a color glyph to @x, @y as RGBA bytes, padded or cut to @w x @h */
+static int upload_color(struct gltex *gt, const struct kmscon_glyph *glyph, unsigned int x,
+			unsigned int y, unsigned int w, unsigned int h)
+{
+	const uint32_t *src;
+	uint8_t *data, *dst;
+	unsigned int i, j;
+
+	data = shl_arena_zalloc(&gt->frame_arena, (size_t)w * h * 4);
+	if (!data)
+		return -ENOMEM;
+
+	for (i = 0; i < h && i < GLYPH_HEIGHT(glyph); ++i) {
+		src = (const uint32_t *)&GLYPH_DATA(glyph)[i * GLYPH_STRIDE(glyph)];
+		dst = &data[i * w * 4];
+		for (j = 0; j < w && j < GLYPH_WIDTH(glyph); ++j, dst += 4) {
+			dst[0] = src[j] >> 16;
+			dst[1] = src[j] >> 8;
+			dst[2] = src[j];
+			dst[3] = src[j] >> 24;
+		}
+	}
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	return 0;
+}
+
 static struct gl_glyph *find_glyph(struct kmscon_text *txt, uint64_t id, const uint32_t *ch,
 				   size_t len, const struct tsm_screen_attr *attr)
 {
@@ -416,41 +801,68 @@ static struct gl_glyph *find_glyph(struct kmscon_text *txt, uint64_t id, const u
 	int i;
 	GLenum err;
 	uint8_t *packed_data, *dst;
-	const uint8_t *src;
 	struct kmscon_font *font = txt->font;
-	unsigned int num;
+	unsigned int num, slot, x, y, w, h;
 	const uint32_t replacement_char = 0xfffd;
 	struct kmscon_glyph *glyph;
-
-	font->attr.underline = !!attr->underline;
-	font->attr.italic = !!attr->italic;
-	font->attr.bold = !!attr->bold;
-
-	if (len == 1 && !kmscon_font_has_glyph(font, ch, len)) {
+	uint32_t flags = 0;
+	bool fits, color;
+
+	if (attr->bold)
+		flags |= KMSCON_GLYPH_BOLD;
+	if (attr->italic)
+		flags |= KMSCON_GLYPH_ITALIC;
+	if (attr->underline)
+		flags |= KMSCON_GLYPH_UNDERLINE;
+
+	/* as in bbulk, only a miss asks the font whether it has the glyph */
+	if (shl_hashtable_find(gt->glyphs[flags], (void **)&glglyph, id)) {
+		KMSCON_TEXT_COUNT(txt, glyph_hits, 1);
+		use_glyph(gt, glglyph);
+		return glglyph;
+	}
+	if (len == 1 && !kmscon_font_has_glyph_styled(font, ch, len, flags)) {
 		id = (id & ~0xffffffff) | replacement_char;
 		ch = &replacement_char;
-		len = 1;
+		if (shl_hashtable_find(gt->glyphs[flags], (void **)&glglyph, id)) {
+			KMSCON_TEXT_COUNT(txt, glyph_hits, 1);
+			use_glyph(gt, glglyph);
+			return glglyph;
+		}
 	}
+	KMSCON_TEXT_COUNT(txt, glyph_misses, 1);
 
-	if (shl_hashtable_find(gt->glyphs, (void **)&glglyph, id))
-		return glglyph;
-
-	glglyph = malloc(sizeof(*glglyph));
+	glglyph = shl_pool_alloc(&gt->glyph_pool);
 	if (!glglyph)
 		return NULL;
 	memset(glglyph, 0, sizeof(*glglyph));
 
-	glyph = kmscon_font_render(font, id, ch, len);
-	if (!glyph)
-		return NULL;
+	glyph = kmscon_glyph_cache_get(gt->cache, id, flags);
+	if (!glyph) {
+		KMSCON_TEXT_TIME_BEGIN(txt, raster_time);
+		glyph = kmscon_font_render_styled(font, id, ch, len, flags);
+		KMSCON_TEXT_TIME_END(txt, raster_time);
+		if (glyph)
+			glyph = kmscon_glyph_cache_insert(gt->cache, id, flags, glyph);
+		if (!glyph)
+			goto err_free;
+	}
 
 	glglyph->double_width = glyph->double_width;
 
 	num = kmscon_glyph_cwidth(glyph);
-	atlas = get_atlas(txt, num);
+	color = glyph->buf.format == UTERM_FORMAT_ARGB32;
+	atlas = get_slot(txt, num, color, &slot);
 	if (!atlas)
 		goto err_free;
 
+	/* a reused slot still holds the glyph that was evicted from it, so a
+	 * glyph of another size than its slots is padded or cut */
+	x = slot % atlas->cols * FONT_WIDTH(txt);
+	y = slot / atlas->cols * FONT_HEIGHT(txt);
+	w = num * FONT_WIDTH(txt);
+	h = FONT_HEIGHT(txt);
+
 	/* Funnily, not all OpenGLESv2 implementations support specifying the
 	 * stride of a texture. Therefore, we then need to create a
 	 * temporary image with a stride equal to the image width for loading
@@ -462,37 +874,40 @@ static struct gl_glyph *find_glyph(struct kmscon_text *txt, uint64_t id, const u
 
 	glBindTexture(GL_TEXTURE_2D, atlas->tex);
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	if (!gt->supports_rowlen) {
-		if (GLYPH_STRIDE(glyph) == GLYPH_WIDTH(glyph)) {
-			glTexSubImage2D(GL_TEXTURE_2D, 0, FONT_WIDTH(txt) * atlas->fill, 0,
-					GLYPH_WIDTH(glyph), GLYPH_HEIGHT(glyph), GL_ALPHA,
-					GL_UNSIGNED_BYTE, GLYPH_DATA(glyph));
-		} else {
-			packed_data = malloc(GLYPH_WIDTH(glyph) * GLYPH_HEIGHT(glyph));
-			if (!packed_data) {
-				log_error("cannot allocate memory for glyph storage");
-				goto err_free;
-			}
-
-			src = GLYPH_DATA(glyph);
-			dst = packed_data;
-			for (i = 0; i < GLYPH_HEIGHT(glyph); ++i) {
-				memcpy(dst, src, GLYPH_WIDTH(glyph));
-				dst += GLYPH_WIDTH(glyph);
-				src += GLYPH_STRIDE(glyph);
-			}
-
-			glTexSubImage2D(GL_TEXTURE_2D, 0, FONT_WIDTH(txt) * atlas->fill, 0,
-					GLYPH_WIDTH(glyph), GLYPH_HEIGHT(glyph), GL_ALPHA,
-					GL_UNSIGNED_BYTE, packed_data);
-			free(packed_data);
+	fits = GLYPH_WIDTH(glyph) == w && GLYPH_HEIGHT(glyph) == h &&
+	       glyph->buf.format == UTERM_FORMAT_GREY;
+	if (color) {
+		if (upload_color(gt, glyph, x, y, w, h)) {
+			log_error("cannot allocate memory for glyph storage");
+			goto err_slot;
 		}
-	} else {
+	} else if (fits && GLYPH_STRIDE(glyph) == w) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_ALPHA, GL_UNSIGNED_BYTE,
+				GLYPH_DATA(glyph));
+	} else if (fits && gt->supports_rowlen) {
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, GLYPH_STRIDE(glyph));
-		glTexSubImage2D(GL_TEXTURE_2D, 0, FONT_WIDTH(txt) * atlas->fill, 0,
-				GLYPH_WIDTH(glyph), GLYPH_HEIGHT(glyph), GL_ALPHA, GL_UNSIGNED_BYTE,
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_ALPHA, GL_UNSIGNED_BYTE,
 				GLYPH_DATA(glyph));
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	} else {
+		/* rows of a too wide glyph run into the next one, which then
+		 * overwrites them; the slack is for the last one */
+		packed_data = shl_arena_zalloc(&gt->frame_arena, w * h + GLYPH_WIDTH(glyph));
+		if (!packed_data) {
+			log_error("cannot allocate memory for glyph storage");
+			goto err_slot;
+		}
+
+		dst = packed_data;
+		for (i = 0; i < h && i < GLYPH_HEIGHT(glyph); ++i) {
+			uterm_video_buffer_unpack(dst, &glyph->buf, i);
+			dst += w;
+		}
+		if (GLYPH_WIDTH(glyph) > w)
+			memset(dst, 0, GLYPH_WIDTH(glyph));
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_ALPHA, GL_UNSIGNED_BYTE,
+				packed_data);
 	}
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
@@ -510,31 +925,40 @@ static struct gl_glyph *find_glyph(struct kmscon_text *txt, uint64_t id, const u
 		log_warning("cannot load glyph data into OpenGL texture (%d: %s); disable the "
 			    "GL-renderer if this does not work reliably",
 			    err, gl_err_to_str(err));
-		goto err_free;
+		goto err_slot;
 	}
 
+	glglyph->id = id;
+	glglyph->style = flags;
+	glglyph->frame = gt->frame;
 	glglyph->atlas = atlas;
-	glglyph->texoff = atlas->fill;
+	glglyph->slot = slot;
 
-	if (shl_hashtable_insert(gt->glyphs, id, glglyph))
-		goto err_free;
+	if (shl_hashtable_insert(gt->glyphs[flags], id, glglyph))
+		goto err_slot;
 
-	atlas->fill += num;
-	free(glyph);
+	atlas->slots[slot] = glglyph;
+	if (num > 1)
+		atlas->slots[slot + 1] = glglyph;
+	shl_dlist_link_tail(&gt->lru, &glglyph->lru);
 
 	return glglyph;
 
+err_slot:
+	atlas_release(atlas, slot, num);
 err_free:
-	free(glyph);
-	free(glglyph);
+	shl_pool_free(&gt->glyph_pool, glglyph);
 	return NULL;
 }
 
 static void gltex_resize(struct kmscon_text *txt, unsigned int cols, unsigned int rows)
 {
+	struct gltex *gt = txt->data;
+
 	txt->cols = cols;
 	txt->rows = rows;
 	compute_advance_and_offset(txt);
+	gt->force_redraw = true;
 }
 
 static int gltex_rotate(struct kmscon_text *txt, enum Orientation orientation)
@@ -557,32 +981,151 @@ static int gltex_prepare(struct kmscon_text *txt, struct tsm_screen_attr *attr)
 	if (ret)
 		return ret;
 
+	/* no quad refers to the atlases between two frames */
+	if (!(gt->frame % ATLAS_COMPACT_FRAMES)) {
+		compact_atlases(txt, false);
+		compact_atlases(txt, true);
+	}
+
 	shl_dlist_for_each(iter, &gt->atlases)
 	{
 		atlas = shl_dlist_entry(iter, struct atlas, list);
 
-		atlas->cache_num = 0;
+		atlas->num = 0;
+	}
+	gt->quad_num = 0;
+	shl_arena_reset(&gt->frame_arena);
+
+	++gt->frame;
+	memset(&gt->pointer[gt->frame % POINTER_HISTORY], 0, sizeof(gt->pointer[0]));
+
+	/* the back buffer must be queried before anything is drawn into it */
+	gt->age = uterm_display_get_buffer_age(txt->disp);
+
+	if (gt->force_redraw || memcmp(&gt->attr, attr, sizeof(*attr)) ||
+	    uterm_display_need_redraw(txt->disp)) {
+		gt->full_frame = gt->frame;
+		gt->force_redraw = false;
 	}
 	gt->attr = *attr;
 
-	glClearColor(gt->attr.br / 255.0, gt->attr.bg / 255.0, gt->attr.bb / 255.0, 1);
-	glClear(GL_COLOR_BUFFER_BIT);
 	return 0;
 }
 
+/* mark @width cells starting at @posx as changed in this frame */
+static void touch_cells(struct kmscon_text *txt, unsigned int posx, unsigned int posy,
+			unsigned int width)
+{
+	struct gltex *gt = txt->data;
+	unsigned int i;
+
+	for (i = posx; i < posx + width && i < txt->cols; ++i)
+		gt->cells[i + posy * txt->max_cols].frame = gt->frame;
+}
+
+static void set_vertex(struct vertex *v, GLfloat x, GLfloat y, unsigned int tx, unsigned int ty,
+		       const GLubyte *fg, const GLubyte *bg)
+{
+	v->pos[0] = x;
+	v->pos[1] = y;
+	v->tex[0] = tx;
+	v->tex[1] = ty;
+	memcpy(v->fg, fg, sizeof(v->fg));
+	memcpy(v->bg, bg, sizeof(v->bg));
+}
+
+/* Queue a quad of @glyph for this frame, the vertices are made when rendering */
+static int push_quad(struct gltex *gt, const struct gl_glyph *glyph, GLfloat x, GLfloat y,
+		     unsigned int width, const GLubyte *fg, const GLubyte *bg)
+{
+	struct gl_quad *quad;
+
+	if (gt->quad_num >= gt->max_quads)
+		return -ERANGE;
+
+	quad = &gt->quads[gt->quad_num++];
+	quad->atlas = glyph->atlas;
+	quad->x = x;
+	quad->y = y;
+	quad->width = width;
+	quad->slot = glyph->slot;
+	memcpy(quad->fg, fg, sizeof(quad->fg));
+	memcpy(quad->bg, bg, sizeof(quad->bg));
+	++glyph->atlas->num;
+
+	return 0;
+}
+
+/* Write the quads into the vertex buffer sorted by atlas, and mark those dirty
+ * that differ from the ones at their position during the last frame. */
+static void build_vertices(struct gltex *gt)
+{
+	struct atlas *atlas;
+	struct shl_dlist *iter;
+	const struct gl_quad *q;
+	struct vertex quad[6];
+	unsigned int i, idx, first = 0, tx, ty;
+
+	shl_dlist_for_each(iter, &gt->atlases) {
+		atlas = shl_dlist_entry(iter, struct atlas, list);
+		atlas->first = first;
+		first += atlas->num;
+		atlas->num = 0;
+	}
+
+	for (i = 0; i < gt->quad_num; ++i) {
+		q = &gt->quads[i];
+		atlas = q->atlas;
+		tx = q->slot % atlas->cols;
+		ty = q->slot / atlas->cols;
+
+		memset(quad, 0, sizeof(quad));
+		set_vertex(&quad[0], q->x, q->y, tx, ty, q->fg, q->bg);
+		set_vertex(&quad[1], q->x, q->y + 1, tx, ty + 1, q->fg, q->bg);
+		set_vertex(&quad[2], q->x + q->width, q->y + 1, tx + q->width, ty + 1, q->fg,
+			   q->bg);
+		set_vertex(&quad[3], q->x, q->y, tx, ty, q->fg, q->bg);
+		set_vertex(&quad[4], q->x + q->width, q->y + 1, tx + q->width, ty + 1, q->fg,
+			   q->bg);
+		set_vertex(&quad[5], q->x + q->width, q->y, tx + q->width, ty, q->fg, q->bg);
+
+		idx = (atlas->first + atlas->num++) * 6;
+		if (!memcmp(&gt->vertices[idx], quad, sizeof(quad)))
+			continue;
+
+		memcpy(&gt->vertices[idx], quad, sizeof(quad));
+		if (gt->dirty_start >= gt->dirty_end) {
+			gt->dirty_start = idx;
+			gt->dirty_end = idx + 6;
+		} else {
+			gt->dirty_start = min(gt->dirty_start, idx);
+			gt->dirty_end = max(gt->dirty_end, idx + 6);
+		}
+	}
+}
+
 static int gltex_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch, size_t len,
 		      unsigned int width, unsigned int posx, unsigned int posy,
 		      const struct tsm_screen_attr *attr)
 {
 	struct gltex *gt = txt->data;
-	struct atlas *atlas;
 	struct gl_glyph *glglyph;
-	float gl_x1, gl_x2, gl_y1, gl_y2;
-	int i, idx;
+	struct gl_cell *cell;
+	GLubyte fg[4] = {attr->fr, attr->fg, attr->fb, 0};
+	GLubyte bg[4] = {attr->br, attr->bg, attr->bb, 0};
+	const uint32_t space = ' ';
+	unsigned int col, row;
 
 	if (!width)
 		return 0;
 
+	/* the atlas only holds alpha, so inline images are blank */
+	if (len == 1 && attr->fccode < 0 && kmscon_image_cell(*ch, &col, &row) &&
+	    kmscon_image_placed(txt->images, attr->fr << 16 | attr->fg << 8 | attr->fb)) {
+		id = space;
+		ch = &space;
+	}
+
 	if (!len && posx && gt->previous_overflow) {
 		gt->previous_overflow = false;
 		return 0;
@@ -591,8 +1134,6 @@ static int gltex_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch,
 	if (!glglyph)
 		return -ENOMEM;
 
-	atlas = glglyph->atlas;
-
 	if (width == 1 && glglyph->double_width) {
 		gt->previous_overflow = true;
 		width = 2;
@@ -600,87 +1141,56 @@ static int gltex_draw(struct kmscon_text *txt, uint64_t id, const uint32_t *ch,
 		gt->previous_overflow = false;
 	}
 
-	if (atlas->cache_num >= atlas->cache_size)
+	if (gt->quad_num >= gt->max_quads)
 		return -ERANGE;
 
-	idx = atlas->cache_num * 2 * 6;
-	gl_x1 = gt->off_x + gt->advance_x * posx - 1.0;
-	gl_x2 = gl_x1 + width * gt->advance_x;
-	gl_y1 = 1.0 - gt->off_y - gt->advance_y * posy;
-	gl_y2 = gl_y1 - gt->advance_y;
-
-	atlas->cache_pos[idx + 0] = gl_x1;
-	atlas->cache_pos[idx + 1] = gl_y1;
-	atlas->cache_pos[idx + 2] = gl_x1;
-	atlas->cache_pos[idx + 3] = gl_y2;
-	atlas->cache_pos[idx + 4] = gl_x2;
-	atlas->cache_pos[idx + 5] = gl_y2;
-
-	atlas->cache_pos[idx + 6] = gl_x1;
-	atlas->cache_pos[idx + 7] = gl_y1;
-	atlas->cache_pos[idx + 8] = gl_x2;
-	atlas->cache_pos[idx + 9] = gl_y2;
-	atlas->cache_pos[idx + 10] = gl_x2;
-	atlas->cache_pos[idx + 11] = gl_y1;
-
-	atlas->cache_texpos[idx + 0] = glglyph->texoff;
-	atlas->cache_texpos[idx + 1] = 0.0;
-	atlas->cache_texpos[idx + 2] = glglyph->texoff;
-	atlas->cache_texpos[idx + 3] = 1.0;
-	atlas->cache_texpos[idx + 4] = glglyph->texoff + width;
-	atlas->cache_texpos[idx + 5] = 1.0;
-
-	atlas->cache_texpos[idx + 6] = glglyph->texoff;
-	atlas->cache_texpos[idx + 7] = 0.0;
-	atlas->cache_texpos[idx + 8] = glglyph->texoff + width;
-	atlas->cache_texpos[idx + 9] = 1.0;
-	atlas->cache_texpos[idx + 10] = glglyph->texoff + width;
-	atlas->cache_texpos[idx + 11] = 0.0;
-
-	for (i = 0; i < 6; ++i) {
-		idx = atlas->cache_num * 3 * 6 + i * 3;
-		if (attr->inverse) {
-			atlas->cache_fgcol[idx + 0] = attr->br / 255.0;
-			atlas->cache_fgcol[idx + 1] = attr->bg / 255.0;
-			atlas->cache_fgcol[idx + 2] = attr->bb / 255.0;
-			atlas->cache_bgcol[idx + 0] = attr->fr / 255.0;
-			atlas->cache_bgcol[idx + 1] = attr->fg / 255.0;
-			atlas->cache_bgcol[idx + 2] = attr->fb / 255.0;
-		} else {
-			atlas->cache_fgcol[idx + 0] = attr->fr / 255.0;
-			atlas->cache_fgcol[idx + 1] = attr->fg / 255.0;
-			atlas->cache_fgcol[idx + 2] = attr->fb / 255.0;
-			atlas->cache_bgcol[idx + 0] = attr->br / 255.0;
-			atlas->cache_bgcol[idx + 1] = attr->bg / 255.0;
-			atlas->cache_bgcol[idx + 2] = attr->bb / 255.0;
-		}
+	cell = &gt->cells[posx + posy * txt->max_cols];
+	if (cell->id != id || cell->width != width || memcmp(&cell->attr, attr, sizeof(*attr))) {
+		touch_cells(txt, posx, posy, max(cell->width, width));
+		cell->id = id;
+		cell->width = width;
+		cell->attr = *attr;
 	}
 
-	++atlas->cache_num;
+	if (attr->inverse)
+		return push_quad(gt, glglyph, posx, posy, width, bg, fg);
+	else
+		return push_quad(gt, glglyph, posx, posy, width, fg, bg);
+}
 
-	return 0;
+static int gltex_draw_row(struct kmscon_text *txt, unsigned int posy,
+			  const struct kmscon_text_cell *cells, size_t num)
+{
+	const struct kmscon_text_cell *c;
+	size_t i;
+	int ret = 0, r;
+
+	for (i = 0; i < num; ++i) {
+		c = &cells[i];
+		r = gltex_draw(txt, c->id, c->ch, c->len, c->width, c->posx, posy, &c->attr);
+		if (r)
+			ret = r;
+	}
+	return ret;
 }
 
 static int gltex_draw_pointer(struct kmscon_text *txt, unsigned int x, unsigned int y)
 {
 	struct gltex *gt = txt->data;
-	struct atlas *atlas;
 	struct gl_glyph *glyph;
-	float gl_x1, gl_x2, gl_y1, gl_y2;
-	unsigned int sw, sh;
-	int i, idx;
+	GLfloat cx, cy;
+	unsigned int sw, sh, fw, fh;
+	struct uterm_video_rect *r;
+	int ret;
 	uint32_t ch = 'I';
 	uint64_t id = ch;
+	GLubyte fg[4] = {gt->attr.fr, gt->attr.fg, gt->attr.fb, 0};
+	GLubyte bg[4] = {gt->attr.br, gt->attr.bg, gt->attr.bb, 0};
 
 	glyph = find_glyph(txt, id, &ch, 1, &gt->attr);
 	if (!glyph)
 		return -ENOMEM;
 
-	atlas = glyph->atlas;
-
-	if (atlas->cache_num >= atlas->cache_size)
-		return -ERANGE;
-
 	if (txt->orientation == OR_NORMAL || txt->orientation == OR_UPSIDE_DOWN) {
 		sw = gt->sw;
 		sh = gt->sh;
@@ -695,74 +1205,231 @@ static int gltex_draw_pointer(struct kmscon_text *txt, unsigned int x, unsigned
 	if (y > sh)
 		y = sh;
 
-	gl_x1 = gt->off_x + x * 2.0 / sw - 1.0 - gt->advance_x / 2.0;
-	gl_y1 = 1.0 - gt->off_y - y * 2.0 / sh + gt->advance_y / 2.0;
-	gl_x2 = gl_x1 + gt->advance_x;
-	gl_y2 = gl_y1 - gt->advance_y;
-
-	idx = atlas->cache_num * 2 * 6;
-
-	atlas->cache_pos[idx + 0] = gl_x1;
-	atlas->cache_pos[idx + 1] = gl_y1;
-	atlas->cache_pos[idx + 2] = gl_x1;
-	atlas->cache_pos[idx + 3] = gl_y2;
-	atlas->cache_pos[idx + 4] = gl_x2;
-	atlas->cache_pos[idx + 5] = gl_y2;
-
-	atlas->cache_pos[idx + 6] = gl_x1;
-	atlas->cache_pos[idx + 7] = gl_y1;
-	atlas->cache_pos[idx + 8] = gl_x2;
-	atlas->cache_pos[idx + 9] = gl_y2;
-	atlas->cache_pos[idx + 10] = gl_x2;
-	atlas->cache_pos[idx + 11] = gl_y1;
-
-	atlas->cache_texpos[idx + 0] = glyph->texoff;
-	atlas->cache_texpos[idx + 1] = 0.0;
-	atlas->cache_texpos[idx + 2] = glyph->texoff;
-	atlas->cache_texpos[idx + 3] = 1.0;
-	atlas->cache_texpos[idx + 4] = glyph->texoff + 1.0;
-	atlas->cache_texpos[idx + 5] = 1.0;
-
-	atlas->cache_texpos[idx + 6] = glyph->texoff;
-	atlas->cache_texpos[idx + 7] = 0.0;
-	atlas->cache_texpos[idx + 8] = glyph->texoff + 1.0;
-	atlas->cache_texpos[idx + 9] = 1.0;
-	atlas->cache_texpos[idx + 10] = glyph->texoff + 1.0;
-	atlas->cache_texpos[idx + 11] = 0.0;
-
-	for (i = 0; i < 6; ++i) {
-		idx = atlas->cache_num * 3 * 6 + i * 3;
-		atlas->cache_fgcol[idx + 0] = gt->attr.fr / 255.0;
-		atlas->cache_fgcol[idx + 1] = gt->attr.fg / 255.0;
-		atlas->cache_fgcol[idx + 2] = gt->attr.fb / 255.0;
-		atlas->cache_bgcol[idx + 0] = gt->attr.br / 255.0;
-		atlas->cache_bgcol[idx + 1] = gt->attr.bg / 255.0;
-		atlas->cache_bgcol[idx + 2] = gt->attr.bb / 255.0;
-	}
-
-	++atlas->cache_num;
+	/* center the pointer glyph on x/y, in cell units */
+	cx = x * 2.0 / sw / gt->advance_x - 0.5;
+	cy = y * 2.0 / sh / gt->advance_y - 0.5;
+
+	ret = push_quad(gt, glyph, cx, cy, 1, fg, bg);
+	if (ret)
+		return ret;
+
+	/* remember the area covered by the pointer, padded for rounding */
+	fw = FONT_WIDTH(txt);
+	fh = FONT_HEIGHT(txt);
+	r = &gt->pointer[gt->frame % POINTER_HISTORY];
+	r->x1 = (int32_t)(gt->border_x + x) - (int32_t)(fw / 2) - 1;
+	r->y1 = (int32_t)(gt->border_y + y) - (int32_t)(fh / 2) - 1;
+	r->x2 = r->x1 + fw + 2;
+	r->y2 = r->y1 + fh + 2;
 
 	return 0;
 }
 
+static int32_t clamp(int32_t val, int32_t min, int32_t max)
+{
+	if (val < min)
+		return min;
+	if (val > max)
+		return max;
+	return val;
+}
+
+/*
+ * Damage is computed in the non-rotated view, with the border. This maps a
+ * view rectangle onto the screen, see opRotate() in the vertex shader.
+ */
+static void view_to_screen(struct kmscon_text *txt, const struct uterm_video_rect *in,
+			   struct uterm_video_rect *out)
+{
+	struct gltex *gt = txt->data;
+	int32_t sw = gt->sw, sh = gt->sh;
+
+	switch (txt->orientation) {
+	default:
+	case OR_NORMAL:
+		*out = *in;
+		break;
+	case OR_UPSIDE_DOWN:
+		out->x1 = sw - in->x2;
+		out->y1 = sh - in->y2;
+		out->x2 = sw - in->x1;
+		out->y2 = sh - in->y1;
+		break;
+	case OR_RIGHT:
+		out->x1 = sw - in->y2;
+		out->y1 = in->x1;
+		out->x2 = sw - in->y1;
+		out->y2 = in->x2;
+		break;
+	case OR_LEFT:
+		out->x1 = in->y1;
+		out->y1 = sh - in->x2;
+		out->x2 = in->y2;
+		out->y2 = sh - in->x1;
+		break;
+	}
+
+	out->x1 = clamp(out->x1, 0, sw);
+	out->x2 = clamp(out->x2, 0, sw);
+	out->y1 = clamp(out->y1, 0, sh);
+	out->y2 = clamp(out->y2, 0, sh);
+}
+
+static bool rect_empty(const struct uterm_video_rect *r)
+{
+	return r->x1 >= r->x2 || r->y1 >= r->y2;
+}
+
+static void rect_union(struct uterm_video_rect *out, const struct uterm_video_rect *r)
+{
+	if (rect_empty(r))
+		return;
+
+	if (rect_empty(out)) {
+		*out = *r;
+		return;
+	}
+
+	out->x1 = min(out->x1, r->x1);
+	out->y1 = min(out->y1, r->y1);
+	out->x2 = max(out->x2, r->x2);
+	out->y2 = max(out->y2, r->y2);
+}
+
+/* area the pointer damaged in @frame, empty if it did not move */
+static void pointer_damage(struct gltex *gt, unsigned int frame, struct uterm_video_rect *out)
+{
+	const struct uterm_video_rect *cur = &gt->pointer[frame % POINTER_HISTORY];
+	const struct uterm_video_rect *prev = &gt->pointer[(frame - 1) % POINTER_HISTORY];
+
+	memset(out, 0, sizeof(*out));
+	if (!memcmp(cur, prev, sizeof(*cur)))
+		return;
+
+	rect_union(out, cur);
+	rect_union(out, prev);
+}
+
+static void add_damage(struct kmscon_text *txt, const struct uterm_video_rect *view)
+{
+	struct gltex *gt = txt->data;
+	struct uterm_video_rect r;
+
+	view_to_screen(txt, view, &r);
+	if (!rect_empty(&r))
+		gt->damage_rects[gt->damage_rect_len++] = r;
+}
+
+/*
+ * Collect the cells that changed in this frame into damage rectangles, merging
+ * cells of a line that are less than DAMAGE_MERGE_LEN apart. Returns the
+ * bounding box, in the view, of everything that changed in the last @age
+ * frames.
+ */
+static void gltex_compute_damage(struct kmscon_text *txt, unsigned int age,
+				 struct uterm_video_rect *bbox)
+{
+	struct gltex *gt = txt->data;
+	struct gl_cell *cell;
+	struct uterm_video_rect r, run;
+	unsigned int posx, posy, fw, fh, i;
+	int gap;
+
+	fw = FONT_WIDTH(txt);
+	fh = FONT_HEIGHT(txt);
+	memset(bbox, 0, sizeof(*bbox));
+	gt->damage_rect_len = 0;
+
+	for (posy = 0; posy < txt->rows; ++posy) {
+		memset(&run, 0, sizeof(run));
+		gap = 0;
+
+		for (posx = 0; posx < txt->cols; ++posx) {
+			cell = &gt->cells[posx + posy * txt->max_cols];
+			if (gt->frame - cell->frame >= age) {
+				if (gap)
+					--gap;
+				continue;
+			}
+
+			r.x1 = gt->border_x + posx * fw;
+			r.y1 = gt->border_y + posy * fh;
+			r.x2 = r.x1 + fw;
+			r.y2 = r.y1 + fh;
+			rect_union(bbox, &r);
+
+			if (cell->frame != gt->frame)
+				continue;
+
+			if (!gap && !rect_empty(&run)) {
+				add_damage(txt, &run);
+				memset(&run, 0, sizeof(run));
+			}
+			rect_union(&run, &r);
+			gap = DAMAGE_MERGE_LEN;
+		}
+
+		if (!rect_empty(&run))
+			add_damage(txt, &run);
+	}
+
+	for (i = 0; i < age; ++i) {
+		pointer_damage(gt, gt->frame - i, &r);
+		rect_union(bbox, &r);
+		if (!i && !rect_empty(&r))
+			add_damage(txt, &r);
+	}
+}
+
 static int gltex_render(struct kmscon_text *txt)
 {
 	struct gltex *gt = txt->data;
 	struct atlas *atlas;
 	struct shl_dlist *iter;
+	struct uterm_video_rect bbox, r;
+	bool partial;
 	float mat[16];
+	uint64_t allocs;
 
-	gl_clear_error();
+	/* everything of this frame was drawn, the rest must not allocate */
+	allocs = gt->glyph_pool.allocs + gt->frame_arena.allocs;
+	KMSCON_TEXT_COUNT(txt, heap_allocs, allocs - gt->heap_allocs);
+	gt->heap_allocs = allocs;
 
-	gl_shader_use(gt->shader);
+	/* we can only repaint what changed if the back buffer content is known
+	 * and we have the damage of all frames since it was last used */
+	partial = gt->age > 0 && gt->age < POINTER_HISTORY &&
+		  gt->frame - gt->full_frame >= (unsigned int)gt->age;
+
+	gl_clear_error();
 
 	glViewport(0, 0, gt->sw, gt->sh);
 	glDisable(GL_BLEND);
+	glClearColor(gt->attr.br / 255.0, gt->attr.bg / 255.0, gt->attr.bb / 255.0, 1);
+
+	if (partial) {
+		gltex_compute_damage(txt, gt->age, &bbox);
+		uterm_display_set_damage(txt->disp, gt->damage_rect_len, gt->damage_rects);
+		if (rect_empty(&bbox))
+			return 0;
+
+		view_to_screen(txt, &bbox, &r);
+		glScissor(r.x1, gt->sh - r.y2, r.x2 - r.x1, r.y2 - r.y1);
+		glEnable(GL_SCISSOR_TEST);
+	} else {
+		uterm_display_set_damage(txt->disp, 0, NULL);
+	}
+
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	gl_shader_use(gt->shader);
 
 	gl_m4_identity(mat);
 	glUniformMatrix4fv(gt->uni_proj, 1, GL_FALSE, mat);
 	glUniform1f(gt->uni_cos, gt->cos);
 	glUniform1f(gt->uni_sin, gt->sin);
+	glUniform2f(gt->uni_advance, gt->advance_x, gt->advance_y);
+	glUniform2f(gt->uni_offset, gt->off_x, gt->off_y);
 
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
@@ -772,27 +1439,50 @@ static int gltex_render(struct kmscon_text *txt)
 	glActiveTexture(GL_TEXTURE0);
 	glUniform1i(gt->uni_atlas, 0);
 
+	KMSCON_TEXT_TIME_BEGIN(txt, blend_time);
+	build_vertices(gt);
+
+	glBindBuffer(GL_ARRAY_BUFFER, gt->vbo);
+	if (gt->dirty_start < gt->dirty_end) {
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(struct vertex) * gt->dirty_start,
+				sizeof(struct vertex) * (gt->dirty_end - gt->dirty_start),
+				&gt->vertices[gt->dirty_start]);
+		gt->dirty_start = 0;
+		gt->dirty_end = 0;
+	}
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct vertex),
+			      (void *)offsetof(struct vertex, pos));
+	glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(struct vertex),
+			      (void *)offsetof(struct vertex, tex));
+	glVertexAttribPointer(2, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct vertex),
+			      (void *)offsetof(struct vertex, fg));
+	glVertexAttribPointer(3, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct vertex),
+			      (void *)offsetof(struct vertex, bg));
+
 	shl_dlist_for_each(iter, &gt->atlases)
 	{
 		atlas = shl_dlist_entry(iter, struct atlas, list);
-		if (!atlas->cache_num)
+		if (!atlas->num)
 			continue;
 
 		glBindTexture(GL_TEXTURE_2D, atlas->tex);
+		glUniform1f(gt->uni_color, atlas->color ? 1.0 : 0.0);
 		glUniform1f(gt->uni_advance_htex, atlas->advance_htex);
 		glUniform1f(gt->uni_advance_vtex, atlas->advance_vtex);
-
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, atlas->cache_pos);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, atlas->cache_texpos);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, atlas->cache_fgcol);
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, atlas->cache_bgcol);
-		glDrawArrays(GL_TRIANGLES, 0, 6 * atlas->cache_num);
+		glDrawArrays(GL_TRIANGLES, 6 * atlas->first, 6 * atlas->num);
+		KMSCON_TEXT_COUNT(txt, cells_blended, atlas->num);
 	}
+	KMSCON_TEXT_TIME_END(txt, blend_time);
+
+	/* drm3d blits with client-side arrays, don't leave our buffer bound */
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(2);
 	glDisableVertexAttribArray(3);
+	glDisable(GL_SCISSOR_TEST);
 
 	if (gl_has_error(gt->shader)) {
 		log_warning("rendering console caused OpenGL errors");
@@ -802,6 +1492,28 @@ static int gltex_render(struct kmscon_text *txt)
 	return 0;
 }
 
+static void gltex_get_memory(struct kmscon_text *txt, struct kmscon_text_memory *out)
+{
+	struct gltex *gt = txt->data;
+	struct shl_dlist *iter;
+	struct atlas *atlas;
+	size_t cells = (size_t)txt->max_cols * txt->max_rows;
+
+	shl_dlist_for_each(iter, &gt->atlases)
+	{
+		atlas = shl_dlist_entry(iter, struct atlas, list);
+		out->tiles += atlas->used;
+		out->bytes += sizeof(*atlas) + atlas->cols * atlas->shelves * sizeof(*atlas->slots);
+	}
+	out->tile_bytes = gt->atlas_mem;
+	out->bytes += out->tiles * gt->glyph_pool.size;
+
+	/* the vertices are in the buffer object, too */
+	out->bytes += gt->max_quads * (sizeof(*gt->quads) + 2 * 6 * sizeof(*gt->vertices));
+	out->bytes += cells * sizeof(*gt->cells) + (cells + 1) * sizeof(*gt->damage_rects);
+	out->reqs = gt->quad_num;
+}
+
 struct kmscon_text_ops kmscon_text_gltex_ops = {
 	.name = "gltex",
 	.owner = NULL,
@@ -813,7 +1525,9 @@ struct kmscon_text_ops kmscon_text_gltex_ops = {
 	.rotate = gltex_rotate,
 	.prepare = gltex_prepare,
 	.draw = gltex_draw,
+	.draw_row = gltex_draw_row,
 	.draw_pointer = gltex_draw_pointer,
 	.render = gltex_render,
 	.abort = NULL,
+	.get_memory = gltex_get_memory,
 };
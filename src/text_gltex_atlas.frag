@@ -27,12 +27,13 @@
 /*
  * Fragment Shader
  * A basic fragment shader which applies a 2D texture and blends foreground and
- * background colors.
+ * background colors. Color atlases bring their own foreground.
  */
 
 precision mediump float;
 
 uniform sampler2D atlas;
+uniform float color; /* 1.0 if the atlas holds premultiplied RGBA */
 uniform float advance_htex;
 uniform float advance_vtex;
 
@@ -43,7 +44,7 @@ varying vec3 bgcol;
 void main()
 {
 	vec2 pos = vec2(texpos.x * advance_htex, texpos.y * advance_vtex);
-	float alpha = texture2D(atlas, pos).a;
-	vec3 val = alpha * fgcol + (1.0 - alpha) * bgcol;
+	vec4 tex = texture2D(atlas, pos);
+	vec3 val = mix(tex.a * fgcol, tex.rgb, color) + (1.0 - tex.a) * bgcol;
 	gl_FragColor = vec4(val, 1.0);
 }
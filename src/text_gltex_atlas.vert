@@ -27,12 +27,15 @@
 /*
  * Vertex Shader
  * This shader is a very basic vertex shader which forwards all data and
- * performs basic matrix multiplications.
+ * performs basic matrix multiplications. Positions are given in cell units and
+ * are converted into normalized device coordinates here.
  */
 
 uniform mat4 projection;
 uniform float cos;
 uniform float sin;
+uniform vec2 advance;
+uniform vec2 offset;
 
 attribute vec2 position;
 attribute vec2 texture_position;
@@ -50,7 +53,9 @@ vec2 opRotate(in vec2 p)
 
 void main()
 {
-	vec2 rotatedPosition = opRotate(position);
+	vec2 pos = vec2(offset.x - 1.0 + position.x * advance.x,
+			1.0 - offset.y - position.y * advance.y);
+	vec2 rotatedPosition = opRotate(pos);
 	gl_Position = projection * vec4(rotatedPosition, 0.0, 1.0);
 	texpos = texture_position;
 	fgcol = fgcolor;
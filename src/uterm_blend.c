@@ -0,0 +1,1099 @@
+/*
+ * uterm - Linux User-Space Terminal
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Software glyph blending
+ * The 2D backends blend 8bit alpha glyphs between a foreground and background
+ * color into XRGB8888 memory. This is the hottest loop of the software
+ * renderer, so we provide vectorized kernels for the common architectures and
+ * select the best one at runtime. All kernels produce bit-identical results to
+ * the scalar fallback.
+ *
+ * Division by 255 (t /= 255) is done with:
+ *   t += 0x80
+ *   t = (t + (t >> 8)) >> 8
+ * This is exact for all t in [0, 255 * 255] and avoids the division.
+ *
+ * Bitmap fonts hand in UTERM_FORMAT_MONO glyphs with one bit per pixel. Those
+ * only ever select the foreground or the background color, so their kernels
+ * expand the bits to masks and store the colors without any math.
+ *
+ * Color glyphs are UTERM_FORMAT_ARGB32 with premultiplied alpha, so drawing
+ * them over the background is a multiply of the background and an add. Most
+ * of their pixels are either opaque or empty, which are stored as they are.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shl_log.h"
+#include "shl_misc.h"
+#include "uterm_video.h"
+#include "uterm_video_internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#endif
+
+#define LOG_SUBSYSTEM "uterm_blend"
+
+static inline uint32_t blend_pixel(const struct uterm_video_blend_req *req, uint8_t a)
+{
+	uint_fast32_t r, g, b;
+
+	if (a == 0)
+		return (req->br << 16) | (req->bg << 8) | req->bb;
+	if (a == 255)
+		return (req->fr << 16) | (req->fg << 8) | req->fb;
+
+	r = req->fr * a + req->br * (255 - a);
+	r += 0x80;
+	r = (r + (r >> 8)) >> 8;
+
+	g = req->fg * a + req->bg * (255 - a);
+	g += 0x80;
+	g = (g + (g >> 8)) >> 8;
+
+	b = req->fb * a + req->bb * (255 - a);
+	b += 0x80;
+	b = (b + (b >> 8)) >> 8;
+
+	return (r << 16) | (g << 8) | b;
+}
+
+static void blend_line_scalar(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      const struct uterm_video_blend_req *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < width; ++i)
+		dst[i] = blend_pixel(req, src[i]);
+}
+
+static void fill_line(uint32_t *dst, unsigned int width, uint32_t val)
+{
+	unsigned int i;
+
+	for (i = 0; i < width; ++i)
+		dst[i] = val;
+}
+
+static void blend_mono_scalar(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      uint32_t fval, uint32_t bval)
+{
+	unsigned int i, j;
+	uint8_t c;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		c = src[i / 8];
+		if (c == 0x00) {
+			fill_line(&dst[i], 8, bval);
+		} else if (c == 0xff) {
+			fill_line(&dst[i], 8, fval);
+		} else {
+			for (j = 0; j < 8; ++j)
+				dst[i + j] = (c & (0x80 >> j)) ? fval : bval;
+		}
+	}
+
+	for (; i < width; ++i)
+		dst[i] = (src[i / 8] & (0x80 >> (i % 8))) ? fval : bval;
+}
+
+/* premultiplied @src over @bval, saturated in case @src is not premultiplied */
+static inline uint32_t over_pixel(uint32_t src, uint32_t bval)
+{
+	uint_fast32_t a = src >> 24, ia, c, res = 0;
+	unsigned int shift;
+
+	if (a == 255)
+		return src & 0xffffff;
+	if (!src)
+		return bval;
+
+	ia = 255 - a;
+	for (shift = 0; shift < 24; shift += 8) {
+		c = ((bval >> shift) & 0xff) * ia;
+		c += 0x80;
+		c = (c + (c >> 8)) >> 8;
+		c += (src >> shift) & 0xff;
+		res |= min(c, (uint_fast32_t)255) << shift;
+	}
+
+	return res;
+}
+
+static void blend_argb_scalar(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      uint32_t bval)
+{
+	const uint32_t *pix = (const uint32_t *)src;
+	unsigned int i;
+
+	for (i = 0; i < width; ++i)
+		dst[i] = over_pixel(pix[i], bval);
+}
+
+#if defined(__SSE2__)
+
+static inline __m128i div255_epi16(__m128i t)
+{
+	t = _mm_add_epi16(t, _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i blend_epi16(__m128i f, __m128i b, __m128i a, __m128i ia)
+{
+	return div255_epi16(_mm_add_epi16(_mm_mullo_epi16(f, a), _mm_mullo_epi16(b, ia)));
+}
+
+/* Blend 8 alpha values (as 16bit lanes) and store 8 XRGB8888 pixels */
+static inline void blend8_sse2(uint32_t *dst, __m128i a, const __m128i *fg, const __m128i *bg)
+{
+	__m128i ia, r, g, b, lo, hi;
+
+	ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+	r = blend_epi16(fg[0], bg[0], a, ia);
+	g = blend_epi16(fg[1], bg[1], a, ia);
+	b = blend_epi16(fg[2], bg[2], a, ia);
+
+	/* (g << 8 | b) and r interleaved give the little-endian XRGB words */
+	b = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	lo = _mm_unpacklo_epi16(b, r);
+	hi = _mm_unpackhi_epi16(b, r);
+	_mm_storeu_si128((__m128i *)dst, lo);
+	_mm_storeu_si128((__m128i *)(dst + 4), hi);
+}
+
+static void blend_line_sse2(uint32_t *dst, const uint8_t *src, unsigned int width,
+			    const struct uterm_video_blend_req *req)
+{
+	__m128i fg[3], bg[3], zero, ff, v;
+	uint32_t fval, bval;
+	unsigned int i, mask;
+
+	fg[0] = _mm_set1_epi16(req->fr);
+	fg[1] = _mm_set1_epi16(req->fg);
+	fg[2] = _mm_set1_epi16(req->fb);
+	bg[0] = _mm_set1_epi16(req->br);
+	bg[1] = _mm_set1_epi16(req->bg);
+	bg[2] = _mm_set1_epi16(req->bb);
+	fval = (req->fr << 16) | (req->fg << 8) | req->fb;
+	bval = (req->br << 16) | (req->bg << 8) | req->bb;
+	zero = _mm_setzero_si128();
+	ff = _mm_set1_epi8(-1);
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		/* Glyphs are mostly empty or fully covered, skip the math */
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		if (mask == 0xffff) {
+			fill_line(&dst[i], 16, bval);
+			continue;
+		}
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ff));
+		if (mask == 0xffff) {
+			fill_line(&dst[i], 16, fval);
+			continue;
+		}
+
+		blend8_sse2(&dst[i], _mm_unpacklo_epi8(v, zero), fg, bg);
+		blend8_sse2(&dst[i + 8], _mm_unpackhi_epi8(v, zero), fg, bg);
+	}
+
+	blend_line_scalar(&dst[i], &src[i], width - i, req);
+}
+
+/* Each byte of @src gives 8 pixels, a lane is set where its bit is */
+static void blend_mono_sse2(uint32_t *dst, const uint8_t *src, unsigned int width,
+			    uint32_t fval, uint32_t bval)
+{
+	__m128i f, b, lo, hi, v, m;
+	unsigned int i;
+
+	f = _mm_set1_epi32(fval);
+	b = _mm_set1_epi32(bval);
+	lo = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+	hi = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		v = _mm_set1_epi32(src[i / 8]);
+		m = _mm_cmpeq_epi32(_mm_and_si128(v, lo), lo);
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 _mm_or_si128(_mm_and_si128(m, f), _mm_andnot_si128(m, b)));
+		m = _mm_cmpeq_epi32(_mm_and_si128(v, hi), hi);
+		_mm_storeu_si128((__m128i *)&dst[i + 4],
+				 _mm_or_si128(_mm_and_si128(m, f), _mm_andnot_si128(m, b)));
+	}
+
+	blend_mono_scalar(&dst[i], &src[i / 8], width - i, fval, bval);
+}
+
+/* 4 pixels at a time, the channels of two pixels in 16bit lanes */
+static void blend_argb_sse2(uint32_t *dst, const uint8_t *src, unsigned int width,
+			    uint32_t bval)
+{
+	const uint32_t *pix = (const uint32_t *)src;
+	__m128i zero, ff, rgb, b, v, a, ia, lo, hi;
+	unsigned int i;
+
+	zero = _mm_setzero_si128();
+	ff = _mm_set1_epi32(255);
+	rgb = _mm_set1_epi32(0xffffff);
+	b = _mm_unpacklo_epi8(_mm_set1_epi32(bval), zero);
+
+	for (i = 0; i + 4 <= width; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)&pix[i]);
+		a = _mm_srli_epi32(v, 24);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, ff)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)&dst[i], _mm_and_si128(v, rgb));
+			continue;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) == 0xffff) {
+			fill_line(&dst[i], 4, bval);
+			continue;
+		}
+
+		/* 255 - alpha in all four 16bit lanes of each pixel */
+		ia = _mm_sub_epi32(ff, a);
+		ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+		lo = div255_epi16(_mm_mullo_epi16(b, _mm_unpacklo_epi32(ia, ia)));
+		hi = div255_epi16(_mm_mullo_epi16(b, _mm_unpackhi_epi32(ia, ia)));
+		v = _mm_adds_epu8(_mm_packus_epi16(lo, hi), v);
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_and_si128(v, rgb));
+	}
+
+	blend_argb_scalar(&dst[i], (const uint8_t *)&pix[i], width - i, bval);
+}
+
+#define HAVE_SSE2_KERNEL 1
+
+#endif /* __SSE2__ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i div255_epi16_avx2(__m256i t)
+{
+	t = _mm256_add_epi16(t, _mm256_set1_epi16(0x80));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+static inline AVX2 __m256i blend_epi16_avx2(__m256i f, __m256i b, __m256i a, __m256i ia)
+{
+	return div255_epi16_avx2(
+		_mm256_add_epi16(_mm256_mullo_epi16(f, a), _mm256_mullo_epi16(b, ia)));
+}
+
+/* Blend 16 alpha values and store 16 XRGB8888 pixels */
+static inline AVX2 void blend16_avx2(uint32_t *dst, __m128i v, const __m256i *fg,
+				     const __m256i *bg)
+{
+	__m256i a, ia, r, g, b, lo, hi;
+
+	a = _mm256_cvtepu8_epi16(v);
+	ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+	r = blend_epi16_avx2(fg[0], bg[0], a, ia);
+	g = blend_epi16_avx2(fg[1], bg[1], a, ia);
+	b = blend_epi16_avx2(fg[2], bg[2], a, ia);
+
+	/* unpack works on 128bit lanes: lo = px 0-3,8-11; hi = px 4-7,12-15 */
+	b = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+	lo = _mm256_unpacklo_epi16(b, r);
+	hi = _mm256_unpackhi_epi16(b, r);
+	_mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(dst + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+static AVX2 void blend_line_avx2(uint32_t *dst, const uint8_t *src, unsigned int width,
+				 const struct uterm_video_blend_req *req)
+{
+	__m256i fg[3], bg[3], v, zero, ff;
+	uint32_t fval, bval;
+	unsigned int i, mask;
+
+	fg[0] = _mm256_set1_epi16(req->fr);
+	fg[1] = _mm256_set1_epi16(req->fg);
+	fg[2] = _mm256_set1_epi16(req->fb);
+	bg[0] = _mm256_set1_epi16(req->br);
+	bg[1] = _mm256_set1_epi16(req->bg);
+	bg[2] = _mm256_set1_epi16(req->bb);
+	fval = (req->fr << 16) | (req->fg << 8) | req->fb;
+	bval = (req->br << 16) | (req->bg << 8) | req->bb;
+	zero = _mm256_setzero_si256();
+	ff = _mm256_set1_epi8(-1);
+
+	for (i = 0; i + 32 <= width; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)&src[i]);
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		if (mask == 0xffffffff) {
+			fill_line(&dst[i], 32, bval);
+			continue;
+		}
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ff));
+		if (mask == 0xffffffff) {
+			fill_line(&dst[i], 32, fval);
+			continue;
+		}
+
+		blend16_avx2(&dst[i], _mm256_castsi256_si128(v), fg, bg);
+		blend16_avx2(&dst[i + 16], _mm256_extracti128_si256(v, 1), fg, bg);
+	}
+
+	/* Most glyphs are narrower than 32 pixels, so handle a 16 wide tail */
+	if (i + 16 <= width) {
+		blend16_avx2(&dst[i], _mm_loadu_si128((const __m128i *)&src[i]), fg, bg);
+		i += 16;
+	}
+
+	blend_line_scalar(&dst[i], &src[i], width - i, req);
+}
+
+#define HAVE_AVX2_KERNEL 1
+
+#endif /* x86 */
+
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+static inline uint8x8_t blend_u8_neon(uint8x8_t f, uint8x8_t b, uint8x8_t a, uint8x8_t ia)
+{
+	uint16x8_t t;
+
+	t = vmlal_u8(vmull_u8(f, a), b, ia);
+	/* ((t + 0x80) + ((t + 0x80) >> 8)) >> 8 */
+	return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void blend_line_neon(uint32_t *dst, const uint8_t *src, unsigned int width,
+			    const struct uterm_video_blend_req *req)
+{
+	uint8x8_t fr, fgr, fb, br, bgr, bb, lo, ilo, hi, ihi;
+	uint8x16_t v;
+	uint8x16x4_t px;
+	unsigned int i;
+
+	fr = vdup_n_u8(req->fr);
+	fgr = vdup_n_u8(req->fg);
+	fb = vdup_n_u8(req->fb);
+	br = vdup_n_u8(req->br);
+	bgr = vdup_n_u8(req->bg);
+	bb = vdup_n_u8(req->bb);
+	px.val[3] = vdupq_n_u8(0);
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		v = vld1q_u8(&src[i]);
+		lo = vget_low_u8(v);
+		ilo = vmvn_u8(lo);
+		hi = vget_high_u8(v);
+		ihi = vmvn_u8(hi);
+
+		px.val[0] = vcombine_u8(blend_u8_neon(fb, bb, lo, ilo),
+					blend_u8_neon(fb, bb, hi, ihi));
+		px.val[1] = vcombine_u8(blend_u8_neon(fgr, bgr, lo, ilo),
+					blend_u8_neon(fgr, bgr, hi, ihi));
+		px.val[2] = vcombine_u8(blend_u8_neon(fr, br, lo, ilo),
+					blend_u8_neon(fr, br, hi, ihi));
+
+		/* vst4 interleaves B, G, R, X which is XRGB8888 in memory */
+		vst4q_u8((uint8_t *)&dst[i], px);
+	}
+
+	blend_line_scalar(&dst[i], &src[i], width - i, req);
+}
+
+static void blend_mono_neon(uint32_t *dst, const uint8_t *src, unsigned int width,
+			    uint32_t fval, uint32_t bval)
+{
+	static const uint32_t bits[8] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+	uint32x4_t f, b, lo, hi, v;
+	unsigned int i;
+
+	f = vdupq_n_u32(fval);
+	b = vdupq_n_u32(bval);
+	lo = vld1q_u32(bits);
+	hi = vld1q_u32(bits + 4);
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		v = vdupq_n_u32(src[i / 8]);
+		vst1q_u32(&dst[i], vbslq_u32(vtstq_u32(v, lo), f, b));
+		vst1q_u32(&dst[i + 4], vbslq_u32(vtstq_u32(v, hi), f, b));
+	}
+
+	blend_mono_scalar(&dst[i], &src[i / 8], width - i, fval, bval);
+}
+
+#define HAVE_NEON_KERNEL 1
+
+#endif /* __ARM_NEON */
+
+/* there is nothing to gain from AVX2 for mono, so it is picked at build time */
+#if defined(HAVE_SSE2_KERNEL)
+#define blend_mono blend_mono_sse2
+#elif defined(HAVE_NEON_KERNEL)
+#define blend_mono blend_mono_neon
+#else
+#define blend_mono blend_mono_scalar
+#endif
+
+/* color glyphs are rare enough that SSE2 is all they get */
+#if defined(HAVE_SSE2_KERNEL)
+#define blend_argb blend_argb_sse2
+#else
+#define blend_argb blend_argb_scalar
+#endif
+
+typedef void (*blend_line_fn)(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      const struct uterm_video_blend_req *req);
+
+static void blend_line_detect(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      const struct uterm_video_blend_req *req);
+
+static blend_line_fn blend_line = blend_line_detect;
+
+static blend_line_fn blend_select(void)
+{
+#ifdef HAVE_AVX2_KERNEL
+	if (__builtin_cpu_supports("avx2")) {
+		log_debug("using AVX2 blend kernel");
+		return blend_line_avx2;
+	}
+#endif
+#if defined(HAVE_SSE2_KERNEL)
+	log_debug("using SSE2 blend kernel");
+	return blend_line_sse2;
+#elif defined(HAVE_NEON_KERNEL)
+	log_debug("using NEON blend kernel");
+	return blend_line_neon;
+#else
+	log_debug("using scalar blend kernel");
+	return blend_line_scalar;
+#endif
+}
+
+/* First call picks the kernel. Concurrent first calls just store the same
+ * pointer twice, so no locking is needed. */
+static void blend_line_detect(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      const struct uterm_video_blend_req *req)
+{
+	blend_line = blend_select();
+	blend_line(dst, src, width, req);
+}
+
+void uterm_blend_xrgb32_line(uint32_t *dst, const uint8_t *src, unsigned int width,
+			     const struct uterm_video_blend_req *req)
+{
+	blend_line(dst, src, width, req);
+}
+
+/**
+ * uterm_blend_argb32_line:
+ * @dst: XRGB8888 pixels to fill
+ * @src: row of a UTERM_FORMAT_ARGB32 buffer
+ * @width: number of pixels
+ * @bval: XRGB8888 background the pixels are drawn over
+ *
+ * Draw a row of premultiplied ARGB pixels over @bval, for backends that
+ * convert the result to their own pixel format.
+ */
+void uterm_blend_argb32_line(uint32_t *dst, const uint8_t *src, unsigned int width,
+			     uint32_t bval)
+{
+	blend_argb(dst, src, width, bval);
+}
+
+static uint32_t req_fg(const struct uterm_video_blend_req *req)
+{
+	return (req->fr << 16) | (req->fg << 8) | req->fb;
+}
+
+static uint32_t req_bg(const struct uterm_video_blend_req *req)
+{
+	return (req->br << 16) | (req->bg << 8) | req->bb;
+}
+
+/* blend row @row of @buf, which may be of either format */
+static void blend_buf_line(uint32_t *dst, const struct uterm_video_buffer *buf, unsigned int row,
+			   unsigned int width, const struct uterm_video_blend_req *req)
+{
+	const uint8_t *src = &buf->data[row * buf->stride];
+
+	if (buf->format == UTERM_FORMAT_MONO)
+		blend_mono(dst, src, width, req_fg(req), req_bg(req));
+	else if (buf->format == UTERM_FORMAT_ARGB32)
+		blend_argb(dst, src, width, req_bg(req));
+	else
+		blend_line(dst, src, width, req);
+}
+
+/**
+ * uterm_video_buffer_unpack:
+ * @dst: buf->width bytes to fill
+ * @buf: buffer to read
+ * @row: row of @buf to read
+ *
+ * Store row @row of @buf as one byte of alpha per pixel, whatever its format.
+ * For users that can't handle UTERM_FORMAT_MONO themselves, like texture
+ * uploads. UTERM_FORMAT_ARGB32 rows lose their colors and keep the shape.
+ */
+SHL_EXPORT
+void uterm_video_buffer_unpack(uint8_t *dst, const struct uterm_video_buffer *buf,
+			       unsigned int row)
+{
+	const uint8_t *src = &buf->data[row * buf->stride];
+	unsigned int i;
+
+	if (buf->format == UTERM_FORMAT_GREY) {
+		memcpy(dst, src, buf->width);
+		return;
+	}
+
+	if (buf->format == UTERM_FORMAT_ARGB32) {
+		for (i = 0; i < buf->width; ++i)
+			dst[i] = ((const uint32_t *)src)[i] >> 24;
+		return;
+	}
+
+	for (i = 0; i < buf->width; ++i)
+		dst[i] = (src[i / 8] & (0x80 >> (i % 8))) ? 0xff : 0x00;
+}
+
+/**
+ * uterm_blend_to_xrgb32:
+ * @dst: XRGB8888 buffer of at least the size of req->buf
+ * @stride: stride of @dst in bytes
+ * @req: blend request, its position is ignored
+ *
+ * Blend req->buf into @dst, for callers that keep blended pixels around and
+ * pass them back with UTERM_BLEND_XRGB32.
+ */
+SHL_EXPORT
+void uterm_blend_to_xrgb32(uint32_t *dst, unsigned int stride,
+			   const struct uterm_video_blend_req *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < req->buf->height; ++i) {
+		blend_buf_line(dst, req->buf, i, req->buf->width, req);
+		dst = (uint32_t *)((uint8_t *)dst + stride);
+	}
+}
+
+/**
+ * uterm_blend_lut:
+ * @lut: table of 256 XRGB8888 pixels to fill
+ * @req: blend request to take the colors from
+ *
+ * Fill @lut with the colors of @req blended at every alpha value, the same
+ * that uterm_blend_xrgb32_line() produces.
+ */
+void uterm_blend_lut(uint32_t *lut, const struct uterm_video_blend_req *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; ++i)
+		lut[i] = blend_pixel(req, i);
+}
+
+/*
+ * Blend tables
+ * A terminal shows few color pairs at a time, so each display keeps the tables
+ * of the last UTERM_BLEND_LUT_MAX fg/bg pairs it blended, most recently used
+ * first. The backend may convert them to its pixel format once when they are
+ * filled; blending a pixel is then a single lookup.
+ * Several threads may blend into one display, so the list is locked and a
+ * table is pinned while it is used. Pinned tables are never refilled; if all
+ * of them are, more than UTERM_BLEND_LUT_MAX are kept until they are put.
+ */
+
+struct blend_table {
+	struct shl_dlist list;
+	uint64_t key;
+	unsigned int pins;
+	uint32_t pix[256];
+};
+
+static uint64_t blend_key(const struct uterm_video_blend_req *req)
+{
+	uint64_t key;
+
+	key = (uint64_t)((req->fr << 16) | (req->fg << 8) | req->fb) << 32;
+	key |= (req->br << 16) | (req->bg << 8) | req->bb;
+	return key;
+}
+
+/* the least recently used table nobody uses, NULL if all are pinned */
+static struct blend_table *unpinned_table(struct uterm_display *disp)
+{
+	struct shl_dlist *iter;
+	struct blend_table *table;
+
+	shl_dlist_for_each_reverse(iter, &disp->blend_luts) {
+		table = shl_dlist_entry(iter, struct blend_table, list);
+		if (!table->pins)
+			return table;
+	}
+
+	return NULL;
+}
+
+/**
+ * uterm_blend_get_lut:
+ * @disp: display owning the tables
+ * @req: blend request to take the colors from
+ *
+ * Returns: the table of the colors of @req, filled by uterm_blend_lut() and
+ * converted by disp->blend_lut_convert if set. It is pinned and stays valid
+ * until it is given back with uterm_blend_put_lut(). NULL if it cannot be
+ * allocated.
+ */
+const uint32_t *uterm_blend_get_lut(struct uterm_display *disp,
+				    const struct uterm_video_blend_req *req)
+{
+	struct shl_dlist *iter;
+	struct blend_table *table;
+	uint64_t key = blend_key(req);
+
+	pthread_mutex_lock(&disp->blend_lut_lock);
+
+	shl_dlist_for_each(iter, &disp->blend_luts) {
+		table = shl_dlist_entry(iter, struct blend_table, list);
+		if (table->key == key) {
+			shl_dlist_unlink(&table->list);
+			goto out;
+		}
+	}
+
+	table = NULL;
+	if (disp->blend_lut_num >= UTERM_BLEND_LUT_MAX)
+		table = unpinned_table(disp);
+	if (table) {
+		shl_dlist_unlink(&table->list);
+	} else {
+		table = malloc(sizeof(*table));
+		if (!table) {
+			pthread_mutex_unlock(&disp->blend_lut_lock);
+			return NULL;
+		}
+		table->pins = 0;
+		++disp->blend_lut_num;
+	}
+
+	table->key = key;
+	uterm_blend_lut(table->pix, req);
+	if (disp->blend_lut_convert)
+		disp->blend_lut_convert(disp, table->pix);
+
+out:
+	++table->pins;
+	shl_dlist_link(&disp->blend_luts, &table->list);
+	pthread_mutex_unlock(&disp->blend_lut_lock);
+
+	return table->pix;
+}
+
+/**
+ * uterm_blend_put_lut:
+ * @disp: display owning the tables
+ * @lut: table returned by uterm_blend_get_lut(), or NULL
+ *
+ * Unpin @lut. Tables kept beyond UTERM_BLEND_LUT_MAX while all were pinned are
+ * freed once nobody uses them.
+ */
+void uterm_blend_put_lut(struct uterm_display *disp, const uint32_t *lut)
+{
+	struct blend_table *table;
+
+	if (!lut)
+		return;
+
+	table = (struct blend_table *)((const uint8_t *)lut - offsetof(struct blend_table, pix));
+
+	pthread_mutex_lock(&disp->blend_lut_lock);
+	if (!--table->pins && disp->blend_lut_num > UTERM_BLEND_LUT_MAX) {
+		shl_dlist_unlink(&table->list);
+		free(table);
+		--disp->blend_lut_num;
+	}
+	pthread_mutex_unlock(&disp->blend_lut_lock);
+}
+
+/* drop all tables, needed when the pixel format changes, none may be pinned */
+void uterm_blend_flush_luts(struct uterm_display *disp)
+{
+	struct blend_table *table;
+
+	pthread_mutex_lock(&disp->blend_lut_lock);
+	while (!shl_dlist_empty(&disp->blend_luts)) {
+		table = shl_dlist_first(&disp->blend_luts, struct blend_table, list);
+		shl_dlist_unlink(&table->list);
+		free(table);
+	}
+	disp->blend_lut_num = 0;
+	pthread_mutex_unlock(&disp->blend_lut_lock);
+}
+
+static void blend_line_lut(uint32_t *dst, const uint8_t *src, unsigned int width,
+			   const uint32_t *lut)
+{
+	unsigned int i;
+
+	for (i = 0; i < width; ++i)
+		dst[i] = lut[src[i]];
+}
+
+/* The vector kernels beat a table lookup per pixel, so the tables only
+ * replace the scalar kernel. */
+static const uint32_t *req_lut(struct uterm_display *disp,
+			       const struct uterm_video_blend_req *req)
+{
+	if (!disp || req->flags & UTERM_BLEND_XRGB32)
+		return NULL;
+	if (blend_line == blend_line_detect)
+		blend_line = blend_select();
+	if (blend_line != blend_line_scalar)
+		return NULL;
+	return uterm_blend_get_lut(disp, req);
+}
+
+static void blend_req_line(uint32_t *dst, const struct uterm_video_buffer *buf, unsigned int row,
+			   unsigned int width, const struct uterm_video_blend_req *req,
+			   const uint32_t *lut)
+{
+	const uint8_t *src = &buf->data[row * buf->stride];
+
+	if (req->flags & UTERM_BLEND_XRGB32)
+		memcpy(dst, src, width * 4);
+	else if (lut && buf->format == UTERM_FORMAT_GREY)
+		blend_line_lut(dst, src, width, lut);
+	else
+		blend_buf_line(dst, buf, row, width, req);
+}
+
+/*
+ * Framebuffers are mostly uncached or write-combined, where a glyph width of
+ * scattered stores per row defeats the write-combining buffers. So cells that
+ * sit side by side on a row are blended into a tile in cache first, and each
+ * tile row is then written out as one run of non-temporal stores.
+ */
+
+#define TILE_SIZE 8192
+
+static void stream_line(uint32_t *dst, const uint32_t *src, unsigned int width)
+{
+#if defined(__SSE2__)
+	unsigned int i = 0;
+
+	for (; i < width && ((uintptr_t)&dst[i] & 15); ++i)
+		dst[i] = src[i];
+	for (; i + 4 <= width; i += 4)
+		_mm_stream_si128((__m128i *)&dst[i], _mm_loadu_si128((const __m128i *)&src[i]));
+	for (; i < width; ++i)
+		dst[i] = src[i];
+#else
+	memcpy(dst, src, width * 4);
+#endif
+}
+
+static void stream_fill(uint32_t *dst, unsigned int width, uint32_t val)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_set1_epi32(val);
+	unsigned int i = 0;
+
+	for (; i < width && ((uintptr_t)&dst[i] & 15); ++i)
+		dst[i] = val;
+	for (; i + 16 <= width; i += 16) {
+		_mm_stream_si128((__m128i *)&dst[i], v);
+		_mm_stream_si128((__m128i *)&dst[i + 4], v);
+		_mm_stream_si128((__m128i *)&dst[i + 8], v);
+		_mm_stream_si128((__m128i *)&dst[i + 12], v);
+	}
+	for (; i + 4 <= width; i += 4)
+		_mm_stream_si128((__m128i *)&dst[i], v);
+	for (; i < width; ++i)
+		dst[i] = val;
+#else
+	fill_line(dst, width, val);
+#endif
+}
+
+static void stream_fence(void)
+{
+#if defined(__SSE2__)
+	/* non-temporal stores are weakly ordered, publish them before the flip */
+	_mm_sfence();
+#endif
+}
+
+/**
+ * uterm_blend_fill_xrgb32:
+ * @map: first pixel to fill
+ * @stride: stride of @map in bytes
+ * @width: pixels per row
+ * @height: number of rows
+ * @val: pixel value
+ *
+ * Fill a rectangle of 32bit pixels with non-temporal stores.
+ */
+void uterm_blend_fill_xrgb32(uint8_t *map, unsigned int stride, unsigned int width,
+			     unsigned int height, uint32_t val)
+{
+	while (height--) {
+		stream_fill((uint32_t *)map, width, val);
+		map += stride;
+	}
+	stream_fence();
+}
+
+static void stream_bytes(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#if defined(__SSE2__)
+	size_t i = 0;
+
+	for (; i < len && ((uintptr_t)&dst[i] & 15); ++i)
+		dst[i] = src[i];
+	for (; i + 16 <= len; i += 16)
+		_mm_stream_si128((__m128i *)&dst[i], _mm_loadu_si128((const __m128i *)&src[i]));
+	for (; i < len; ++i)
+		dst[i] = src[i];
+#else
+	memcpy(dst, src, len);
+#endif
+}
+
+/**
+ * uterm_blend_copy_rects:
+ * @dst: framebuffer to copy to
+ * @dst_stride: stride of @dst in bytes
+ * @src: framebuffer to copy from, with the same format as @dst
+ * @src_stride: stride of @src in bytes
+ * @Bpp: bytes per pixel
+ * @sw: width of both in pixels
+ * @sh: height of both in pixels
+ * @rects: rectangles to copy, clipped to the framebuffer
+ * @num: number of rectangles
+ *
+ * Copy rectangles of a shadow buffer to the device with non-temporal stores,
+ * each row as one run.
+ */
+void uterm_blend_copy_rects(uint8_t *dst, unsigned int dst_stride, const uint8_t *src,
+			    unsigned int src_stride, unsigned int Bpp, unsigned int sw,
+			    unsigned int sh, const struct uterm_video_rect *rects, size_t num)
+{
+	unsigned int x1, y1, x2, y2, y;
+	size_t i;
+
+	for (i = 0; i < num; ++i) {
+		x1 = min((unsigned int)max(rects[i].x1, 0), sw);
+		y1 = min((unsigned int)max(rects[i].y1, 0), sh);
+		x2 = min((unsigned int)max(rects[i].x2, 0), sw);
+		y2 = min((unsigned int)max(rects[i].y2, 0), sh);
+		if (x1 >= x2)
+			continue;
+
+		for (y = y1; y < y2; ++y)
+			stream_bytes(&dst[(size_t)y * dst_stride + x1 * Bpp],
+				     &src[(size_t)y * src_stride + x1 * Bpp], (x2 - x1) * Bpp);
+	}
+	stream_fence();
+}
+
+static bool req_draws(const struct uterm_video_blend_req *req)
+{
+	return req->buf || req->flags & (UTERM_BLEND_FILL | UTERM_BLEND_SPAN);
+}
+
+/* size of what @req draws */
+static void req_size(const struct uterm_video_blend_req *req, unsigned int *width,
+		     unsigned int *height)
+{
+	if (req->flags & (UTERM_BLEND_FILL | UTERM_BLEND_SPAN)) {
+		*width = req->width;
+		*height = req->height;
+	} else {
+		*width = req->buf->width;
+		*height = req->buf->height;
+	}
+}
+
+static int clip_req(const struct uterm_video_blend_req *req, unsigned int sw, unsigned int sh,
+		    unsigned int *width, unsigned int *height)
+{
+	unsigned int tmp, w, h;
+
+	req_size(req, &w, &h);
+
+	tmp = req->x + w;
+	if (tmp < req->x || req->x >= sw)
+		return -EINVAL;
+	*width = tmp > sw ? sw - req->x : w;
+
+	tmp = req->y + h;
+	if (tmp < req->y || req->y >= sh)
+		return -EINVAL;
+	*height = tmp > sh ? sh - req->y : h;
+
+	return 0;
+}
+
+/*
+ * Draw rows @top to @top + @height of @req, @width pixels wide, to @dst. With
+ * @direct, @dst is the framebuffer and fills are streamed.
+ */
+static void draw_req(struct uterm_display *disp, uint8_t *dst, unsigned int stride,
+		     const struct uterm_video_blend_req *req, unsigned int top, unsigned int width,
+		     unsigned int height, bool direct)
+{
+	const struct uterm_video_buffer *buf;
+	const uint32_t *lut;
+	unsigned int i, j, off, w;
+
+	if (req->flags & UTERM_BLEND_FILL) {
+		for (i = 0; i < height; ++i, dst += stride) {
+			if (direct)
+				stream_fill((uint32_t *)dst, width, req_bg(req));
+			else
+				fill_line((uint32_t *)dst, width, req_bg(req));
+		}
+		return;
+	}
+
+	if (!(req->flags & UTERM_BLEND_SPAN)) {
+		buf = req->buf;
+		lut = buf->format == UTERM_FORMAT_GREY ? req_lut(disp, req) : NULL;
+		for (i = top; i < top + height; ++i, dst += stride)
+			blend_req_line((uint32_t *)dst, buf, i, width, req, lut);
+		uterm_blend_put_lut(disp, lut);
+		return;
+	}
+
+	lut = req_lut(disp, req);
+
+	/* all glyphs of a row at once, so the row stays in cache */
+	for (i = top; i < top + height; ++i, dst += stride) {
+		for (j = 0, off = 0; j < req->buf_num && off < width; ++j, off += w) {
+			buf = req->bufs[j];
+			w = min(buf->width, width - off);
+			blend_req_line(&((uint32_t *)dst)[off], buf, i, w, req, lut);
+		}
+	}
+	uterm_blend_put_lut(disp, lut);
+}
+
+/**
+ * uterm_blend_xrgb32v:
+ * @disp: display to keep blend tables on, or NULL
+ * @map: first pixel of an XRGB8888 buffer
+ * @stride: stride of @map in bytes
+ * @sw: width of @map in pixels
+ * @sh: height of @map in pixels
+ * @req: blend requests, entries with nothing to draw are skipped
+ * @num: number of requests
+ *
+ * Blend @req into @map like uterm_display_fake_blendv(). Requests with
+ * UTERM_BLEND_XRGB32 are copied, fills and spans are drawn as described in
+ * uterm_video.h.
+ *
+ * Returns: 0 on success, -EINVAL if a request lies outside of @map.
+ */
+int uterm_blend_xrgb32v(struct uterm_display *disp, uint8_t *map, unsigned int stride,
+			unsigned int sw, unsigned int sh, const struct uterm_video_blend_req *req,
+			size_t num)
+{
+	uint32_t tile[TILE_SIZE] __attribute__((aligned(64)));
+	const struct uterm_video_blend_req *end = req + num, *first, *next;
+	unsigned int width, height, w = 0, h, run, off, top, i;
+	uint8_t *dst;
+	int ret = 0;
+
+	while (req < end) {
+		if (!req_draws(req)) {
+			++req;
+			continue;
+		}
+
+		ret = clip_req(req, sw, sh, &width, &height);
+		if (ret)
+			break;
+
+		/*
+		 * A request too big for the tile, like a span of a whole row, goes
+		 * through it a few rows at a time. Fills and rows wider than the
+		 * tile go straight to the buffer.
+		 */
+		if (width * height > TILE_SIZE) {
+			dst = &map[req->y * stride + req->x * 4];
+			if (req->flags & UTERM_BLEND_FILL || width > TILE_SIZE) {
+				draw_req(disp, dst, stride, req, 0, width, height, true);
+				++req;
+				continue;
+			}
+			h = TILE_SIZE / width;
+			for (top = 0; top < height; top += h) {
+				if (h > height - top)
+					h = height - top;
+				draw_req(disp, (uint8_t *)tile, width * 4, req, top, width, h, false);
+				for (i = 0; i < h; ++i, dst += stride)
+					stream_line((uint32_t *)dst, &tile[i * width], width);
+			}
+			++req;
+			continue;
+		}
+
+		/* collect the cells that continue this one on the same row */
+		run = width;
+		for (next = req + 1; next < end && req_draws(next); ++next) {
+			if (next->y != req->y || next->x != req->x + run)
+				break;
+			if (clip_req(next, sw, sh, &w, &h) || h != height ||
+			    (run + w) * height > TILE_SIZE)
+				break;
+			run += w;
+		}
+
+		first = req;
+		for (off = 0; req < next; ++req, off += w) {
+			clip_req(req, sw, sh, &w, &h);
+			draw_req(disp, (uint8_t *)&tile[off], run * 4, req, 0, w, height, false);
+		}
+
+		dst = &map[first->y * stride + first->x * 4];
+		for (i = 0; i < height; ++i) {
+			stream_line((uint32_t *)dst, &tile[i * run], run);
+			dst += stride;
+		}
+	}
+
+	stream_fence();
+
+	return ret;
+}
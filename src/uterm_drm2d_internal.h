@@ -30,6 +30,7 @@
 
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include "uterm_drm_shared_internal.h"
@@ -41,16 +42,83 @@ struct uterm_drm2d_rb {
 	uint32_t stride;
 	uint64_t size;
 	void *map;
+	uint64_t frame; /* number of the frame in the buffer, 0 if never drawn */
+
+	/* with --gbm-scanout, a linear GBM buffer mapped through its dma-buf */
+	struct gbm_bo *bo;
+	int dmabuf;
 };
 
+/*
+ * A frame kept with uterm_display_keep_frame(). It stays in the buffer of the
+ * display it was drawn into until the display draws into that buffer again.
+ * Then the frame takes the buffer along and the display gets the spare one or
+ * a new one, so a session switch only allocates if frames pile up.
+ */
+struct uterm_drm2d_frame {
+	int slot;		  /* buffer of the display holding it, or -1 */
+	struct uterm_drm2d_rb rb; /* once it left the display, size 0 if lost */
+	unsigned int width;
+	unsigned int height;
+};
+
+/* damage of a frame drawn into the shadow buffer, kept for each buffer */
+#define UTERM_DRM2D_DAMAGE_HISTORY 3
+
+struct uterm_drm2d_damage {
+	struct uterm_video_rect *rects;
+	size_t len;
+	size_t size;
+	bool all; /* unknown, the whole frame may have changed */
+};
+
+struct uterm_drm2d_video {
+	struct gbm_device *gbm; /* created on first use */
+};
+
+/*
+ * We draw into back_rb and hand it to the kernel on swap. In mailbox mode a
+ * third buffer lets us draw while a page-flip is pending. The frame swapped
+ * meanwhile is queued and flipped once the pending flip is done, unless a
+ * newer frame gets drawn into the same buffer first. In front mode there is
+ * only one buffer, back_rb and current_rb are the same and swaps only report
+ * the damage, see uterm_drm_display_dirty().
+ * The lock protects back_rb and queued_rb against the page-flip handler if the
+ * buffers are drawn from another thread.
+ */
 struct uterm_drm2d_display {
 	struct uterm_drm_display ddrm;
-	int current_rb;
-	struct uterm_drm2d_rb rb[2];
+	pthread_mutex_t lock;
+	unsigned int num_rb;
+	int current_rb; /* last buffer handed to the kernel */
+	int back_rb;	/* buffer we draw into */
+	int last_rb;	/* buffer with the last swapped frame */
+	int queued_rb;	/* buffer waiting for the pending flip, or -1 */
+	uint64_t frame;
+	struct uterm_drm2d_rb rb[3];
+	struct uterm_drm2d_frame *kept[3]; /* frame kept in each buffer */
+	struct uterm_drm2d_rb spare;	   /* left by a frame shown again */
+
+	/*
+	 * With a shadow buffer, frames are drawn into system RAM. A swap copies
+	 * the damage of all frames the back buffer missed into it, damage[]
+	 * holds the damage of the last frames indexed by frame number.
+	 */
+	uint8_t *shadow;
+	unsigned int shadow_stride;
+	struct uterm_drm2d_damage damage[UTERM_DRM2D_DAMAGE_HISTORY];
 };
 
+void uterm_drm2d_display_detach(struct uterm_display *disp, int i);
 int uterm_drm2d_display_fake_blendv(struct uterm_display *disp,
 				    const struct uterm_video_blend_req *req, size_t num);
 int uterm_drm2d_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b);
+int uterm_drm2d_display_fake_move(struct uterm_display *disp, unsigned int src_y,
+				  unsigned int dst_y, unsigned int height);
+int uterm_drm2d_display_fake_copyv(struct uterm_display *disp,
+				   const struct uterm_video_rect *rects, size_t num);
+int uterm_drm2d_display_fake_readv(struct uterm_display *disp, uint8_t *dst,
+				   unsigned int stride, const struct uterm_video_rect *rects,
+				   size_t num);
 
 #endif /* UTERM_DRM2D_INTERNAL_H */
@@ -39,6 +39,7 @@
 #include <xf86drmMode.h>
 #include "eloop.h"
 #include "shl_log.h"
+#include "shl_misc.h"
 #include "uterm_drm2d_internal.h"
 #include "uterm_drm_shared_internal.h"
 #include "uterm_video.h"
@@ -49,105 +50,115 @@
 int uterm_drm2d_display_fake_blendv(struct uterm_display *disp,
 				    const struct uterm_video_blend_req *req, size_t num)
 {
-	unsigned int tmp;
-	uint8_t *dst;
-	const uint8_t *src;
-	unsigned int width, height, i, j;
-	unsigned int sw, sh;
-	uint_fast32_t r, g, b, out;
-	struct uterm_drm2d_rb *rb;
 	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_rb *rb;
 
 	if (!req)
 		return -EINVAL;
 
-	rb = &d2d->rb[d2d->current_rb ^ 1];
-	sw = disp->width;
-	sh = disp->height;
-
-	for (j = 0; j < num; ++j, ++req) {
-		if (!req->buf)
-			continue;
-
-		tmp = req->x + req->buf->width;
-		if (tmp < req->x || req->x >= sw)
-			return -EINVAL;
-		if (tmp > sw)
-			width = sw - req->x;
-		else
-			width = req->buf->width;
-
-		tmp = req->y + req->buf->height;
-		if (tmp < req->y || req->y >= sh)
-			return -EINVAL;
-		if (tmp > sh)
-			height = sh - req->y;
-		else
-			height = req->buf->height;
-
-		dst = rb->map;
-		dst = &dst[req->y * rb->stride + req->x * 4];
-		src = req->buf->data;
-
-		while (height--) {
-			for (i = 0; i < width; ++i) {
-				/* Division by 255 (t /= 255) is done with:
-				 *   t += 0x80
-				 *   t = (t + (t >> 8)) >> 8
-				 * This speeds up the computation by ~20% as the
-				 * division is not needed. */
-				if (src[i] == 0) {
-					r = req->br;
-					g = req->bg;
-					b = req->bb;
-					out = (r << 16) | (g << 8) | b;
-				} else if (src[i] == 255) {
-					r = req->fr;
-					g = req->fg;
-					b = req->fb;
-					out = (r << 16) | (g << 8) | b;
-				} else {
-					r = req->fr * src[i] + req->br * (255 - src[i]);
-					r += 0x80;
-					r = (r + (r >> 8)) >> 8;
-
-					g = req->fg * src[i] + req->bg * (255 - src[i]);
-					g += 0x80;
-					g = (g + (g >> 8)) >> 8;
-
-					b = req->fb * src[i] + req->bb * (255 - src[i]);
-					b += 0x80;
-					b = (b + (b >> 8)) >> 8;
-					out = (r << 16) | (g << 8) | b;
-				}
-
-				((uint32_t *)dst)[i] = out;
-			}
-			dst += rb->stride;
-			src += req->buf->stride;
-		}
+	if (d2d->shadow)
+		return uterm_blend_xrgb32v(disp, d2d->shadow, d2d->shadow_stride, disp->width,
+					   disp->height, req, num);
+
+	rb = &d2d->rb[d2d->back_rb];
+	return uterm_blend_xrgb32v(disp, rb->map, rb->stride, disp->width, disp->height, req, num);
+}
+
+int uterm_drm2d_display_fake_move(struct uterm_display *disp, unsigned int src_y,
+				  unsigned int dst_y, unsigned int height)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_rb *front, *back;
+	unsigned int sh = disp->height;
+
+	if (src_y > sh || dst_y > sh || height > sh - src_y || height > sh - dst_y)
+		return -EINVAL;
+
+	if (d2d->shadow) {
+		memmove(d2d->shadow + dst_y * d2d->shadow_stride,
+			d2d->shadow + src_y * d2d->shadow_stride,
+			(size_t)height * d2d->shadow_stride);
+		return 0;
 	}
 
+	/* the back buffer may be older, so copy from the last frame */
+	front = &d2d->rb[d2d->last_rb];
+	back = &d2d->rb[d2d->back_rb];
+	if (front->stride != back->stride)
+		return -EINVAL;
+
+	/* a queued frame that gets replaced is its own last frame */
+	memmove((uint8_t *)back->map + dst_y * back->stride,
+		(uint8_t *)front->map + src_y * front->stride, (size_t)height * back->stride);
 	return 0;
 }
 
-int uterm_drm2d_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
+int uterm_drm2d_display_fake_copyv(struct uterm_display *disp,
+				   const struct uterm_video_rect *rects, size_t num)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_rb *front, *back;
+	unsigned int sw = disp->width, sh = disp->height;
+	unsigned int x1, y1, x2, y2, y;
+	size_t i;
+
+	/* the shadow buffer always holds the last frame */
+	front = &d2d->rb[d2d->last_rb];
+	back = &d2d->rb[d2d->back_rb];
+	if (front == back || d2d->shadow)
+		return 0;
+
+	for (i = 0; i < num; ++i) {
+		x1 = min((unsigned int)max(rects[i].x1, 0), sw);
+		y1 = min((unsigned int)max(rects[i].y1, 0), sh);
+		x2 = min((unsigned int)max(rects[i].x2, 0), sw);
+		y2 = min((unsigned int)max(rects[i].y2, 0), sh);
+
+		for (y = y1; y < y2; ++y)
+			memcpy((uint8_t *)back->map + y * back->stride + x1 * 4,
+			       (uint8_t *)front->map + y * front->stride + x1 * 4, (x2 - x1) * 4);
+	}
+
+	return 0;
+}
+
+int uterm_drm2d_display_fake_readv(struct uterm_display *disp, uint8_t *dst,
+				   unsigned int stride, const struct uterm_video_rect *rects,
+				   size_t num)
 {
+	struct uterm_drm2d_display *d2d = disp->data;
 	struct uterm_drm2d_rb *rb;
+
+	if (d2d->shadow) {
+		uterm_blend_copy_rects(dst, stride, d2d->shadow, d2d->shadow_stride, 4,
+				       disp->width, disp->height, rects, num);
+		return 0;
+	}
+
+	rb = &d2d->rb[d2d->back_rb];
+	uterm_blend_copy_rects(dst, stride, rb->map, rb->stride, 4, disp->width, disp->height,
+			       rects, num);
+	return 0;
+}
+
+int uterm_drm2d_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
+{
 	struct uterm_drm2d_display *d2d = disp->data;
-	unsigned int width = disp->width;
-	unsigned int height = disp->height;
-	uint8_t *dst;
-	int i;
-
-	rb = &d2d->rb[d2d->current_rb ^ 1];
-	dst = rb->map;
-
-	while (height--) {
-		for (i = 0; i < width; ++i)
-			((uint32_t *)dst)[i] = (r << 16) | (g << 8) | b;
-		dst += rb->stride;
+	struct uterm_drm2d_rb *rb;
+
+	/* the screen may be cleared without uterm_display_use() */
+	pthread_mutex_lock(&d2d->lock);
+	uterm_drm2d_display_detach(disp, d2d->back_rb);
+	pthread_mutex_unlock(&d2d->lock);
+
+	if (d2d->shadow) {
+		uterm_blend_fill_xrgb32(d2d->shadow, d2d->shadow_stride, disp->width,
+					disp->height, (r << 16) | (g << 8) | b);
+		return 0;
 	}
 
+	rb = &d2d->rb[d2d->back_rb];
+	uterm_blend_fill_xrgb32(rb->map, rb->stride, disp->width, disp->height,
+				(r << 16) | (g << 8) | b);
 	return 0;
 }
@@ -35,6 +35,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -48,6 +49,11 @@
 #include "uterm_video.h"
 #include "uterm_video_internal.h"
 
+#ifdef BUILD_HAVE_GBM
+#include <gbm.h>
+#include <linux/dma-buf.h>
+#endif
+
 #define LOG_SUBSYSTEM "video_drm2d"
 
 static int drm_addfb2(int fd, uint32_t width, uint32_t height, struct uterm_drm2d_rb *rb)
@@ -105,6 +111,128 @@ err_buf:
 	return ret;
 }
 
+#ifdef BUILD_HAVE_GBM
+
+static void sync_rb(struct uterm_drm2d_rb *rb, uint64_t flags)
+{
+	struct dma_buf_sync sync = {.flags = flags};
+
+	if (rb->bo && ioctl(rb->dmabuf, DMA_BUF_IOCTL_SYNC, &sync))
+		log_debug("cannot sync dma-buf (%d): %m", errno);
+}
+
+/* bracket CPU access, so caches are flushed before scanout, if there are any */
+static void begin_rb(struct uterm_drm2d_rb *rb)
+{
+	sync_rb(rb, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+}
+
+static void end_rb(struct uterm_drm2d_rb *rb)
+{
+	sync_rb(rb, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+}
+
+/*
+ * Allocate a linear scanout buffer with GBM. We map its dma-buf instead of
+ * using gbm_bo_map(), which may return a staging copy, so we draw right into
+ * scanout memory. The dma-buf can be handed to other renderers, too.
+ */
+static int init_gbm_rb(struct uterm_video *video, uint32_t width, uint32_t height,
+		       struct uterm_drm2d_rb *rb)
+{
+	struct uterm_drm_video *vdrm = video->data;
+	struct uterm_drm2d_video *v2d = vdrm->data;
+	int ret;
+
+	if (!v2d->gbm) {
+		v2d->gbm = gbm_create_device(vdrm->fd);
+		if (!v2d->gbm) {
+			log_warning("cannot create gbm device");
+			return -EFAULT;
+		}
+	}
+
+	rb->bo = gbm_bo_create(v2d->gbm, width, height, GBM_FORMAT_XRGB8888,
+			       GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+	if (!rb->bo) {
+		log_warning("cannot create linear gbm buffer");
+		return -EFAULT;
+	}
+
+	rb->handle = gbm_bo_get_handle(rb->bo).u32;
+	rb->stride = gbm_bo_get_stride(rb->bo);
+	rb->size = (uint64_t)rb->stride * height;
+
+	rb->dmabuf = gbm_bo_get_fd(rb->bo);
+	if (rb->dmabuf < 0) {
+		log_warning("cannot export gbm buffer as dma-buf");
+		ret = -EFAULT;
+		goto err_bo;
+	}
+
+	rb->map = mmap(0, rb->size, PROT_READ | PROT_WRITE, MAP_SHARED, rb->dmabuf, 0);
+	if (rb->map == MAP_FAILED) {
+		log_warning("cannot mmap dma-buf: %m");
+		ret = -EFAULT;
+		goto err_fd;
+	}
+
+	ret = drm_addfb2(vdrm->fd, width, height, rb);
+	if (ret) {
+		log_warning("cannot add drm-fb for gbm buffer");
+		ret = -EFAULT;
+		goto err_map;
+	}
+
+	begin_rb(rb);
+	memset(rb->map, 0, rb->size);
+	end_rb(rb);
+
+	return 0;
+
+err_map:
+	munmap(rb->map, rb->size);
+err_fd:
+	close(rb->dmabuf);
+err_bo:
+	gbm_bo_destroy(rb->bo);
+	rb->bo = NULL;
+	rb->size = 0;
+	return ret;
+}
+
+static void destroy_gbm_rb(int fd, struct uterm_drm2d_rb *rb)
+{
+	munmap(rb->map, rb->size);
+	drmModeRmFB(fd, rb->id);
+	close(rb->dmabuf);
+	gbm_bo_destroy(rb->bo);
+	rb->bo = NULL;
+	rb->size = 0;
+}
+
+#else /* BUILD_HAVE_GBM */
+
+static void begin_rb(struct uterm_drm2d_rb *rb)
+{
+}
+
+static void end_rb(struct uterm_drm2d_rb *rb)
+{
+}
+
+static int init_gbm_rb(struct uterm_video *video, uint32_t width, uint32_t height,
+		       struct uterm_drm2d_rb *rb)
+{
+	return -EOPNOTSUPP;
+}
+
+static void destroy_gbm_rb(int fd, struct uterm_drm2d_rb *rb)
+{
+}
+
+#endif /* BUILD_HAVE_GBM */
+
 static void destroy_rb(int fd, struct uterm_drm2d_rb *rb)
 {
 	int ret;
@@ -112,6 +240,11 @@ static void destroy_rb(int fd, struct uterm_drm2d_rb *rb)
 	if (!rb->size)
 		return;
 
+	if (rb->bo) {
+		destroy_gbm_rb(fd, rb);
+		return;
+	}
+
 	munmap(rb->map, rb->size);
 	drmModeRmFB(fd, rb->id);
 	ret = drmModeDestroyDumbBuffer(fd, rb->handle);
@@ -120,55 +253,147 @@ static void destroy_rb(int fd, struct uterm_drm2d_rb *rb)
 	rb->size = 0;
 }
 
+static int alloc_rb(struct uterm_display *disp, struct uterm_drm2d_rb *rb)
+{
+	struct uterm_drm_video *vdrm = disp->video->data;
+	int ret = -EOPNOTSUPP;
+
+	if (disp->video->gbm_scanout)
+		ret = init_gbm_rb(disp->video, disp->width, disp->height, rb);
+	if (ret)
+		ret = init_rb(vdrm->fd, disp->width, disp->height, rb);
+	return ret;
+}
+
+/*
+ * Draw into system RAM instead of the framebuffers if they are slow to access,
+ * see uterm_video_use_shadow(). Called before anything was drawn.
+ */
+static void init_shadow(struct uterm_display *disp)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_rb *rb = &d2d->rb[d2d->back_rb];
+	unsigned int i;
+	bool use;
+
+	begin_rb(rb);
+	use = uterm_video_use_shadow(disp->video, disp->name, rb->map, rb->size);
+	end_rb(rb);
+	if (!use)
+		return;
+
+	d2d->shadow_stride = disp->width * 4;
+	d2d->shadow = calloc(disp->height, d2d->shadow_stride);
+	if (!d2d->shadow) {
+		log_warning("cannot allocate shadow buffer for display %s", disp->name);
+		return;
+	}
+
+	for (i = 0; i < UTERM_DRM2D_DAMAGE_HISTORY; ++i)
+		d2d->damage[i].all = true;
+	disp->flags |= DISPLAY_DAMAGE;
+	log_debug("drawing display %s into a shadow buffer", disp->name);
+}
+
 static int display_allocfb(struct uterm_display *disp)
 {
 	struct uterm_drm_video *vdrm = disp->video->data;
 	struct uterm_drm2d_display *d2d = disp->data;
+	unsigned int i;
 	int ret;
 
 	disp->width = d2d->ddrm.current_mode->hdisplay;
 	disp->height = d2d->ddrm.current_mode->vdisplay;
 
+	/* in front mode the only buffer stays on screen and is drawn into */
+	d2d->ddrm.front = vdrm->dirty_fb;
+	if (d2d->ddrm.front) {
+		disp->flags |= DISPLAY_DAMAGE;
+		d2d->num_rb = 1;
+	} else {
+		d2d->num_rb = disp->video->mailbox ? 3 : 2;
+	}
 	d2d->current_rb = 0;
+	d2d->back_rb = d2d->num_rb > 1 ? 1 : 0;
+	d2d->last_rb = 0;
+	d2d->queued_rb = -1;
+	d2d->frame = 0;
+
+	for (i = 0; i < d2d->num_rb; ++i) {
+		ret = alloc_rb(disp, &d2d->rb[i]);
+		if (!ret)
+			continue;
+		if (i < 2)
+			goto err_rb;
 
-	ret = init_rb(vdrm->fd, disp->width, disp->height, &d2d->rb[0]);
-	if (ret)
-		return ret;
+		log_warning("cannot allocate third buffer on display %s, mailbox disabled",
+			    disp->name);
+		d2d->num_rb = 2;
+	}
 
-	ret = init_rb(vdrm->fd, disp->width, disp->height, &d2d->rb[1]);
-	if (ret)
-		goto free_rb0;
-	return 0;
+	if (!d2d->ddrm.front)
+		init_shadow(disp);
 
-free_rb0:
-	destroy_rb(vdrm->fd, &d2d->rb[0]);
 	return 0;
+
+err_rb:
+	while (i--)
+		destroy_rb(vdrm->fd, &d2d->rb[i]);
+	return ret;
 }
 
 static void display_freefb(struct uterm_display *disp)
 {
 	struct uterm_drm_video *vdrm = disp->video->data;
 	struct uterm_drm2d_display *d2d = disp->data;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(d2d->rb) / sizeof(*d2d->rb); ++i) {
+		/* the frames kept in the buffers are lost */
+		if (d2d->kept[i]) {
+			d2d->kept[i]->slot = -1;
+			d2d->kept[i] = NULL;
+		}
+		destroy_rb(vdrm->fd, &d2d->rb[i]);
+	}
+	destroy_rb(vdrm->fd, &d2d->spare);
+
+	free(d2d->shadow);
+	d2d->shadow = NULL;
+	for (i = 0; i < UTERM_DRM2D_DAMAGE_HISTORY; ++i) {
+		free(d2d->damage[i].rects);
+		memset(&d2d->damage[i], 0, sizeof(d2d->damage[i]));
+	}
+}
+
+/* returns a buffer that is neither @a nor @b, or @a if there is none */
+static int free_rb(struct uterm_drm2d_display *d2d, int a, int b)
+{
+	unsigned int i;
+
+	for (i = 0; i < d2d->num_rb; ++i) {
+		if ((int)i != a && (int)i != b)
+			return i;
+	}
 
-	destroy_rb(vdrm->fd, &d2d->rb[0]);
-	destroy_rb(vdrm->fd, &d2d->rb[1]);
+	return a;
 }
 
 static int display_prepare_modeset(struct uterm_display *disp, drmModeAtomicReqPtr req)
 {
 	struct uterm_drm_video *vdrm = disp->video->data;
 	struct uterm_drm2d_display *d2d = disp->data;
-	int rb, ret;
+	int ret;
 
 	if (!d2d->rb[0].size) {
 		ret = display_allocfb(disp);
 		if (ret)
 			return ret;
 	}
-	rb = d2d->current_rb ^ 1;
+	d2d->queued_rb = -1;
 
-	ret = uterm_drm_prepare_commit(vdrm->fd, &d2d->ddrm, req, d2d->rb[rb].id, disp->width,
-				       disp->height, vdrm->cursor_hotspot);
+	ret = uterm_drm_prepare_commit(vdrm->fd, &d2d->ddrm, req, d2d->rb[d2d->back_rb].id,
+				       disp->width, disp->height, vdrm->cursor_hotspot);
 	if (ret)
 		return ret;
 	return 0;
@@ -177,23 +402,37 @@ static int display_prepare_modeset(struct uterm_display *disp, drmModeAtomicReqP
 static void display_done_modeset(struct uterm_display *disp, int status)
 {
 	struct uterm_drm2d_display *d2d = disp->data;
+	int rb;
+
 	if (status) {
 		display_freefb(disp);
 	} else {
-		d2d->current_rb = d2d->current_rb ^ 1;
+		rb = d2d->back_rb;
+		d2d->back_rb = free_rb(d2d, d2d->current_rb, rb);
+		d2d->current_rb = rb;
+		d2d->last_rb = rb;
 	}
 }
 
 static int display_init(struct uterm_display *disp)
 {
 	struct uterm_drm2d_display *d2d;
+	int ret;
 
 	d2d = malloc(sizeof(*d2d));
 	if (!d2d)
 		return -ENOMEM;
 	memset(d2d, 0, sizeof(*d2d));
 
+	ret = pthread_mutex_init(&d2d->lock, NULL);
+	if (ret) {
+		free(d2d);
+		return -ret;
+	}
+
 	disp->data = d2d;
+	/* uterm_blend_xrgb32v() only writes the pixels of the requests */
+	disp->flags |= DISPLAY_THREADED_BLEND;
 
 	d2d->ddrm.prepare_modeset = display_prepare_modeset;
 	d2d->ddrm.done_modeset = display_done_modeset;
@@ -207,40 +446,421 @@ static void display_destroy(struct uterm_display *disp)
 
 	display_freefb(disp);
 	uterm_drm_display_free_properties(disp);
+	pthread_mutex_destroy(&d2d->lock);
 	free(d2d);
 }
 
-static int display_swap(struct uterm_display *disp)
+/* make @rb the spare buffer, or destroy it if there is one or it doesn't fit */
+static void put_spare(struct uterm_display *disp, struct uterm_drm2d_rb *rb)
+{
+	struct uterm_drm_video *vdrm = disp->video->data;
+	struct uterm_drm2d_display *d2d = disp->data;
+
+	if (d2d->spare.size || rb->size != d2d->rb[0].size) {
+		destroy_rb(vdrm->fd, rb);
+	} else {
+		d2d->spare = *rb;
+		rb->size = 0;
+	}
+}
+
+/*
+ * Before buffer @i is drawn into, the frame kept in it takes it along and the
+ * display gets the spare buffer or a new one. Called with the lock held.
+ */
+void uterm_drm2d_display_detach(struct uterm_display *disp, int i)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_frame *f = d2d->kept[i];
+	struct uterm_drm2d_rb rb;
+
+	if (!f)
+		return;
+
+	d2d->kept[i] = NULL;
+	f->slot = -1;
+
+	if (d2d->spare.size) {
+		rb = d2d->spare;
+		d2d->spare.size = 0;
+	} else if (alloc_rb(disp, &rb)) {
+		log_warning("cannot allocate buffer on display %s, dropping kept frame",
+			    disp->name);
+		return;
+	}
+
+	f->rb = d2d->rb[i];
+	d2d->rb[i] = rb;
+	d2d->rb[i].frame = 0;
+}
+
+/* a frame drawn into the queued buffer replaces it, so it can't be flipped */
+static int display_use(struct uterm_display *disp)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+
+	pthread_mutex_lock(&d2d->lock);
+	uterm_drm2d_display_detach(disp, d2d->back_rb);
+	if (d2d->queued_rb == d2d->back_rb)
+		d2d->queued_rb = -1;
+	begin_rb(&d2d->rb[d2d->back_rb]);
+	pthread_mutex_unlock(&d2d->lock);
+
+	return 0;
+}
+
+/* hand @rb to the kernel and draw into a buffer that isn't on screen */
+static int flip_rb(struct uterm_display *disp, int rb)
 {
 	struct uterm_drm2d_display *d2d = disp->data;
 	int ret;
-	int rb;
 
-	rb = d2d->current_rb ^ 1;
 	ret = uterm_drm_display_swap(disp, d2d->rb[rb].id);
 	if (ret)
 		return ret;
 
+	d2d->back_rb = free_rb(d2d, d2d->current_rb, rb);
 	d2d->current_rb = rb;
 	return 0;
 }
 
+/*
+ * Bring buffer @i up to date with the shadow buffer. It holds an older frame,
+ * so the damage of each frame since then is copied, or everything if one of
+ * them is unknown or other clients drew into the buffers.
+ */
+static void flush_shadow(struct uterm_display *disp, int i)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_rb *rb = &d2d->rb[i];
+	struct uterm_video_rect all = {0, 0, disp->width, disp->height};
+	struct uterm_drm2d_damage *damage;
+	uint64_t frame = d2d->frame + 1;
+	uint64_t age = frame - rb->frame;
+	bool full;
+	unsigned int j;
+	uint64_t n;
+
+	full = !rb->frame || age > UTERM_DRM2D_DAMAGE_HISTORY;
+	if (disp->flags & DISPLAY_NEED_REDRAW) {
+		full = true;
+		for (j = 0; j < d2d->num_rb; ++j)
+			d2d->rb[j].frame = 0;
+	}
+	for (n = 0; !full && n < age; ++n)
+		full = d2d->damage[(frame - n) % UTERM_DRM2D_DAMAGE_HISTORY].all;
+
+	if (full) {
+		uterm_blend_copy_rects(rb->map, rb->stride, d2d->shadow, d2d->shadow_stride, 4,
+				       disp->width, disp->height, &all, 1);
+		return;
+	}
+
+	for (n = 0; n < age; ++n) {
+		damage = &d2d->damage[(frame - n) % UTERM_DRM2D_DAMAGE_HISTORY];
+		uterm_blend_copy_rects(rb->map, rb->stride, d2d->shadow, d2d->shadow_stride, 4,
+				       disp->width, disp->height, damage->rects, damage->len);
+	}
+}
+
+static int display_swap(struct uterm_display *disp)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	int ret = 0;
+	int rb;
+
+	pthread_mutex_lock(&d2d->lock);
+
+	rb = d2d->back_rb;
+	if (d2d->shadow)
+		flush_shadow(disp, rb);
+	end_rb(&d2d->rb[rb]);
+	if (d2d->ddrm.front) {
+		ret = uterm_drm_display_dirty(disp, d2d->rb[rb].id);
+	} else if (d2d->num_rb < 3 || !(disp->flags & DISPLAY_VSYNC)) {
+		ret = flip_rb(disp, rb);
+	} else if (disp->dpms != UTERM_DPMS_ON) {
+		ret = -EINVAL;
+	} else {
+		/* the only buffer left is this one, the next frame replaces it */
+		d2d->queued_rb = rb;
+		disp->flags &= ~DISPLAY_NEED_REDRAW;
+	}
+
+	if (!ret) {
+		d2d->rb[rb].frame = ++d2d->frame;
+		d2d->last_rb = rb;
+		/* until told otherwise, the next frame may change everything */
+		d2d->damage[(d2d->frame + 1) % UTERM_DRM2D_DAMAGE_HISTORY].all = true;
+	}
+
+	pthread_mutex_unlock(&d2d->lock);
+	return ret;
+}
+
+static void display_set_damage(struct uterm_display *disp, size_t n_rect,
+			       struct uterm_video_rect *damages)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_damage *damage;
+	struct uterm_video_rect *rects;
+
+	uterm_drm_display_set_damage(disp, n_rect, damages);
+	if (!d2d->shadow)
+		return;
+
+	damage = &d2d->damage[(d2d->frame + 1) % UTERM_DRM2D_DAMAGE_HISTORY];
+
+	damage->all = true;
+	if (n_rect > damage->size) {
+		rects = realloc(damage->rects, n_rect * sizeof(*rects));
+		if (!rects)
+			return;
+		damage->rects = rects;
+		damage->size = n_rect;
+	}
+	memcpy(damage->rects, damages, n_rect * sizeof(*damages));
+	damage->len = n_rect;
+	damage->all = false;
+}
+
+static bool display_is_swapping(struct uterm_display *disp)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+
+	/* in mailbox mode there is always a buffer to draw into */
+	return d2d->num_rb < 3 && uterm_drm_is_swapping(disp);
+}
+
+/* flip the queued frame, if any, now that the pending flip is done */
+static void page_flip_handler(struct uterm_display *disp)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	int ret;
+
+	pthread_mutex_lock(&d2d->lock);
+	if (d2d->queued_rb >= 0) {
+		ret = flip_rb(disp, d2d->queued_rb);
+		if (ret)
+			log_warning("cannot flip queued frame on display %s (%d)", disp->name,
+				    ret);
+		d2d->queued_rb = -1;
+	}
+	pthread_mutex_unlock(&d2d->lock);
+}
+
+/* count the frames since the back buffer was drawn, never drawn is the oldest */
+static int display_get_buffer_age(struct uterm_display *disp)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	uint64_t age = d2d->frame + 1 - d2d->rb[d2d->back_rb].frame;
+
+	/* the shadow buffer always holds the last frame */
+	if (d2d->shadow)
+		return 1;
+
+	return age > INT_MAX ? INT_MAX : (int)age;
+}
+
+/* keep the last swapped frame in the buffer it was drawn into */
+static int display_keep_frame(struct uterm_display *disp, struct uterm_frame *frame)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_frame *f;
+	int ret = 0;
+
+	/*
+	 * The only buffer is drawn into again right away, or the shadow buffer
+	 * would not match a frame shown again.
+	 */
+	if (d2d->ddrm.front || d2d->shadow)
+		return -EOPNOTSUPP;
+
+	f = malloc(sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+	memset(f, 0, sizeof(*f));
+	f->width = disp->width;
+	f->height = disp->height;
+
+	pthread_mutex_lock(&d2d->lock);
+	if (!d2d->rb[d2d->last_rb].frame || d2d->kept[d2d->last_rb]) {
+		ret = -ENOENT;
+	} else {
+		f->slot = d2d->last_rb;
+		d2d->kept[f->slot] = f;
+		frame->size = d2d->rb[f->slot].size;
+		frame->data = f;
+	}
+	pthread_mutex_unlock(&d2d->lock);
+
+	if (ret)
+		free(f);
+	return ret;
+}
+
+/*
+ * A frame still in its buffer is flipped to. Otherwise its buffer replaces the
+ * back buffer, which goes to the frame kept in it, if any, or to the spare.
+ */
+static int display_show_frame(struct uterm_display *disp, struct uterm_frame *frame)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_frame *f = frame->data;
+	struct uterm_drm2d_frame *other;
+	bool mailbox = d2d->num_rb >= 3;
+	int ret = 0;
+	int rb;
+
+	pthread_mutex_lock(&d2d->lock);
+
+	if (f->slot < 0 && !f->rb.size) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if (f->slot < 0 && (f->width != disp->width || f->height != disp->height)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (!mailbox && uterm_drm_is_swapping(disp)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (f->slot >= 0) {
+		rb = f->slot;
+		d2d->kept[rb] = NULL;
+		f->slot = -1;
+	} else {
+		rb = d2d->back_rb;
+		other = d2d->kept[rb];
+		if (other) {
+			d2d->kept[rb] = NULL;
+			other->slot = -1;
+			other->rb = d2d->rb[rb];
+		} else {
+			put_spare(disp, &d2d->rb[rb]);
+		}
+		d2d->rb[rb] = f->rb;
+		d2d->rb[rb].frame = 0;
+		f->rb.size = 0;
+	}
+
+	if (rb == d2d->current_rb) {
+		/* still on screen, a newer frame must not replace it */
+		d2d->queued_rb = -1;
+	} else if (mailbox && uterm_drm_is_swapping(disp)) {
+		d2d->queued_rb = rb;
+		disp->flags &= ~DISPLAY_NEED_REDRAW;
+	} else {
+		ret = flip_rb(disp, rb);
+	}
+
+	if (!ret) {
+		d2d->rb[rb].frame = ++d2d->frame;
+		d2d->last_rb = rb;
+	}
+
+out:
+	pthread_mutex_unlock(&d2d->lock);
+	if (!ret)
+		free(f);
+	return ret;
+}
+
+static void display_drop_frame(struct uterm_display *disp, struct uterm_frame *frame)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_frame *f = frame->data;
+
+	pthread_mutex_lock(&d2d->lock);
+	if (f->slot >= 0)
+		d2d->kept[f->slot] = NULL;
+	else if (f->rb.size)
+		put_spare(disp, &f->rb);
+	pthread_mutex_unlock(&d2d->lock);
+
+	free(f);
+}
+
+/* hand out the buffer of the last frame as a dma-buf */
+static int display_export_frame(struct uterm_display *disp, struct uterm_video_export *out)
+{
+	struct uterm_drm_video *vdrm = disp->video->data;
+	struct uterm_drm2d_display *d2d = disp->data;
+	struct uterm_drm2d_rb *rb;
+	int ret = 0;
+
+	pthread_mutex_lock(&d2d->lock);
+	rb = &d2d->rb[d2d->last_rb];
+	if (!rb->frame)
+		ret = -ENOENT;
+	else if (rb->bo)
+		out->fd = fcntl(rb->dmabuf, F_DUPFD_CLOEXEC, 0);
+	else if (drmPrimeHandleToFD(vdrm->fd, rb->handle, DRM_CLOEXEC, &out->fd))
+		out->fd = -1;
+	if (!ret && out->fd < 0)
+		ret = -errno;
+	out->stride = rb->stride;
+	pthread_mutex_unlock(&d2d->lock);
+
+	if (ret)
+		return ret;
+
+	out->dmabuf = true;
+	out->width = disp->width;
+	out->height = disp->height;
+	out->format = DRM_FORMAT_XRGB8888;
+	out->modifier = DRM_FORMAT_MOD_LINEAR;
+	return 0;
+}
+
+static int display_get_memory(struct uterm_display *disp, struct uterm_display_memory *out)
+{
+	struct uterm_drm2d_display *d2d = disp->data;
+	unsigned int i;
+
+	pthread_mutex_lock(&d2d->lock);
+	for (i = 0; i < d2d->num_rb; ++i)
+		out->bytes += d2d->rb[i].size;
+	out->buffers = d2d->num_rb;
+	/* a buffer given up by a frame that was shown again */
+	if (d2d->spare.size) {
+		out->bytes += d2d->spare.size;
+		++out->buffers;
+	}
+	pthread_mutex_unlock(&d2d->lock);
+
+	if (d2d->shadow)
+		out->shadow = (uint64_t)d2d->shadow_stride * disp->height;
+	return 0;
+}
+
 static const struct display_ops drm2d_display_ops = {
 	.init = display_init,
 	.destroy = display_destroy,
 	.set_dpms = uterm_drm_display_set_dpms,
-	.use = NULL,
+	.use = display_use,
 	.swap = display_swap,
-	.is_swapping = uterm_drm_is_swapping,
+	.is_swapping = display_is_swapping,
 	.fake_blendv = uterm_drm2d_display_fake_blendv,
 	.clear = uterm_drm2d_display_clear,
-	.set_damage = uterm_drm_display_set_damage,
+	.fake_move = uterm_drm2d_display_fake_move,
+	.fake_copyv = uterm_drm2d_display_fake_copyv,
+	.fake_readv = uterm_drm2d_display_fake_readv,
+	.set_damage = display_set_damage,
 	.has_damage = uterm_drm_display_has_damage,
+	.get_buffer_age = display_get_buffer_age,
 	.setup_cursor = uterm_drm_display_setup_cursor,
 	.destroy_cursor = uterm_drm_display_destroy_cursor,
 	.show_cursor = uterm_drm_display_show_cursor,
 	.hide_cursor = uterm_drm_display_hide_cursor,
 	.set_cursor_offset = uterm_drm_display_set_cursor_offset,
+	.keep_frame = display_keep_frame,
+	.show_frame = display_show_frame,
+	.drop_frame = display_drop_frame,
+	.export_frame = display_export_frame,
+	.get_memory = display_get_memory,
 };
 
 static void show_displays(struct uterm_video *video)
@@ -268,9 +888,11 @@ static void show_displays(struct uterm_video *video)
 		 * tearing but that's acceptable as this is only called during
 		 * wakeup/sleep. */
 
+		/* a frame kept in the buffer is left as it is */
 		d2d = iter->data;
 		rb = &d2d->rb[d2d->current_rb];
-		memset(rb->map, 0, rb->size);
+		if (!d2d->kept[d2d->current_rb])
+			memset(rb->map, 0, rb->size);
 		uterm_drm_display_wait_pflip(iter);
 	}
 }
@@ -280,10 +902,18 @@ static int video_init(struct uterm_video *video, const char *node)
 	int ret;
 	uint64_t has_dumb;
 	struct uterm_drm_video *vdrm;
+	struct uterm_drm2d_video *v2d;
 
-	ret = uterm_drm_video_init(video, node, &drm2d_display_ops, NULL, NULL);
-	if (ret)
+	v2d = malloc(sizeof(*v2d));
+	if (!v2d)
+		return -ENOMEM;
+	memset(v2d, 0, sizeof(*v2d));
+
+	ret = uterm_drm_video_init(video, node, &drm2d_display_ops, page_flip_handler, v2d);
+	if (ret) {
+		free(v2d);
 		return ret;
+	}
 	vdrm = video->data;
 
 	log_debug("initialize 2D layer on %p", video);
@@ -291,6 +921,7 @@ static int video_init(struct uterm_video *video, const char *node)
 	if (drmGetCap(vdrm->fd, DRM_CAP_DUMB_BUFFER, &has_dumb) < 0 || !has_dumb) {
 		log_err("driver does not support dumb buffers");
 		uterm_drm_video_destroy(video);
+		free(v2d);
 		return -EOPNOTSUPP;
 	}
 
@@ -299,8 +930,15 @@ static int video_init(struct uterm_video *video, const char *node)
 
 static void video_destroy(struct uterm_video *video)
 {
+	struct uterm_drm2d_video *v2d = uterm_drm_video_get_data(video);
+
 	log_info("free drm video device %p", video);
+#ifdef BUILD_HAVE_GBM
+	if (v2d->gbm)
+		gbm_device_destroy(v2d->gbm);
+#endif
 	uterm_drm_video_destroy(video);
+	free(v2d);
 }
 
 static int video_poll(struct uterm_video *video)
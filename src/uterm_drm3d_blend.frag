@@ -32,13 +32,13 @@
 precision mediump float;
 
 uniform sampler2D texture;
-uniform vec3 fgcolor;
-uniform vec3 bgcolor;
 varying vec2 texpos;
+varying vec3 fgcol;
+varying vec3 bgcol;
 
 void main()
 {
 	float alpha = texture2D(texture, texpos).a;
-	vec3 val = alpha * fgcolor + (1.0 - alpha) * bgcolor;
+	vec3 val = alpha * fgcol + (1.0 - alpha) * bgcol;
 	gl_FragColor = vec4(val, 1.0);
 }
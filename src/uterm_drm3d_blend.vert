@@ -27,16 +27,23 @@
 /*
  * Vertex Shader
  * This shader is a very basic vertex shader which forwards all data and
- * performs basic matrix multiplications.
+ * performs basic matrix multiplications. Each glyph brings its own colors so a
+ * whole batch of them can be drawn at once.
  */
 
 uniform mat4 projection;
 attribute vec2 position;
 attribute vec2 texture_position;
+attribute vec3 fgcolor;
+attribute vec3 bgcolor;
 varying vec2 texpos;
+varying vec3 fgcol;
+varying vec3 bgcol;
 
 void main()
 {
 	gl_Position = projection * vec4(position, 0.0, 1.0);
 	texpos = texture_position;
+	fgcol = fgcolor;
+	bgcol = bgcolor;
 }
@@ -56,6 +56,8 @@
 struct uterm_drm3d_rb {
 	struct uterm_display *disp;
 	struct gbm_bo *bo;
+	uint32_t handle; /* of bo on the scanout device */
+	bool imported;	 /* handle was imported from the render device */
 	uint32_t id;
 };
 
@@ -65,9 +67,18 @@ struct uterm_drm3d_display {
 	EGLSurface surface;
 	struct uterm_drm3d_rb *current;
 	struct uterm_drm3d_rb *next;
+	/* in mailbox mode, the frame waiting for the pending flip */
+	struct uterm_drm3d_rb *queued;
+
+	/* damage of the next swap, as EGL x/y/width/height quadruples */
+	EGLint *damage;
+	EGLint damage_num;
+	size_t damage_size;
 };
 
 struct uterm_drm3d_video {
+	/* with render offload, gbm renders on render_fd instead of the device */
+	int render_fd;
 	struct gbm_device *gbm;
 	EGLDisplay disp;
 	EGLConfig conf;
@@ -75,13 +86,14 @@ struct uterm_drm3d_video {
 
 	unsigned int sinit;
 	bool supports_rowlen;
+	bool supports_buffer_age;
+	PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_with_damage;
 	GLuint tex;
 
 	struct gl_shader *blend_shader;
 	GLuint uni_blend_proj;
 	GLuint uni_blend_tex;
-	GLuint uni_blend_fgcol;
-	GLuint uni_blend_bgcol;
+	struct uterm_drm3d_atlas *atlas;
 };
 
 int uterm_drm3d_display_use(struct uterm_display *disp);
@@ -45,8 +45,11 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include "eloop.h"
+#include "shl_arena.h"
 #include "shl_gl.h"
+#include "shl_hashtable.h"
 #include "shl_log.h"
+#include "shl_misc.h"
 #include "uterm_drm3d_blend.frag.bin.h"
 #include "uterm_drm3d_blend.vert.bin.h"
 #include "uterm_drm3d_internal.h"
@@ -56,11 +59,317 @@
 
 #define LOG_SUBSYSTEM "uterm_drm3d_render"
 
+/*
+ * Glyph Atlas
+ * fake_blendv() keeps every glyph it has seen in one alpha texture, so a frame
+ * costs a single upload of the new glyphs and a single draw call. Glyphs are
+ * keyed on their buffer, which the text renderers keep alive in their glyph
+ * caches. Those may reuse a buffer for another glyph after eviction, hence the
+ * content is compared against the CPU copy of the atlas, too. When the atlas
+ * is full, it is flushed and started over. UTERM_FORMAT_MONO glyphs are
+ * expanded to alpha on the way in, UTERM_FORMAT_ARGB32 color glyphs keep their
+ * alpha only and are drawn in the foreground color.
+ */
+
+#define ATLAS_SIZE 2048
+
+struct atlas_slot {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct atlas_vertex {
+	GLfloat pos[2];
+	GLfloat tex[2];
+	GLubyte fg[4];
+	GLubyte bg[4];
+};
+
+struct uterm_drm3d_atlas {
+	unsigned int width;
+	unsigned int height;
+	uint8_t *data;
+	struct shl_hashtable *slots;
+	struct shl_pool slot_pool; /* the slots of @slots, freed all at once */
+
+	unsigned int shelf_x;
+	unsigned int shelf_y;
+	unsigned int shelf_h;
+	unsigned int dirty_start;
+	unsigned int dirty_end;
+
+	struct atlas_vertex *vertices;
+	size_t vertex_size;
+	size_t vertex_num;
+
+	/* a mono or color glyph row as alpha, for comparison */
+	uint8_t row[ATLAS_SIZE];
+};
+
+static void atlas_free(struct uterm_drm3d_atlas *atlas)
+{
+	if (!atlas)
+		return;
+
+	shl_hashtable_free(atlas->slots);
+	shl_pool_deinit(&atlas->slot_pool);
+	free(atlas->vertices);
+	free(atlas->data);
+	free(atlas);
+}
+
+static int atlas_new(struct uterm_drm3d_atlas **out)
+{
+	struct uterm_drm3d_atlas *atlas;
+	GLint max;
+	int ret;
+
+	atlas = malloc(sizeof(*atlas));
+	if (!atlas)
+		return -ENOMEM;
+	memset(atlas, 0, sizeof(*atlas));
+	shl_pool_init(&atlas->slot_pool, sizeof(struct atlas_slot));
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max);
+	atlas->width = ATLAS_SIZE;
+	if (max > 0 && (unsigned int)max < atlas->width)
+		atlas->width = max;
+	atlas->height = atlas->width;
+
+	atlas->data = malloc(atlas->width * atlas->height);
+	if (!atlas->data) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	memset(atlas->data, 0, atlas->width * atlas->height);
+
+	ret = shl_hashtable_new(&atlas->slots, shl_direct_hash, shl_direct_equal, NULL);
+	if (ret)
+		goto err_free;
+
+	*out = atlas;
+	return 0;
+
+err_free:
+	atlas_free(atlas);
+	return ret;
+}
+
+static int atlas_reset(struct uterm_drm3d_atlas *atlas)
+{
+	shl_hashtable_free(atlas->slots);
+	atlas->slots = NULL;
+	shl_pool_clear(&atlas->slot_pool);
+	atlas->shelf_x = 0;
+	atlas->shelf_y = 0;
+	atlas->shelf_h = 0;
+	atlas->dirty_start = 0;
+	atlas->dirty_end = 0;
+
+	return shl_hashtable_new(&atlas->slots, shl_direct_hash, shl_direct_equal, NULL);
+}
+
+static bool atlas_slot_matches(struct uterm_drm3d_atlas *atlas, const struct atlas_slot *slot,
+			       const struct uterm_video_buffer *buf)
+{
+	const uint8_t *src, *dst;
+	unsigned int i;
+
+	if (slot->width != buf->width || slot->height != buf->height)
+		return false;
+
+	dst = &atlas->data[slot->y * atlas->width + slot->x];
+	for (i = 0; i < buf->height; ++i) {
+		src = &buf->data[i * buf->stride];
+		if (buf->format != UTERM_FORMAT_GREY) {
+			uterm_video_buffer_unpack(atlas->row, buf, i);
+			src = atlas->row;
+		}
+		if (memcmp(dst, src, buf->width))
+			return false;
+		dst += atlas->width;
+	}
+
+	return true;
+}
+
+static void atlas_slot_load(struct uterm_drm3d_atlas *atlas, const struct atlas_slot *slot,
+			    const struct uterm_video_buffer *buf)
+{
+	uint8_t *dst;
+	unsigned int i;
+
+	dst = &atlas->data[slot->y * atlas->width + slot->x];
+	for (i = 0; i < buf->height; ++i) {
+		uterm_video_buffer_unpack(dst, buf, i);
+		dst += atlas->width;
+	}
+
+	if (atlas->dirty_start == atlas->dirty_end) {
+		atlas->dirty_start = slot->y;
+		atlas->dirty_end = slot->y + slot->height;
+	} else {
+		atlas->dirty_start = min(atlas->dirty_start, slot->y);
+		atlas->dirty_end = max(atlas->dirty_end, slot->y + slot->height);
+	}
+}
+
+/* place a glyph on the current shelf or open a new one below */
+static int atlas_place(struct uterm_drm3d_atlas *atlas, struct atlas_slot *slot,
+		       const struct uterm_video_buffer *buf)
+{
+	if (buf->width > atlas->width || buf->height > atlas->height)
+		return -EINVAL;
+
+	if (atlas->shelf_x + buf->width > atlas->width) {
+		atlas->shelf_y += atlas->shelf_h;
+		atlas->shelf_x = 0;
+		atlas->shelf_h = 0;
+	}
+	if (atlas->shelf_y + buf->height > atlas->height)
+		return -ENOSPC;
+
+	slot->x = atlas->shelf_x;
+	slot->y = atlas->shelf_y;
+	slot->width = buf->width;
+	slot->height = buf->height;
+	atlas->shelf_x += buf->width;
+	atlas->shelf_h = max(atlas->shelf_h, buf->height);
+
+	return 0;
+}
+
+static int atlas_get(struct uterm_drm3d_atlas *atlas, const struct uterm_video_buffer *buf,
+		     struct atlas_slot **out)
+{
+	struct atlas_slot *slot;
+	uint64_t key = (uintptr_t)buf;
+	int ret;
+
+	if (shl_hashtable_find(atlas->slots, (void **)&slot, key)) {
+		if (atlas_slot_matches(atlas, slot, buf)) {
+			*out = slot;
+			return 0;
+		}
+
+		/* the buffer was reused for another glyph */
+		if (slot->width != buf->width || slot->height != buf->height) {
+			ret = atlas_place(atlas, slot, buf);
+			if (ret)
+				return ret;
+		}
+	} else {
+		slot = shl_pool_alloc(&atlas->slot_pool);
+		if (!slot)
+			return -ENOMEM;
+
+		ret = atlas_place(atlas, slot, buf);
+		if (!ret)
+			ret = shl_hashtable_insert(atlas->slots, key, slot);
+		if (ret) {
+			shl_pool_free(&atlas->slot_pool, slot);
+			return ret;
+		}
+	}
+
+	atlas_slot_load(atlas, slot, buf);
+	*out = slot;
+	return 0;
+}
+
+static void atlas_push(struct uterm_drm3d_atlas *atlas, const struct atlas_slot *slot,
+		       const struct uterm_video_blend_req *req, unsigned int width,
+		       unsigned int height, unsigned int sw, unsigned int sh)
+{
+	struct atlas_vertex *v = &atlas->vertices[atlas->vertex_num];
+	GLfloat x1, y1, x2, y2, s1, t1, s2, t2;
+	unsigned int i;
+
+	x1 = 2.0f * req->x / sw - 1.0f;
+	x2 = 2.0f * (req->x + width) / sw - 1.0f;
+	y1 = 1.0f - 2.0f * req->y / sh;
+	y2 = 1.0f - 2.0f * (req->y + height) / sh;
+	s1 = (GLfloat)slot->x / atlas->width;
+	s2 = (GLfloat)(slot->x + width) / atlas->width;
+	t1 = (GLfloat)slot->y / atlas->height;
+	t2 = (GLfloat)(slot->y + height) / atlas->height;
+
+	/* two triangles, top-left, bottom-left, bottom-right and so on */
+	v[0].pos[0] = x1;
+	v[0].pos[1] = y1;
+	v[0].tex[0] = s1;
+	v[0].tex[1] = t1;
+	v[1].pos[0] = x1;
+	v[1].pos[1] = y2;
+	v[1].tex[0] = s1;
+	v[1].tex[1] = t2;
+	v[2].pos[0] = x2;
+	v[2].pos[1] = y2;
+	v[2].tex[0] = s2;
+	v[2].tex[1] = t2;
+	v[3] = v[0];
+	v[4] = v[2];
+	v[5].pos[0] = x2;
+	v[5].pos[1] = y1;
+	v[5].tex[0] = s2;
+	v[5].tex[1] = t1;
+
+	for (i = 0; i < 6; ++i) {
+		v[i].fg[0] = req->fr;
+		v[i].fg[1] = req->fg;
+		v[i].fg[2] = req->fb;
+		v[i].bg[0] = req->br;
+		v[i].bg[1] = req->bg;
+		v[i].bg[2] = req->bb;
+	}
+
+	atlas->vertex_num += 6;
+}
+
+/* upload the new glyphs and draw everything queued so far */
+static void atlas_flush(struct uterm_drm3d_atlas *atlas)
+{
+	if (atlas->dirty_start < atlas->dirty_end) {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, atlas->dirty_start, atlas->width,
+				atlas->dirty_end - atlas->dirty_start, GL_ALPHA, GL_UNSIGNED_BYTE,
+				&atlas->data[atlas->dirty_start * atlas->width]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		atlas->dirty_start = 0;
+		atlas->dirty_end = 0;
+	}
+
+	if (!atlas->vertex_num)
+		return;
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct atlas_vertex),
+			      &atlas->vertices->pos);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(struct atlas_vertex),
+			      &atlas->vertices->tex);
+	glVertexAttribPointer(2, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct atlas_vertex),
+			      &atlas->vertices->fg);
+	glVertexAttribPointer(3, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct atlas_vertex),
+			      &atlas->vertices->bg);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	glDrawArrays(GL_TRIANGLES, 0, atlas->vertex_num);
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(2);
+	glDisableVertexAttribArray(3);
+
+	atlas->vertex_num = 0;
+}
+
 static int init_shaders(struct uterm_video *video)
 {
 	struct uterm_drm3d_video *v3d = uterm_drm_video_get_data(video);
 	int ret;
-	char *blend_attr[] = {"position", "texture_position"};
+	char *blend_attr[] = {"position", "texture_position", "fgcolor", "bgcolor"};
 	int blend_vlen, blend_flen;
 	const char *blend_vert, *blend_frag;
 
@@ -76,17 +385,25 @@ static int init_shaders(struct uterm_video *video)
 	blend_frag = _binary_uterm_drm3d_blend_frag_start;
 	blend_flen = _binary_uterm_drm3d_blend_frag_size;
 
-	ret = gl_shader_new(&v3d->blend_shader, blend_vert, blend_vlen, blend_frag, blend_flen,
-			    blend_attr, 2);
+	ret = gl_shader_new_cached(&v3d->blend_shader, video->shader_cache, blend_vert, blend_vlen,
+				   blend_frag, blend_flen, blend_attr, 4);
 	if (ret)
 		return ret;
 
 	v3d->uni_blend_proj = gl_shader_get_uniform(v3d->blend_shader, "projection");
 	v3d->uni_blend_tex = gl_shader_get_uniform(v3d->blend_shader, "texture");
-	v3d->uni_blend_fgcol = gl_shader_get_uniform(v3d->blend_shader, "fgcolor");
-	v3d->uni_blend_bgcol = gl_shader_get_uniform(v3d->blend_shader, "bgcolor");
+
+	ret = atlas_new(&v3d->atlas);
+	if (ret) {
+		gl_shader_unref(v3d->blend_shader);
+		return ret;
+	}
 
 	gl_tex_new(&v3d->tex, 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, v3d->atlas->width, v3d->atlas->height, 0,
+		     GL_ALPHA, GL_UNSIGNED_BYTE, v3d->atlas->data);
 	v3d->sinit = 2;
 
 	return 0;
@@ -100,23 +417,72 @@ void uterm_drm3d_deinit_shaders(struct uterm_video *video)
 		return;
 
 	v3d->sinit = 0;
+	atlas_free(v3d->atlas);
+	v3d->atlas = NULL;
 	gl_tex_free(&v3d->tex, 1);
 	gl_shader_unref(v3d->blend_shader);
 }
 
-static int display_blend(struct uterm_display *disp, const struct uterm_video_buffer *buf,
-			 unsigned int x, unsigned int y, uint8_t fr, uint8_t fg, uint8_t fb,
-			 uint8_t br, uint8_t bg, uint8_t bb)
+/* queue the glyph of @req, making room in the atlas if needed */
+static int push_glyph(struct uterm_drm3d_atlas *atlas, const struct uterm_video_blend_req *req,
+		      unsigned int sw, unsigned int sh)
+{
+	struct atlas_slot *slot;
+	unsigned int width, height;
+	int ret;
+
+	if (req->x >= sw || req->y >= sh)
+		return -EINVAL;
+	width = min(req->buf->width, sw - req->x);
+	height = min(req->buf->height, sh - req->y);
+
+	ret = atlas_get(atlas, req->buf, &slot);
+	if (ret == -ENOSPC) {
+		/* draw what refers to the old content before replacing it */
+		atlas_flush(atlas);
+		ret = atlas_reset(atlas);
+		if (!ret)
+			ret = atlas_get(atlas, req->buf, &slot);
+	}
+	if (ret)
+		return ret;
+
+	atlas_push(atlas, slot, req, width, height, sw, sh);
+	return 0;
+}
+
+/* each glyph of a span is a quad of its own */
+static int blend_span(struct uterm_drm3d_atlas *atlas, const struct uterm_video_blend_req *req,
+		      unsigned int sw, unsigned int sh)
+{
+	struct uterm_video_blend_req glyph = *req;
+	unsigned int i;
+	int ret;
+
+	glyph.flags = 0;
+	for (i = 0; i < req->buf_num; ++i) {
+		glyph.buf = req->bufs[i];
+		ret = push_glyph(atlas, &glyph, sw, sh);
+		if (ret)
+			return ret;
+		glyph.x += glyph.buf->width;
+	}
+
+	return 0;
+}
+
+int uterm_drm3d_display_fake_blendv(struct uterm_display *disp,
+				    const struct uterm_video_blend_req *req, size_t num)
 {
 	struct uterm_drm3d_video *v3d;
-	unsigned int sw, sh, tmp, width, height, i;
+	struct uterm_drm3d_atlas *atlas;
+	struct atlas_vertex *vertices;
+	unsigned int sw, sh, width, height;
+	size_t i, quads;
 	float mat[16];
-	float vertices[6 * 2], texpos[6 * 2], fgcol[3], bgcol[3];
 	int ret;
-	uint8_t *packed, *dst;
-	const uint8_t *src;
 
-	if (!buf)
+	if (!disp || !req)
 		return -EINVAL;
 
 	v3d = uterm_drm_video_get_data(disp->video);
@@ -126,62 +492,23 @@ static int display_blend(struct uterm_display *disp, const struct uterm_video_bu
 	ret = init_shaders(disp->video);
 	if (ret)
 		return ret;
+	atlas = v3d->atlas;
 
-	sw = disp->width;
-	sh = disp->height;
+	for (i = 0, quads = 0; i < num; ++i)
+		quads += (req[i].flags & UTERM_BLEND_SPAN) ? req[i].buf_num : 1;
 
-	vertices[0] = -1.0;
-	vertices[1] = -1.0;
-	vertices[2] = -1.0;
-	vertices[3] = +1.0;
-	vertices[4] = +1.0;
-	vertices[5] = +1.0;
-
-	vertices[6] = -1.0;
-	vertices[7] = -1.0;
-	vertices[8] = +1.0;
-	vertices[9] = +1.0;
-	vertices[10] = +1.0;
-	vertices[11] = -1.0;
-
-	texpos[0] = 0.0;
-	texpos[1] = 1.0;
-	texpos[2] = 0.0;
-	texpos[3] = 0.0;
-	texpos[4] = 1.0;
-	texpos[5] = 0.0;
-
-	texpos[6] = 0.0;
-	texpos[7] = 1.0;
-	texpos[8] = 1.0;
-	texpos[9] = 0.0;
-	texpos[10] = 1.0;
-	texpos[11] = 1.0;
-
-	fgcol[0] = fr / 255.0;
-	fgcol[1] = fg / 255.0;
-	fgcol[2] = fb / 255.0;
-	bgcol[0] = br / 255.0;
-	bgcol[1] = bg / 255.0;
-	bgcol[2] = bb / 255.0;
-
-	tmp = x + buf->width;
-	if (tmp < x || x >= sw)
-		return -EINVAL;
-	if (tmp > sw)
-		width = sw - x;
-	else
-		width = buf->width;
+	if (quads * 6 > atlas->vertex_size) {
+		vertices = realloc(atlas->vertices, quads * 6 * sizeof(*vertices));
+		if (!vertices)
+			return -ENOMEM;
+		atlas->vertices = vertices;
+		atlas->vertex_size = quads * 6;
+	}
 
-	tmp = y + buf->height;
-	if (tmp < y || y >= sh)
-		return -EINVAL;
-	if (tmp > sh)
-		height = sh - y;
-	else
-		height = buf->height;
+	sw = disp->width;
+	sh = disp->height;
 
-	glViewport(x, sh - y - height, width, height);
+	glViewport(0, 0, sw, sh);
 	glDisable(GL_BLEND);
 
 	gl_shader_use(v3d->blend_shader);
@@ -189,79 +516,59 @@ static int display_blend(struct uterm_display *disp, const struct uterm_video_bu
 	gl_m4_identity(mat);
 	glUniformMatrix4fv(v3d->uni_blend_proj, 1, GL_FALSE, mat);
 
-	glUniform3fv(v3d->uni_blend_fgcol, 1, fgcol);
-	glUniform3fv(v3d->uni_blend_bgcol, 1, bgcol);
-
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, v3d->tex);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-	if (v3d->supports_rowlen) {
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, buf->stride);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA,
-			     GL_UNSIGNED_BYTE, buf->data);
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-	} else if (buf->stride == width) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA,
-			     GL_UNSIGNED_BYTE, buf->data);
-	} else {
-		packed = malloc(width * height);
-		if (!packed)
-			return -ENOMEM;
+	glUniform1i(v3d->uni_blend_tex, 0);
 
-		src = buf->data;
-		dst = packed;
-		for (i = 0; i < height; ++i) {
-			memcpy(dst, src, width);
-			dst += width;
-			src += buf->stride;
+	atlas->vertex_num = 0;
+	for (; num--; ++req) {
+		if (req->flags & UTERM_BLEND_FILL) {
+			if (req->x >= sw || req->y >= sh) {
+				ret = -EINVAL;
+				break;
+			}
+			width = min(req->width, sw - req->x);
+			height = min(req->height, sh - req->y);
+
+			/* keep the order with the glyphs queued so far */
+			atlas_flush(atlas);
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(req->x, sh - req->y - height, width, height);
+			glClearColor(req->br / 255.0f, req->bg / 255.0f, req->bb / 255.0f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
+			glDisable(GL_SCISSOR_TEST);
+			continue;
 		}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA,
-			     GL_UNSIGNED_BYTE, packed);
+		if (req->flags & UTERM_BLEND_SPAN) {
+			ret = blend_span(atlas, req, sw, sh);
+			if (ret)
+				break;
+			continue;
+		}
 
-		free(packed);
-	}
+		if (!req->buf)
+			continue;
 
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glUniform1i(v3d->uni_blend_tex, 0);
+		/* the atlas only holds alpha */
+		if (req->flags & UTERM_BLEND_XRGB32) {
+			ret = -EOPNOTSUPP;
+			break;
+		}
 
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertices);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texpos);
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
+		ret = push_glyph(atlas, req, sw, sh);
+		if (ret)
+			break;
+	}
+
+	atlas_flush(atlas);
 
 	if (gl_has_error(v3d->blend_shader)) {
 		log_warning("GL error");
 		return -EFAULT;
 	}
 
-	return 0;
-}
-
-int uterm_drm3d_display_fake_blendv(struct uterm_display *disp,
-				    const struct uterm_video_blend_req *req, size_t num)
-{
-	int ret;
-	unsigned int i;
-
-	if (!disp || !req)
-		return -EINVAL;
-
-	for (i = 0; i < num; ++i, ++req) {
-		if (!req->buf)
-			continue;
-
-		ret = display_blend(disp, req->buf, req->x, req->y, req->fr, req->fg, req->fb,
-				    req->br, req->bg, req->bb);
-		if (ret)
-			return ret;
-	}
-
-	return 0;
+	return ret;
 }
 
 int uterm_drm3d_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
@@ -55,6 +55,34 @@
 
 #define LOG_SUBSYSTEM "uterm_drm3d_video"
 
+static void close_handle(int fd, uint32_t handle)
+{
+	struct drm_gem_close req;
+
+	memset(&req, 0, sizeof(req));
+	req.handle = handle;
+	if (drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &req))
+		log_warning("cannot close imported buffer (%d): %m", errno);
+}
+
+/* render offload: the scanout device gets @rb's buffer through a dma-buf */
+static int import_bo(int fd, struct uterm_drm3d_rb *rb)
+{
+	int dmabuf, ret;
+
+	dmabuf = gbm_bo_get_fd(rb->bo);
+	if (dmabuf < 0)
+		return -EFAULT;
+
+	ret = drmPrimeFDToHandle(fd, dmabuf, &rb->handle);
+	close(dmabuf);
+	if (ret)
+		return -EFAULT;
+
+	rb->imported = true;
+	return 0;
+}
+
 static void bo_destroy_event(struct gbm_bo *bo, void *data)
 {
 	struct uterm_drm3d_rb *rb = data;
@@ -65,12 +93,14 @@ static void bo_destroy_event(struct gbm_bo *bo, void *data)
 
 	vdrm = rb->disp->video->data;
 	drmModeRmFB(vdrm->fd, rb->id);
+	if (rb->imported)
+		close_handle(vdrm->fd, rb->handle);
 	free(rb);
 }
 
 static int drm_addfb2(int fd, struct uterm_drm3d_rb *rb)
 {
-	uint32_t handles[4] = {gbm_bo_get_handle(rb->bo).u32, 0, 0, 0};
+	uint32_t handles[4] = {rb->handle, 0, 0, 0};
 	uint32_t pitches[4] = {gbm_bo_get_stride(rb->bo), 0, 0, 0};
 	uint32_t offsets[4] = {0, 0, 0, 0};
 
@@ -83,6 +113,7 @@ static struct uterm_drm3d_rb *bo_to_rb(struct uterm_display *disp, struct gbm_bo
 	struct uterm_drm3d_rb *rb = gbm_bo_get_user_data(bo);
 	struct uterm_video *video = disp->video;
 	struct uterm_drm_video *vdrm = video->data;
+	struct uterm_drm3d_video *v3d = vdrm->data;
 	int ret;
 
 	if (rb)
@@ -93,12 +124,23 @@ static struct uterm_drm3d_rb *bo_to_rb(struct uterm_display *disp, struct gbm_bo
 		log_err("cannot allocate memory for render buffer");
 		return NULL;
 	}
+	memset(rb, 0, sizeof(*rb));
 	rb->disp = disp;
 	rb->bo = bo;
 
+	if (v3d->render_fd < 0) {
+		rb->handle = gbm_bo_get_handle(bo).u32;
+	} else if (import_bo(vdrm->fd, rb)) {
+		log_err("cannot import buffer of render device");
+		free(rb);
+		return NULL;
+	}
+
 	ret = drm_addfb2(vdrm->fd, rb);
 	if (ret) {
 		log_err("cannot add drm-fb %d", ret);
+		if (rb->imported)
+			close_handle(vdrm->fd, rb->handle);
 		free(rb);
 		return NULL;
 	}
@@ -115,6 +157,7 @@ static int display_allocfb(struct uterm_display *disp)
 	int ret;
 	struct gbm_bo *bo;
 	drmModeModeInfo *minfo;
+	uint32_t flags;
 
 	v3d = uterm_drm_video_get_data(video);
 
@@ -126,10 +169,16 @@ static int display_allocfb(struct uterm_display *disp)
 
 	d3d->current = NULL;
 	d3d->next = NULL;
+	d3d->queued = NULL;
 
-	d3d->gbm =
-		gbm_surface_create(v3d->gbm, minfo->hdisplay, minfo->vdisplay, GBM_FORMAT_XRGB8888,
-				   GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	/* another GPU scans the buffers out, it can only read linear ones */
+	if (v3d->render_fd >= 0)
+		flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR;
+	else
+		flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
+
+	d3d->gbm = gbm_surface_create(v3d->gbm, minfo->hdisplay, minfo->vdisplay,
+				      GBM_FORMAT_XRGB8888, flags);
 	if (!d3d->gbm) {
 		log_err("cannot create gbm surface");
 		ret = -EFAULT;
@@ -207,6 +256,10 @@ static void display_freefb(struct uterm_display *disp)
 		gbm_surface_release_buffer(d3d->gbm, d3d->next->bo);
 		d3d->next = NULL;
 	}
+	if (d3d->queued) {
+		gbm_surface_release_buffer(d3d->gbm, d3d->queued->bo);
+		d3d->queued = NULL;
+	}
 	if (d3d->surface) {
 		eglDestroySurface(v3d->disp, d3d->surface);
 		d3d->surface = NULL;
@@ -281,6 +334,10 @@ static void display_done_modeset(struct uterm_display *disp, int status)
 		gbm_surface_release_buffer(d3d->gbm, d3d->next->bo);
 		d3d->next = NULL;
 	}
+	if (d3d->queued) {
+		gbm_surface_release_buffer(d3d->gbm, d3d->queued->bo);
+		d3d->queued = NULL;
+	}
 }
 
 static int display_init(struct uterm_display *disp)
@@ -301,9 +358,12 @@ static int display_init(struct uterm_display *disp)
 
 static void display_destroy(struct uterm_display *disp)
 {
+	struct uterm_drm3d_display *d3d = disp->data;
+
 	display_freefb(disp);
 	uterm_drm_display_free_properties(disp);
-	free(disp->data);
+	free(d3d->damage);
+	free(d3d);
 }
 
 /*
@@ -325,6 +385,7 @@ int uterm_drm3d_display_use(struct uterm_display *disp)
 static int display_swap(struct uterm_display *disp)
 {
 	int ret;
+	EGLBoolean b;
 	struct gbm_bo *bo;
 	struct uterm_drm3d_rb *rb;
 	struct uterm_drm3d_display *d3d = disp->data;
@@ -334,7 +395,13 @@ static int display_swap(struct uterm_display *disp)
 	if (!gbm_surface_has_free_buffers(d3d->gbm))
 		return -EBUSY;
 
-	if (!eglSwapBuffers(v3d->disp, d3d->surface)) {
+	if (d3d->damage_num && v3d->swap_with_damage)
+		b = v3d->swap_with_damage(v3d->disp, d3d->surface, d3d->damage, d3d->damage_num);
+	else
+		b = eglSwapBuffers(v3d->disp, d3d->surface);
+	d3d->damage_num = 0;
+
+	if (!b) {
 		log_err("cannot swap EGL buffers");
 		return -EFAULT;
 	}
@@ -351,6 +418,16 @@ static int display_swap(struct uterm_display *disp)
 		gbm_surface_release_buffer(d3d->gbm, bo);
 		return -EFAULT;
 	}
+
+	if (video->mailbox && (disp->flags & DISPLAY_VSYNC) && disp->dpms == UTERM_DPMS_ON) {
+		/* replace the frame waiting for the pending flip */
+		if (d3d->queued)
+			gbm_surface_release_buffer(d3d->gbm, d3d->queued->bo);
+		d3d->queued = rb;
+		disp->flags &= ~DISPLAY_NEED_REDRAW;
+		return 0;
+	}
+
 	ret = uterm_drm_display_swap(disp, rb->id);
 	if (ret) {
 		gbm_surface_release_buffer(d3d->gbm, bo);
@@ -366,22 +443,123 @@ static int display_swap(struct uterm_display *disp)
 	return 0;
 }
 
+/*
+ * Remember the damage for the next swap. EGL wants the rectangles relative to
+ * the bottom-left corner, the plane FB_DAMAGE_CLIPS take them as they are.
+ */
+static void display_set_damage(struct uterm_display *disp, size_t n_rect,
+			       struct uterm_video_rect *damages)
+{
+	struct uterm_drm3d_display *d3d = disp->data;
+	EGLint *rects;
+	size_t i;
+
+	d3d->damage_num = 0;
+	uterm_drm_display_set_damage(disp, n_rect, damages);
+
+	if (!n_rect || (disp->flags & DISPLAY_NEED_REDRAW))
+		return;
+
+	if (n_rect > d3d->damage_size) {
+		rects = realloc(d3d->damage, n_rect * 4 * sizeof(*rects));
+		if (!rects)
+			return;
+		d3d->damage = rects;
+		d3d->damage_size = n_rect;
+	}
+
+	rects = d3d->damage;
+	for (i = 0; i < n_rect; ++i) {
+		rects[i * 4 + 0] = damages[i].x1;
+		rects[i * 4 + 1] = disp->height - damages[i].y2;
+		rects[i * 4 + 2] = damages[i].x2 - damages[i].x1;
+		rects[i * 4 + 3] = damages[i].y2 - damages[i].y1;
+	}
+	d3d->damage_num = n_rect;
+}
+
+static bool display_is_swapping(struct uterm_display *disp)
+{
+	struct uterm_drm3d_display *d3d = disp->data;
+
+	if (!disp->video->mailbox)
+		return uterm_drm_is_swapping(disp);
+
+	/* in mailbox mode, we only wait if gbm has no buffer left to draw into */
+	return uterm_drm_is_swapping(disp) && !gbm_surface_has_free_buffers(d3d->gbm);
+}
+
+/*
+ * Number of frames since the back buffer was last drawn into, 0 if its
+ * content is undefined.
+ */
+static int display_get_buffer_age(struct uterm_display *disp)
+{
+	struct uterm_drm3d_display *d3d = disp->data;
+	struct uterm_drm3d_video *v3d = uterm_drm_video_get_data(disp->video);
+	EGLint age = 0;
+
+	if (!v3d->supports_buffer_age || d3d->surface == EGL_NO_SURFACE)
+		return 0;
+
+	if (!eglQuerySurface(v3d->disp, d3d->surface, EGL_BUFFER_AGE_EXT, &age))
+		return 0;
+
+	return age;
+}
+
+/* hand out the buffer of the last frame as a dma-buf, without reading it back */
+static int display_export_frame(struct uterm_display *disp, struct uterm_video_export *out)
+{
+	struct uterm_drm3d_display *d3d = disp->data;
+	struct uterm_drm3d_rb *rb;
+
+	rb = d3d->queued ? d3d->queued : (d3d->next ? d3d->next : d3d->current);
+	if (!rb)
+		return -ENOENT;
+
+	out->fd = gbm_bo_get_fd(rb->bo);
+	if (out->fd < 0)
+		return -EFAULT;
+
+	out->dmabuf = true;
+	out->width = gbm_bo_get_width(rb->bo);
+	out->height = gbm_bo_get_height(rb->bo);
+	out->stride = gbm_bo_get_stride(rb->bo);
+	out->offset = gbm_bo_get_offset(rb->bo, 0);
+	out->format = gbm_bo_get_format(rb->bo);
+	out->modifier = gbm_bo_get_modifier(rb->bo);
+	return 0;
+}
+
+static int display_finish(struct uterm_display *disp)
+{
+	if (uterm_drm3d_display_use(disp))
+		return -EFAULT;
+
+	glFinish();
+	return 0;
+}
+
 static const struct display_ops drm_display_ops = {
 	.init = display_init,
 	.destroy = display_destroy,
 	.set_dpms = uterm_drm_display_set_dpms,
 	.use = uterm_drm3d_display_use,
 	.swap = display_swap,
-	.is_swapping = uterm_drm_is_swapping,
+	.is_swapping = display_is_swapping,
 	.fake_blendv = uterm_drm3d_display_fake_blendv,
 	.clear = uterm_drm3d_display_clear,
-	.set_damage = NULL,
-	.has_damage = NULL,
+	.set_damage = display_set_damage,
+	.has_damage = uterm_drm_display_has_damage,
+	.get_buffer_age = display_get_buffer_age,
 	.setup_cursor = uterm_drm_display_setup_cursor,
 	.destroy_cursor = uterm_drm_display_destroy_cursor,
 	.show_cursor = uterm_drm_display_show_cursor,
 	.hide_cursor = uterm_drm_display_hide_cursor,
 	.set_cursor_offset = uterm_drm_display_set_cursor_offset,
+	.export_frame = display_export_frame,
+	.finish = display_finish,
 };
 
 static void show_displays(struct uterm_video *video)
@@ -408,6 +586,7 @@ static void show_displays(struct uterm_video *video)
 
 		glClearColor(0, 0, 0, 1);
 		glClear(GL_COLOR_BUFFER_BIT);
+		display_set_damage(iter, 0, NULL);
 		display_swap(iter);
 	}
 }
@@ -415,6 +594,8 @@ static void show_displays(struct uterm_video *video)
 static void page_flip_handler(struct uterm_display *disp)
 {
 	struct uterm_drm3d_display *d3d = disp->data;
+	struct uterm_drm3d_rb *rb;
+	int ret;
 
 	if (d3d->next) {
 		if (d3d->current)
@@ -422,6 +603,62 @@ static void page_flip_handler(struct uterm_display *disp)
 		d3d->current = d3d->next;
 		d3d->next = NULL;
 	}
+
+	/* flip the queued frame, now that the pending flip is done */
+	if (d3d->queued) {
+		rb = d3d->queued;
+		d3d->queued = NULL;
+		ret = uterm_drm_display_swap(disp, rb->id);
+		if (ret) {
+			log_warning("cannot flip queued frame on display %s (%d)", disp->name,
+				    ret);
+			gbm_surface_release_buffer(d3d->gbm, rb->bo);
+		} else {
+			d3d->next = rb;
+		}
+	}
+}
+
+/*
+ * Render offload: frames are rendered on the GPU at video->render_node into
+ * linear buffers, which this device imports and scans out. Flips still pass
+ * the damage, so devices that copy the framebuffer only copy what changed.
+ */
+static int open_render_node(struct uterm_video *video)
+{
+	struct uterm_drm_video *vdrm = video->data;
+	struct uterm_drm3d_video *v3d = vdrm->data;
+	uint64_t cap = 0;
+	char *name;
+	int fd;
+
+	if (drmGetCap(vdrm->fd, DRM_CAP_PRIME, &cap) || !(cap & DRM_PRIME_CAP_IMPORT)) {
+		log_err("device %s cannot import buffers of %s", vdrm->name, video->render_node);
+		return -EOPNOTSUPP;
+	}
+
+	fd = open(video->render_node, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		log_err("cannot open render device %s (%d): %m", video->render_node, errno);
+		return -EFAULT;
+	}
+
+	/* without DRM-Master, only the render node of a card may render */
+	name = drmGetRenderDeviceNameFromFd(fd);
+	if (name) {
+		close(fd);
+		fd = open(name, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			log_err("cannot open render node %s (%d): %m", name, errno);
+			free(name);
+			return -EFAULT;
+		}
+	}
+
+	log_info("rendering frames of %s on %s", vdrm->name, name ? name : video->render_node);
+	free(name);
+	v3d->render_fd = fd;
+	return 0;
 }
 
 static int video_init(struct uterm_video *video, const char *node)
@@ -466,11 +703,18 @@ static int video_init(struct uterm_video *video, const char *node)
 
 	log_debug("initialize 3D layer on %p", video);
 
-	v3d->gbm = gbm_create_device(vdrm->fd);
+	v3d->render_fd = -1;
+	if (video->render_node) {
+		ret = open_render_node(video);
+		if (ret)
+			goto err_video;
+	}
+
+	v3d->gbm = gbm_create_device(v3d->render_fd >= 0 ? v3d->render_fd : vdrm->fd);
 	if (!v3d->gbm) {
 		log_err("cannot create gbm device for %s (permission denied)", node);
 		ret = -EFAULT;
-		goto err_video;
+		goto err_render;
 	}
 
 	v3d->disp = eglGetDisplay((EGLNativeDisplayType)v3d->gbm);
@@ -499,6 +743,19 @@ static int video_init(struct uterm_video *video, const char *node)
 		goto err_disp;
 	}
 
+	if (strstr(ext, "EGL_EXT_buffer_age") || strstr(ext, "EGL_KHR_partial_update"))
+		v3d->supports_buffer_age = true;
+
+	if (strstr(ext, "EGL_KHR_swap_buffers_with_damage"))
+		v3d->swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress(
+			"eglSwapBuffersWithDamageKHR");
+	else if (strstr(ext, "EGL_EXT_swap_buffers_with_damage"))
+		v3d->swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress(
+			"eglSwapBuffersWithDamageEXT");
+
+	log_debug("EGL buffer age: %s, swap with damage: %s",
+		  v3d->supports_buffer_age ? "yes" : "no", v3d->swap_with_damage ? "yes" : "no");
+
 	api = EGL_OPENGL_ES_API;
 	if (!eglBindAPI(api)) {
 		log_err("cannot bind opengl-es api");
@@ -587,6 +844,9 @@ err_disp:
 	eglTerminate(v3d->disp);
 err_gbm:
 	gbm_device_destroy(v3d->gbm);
+err_render:
+	if (v3d->render_fd >= 0)
+		close(v3d->render_fd);
 err_video:
 	uterm_drm_video_destroy(video);
 err_free:
@@ -608,6 +868,8 @@ static void video_destroy(struct uterm_video *video)
 	eglDestroyContext(v3d->disp, v3d->ctx);
 	eglTerminate(v3d->disp);
 	gbm_device_destroy(v3d->gbm);
+	if (v3d->render_fd >= 0)
+		close(v3d->render_fd);
 	free(v3d);
 	uterm_drm_video_destroy(video);
 }
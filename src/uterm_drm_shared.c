@@ -32,6 +32,7 @@
 #include <libdrm/drm_fourcc.h>
 #include <poll.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -42,6 +43,7 @@
 #include "shl_log.h"
 #include "shl_misc.h"
 #include "shl_timer.h"
+#include "shl_trace.h"
 #include "uterm_drm_shared_internal.h"
 #include "uterm_video.h"
 #include "uterm_video_internal.h"
@@ -50,8 +52,11 @@
 
 static void modeset_drm_object_fini(struct drm_object *obj);
 static void modeset_get_object_properties(int fd, struct drm_object *obj, uint32_t type);
-static int set_drm_object_property(drmModeAtomicReq *req, struct drm_object *obj, const char *name,
-				   uint64_t value);
+static int commit_cursor(struct uterm_display *disp);
+static void flush_flips(struct ev_eloop *eloop, void *unused, void *data);
+static void do_pflips(struct ev_eloop *eloop, void *unused, void *data);
+static void free_damage_blob(int fd, struct uterm_drm_display *ddrm);
+static void hotplug_timeout(struct ev_timer *timer, uint64_t exp, void *data);
 
 static uint32_t get_property_id(int fd, drmModeObjectPropertiesPtr props, const char *name)
 {
@@ -105,9 +110,29 @@ static const char *drm_mode_prop_name(uint32_t type)
 	}
 }
 
+static const char *const drm_prop_names[DRM_PROP_NUM] = {
+	[DRM_PROP_ACTIVE] = "ACTIVE",
+	[DRM_PROP_MODE_ID] = "MODE_ID",
+	[DRM_PROP_CRTC_ID] = "CRTC_ID",
+	[DRM_PROP_FB_ID] = "FB_ID",
+	[DRM_PROP_SRC_X] = "SRC_X",
+	[DRM_PROP_SRC_Y] = "SRC_Y",
+	[DRM_PROP_SRC_W] = "SRC_W",
+	[DRM_PROP_SRC_H] = "SRC_H",
+	[DRM_PROP_CRTC_X] = "CRTC_X",
+	[DRM_PROP_CRTC_Y] = "CRTC_Y",
+	[DRM_PROP_CRTC_W] = "CRTC_W",
+	[DRM_PROP_CRTC_H] = "CRTC_H",
+	[DRM_PROP_FB_DAMAGE_CLIPS] = "FB_DAMAGE_CLIPS",
+	[DRM_PROP_HOTSPOT_X] = "HOTSPOT_X",
+	[DRM_PROP_HOTSPOT_Y] = "HOTSPOT_Y",
+	[DRM_PROP_VRR_ENABLED] = "VRR_ENABLED",
+	[DRM_PROP_VRR_CAPABLE] = "vrr_capable",
+};
+
 static void modeset_get_object_properties(int fd, struct drm_object *obj, uint32_t type)
 {
-	unsigned int i;
+	unsigned int i, p;
 
 	obj->props = drmModeObjectGetProperties(fd, obj->id, type);
 	if (!obj->props) {
@@ -119,27 +144,40 @@ static void modeset_get_object_properties(int fd, struct drm_object *obj, uint32
 	obj->props_info = calloc(obj->props->count_props, sizeof(obj->props_info));
 	for (i = 0; i < obj->props->count_props; i++)
 		obj->props_info[i] = drmModeGetProperty(fd, obj->props->props[i]);
+
+	memset(obj->prop_ids, 0, sizeof(obj->prop_ids));
+	for (i = 0; i < obj->props->count_props; i++) {
+		if (!obj->props_info[i])
+			continue;
+		for (p = 0; p < DRM_PROP_NUM; ++p) {
+			if (!strcmp(obj->props_info[i]->name, drm_prop_names[p])) {
+				obj->prop_ids[p] = obj->props_info[i]->prop_id;
+				break;
+			}
+		}
+	}
 }
 
-static int set_drm_object_property(drmModeAtomicReq *req, struct drm_object *obj, const char *name,
-				   uint64_t value)
+static uint64_t get_prop(struct drm_object *obj, enum drm_prop prop)
 {
-	int i;
-	uint32_t prop_id = 0;
+	unsigned int i;
 
-	for (i = 0; i < obj->props->count_props; i++) {
-		if (!strcmp(obj->props_info[i]->name, name)) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
-		}
+	for (i = 0; obj->props && obj->prop_ids[prop] && i < obj->props->count_props; i++) {
+		if (obj->props->props[i] == obj->prop_ids[prop])
+			return obj->props->prop_values[i];
 	}
+	return 0;
+}
 
-	if (prop_id == 0) {
-		log_err("no object property: %s\n", name);
+static int add_prop(drmModeAtomicReq *req, struct drm_object *obj, enum drm_prop prop,
+		    uint64_t value)
+{
+	if (!obj->prop_ids[prop]) {
+		log_err("no object property: %s\n", drm_prop_names[prop]);
 		return -EINVAL;
 	}
 
-	return drmModeAtomicAddProperty(req, obj->id, prop_id, value);
+	return drmModeAtomicAddProperty(req, obj->id, obj->prop_ids[prop], value);
 }
 
 static bool is_crtc_in_use(struct uterm_video *video, uint32_t crtc_id)
@@ -260,8 +298,10 @@ static int modeset_find_plane(int fd, struct uterm_display *disp)
 				found_primary = true;
 				ddrm->plane.id = plane_id;
 				ret = 0;
-				if (get_property_id(fd, props, "FB_DAMAGE_CLIPS") > 0)
+				if (get_property_id(fd, props, "FB_DAMAGE_CLIPS") > 0) {
+					ddrm->plane_damage = true;
 					disp->flags |= DISPLAY_DAMAGE;
+				}
 			} else if (!found_cursor && plane_type == DRM_PLANE_TYPE_CURSOR) {
 				found_cursor = true;
 				ddrm->cursor_plane.id = plane_id;
@@ -463,6 +503,11 @@ void uterm_drm_display_destroy_cursor(struct uterm_display *disp)
 	cursor->active = false;
 }
 
+/*
+ * Moving the cursor only commits the cursor plane, no frame is drawn for it.
+ * While a page-flip is pending, the new position goes along with the next one,
+ * so a fast mouse costs at most one commit per vblank.
+ */
 int uterm_drm_display_show_cursor(struct uterm_display *disp, int32_t x, int32_t y)
 {
 	struct uterm_drm_display *ddrm = disp->data;
@@ -471,11 +516,15 @@ int uterm_drm_display_show_cursor(struct uterm_display *disp, int32_t x, int32_t
 	if (!cursor->active)
 		return -EINVAL;
 
+	if (cursor->visible && cursor->x == x && cursor->y == y)
+		return 0;
+
 	cursor->x = x;
 	cursor->y = y;
 	cursor->visible = true;
+	cursor->dirty = true;
 
-	return 0;
+	return commit_cursor(disp);
 }
 
 int uterm_drm_display_hide_cursor(struct uterm_display *disp)
@@ -487,8 +536,9 @@ int uterm_drm_display_hide_cursor(struct uterm_display *disp)
 		return 0;
 
 	cursor->visible = false;
+	cursor->dirty = true;
 
-	return 0;
+	return commit_cursor(disp);
 }
 
 void uterm_drm_display_set_cursor_offset(struct uterm_display *disp, int32_t x, int32_t y)
@@ -496,8 +546,13 @@ void uterm_drm_display_set_cursor_offset(struct uterm_display *disp, int32_t x,
 	struct uterm_drm_display *ddrm = disp->data;
 	struct uterm_drm_cursor *cursor = &ddrm->cursor;
 
+	if (cursor->off_x == x && cursor->off_y == y)
+		return;
+
+	/* shown with the next frame, it follows a resize of the text */
 	cursor->off_x = x;
 	cursor->off_y = y;
+	cursor->dirty = true;
 }
 
 static void modeset_drm_object_fini(struct drm_object *obj)
@@ -562,113 +617,197 @@ void uterm_drm_display_free_properties(struct uterm_display *disp)
 	modeset_drm_object_fini(&ddrm->plane);
 	modeset_drm_object_fini(&ddrm->cursor_plane);
 
+	free_damage_blob(vdrm->fd, ddrm);
+	free(ddrm->damage_rects);
+	ddrm->damage_rects = NULL;
+	ddrm->damage_size = 0;
+	free(ddrm->dirty_clips);
+	ddrm->dirty_clips = NULL;
+	ddrm->dirty_size = 0;
+	drmModeAtomicFree(ddrm->flip_tmpl);
+	ddrm->flip_tmpl = NULL;
+	drmModeAtomicFree(ddrm->flip_req);
+	ddrm->flip_req = NULL;
+
 	drmModeDestroyPropertyBlob(vdrm->fd, ddrm->mode_blob_id);
 }
 
-int uterm_drm_prepare_commit(int fd, struct uterm_drm_display *ddrm, drmModeAtomicReq *req,
-			     uint32_t fb, uint32_t width, uint32_t height, bool cursor_hotspot)
+static int prepare_cursor(drmModeAtomicReq *req, struct uterm_drm_display *ddrm,
+			  bool cursor_hotspot)
 {
-	struct drm_object *plane = &ddrm->plane;
+	if (ddrm->cursor_plane.id) {
+		struct drm_object *cp = &ddrm->cursor_plane;
+		struct uterm_drm_cursor *cursor = &ddrm->cursor;
 
-	if (req == NULL) {
-		/* Legacy modeset */
-		ddrm->fb_id = fb;
-		return 0;
+		if (cursor->active && cursor->visible) {
+			if (cursor_hotspot) {
+				if (add_prop(req, cp, DRM_PROP_HOTSPOT_X, cursor->hot_x) < 0)
+					return -1;
+				if (add_prop(req, cp, DRM_PROP_HOTSPOT_Y, cursor->hot_y) < 0)
+					return -1;
+			}
+			if (add_prop(req, cp, DRM_PROP_FB_ID, cursor->fb_id) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_CRTC_ID, ddrm->crtc.id) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_SRC_X, 0) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_SRC_Y, 0) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_SRC_W, (uint64_t)cursor->width << 16) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_SRC_H, (uint64_t)cursor->height << 16) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_CRTC_X,
+				     cursor->off_x + cursor->x - cursor->hot_x) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_CRTC_Y,
+				     cursor->off_y + cursor->y - cursor->hot_y) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_CRTC_W, cursor->width) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_CRTC_H, cursor->height) < 0)
+				return -1;
+		} else {
+			if (add_prop(req, cp, DRM_PROP_FB_ID, 0) < 0)
+				return -1;
+			if (add_prop(req, cp, DRM_PROP_CRTC_ID, 0) < 0)
+				return -1;
+		}
 	}
 
+	return 0;
+}
+
+/* the connector, CRTC and plane properties that only change with the mode */
+static int prepare_mode(drmModeAtomicReq *req, struct uterm_drm_display *ddrm, uint32_t width,
+			uint32_t height)
+{
+	struct drm_object *plane = &ddrm->plane;
+
 	/* set id of the CRTC id that the connector is using */
-	if (set_drm_object_property(req, &ddrm->connector, "CRTC_ID", ddrm->crtc.id) < 0)
+	if (add_prop(req, &ddrm->connector, DRM_PROP_CRTC_ID, ddrm->crtc.id) < 0)
 		return -1;
 
 	/* set the mode id of the CRTC; this property receives the id of a blob
 	 * property that holds the struct that actually contains the mode info */
-	if (set_drm_object_property(req, &ddrm->crtc, "MODE_ID", ddrm->mode_blob_id) < 0)
+	if (add_prop(req, &ddrm->crtc, DRM_PROP_MODE_ID, ddrm->mode_blob_id) < 0)
 		return -1;
 
 	/* set the CRTC object as active */
-	if (set_drm_object_property(req, &ddrm->crtc, "ACTIVE", 1) < 0)
+	if (add_prop(req, &ddrm->crtc, DRM_PROP_ACTIVE, 1) < 0)
 		return -1;
 
-	/* set properties of the plane related to the CRTC and the framebuffer */
-	if (set_drm_object_property(req, plane, "FB_ID", fb) < 0)
+	/* set properties of the plane related to the CRTC */
+	if (add_prop(req, plane, DRM_PROP_CRTC_ID, ddrm->crtc.id) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "CRTC_ID", ddrm->crtc.id) < 0)
+	if (add_prop(req, plane, DRM_PROP_SRC_X, 0) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "SRC_X", 0) < 0)
+	if (add_prop(req, plane, DRM_PROP_SRC_Y, 0) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "SRC_Y", 0) < 0)
+	if (add_prop(req, plane, DRM_PROP_SRC_W, width << 16) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "SRC_W", width << 16) < 0)
+	if (add_prop(req, plane, DRM_PROP_SRC_H, height << 16) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "SRC_H", height << 16) < 0)
+	if (add_prop(req, plane, DRM_PROP_CRTC_X, 0) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "CRTC_X", 0) < 0)
+	if (add_prop(req, plane, DRM_PROP_CRTC_Y, 0) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "CRTC_Y", 0) < 0)
+	if (add_prop(req, plane, DRM_PROP_CRTC_W, width) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "CRTC_W", width) < 0)
+	if (add_prop(req, plane, DRM_PROP_CRTC_H, height) < 0)
 		return -1;
-	if (set_drm_object_property(req, plane, "CRTC_H", height) < 0)
+
+	return 0;
+}
+
+/* the framebuffer, its damage and the cursor, which change with every frame */
+static int prepare_frame(drmModeAtomicReq *req, struct uterm_drm_display *ddrm, uint32_t fb,
+			 bool cursor_hotspot)
+{
+	struct drm_object *plane = &ddrm->plane;
+
+	if (add_prop(req, plane, DRM_PROP_FB_ID, fb) < 0)
 		return -1;
 
-	if (ddrm->damage_blob_id) {
-		if (set_drm_object_property(req, plane, "FB_DAMAGE_CLIPS", ddrm->damage_blob_id) <
-		    0) {
+	if (ddrm->damage_set) {
+		if (add_prop(req, plane, DRM_PROP_FB_DAMAGE_CLIPS, ddrm->damage_blob_id) < 0) {
 			log_warn("Cannot set FB_DAMAGE_CLIPS");
 			return -1;
 		}
 	}
 
-	if (ddrm->cursor_plane.id) {
-		struct drm_object *cp = &ddrm->cursor_plane;
-		struct uterm_drm_cursor *cursor = &ddrm->cursor;
+	return prepare_cursor(req, ddrm, cursor_hotspot);
+}
 
-		if (cursor->active && cursor->visible) {
-			if (cursor_hotspot) {
-				if (set_drm_object_property(req, cp, "HOTSPOT_X", cursor->hot_x) <
-				    0)
-					return -1;
-				if (set_drm_object_property(req, cp, "HOTSPOT_Y", cursor->hot_y) <
-				    0)
-					return -1;
-			}
-			if (set_drm_object_property(req, cp, "FB_ID", cursor->fb_id) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "CRTC_ID", ddrm->crtc.id) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "SRC_X", 0) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "SRC_Y", 0) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "SRC_W",
-						    (uint64_t)cursor->width << 16) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "SRC_H",
-						    (uint64_t)cursor->height << 16) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "CRTC_X",
-						    cursor->off_x + cursor->x - cursor->hot_x) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "CRTC_Y",
-						    cursor->off_y + cursor->y - cursor->hot_y) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "CRTC_W", cursor->width) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "CRTC_H", cursor->height) < 0)
-				return -1;
-		} else {
-			if (set_drm_object_property(req, cp, "FB_ID", 0) < 0)
-				return -1;
-			if (set_drm_object_property(req, cp, "CRTC_ID", 0) < 0)
-				return -1;
+int uterm_drm_prepare_commit(int fd, struct uterm_drm_display *ddrm, drmModeAtomicReq *req,
+			     uint32_t fb, uint32_t width, uint32_t height, bool cursor_hotspot)
+{
+	if (req == NULL) {
+		/* Legacy modeset */
+		ddrm->fb_id = fb;
+		return 0;
+	}
+
+	if (prepare_mode(req, ddrm, width, height))
+		return -1;
+
+	/* also switch it off, another DRM master may have left it on */
+	if (ddrm->crtc.prop_ids[DRM_PROP_VRR_ENABLED] &&
+	    add_prop(req, &ddrm->crtc, DRM_PROP_VRR_ENABLED, ddrm->vrr) < 0)
+		return -1;
+
+	return prepare_frame(req, ddrm, fb, cursor_hotspot);
+}
+
+/* an empty request, allocated on first use and reused afterwards */
+static drmModeAtomicReq *reuse_req(drmModeAtomicReq **req)
+{
+	if (*req)
+		drmModeAtomicSetCursor(*req, 0);
+	else
+		*req = drmModeAtomicAlloc();
+	return *req;
+}
+
+/*
+ * Add a page-flip of @disp to @req. The properties that only change with the
+ * mode are kept in a template, which is merged in, so a flip only looks up
+ * and adds the framebuffer, its damage and the cursor.
+ */
+static int add_flip(struct uterm_display *disp, drmModeAtomicReq *req, uint32_t fb)
+{
+	struct uterm_drm_display *ddrm = disp->data;
+	struct uterm_drm_video *vdrm = disp->video->data;
+
+	if (!ddrm->flip_tmpl || ddrm->flip_mode != ddrm->mode_blob_id ||
+	    ddrm->flip_width != disp->width || ddrm->flip_height != disp->height) {
+		drmModeAtomicFree(ddrm->flip_tmpl);
+		ddrm->flip_tmpl = drmModeAtomicAlloc();
+		if (!ddrm->flip_tmpl)
+			return -ENOMEM;
+		if (prepare_mode(ddrm->flip_tmpl, ddrm, disp->width, disp->height)) {
+			drmModeAtomicFree(ddrm->flip_tmpl);
+			ddrm->flip_tmpl = NULL;
+			return -EINVAL;
 		}
+		ddrm->flip_mode = ddrm->mode_blob_id;
+		ddrm->flip_width = disp->width;
+		ddrm->flip_height = disp->height;
 	}
 
+	if (drmModeAtomicMerge(req, ddrm->flip_tmpl))
+		return -ENOMEM;
+
+	if (prepare_frame(req, ddrm, fb, vdrm->cursor_hotspot))
+		return -EINVAL;
 	return 0;
 }
 
 static void free_damage_blob(int fd, struct uterm_drm_display *ddrm)
 {
+	ddrm->damage_set = false;
+	ddrm->damage_len = 0;
 	if (!ddrm->damage_blob_id)
 		return;
 	if (drmModeDestroyPropertyBlob(fd, ddrm->damage_blob_id))
@@ -797,15 +936,40 @@ int uterm_drm_display_set_dpms(struct uterm_display *disp, int state)
 	return 0;
 }
 
+/* drmModeDirtyFB() takes 16 bit clips, the damage is within the mode anyway */
+static void set_dirty_clips(struct uterm_drm_display *ddrm, size_t n_rect,
+			    const struct uterm_video_rect *damages)
+{
+	drmModeClip *clips;
+	size_t i;
+
+	if (n_rect > ddrm->dirty_size) {
+		clips = realloc(ddrm->dirty_clips, n_rect * sizeof(*clips));
+		if (!clips)
+			return;
+		ddrm->dirty_clips = clips;
+		ddrm->dirty_size = n_rect;
+	}
+
+	for (i = 0; i < n_rect; ++i) {
+		ddrm->dirty_clips[i].x1 = damages[i].x1;
+		ddrm->dirty_clips[i].y1 = damages[i].y1;
+		ddrm->dirty_clips[i].x2 = damages[i].x2;
+		ddrm->dirty_clips[i].y2 = damages[i].y2;
+	}
+	ddrm->damage_len = n_rect;
+	ddrm->damage_set = true;
+}
+
 void uterm_drm_display_set_damage(struct uterm_display *disp, size_t n_rect,
 				  struct uterm_video_rect *damages)
 {
 	struct uterm_drm_video *vdrm = disp->video->data;
 	struct uterm_drm_display *ddrm = disp->data;
+	struct uterm_video_rect *rects;
 	int ret;
 
-	if (ddrm->damage_blob_id)
-		free_damage_blob(vdrm->fd, ddrm);
+	ddrm->damage_set = false;
 
 	// Don't pass damage clip after a modeset.
 	if (disp->flags & DISPLAY_NEED_REDRAW)
@@ -813,21 +977,53 @@ void uterm_drm_display_set_damage(struct uterm_display *disp, size_t n_rect,
 
 	if (!n_rect || !(disp->flags & DISPLAY_DAMAGE))
 		return;
+
+	if (ddrm->front) {
+		set_dirty_clips(ddrm, n_rect, damages);
+		return;
+	}
+
+	/* drm2d may want the damage only for its shadow buffer */
+	if (!ddrm->plane_damage)
+		return;
+
+	/* a cursor blinking or a clock ticking damages the same cells every frame */
+	if (ddrm->damage_blob_id && n_rect == ddrm->damage_len &&
+	    !memcmp(ddrm->damage_rects, damages, n_rect * sizeof(*damages))) {
+		ddrm->damage_set = true;
+		return;
+	}
+
+	free_damage_blob(vdrm->fd, ddrm);
 	ret = drmModeCreatePropertyBlob(vdrm->fd, damages, n_rect * sizeof(*damages),
 					&ddrm->damage_blob_id);
-	if (ret)
+	if (ret) {
 		log_warn("Cannot create damage property %d, [%zu]", ret, n_rect);
+		return;
+	}
+	ddrm->damage_set = true;
+
+	if (n_rect > ddrm->damage_size) {
+		rects = realloc(ddrm->damage_rects, n_rect * sizeof(*rects));
+		if (!rects)
+			return;
+		ddrm->damage_rects = rects;
+		ddrm->damage_size = n_rect;
+	}
+	memcpy(ddrm->damage_rects, damages, n_rect * sizeof(*damages));
+	ddrm->damage_len = n_rect;
 }
 
 bool uterm_drm_display_has_damage(struct uterm_display *disp)
 {
 	struct uterm_drm_display *ddrm = disp->data;
 
-	return ddrm->damage_blob_id != 0;
+	return ddrm->damage_set;
 }
 
 int uterm_drm_display_wait_pflip(struct uterm_display *disp)
 {
+	struct uterm_drm_display *ddrm = disp->data;
 	struct uterm_video *video = disp->video;
 	int ret;
 	unsigned int timeout = 1000; /* 1s */
@@ -835,6 +1031,12 @@ int uterm_drm_display_wait_pflip(struct uterm_display *disp)
 	if ((disp->flags & DISPLAY_PFLIP) || !(disp->flags & DISPLAY_VSYNC))
 		return 0;
 
+	/* a queued flip only reaches the kernel when the batch is committed */
+	if (ddrm->flip_queued) {
+		ev_eloop_unregister_idle_cb(video->eloop, flush_flips, video, EV_SINGLE);
+		flush_flips(video->eloop, NULL, video);
+	}
+
 	do {
 		ret = uterm_drm_video_wait_pflip(video, &timeout);
 		if (ret < 1)
@@ -853,7 +1055,26 @@ int uterm_drm_display_wait_pflip(struct uterm_display *disp)
 	return 0;
 }
 
-static int perform_modeset(struct uterm_video *video)
+/* the time between two vblanks of the current mode, unless it is variable */
+static void init_vblank(struct uterm_display *disp)
+{
+	struct uterm_drm_display *ddrm = disp->data;
+	const drmModeModeInfo *mode = ddrm->current_mode;
+
+	disp->vblank_time = 0;
+	if (ddrm->vrr || !mode->clock)
+		disp->vblank_period = 0;
+	else
+		disp->vblank_period = (uint64_t)mode->htotal * mode->vtotal * 1000 / mode->clock;
+}
+
+/* with @all unset, displays that are already online keep their mode and buffers */
+static bool needs_modeset(struct uterm_display *disp, bool all)
+{
+	return all || !display_is_online(disp);
+}
+
+static int perform_modeset(struct uterm_video *video, bool all)
 {
 	drmModeAtomicReq *req;
 	struct shl_dlist *iter;
@@ -868,18 +1089,26 @@ static int perform_modeset(struct uterm_video *video)
 	if (!req)
 		return -ENOMEM;
 
-	modeset_clear_cursor(req, vdrm->fd);
+	if (all)
+		modeset_clear_cursor(req, vdrm->fd);
 
 	shl_dlist_for_each(iter, &video->displays)
 	{
 		disp = shl_dlist_entry(iter, struct uterm_display, list);
 		ddrm = disp->data;
+		if (!needs_modeset(disp, all))
+			continue;
 
 		uterm_drm_display_wait_pflip(disp);
 
 		log_info("Preparing modeset for %s at %dx%d\n", disp->name,
 			 ddrm->current_mode->hdisplay, ddrm->current_mode->vdisplay);
 
+		ddrm->vrr = video->vrr && ddrm->crtc.prop_ids[DRM_PROP_VRR_ENABLED] &&
+			    get_prop(&ddrm->connector, DRM_PROP_VRR_CAPABLE);
+		if (ddrm->vrr)
+			log_info("using variable refresh rate on %s", disp->name);
+
 		ret = ddrm->prepare_modeset(disp, req);
 		if (ret < 0)
 			break;
@@ -901,7 +1130,8 @@ static int perform_modeset(struct uterm_video *video)
 	shl_dlist_for_each(iter, &video->displays)
 	{
 		disp = shl_dlist_entry(iter, struct uterm_display, list);
-		uterm_display_ref(disp);
+		if (needs_modeset(disp, all))
+			uterm_display_ref(disp);
 	}
 
 	/* initial modeset on all outputs */
@@ -917,17 +1147,21 @@ err_commit:
 	{
 		disp = shl_dlist_entry(iter, struct uterm_display, list);
 		ddrm = disp->data;
+		if (!needs_modeset(disp, all))
+			continue;
 		ddrm->done_modeset(disp, ret);
 		if (ret) {
 			disp->flags &= ~DISPLAY_ONLINE;
 			uterm_display_unref(disp);
-		} else
+		} else {
 			disp->flags |= DISPLAY_ONLINE | DISPLAY_VSYNC | DISPLAY_NEED_REDRAW;
+			init_vblank(disp);
+		}
 	}
 	return ret;
 }
 
-static int legacy_modeset(struct uterm_video *video)
+static int legacy_modeset(struct uterm_video *video, bool all)
 {
 	struct uterm_drm_video *vdrm = video->data;
 	struct shl_dlist *iter;
@@ -939,6 +1173,8 @@ static int legacy_modeset(struct uterm_video *video)
 	{
 		disp = shl_dlist_entry(iter, struct uterm_display, list);
 		ddrm = disp->data;
+		if (!needs_modeset(disp, all))
+			continue;
 
 		uterm_drm_display_wait_pflip(disp);
 
@@ -962,11 +1198,14 @@ static int legacy_modeset(struct uterm_video *video)
 			continue;
 		}
 		disp->flags |= DISPLAY_ONLINE | DISPLAY_NEED_REDRAW;
+		init_vblank(disp);
 	}
 	return 0;
 }
 
-static int try_modeset(struct uterm_video *video)
+/* Sets the mode of all displays, or with @all unset only of those that are not
+ * online yet, so a hotplugged monitor leaves the other outputs alone. */
+static int try_modeset(struct uterm_video *video, bool all)
 {
 	struct shl_dlist *iter;
 	struct uterm_display *disp;
@@ -975,9 +1214,9 @@ static int try_modeset(struct uterm_video *video)
 	int ret;
 
 	if (vdrm->legacy)
-		ret = legacy_modeset(video);
+		ret = legacy_modeset(video, all);
 	else
-		ret = perform_modeset(video);
+		ret = perform_modeset(video, all);
 
 	if (ret != -EAGAIN)
 		return ret;
@@ -990,9 +1229,14 @@ static int try_modeset(struct uterm_video *video)
 		ddrm->current_mode = &ddrm->default_mode;
 	}
 	if (vdrm->legacy)
-		return legacy_modeset(video);
+		ret = legacy_modeset(video, all);
 	else
-		return perform_modeset(video);
+		ret = perform_modeset(video, all);
+
+	/* the new display may only fit if the others give up bandwidth */
+	if (ret == -EAGAIN && !all)
+		return try_modeset(video, true);
+	return ret;
 }
 
 static int legacy_pageflip(int fd, struct uterm_display *disp, uint32_t fb)
@@ -1012,15 +1256,13 @@ static int pageflip(int fd, struct uterm_display *disp, uint32_t fb)
 	struct uterm_drm_video *vdrm = disp->video->data;
 	drmModeAtomicReq *req;
 	int ret, flags;
-	uint32_t width, height;
 
 	/* prepare output for atomic commit */
-	req = drmModeAtomicAlloc();
-
-	height = disp->height;
-	width = disp->width;
+	req = reuse_req(&ddrm->flip_req);
+	if (!req)
+		return -ENOMEM;
 
-	ret = uterm_drm_prepare_commit(fd, ddrm, req, fb, width, height, vdrm->cursor_hotspot);
+	ret = add_flip(disp, req, fb);
 	if (ret) {
 		log_warn("prepare atomic pageflip failed for [%s], %d\n", disp->name, ret);
 		return -EINVAL;
@@ -1028,7 +1270,6 @@ static int pageflip(int fd, struct uterm_display *disp, uint32_t fb)
 
 	flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
 	ret = drmModeAtomicCommit(fd, req, flags, disp->video);
-	drmModeAtomicFree(req);
 
 	if (ret < 0) {
 		/* don't print error for EBUSY, as next pageflip will succeed */
@@ -1036,10 +1277,135 @@ static int pageflip(int fd, struct uterm_display *disp, uint32_t fb)
 			log_warn("atomic pageflip failed for [%s], %d\n", disp->name, ret);
 		return ret;
 	}
-	free_damage_blob(fd, ddrm);
+	/* the blob is kept, the next frame may have the same damage */
+	ddrm->damage_set = false;
+	ddrm->cursor.dirty = false;
+	return 0;
+}
+
+/*
+ * Commit the cursor plane on its own. Like a page-flip, it sends a flip event
+ * once it is shown, and swaps wait for it. Nothing happens while a flip is
+ * pending, uterm_drm_display_pflip() picks the cursor up afterwards.
+ */
+static int commit_cursor(struct uterm_display *disp)
+{
+	struct uterm_drm_display *ddrm = disp->data;
+	struct uterm_drm_video *vdrm = disp->video->data;
+	drmModeAtomicReq *req;
+	int ret;
+
+	if (vdrm->legacy || !ddrm->cursor.dirty || (disp->flags & DISPLAY_VSYNC) ||
+	    disp->dpms != UTERM_DPMS_ON || !display_is_online(disp) ||
+	    !video_is_awake(disp->video))
+		return 0;
+
+	req = reuse_req(&ddrm->flip_req);
+	if (!req)
+		return -ENOMEM;
+
+	if (prepare_cursor(req, ddrm, vdrm->cursor_hotspot))
+		ret = -EINVAL;
+	else
+		ret = drmModeAtomicCommit(vdrm->fd, req,
+					  DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK,
+					  disp->video);
+
+	if (ret < 0) {
+		if (ret != -EBUSY)
+			log_warn("cursor commit failed for [%s], %d", disp->name, ret);
+		return ret;
+	}
+
+	/* same as a swap, the flip event drops the ref */
+	uterm_display_ref(disp);
+	disp->flags |= DISPLAY_VSYNC;
+	ddrm->cursor.dirty = false;
+	return 0;
+}
+
+/*
+ * With batched flips, the swap only remembers the framebuffer and the commit
+ * is built at the end of the dispatch, for all displays that swapped in it.
+ */
+static int queue_flip(struct uterm_display *disp, uint32_t fb)
+{
+	struct uterm_drm_display *ddrm = disp->data;
+	int ret;
+
+	ret = ev_eloop_register_idle_cb(disp->video->eloop, flush_flips, disp->video,
+					EV_ONESHOT | EV_SINGLE);
+	if (ret)
+		return ret;
+
+	ddrm->queued_fb = fb;
+	ddrm->flip_queued = true;
 	return 0;
 }
 
+/* the flip never happened, let the display go on as if it did */
+static void fail_flip(struct uterm_display *disp)
+{
+	disp->flags |= DISPLAY_PFLIP | DISPLAY_NEED_REDRAW;
+	uterm_display_unref(disp);
+	ev_eloop_register_idle_cb(disp->video->eloop, do_pflips, disp->video,
+				  EV_ONESHOT | EV_SINGLE);
+}
+
+/*
+ * One nonblocking commit flips every queued display. If the kernel refuses
+ * the combined state, each display is flipped on its own instead.
+ */
+static void flush_flips(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct uterm_video *video = data;
+	struct uterm_drm_video *vdrm = video->data;
+	struct uterm_drm_display *ddrm;
+	struct uterm_display *disp;
+	struct shl_dlist *iter;
+	drmModeAtomicReq *req;
+	unsigned int num = 0;
+	int ret = -ENOMEM;
+
+	req = reuse_req(&vdrm->batch_req);
+	shl_dlist_for_each(iter, &video->displays)
+	{
+		disp = shl_dlist_entry(iter, struct uterm_display, list);
+		ddrm = disp->data;
+		if (!ddrm->flip_queued || !req)
+			continue;
+		if (add_flip(disp, req, ddrm->queued_fb)) {
+			req = NULL;
+			continue;
+		}
+		++num;
+	}
+
+	if (req && num) {
+		ret = drmModeAtomicCommit(vdrm->fd, req,
+					  DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK,
+					  video);
+		if (ret < 0 && ret != -EBUSY)
+			log_warn("batched pageflip of %u displays failed, %d", num, ret);
+	}
+
+	shl_dlist_for_each(iter, &video->displays)
+	{
+		disp = shl_dlist_entry(iter, struct uterm_display, list);
+		ddrm = disp->data;
+		if (!ddrm->flip_queued)
+			continue;
+
+		ddrm->flip_queued = false;
+		if (ret >= 0) {
+			ddrm->damage_set = false;
+			ddrm->cursor.dirty = false;
+		} else if (pageflip(vdrm->fd, disp, ddrm->queued_fb)) {
+			fail_flip(disp);
+		}
+	}
+}
+
 int uterm_drm_display_swap(struct uterm_display *disp, uint32_t fb)
 {
 	struct uterm_drm_video *vdrm = disp->video->data;
@@ -1053,6 +1419,8 @@ int uterm_drm_display_swap(struct uterm_display *disp, uint32_t fb)
 
 	if (vdrm->legacy)
 		ret = legacy_pageflip(vdrm->fd, disp, fb);
+	else if (disp->video->batch_flips)
+		ret = queue_flip(disp, fb);
 	else
 		ret = pageflip(vdrm->fd, disp, fb);
 	if (ret)
@@ -1067,6 +1435,36 @@ int uterm_drm_display_swap(struct uterm_display *disp, uint32_t fb)
 	return 0;
 }
 
+/*
+ * Front mode: the frame was drawn into @fb, which is on screen already. Tell the
+ * driver which parts changed so it only uploads those, or everything if the
+ * damage is unknown. There is no flip and so no page-flip event.
+ */
+int uterm_drm_display_dirty(struct uterm_display *disp, uint32_t fb)
+{
+	struct uterm_drm_video *vdrm = disp->video->data;
+	struct uterm_drm_display *ddrm = disp->data;
+	int ret;
+
+	if (disp->dpms != UTERM_DPMS_ON)
+		return -EINVAL;
+
+	if (ddrm->damage_set)
+		ret = drmModeDirtyFB(vdrm->fd, fb, ddrm->dirty_clips, ddrm->damage_len);
+	else
+		ret = drmModeDirtyFB(vdrm->fd, fb, NULL, 0);
+	ddrm->damage_set = false;
+
+	/* the driver scans the buffer out itself, so it is shown already */
+	if (ret == -ENOSYS)
+		ret = 0;
+	if (ret)
+		log_warn("cannot mark framebuffer of display %s dirty (%d)", disp->name, ret);
+	else
+		disp->flags &= ~DISPLAY_NEED_REDRAW;
+	return ret;
+}
+
 bool uterm_drm_is_swapping(struct uterm_display *disp)
 {
 	return (disp->flags & DISPLAY_VSYNC) != 0;
@@ -1075,12 +1473,16 @@ bool uterm_drm_is_swapping(struct uterm_display *disp)
 static void uterm_drm_display_pflip(struct uterm_display *disp)
 {
 	struct uterm_drm_video *vdrm = disp->video->data;
+	struct uterm_drm_display *ddrm = disp->data;
 
 	disp->flags &= ~(DISPLAY_PFLIP | DISPLAY_VSYNC);
 	if (vdrm->page_flip)
 		vdrm->page_flip(disp);
 
-	DISPLAY_CB(disp, UTERM_PAGE_FLIP);
+	DISPLAY_CB_AT(disp, UTERM_PAGE_FLIP, ddrm->flip_time);
+
+	/* the cursor moved during the flip and no new frame took it along */
+	commit_cursor(disp);
 }
 
 static void display_event(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
@@ -1098,6 +1500,8 @@ static void display_event(int fd, unsigned int frame, unsigned int sec, unsigned
 		if (ddrm->crtc.id == crtc_id) {
 			if (disp->flags & DISPLAY_VSYNC)
 				disp->flags |= DISPLAY_PFLIP;
+			ddrm->flip_time = sec * 1000000ULL + usec;
+			disp->vblank_time = ddrm->flip_time;
 
 			uterm_display_unref(disp);
 			return;
@@ -1225,6 +1629,58 @@ static void drop_drm_master(struct uterm_drm_video *vdrm)
 	vdrm->master = false;
 }
 
+/*
+ * These drivers copy the framebuffer to a USB device or to the real scanout
+ * buffer, and only copy what drmModeDirtyFB() reports. Drawing into the buffer
+ * on screen saves them the flip and the copy of the whole frame.
+ */
+static const char *const dirty_fb_drivers[] = {
+	"udl", "gud", "simpledrm", "ofdrm", "cirrus", NULL,
+};
+
+static bool uses_dirty_fb(int fd)
+{
+	drmVersionPtr version;
+	bool ret = false;
+	size_t i;
+
+	version = drmGetVersion(fd);
+	if (!version)
+		return false;
+
+	for (i = 0; dirty_fb_drivers[i]; ++i) {
+		if (!strcmp(version->name, dirty_fb_drivers[i])) {
+			ret = true;
+			break;
+		}
+	}
+
+	drmFreeVersion(version);
+	return ret;
+}
+
+/* the driver, and the vendor and device of PCI GPUs, like "amdgpu:1002:73bf" */
+static void get_gpu(struct uterm_video *video, int fd)
+{
+	drmVersionPtr version;
+	drmDevicePtr dev;
+	int len;
+
+	version = drmGetVersion(fd);
+	if (!version)
+		return;
+
+	len = snprintf(video->gpu, sizeof(video->gpu), "%s", version->name);
+	drmFreeVersion(version);
+
+	if (len > 0 && (size_t)len < sizeof(video->gpu) && !drmGetDevice2(fd, 0, &dev)) {
+		if (dev->bustype == DRM_BUS_PCI)
+			snprintf(&video->gpu[len], sizeof(video->gpu) - len, ":%04x:%04x",
+				 dev->deviceinfo.pci->vendor_id, dev->deviceinfo.pci->device_id);
+		drmFreeDevice(&dev);
+	}
+}
+
 int uterm_drm_video_init(struct uterm_video *video, const char *node,
 			 const struct display_ops *display_ops, uterm_drm_page_flip_t pflip,
 			 void *data)
@@ -1269,11 +1725,17 @@ int uterm_drm_video_init(struct uterm_video *video, const char *node,
 		vdrm->legacy = true;
 	}
 
+	get_gpu(video, vdrm->fd);
+	vdrm->dirty_fb = uses_dirty_fb(vdrm->fd);
+	if (vdrm->dirty_fb)
+		log_debug("Device %s only uploads the damage passed to drmModeDirtyFB", node);
+
 	/* support hardware cursor on VM */
 	ret = drmSetClientCap(vdrm->fd, DRM_CLIENT_CAP_CURSOR_PLANE_HOTSPOT, 1);
 	vdrm->cursor_hotspot = (ret == 0);
 
-	ret = ev_eloop_new_fd(video->eloop, &vdrm->efd, vdrm->fd, EV_READABLE, io_event, video);
+	ret = ev_eloop_new_fd(video->eloop, &vdrm->efd, vdrm->fd, EV_READABLE | EV_PRIO_LOW, io_event,
+			      video);
 	if (ret)
 		goto err_close;
 
@@ -1285,9 +1747,15 @@ int uterm_drm_video_init(struct uterm_video *video, const char *node,
 	if (ret)
 		goto err_timer;
 
+	ret = ev_eloop_new_timer(video->eloop, &vdrm->hotplug_timer, NULL, hotplug_timeout, video);
+	if (ret)
+		goto err_vt_timer;
+
 	video->flags |= VIDEO_HOTPLUG;
 	return 0;
 
+err_vt_timer:
+	ev_eloop_rm_timer(vdrm->vt_timer);
 err_timer:
 	shl_timer_free(vdrm->timer);
 err_fd:
@@ -1305,8 +1773,11 @@ void uterm_drm_video_destroy(struct uterm_video *video)
 {
 	struct uterm_drm_video *vdrm = video->data;
 
+	ev_eloop_rm_timer(vdrm->hotplug_timer);
 	ev_eloop_rm_timer(vdrm->vt_timer);
 	ev_eloop_unregister_idle_cb(video->eloop, do_pflips, video, EV_SINGLE);
+	ev_eloop_unregister_idle_cb(video->eloop, flush_flips, video, EV_SINGLE);
+	drmModeAtomicFree(vdrm->batch_req);
 	shl_timer_free(vdrm->timer);
 	ev_eloop_rm_fd(vdrm->efd);
 	close(vdrm->fd);
@@ -1376,6 +1847,44 @@ static void init_modes(struct uterm_display *disp, drmModeConnector *conn)
 		  ddrm->current_mode->vdisplay);
 }
 
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* Identifies the monitor behind @conn by its EDID and modes, so swapping the
+ * monitor on a connector between two hotplug events is noticed. */
+static uint64_t connector_hash(int fd, drmModeConnector *conn)
+{
+	drmModePropertyPtr prop;
+	drmModePropertyBlobPtr blob;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < conn->count_props; ++i) {
+		prop = drmModeGetProperty(fd, conn->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "EDID") && conn->prop_values[i]) {
+			blob = drmModeGetPropertyBlob(fd, conn->prop_values[i]);
+			if (blob) {
+				h = fnv1a(h, blob->data, blob->length);
+				drmModeFreePropertyBlob(blob);
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	return fnv1a(h, conn->modes, conn->count_modes * sizeof(*conn->modes));
+}
+
 static void bind_display(struct uterm_video *video, drmModeRes *res, drmModeConnector *conn)
 {
 	struct uterm_drm_video *vdrm = video->data;
@@ -1393,6 +1902,7 @@ static void bind_display(struct uterm_video *video, drmModeRes *res, drmModeConn
 	init_modes(disp, conn);
 
 	ddrm->connector.id = conn->connector_id;
+	ddrm->conn_hash = connector_hash(vdrm->fd, conn);
 	disp->dpms = uterm_drm_get_dpms(vdrm->fd, conn);
 	log_info("display %s DPMS is %s", disp->name, uterm_dpms_to_name(disp->dpms));
 
@@ -1448,6 +1958,7 @@ int uterm_drm_video_hotplug(struct uterm_video *video, bool read_dpms, bool mode
 	int ret, i, dpms;
 	struct shl_dlist *iter, *tmp;
 	bool new_display = false;
+	uint64_t start;
 
 	if (!video_is_awake(video) || !video_need_hotplug(video))
 		return 0;
@@ -1483,6 +1994,13 @@ int uterm_drm_video_hotplug(struct uterm_video *video, bool read_dpms, bool mode
 			if (ddrm->connector.id != res->connectors[i])
 				continue;
 
+			if (ddrm->conn_hash != connector_hash(vdrm->fd, conn)) {
+				log_info("monitor on display %s changed", disp->name);
+				uterm_display_unbind(disp);
+				iter = &video->displays;
+				break;
+			}
+
 			disp->flags |= DISPLAY_AVAILABLE;
 
 			if (!display_is_online(disp))
@@ -1520,9 +2038,11 @@ int uterm_drm_video_hotplug(struct uterm_video *video, bool read_dpms, bool mode
 	}
 
 	if (modeset || new_display) {
-		ret = try_modeset(video);
+		start = shl_timer_now();
+		ret = try_modeset(video, modeset);
 		if (ret)
 			return ret;
+		shl_trace_span("modeset", vdrm->name, start);
 	}
 	shl_dlist_for_each(iter, &video->displays)
 	{
@@ -1580,10 +2100,43 @@ void uterm_drm_video_sleep(struct uterm_video *video)
 	ev_timer_update(vdrm->vt_timer, NULL);
 }
 
+/* Plugging a monitor or a dock sends a burst of change events. Connectors are
+ * read once the burst is quiet for HOTPLUG_DEBOUNCE ms, but not later than
+ * HOTPLUG_MAX_DELAY ms after its first event. */
+#define HOTPLUG_DEBOUNCE 100
+#define HOTPLUG_MAX_DELAY 1000
+
+static void hotplug_timeout(struct ev_timer *timer, uint64_t exp, void *data)
+{
+	struct uterm_video *video = data;
+	struct uterm_drm_video *vdrm = video->data;
+
+	vdrm->hotplug_since = 0;
+	uterm_drm_video_hotplug(video, false, false);
+}
+
 int uterm_drm_video_poll(struct uterm_video *video)
 {
+	struct uterm_drm_video *vdrm = video->data;
+	struct itimerspec spec;
+	uint64_t now, delay;
+
 	video->flags |= VIDEO_HOTPLUG;
-	return uterm_drm_video_hotplug(video, false, false);
+
+	now = shl_timer_now();
+	if (!vdrm->hotplug_since)
+		vdrm->hotplug_since = now;
+
+	delay = HOTPLUG_DEBOUNCE * 1000ULL;
+	if (now + delay > vdrm->hotplug_since + HOTPLUG_MAX_DELAY * 1000ULL)
+		delay = vdrm->hotplug_since + HOTPLUG_MAX_DELAY * 1000ULL - now;
+	if (!delay)
+		delay = 1;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = delay / 1000000;
+	spec.it_value.tv_nsec = (delay % 1000000) * 1000;
+	return ev_timer_update(vdrm->hotplug_timer, &spec);
 }
 
 /* Waits for events on DRM fd for \mtimeout milliseconds and returns 0 if the
@@ -38,10 +38,33 @@
 
 /* drm object */
 
+/* the properties we set, resolved once when the object is set up */
+enum drm_prop {
+	DRM_PROP_ACTIVE,
+	DRM_PROP_MODE_ID,
+	DRM_PROP_CRTC_ID,
+	DRM_PROP_FB_ID,
+	DRM_PROP_SRC_X,
+	DRM_PROP_SRC_Y,
+	DRM_PROP_SRC_W,
+	DRM_PROP_SRC_H,
+	DRM_PROP_CRTC_X,
+	DRM_PROP_CRTC_Y,
+	DRM_PROP_CRTC_W,
+	DRM_PROP_CRTC_H,
+	DRM_PROP_FB_DAMAGE_CLIPS,
+	DRM_PROP_HOTSPOT_X,
+	DRM_PROP_HOTSPOT_Y,
+	DRM_PROP_VRR_ENABLED,
+	DRM_PROP_VRR_CAPABLE,
+	DRM_PROP_NUM
+};
+
 struct drm_object {
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
 	uint32_t id;
+	uint32_t prop_ids[DRM_PROP_NUM]; /* 0 if the object doesn't have it */
 };
 
 /* drm display */
@@ -56,6 +79,7 @@ struct uterm_drm_cursor {
 	uint64_t map_size;
 	bool active;
 	bool visible;
+	bool dirty; /* the plane doesn't show the state below yet */
 	int32_t x;
 	int32_t y;
 	int32_t hot_x;
@@ -73,7 +97,36 @@ struct uterm_drm_display {
 	drmModeModeInfo mode;
 	uint32_t mode_blob_id;
 	uint32_t crtc_index;
+	bool plane_damage; /* the primary plane takes FB_DAMAGE_CLIPS */
 	uint32_t damage_blob_id;
+	bool damage_set; /* damage_blob_id belongs to the next flip */
+	/* the rectangles in damage_blob_id, it is reused while they don't change */
+	struct uterm_video_rect *damage_rects;
+	size_t damage_len;
+	size_t damage_size;
+	/*
+	 * In front mode the display draws into the framebuffer on screen and
+	 * reports the damage with drmModeDirtyFB() instead of flipping.
+	 */
+	bool front;
+	drmModeClip *dirty_clips;
+	size_t dirty_size;
+	uint64_t flip_time; /* kernel timestamp of the last page-flip */
+	bool vrr;	    /* VRR_ENABLED is set on the CRTC */
+	bool flip_queued;   /* queued_fb waits for the batched commit */
+	uint32_t queued_fb;
+	/*
+	 * Everything a page-flip sets besides the framebuffer, the damage and the
+	 * cursor, for the mode in flip_mode. flip_req is reset for each commit.
+	 */
+	drmModeAtomicReq *flip_tmpl;
+	drmModeAtomicReq *flip_req;
+	uint32_t flip_mode;
+	uint32_t flip_width;
+	uint32_t flip_height;
+
+	/* identifies the monitor on the connector, see connector_hash() */
+	uint64_t conn_hash;
 
 	drmModeModeInfoPtr current_mode;
 	drmModeModeInfo default_mode;
@@ -106,6 +159,7 @@ void uterm_drm_display_free_properties(struct uterm_display *disp);
 void uterm_drm_display_set_damage(struct uterm_display *disp, size_t n_rect,
 				  struct uterm_video_rect *damages);
 bool uterm_drm_display_has_damage(struct uterm_display *disp);
+int uterm_drm_display_dirty(struct uterm_display *disp, uint32_t fb);
 
 /* drm video */
 
@@ -119,10 +173,15 @@ struct uterm_drm_video {
 	void *data;
 	struct shl_timer *timer;
 	struct ev_timer *vt_timer;
+	/* connectors are read once a burst of change events is over */
+	struct ev_timer *hotplug_timer;
+	uint64_t hotplug_since; /* first change event of the burst, 0 if none */
 	bool legacy;
 	bool master;
 	bool cursor_hotspot;
+	bool dirty_fb; /* the driver uploads what drmModeDirtyFB() reports */
 	const struct display_ops *display_ops;
+	drmModeAtomicReq *batch_req; /* reused for every batched commit */
 };
 
 int uterm_drm_video_init(struct uterm_video *video, const char *node,
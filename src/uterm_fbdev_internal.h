@@ -40,6 +40,11 @@ struct fbdev_mode {
 	unsigned int height;
 };
 
+struct fbdev_display;
+
+typedef void (*fbdev_blend_line_t)(struct fbdev_display *fbdev, uint8_t *dst, const uint8_t *src,
+				   unsigned int width, const uint32_t *lut);
+
 struct fbdev_display {
 	int fd;
 	struct fb_fix_screeninfo finfo;
@@ -54,6 +59,16 @@ struct fbdev_display {
 	uint8_t *map;
 	unsigned int stride;
 
+	/*
+	 * Without panning, frames are drawn into a shadow buffer in system RAM
+	 * and only the damage is copied to the device on swap.
+	 */
+	uint8_t *shadow;
+	struct uterm_video_rect *damage;
+	size_t damage_len;
+	size_t damage_size;
+	bool damage_set;
+
 	bool xrgb32;
 	bool rgb24;
 	bool rgb16;
@@ -68,6 +83,13 @@ struct fbdev_display {
 	int_fast32_t dither_g;
 	int_fast32_t dither_b;
 
+	/* selected for the pixel format at activation; the blend tables hold
+	 * device pixels if lut_device is set, otherwise XRGB32 that is dithered.
+	 * blend_mono takes UTERM_FORMAT_MONO rows. */
+	fbdev_blend_line_t blend_line;
+	fbdev_blend_line_t blend_mono;
+	bool lut_device;
+
 	bool vblank_scheduled;
 	struct itimerspec vblank_spec;
 	struct ev_timer *vblank_timer;
@@ -78,8 +100,18 @@ struct fbdev_video {
 	bool pending_intro;
 };
 
+void uterm_fbdev_display_setup_blend(struct uterm_display *disp);
 int uterm_fbdev_display_fake_blendv(struct uterm_display *disp,
 				    const struct uterm_video_blend_req *req, size_t num);
 int uterm_fbdev_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b);
+int uterm_fbdev_display_fake_move(struct uterm_display *disp, unsigned int src_y,
+				  unsigned int dst_y, unsigned int height);
+int uterm_fbdev_display_fake_copyv(struct uterm_display *disp,
+				   const struct uterm_video_rect *rects, size_t num);
+int uterm_fbdev_display_fake_readv(struct uterm_display *disp, uint8_t *dst,
+				   unsigned int stride, const struct uterm_video_rect *rects,
+				   size_t num);
+int uterm_fbdev_display_export_frame(struct uterm_display *disp, struct uterm_video_export *out);
+void uterm_fbdev_display_flush(struct uterm_display *disp);
 
 #endif /* UTERM_FBDEV_INTERNAL_H */
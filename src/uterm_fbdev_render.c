@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "shl_log.h"
+#include "shl_misc.h"
 #include "uterm_fbdev_internal.h"
 #include "uterm_video.h"
 #include "uterm_video_internal.h"
@@ -48,53 +49,72 @@ static int clamp_value(int val, int low, int up)
 		return val;
 }
 
-static uint_fast32_t xrgb32_to_device(struct uterm_display *disp, uint32_t pixel)
+/* This is some very basic dithering which simply does small rotations in the
+ * lower pixel bits. @d carries the error from one pixel to the next.
+ * TODO: Let's take a look at Floyd-Steinberg dithering which should give much
+ * better results. It is slightly slower, though. Or even better would be some
+ * Sierra filter like the Sierra LITE. */
+static inline __attribute__((always_inline)) uint_fast32_t dither_channel(int_fast32_t *d,
+									   uint8_t c,
+									   unsigned int len)
+{
+	uint_fast32_t v;
+	uint8_t n;
+	unsigned int i;
+
+	*d = c - *d;
+	v = clamp_value(*d, 0, 255) >> (8 - len);
+	n = v << (8 - len);
+	for (i = len; i < 8; i <<= 1)
+		n |= n >> i;
+	*d = n - *d;
+
+	return v;
+}
+
+/* Always inlined, so the loops below get the shifts as constants where the
+ * format is known. */
+static inline __attribute__((always_inline)) uint_fast32_t
+dither_pixel(int_fast32_t *d, uint32_t pixel, unsigned int len_r, unsigned int len_g,
+	     unsigned int len_b, unsigned int off_r, unsigned int off_g, unsigned int off_b)
+{
+	uint_fast32_t res;
+
+	res = dither_channel(&d[0], (pixel >> 16) & 0xff, len_r) << off_r;
+	res |= dither_channel(&d[1], (pixel >> 8) & 0xff, len_g) << off_g;
+	res |= dither_channel(&d[2], pixel & 0xff, len_b) << off_b;
+
+	return res;
+}
+
+static uint_fast32_t pack_pixel(const struct fbdev_display *fbdev, uint32_t pixel)
 {
-	uint8_t r, g, b, nr, ng, nb;
-	int i;
 	uint_fast32_t res;
+
+	res = (((pixel >> 16) & 0xff) >> (8 - fbdev->len_r)) << fbdev->off_r;
+	res |= (((pixel >> 8) & 0xff) >> (8 - fbdev->len_g)) << fbdev->off_g;
+	res |= ((pixel & 0xff) >> (8 - fbdev->len_b)) << fbdev->off_b;
+
+	return res;
+}
+
+static uint_fast32_t xrgb32_to_device(struct uterm_display *disp, uint32_t pixel)
+{
 	struct fbdev_display *fbdev = disp->data;
+	int_fast32_t d[3];
+	uint_fast32_t res;
 
-	r = (pixel >> 16) & 0xff;
-	g = (pixel >> 8) & 0xff;
-	b = (pixel >> 0) & 0xff;
-
-	if (disp->flags & DISPLAY_DITHERING) {
-		/* This is some very basic dithering which simply does small
-		 * rotations in the lower pixel bits. TODO: Let's take a look
-		 * at Floyd-Steinberg dithering which should give much better
-		 * results. It is slightly slower, though.
-		 * Or even better would be some Sierra filter like the Sierra
-		 * LITE. */
-		fbdev->dither_r = r - fbdev->dither_r;
-		fbdev->dither_g = g - fbdev->dither_g;
-		fbdev->dither_b = b - fbdev->dither_b;
-		r = clamp_value(fbdev->dither_r, 0, 255) >> (8 - fbdev->len_r);
-		g = clamp_value(fbdev->dither_g, 0, 255) >> (8 - fbdev->len_g);
-		b = clamp_value(fbdev->dither_b, 0, 255) >> (8 - fbdev->len_b);
-		nr = r << (8 - fbdev->len_r);
-		ng = g << (8 - fbdev->len_g);
-		nb = b << (8 - fbdev->len_b);
-
-		for (i = fbdev->len_r; i < 8; i <<= 1)
-			nr |= nr >> i;
-		for (i = fbdev->len_g; i < 8; i <<= 1)
-			ng |= ng >> i;
-		for (i = fbdev->len_b; i < 8; i <<= 1)
-			nb |= nb >> i;
-
-		fbdev->dither_r = nr - fbdev->dither_r;
-		fbdev->dither_g = ng - fbdev->dither_g;
-		fbdev->dither_b = nb - fbdev->dither_b;
-
-		res = r << fbdev->off_r;
-		res |= g << fbdev->off_g;
-		res |= b << fbdev->off_b;
-	} else {
-		res = (r >> (8 - fbdev->len_r)) << fbdev->off_r;
-		res |= (g >> (8 - fbdev->len_g)) << fbdev->off_g;
-		res |= (b >> (8 - fbdev->len_b)) << fbdev->off_b;
-	}
+	if (!(disp->flags & DISPLAY_DITHERING))
+		return pack_pixel(fbdev, pixel);
+
+	d[0] = fbdev->dither_r;
+	d[1] = fbdev->dither_g;
+	d[2] = fbdev->dither_b;
+	res = dither_pixel(d, pixel, fbdev->len_r, fbdev->len_g, fbdev->len_b, fbdev->off_r,
+			   fbdev->off_g, fbdev->off_b);
+	fbdev->dither_r = d[0];
+	fbdev->dither_g = d[1];
+	fbdev->dither_b = d[2];
 
 	return res;
 }
@@ -114,160 +134,418 @@ static void write_24bit(uint8_t *dst, uint_fast32_t value)
 #endif
 }
 
+/*
+ * Blend loops
+ * Each request looks up the display's table of its colors blended at all 256
+ * alpha values, so blending a pixel is a table lookup. Without dithering, or if the
+ * channels have 8 bits and dithering does nothing, the table holds device
+ * pixels and the loop only stores them. Otherwise the table holds XRGB32 and
+ * the loop dithers each pixel, with the shifts fixed for RGB565.
+ * Mono rows only ever pick the first or the last entry of the table.
+ */
+
+#define STORE_16(dst, i, v) (((uint16_t *)(dst))[i] = (v))
+#define STORE_24(dst, i, v) write_24bit(&(dst)[(i) * 3], (v))
+#define STORE_32(dst, i, v) (((uint32_t *)(dst))[i] = (v))
+
+#define LOAD_GREY(src, i) ((src)[i])
+#define LOAD_MONO(src, i) (((src)[(i) / 8] & (0x80 >> ((i) % 8))) ? 0xff : 0x00)
+
+#define LUT_LINE(name, load, store)                                                                \
+	static void name(struct fbdev_display *fbdev, uint8_t *dst, const uint8_t *src,            \
+			 unsigned int width, const uint32_t *lut)                                  \
+	{                                                                                          \
+		unsigned int i;                                                                    \
+                                                                                                   \
+		for (i = 0; i < width; ++i)                                                        \
+			store(dst, i, lut[load(src, i)]);                                          \
+	}
+
+#define DITHER_LINE(name, load, store, len_r, len_g, len_b, off_r, off_g, off_b)                   \
+	static void name(struct fbdev_display *fbdev, uint8_t *dst, const uint8_t *src,            \
+			 unsigned int width, const uint32_t *lut)                                  \
+	{                                                                                          \
+		int_fast32_t d[3] = {fbdev->dither_r, fbdev->dither_g, fbdev->dither_b};          \
+		unsigned int i;                                                                    \
+                                                                                                   \
+		for (i = 0; i < width; ++i)                                                        \
+			store(dst, i,                                                              \
+			      dither_pixel(d, lut[load(src, i)], len_r, len_g, len_b, off_r,       \
+					   off_g, off_b));                                         \
+                                                                                                   \
+		fbdev->dither_r = d[0];                                                            \
+		fbdev->dither_g = d[1];                                                            \
+		fbdev->dither_b = d[2];                                                            \
+	}
+
+LUT_LINE(blend_line_lut16, LOAD_GREY, STORE_16)
+LUT_LINE(blend_line_lut24, LOAD_GREY, STORE_24)
+LUT_LINE(blend_line_lut32, LOAD_GREY, STORE_32)
+DITHER_LINE(blend_line_dither_rgb16, LOAD_GREY, STORE_16, 5, 6, 5, 11, 5, 0)
+DITHER_LINE(blend_line_dither16, LOAD_GREY, STORE_16, fbdev->len_r, fbdev->len_g, fbdev->len_b,
+	    fbdev->off_r, fbdev->off_g, fbdev->off_b)
+DITHER_LINE(blend_line_dither24, LOAD_GREY, STORE_24, fbdev->len_r, fbdev->len_g, fbdev->len_b,
+	    fbdev->off_r, fbdev->off_g, fbdev->off_b)
+DITHER_LINE(blend_line_dither32, LOAD_GREY, STORE_32, fbdev->len_r, fbdev->len_g, fbdev->len_b,
+	    fbdev->off_r, fbdev->off_g, fbdev->off_b)
+
+/* mono rows with device pixels in the table are two colors and no lookup */
+#define MONO_LINE(name, store)                                                                     \
+	static void name(struct fbdev_display *fbdev, uint8_t *dst, const uint8_t *src,            \
+			 unsigned int width, const uint32_t *lut)                                  \
+	{                                                                                          \
+		uint_fast32_t fg = lut[0xff], bg = lut[0x00];                                      \
+		unsigned int i;                                                                    \
+                                                                                                   \
+		for (i = 0; i < width; ++i)                                                        \
+			store(dst, i, (src[i / 8] & (0x80 >> (i % 8))) ? fg : bg);                 \
+	}
+
+MONO_LINE(blend_mono_lut16, STORE_16)
+MONO_LINE(blend_mono_lut24, STORE_24)
+MONO_LINE(blend_mono_lut32, STORE_32)
+DITHER_LINE(blend_mono_dither_rgb16, LOAD_MONO, STORE_16, 5, 6, 5, 11, 5, 0)
+DITHER_LINE(blend_mono_dither16, LOAD_MONO, STORE_16, fbdev->len_r, fbdev->len_g, fbdev->len_b,
+	    fbdev->off_r, fbdev->off_g, fbdev->off_b)
+DITHER_LINE(blend_mono_dither24, LOAD_MONO, STORE_24, fbdev->len_r, fbdev->len_g, fbdev->len_b,
+	    fbdev->off_r, fbdev->off_g, fbdev->off_b)
+DITHER_LINE(blend_mono_dither32, LOAD_MONO, STORE_32, fbdev->len_r, fbdev->len_g, fbdev->len_b,
+	    fbdev->off_r, fbdev->off_g, fbdev->off_b)
+
+/* pixels that were blended before, converted one by one */
+static void copy_line(struct uterm_display *disp, uint8_t *dst, const uint32_t *src,
+		      unsigned int width)
+{
+	struct fbdev_display *fbdev = disp->data;
+	unsigned int i;
+
+	for (i = 0; i < width; ++i) {
+		if (fbdev->Bpp == 2)
+			STORE_16(dst, i, xrgb32_to_device(disp, src[i]));
+		else if (fbdev->Bpp == 3)
+			STORE_24(dst, i, xrgb32_to_device(disp, src[i]));
+		else
+			STORE_32(dst, i, xrgb32_to_device(disp, src[i]));
+	}
+}
+
+/* row @row of @buf, with the loop for its format; color glyphs are drawn over
+ * the background in XRGB32 a piece at a time and then converted */
+static void blend_buf_line(struct uterm_display *disp, uint8_t *dst,
+			   const struct uterm_video_buffer *buf, unsigned int row,
+			   unsigned int width, const struct uterm_video_blend_req *req,
+			   const uint32_t *lut)
+{
+	struct fbdev_display *fbdev = disp->data;
+	const uint8_t *src = &buf->data[row * buf->stride];
+	uint32_t tmp[64];
+	unsigned int i, n;
+
+	if (buf->format == UTERM_FORMAT_MONO) {
+		fbdev->blend_mono(fbdev, dst, src, width, lut);
+	} else if (buf->format == UTERM_FORMAT_ARGB32) {
+		for (i = 0; i < width; i += n) {
+			n = min(width - i, (unsigned int)(sizeof(tmp) / sizeof(*tmp)));
+			uterm_blend_argb32_line(tmp, &src[i * 4], n,
+						(req->br << 16) | (req->bg << 8) | req->bb);
+			copy_line(disp, &dst[i * fbdev->Bpp], tmp, n);
+		}
+	} else {
+		fbdev->blend_line(fbdev, dst, src, width, lut);
+	}
+}
+
+/* a run of one color, dithered if the tables can't hold device pixels */
+static void fill_line(struct uterm_display *disp, uint8_t *dst, unsigned int width,
+		      uint32_t pixel)
+{
+	struct fbdev_display *fbdev = disp->data;
+	uint_fast32_t val = pack_pixel(fbdev, pixel);
+	unsigned int i;
+
+	for (i = 0; i < width; ++i) {
+		if (!fbdev->lut_device)
+			val = xrgb32_to_device(disp, pixel);
+		if (fbdev->Bpp == 2)
+			STORE_16(dst, i, val);
+		else if (fbdev->Bpp == 3)
+			STORE_24(dst, i, val);
+		else
+			STORE_32(dst, i, val);
+	}
+}
+
+/* rows of all glyphs of a span, left to right */
+static void blend_span(struct uterm_display *disp, uint8_t *dst,
+		       const struct uterm_video_blend_req *req, unsigned int width,
+		       unsigned int height, const uint32_t *lut)
+{
+	struct fbdev_display *fbdev = disp->data;
+	const struct uterm_video_buffer *buf;
+	unsigned int i, j, off, w;
+
+	for (i = 0; i < height; ++i, dst += fbdev->stride) {
+		for (j = 0, off = 0; j < req->buf_num && off < width; ++j, off += w) {
+			buf = req->bufs[j];
+			w = min(buf->width, width - off);
+			blend_buf_line(disp, &dst[off * fbdev->Bpp], buf, i, w, req, lut);
+		}
+	}
+}
+
+static void pack_lut(struct uterm_display *disp, uint32_t *pix)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; ++i)
+		pix[i] = pack_pixel(disp->data, pix[i]);
+}
+
+void uterm_fbdev_display_setup_blend(struct uterm_display *disp)
+{
+	struct fbdev_display *fbdev = disp->data;
+	static const fbdev_blend_line_t lut_lines[] = {
+		NULL, NULL, blend_line_lut16, blend_line_lut24, blend_line_lut32,
+	};
+	static const fbdev_blend_line_t dither_lines[] = {
+		NULL, NULL, blend_line_dither16, blend_line_dither24, blend_line_dither32,
+	};
+	static const fbdev_blend_line_t mono_lut_lines[] = {
+		NULL, NULL, blend_mono_lut16, blend_mono_lut24, blend_mono_lut32,
+	};
+	static const fbdev_blend_line_t mono_dither_lines[] = {
+		NULL, NULL, blend_mono_dither16, blend_mono_dither24, blend_mono_dither32,
+	};
+
+	fbdev->lut_device = !(disp->flags & DISPLAY_DITHERING) ||
+			    (fbdev->len_r == 8 && fbdev->len_g == 8 && fbdev->len_b == 8);
+
+	if (fbdev->Bpp >= sizeof(lut_lines) / sizeof(*lut_lines)) {
+		fbdev->blend_line = NULL;
+		fbdev->blend_mono = NULL;
+	} else if (fbdev->lut_device) {
+		fbdev->blend_line = lut_lines[fbdev->Bpp];
+		fbdev->blend_mono = mono_lut_lines[fbdev->Bpp];
+	} else if (fbdev->rgb16) {
+		fbdev->blend_line = blend_line_dither_rgb16;
+		fbdev->blend_mono = blend_mono_dither_rgb16;
+	} else {
+		fbdev->blend_line = dither_lines[fbdev->Bpp];
+		fbdev->blend_mono = mono_dither_lines[fbdev->Bpp];
+	}
+
+	/* the tables depend on the format */
+	disp->blend_lut_convert = (fbdev->lut_device && !fbdev->xrgb32) ? pack_lut : NULL;
+	uterm_blend_flush_luts(disp);
+}
+
+/* the buffer frames are drawn into */
+static uint8_t *back_buffer(struct uterm_display *disp)
+{
+	struct fbdev_display *fbdev = disp->data;
+
+	if (fbdev->shadow)
+		return fbdev->shadow;
+	if (!(disp->flags & DISPLAY_DBUF) || fbdev->bufid)
+		return fbdev->map;
+	return &fbdev->map[fbdev->yres * fbdev->stride];
+}
+
+/* with double-buffering, the buffer on screen */
+static uint8_t *front_buffer(struct fbdev_display *fbdev)
+{
+	if (fbdev->bufid)
+		return &fbdev->map[fbdev->yres * fbdev->stride];
+	return fbdev->map;
+}
+
 int uterm_fbdev_display_fake_blendv(struct uterm_display *disp,
 				    const struct uterm_video_blend_req *req, size_t num)
 {
 	unsigned int tmp;
 	uint8_t *dst;
 	const uint8_t *src;
-	unsigned int width, height, i, j;
-	unsigned int r, g, b;
-	uint32_t val;
+	const uint32_t *lut;
+	unsigned int width, height, w, h, i, j;
 	struct fbdev_display *fbdev = disp->data;
+	uint8_t *map;
 
 	if (!req)
 		return -EINVAL;
 
+	map = back_buffer(disp);
+
+	if (fbdev->xrgb32)
+		return uterm_blend_xrgb32v(disp, map, fbdev->stride, fbdev->xres, fbdev->yres, req, num);
+
+	if (!fbdev->blend_line) {
+		log_error("invalid Bpp");
+		return -EFAULT;
+	}
+
 	for (j = 0; j < num; ++j, ++req) {
-		if (!req->buf)
+		if (req->flags & (UTERM_BLEND_FILL | UTERM_BLEND_SPAN)) {
+			w = req->width;
+			h = req->height;
+		} else if (req->buf) {
+			w = req->buf->width;
+			h = req->buf->height;
+		} else {
 			continue;
+		}
 
-		tmp = req->x + req->buf->width;
+		tmp = req->x + w;
 		if (tmp < req->x || req->x >= fbdev->xres)
 			return -EINVAL;
 		if (tmp > fbdev->xres)
 			width = fbdev->xres - req->x;
 		else
-			width = req->buf->width;
+			width = w;
 
-		tmp = req->y + req->buf->height;
+		tmp = req->y + h;
 		if (tmp < req->y || req->y >= fbdev->yres)
 			return -EINVAL;
 		if (tmp > fbdev->yres)
 			height = fbdev->yres - req->y;
 		else
-			height = req->buf->height;
+			height = h;
 
-		if (!(disp->flags & DISPLAY_DBUF) || fbdev->bufid)
-			dst = fbdev->map;
-		else
-			dst = &fbdev->map[fbdev->yres * fbdev->stride];
-		dst = &dst[req->y * fbdev->stride + req->x * fbdev->Bpp];
-		src = req->buf->data;
+		dst = &map[req->y * fbdev->stride + req->x * fbdev->Bpp];
 
-		/* Division by 256 instead of 255 increases
-		 * speed by like 20% on slower machines.
-		 * Downside is, full white is 254/254/254
-		 * instead of 255/255/255. */
-		if (fbdev->xrgb32) {
+		if (req->flags & UTERM_BLEND_FILL) {
 			while (height--) {
-				for (i = 0; i < width; ++i) {
-					if (src[i] == 0) {
-						r = req->br;
-						g = req->bg;
-						b = req->bb;
-					} else if (src[i] == 255) {
-						r = req->fr;
-						g = req->fg;
-						b = req->fb;
-					} else {
-						r = req->fr * src[i] + req->br * (255 - src[i]);
-						r /= 256;
-						g = req->fg * src[i] + req->bg * (255 - src[i]);
-						g /= 256;
-						b = req->fb * src[i] + req->bb * (255 - src[i]);
-						b /= 256;
-					}
-					val = (r << 16) | (g << 8) | b;
-					((uint32_t *)dst)[i] = val;
-				}
+				fill_line(disp, dst, width, (req->br << 16) | (req->bg << 8) | req->bb);
 				dst += fbdev->stride;
-				src += req->buf->stride;
 			}
-		} else if (fbdev->Bpp == 2) {
-			while (height--) {
-				for (i = 0; i < width; ++i) {
-					if (src[i] == 0) {
-						r = req->br;
-						g = req->bg;
-						b = req->bb;
-					} else if (src[i] == 255) {
-						r = req->fr;
-						g = req->fg;
-						b = req->fb;
-					} else {
-						r = req->fr * src[i] + req->br * (255 - src[i]);
-						r /= 256;
-						g = req->fg * src[i] + req->bg * (255 - src[i]);
-						g /= 256;
-						b = req->fb * src[i] + req->bb * (255 - src[i]);
-						b /= 256;
-					}
-					val = (r << 16) | (g << 8) | b;
-					((uint16_t *)dst)[i] = xrgb32_to_device(disp, val);
-				}
-				dst += fbdev->stride;
-				src += req->buf->stride;
-			}
-		} else if (fbdev->Bpp == 3) {
-			while (height--) {
-				for (i = 0; i < width; ++i) {
-					if (src[i] == 0) {
-						r = req->br;
-						g = req->bg;
-						b = req->bb;
-					} else if (src[i] == 255) {
-						r = req->fr;
-						g = req->fg;
-						b = req->fb;
-					} else {
-						r = req->fr * src[i] + req->br * (255 - src[i]);
-						r /= 256;
-						g = req->fg * src[i] + req->bg * (255 - src[i]);
-						g /= 256;
-						b = req->fb * src[i] + req->bb * (255 - src[i]);
-						b /= 256;
-					}
-					val = (r << 16) | (g << 8) | b;
-					uint_fast32_t full = xrgb32_to_device(disp, val);
-					write_24bit(&dst[i * 3], full);
-				}
-				dst += fbdev->stride;
-				src += req->buf->stride;
-			}
-		} else if (fbdev->Bpp == 4) {
+			continue;
+		}
+
+		if (req->flags & UTERM_BLEND_SPAN) {
+			lut = uterm_blend_get_lut(disp, req);
+			if (!lut)
+				return -ENOMEM;
+			blend_span(disp, dst, req, width, height, lut);
+			uterm_blend_put_lut(disp, lut);
+			continue;
+		}
+
+		src = req->buf->data;
+
+		if (req->flags & UTERM_BLEND_XRGB32) {
 			while (height--) {
-				for (i = 0; i < width; ++i) {
-					if (src[i] == 0) {
-						r = req->br;
-						g = req->bg;
-						b = req->bb;
-					} else if (src[i] == 255) {
-						r = req->fr;
-						g = req->fg;
-						b = req->fb;
-					} else {
-						r = req->fr * src[i] + req->br * (255 - src[i]);
-						r /= 256;
-						g = req->fg * src[i] + req->bg * (255 - src[i]);
-						g /= 256;
-						b = req->fb * src[i] + req->bb * (255 - src[i]);
-						b /= 256;
-					}
-					val = (r << 16) | (g << 8) | b;
-					((uint32_t *)dst)[i] = xrgb32_to_device(disp, val);
-				}
+				copy_line(disp, dst, (const uint32_t *)src, width);
 				dst += fbdev->stride;
 				src += req->buf->stride;
 			}
-		} else {
-			log_warning("invalid Bpp");
+			continue;
+		}
+
+		lut = uterm_blend_get_lut(disp, req);
+		if (!lut)
+			return -ENOMEM;
+
+		for (i = 0; i < height; ++i) {
+			blend_buf_line(disp, dst, req->buf, i, width, req, lut);
+			dst += fbdev->stride;
 		}
+		uterm_blend_put_lut(disp, lut);
 	}
 
 	return 0;
 }
 
+int uterm_fbdev_display_fake_move(struct uterm_display *disp, unsigned int src_y,
+				  unsigned int dst_y, unsigned int height)
+{
+	struct fbdev_display *fbdev = disp->data;
+	uint8_t *dst, *src;
+	unsigned int sh = fbdev->yres;
+
+	if (src_y > sh || dst_y > sh || height > sh - src_y || height > sh - dst_y)
+		return -EINVAL;
+
+	/* with double-buffering, copy from the buffer on screen */
+	dst = back_buffer(disp);
+	src = (disp->flags & DISPLAY_DBUF) ? front_buffer(fbdev) : dst;
+
+	memmove(&dst[dst_y * fbdev->stride], &src[src_y * fbdev->stride],
+		(size_t)height * fbdev->stride);
+	return 0;
+}
+
+int uterm_fbdev_display_fake_copyv(struct uterm_display *disp,
+				   const struct uterm_video_rect *rects, size_t num)
+{
+	struct fbdev_display *fbdev = disp->data;
+
+	/* a single buffer is always up to date */
+	if (!(disp->flags & DISPLAY_DBUF))
+		return 0;
+
+	uterm_blend_copy_rects(back_buffer(disp), fbdev->stride, front_buffer(fbdev),
+			       fbdev->stride, fbdev->Bpp, fbdev->xres, fbdev->yres, rects, num);
+	return 0;
+}
+
+/* frames are only read back in the format they are handed out in */
+int uterm_fbdev_display_fake_readv(struct uterm_display *disp, uint8_t *dst,
+				   unsigned int stride, const struct uterm_video_rect *rects,
+				   size_t num)
+{
+	struct fbdev_display *fbdev = disp->data;
+
+	if (!fbdev->xrgb32)
+		return -EOPNOTSUPP;
+
+	uterm_blend_copy_rects(dst, stride, back_buffer(disp), fbdev->stride, 4, fbdev->xres,
+			       fbdev->yres, rects, num);
+	return 0;
+}
+
+/*
+ * fbdev has no dma-bufs, so the frame is copied. Between frames, the shadow
+ * buffer holds the one on screen and is faster to read than video memory.
+ */
+int uterm_fbdev_display_export_frame(struct uterm_display *disp, struct uterm_video_export *out)
+{
+	struct fbdev_display *fbdev = disp->data;
+	const uint8_t *src;
+
+	if (!fbdev->xrgb32)
+		return -EOPNOTSUPP;
+
+	if (fbdev->shadow)
+		src = fbdev->shadow;
+	else if (disp->flags & DISPLAY_DBUF)
+		src = front_buffer(fbdev);
+	else
+		src = fbdev->map;
+
+	return uterm_video_export_copy(out, src, fbdev->stride, fbdev->xres, fbdev->yres);
+}
+
+/*
+ * Copy the shadow buffer to the device. Only the damage of the frame is copied,
+ * unless it is unknown or the device may show something else.
+ */
+void uterm_fbdev_display_flush(struct uterm_display *disp)
+{
+	struct fbdev_display *fbdev = disp->data;
+	struct uterm_video_rect all = {0, 0, fbdev->xres, fbdev->yres};
+
+	if (!fbdev->shadow)
+		return;
+
+	if (!fbdev->damage_set || (disp->flags & DISPLAY_NEED_REDRAW))
+		uterm_blend_copy_rects(fbdev->map, fbdev->stride, fbdev->shadow, fbdev->stride,
+				       fbdev->Bpp, fbdev->xres, fbdev->yres, &all, 1);
+	else
+		uterm_blend_copy_rects(fbdev->map, fbdev->stride, fbdev->shadow, fbdev->stride,
+				       fbdev->Bpp, fbdev->xres, fbdev->yres, fbdev->damage,
+				       fbdev->damage_len);
+	fbdev->damage_set = false;
+}
+
 int uterm_fbdev_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
 {
 	unsigned int i;
@@ -277,10 +555,7 @@ int uterm_fbdev_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g,
 	unsigned int width = fbdev->xres;
 	unsigned int height = fbdev->yres;
 
-	if (!(disp->flags & DISPLAY_DBUF) || fbdev->bufid)
-		dst = fbdev->map;
-	else
-		dst = &fbdev->map[fbdev->yres * fbdev->stride];
+	dst = back_buffer(disp);
 
 	full_val = ((r & 0xff) >> (8 - fbdev->len_r)) << fbdev->off_r;
 	full_val |= ((g & 0xff) >> (8 - fbdev->len_g)) << fbdev->off_g;
@@ -312,11 +587,7 @@ int uterm_fbdev_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g,
 			dst += fbdev->stride;
 		}
 	} else if (fbdev->Bpp == 4) {
-		while (height--) {
-			for (i = 0; i < width; ++i)
-				((uint32_t *)dst)[i] = full_val;
-			dst += fbdev->stride;
-		}
+		uterm_blend_fill_xrgb32(dst, fbdev->stride, width, height, full_val);
 	} else {
 		log_error("invalid Bpp");
 		return -EFAULT;
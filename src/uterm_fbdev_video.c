@@ -107,6 +107,7 @@ static void display_destroy(struct uterm_display *disp)
 	struct fbdev_display *fbdev = disp->data;
 	ev_eloop_rm_timer(fbdev->vblank_timer);
 	ev_timer_unref(fbdev->vblank_timer);
+	free(fbdev->damage);
 	free(disp->data);
 }
 
@@ -130,6 +131,69 @@ static int refresh_info(struct uterm_display *disp)
 	return 0;
 }
 
+/*
+ * Many drivers accept any virtual size, so only pan if the driver says it can
+ * and the memory of both buffers exists.
+ */
+static bool can_pan(struct fbdev_display *dfb)
+{
+	struct fb_fix_screeninfo *finfo = &dfb->finfo;
+	struct fb_var_screeninfo *vinfo = &dfb->vinfo;
+
+	if (vinfo->xres_virtual < vinfo->xres || vinfo->yres_virtual < vinfo->yres * 2)
+		return false;
+	if (!finfo->ypanstep || vinfo->yres % finfo->ypanstep)
+		return false;
+	return (uint64_t)finfo->line_length * vinfo->yres * 2 <= finfo->smem_len;
+}
+
+/*
+ * Without panning, frames are drawn into system RAM and the damage is copied
+ * to the device on swap. This avoids showing half-drawn frames and reading
+ * from video memory. If there is no memory or the shadow buffer is turned off,
+ * draw into the device directly.
+ */
+static void init_shadow(struct uterm_display *disp)
+{
+	struct fbdev_display *dfb = disp->data;
+
+	if (disp->video->shadow == UTERM_SHADOW_OFF)
+		return;
+
+	dfb->shadow = malloc((size_t)dfb->stride * dfb->yres);
+	if (!dfb->shadow) {
+		log_warning("cannot allocate shadow buffer for %s", dfb->node);
+		return;
+	}
+
+	memset(dfb->shadow, 0, (size_t)dfb->stride * dfb->yres);
+	dfb->damage_set = false;
+	disp->flags |= DISPLAY_DAMAGE;
+}
+
+/* the frame drawn into the back buffer moves to the shadow buffer */
+static void stop_panning(struct uterm_display *disp)
+{
+	struct fbdev_display *dfb = disp->data;
+	uint8_t *back;
+
+	back = dfb->bufid ? dfb->map : &dfb->map[dfb->yres * dfb->stride];
+	disp->flags &= ~DISPLAY_DBUF;
+	dfb->bufid = 0;
+	init_shadow(disp);
+	if (dfb->shadow)
+		memcpy(dfb->shadow, back, (size_t)dfb->stride * dfb->yres);
+	else if (back != dfb->map)
+		memcpy(dfb->map, back, (size_t)dfb->stride * dfb->yres);
+
+	/* the buffer on screen might be either one */
+	dfb->vinfo.yoffset = 0;
+	dfb->vinfo.activate = FB_ACTIVATE_NOW;
+	if (ioctl(dfb->fd, FBIOPUT_VSCREENINFO, &dfb->vinfo))
+		log_debug("cannot reset fb offsets (%d): %m", errno);
+	uterm_fbdev_display_flush(disp);
+}
+
 static int display_activate_force(struct uterm_display *disp, bool force)
 {
 	static const char depths[] = {32, 24, 16, 0};
@@ -169,11 +233,9 @@ static int display_activate_force(struct uterm_display *disp, bool force)
 	 * without segfaults is the _real_ framebuffer. Therefore, disable
 	 * double-buffering for it.
 	 * TODO: fix this kernel-side!
-	 * TODO: There are so many broken fbdev drivers that just accept any
-	 * virtual FB sizes and then break mmap that we now disable
-	 * double-buffering entirely. We might instead add a white-list or
-	 * optional command-line argument to re-enable it. */
-	if (true || !strcmp(finfo->id, "udlfb")) {
+	 * Other drivers accept any virtual size as well, so can_pan() checks
+	 * the result below. */
+	if (!strcmp(finfo->id, "udlfb")) {
 		disp->flags &= ~DISPLAY_DBUF;
 		vinfo->yres_virtual = vinfo->yres;
 	}
@@ -189,11 +251,6 @@ static int display_activate_force(struct uterm_display *disp, bool force)
 		}
 	}
 
-	if (disp->flags & DISPLAY_DBUF)
-		log_debug("enable double buffering");
-	else
-		log_debug("disable double buffering");
-
 	ret = refresh_info(disp);
 	if (ret)
 		goto err_close;
@@ -234,9 +291,20 @@ static int display_activate_force(struct uterm_display *disp, bool force)
 		goto err_close;
 	}
 
-	if (vinfo->xres_virtual < vinfo->xres ||
-	    (disp->flags & DISPLAY_DBUF && vinfo->yres_virtual < vinfo->yres * 2) ||
-	    vinfo->yres_virtual < vinfo->yres) {
+	if ((disp->flags & DISPLAY_DBUF) && !can_pan(dfb)) {
+		log_debug("device %s cannot pan, drawing into a shadow buffer", dfb->node);
+		disp->flags &= ~DISPLAY_DBUF;
+		vinfo->yoffset = 0;
+		vinfo->yres_virtual = vinfo->yres;
+		vinfo->activate = FB_ACTIVATE_NOW | FB_ACTIVATE_FORCE;
+		if (ioctl(dfb->fd, FBIOPUT_VSCREENINFO, vinfo))
+			log_debug("cannot shrink virtual framebuffer (%d): %m", errno);
+		ret = refresh_info(disp);
+		if (ret)
+			goto err_close;
+	}
+
+	if (vinfo->xres_virtual < vinfo->xres || vinfo->yres_virtual < vinfo->yres) {
 		log_warning("device %s has weird virtual buffer sizes (%d %d %d %d)", dfb->node,
 			    vinfo->xres, vinfo->xres_virtual, vinfo->yres, vinfo->yres_virtual);
 	}
@@ -285,6 +353,13 @@ static int display_activate_force(struct uterm_display *disp, bool force)
 		len *= 2;
 
 	dfb->map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, dfb->fd, 0);
+	if (dfb->map == MAP_FAILED && (disp->flags & DISPLAY_DBUF)) {
+		log_debug("cannot mmap both buffers of %s, drawing into a shadow buffer",
+			  dfb->node);
+		disp->flags &= ~DISPLAY_DBUF;
+		len /= 2;
+		dfb->map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, dfb->fd, 0);
+	}
 	if (dfb->map == MAP_FAILED) {
 		log_error("cannot mmap device %s (%d): %m", dfb->node, errno);
 		ret = -EFAULT;
@@ -308,6 +383,7 @@ static int display_activate_force(struct uterm_display *disp, bool force)
 	dfb->dither_g = 0;
 	dfb->dither_b = 0;
 	dfb->xrgb32 = false;
+	dfb->rgb24 = false;
 	dfb->rgb16 = false;
 	if (dfb->len_r == 8 && dfb->len_g == 8 && dfb->len_b == 8 && dfb->off_r == 16 &&
 	    dfb->off_g == 8 && dfb->off_b == 0 && dfb->Bpp == 4)
@@ -319,8 +395,21 @@ static int display_activate_force(struct uterm_display *disp, bool force)
 		 dfb->off_g == 8 && dfb->off_b == 0 && dfb->Bpp == 3)
 		dfb->rgb24 = true;
 
+	/* both buffers would be read back when restoring cells */
+	if ((disp->flags & DISPLAY_DBUF) &&
+	    uterm_video_use_shadow(disp->video, dfb->node, &dfb->map[len / 2], len / 2)) {
+		log_debug("device %s has slow memory, drawing into a shadow buffer", dfb->node);
+		disp->flags &= ~DISPLAY_DBUF;
+	}
+
+	if (disp->flags & DISPLAY_DBUF)
+		log_debug("enable double buffering");
+	else
+		init_shadow(disp);
+
 	/* TODO: make dithering configurable */
 	disp->flags |= DISPLAY_DITHERING;
+	uterm_fbdev_display_setup_blend(disp);
 	disp->width = dfb->xres;
 	disp->height = dfb->yres;
 
@@ -344,6 +433,10 @@ static void display_deactivate_force(struct uterm_display *disp, bool force)
 		close(dfb->fd);
 		dfb->map = NULL;
 	}
+	free(dfb->shadow);
+	dfb->shadow = NULL;
+	dfb->damage_set = false;
+	disp->flags &= ~DISPLAY_DAMAGE;
 	if (!force) {
 		disp->width = 0;
 		disp->height = 0;
@@ -391,8 +484,11 @@ static int display_swap(struct uterm_display *disp)
 	struct fb_var_screeninfo *vinfo;
 	int ret;
 
-	if (!(disp->flags & DISPLAY_DBUF))
+	if (!(disp->flags & DISPLAY_DBUF)) {
+		uterm_fbdev_display_flush(disp);
+		disp->flags &= ~DISPLAY_NEED_REDRAW;
 		return display_schedule_vblank_timer(dfb);
+	}
 
 	vinfo = &dfb->vinfo;
 	vinfo->activate = FB_ACTIVATE_VBL;
@@ -402,16 +498,48 @@ static int display_swap(struct uterm_display *disp)
 	else
 		vinfo->yoffset = 0;
 
-	ret = ioctl(dfb->fd, FBIOPUT_VSCREENINFO, vinfo);
+	ret = ioctl(dfb->fd, FBIOPAN_DISPLAY, vinfo);
 	if (ret) {
-		log_warning("cannot swap buffers on %s (%d): %m", dfb->node, errno);
-		return -EFAULT;
+		log_warning("cannot pan display %s (%d): %m, drawing into a shadow buffer",
+			    dfb->node, errno);
+		stop_panning(disp);
+		return display_schedule_vblank_timer(dfb);
 	}
 
 	dfb->bufid ^= 1;
+	disp->flags &= ~DISPLAY_NEED_REDRAW;
 	return display_schedule_vblank_timer(dfb);
 }
 
+static void display_set_damage(struct uterm_display *disp, size_t n_rect,
+			       struct uterm_video_rect *damages)
+{
+	struct fbdev_display *dfb = disp->data;
+	struct uterm_video_rect *rects;
+
+	dfb->damage_set = false;
+	if (!dfb->shadow || !n_rect)
+		return;
+
+	if (n_rect > dfb->damage_size) {
+		rects = realloc(dfb->damage, n_rect * sizeof(*rects));
+		if (!rects)
+			return;
+		dfb->damage = rects;
+		dfb->damage_size = n_rect;
+	}
+	memcpy(dfb->damage, damages, n_rect * sizeof(*damages));
+	dfb->damage_len = n_rect;
+	dfb->damage_set = true;
+}
+
+static bool display_has_damage(struct uterm_display *disp)
+{
+	struct fbdev_display *dfb = disp->data;
+
+	return dfb->damage_set;
+}
+
 static bool display_is_swapping(struct uterm_display *disp)
 {
 	struct fbdev_display *fbdev = disp->data;
@@ -419,6 +547,23 @@ static bool display_is_swapping(struct uterm_display *disp)
 	return fbdev->vblank_scheduled;
 }
 
+static int display_get_buffer_age(struct uterm_display *disp)
+{
+	return (disp->flags & DISPLAY_DBUF) ? 2 : 1;
+}
+
+/* the mapping holds both buffers with double-buffering */
+static int display_get_memory(struct uterm_display *disp, struct uterm_display_memory *out)
+{
+	struct fbdev_display *dfb = disp->data;
+
+	out->buffers = (disp->flags & DISPLAY_DBUF) ? 2 : 1;
+	out->bytes = dfb->len;
+	if (dfb->shadow)
+		out->shadow = (uint64_t)dfb->stride * dfb->yres;
+	return 0;
+}
+
 static const struct display_ops fbdev_display_ops = {
 	.init = display_init,
 	.destroy = display_destroy,
@@ -428,8 +573,14 @@ static const struct display_ops fbdev_display_ops = {
 	.is_swapping = display_is_swapping,
 	.fake_blendv = uterm_fbdev_display_fake_blendv,
 	.clear = uterm_fbdev_display_clear,
-	.set_damage = NULL,
-	.has_damage = NULL,
+	.fake_move = uterm_fbdev_display_fake_move,
+	.fake_copyv = uterm_fbdev_display_fake_copyv,
+	.fake_readv = uterm_fbdev_display_fake_readv,
+	.set_damage = display_set_damage,
+	.has_damage = display_has_damage,
+	.get_buffer_age = display_get_buffer_age,
+	.export_frame = uterm_fbdev_display_export_frame,
+	.get_memory = display_get_memory,
 };
 
 static void intro_idle_event(struct ev_eloop *eloop, void *unused, void *data)
@@ -36,6 +36,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "eloop.h"
 #include "shl_dlist.h"
@@ -47,6 +48,9 @@
 
 #define LOG_SUBSYSTEM "uterm_input"
 
+/* input_events read at once, enough for several frames of a fast mouse */
+#define UTERM_INPUT_NEVENTS 64
+
 /* How many longs are needed to hold \n bits. */
 #define NLONGS(n) (((n) + LONG_BIT - 1) / LONG_BIT)
 
@@ -75,7 +79,7 @@ static void notify_event(struct uterm_input_dev *dev, uint16_t type, uint16_t co
 static void input_data_dev(struct ev_fd *fd, int mask, void *data)
 {
 	struct uterm_input_dev *dev = data;
-	struct input_event ev[16];
+	struct input_event ev[UTERM_INPUT_NEVENTS];
 	ssize_t len, n;
 	int i;
 
@@ -100,8 +104,11 @@ static void input_data_dev(struct ev_fd *fd, int mask, void *data)
 			log_warn("invalid input_event on %s", dev->node);
 		} else {
 			n = len / sizeof(*ev);
-			for (i = 0; i < n; i++)
+			for (i = 0; i < n; i++) {
+				dev->event.time = ev[i].input_event_sec * 1000000ULL +
+						  ev[i].input_event_usec;
 				notify_event(dev, ev[i].type, ev[i].code, ev[i].value);
+			}
 		}
 	}
 }
@@ -134,7 +141,7 @@ static int input_wake_up_abs(struct uterm_input_dev *dev)
 
 static int input_wake_up_dev(struct uterm_input_dev *dev)
 {
-	int ret;
+	int ret, clk;
 
 	if (dev->rfd >= 0)
 		return 0;
@@ -144,14 +151,19 @@ static int input_wake_up_dev(struct uterm_input_dev *dev)
 		log_warn("cannot open device %s (%d): %m", dev->node, errno);
 		return -EFAULT;
 	}
+	/* stamp events with the clock of page-flips and timers */
+	clk = CLOCK_MONOTONIC;
+	if (ioctl(dev->rfd, EVIOCSCLOCKID, &clk))
+		log_debug("cannot use monotonic timestamps on %s (%d): %m", dev->node, errno);
 	if (dev->capabilities & UTERM_DEVICE_HAS_KEYS)
 		uxkb_dev_wake_up(dev);
 
 	if (dev->capabilities & UTERM_DEVICE_HAS_ABS)
 		input_wake_up_abs(dev);
 
-	ret = ev_eloop_new_fd(dev->input->eloop, &dev->fd, dev->rfd, EV_READABLE, input_data_dev,
-			      dev);
+	/* keys are handled before a flooding pty or page-flips */
+	ret = ev_eloop_new_fd(dev->input->eloop, &dev->fd, dev->rfd, EV_READABLE | EV_PRIO_HIGH,
+			      input_data_dev, dev);
 	if (ret) {
 		close(dev->rfd);
 		dev->rfd = -1;
@@ -54,6 +54,7 @@ enum uterm_input_modifier {
 
 struct uterm_input_key_event {
 	bool handled;	   /* user-controlled, default is false */
+	uint64_t time;	   /* CLOCK_MONOTONIC usecs of the key press, 0 if unknown */
 	uint16_t keycode;  /* linux keycode - KEY_* - linux/input.h */
 	uint32_t ascii;	   /* ascii keysym for @keycode */
 	unsigned int mods; /* active modifiers - uterm_modifier mask */
@@ -95,6 +96,7 @@ int uterm_input_new(struct uterm_input **out, struct ev_eloop *eloop, const char
 		    size_t compose_file_len, unsigned int repeat_delay, unsigned int repeat_rate,
 		    bool mouse_enabled);
 void uterm_input_ref(struct uterm_input *input);
+int uterm_input_set_keymap_cache(const char *dir);
 void uterm_input_unref(struct uterm_input *input);
 
 void uterm_input_add_dev(struct uterm_input *input, const char *node);
@@ -82,6 +82,11 @@ struct uterm_input_pointer {
 
 	/* Track which button is currently pressed (BUTTON_NONE=none, 0=left, 1=right, 2=middle) */
 	uint8_t pressed_button;
+
+	/* motion of the current frame is not sent yet */
+	bool moved;
+	/* event time the inactivity timer was last armed at */
+	uint64_t armed_time;
 };
 
 struct uterm_input_dev {
@@ -115,6 +120,8 @@ struct uterm_input {
 	unsigned int repeat_delay;
 
 	struct shl_hook *key_hook;
+	/* shared by all inputs with the same arguments, see uxkb_desc_init() */
+	struct uxkb_desc *desc;
 	struct xkb_context *ctx;
 	struct xkb_keymap *keymap;
 	struct xkb_compose_table *compose_table;
@@ -6,10 +6,26 @@
 #include "uterm_input.h"
 #include "uterm_input_internal.h"
 
+/*
+ * Pointer Frames
+ * Devices report motion as separate X and Y events that are closed by EV_SYN.
+ * Motion only updates the position and a single UTERM_MOVED is sent per frame
+ * right before UTERM_SYNC. Buttons and the wheel flush pending motion first,
+ * so users see the same order of positions and clicks as before.
+ */
+
+/* re-arming the inactivity timer at most once a second is precise enough */
+#define POINTER_REARM_USEC 1000000ULL
+
 static void pointer_update_inactivity_timer(struct uterm_input_dev *dev)
 {
 	struct itimerspec spec;
 
+	if (dev->pointer.armed_time &&
+	    dev->event.time - dev->pointer.armed_time < POINTER_REARM_USEC)
+		return;
+	dev->pointer.armed_time = dev->event.time;
+
 	spec.it_interval.tv_nsec = 0;
 	spec.it_interval.tv_sec = 0;
 	spec.it_value.tv_nsec = 0;
@@ -37,10 +53,21 @@ static void pointer_dev_send_move(struct uterm_input_dev *dev)
 	shl_hook_call(dev->input->pointer_hook, dev->input, &pev);
 }
 
+static void pointer_dev_flush_move(struct uterm_input_dev *dev)
+{
+	if (!dev->pointer.moved)
+		return;
+
+	dev->pointer.moved = false;
+	pointer_dev_send_move(dev);
+}
+
 static void pointer_dev_send_wheel(struct uterm_input_dev *dev, int32_t value)
 {
 	struct uterm_input_pointer_event pev = {0};
 
+	pointer_dev_flush_move(dev);
+
 	pev.event = UTERM_WHEEL;
 	pev.wheel = value;
 
@@ -52,6 +79,7 @@ static void pointer_dev_send_button(struct uterm_input_dev *dev, uint8_t button,
 {
 	struct uterm_input_pointer_event pev = {0};
 
+	pointer_dev_flush_move(dev);
 	pev.event = UTERM_BUTTON;
 	pev.button = button;
 	pev.pressed = pressed;
@@ -64,6 +92,7 @@ void pointer_dev_sync(struct uterm_input_dev *dev)
 {
 	struct uterm_input_pointer_event pev = {0};
 
+	pointer_dev_flush_move(dev);
 	pev.event = UTERM_SYNC;
 
 	shl_hook_call(dev->input->pointer_hook, dev->input, &pev);
@@ -79,7 +108,7 @@ void pointer_dev_rel(struct uterm_input_dev *dev, uint16_t code, int32_t value)
 			dev->pointer.x = 0;
 		if (dev->pointer.x > dev->input->pointer_max_x)
 			dev->pointer.x = dev->input->pointer_max_x;
-		pointer_dev_send_move(dev);
+		dev->pointer.moved = true;
 		break;
 	case REL_Y:
 		dev->pointer.y += value;
@@ -87,7 +116,7 @@ void pointer_dev_rel(struct uterm_input_dev *dev, uint16_t code, int32_t value)
 			dev->pointer.y = 0;
 		if (dev->pointer.y > dev->input->pointer_max_y)
 			dev->pointer.y = dev->input->pointer_max_y;
-		pointer_dev_send_move(dev);
+		dev->pointer.moved = true;
 		break;
 	case REL_WHEEL:
 		pointer_dev_send_wheel(dev, value);
@@ -126,7 +155,7 @@ static void pointer_dev_abs_x(struct uterm_input_dev *dev, int32_t value)
 	default:
 		return;
 	}
-	pointer_dev_send_move(dev);
+	dev->pointer.moved = true;
 }
 
 static void pointer_dev_abs_y(struct uterm_input_dev *dev, int32_t value)
@@ -158,7 +187,7 @@ static void pointer_dev_abs_y(struct uterm_input_dev *dev, int32_t value)
 	default:
 		return;
 	}
-	pointer_dev_send_move(dev);
+	dev->pointer.moved = true;
 }
 
 void pointer_dev_abs(struct uterm_input_dev *dev, uint16_t code, int32_t value)
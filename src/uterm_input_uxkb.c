@@ -25,14 +25,19 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/input.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xkbcommon/xkbcommon-compose.h>
 #include <xkbcommon/xkbcommon.h>
+#include "shl_dlist.h"
 #include "shl_hook.h"
 #include "shl_log.h"
 #include "shl_misc.h"
@@ -69,11 +74,311 @@ static void uxkb_log(struct xkb_context *context, enum xkb_log_level level, cons
 	log_submit(LOG_DEFAULT, sev, format, args);
 }
 
-int uxkb_desc_init(struct uterm_input *input, const char *model, const char *layout,
-		   const char *variant, const char *options, const char *locale, const char *keymap,
-		   const char *compose_file, size_t compose_file_len)
+/*
+ * Keyboard Descriptions
+ * Compiling a keymap from RMLVO names resolves the rules and reads dozens of
+ * files from the XKB data directory, which is a measurable part of startup on
+ * slow boards. So all inputs created with the same arguments share one
+ * description, and keymaps compiled from names are saved as text in the cache
+ * directory set with uterm_input_set_keymap_cache(). Parsing that text on the
+ * next start skips the rules and include lookups.
+ * xkbcommon does not count references atomically, so descriptions are only
+ * shared between inputs of the same thread. Each thread has its own list and
+ * inputs are destroyed on the thread that created them.
+ */
+
+struct uxkb_desc {
+	struct shl_dlist list;
+	unsigned long ref;
+	char *key;
+	size_t key_len;
+
+	struct xkb_context *ctx;
+	struct xkb_keymap *keymap;
+	struct xkb_compose_table *compose_table;
+};
+
+static __thread struct shl_dlist desc_list;
+static char *keymap_dir;
+
+#define KEYMAP_MAGIC "KMSXKBMP"
+#define KEYMAP_MAX_SIZE (4 * 1024 * 1024)
+
+struct keymap_header {
+	char magic[8];
+	uint64_t key;
+	uint32_t size;
+	uint32_t pad;
+};
+
+/**
+ * uterm_input_set_keymap_cache:
+ * @dir: Directory for compiled keymaps or NULL to disable them
+ *
+ * Sets the directory keymaps compiled from RMLVO names are saved to and loaded
+ * from. This only affects inputs created afterwards. The directory is created
+ * on first save.
+ *
+ * Returns: 0 on success, negative error code on failure.
+ */
+SHL_EXPORT
+int uterm_input_set_keymap_cache(const char *dir)
+{
+	char *copy = NULL;
+
+	if (dir && *dir) {
+		copy = strdup(dir);
+		if (!copy)
+			return -ENOMEM;
+	}
+
+	free(keymap_dir);
+	keymap_dir = copy;
+	return 0;
+}
+
+/* append @str to @buf, NULL and "" differ as xkbcommon treats them apart */
+static size_t key_append(char *buf, size_t off, const char *str, size_t len)
+{
+	if (buf) {
+		buf[off] = str ? 1 : 0;
+		if (str)
+			memcpy(&buf[off + 1], str, len);
+		memcpy(&buf[off + 1 + len], &len, sizeof(len));
+	}
+
+	return off + 1 + len + sizeof(len);
+}
+
+static size_t desc_key(char *buf, const char **strs, size_t num, const char *compose_file,
+		       size_t compose_file_len)
+{
+	size_t i, off = 0;
+
+	for (i = 0; i < num; ++i)
+		off = key_append(buf, off, strs[i], strs[i] ? strlen(strs[i]) : 0);
+
+	return key_append(buf, off, compose_file, compose_file ? compose_file_len : 0);
+}
+
+static void desc_unref(struct uxkb_desc *desc)
+{
+	if (!desc || !desc->ref || --desc->ref)
+		return;
+
+	shl_dlist_unlink(&desc->list);
+	xkb_compose_table_unref(desc->compose_table);
+	xkb_keymap_unref(desc->keymap);
+	xkb_context_unref(desc->ctx);
+	free(desc->key);
+	free(desc);
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static uint64_t fnv1a_str(uint64_t h, const char *str)
+{
+	if (!str)
+		return fnv1a(h, "", 1);
+	h = fnv1a(h, "s", 1);
+	return fnv1a(h, str, strlen(str) + 1);
+}
+
+/*
+ * The names and the defaults xkbcommon fills missing names with, plus the
+ * state of the rules and symbols in every include path, so installing another
+ * xkeyboard-config or changing the environment compiles the keymap again.
+ */
+static uint64_t keymap_key(struct xkb_context *ctx, const struct xkb_rule_names *rmlvo)
+{
+	static const char *const env[] = {
+		"XKB_DEFAULT_RULES", "XKB_DEFAULT_MODEL", "XKB_DEFAULT_LAYOUT",
+		"XKB_DEFAULT_VARIANT", "XKB_DEFAULT_OPTIONS",
+	};
+	static const char *const subdirs[] = {"rules", "keycodes", "types", "compat", "symbols"};
+	char path[PATH_MAX];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned int i, j, num;
+	struct stat st;
+
+	h = fnv1a_str(h, rmlvo->rules);
+	h = fnv1a_str(h, rmlvo->model);
+	h = fnv1a_str(h, rmlvo->layout);
+	h = fnv1a_str(h, rmlvo->variant);
+	h = fnv1a_str(h, rmlvo->options);
+	for (i = 0; i < sizeof(env) / sizeof(*env); ++i)
+		h = fnv1a_str(h, getenv(env[i]));
+
+	num = xkb_context_num_include_paths(ctx);
+	for (i = 0; i < num; ++i) {
+		h = fnv1a_str(h, xkb_context_include_path_get(ctx, i));
+		for (j = 0; j < sizeof(subdirs) / sizeof(*subdirs); ++j) {
+			snprintf(path, sizeof(path), "%s/%s", xkb_context_include_path_get(ctx, i),
+				 subdirs[j]);
+			if (stat(path, &st))
+				continue;
+			h = fnv1a(h, &st.st_dev, sizeof(st.st_dev));
+			h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+			h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+		}
+	}
+
+	return h ? h : 1;
+}
+
+static void keymap_path(char *buf, size_t size, uint64_t key, const char *suffix)
+{
+	snprintf(buf, size, "%s/%016" PRIx64 ".xkb%s", keymap_dir, key, suffix);
+}
+
+static struct xkb_keymap *keymap_load(struct xkb_context *ctx, uint64_t key)
+{
+	char path[PATH_MAX];
+	struct keymap_header hdr;
+	struct xkb_keymap *keymap;
+	char *text;
+	FILE *f;
+
+	keymap_path(path, sizeof(path), key, "");
+	f = fopen(path, "rbe");
+	if (!f) {
+		if (errno != ENOENT)
+			log_warning("cannot open keymap cache %s (%d): %m", path, errno);
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, KEYMAP_MAGIC, sizeof(hdr.magic)) || hdr.key != key || !hdr.size ||
+	    hdr.size > KEYMAP_MAX_SIZE) {
+		log_warning("ignoring invalid keymap cache %s", path);
+		fclose(f);
+		return NULL;
+	}
+
+	text = malloc(hdr.size + 1);
+	if (!text) {
+		fclose(f);
+		return NULL;
+	}
+
+	if (fread(text, hdr.size, 1, f) != 1) {
+		log_warning("ignoring truncated keymap cache %s", path);
+		free(text);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	text[hdr.size] = 0;
+
+	keymap = xkb_keymap_new_from_string(ctx, text, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+	free(text);
+	if (!keymap) {
+		log_warning("cannot parse keymap cache %s", path);
+		return NULL;
+	}
+
+	log_debug("loaded keymap from %s", path);
+	return keymap;
+}
+
+/* write to a temporary file first so a crash never leaves a partial keymap */
+static void keymap_save(struct xkb_keymap *keymap, uint64_t key)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct keymap_header hdr;
+	char *text;
+	size_t len;
+	FILE *f;
+	int fd;
+
+	text = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (!text)
+		return;
+
+	len = strlen(text);
+	if (!len || len > KEYMAP_MAX_SIZE)
+		goto out;
+
+	if (mkdir(keymap_dir, 0755) && errno != EEXIST) {
+		log_warning("cannot create keymap cache directory %s (%d): %m", keymap_dir,
+			    errno);
+		goto out;
+	}
+
+	keymap_path(path, sizeof(path), key, "");
+	keymap_path(tmp, sizeof(tmp), key, ".tmp");
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_warning("cannot create keymap cache %s (%d): %m", tmp, errno);
+		goto out;
+	}
+
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		goto err_unlink;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, KEYMAP_MAGIC, sizeof(hdr.magic));
+	hdr.key = key;
+	hdr.size = len;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(text, len, 1, f);
+
+	if (ferror(f) | fclose(f)) {
+		log_warning("cannot write keymap cache %s", tmp);
+		goto err_unlink;
+	}
+
+	if (rename(tmp, path)) {
+		log_warning("cannot rename keymap cache %s (%d): %m", tmp, errno);
+		goto err_unlink;
+	}
+
+	log_debug("saved keymap to %s", path);
+	goto out;
+
+err_unlink:
+	unlink(tmp);
+out:
+	free(text);
+}
+
+static struct xkb_keymap *keymap_new_from_names(struct xkb_context *ctx,
+						const struct xkb_rule_names *rmlvo)
+{
+	struct xkb_keymap *keymap;
+	uint64_t key = 0;
+
+	if (keymap_dir) {
+		key = keymap_key(ctx, rmlvo);
+		keymap = keymap_load(ctx, key);
+		if (keymap)
+			return keymap;
+	}
+
+	keymap = xkb_keymap_new_from_names(ctx, rmlvo, 0);
+	if (keymap && keymap_dir)
+		keymap_save(keymap, key);
+
+	return keymap;
+}
+
+static int desc_new(struct uxkb_desc *desc, const char *model, const char *layout,
+		    const char *variant, const char *options, const char *locale,
+		    const char *keymap, const char *compose_file, size_t compose_file_len)
 {
-	int ret;
 	struct xkb_rule_names rmlvo = {
 		.rules = "evdev",
 		.model = model,
@@ -85,8 +390,8 @@ int uxkb_desc_init(struct uterm_input *input, const char *model, const char *lay
 
 	fallback = _binary_uterm_input_fallback_xkb_start;
 
-	input->ctx = xkb_context_new(0);
-	if (!input->ctx) {
+	desc->ctx = xkb_context_new(0);
+	if (!desc->ctx) {
 		log_error("cannot create XKB context");
 		return -ENOMEM;
 	}
@@ -94,24 +399,24 @@ int uxkb_desc_init(struct uterm_input *input, const char *model, const char *lay
 	/* Set logging function. You can use XKB_LOG_VERBOSITY and XKB_LOG_LEVEL
 	 * to change the xkbcommon logger. That's why we don't touch the
 	 * verbosity and level here. */
-	xkb_context_set_log_fn(input->ctx, uxkb_log);
+	xkb_context_set_log_fn(desc->ctx, uxkb_log);
 
 	/* If a complete keymap file was given, first try that. */
 	if (keymap && *keymap) {
-		input->keymap = xkb_keymap_new_from_string(input->ctx, keymap,
-							   XKB_KEYMAP_FORMAT_TEXT_V1, 0);
-		if (input->keymap) {
+		desc->keymap = xkb_keymap_new_from_string(desc->ctx, keymap,
+							  XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+		if (desc->keymap) {
 			log_debug("new keyboard description from memory");
 		} else {
 			log_warn("cannot parse keymap, reverting to rmlvo");
 		}
 	}
 
-	if (!input->keymap) {
-		input->keymap = xkb_keymap_new_from_names(input->ctx, &rmlvo, 0);
+	if (!desc->keymap) {
+		desc->keymap = keymap_new_from_names(desc->ctx, &rmlvo);
 	}
 
-	if (!input->keymap) {
+	if (!desc->keymap) {
 		log_warn("failed to create keymap (%s, %s, %s, %s), "
 			 "reverting to default system keymap",
 			 model, layout, variant, options);
@@ -121,17 +426,17 @@ int uxkb_desc_init(struct uterm_input *input, const char *model, const char *lay
 		rmlvo.variant = "";
 		rmlvo.options = "";
 
-		input->keymap = xkb_keymap_new_from_names(input->ctx, &rmlvo, 0);
-		if (!input->keymap) {
+		desc->keymap = keymap_new_from_names(desc->ctx, &rmlvo);
+		if (!desc->keymap) {
 			log_warn("failed to create XKB default keymap, "
 				 "reverting to built-in fallback");
 
-			input->keymap = xkb_keymap_new_from_string(input->ctx, fallback,
-								   XKB_KEYMAP_FORMAT_TEXT_V1, 0);
-			if (!input->keymap) {
+			desc->keymap = xkb_keymap_new_from_string(desc->ctx, fallback,
+								  XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+			if (!desc->keymap) {
 				log_error("cannot create fallback keymap");
-				ret = -EFAULT;
-				goto err_ctx;
+				xkb_context_unref(desc->ctx);
+				return -EFAULT;
 			}
 		}
 
@@ -142,11 +447,11 @@ int uxkb_desc_init(struct uterm_input *input, const char *model, const char *lay
 	}
 
 	if (compose_file && *compose_file) {
-		input->compose_table = xkb_compose_table_new_from_buffer(
-			input->ctx, compose_file, compose_file_len, locale,
+		desc->compose_table = xkb_compose_table_new_from_buffer(
+			desc->ctx, compose_file, compose_file_len, locale,
 			XKB_COMPOSE_FORMAT_TEXT_V1, 0);
 
-		if (input->compose_table) {
+		if (desc->compose_table) {
 			log_debug("new compose table from memory");
 		} else {
 			log_warn("cannot parse compose table, "
@@ -154,26 +459,81 @@ int uxkb_desc_init(struct uterm_input *input, const char *model, const char *lay
 		}
 	}
 
-	if (!input->compose_table) {
-		input->compose_table = xkb_compose_table_new_from_locale(input->ctx, locale, 0);
-		if (!input->compose_table) {
+	if (!desc->compose_table) {
+		desc->compose_table = xkb_compose_table_new_from_locale(desc->ctx, locale, 0);
+		if (!desc->compose_table) {
 			log_warn("failed to create XKB default compose "
 				 "table, disabling compose support");
 		}
 	}
 
 	return 0;
+}
+
+int uxkb_desc_init(struct uterm_input *input, const char *model, const char *layout,
+		   const char *variant, const char *options, const char *locale, const char *keymap,
+		   const char *compose_file, size_t compose_file_len)
+{
+	const char *strs[] = {model, layout, variant, options, locale, keymap};
+	struct shl_dlist *iter;
+	struct uxkb_desc *desc;
+	char *key;
+	size_t len;
+	int ret;
+
+	len = desc_key(NULL, strs, sizeof(strs) / sizeof(*strs), compose_file, compose_file_len);
+	key = malloc(len);
+	if (!key)
+		return -ENOMEM;
+	desc_key(key, strs, sizeof(strs) / sizeof(*strs), compose_file, compose_file_len);
+
+	if (!desc_list.next)
+		shl_dlist_init(&desc_list);
+
+	shl_dlist_for_each(iter, &desc_list) {
+		desc = shl_dlist_entry(iter, struct uxkb_desc, list);
+		if (desc->key_len == len && !memcmp(desc->key, key, len)) {
+			log_debug("sharing keyboard description %p", desc);
+			free(key);
+			++desc->ref;
+			goto out;
+		}
+	}
+
+	desc = malloc(sizeof(*desc));
+	if (!desc) {
+		ret = -ENOMEM;
+		goto err_key;
+	}
+	memset(desc, 0, sizeof(*desc));
+	desc->ref = 1;
+	desc->key = key;
+	desc->key_len = len;
+
+	ret = desc_new(desc, model, layout, variant, options, locale, keymap, compose_file,
+		       compose_file_len);
+	if (ret)
+		goto err_desc;
+
+	shl_dlist_link(&desc_list, &desc->list);
+
+out:
+	input->desc = desc;
+	input->ctx = desc->ctx;
+	input->keymap = desc->keymap;
+	input->compose_table = desc->compose_table;
+	return 0;
 
-err_ctx:
-	xkb_context_unref(input->ctx);
+err_desc:
+	free(desc);
+err_key:
+	free(key);
 	return ret;
 }
 
 void uxkb_desc_destroy(struct uterm_input *input)
 {
-	xkb_compose_table_unref(input->compose_table);
-	xkb_keymap_unref(input->keymap);
-	xkb_context_unref(input->ctx);
+	desc_unref(input->desc);
 }
 
 static void timer_event(struct ev_timer *timer, uint64_t num, void *data)
@@ -191,6 +551,8 @@ int uxkb_dev_init(struct uterm_input_dev *dev)
 	ret = ev_eloop_new_timer(dev->input->eloop, &dev->repeat_timer, NULL, timer_event, dev);
 	if (ret)
 		return ret;
+	/* repeated keys are input just like the device fd */
+	ev_timer_set_prio(dev->repeat_timer, EV_PRIO_HIGH);
 
 	dev->state = xkb_state_new(dev->input->keymap);
 	if (!dev->state) {
@@ -0,0 +1,565 @@
+/*
+ * uterm - Linux User-Space Terminal memory module
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Memory Video backend
+ * A headless display for benchmarks and tests. Frames are drawn into an XRGB32
+ * buffer in system RAM and the damage is copied to a second buffer that stands
+ * in for the screen on swap, like fbdev does with a shadow buffer. A timer
+ * simulates the vblank of the refresh rate.
+ *
+ * The node is the mode as "<width>x<height>[@<hz>]". Without a size, the
+ * desired mode of the device is used, or 1024x768. A rate of 0 completes the
+ * page-flips on the next dispatch, so rendering is not throttled.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eloop.h"
+#include "shl_log.h"
+#include "shl_misc.h"
+#include "shl_timer.h"
+#include "uterm_video.h"
+#include "uterm_video_internal.h"
+
+#define LOG_SUBSYSTEM "video_memory"
+
+#define MEMORY_WIDTH 1024
+#define MEMORY_HEIGHT 768
+#define MEMORY_RATE 60
+
+struct memory_display {
+	unsigned int stride;
+	uint8_t *back;
+	uint8_t *front;
+
+	struct uterm_video_rect *damage;
+	size_t damage_len;
+	size_t damage_size;
+	bool damage_set;
+
+	unsigned long frames;
+	bool vblank_scheduled;
+	struct itimerspec vblank_spec;
+	struct ev_timer *vblank_timer;
+};
+
+struct memory_video {
+	char *node;
+	unsigned int width;
+	unsigned int height;
+	unsigned int rate;
+	bool pending_intro;
+};
+
+static void display_vblank_timer_event(struct ev_timer *timer, uint64_t expirations, void *data)
+{
+	struct uterm_display *disp = data;
+	struct memory_display *mem = disp->data;
+	uint64_t now = shl_timer_now();
+
+	mem->vblank_scheduled = false;
+	disp->vblank_time = now;
+	DISPLAY_CB_AT(disp, UTERM_PAGE_FLIP, now);
+}
+
+static int display_init(struct uterm_display *disp)
+{
+	struct memory_display *mem;
+	int ret;
+
+	mem = malloc(sizeof(*mem));
+	if (!mem)
+		return -ENOMEM;
+	memset(mem, 0, sizeof(*mem));
+	disp->data = mem;
+	disp->dpms = UTERM_DPMS_UNKNOWN;
+	/* uterm_blend_xrgb32v() only writes the pixels of the requests */
+	disp->flags |= DISPLAY_THREADED_BLEND;
+
+	ret = ev_timer_new(&mem->vblank_timer, NULL, display_vblank_timer_event, disp);
+	if (ret)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	free(mem);
+	return ret;
+}
+
+static void display_destroy(struct uterm_display *disp)
+{
+	struct memory_display *mem = disp->data;
+
+	ev_eloop_rm_timer(mem->vblank_timer);
+	ev_timer_unref(mem->vblank_timer);
+	free(mem->back);
+	free(mem->front);
+	free(mem->damage);
+	free(mem);
+}
+
+static int display_activate(struct uterm_display *disp)
+{
+	struct uterm_video *video = disp->video;
+	struct memory_video *vmem = video->data;
+	struct memory_display *mem = disp->data;
+	unsigned int width = vmem->width, height = vmem->height;
+	size_t len;
+
+	if (disp->flags & DISPLAY_ONLINE)
+		return 0;
+
+	if (!width || !height) {
+		width = video->desired_width ? video->desired_width : MEMORY_WIDTH;
+		height = video->desired_height ? video->desired_height : MEMORY_HEIGHT;
+	}
+
+	mem->stride = width * 4;
+	len = (size_t)mem->stride * height;
+	mem->back = calloc(1, len);
+	mem->front = calloc(1, len);
+	if (!mem->back || !mem->front) {
+		log_error("cannot allocate %ux%u buffers for %s", width, height, vmem->node);
+		free(mem->back);
+		free(mem->front);
+		mem->back = NULL;
+		mem->front = NULL;
+		return -ENOMEM;
+	}
+
+	log_info("activating display %s to %ux%u at %u Hz", vmem->node, width, height,
+		 vmem->rate);
+
+	memset(&mem->vblank_spec, 0, sizeof(mem->vblank_spec));
+	if (vmem->rate) {
+		disp->vblank_period = 1000000 / vmem->rate;
+		mem->vblank_spec.it_value.tv_sec = disp->vblank_period / 1000000;
+		mem->vblank_spec.it_value.tv_nsec = disp->vblank_period % 1000000 * 1000;
+	} else {
+		mem->vblank_spec.it_value.tv_nsec = 1000;
+		disp->vblank_period = 0;
+	}
+
+	mem->frames = 0;
+	mem->damage_set = false;
+	disp->vblank_time = 0;
+	disp->width = width;
+	disp->height = height;
+	disp->flags |= DISPLAY_ONLINE | DISPLAY_DAMAGE;
+	return 0;
+}
+
+static void display_deactivate(struct uterm_display *disp)
+{
+	struct memory_display *mem = disp->data;
+
+	if (!(disp->flags & DISPLAY_ONLINE))
+		return;
+
+	log_info("deactivating display %s", disp->name);
+
+	if (mem->vblank_scheduled) {
+		mem->vblank_scheduled = false;
+		ev_timer_update(mem->vblank_timer, NULL);
+	}
+	free(mem->back);
+	free(mem->front);
+	mem->back = NULL;
+	mem->front = NULL;
+	mem->damage_set = false;
+	disp->width = 0;
+	disp->height = 0;
+	disp->flags &= ~(DISPLAY_ONLINE | DISPLAY_DAMAGE);
+}
+
+static int display_set_dpms(struct uterm_display *disp, int state)
+{
+	switch (state) {
+	case UTERM_DPMS_ON:
+	case UTERM_DPMS_STANDBY:
+	case UTERM_DPMS_SUSPEND:
+	case UTERM_DPMS_OFF:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	disp->dpms = state;
+	return 0;
+}
+
+static int display_swap(struct uterm_display *disp)
+{
+	struct memory_display *mem = disp->data;
+	struct uterm_video_rect all = {0, 0, disp->width, disp->height};
+	int ret;
+
+	if (mem->vblank_scheduled && !disp->video->mailbox)
+		return -EBUSY;
+
+	if (mem->damage_set)
+		uterm_blend_copy_rects(mem->front, mem->stride, mem->back, mem->stride, 4,
+				       disp->width, disp->height, mem->damage, mem->damage_len);
+	else
+		uterm_blend_copy_rects(mem->front, mem->stride, mem->back, mem->stride, 4,
+				       disp->width, disp->height, &all, 1);
+	mem->damage_set = false;
+	++mem->frames;
+	disp->flags &= ~DISPLAY_NEED_REDRAW;
+
+	if (mem->vblank_scheduled)
+		return 0;
+
+	ret = ev_timer_update(mem->vblank_timer, &mem->vblank_spec);
+	if (ret)
+		return ret;
+
+	mem->vblank_scheduled = true;
+	return 0;
+}
+
+static bool display_is_swapping(struct uterm_display *disp)
+{
+	struct memory_display *mem = disp->data;
+
+	return mem->vblank_scheduled;
+}
+
+static int display_fake_blendv(struct uterm_display *disp,
+			       const struct uterm_video_blend_req *req, size_t num)
+{
+	struct memory_display *mem = disp->data;
+
+	if (!req)
+		return -EINVAL;
+
+	return uterm_blend_xrgb32v(disp, mem->back, mem->stride, disp->width, disp->height, req,
+				   num);
+}
+
+static int display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
+{
+	struct memory_display *mem = disp->data;
+
+	uterm_blend_fill_xrgb32(mem->back, mem->stride, disp->width, disp->height,
+				(r << 16) | (g << 8) | b);
+	return 0;
+}
+
+static int display_fake_move(struct uterm_display *disp, unsigned int src_y, unsigned int dst_y,
+			     unsigned int height)
+{
+	struct memory_display *mem = disp->data;
+	unsigned int sh = disp->height;
+
+	if (src_y > sh || dst_y > sh || height > sh - src_y || height > sh - dst_y)
+		return -EINVAL;
+
+	memmove(mem->back + (size_t)dst_y * mem->stride, mem->back + (size_t)src_y * mem->stride,
+		(size_t)height * mem->stride);
+	return 0;
+}
+
+/* the back buffer always holds the last frame */
+static int display_fake_copyv(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			      size_t num)
+{
+	return 0;
+}
+
+static int display_fake_readv(struct uterm_display *disp, uint8_t *dst, unsigned int stride,
+			      const struct uterm_video_rect *rects, size_t num)
+{
+	struct memory_display *mem = disp->data;
+
+	uterm_blend_copy_rects(dst, stride, mem->back, mem->stride, 4, disp->width, disp->height,
+			       rects, num);
+	return 0;
+}
+
+static void display_set_damage(struct uterm_display *disp, size_t n_rect,
+			       struct uterm_video_rect *damages)
+{
+	struct memory_display *mem = disp->data;
+	struct uterm_video_rect *rects;
+
+	mem->damage_set = false;
+	if (!n_rect)
+		return;
+
+	if (n_rect > mem->damage_size) {
+		rects = realloc(mem->damage, n_rect * sizeof(*rects));
+		if (!rects)
+			return;
+		mem->damage = rects;
+		mem->damage_size = n_rect;
+	}
+	memcpy(mem->damage, damages, n_rect * sizeof(*damages));
+	mem->damage_len = n_rect;
+	mem->damage_set = true;
+}
+
+static bool display_has_damage(struct uterm_display *disp)
+{
+	struct memory_display *mem = disp->data;
+
+	return mem->damage_set;
+}
+
+static int display_get_buffer_age(struct uterm_display *disp)
+{
+	return 1;
+}
+
+static int display_export_frame(struct uterm_display *disp, struct uterm_video_export *out)
+{
+	struct memory_display *mem = disp->data;
+
+	if (!mem->frames)
+		return -ENOENT;
+
+	return uterm_video_export_copy(out, mem->front, mem->stride, disp->width, disp->height);
+}
+
+static const struct display_ops memory_display_ops = {
+	.init = display_init,
+	.destroy = display_destroy,
+	.set_dpms = display_set_dpms,
+	.use = NULL,
+	.swap = display_swap,
+	.is_swapping = display_is_swapping,
+	.fake_blendv = display_fake_blendv,
+	.clear = display_clear,
+	.fake_move = display_fake_move,
+	.fake_copyv = display_fake_copyv,
+	.fake_readv = display_fake_readv,
+	.set_damage = display_set_damage,
+	.has_damage = display_has_damage,
+	.get_buffer_age = display_get_buffer_age,
+	.export_frame = display_export_frame,
+};
+
+/**
+ * uterm_memory_checksum:
+ * @disp: display of the memory backend
+ * @out: where to store the checksum
+ *
+ * Hash the frame on screen, that is the one of the last swap, with 64bit
+ * FNV-1a over its pixels. The padding of the X byte is included, so blitters
+ * must write it the same way to get the same sum.
+ *
+ * Returns: 0 on success, -EOPNOTSUPP if @disp is not of this backend or
+ * -EINVAL if it is offline.
+ */
+SHL_EXPORT
+int uterm_memory_checksum(struct uterm_display *disp, uint64_t *out)
+{
+	struct memory_display *mem;
+	const uint32_t *row;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned int x, y;
+
+	if (!disp || !out)
+		return -EINVAL;
+	if (disp->ops != &memory_display_ops)
+		return -EOPNOTSUPP;
+	if (!display_is_online(disp))
+		return -EINVAL;
+
+	mem = disp->data;
+	for (y = 0; y < disp->height; ++y) {
+		row = (const uint32_t *)(mem->front + (size_t)y * mem->stride);
+		for (x = 0; x < disp->width; ++x) {
+			hash ^= row[x];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+
+	*out = hash;
+	return 0;
+}
+
+/* number of frames swapped since the display was activated */
+SHL_EXPORT
+unsigned long uterm_memory_frames(struct uterm_display *disp)
+{
+	struct memory_display *mem;
+
+	if (!disp || disp->ops != &memory_display_ops)
+		return 0;
+
+	mem = disp->data;
+	return mem->frames;
+}
+
+static void intro_idle_event(struct ev_eloop *eloop, void *unused, void *data)
+{
+	struct uterm_video *video = data;
+	struct memory_video *vmem = video->data;
+	struct uterm_display *disp;
+	struct memory_display *mem;
+	int ret;
+
+	vmem->pending_intro = false;
+	ev_eloop_unregister_idle_cb(eloop, intro_idle_event, data, EV_NORMAL);
+
+	ret = display_new(&disp, &memory_display_ops, video, "memory");
+	if (ret) {
+		log_error("cannot create memory display: %d", ret);
+		return;
+	}
+
+	mem = disp->data;
+	ret = ev_eloop_add_timer(video->eloop, mem->vblank_timer);
+	if (ret) {
+		log_error("cannot add memory timer: %d", ret);
+		uterm_display_unref(disp);
+		return;
+	}
+
+	if (video_is_awake(video)) {
+		ret = display_activate(disp);
+		if (ret) {
+			uterm_display_unref(disp);
+			return;
+		}
+	}
+
+	ret = uterm_display_bind(disp);
+	if (ret) {
+		log_error("cannot bind memory display: %d", ret);
+		uterm_display_unref(disp);
+		return;
+	}
+	uterm_display_ready(disp);
+	uterm_display_unref(disp);
+}
+
+static int video_init(struct uterm_video *video, const char *node)
+{
+	struct memory_video *vmem;
+	int ret, n;
+
+	vmem = malloc(sizeof(*vmem));
+	if (!vmem)
+		return -ENOMEM;
+	memset(vmem, 0, sizeof(*vmem));
+	video->data = vmem;
+	vmem->rate = MEMORY_RATE;
+
+	if (node) {
+		n = sscanf(node, "%ux%u@%u", &vmem->width, &vmem->height, &vmem->rate);
+		if (n < 2) {
+			log_error("invalid memory mode %s, expected <width>x<height>[@<hz>]", node);
+			ret = -EINVAL;
+			goto err_free;
+		}
+		if (vmem->rate > 100000) {
+			log_warning("refresh rate of %s is >100 kHz, forcing 60 Hz", node);
+			vmem->rate = MEMORY_RATE;
+		}
+	}
+
+	vmem->node = strdup(node ? node : "memory");
+	if (!vmem->node) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	log_info("new device on %s", vmem->node);
+
+	ret = ev_eloop_register_idle_cb(video->eloop, intro_idle_event, video, EV_NORMAL);
+	if (ret) {
+		log_error("cannot register idle event: %d", ret);
+		goto err_node;
+	}
+	vmem->pending_intro = true;
+
+	return 0;
+
+err_node:
+	free(vmem->node);
+err_free:
+	free(vmem);
+	return ret;
+}
+
+static void video_destroy(struct uterm_video *video)
+{
+	struct memory_video *vmem = video->data;
+
+	log_info("free device on %s", vmem->node);
+
+	if (vmem->pending_intro)
+		ev_eloop_unregister_idle_cb(video->eloop, intro_idle_event, video, EV_NORMAL);
+
+	free(vmem->node);
+	free(vmem);
+}
+
+static void video_sleep(struct uterm_video *video)
+{
+	struct uterm_display *iter;
+	struct shl_dlist *i;
+
+	shl_dlist_for_each(i, &video->displays)
+	{
+		iter = shl_dlist_entry(i, struct uterm_display, list);
+		display_deactivate(iter);
+	}
+}
+
+static int video_wake_up(struct uterm_video *video)
+{
+	struct uterm_display *iter;
+	struct shl_dlist *i;
+	int ret;
+
+	video->flags |= VIDEO_AWAKE;
+	shl_dlist_for_each(i, &video->displays)
+	{
+		iter = shl_dlist_entry(i, struct uterm_display, list);
+
+		ret = display_activate(iter);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+struct uterm_video_module memory_module = {.name = "memory",
+					   .owner = NULL,
+					   .ops = {
+						   .init = video_init,
+						   .destroy = video_destroy,
+						   .poll = NULL,
+						   .sleep = video_sleep,
+						   .wake_up = video_wake_up,
+					   }};
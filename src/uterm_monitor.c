@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include "shl_dlist.h"
 #include "shl_log.h"
@@ -53,6 +54,8 @@ struct uterm_monitor_dev {
 	struct uterm_monitor_seat *seat;
 	unsigned int type;
 	unsigned int flags;
+	dev_t devnum;
+	bool hotplug;
 	char *node;
 	void *data;
 };
@@ -79,6 +82,15 @@ struct uterm_monitor {
 	struct ev_fd *umon_fd;
 
 	struct shl_dlist seats;
+	struct shl_dlist classes;
+};
+
+/* Flags of a GPU, which take opening the node and an ioctl to find out. Kept
+ * until the device is removed, as change events of a device keep coming. */
+struct monitor_class {
+	struct shl_dlist list;
+	dev_t devnum;
+	unsigned int flags;
 };
 
 static void monitor_new_seat(struct uterm_monitor *mon, const char *name);
@@ -193,7 +205,7 @@ static void monitor_sd_deinit(struct uterm_monitor *mon)
 }
 
 static void seat_new_dev(struct uterm_monitor_seat *seat, unsigned int type, unsigned int flags,
-			 const char *node)
+			 dev_t devnum, const char *node)
 {
 	struct uterm_monitor_dev *dev;
 	struct uterm_monitor_event ev;
@@ -205,6 +217,7 @@ static void seat_new_dev(struct uterm_monitor_seat *seat, unsigned int type, uns
 	dev->seat = seat;
 	dev->type = type;
 	dev->flags = flags;
+	dev->devnum = devnum;
 
 	dev->node = strdup(node);
 	if (!dev->node)
@@ -258,13 +271,13 @@ static void seat_free_dev(struct uterm_monitor_dev *dev)
 static struct uterm_monitor_dev *monitor_find_dev(struct uterm_monitor *mon,
 						  struct udev_device *dev)
 {
-	const char *node;
+	dev_t devnum;
 	struct shl_dlist *iter, *iter2;
 	struct uterm_monitor_seat *seat;
 	struct uterm_monitor_dev *sdev;
 
-	node = udev_device_get_devnode(dev);
-	if (!node)
+	devnum = udev_device_get_devnum(dev);
+	if (!devnum)
 		return NULL;
 
 	shl_dlist_for_each(iter, &mon->seats)
@@ -273,7 +286,7 @@ static struct uterm_monitor_dev *monitor_find_dev(struct uterm_monitor *mon,
 		shl_dlist_for_each(iter2, &seat->devices)
 		{
 			sdev = shl_dlist_entry(iter2, struct uterm_monitor_dev, list);
-			if (!strcmp(node, sdev->node))
+			if (sdev->devnum == devnum)
 				return sdev;
 		}
 	}
@@ -551,6 +564,60 @@ static unsigned int get_drm_flags(struct uterm_monitor *mon, struct udev_device
 	return flags;
 }
 
+static struct monitor_class *monitor_find_class(struct uterm_monitor *mon, dev_t devnum)
+{
+	struct shl_dlist *iter;
+	struct monitor_class *class;
+
+	shl_dlist_for_each(iter, &mon->classes)
+	{
+		class = shl_dlist_entry(iter, struct monitor_class, list);
+		if (class->devnum == devnum)
+			return class;
+	}
+
+	return NULL;
+}
+
+static unsigned int get_dev_flags(struct uterm_monitor *mon, struct udev_device *dev,
+				  unsigned int type, dev_t devnum, const char *node)
+{
+	struct monitor_class *class;
+	unsigned int flags;
+
+	if (type == UTERM_MONITOR_INPUT)
+		return 0;
+
+	class = monitor_find_class(mon, devnum);
+	if (class)
+		return class->flags;
+
+	if (type == UTERM_MONITOR_DRM)
+		flags = get_drm_flags(mon, dev, node);
+	else
+		flags = get_fbdev_flags(mon, node);
+
+	class = malloc(sizeof(*class));
+	if (class) {
+		class->devnum = devnum;
+		class->flags = flags;
+		shl_dlist_link(&mon->classes, &class->list);
+	}
+
+	return flags;
+}
+
+static void monitor_forget_class(struct uterm_monitor *mon, struct udev_device *dev)
+{
+	struct monitor_class *class;
+
+	class = monitor_find_class(mon, udev_device_get_devnum(dev));
+	if (class) {
+		shl_dlist_unlink(&class->list);
+		free(class);
+	}
+}
+
 static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 {
 	const char *sname, *subs, *node, *name, *sysname;
@@ -559,6 +626,7 @@ static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 	unsigned int type, flags;
 	int id;
 	struct udev_device *p;
+	dev_t devnum;
 
 	name = udev_device_get_syspath(dev);
 	if (!name) {
@@ -572,7 +640,8 @@ static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 	}
 
 	node = udev_device_get_devnode(dev);
-	if (!node)
+	devnum = udev_device_get_devnum(dev);
+	if (!node || !devnum)
 		return;
 
 	subs = udev_device_get_subsystem(dev);
@@ -593,7 +662,6 @@ static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 		}
 		sname = udev_device_get_property_value(dev, "ID_SEAT");
 		type = UTERM_MONITOR_DRM;
-		flags = get_drm_flags(mon, dev, node);
 	} else if (!strcmp(subs, "graphics")) {
 		if (mon->sd && udev_device_has_tag(dev, "seat") != 1) {
 			log_debug("adding non-seat'ed device %s", name);
@@ -606,7 +674,6 @@ static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 		}
 		sname = udev_device_get_property_value(dev, "ID_SEAT");
 		type = UTERM_MONITOR_FBDEV;
-		flags = get_fbdev_flags(mon, node);
 	} else if (!strcmp(subs, "input")) {
 		sysname = udev_device_get_sysname(dev);
 		if (!sysname || strncmp(sysname, "event", 5)) {
@@ -624,7 +691,6 @@ static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 		}
 		sname = udev_device_get_property_value(p, "ID_SEAT");
 		type = UTERM_MONITOR_INPUT;
-		flags = 0;
 	} else {
 		log_debug("adding device with unknown subsystem %s (%s)", subs, name);
 		return;
@@ -646,13 +712,17 @@ static void monitor_udev_add(struct uterm_monitor *mon, struct udev_device *dev)
 		return;
 	}
 
-	seat_new_dev(seat, type, flags, node);
+	/* only probe devices of our seats */
+	flags = get_dev_flags(mon, dev, type, devnum, node);
+	seat_new_dev(seat, type, flags, devnum, node);
 }
 
 static void monitor_udev_remove(struct uterm_monitor *mon, struct udev_device *dev)
 {
 	struct uterm_monitor_dev *sdev;
 
+	monitor_forget_class(mon, dev);
+
 	sdev = monitor_find_dev(mon, dev);
 	if (!sdev) {
 		log_debug("removing unknown device");
@@ -666,7 +736,6 @@ static void monitor_udev_change(struct uterm_monitor *mon, struct udev_device *d
 {
 	const char *sname, *val;
 	struct uterm_monitor_dev *sdev;
-	struct uterm_monitor_event ev;
 
 	sdev = monitor_find_dev(mon, dev);
 	if (sdev) {
@@ -680,27 +749,63 @@ static void monitor_udev_change(struct uterm_monitor *mon, struct udev_device *d
 			return;
 		}
 
-		/* DRM devices send hotplug events; catch them here */
+		/* DRM devices send hotplug events; catch them here and
+		 * report them once the queue is drained */
 		val = udev_device_get_property_value(dev, "HOTPLUG");
-		if (val && !strcmp(val, "1")) {
+		if (val && !strcmp(val, "1"))
+			sdev->hotplug = true;
+	} else {
+		/* Unknown device; maybe it switched into a known seat? Try
+		 * adding it as new device. If that fails, we ignore it */
+		monitor_udev_add(mon, dev);
+	}
+}
+
+/* reports a burst of hotplug events of a device as a single one */
+static void monitor_flush_hotplug(struct uterm_monitor *mon)
+{
+	struct shl_dlist *iter, *iter2, *tmp;
+	struct uterm_monitor_seat *seat;
+	struct uterm_monitor_dev *sdev;
+	struct uterm_monitor_event ev;
+
+	shl_dlist_for_each(iter, &mon->seats)
+	{
+		seat = shl_dlist_entry(iter, struct uterm_monitor_seat, list);
+		shl_dlist_for_each_safe(iter2, tmp, &seat->devices)
+		{
+			sdev = shl_dlist_entry(iter2, struct uterm_monitor_dev, list);
+			if (!sdev->hotplug)
+				continue;
+			sdev->hotplug = false;
+
 			memset(&ev, 0, sizeof(ev));
 			ev.type = UTERM_MONITOR_HOTPLUG_DEV;
-			ev.seat = sdev->seat;
-			ev.seat_name = sdev->seat->name;
-			ev.seat_data = sdev->seat->data;
+			ev.seat = seat;
+			ev.seat_name = seat->name;
+			ev.seat_data = seat->data;
 			ev.dev = sdev;
 			ev.dev_type = sdev->type;
 			ev.dev_node = sdev->node;
 			ev.dev_data = sdev->data;
-			sdev->seat->mon->cb(sdev->seat->mon, &ev, sdev->seat->mon->data);
+			mon->cb(mon, &ev, mon->data);
 		}
-	} else {
-		/* Unknown device; maybe it switched into a known seat? Try
-		 * adding it as new device. If that fails, we ignore it */
-		monitor_udev_add(mon, dev);
 	}
 }
 
+/* input devices other than evdev nodes are never added, skip them early */
+static bool monitor_ignore(struct udev_device *dev)
+{
+	const char *subs, *sysname;
+
+	subs = udev_device_get_subsystem(dev);
+	if (!subs || strcmp(subs, "input"))
+		return false;
+
+	sysname = udev_device_get_sysname(dev);
+	return !sysname || strncmp(sysname, "event", 5);
+}
+
 static void monitor_udev_event(struct ev_fd *fd, int mask, void *data)
 {
 	struct uterm_monitor *mon = data;
@@ -726,10 +831,10 @@ static void monitor_udev_event(struct ev_fd *fd, int mask, void *data)
 		/* we use non-blocking udev monitor so ignore errors */
 		dev = udev_monitor_receive_device(mon->umon);
 		if (!dev)
-			return;
+			break;
 
 		action = udev_device_get_action(dev);
-		if (action) {
+		if (action && !monitor_ignore(dev)) {
 			if (!strcmp(action, "add"))
 				monitor_udev_add(mon, dev);
 			else if (!strcmp(action, "remove"))
@@ -740,6 +845,8 @@ static void monitor_udev_event(struct ev_fd *fd, int mask, void *data)
 
 		udev_device_unref(dev);
 	}
+
+	monitor_flush_hotplug(mon);
 }
 
 SHL_EXPORT
@@ -761,6 +868,7 @@ int uterm_monitor_new(struct uterm_monitor **out, struct ev_eloop *eloop, uterm_
 	mon->cb = cb;
 	mon->data = data;
 	shl_dlist_init(&mon->seats);
+	shl_dlist_init(&mon->classes);
 
 	/* Monitor seats if VT is disabled */
 	if (!vt) {
@@ -869,6 +977,7 @@ SHL_EXPORT
 void uterm_monitor_unref(struct uterm_monitor *mon)
 {
 	struct uterm_monitor_seat *seat;
+	struct monitor_class *class;
 
 	if (!mon || !mon->ref || --mon->ref)
 		return;
@@ -878,6 +987,12 @@ void uterm_monitor_unref(struct uterm_monitor *mon)
 		monitor_free_seat(seat);
 	}
 
+	while (mon->classes.next != &mon->classes) {
+		class = shl_dlist_entry(mon->classes.next, struct monitor_class, list);
+		shl_dlist_unlink(&class->list);
+		free(class);
+	}
+
 	ev_eloop_rm_fd(mon->umon_fd);
 	udev_monitor_unref(mon->umon);
 	udev_unref(mon->udev);
@@ -29,10 +29,12 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include "eloop.h"
 #include "shl_dlist.h"
@@ -41,11 +43,30 @@
 #include "shl_misc.h"
 #include "shl_module.h"
 #include "shl_register.h"
+#include "shl_timer.h"
 #include "uterm_video.h"
 #include "uterm_video_internal.h"
 
 #define LOG_SUBSYSTEM "video"
 
+/* more damage rects per frame than this are copied as the whole frame */
+#define UTERM_MIRROR_RECTS_MAX 128
+
+struct uterm_mirror {
+	uint8_t *map;
+	unsigned int stride;
+	unsigned int width;
+	unsigned int height;
+	uterm_mirror_cb cb;
+	void *data;
+
+	/* damage of the next frame, or the whole frame if @full */
+	bool full;
+	bool damaged;
+	size_t len;
+	struct uterm_video_rect rects[UTERM_MIRROR_RECTS_MAX];
+};
+
 static struct shl_register video_reg = SHL_REGISTER_INIT(video_reg);
 
 static inline void uterm_video_destroy(void *data)
@@ -88,6 +109,8 @@ int display_new(struct uterm_display **out, const struct display_ops *ops,
 	disp->name = strdup(name);
 	disp->ref = 1;
 	disp->ops = ops;
+	pthread_mutex_init(&disp->blend_lut_lock, NULL);
+	shl_dlist_init(&disp->blend_luts);
 	log_info("new display %s %p", disp->name, disp);
 	disp->video = video;
 
@@ -127,6 +150,9 @@ void uterm_display_unref(struct uterm_display *disp)
 	log_info("free display %s %p", disp->name, disp);
 
 	VIDEO_CALL(disp->ops->destroy, 0, disp);
+	uterm_blend_flush_luts(disp);
+	pthread_mutex_destroy(&disp->blend_lut_lock);
+	free(disp->mirror);
 	shl_hook_free(disp->hook);
 	free(disp->name);
 	free(disp);
@@ -183,6 +209,13 @@ bool uterm_display_supports_damage(struct uterm_display *disp)
 	return (disp->flags & DISPLAY_DAMAGE) != 0;
 }
 
+/* fake_blendv() may run on several threads at once, for requests that don't overlap */
+SHL_EXPORT
+bool uterm_display_supports_threaded_blend(struct uterm_display *disp)
+{
+	return (disp->flags & DISPLAY_THREADED_BLEND) != 0;
+}
+
 SHL_EXPORT
 const char *uterm_display_backend_name(struct uterm_display *disp)
 {
@@ -199,6 +232,26 @@ const char *uterm_display_name(struct uterm_display *disp)
 	return "Unknown";
 }
 
+/* the shader cache directory of the video device, or NULL */
+SHL_EXPORT
+const char *uterm_display_get_shader_cache(struct uterm_display *disp)
+{
+	if (!disp || !disp->video)
+		return NULL;
+
+	return disp->video->shader_cache;
+}
+
+/* driver and model of the GPU of the display, or NULL if unknown */
+SHL_EXPORT
+const char *uterm_display_get_gpu(struct uterm_display *disp)
+{
+	if (!disp || !disp->video || !disp->video->gpu[0])
+		return NULL;
+
+	return disp->video->gpu;
+}
+
 SHL_EXPORT
 struct uterm_display *uterm_display_next(struct uterm_display *disp)
 {
@@ -284,13 +337,76 @@ int uterm_display_use(struct uterm_display *disp)
 	return VIDEO_CALL(disp->ops->use, -EOPNOTSUPP, disp);
 }
 
+static void mirror_add_damage(struct uterm_mirror *mirror, size_t num,
+			      const struct uterm_video_rect *rects)
+{
+	mirror->damaged = true;
+	if (!num || num > UTERM_MIRROR_RECTS_MAX - mirror->len) {
+		mirror->full = true;
+		return;
+	}
+
+	memcpy(&mirror->rects[mirror->len], rects, num * sizeof(*rects));
+	mirror->len += num;
+}
+
+/*
+ * Copy the damage of the frame that is about to be swapped into the mirror.
+ * Frames without damage info are copied as a whole. If the display changed
+ * its size, the mirror is dropped and its owner told so with no rects; it may
+ * set a new mirror from the callback, which then gets this frame.
+ */
+static void mirror_copy(struct uterm_display *disp)
+{
+	struct uterm_mirror *mirror = disp->mirror;
+	struct uterm_video_rect all = {0, 0, disp->width, disp->height};
+
+	if (mirror->width != disp->width || mirror->height != disp->height) {
+		disp->mirror = NULL;
+		mirror->cb(disp, NULL, 0, mirror->data);
+		free(mirror);
+		mirror = disp->mirror;
+		if (!mirror)
+			return;
+	}
+
+	if (disp->flags & DISPLAY_NEED_REDRAW || !mirror->damaged)
+		mirror->full = true;
+	if (mirror->full) {
+		mirror->rects[0] = all;
+		mirror->len = 1;
+	}
+
+	disp->ops->fake_readv(disp, mirror->map, mirror->stride, mirror->rects, mirror->len);
+}
+
+static void mirror_done(struct uterm_display *disp)
+{
+	struct uterm_mirror *mirror = disp->mirror;
+	size_t len = mirror->len;
+
+	mirror->full = false;
+	mirror->damaged = false;
+	mirror->len = 0;
+	mirror->cb(disp, mirror->rects, len, mirror->data);
+}
+
 SHL_EXPORT
 int uterm_display_swap(struct uterm_display *disp)
 {
+	int ret;
+
 	if (!disp || !display_is_online(disp) || !video_is_awake(disp->video))
 		return -EINVAL;
 
-	return VIDEO_CALL(disp->ops->swap, 0, disp);
+	if (disp->mirror)
+		mirror_copy(disp);
+
+	/* a frame that wasn't swapped is copied again with the next one */
+	ret = VIDEO_CALL(disp->ops->swap, 0, disp);
+	if (!ret && disp->mirror)
+		mirror_done(disp);
+	return ret;
 }
 
 SHL_EXPORT
@@ -321,6 +437,49 @@ int uterm_display_fake_blendv(struct uterm_display *disp, const struct uterm_vid
 	return VIDEO_CALL(disp->ops->fake_blendv, -EOPNOTSUPP, disp, req, num);
 }
 
+/*
+ * Copy @height scanlines of the frame that is currently shown, starting at
+ * @src_y, to @dst_y of the frame that is drawn next. This lets renderers
+ * scroll the screen without blending the moved content again.
+ */
+SHL_EXPORT
+int uterm_display_fake_move(struct uterm_display *disp, unsigned int src_y, unsigned int dst_y,
+			    unsigned int height)
+{
+	if (!disp || !display_is_online(disp) || !video_is_awake(disp->video))
+		return -EINVAL;
+
+	return VIDEO_CALL(disp->ops->fake_move, -EOPNOTSUPP, disp, src_y, dst_y, height);
+}
+
+/*
+ * Copy @rects from the frame that was drawn last to the same place in the
+ * frame that is drawn next, so renderers can bring a stale back buffer up to
+ * date without blending again. Call it with @num 0 to check for support.
+ */
+SHL_EXPORT
+int uterm_display_fake_copyv(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			     size_t num)
+{
+	if (!disp || !display_is_online(disp) || !video_is_awake(disp->video))
+		return -EINVAL;
+
+	return VIDEO_CALL(disp->ops->fake_copyv, -EOPNOTSUPP, disp, rects, num);
+}
+
+/*
+ * Wait until the drawing of the back buffer is done, for backends that draw
+ * on the GPU. The others are done when their drawing calls return.
+ */
+SHL_EXPORT
+int uterm_display_finish(struct uterm_display *disp)
+{
+	if (!disp || !display_is_online(disp) || !video_is_awake(disp->video))
+		return -EINVAL;
+
+	return VIDEO_CALL(disp->ops->finish, 0, disp);
+}
+
 SHL_EXPORT
 void uterm_display_set_need_redraw(struct uterm_display *disp)
 {
@@ -394,6 +553,8 @@ void uterm_display_set_damage(struct uterm_display *disp, size_t n_rect,
 		return;
 
 	VIDEO_CALL(disp->ops->set_damage, 0, disp, n_rect, damages);
+	if (disp->mirror)
+		mirror_add_damage(disp->mirror, n_rect, damages);
 }
 
 SHL_EXPORT
@@ -405,10 +566,252 @@ bool uterm_display_has_damage(struct uterm_display *disp)
 	return VIDEO_CALL(disp->ops->has_damage, 0, disp);
 }
 
+SHL_EXPORT
+int uterm_display_get_buffer_age(struct uterm_display *disp)
+{
+	if (!disp || !display_is_online(disp) || !video_is_awake(disp->video))
+		return 0;
+
+	return VIDEO_CALL(disp->ops->get_buffer_age, 0, disp);
+}
+
+/*
+ * Predict the first vblank after @now from the last page-flip and the refresh
+ * rate of the mode. Both are CLOCK_MONOTONIC in microseconds. Returns 0 if it
+ * can't be predicted, like on fbdev, before the first flip or with variable
+ * refresh rate, where the display waits for the next frame instead.
+ */
+SHL_EXPORT
+uint64_t uterm_display_next_vblank(struct uterm_display *disp, uint64_t now)
+{
+	uint64_t n;
+
+	if (!disp || !display_is_online(disp) || !disp->vblank_period || !disp->vblank_time)
+		return 0;
+
+	if (now < disp->vblank_time)
+		return disp->vblank_time;
+
+	n = (now - disp->vblank_time) / disp->vblank_period + 1;
+	return disp->vblank_time + n * disp->vblank_period;
+}
+
+/*
+ * Keep the frame that was swapped last, so it can be shown again with a
+ * page-flip instead of being drawn again, like when switching back to a
+ * session. The frame holds a reference to @disp until it is shown or dropped.
+ * Returns -EOPNOTSUPP if the backend cannot keep frames.
+ */
+SHL_EXPORT
+int uterm_display_keep_frame(struct uterm_display *disp, struct uterm_frame **out)
+{
+	struct uterm_frame *frame;
+	int ret;
+
+	if (!disp || !out || !display_is_online(disp) || !video_is_awake(disp->video))
+		return -EINVAL;
+	if (!disp->ops->keep_frame)
+		return -EOPNOTSUPP;
+
+	frame = malloc(sizeof(*frame));
+	if (!frame)
+		return -ENOMEM;
+	memset(frame, 0, sizeof(*frame));
+	frame->disp = disp;
+
+	ret = disp->ops->keep_frame(disp, frame);
+	if (ret) {
+		free(frame);
+		return ret;
+	}
+
+	uterm_display_ref(disp);
+	*out = frame;
+	return 0;
+}
+
+/*
+ * Flip to @frame, which makes it the last frame of @disp, so renderers go on
+ * from it. @frame is released, unless this returns -EBUSY because a page-flip
+ * is pending. Then try again after the page-flip event.
+ */
+SHL_EXPORT
+int uterm_display_show_frame(struct uterm_display *disp, struct uterm_frame *frame)
+{
+	int ret;
+
+	if (!disp || !frame || frame->disp != disp)
+		return -EINVAL;
+
+	if (!display_is_online(disp) || !video_is_awake(disp->video))
+		ret = -EINVAL;
+	else
+		ret = disp->ops->show_frame(disp, frame);
+	if (ret == -EBUSY)
+		return ret;
+
+	/* the frame was never drawn, so the mirror needs all of the next one */
+	if (!ret && disp->mirror)
+		disp->mirror->full = true;
+	if (ret)
+		disp->ops->drop_frame(disp, frame);
+	free(frame);
+	uterm_display_unref(disp);
+	return ret;
+}
+
+SHL_EXPORT
+void uterm_display_drop_frame(struct uterm_display *disp, struct uterm_frame *frame)
+{
+	if (!disp || !frame || frame->disp != disp)
+		return;
+
+	disp->ops->drop_frame(disp, frame);
+	free(frame);
+	uterm_display_unref(disp);
+}
+
+SHL_EXPORT
+uint64_t uterm_frame_get_size(const struct uterm_frame *frame)
+{
+	return frame ? frame->size : 0;
+}
+
+/*
+ * Hand out the last swapped frame of @disp, like for screenshots. Backends
+ * with dma-bufs export the buffer itself, so nothing is read back; it is only
+ * valid until the display draws into it again, which is after the next
+ * page-flip at the earliest. Others copy the frame into a memfd. Returns
+ * -EOPNOTSUPP if the backend can do neither, -ENOENT before the first frame.
+ */
+SHL_EXPORT
+int uterm_display_export_frame(struct uterm_display *disp, struct uterm_video_export *out)
+{
+	if (!disp || !out || !display_is_online(disp) || !video_is_awake(disp->video))
+		return -EINVAL;
+
+	memset(out, 0, sizeof(*out));
+	out->fd = -1;
+	return VIDEO_CALL(disp->ops->export_frame, -EOPNOTSUPP, disp, out);
+}
+
+/*
+ * Tell how much memory the buffers of @disp take, for the memory report.
+ * Returns -EOPNOTSUPP if the backend doesn't know, like with EGL surfaces.
+ */
+SHL_EXPORT
+int uterm_display_get_memory(struct uterm_display *disp, struct uterm_display_memory *out)
+{
+	if (!disp || !out || !display_is_online(disp))
+		return -EINVAL;
+
+	memset(out, 0, sizeof(*out));
+	return VIDEO_CALL(disp->ops->get_memory, -EOPNOTSUPP, disp, out);
+}
+
+/* for backends without dma-bufs, copy an XRGB8888 frame into a new memfd */
+int uterm_video_export_copy(struct uterm_video_export *out, const uint8_t *src,
+			    unsigned int stride, unsigned int width, unsigned int height)
+{
+	size_t size = (size_t)stride * height;
+	ssize_t len;
+	int fd;
+
+	fd = memfd_create("uterm-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -errno;
+
+	len = write(fd, src, size);
+	if (len < 0 || (size_t)len != size) {
+		close(fd);
+		return len < 0 ? -errno : -EIO;
+	}
+
+	/* it's a copy, so whoever gets it may read it but not change it */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+	out->fd = fd;
+	out->dmabuf = false;
+	out->width = width;
+	out->height = height;
+	out->stride = stride;
+	out->offset = 0;
+	out->format = UTERM_FOURCC_XRGB8888;
+	out->modifier = 0;
+	return 0;
+}
+
+/*
+ * Copy each frame of @disp into @map when it is swapped, which holds a frame
+ * of the current size of @disp as XRGB32 with @stride bytes per line. Only the
+ * damage is copied, except for the first frame. @cb is called after each swap
+ * with the rects that changed. If the size of @disp changes, the mirror is
+ * dropped and @cb is called without rects. A NULL @map drops the mirror.
+ * Returns -EOPNOTSUPP if the backend cannot read its frames back.
+ */
+SHL_EXPORT
+int uterm_display_set_mirror(struct uterm_display *disp, uint8_t *map, unsigned int stride,
+			     uterm_mirror_cb cb, void *data)
+{
+	struct uterm_mirror *mirror;
+	int ret;
+
+	if (!disp)
+		return -EINVAL;
+
+	if (!map) {
+		free(disp->mirror);
+		disp->mirror = NULL;
+		return 0;
+	}
+
+	if (!cb || !display_is_online(disp) || stride < disp->width * 4)
+		return -EINVAL;
+	if (!disp->ops->fake_readv)
+		return -EOPNOTSUPP;
+
+	/* some backends can only read back some formats */
+	ret = disp->ops->fake_readv(disp, map, stride, NULL, 0);
+	if (ret)
+		return ret;
+
+	mirror = malloc(sizeof(*mirror));
+	if (!mirror)
+		return -ENOMEM;
+	memset(mirror, 0, sizeof(*mirror));
+	mirror->map = map;
+	mirror->stride = stride;
+	mirror->width = disp->width;
+	mirror->height = disp->height;
+	mirror->cb = cb;
+	mirror->data = data;
+	mirror->full = true;
+
+	free(disp->mirror);
+	disp->mirror = mirror;
+	return 0;
+}
+
 SHL_EXPORT
 int uterm_video_new(struct uterm_video **out, struct ev_eloop *eloop, const char *node,
 		    const char *backend, unsigned int desired_width, unsigned int desired_height,
 		    bool use_original)
+{
+	return uterm_video_new_offload(out, eloop, node, NULL, backend, desired_width,
+				       desired_height, use_original);
+}
+
+/*
+ * Like uterm_video_new(), but the frames are rendered on the GPU at
+ * @render_node and only scanned out by @node, which imports them as dma-bufs.
+ * This is for USB displays and other devices that can't render themselves.
+ * Backends that don't render on a GPU ignore @render_node.
+ */
+SHL_EXPORT
+int uterm_video_new_offload(struct uterm_video **out, struct ev_eloop *eloop, const char *node,
+			    const char *render_node, const char *backend,
+			    unsigned int desired_width, unsigned int desired_height,
+			    bool use_original)
 {
 	struct shl_register_record *record;
 	const char *name = backend ? backend : "<default>";
@@ -446,9 +849,17 @@ int uterm_video_new(struct uterm_video **out, struct ev_eloop *eloop, const char
 	if (ret)
 		goto err_free;
 
+	if (render_node) {
+		video->render_node = strdup(render_node);
+		if (!video->render_node) {
+			ret = -ENOMEM;
+			goto err_hook;
+		}
+	}
+
 	ret = VIDEO_CALL(video->mod->ops.init, 0, video, node);
 	if (ret)
-		goto err_hook;
+		goto err_render;
 
 	video->desired_width = desired_width;
 	video->desired_height = desired_height;
@@ -458,6 +869,8 @@ int uterm_video_new(struct uterm_video **out, struct ev_eloop *eloop, const char
 	*out = video;
 	return 0;
 
+err_render:
+	free(video->render_node);
 err_hook:
 	shl_hook_free(video->hook);
 err_free:
@@ -495,9 +908,165 @@ void uterm_video_unref(struct uterm_video *video)
 	shl_hook_free(video->hook);
 	ev_eloop_unref(video->eloop);
 	shl_register_record_unref(video->record);
+	free(video->render_node);
+	free(video->shader_cache);
 	free(video);
 }
 
+/*
+ * In mailbox mode, swapping while a page-flip is pending queues the frame
+ * instead of failing with -EBUSY, and a newer frame replaces a queued one. The
+ * backends that can't do this ignore it.
+ */
+SHL_EXPORT
+void uterm_video_set_mailbox(struct uterm_video *video, bool enable)
+{
+	if (!video)
+		return;
+
+	video->mailbox = enable;
+}
+
+/*
+ * Collect the swaps of all displays of an atomic DRM device during one
+ * dispatch and flip them with a single commit. Cloned outputs then flip on the
+ * same vblank and their flip events arrive together. The other backends and
+ * legacy DRM ignore it.
+ */
+SHL_EXPORT
+void uterm_video_set_batch_flips(struct uterm_video *video, bool enable)
+{
+	if (!video)
+		return;
+
+	video->batch_flips = enable;
+}
+
+/*
+ * Let drm2d allocate its framebuffers as linear GBM buffers and draw into them
+ * through their dma-buf, which is faster on drivers that map dumb buffers
+ * uncached. It falls back to dumb buffers if that fails or kmscon was built
+ * without GBM. Like mailbox mode, this applies to framebuffers allocated
+ * afterwards.
+ */
+/*
+ * Set VRR_ENABLED on the CRTCs of atomic DRM displays whose connector is
+ * vrr_capable, so a flip is shown as soon as the frame is ready instead of on
+ * the next fixed vblank. Like mailbox mode, this applies to modesets done
+ * afterwards. The other backends and legacy DRM ignore it.
+ */
+SHL_EXPORT
+void uterm_video_set_vrr(struct uterm_video *video, bool enable)
+{
+	if (!video)
+		return;
+
+	video->vrr = enable;
+}
+
+SHL_EXPORT
+void uterm_video_set_gbm_scanout(struct uterm_video *video, bool enable)
+{
+	if (!video)
+		return;
+
+	video->gbm_scanout = enable;
+}
+
+/*
+ * With UTERM_SHADOW_ON, drm2d and fbdev draw into a shadow buffer in system RAM
+ * and copy only the damage of each frame to the device on swap. With
+ * UTERM_SHADOW_AUTO, the default, they do so if the device memory turns out
+ * to be slow, see uterm_video_use_shadow(). Like mailbox mode, this applies to
+ * framebuffers allocated afterwards.
+ */
+SHL_EXPORT
+void uterm_video_set_shadow(struct uterm_video *video, unsigned int mode)
+{
+	if (!video)
+		return;
+
+	video->shadow = mode;
+}
+
+/*
+ * Save the linked GL programs of drm3d and of renderers drawing on its displays
+ * in @dir and load them from there on the next start, so the shaders are not
+ * compiled again. NULL disables it. Like mailbox mode, this applies to
+ * contexts created afterwards.
+ */
+SHL_EXPORT
+int uterm_video_set_shader_cache(struct uterm_video *video, const char *dir)
+{
+	char *copy = NULL;
+
+	if (!video)
+		return -EINVAL;
+
+	if (dir && *dir) {
+		copy = strdup(dir);
+		if (!copy)
+			return -ENOMEM;
+	}
+
+	free(video->shader_cache);
+	video->shader_cache = copy;
+	return 0;
+}
+
+#define SHADOW_PROBE_SIZE (512 * 1024)
+
+/* write and read back @len bytes of @map, returns the microseconds it took */
+static uint64_t probe_memory(uint8_t *map, size_t len)
+{
+	volatile uint64_t sink;
+	const uint64_t *p = (const uint64_t *)map;
+	uint64_t start, sum = 0;
+	size_t i;
+
+	start = shl_timer_now();
+	memset(map, 0, len);
+	for (i = 0; i < len / sizeof(*p); i += 8)
+		sum += p[i];
+	sink = sum;
+	(void)sink;
+	return shl_timer_now() - start;
+}
+
+/*
+ * Whether a framebuffer mapped at @map should get a shadow buffer. Mappings of
+ * device memory are often uncached, where each read stalls and scattered
+ * writes land as small bursts. In auto mode, a quick write and read of the
+ * start of @map is compared with the same in system RAM. @map must not be on
+ * screen, it is cleared.
+ */
+bool uterm_video_use_shadow(struct uterm_video *video, const char *name, uint8_t *map,
+			    size_t len)
+{
+	uint64_t dev, ram;
+	uint8_t *buf;
+
+	if (video->shadow == UTERM_SHADOW_ON)
+		return true;
+	if (video->shadow == UTERM_SHADOW_OFF)
+		return false;
+
+	len = min(len, (size_t)SHADOW_PROBE_SIZE);
+	buf = malloc(len);
+	if (!buf)
+		return false;
+
+	/* the first touch faults the pages in */
+	memset(buf, 0, len);
+	ram = probe_memory(buf, len);
+	dev = probe_memory(map, len);
+	free(buf);
+
+	log_debug("framebuffer memory of %s: %" PRIu64 " us, system RAM: %" PRIu64 " us", name,
+		  dev, ram);
+	return dev > 4 * ram + 50;
+}
+
 SHL_EXPORT
 struct uterm_display *uterm_video_get_displays(struct uterm_video *video)
 {
@@ -57,6 +57,7 @@
 
 struct uterm_mode;
 struct uterm_display;
+struct uterm_frame;
 struct uterm_video;
 struct uterm_video_module;
 
@@ -75,6 +76,12 @@ enum uterm_display_dpms {
 	UTERM_DPMS_UNKNOWN,
 };
 
+enum uterm_shadow_mode {
+	UTERM_SHADOW_AUTO,
+	UTERM_SHADOW_ON,
+	UTERM_SHADOW_OFF,
+};
+
 enum uterm_video_action {
 	UTERM_WAKE_UP,
 	UTERM_SLEEP,
@@ -94,25 +101,58 @@ enum uterm_display_action {
 
 struct uterm_display_event {
 	int action;
+	uint64_t time; /* CLOCK_MONOTONIC usecs of a page-flip, 0 if unknown */
 };
 
+/* one byte of alpha per pixel */
+#define UTERM_FORMAT_GREY 0x00
+/* one bit per pixel, most significant bit first, set bits are foreground */
+#define UTERM_FORMAT_MONO 0x01
+/* one premultiplied ARGB8888 word per pixel, like color emoji; drawn over the
+ * background, the foreground color is unused */
+#define UTERM_FORMAT_ARGB32 0x02
+
 struct uterm_video_buffer {
 	unsigned int width;
 	unsigned int height;
-	unsigned int stride;
+	unsigned int stride; /* in bytes */
+	unsigned int format;
 	uint8_t data[];
 };
 
+/* bytes used by a row of @buf, the stride may be bigger */
+static inline unsigned int uterm_video_buffer_row_size(const struct uterm_video_buffer *buf)
+{
+	if (buf->format == UTERM_FORMAT_MONO)
+		return (buf->width + 7) / 8;
+	if (buf->format == UTERM_FORMAT_ARGB32)
+		return buf->width * 4;
+	return buf->width;
+}
+
+/* @buf holds XRGB8888 pixels to copy as they are, the colors are unused */
+#define UTERM_BLEND_XRGB32 0x01
+/* fill @width x @height with the background color, @buf is NULL */
+#define UTERM_BLEND_FILL 0x02
+/* blend the @buf_num glyphs of @bufs left to right, @width x @height in total
+ * and all of the same height, @buf is NULL */
+#define UTERM_BLEND_SPAN 0x04
+
 struct uterm_video_blend_req {
 	const struct uterm_video_buffer *buf;
+	const struct uterm_video_buffer *const *bufs; /* of a span */
+	unsigned int buf_num;			      /* of a span */
 	unsigned int x;
 	unsigned int y;
+	unsigned int width;  /* of a fill or span */
+	unsigned int height; /* of a fill or span */
 	uint8_t fr;
 	uint8_t fg;
 	uint8_t fb;
 	uint8_t br;
 	uint8_t bg;
 	uint8_t bb;
+	uint8_t flags;
 };
 
 /*
@@ -129,6 +169,8 @@ typedef void (*uterm_video_cb)(struct uterm_video *video, struct uterm_video_hot
 			       void *data);
 typedef void (*uterm_display_cb)(struct uterm_display *disp, struct uterm_display_event *arg,
 				 void *data);
+typedef void (*uterm_mirror_cb)(struct uterm_display *disp, const struct uterm_video_rect *rects,
+				size_t num, void *data);
 
 /* misc */
 
@@ -141,8 +183,11 @@ void uterm_display_unref(struct uterm_display *disp);
 bool uterm_display_is_drm(struct uterm_display *disp);
 bool uterm_display_has_opengl(struct uterm_display *disp);
 bool uterm_display_supports_damage(struct uterm_display *disp);
+bool uterm_display_supports_threaded_blend(struct uterm_display *disp);
 const char *uterm_display_backend_name(struct uterm_display *disp);
 const char *uterm_display_name(struct uterm_display *disp);
+const char *uterm_display_get_shader_cache(struct uterm_display *disp);
+const char *uterm_display_get_gpu(struct uterm_display *disp);
 struct uterm_display *uterm_display_next(struct uterm_display *disp);
 
 int uterm_display_register_cb(struct uterm_display *disp, uterm_display_cb cb, void *data);
@@ -161,6 +206,7 @@ void uterm_display_set_need_redraw(struct uterm_display *disp);
 bool uterm_display_need_redraw(struct uterm_display *disp);
 
 int uterm_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b);
+int uterm_display_finish(struct uterm_display *disp);
 
 /* cursor interface */
 #define UTERM_CURSOR_MAX_SIZE 64
@@ -173,17 +219,76 @@ void uterm_display_set_cursor_offset(struct uterm_display *disp, int32_t x, int3
 
 int uterm_display_fake_blendv(struct uterm_display *disp, const struct uterm_video_blend_req *req,
 			      size_t num);
+void uterm_blend_to_xrgb32(uint32_t *dst, unsigned int stride,
+			   const struct uterm_video_blend_req *req);
+void uterm_video_buffer_unpack(uint8_t *dst, const struct uterm_video_buffer *buf,
+			       unsigned int row);
+int uterm_display_fake_move(struct uterm_display *disp, unsigned int src_y, unsigned int dst_y,
+			    unsigned int height);
+int uterm_display_fake_copyv(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			     size_t num);
 void uterm_display_set_damage(struct uterm_display *disp, size_t n_rect,
 			      struct uterm_video_rect *damages);
 bool uterm_display_has_damage(struct uterm_display *disp);
+int uterm_display_get_buffer_age(struct uterm_display *disp);
+uint64_t uterm_display_next_vblank(struct uterm_display *disp, uint64_t now);
+
+/* kept frames, to show a frame again without drawing it */
+int uterm_display_keep_frame(struct uterm_display *disp, struct uterm_frame **out);
+int uterm_display_show_frame(struct uterm_display *disp, struct uterm_frame *frame);
+void uterm_display_drop_frame(struct uterm_display *disp, struct uterm_frame *frame);
+uint64_t uterm_frame_get_size(const struct uterm_frame *frame);
+
+/*
+ * The last swapped frame of a display, handed out by
+ * uterm_display_export_frame(). @fd belongs to the caller and is a dma-buf of
+ * the buffer itself, or a memfd with a copy if the backend has no dma-bufs.
+ */
+struct uterm_video_export {
+	int fd;
+	bool dmabuf;
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+	unsigned int offset;
+	uint32_t format;   /* DRM fourcc */
+	uint64_t modifier; /* DRM format modifier */
+};
+
+#define UTERM_FOURCC_XRGB8888 0x34325258 /* DRM_FORMAT_XRGB8888 */
+
+int uterm_display_export_frame(struct uterm_display *disp, struct uterm_video_export *out);
+
+/* memory of the buffers a display draws into, see uterm_display_get_memory() */
+struct uterm_display_memory {
+	unsigned int buffers; /* scanout buffers */
+	uint64_t bytes;	      /* of the scanout buffers */
+	uint64_t shadow;      /* of a shadow buffer in system RAM, 0 without */
+};
+
+int uterm_display_get_memory(struct uterm_display *disp, struct uterm_display_memory *out);
+
+/* mirrors, to copy each frame into memory of the caller */
+int uterm_display_set_mirror(struct uterm_display *disp, uint8_t *map, unsigned int stride,
+			     uterm_mirror_cb cb, void *data);
 
 /* video interface */
 
 int uterm_video_new(struct uterm_video **out, struct ev_eloop *eloop, const char *node,
 		    const char *backend, unsigned int desired_width, unsigned int desired_height,
 		    bool use_original);
+int uterm_video_new_offload(struct uterm_video **out, struct ev_eloop *eloop, const char *node,
+			    const char *render_node, const char *backend,
+			    unsigned int desired_width, unsigned int desired_height,
+			    bool use_original);
 void uterm_video_ref(struct uterm_video *video);
 void uterm_video_unref(struct uterm_video *video);
+void uterm_video_set_mailbox(struct uterm_video *video, bool enable);
+void uterm_video_set_batch_flips(struct uterm_video *video, bool enable);
+void uterm_video_set_vrr(struct uterm_video *video, bool enable);
+void uterm_video_set_gbm_scanout(struct uterm_video *video, bool enable);
+void uterm_video_set_shadow(struct uterm_video *video, unsigned int mode);
+int uterm_video_set_shader_cache(struct uterm_video *video, const char *dir);
 
 struct uterm_display *uterm_video_get_displays(struct uterm_video *video);
 int uterm_video_register_cb(struct uterm_video *video, uterm_video_cb cb, void *data);
@@ -219,4 +324,18 @@ static inline void uterm_register_fbdev(void)
 static inline void uterm_register_fbdev(void) {}
 #endif
 
+#ifdef BUILD_ENABLE_VIDEO_MEMORY
+extern struct uterm_video_module memory_module;
+
+static inline void uterm_register_memory(void)
+{
+	uterm_video_register(&memory_module);
+}
+
+int uterm_memory_checksum(struct uterm_display *disp, uint64_t *out);
+unsigned long uterm_memory_frames(struct uterm_display *disp);
+#else
+static inline void uterm_register_memory(void) {}
+#endif
+
 #endif /* UTERM_UTERM_VIDEO_H */
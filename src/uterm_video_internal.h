@@ -30,6 +30,7 @@
 
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include "eloop.h"
@@ -49,15 +50,28 @@ struct display_ops {
 	int (*fake_blendv)(struct uterm_display *disp, const struct uterm_video_blend_req *req,
 			   size_t num);
 	int (*clear)(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b);
+	int (*fake_move)(struct uterm_display *disp, unsigned int src_y, unsigned int dst_y,
+			 unsigned int height);
+	int (*fake_copyv)(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			  size_t num);
+	int (*fake_readv)(struct uterm_display *disp, uint8_t *dst, unsigned int stride,
+			  const struct uterm_video_rect *rects, size_t num);
 	void (*set_damage)(struct uterm_display *disp, size_t n_rect,
 			   struct uterm_video_rect *damages);
 	bool (*has_damage)(struct uterm_display *disp);
+	int (*get_buffer_age)(struct uterm_display *disp);
 	int (*setup_cursor)(struct uterm_display *disp, const uint32_t *pixels, unsigned int width,
 			    unsigned int height, int hot_x, int hot_y);
 	void (*destroy_cursor)(struct uterm_display *disp);
 	int (*show_cursor)(struct uterm_display *disp, int32_t x, int32_t y);
 	int (*hide_cursor)(struct uterm_display *disp);
 	void (*set_cursor_offset)(struct uterm_display *disp, int32_t x, int32_t y);
+	int (*keep_frame)(struct uterm_display *disp, struct uterm_frame *frame);
+	int (*show_frame)(struct uterm_display *disp, struct uterm_frame *frame);
+	void (*drop_frame)(struct uterm_display *disp, struct uterm_frame *frame);
+	int (*export_frame)(struct uterm_display *disp, struct uterm_video_export *out);
+	int (*get_memory)(struct uterm_display *disp, struct uterm_display_memory *out);
+	int (*finish)(struct uterm_display *disp);
 };
 
 struct video_ops {
@@ -89,6 +103,7 @@ struct uterm_video_module {
 #define DISPLAY_INUSE 0x100
 #define DISPLAY_DAMAGE 0x200
 #define DISPLAY_NEED_REDRAW 0x400
+#define DISPLAY_THREADED_BLEND 0x800
 
 struct uterm_display {
 	char *name;
@@ -103,8 +118,28 @@ struct uterm_display {
 	struct shl_hook *hook;
 	int dpms;
 
+	/* last vblank and the time between two in usecs, 0 if unknown or variable */
+	uint64_t vblank_time;
+	unsigned int vblank_period;
+
 	const struct display_ops *ops;
 	void *data;
+
+	/* blend tables of recent color pairs, see uterm_blend_get_lut() */
+	pthread_mutex_t blend_lut_lock;
+	struct shl_dlist blend_luts;
+	unsigned int blend_lut_num;
+	void (*blend_lut_convert)(struct uterm_display *disp, uint32_t *pix);
+
+	/* copy of each swapped frame, see uterm_display_set_mirror() */
+	struct uterm_mirror *mirror;
+};
+
+/* a frame kept by uterm_display_keep_frame(), @data belongs to the backend */
+struct uterm_frame {
+	struct uterm_display *disp;
+	uint64_t size; /* bytes of the buffer it holds */
+	void *data;
 };
 
 int display_new(struct uterm_display **out, const struct display_ops *ops,
@@ -113,11 +148,13 @@ int uterm_display_bind(struct uterm_display *disp);
 void uterm_display_unbind(struct uterm_display *disp);
 void uterm_display_ready(struct uterm_display *disp);
 
-#define DISPLAY_CB(disp, act)                                                                      \
+#define DISPLAY_CB_AT(disp, act, t)                                                                \
 	shl_hook_call((disp)->hook, (disp),                                                        \
 		      &(struct uterm_display_event){                                               \
 			      .action = (act),                                                     \
+			      .time = (t),                                                         \
 		      })
+#define DISPLAY_CB(disp, act) DISPLAY_CB_AT(disp, act, 0)
 
 static inline bool display_is_online(const struct uterm_display *disp)
 {
@@ -141,11 +178,30 @@ struct uterm_video {
 	bool use_original;
 	unsigned int desired_width;
 	unsigned int desired_height;
+	/* keep a third buffer and replace queued frames with newer ones */
+	bool mailbox;
+	/* flip all displays of the device in a single commit */
+	bool batch_flips;
+	/* enable variable refresh rate on displays that support it */
+	bool vrr;
+	/* allocate dumb-buffer framebuffers as linear GBM buffers */
+	bool gbm_scanout;
+	/* draw into system RAM and copy the damage, see uterm_video_use_shadow() */
+	unsigned int shadow;
+	/* GPU that renders the frames this device scans out, or NULL */
+	char *render_node;
+	/* directory for linked GL programs, or NULL */
+	char *shader_cache;
+	/* driver and model of the GPU, empty if unknown */
+	char gpu[64];
 
 	const struct uterm_video_module *mod;
 	void *data;
 };
 
+bool uterm_video_use_shadow(struct uterm_video *video, const char *name, uint8_t *map,
+			    size_t len);
+
 static inline bool video_is_awake(const struct uterm_video *video)
 {
 	return video->flags & VIDEO_AWAKE;
@@ -162,4 +218,30 @@ static inline bool video_need_hotplug(const struct uterm_video *video)
 			      .display = (disp),                                                   \
 			      .action = (act),                                                     \
 		      })
+
+/* software blending helpers */
+
+void uterm_blend_xrgb32_line(uint32_t *dst, const uint8_t *src, unsigned int width,
+			     const struct uterm_video_blend_req *req);
+void uterm_blend_argb32_line(uint32_t *dst, const uint8_t *src, unsigned int width,
+			     uint32_t bval);
+void uterm_blend_lut(uint32_t *lut, const struct uterm_video_blend_req *req);
+void uterm_blend_fill_xrgb32(uint8_t *map, unsigned int stride, unsigned int width,
+			     unsigned int height, uint32_t val);
+int uterm_blend_xrgb32v(struct uterm_display *disp, uint8_t *map, unsigned int stride,
+			unsigned int sw, unsigned int sh, const struct uterm_video_blend_req *req,
+			size_t num);
+int uterm_video_export_copy(struct uterm_video_export *out, const uint8_t *src,
+			    unsigned int stride, unsigned int width, unsigned int height);
+void uterm_blend_copy_rects(uint8_t *dst, unsigned int dst_stride, const uint8_t *src,
+			    unsigned int src_stride, unsigned int Bpp, unsigned int sw,
+			    unsigned int sh, const struct uterm_video_rect *rects, size_t num);
+
+#define UTERM_BLEND_LUT_MAX 32
+
+const uint32_t *uterm_blend_get_lut(struct uterm_display *disp,
+				    const struct uterm_video_blend_req *req);
+void uterm_blend_put_lut(struct uterm_display *disp, const uint32_t *lut);
+void uterm_blend_flush_luts(struct uterm_display *disp);
+
 #endif /* UTERM_VIDEO_INTERNAL_H */
@@ -752,6 +752,33 @@ static void vt_sigusr2(struct ev_eloop *eloop, struct signalfd_siginfo *info, vo
 		real_sig_leave(vt, info);
 }
 
+/*
+ * Only real VTs use the VT signals. Fake VTs do not register them so seats
+ * with their own eloop on another thread cannot take them from the real VT.
+ */
+static int vt_register_signals(struct uterm_vt *vt)
+{
+	int ret;
+
+	ret = ev_eloop_register_signal_cb(vt->vtm->eloop, SIGUSR1, vt_sigusr1, vt);
+	if (ret)
+		return ret;
+
+	ret = ev_eloop_register_signal_cb(vt->vtm->eloop, SIGUSR2, vt_sigusr2, vt);
+	if (ret) {
+		ev_eloop_unregister_signal_cb(vt->vtm->eloop, SIGUSR1, vt_sigusr1, vt);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void vt_unregister_signals(struct uterm_vt *vt)
+{
+	ev_eloop_unregister_signal_cb(vt->vtm->eloop, SIGUSR2, vt_sigusr2, vt);
+	ev_eloop_unregister_signal_cb(vt->vtm->eloop, SIGUSR1, vt_sigusr1, vt);
+}
+
 static int seat_find_vt(const char *seat, char **out)
 {
 	static const char def_vt[] = "/dev/tty0";
@@ -847,17 +874,9 @@ int uterm_vt_allocate(struct uterm_vt_master *vtm, struct uterm_vt **out,
 	vt->real_num = -1;
 	vt->real_saved_num = -1;
 
-	ret = ev_eloop_register_signal_cb(vtm->eloop, SIGUSR1, vt_sigusr1, vt);
-	if (ret)
-		goto err_free;
-
-	ret = ev_eloop_register_signal_cb(vtm->eloop, SIGUSR2, vt_sigusr2, vt);
-	if (ret)
-		goto err_sig1;
-
 	ret = uterm_input_register_key_cb(vt->input, vt_input, vt);
 	if (ret)
-		goto err_sig2;
+		goto err_free;
 
 	if (!vt_name) {
 		ret = seat_find_vt(seat, &path);
@@ -873,8 +892,15 @@ int uterm_vt_allocate(struct uterm_vt_master *vtm, struct uterm_vt **out,
 			free(path);
 			goto err_input;
 		}
+		ret = vt_register_signals(vt);
+		if (ret) {
+			free(path);
+			goto err_input;
+		}
 		vt->mode = UTERM_VT_REAL;
 		ret = real_open(vt, vt_name ? vt_name : path);
+		if (ret)
+			vt_unregister_signals(vt);
 	} else {
 		if (!(allowed_types & UTERM_VT_FAKE)) {
 			ret = -ERANGE;
@@ -896,10 +922,6 @@ int uterm_vt_allocate(struct uterm_vt_master *vtm, struct uterm_vt **out,
 
 err_input:
 	uterm_input_unregister_key_cb(vt->input, vt_input, vt);
-err_sig2:
-	ev_eloop_unregister_signal_cb(vtm->eloop, SIGUSR2, vt_sigusr2, vt);
-err_sig1:
-	ev_eloop_unregister_signal_cb(vtm->eloop, SIGUSR1, vt_sigusr1, vt);
 err_free:
 	free(vt);
 	return ret;
@@ -911,13 +933,13 @@ void uterm_vt_deallocate(struct uterm_vt *vt)
 	if (!vt || !vt->vtm)
 		return;
 
-	if (vt->mode == UTERM_VT_REAL)
+	if (vt->mode == UTERM_VT_REAL) {
 		real_close(vt);
-	else if (vt->mode == UTERM_VT_FAKE)
+		vt_unregister_signals(vt);
+	} else if (vt->mode == UTERM_VT_FAKE) {
 		fake_close(vt);
+	}
 
-	ev_eloop_unregister_signal_cb(vt->vtm->eloop, SIGUSR2, vt_sigusr2, vt);
-	ev_eloop_unregister_signal_cb(vt->vtm->eloop, SIGUSR1, vt_sigusr1, vt);
 	shl_dlist_unlink(&vt->list);
 	uterm_input_unref(vt->input);
 	vt->vtm = NULL;
@@ -0,0 +1,125 @@
+/*
+ * Microbenchmark of the glyph cache against shl_lru.
+ * Both caches are fed the same trace: a terminal of COLS x ROWS cells redrawn
+ * FRAMES times, mostly ASCII with a tail of rarely used glyphs, so that both
+ * the hit path and eviction are exercised.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/font_cache.c"
+#include "../src/shl_lru.h"
+
+#define COLS 240
+#define ROWS 67
+#define CELLS (COLS * ROWS)
+#define FRAMES 200
+#define GLYPH_W 8
+#define GLYPH_H 16
+
+static uint64_t trace[FRAMES][CELLS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct kmscon_glyph *new_glyph(void)
+{
+	struct kmscon_glyph *g;
+	size_t size = sizeof(*g) + GLYPH_W * GLYPH_H;
+
+	g = malloc(size);
+	if (!g)
+		abort();
+	memset(g, 0, size);
+	g->buf.width = GLYPH_W;
+	g->buf.height = GLYPH_H;
+	g->buf.stride = GLYPH_W;
+	return g;
+}
+
+static void make_trace(void)
+{
+	unsigned int f, i;
+	uint64_t id;
+
+	srand(42);
+	for (f = 0; f < FRAMES; ++f) {
+		for (i = 0; i < CELLS; ++i) {
+			if (rand() % 64)
+				id = 32 + rand() % 95;
+			else
+				id = 0x4e00 + rand() % (4 * CELLS);
+			/* some cells are bold, which is a different glyph */
+			if (!(rand() % 8))
+				id |= 1ULL << 63;
+			trace[f][i] = id;
+		}
+	}
+}
+
+static void bench_lru(void)
+{
+	struct shl_lru *lru;
+	unsigned int f, i, misses = 0;
+	uint64_t start, end;
+
+	lru = shl_lru_new(2 * CELLS);
+	start = now_ns();
+	for (f = 0; f < FRAMES; ++f) {
+		for (i = 0; i < CELLS; ++i) {
+			if (shl_lru_get(lru, trace[f][i]))
+				continue;
+			++misses;
+			shl_lru_insert(lru, trace[f][i], new_glyph());
+		}
+	}
+	end = now_ns();
+	shl_lru_free(lru);
+
+	printf("shl_lru:     %6.1f ns/lookup, %u misses\n",
+	       (double)(end - start) / (FRAMES * CELLS), misses);
+}
+
+static void bench_cache(void)
+{
+	struct kmscon_glyph_cache *cache;
+	unsigned int f, i, misses = 0;
+	uint64_t start, end, id;
+	uint32_t flags;
+
+	kmscon_glyph_cache_new(&cache, 2 * CELLS, sizeof(struct kmscon_glyph) + GLYPH_W * GLYPH_H);
+	start = now_ns();
+	for (f = 0; f < FRAMES; ++f) {
+		kmscon_glyph_cache_next_frame(cache);
+		for (i = 0; i < CELLS; ++i) {
+			id = trace[f][i] & ~(1ULL << 63);
+			flags = (trace[f][i] >> 63) ? KMSCON_GLYPH_BOLD : 0;
+			if (kmscon_glyph_cache_get(cache, id, flags))
+				continue;
+			++misses;
+			kmscon_glyph_cache_insert(cache, id, flags, new_glyph());
+		}
+	}
+	end = now_ns();
+	kmscon_glyph_cache_unref(cache);
+
+	printf("glyph cache: %6.1f ns/lookup, %u misses\n",
+	       (double)(end - start) / (FRAMES * CELLS), misses);
+}
+
+int main(void)
+{
+	make_trace();
+	bench_lru();
+	bench_cache();
+	return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * Throughput benchmark of the terminal render path.
+ * Canned VTE streams are parsed by libtsm and drawn by the real bbulk renderer
+ * into an offscreen XRGB32 buffer, using the same blend kernels as drm2d and
+ * fbdev. The font is a stub handing out fixed glyphs, so only kmscon and libtsm
+ * are measured. Like a pty, the stream is fed in chunks and a frame is drawn
+ * after each of them. Every stream runs once more with the cell cache.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "font.h"
+#include "text.h"
+#include "uterm_video.h"
+#include "uterm_video_internal.h"
+
+#define CELL_W 8
+#define CELL_H 16
+#define COLS 240
+#define ROWS 67
+#define WIDTH (COLS * CELL_W)
+#define HEIGHT (ROWS * CELL_H)
+#define CHUNK 4096
+#define STREAM_SIZE (4 * 1024 * 1024)
+
+/* ---- Offscreen display ---- */
+
+static uint32_t fb[WIDTH * HEIGHT];
+static uint64_t blended;
+
+unsigned int uterm_display_get_width(struct uterm_display *disp)
+{
+	return WIDTH;
+}
+
+unsigned int uterm_display_get_height(struct uterm_display *disp)
+{
+	return HEIGHT;
+}
+
+void uterm_display_ref(struct uterm_display *disp) {}
+void uterm_display_unref(struct uterm_display *disp) {}
+
+bool uterm_display_need_redraw(struct uterm_display *disp)
+{
+	return false;
+}
+
+bool uterm_display_has_damage(struct uterm_display *disp)
+{
+	return false;
+}
+
+bool uterm_display_supports_damage(struct uterm_display *disp)
+{
+	return true;
+}
+
+bool uterm_display_supports_threaded_blend(struct uterm_display *disp)
+{
+	return true;
+}
+
+bool uterm_display_has_opengl(struct uterm_display *disp)
+{
+	return false;
+}
+
+bool uterm_display_is_drm(struct uterm_display *disp)
+{
+	return true;
+}
+
+int uterm_display_use(struct uterm_display *disp)
+{
+	return -EOPNOTSUPP;
+}
+
+/* a single buffer that keeps its content between frames */
+int uterm_display_get_buffer_age(struct uterm_display *disp)
+{
+	return 1;
+}
+
+void uterm_display_set_damage(struct uterm_display *disp, size_t n_rect,
+			      struct uterm_video_rect *damages)
+{
+}
+
+void uterm_display_set_cursor_offset(struct uterm_display *disp, int32_t x, int32_t y) {}
+
+int uterm_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint32_t val = (r << 16) | (g << 8) | b;
+	unsigned int i;
+
+	for (i = 0; i < WIDTH * HEIGHT; ++i)
+		fb[i] = val;
+	return 0;
+}
+
+int uterm_display_fake_blendv(struct uterm_display *disp, const struct uterm_video_blend_req *req,
+			      size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; ++i) {
+		if (req[i].flags & UTERM_BLEND_SPAN)
+			__atomic_add_fetch(&blended, req[i].buf_num, __ATOMIC_RELAXED);
+		else if (req[i].buf)
+			__atomic_add_fetch(&blended, 1, __ATOMIC_RELAXED);
+	}
+
+	return uterm_blend_xrgb32v(NULL, (uint8_t *)fb, WIDTH * 4, WIDTH, HEIGHT, req, num);
+}
+
+int uterm_display_fake_move(struct uterm_display *disp, unsigned int src_y, unsigned int dst_y,
+			    unsigned int height)
+{
+	memmove(&fb[dst_y * WIDTH], &fb[src_y * WIDTH], height * WIDTH * sizeof(*fb));
+	return 0;
+}
+
+/* the last frame is the one in the buffer, nothing to restore */
+int uterm_display_fake_copyv(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			     size_t num)
+{
+	return 0;
+}
+
+/* ---- Stub font ---- */
+
+static const struct kmscon_font_ops bench_font_ops = {
+	.name = "bench",
+};
+
+void kmscon_font_ref(struct kmscon_font *font) {}
+void kmscon_font_unref(struct kmscon_font *font) {}
+
+int kmscon_font_find(struct kmscon_font **out, const struct kmscon_font_attr *attr,
+		     const char *backend)
+{
+	return -ENOENT;
+}
+
+bool kmscon_font_has_glyph_styled(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				  unsigned int style)
+{
+	return true;
+}
+
+int kmscon_font_shape(struct kmscon_font *font, const uint32_t *ch, size_t num, unsigned int style,
+		      uint64_t *ids)
+{
+	return -EOPNOTSUPP;
+}
+
+struct kmscon_glyph *kmscon_font_render_styled(struct kmscon_font *font, uint64_t id,
+					       const uint32_t *ch, size_t len, unsigned int style)
+{
+	struct kmscon_glyph *g;
+	unsigned int width, i;
+
+	width = (len && tsm_ucs4_get_width(*ch) == 2) ? 2 * CELL_W : CELL_W;
+	g = malloc(sizeof(*g) + width * CELL_H);
+	if (!g)
+		return NULL;
+	memset(g, 0, sizeof(*g));
+	g->double_width = width > CELL_W;
+	g->buf.width = width;
+	g->buf.height = CELL_H;
+	g->buf.stride = width;
+	/* some full, some empty and some partial coverage, like antialiased text */
+	for (i = 0; i < width * CELL_H; ++i)
+		g->buf.data[i] = (i * 37 + id) & 0xff;
+	return g;
+}
+
+/* ---- Canned streams ---- */
+
+struct stream {
+	char *buf;
+	size_t len;
+};
+
+static void stream_add(struct stream *s, const char *str, size_t len)
+{
+	if (s->len + len > STREAM_SIZE)
+		len = STREAM_SIZE - s->len;
+	memcpy(&s->buf[s->len], str, len);
+	s->len += len;
+}
+
+static bool stream_full(const struct stream *s)
+{
+	return s->len >= STREAM_SIZE;
+}
+
+/* Streams are what the pty hands out, so lines end in \r\n. */
+
+/* lines of source text of varying length, like cat of a large file */
+static void gen_cat(struct stream *s)
+{
+	char line[COLS + 2];
+	unsigned int i, len;
+
+	srand(42);
+	while (!stream_full(s)) {
+		len = rand() % (COLS * 3 / 4);
+		for (i = 0; i < len; ++i)
+			line[i] = (rand() % 6) ? 'a' + rand() % 26 : ' ';
+		line[len] = '\r';
+		line[len + 1] = '\n';
+		stream_add(s, line, len + 2);
+	}
+}
+
+static void gen_yes(struct stream *s)
+{
+	while (!stream_full(s))
+		stream_add(s, "y\r\n", 3);
+}
+
+/* a few numbers rewritten in place each refresh, like top */
+static void gen_top(struct stream *s)
+{
+	char line[128];
+	unsigned int row, n = 0;
+	int len;
+
+	srand(42);
+	while (!stream_full(s)) {
+		stream_add(s, "\e[H", 3);
+		for (row = 1; row <= 40; ++row) {
+			len = snprintf(line, sizeof(line),
+				       "\e[%u;1H%5u root      20   0 %7u %6u %5.1f %4.1f %s", row,
+				       1000 + row, rand() % 100000, rand() % 10000,
+				       (rand() % 1000) / 10.0, (rand() % 100) / 10.0,
+				       (n + row) % 3 ? "kworker" : "kmscon");
+			stream_add(s, line, len);
+		}
+		++n;
+	}
+}
+
+/* wide CJK text mixed with some ascii */
+static void gen_cjk(struct stream *s)
+{
+	char line[4 * COLS + 2];
+	unsigned int i, len;
+	size_t pos;
+	uint32_t ch;
+
+	srand(42);
+	while (!stream_full(s)) {
+		len = rand() % (COLS / 2);
+		pos = 0;
+		for (i = 0; i < len; ++i) {
+			if (rand() % 8)
+				ch = 0x4e00 + rand() % 0x5000;
+			else
+				ch = 'a' + rand() % 26;
+			pos += tsm_ucs4_to_utf8(ch, &line[pos]);
+		}
+		line[pos++] = '\r';
+		line[pos++] = '\n';
+		stream_add(s, line, pos);
+	}
+}
+
+/* a color change for every character, both 256-color and truecolor */
+static void gen_sgr(struct stream *s)
+{
+	char seq[64];
+	unsigned int i = 0;
+	int len;
+
+	srand(42);
+	while (!stream_full(s)) {
+		if (i % 2)
+			len = snprintf(seq, sizeof(seq), "\e[38;5;%um\e[48;5;%um%c", rand() % 256,
+				       rand() % 256, 'a' + rand() % 26);
+		else
+			len = snprintf(seq, sizeof(seq), "\e[38;2;%u;%u;%um\e[48;2;%u;%u;%um%c",
+				       rand() % 256, rand() % 256, rand() % 256, rand() % 256,
+				       rand() % 256, rand() % 256, 'a' + rand() % 26);
+		stream_add(s, seq, len);
+		if (!(++i % COLS))
+			stream_add(s, "\e[0m\r\n", 6);
+	}
+}
+
+/* ---- Benchmark ---- */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vte_write(struct tsm_vte *vte, const char *u8, size_t len, void *data) {}
+
+static void bench(const char *name, void (*gen)(struct stream *s), const char *backend,
+		  const char *label)
+{
+	struct kmscon_font font = {.ops = &bench_font_ops};
+	struct kmscon_text *txt;
+	struct tsm_screen *screen;
+	struct tsm_vte *vte;
+	struct tsm_screen_attr attr;
+	struct stream s;
+	uint64_t start, end, frames = 0;
+	size_t pos, len;
+	double secs;
+	int ret;
+
+	s.buf = malloc(STREAM_SIZE);
+	if (!s.buf)
+		abort();
+	s.len = 0;
+	gen(&s);
+
+	strcpy(font.attr.name, "bench");
+	font.attr.width = CELL_W;
+	font.attr.height = CELL_H;
+
+	ret = kmscon_text_new(&txt, backend, "normal");
+	if (ret) {
+		fprintf(stderr, "cannot create %s renderer: %d\n", backend, ret);
+		exit(1);
+	}
+	/* the display is never dereferenced by the stubs above */
+	ret = kmscon_text_set(txt, &font, (struct uterm_display *)fb);
+	if (ret) {
+		fprintf(stderr, "cannot set %s renderer: %d\n", backend, ret);
+		exit(1);
+	}
+
+	if (tsm_screen_new(&screen, NULL, NULL) ||
+	    tsm_vte_new(&vte, screen, vte_write, NULL, NULL, NULL))
+		abort();
+	tsm_screen_resize(screen, kmscon_text_get_cols(txt), kmscon_text_get_rows(txt));
+	tsm_vte_get_def_attr(vte, &attr);
+
+	blended = 0;
+	start = now_ns();
+	for (pos = 0; pos < s.len; pos += len) {
+		len = s.len - pos < CHUNK ? s.len - pos : CHUNK;
+		tsm_vte_input(vte, &s.buf[pos], len);
+
+		kmscon_text_prepare(txt, &attr);
+		tsm_screen_draw(screen, kmscon_text_draw_cb, txt);
+		kmscon_text_render(txt);
+		++frames;
+	}
+	end = now_ns();
+
+	secs = (end - start) / 1e9;
+	printf("%-6s %-5s %8.1f MB/s %8.1f frames/s %8.1f cells blended/frame\n", label, name,
+	       s.len / secs / (1024 * 1024), frames / secs, (double)blended / frames);
+
+	tsm_vte_unref(vte);
+	tsm_screen_unref(screen);
+	kmscon_text_unset(txt);
+	kmscon_text_unref(txt);
+	free(s.buf);
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		void (*gen)(struct stream *s);
+	} streams[] = {
+		{"cat", gen_cat}, {"yes", gen_yes}, {"top", gen_top},
+		{"cjk", gen_cjk}, {"sgr", gen_sgr},
+	};
+	unsigned int i;
+
+	kmscon_text_register(&kmscon_text_bbulk_ops);
+	for (i = 0; i < sizeof(streams) / sizeof(*streams); ++i)
+		bench(streams[i].name, streams[i].gen, "bbulk", "bbulk");
+	kmscon_text_bbulk_set_cell_cache(4 * 1024 * 1024);
+	for (i = 0; i < sizeof(streams) / sizeof(*streams); ++i)
+		bench(streams[i].name, streams[i].gen, "bbulk", "cells");
+	kmscon_text_bbulk_set_cell_cache(0);
+	kmscon_text_unregister("bbulk");
+
+	return 0;
+}
@@ -1,5 +1,12 @@
 /*
- * Lightweight test for repeated bbulk_set calls (no leaks, all cells re-damaged).
+ * Lightweight test for repeated bbulk_set calls (no leaks, arrays reused, all
+ * cells re-damaged), for resizing by moving the rows that stay, for blending a
+ * frame on the thread pool and reporting its memory, for restoring stale cells
+ * by copying, for scrolling by moving lines, for redrawing with three buffers,
+ * for merging cells into spans, for filling blank cells, for inline image
+ * tiles, for the pointer tile, for the cell cache, for keeping glyphs across
+ * rotations, for the damage bitset, for merging damage rectangles and for
+ * packing cell attributes.
  * We include the implementation to access static helpers.
  */
 
@@ -40,14 +47,18 @@ unsigned int kmscon_font_get_height(const struct kmscon_font *font)
 }
 
 /* Stub font rendering APIs used by text_bbulk.c */
-struct kmscon_glyph *kmscon_font_render(struct kmscon_font *font, uint64_t id, const uint32_t *ch,
-					size_t len)
+static unsigned int renders;
+
+struct kmscon_glyph *kmscon_font_render_styled(struct kmscon_font *font, uint64_t id,
+					       const uint32_t *ch, size_t len, unsigned int style)
 {
 	struct kmscon_glyph *g;
 	(void)font;
 	(void)id;
 	(void)ch;
 	(void)len;
+	(void)style;
+	++renders;
 	g = malloc(sizeof(*g) + FAKE_CELL_W * FAKE_CELL_W);
 	memset(g, 0, sizeof(*g) + FAKE_CELL_W * FAKE_CELL_W);
 	g->buf.width = g->buf.height = FAKE_CELL_W;
@@ -55,14 +66,31 @@ struct kmscon_glyph *kmscon_font_render(struct kmscon_font *font, uint64_t id, c
 	return g;
 }
 
-bool kmscon_font_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len)
+bool kmscon_font_has_glyph_styled(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				  unsigned int style)
 {
 	(void)font;
 	(void)ch;
 	(void)len;
+	(void)style;
 	return true;
 }
 
+/* Stub font lookup used by the glyph cache prerendering */
+int kmscon_font_find(struct kmscon_font **out, const struct kmscon_font_attr *attr,
+		     const char *backend)
+{
+	(void)out;
+	(void)attr;
+	(void)backend;
+	return -ENOENT;
+}
+
+void kmscon_font_unref(struct kmscon_font *font)
+{
+	(void)font;
+}
+
 int kmscon_rotate_glyph(struct kmscon_glyph *vb, const struct kmscon_glyph *glyph,
 			enum Orientation o, uint8_t align)
 {
@@ -94,22 +122,93 @@ bool uterm_display_supports_damage(struct uterm_display *disp)
 	(void)disp;
 	return true;
 }
+static bool threaded_blend = true;
+
+bool uterm_display_supports_threaded_blend(struct uterm_display *disp)
+{
+	(void)disp;
+	return threaded_blend;
+}
+static unsigned int clears;
+
 int uterm_display_clear(struct uterm_display *disp, uint8_t r, uint8_t g, uint8_t b)
 {
 	(void)disp;
+	++clears;
 	(void)r;
 	(void)g;
 	(void)b;
 	return 0;
 }
+/* how often each cell got blended, indexed by its pixel position */
+static unsigned int blended[480 / FAKE_CELL_H][640 / FAKE_CELL_W];
+/* the requests of the last call */
+static const struct uterm_video_blend_req *blend_last;
+static size_t blend_last_num, blend_calls;
+
 int uterm_display_fake_blendv(struct uterm_display *disp, const struct uterm_video_blend_req *req,
 			      size_t num)
 {
 	(void)disp;
-	(void)req;
-	(void)num;
+	__atomic_store_n(&blend_last, req, __ATOMIC_RELAXED);
+	__atomic_store_n(&blend_last_num, num, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&blend_calls, 1, __ATOMIC_RELAXED);
+	for (; num--; ++req) {
+		if (req->buf)
+			__atomic_add_fetch(&blended[req->y / FAKE_CELL_H][req->x / FAKE_CELL_W], 1,
+					   __ATOMIC_RELAXED);
+		if (req->flags & UTERM_BLEND_SPAN) {
+			for (unsigned int i = 0; i < req->buf_num; ++i)
+				__atomic_add_fetch(&blended[req->y / FAKE_CELL_H]
+							   [req->x / FAKE_CELL_W + i],
+						   1, __ATOMIC_RELAXED);
+		}
+	}
 	return 0;
 }
+static unsigned int moves, move_src, move_dst, move_height;
+
+int uterm_display_fake_move(struct uterm_display *disp, unsigned int src_y, unsigned int dst_y,
+			    unsigned int height)
+{
+	(void)disp;
+	++moves;
+	move_src = src_y;
+	move_dst = dst_y;
+	move_height = height;
+	return 0;
+}
+/* pixels restored from the last frame since the last check */
+static unsigned int copied;
+
+int uterm_display_fake_copyv(struct uterm_display *disp, const struct uterm_video_rect *rects,
+			     size_t num)
+{
+	(void)disp;
+	for (; num--; ++rects)
+		copied += (rects->x2 - rects->x1) * (rects->y2 - rects->y1);
+	return 0;
+}
+bool uterm_display_has_opengl(struct uterm_display *disp)
+{
+	(void)disp;
+	return false;
+}
+bool uterm_display_is_drm(struct uterm_display *disp)
+{
+	(void)disp;
+	return true;
+}
+static unsigned int tiles_blended;
+
+void uterm_blend_to_xrgb32(uint32_t *dst, unsigned int stride,
+			   const struct uterm_video_blend_req *req)
+{
+	(void)dst;
+	(void)stride;
+	(void)req;
+	++tiles_blended;
+}
 void uterm_display_set_damage(struct uterm_display *disp, size_t n_rect,
 			      struct uterm_video_rect *damages)
 {
@@ -123,15 +222,117 @@ void uterm_display_set_cursor_offset(struct uterm_display *disp, int32_t x, int3
 	(void)x;
 	(void)y;
 }
+int uterm_display_use(struct uterm_display *disp)
+{
+	(void)disp;
+	return -EOPNOTSUPP;
+}
+static int buffer_age;
+
+int uterm_display_get_buffer_age(struct uterm_display *disp)
+{
+	(void)disp;
+	return buffer_age;
+}
 #include "shl_log.h"
 #undef log_warning
 #define log_warning(f, ...)
 /* Pull in the implementation so we can call bbulk_set directly */
 #include "../src/text_bbulk.c"
 
+/* the last image the parser placed */
+static uint32_t image_id;
+
+static void image_text(void *data, const char *buf, size_t len)
+{
+	(void)data;
+	(void)buf;
+	(void)len;
+}
+
+static void image_place(void *data, uint32_t id, unsigned int cols, unsigned int rows,
+			enum kmscon_image_cursor cursor)
+{
+	(void)data;
+	(void)cols;
+	(void)rows;
+	(void)cursor;
+	image_id = id;
+}
+
+static const struct kmscon_image_ops image_ops = {
+	.text = image_text,
+	.place = image_place,
+};
+
 /* Fake font objects with valid width/height for FONT_WIDTH/FONT_HEIGHT macros */
 static struct kmscon_font fake_font = {.attr = {.width = FAKE_CELL_W, .height = FAKE_CELL_H}};
 
+/* glyphs are looked up while drawing, render must not touch the cache */
+static int render_without_cache(struct kmscon_text *txt)
+{
+	struct bbulk *bb = txt->data;
+	struct kmscon_glyph_cache *glyphs = bb->glyphs;
+	int ret;
+
+	bb->glyphs = NULL;
+	ret = bbulk_render(txt);
+	bb->glyphs = glyphs;
+	return ret;
+}
+
+/* draw a frame where row y shows id @ids[y], all cells drawn */
+static void draw_ids(struct kmscon_text *txt, const uint64_t *ids)
+{
+	struct tsm_screen_attr attr;
+	struct bbulk *bb = txt->data;
+	uint32_t ch = 'x';
+
+	memset(&attr, 0, sizeof(attr));
+	assert(bbulk_prepare(txt, &attr) == 0);
+	for (unsigned y = 0; y < txt->rows; ++y)
+		for (unsigned x = 0; x < txt->cols; ++x)
+			assert(bbulk_draw(txt, ids[y], &ch, 1, 1, x, y, &attr) == 0);
+	assert(bb->pending_len == txt->cols * txt->rows);
+	assert(render_without_cache(txt) == 0);
+}
+
+static void draw_rows(struct kmscon_text *txt, uint64_t first)
+{
+	uint64_t ids[480 / FAKE_CELL_H];
+
+	for (unsigned y = 0; y < txt->rows; ++y)
+		ids[y] = first + y;
+	draw_ids(txt, ids);
+}
+
+/* cells covered by the requests of the last frame */
+static unsigned int drawn_cells(const struct bbulk *bb)
+{
+	unsigned int i, num = 0;
+
+	for (i = 0; i < bb->req_len; ++i) {
+		if (bb->reqs[i].flags & UTERM_BLEND_SPAN)
+			num += bb->reqs[i].buf_num;
+		else if (bb->reqs[i].flags & UTERM_BLEND_FILL)
+			num += bb->reqs[i].width / FAKE_CELL_W;
+		else
+			++num;
+	}
+	return num;
+}
+
+/* a frame where only the pointer is drawn, libtsm skips all cells */
+static void draw_pointer_frame(struct kmscon_text *txt, unsigned int x, unsigned int y)
+{
+	struct tsm_screen_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	assert(bbulk_prepare(txt, &attr) == 0);
+	assert(bbulk_draw_pointer(txt, x, y) == 0);
+	assert(render_without_cache(txt) == 0);
+}
+
 static void init_fake_txt(struct kmscon_text *txt)
 {
 	memset(txt, 0, sizeof(*txt));
@@ -145,6 +346,7 @@ static void init_fake_txt(struct kmscon_text *txt)
 int main(void)
 {
 	struct kmscon_text txt;
+	struct kmscon_image_parser *images;
 	int ret;
 
 	init_fake_txt(&txt);
@@ -157,8 +359,9 @@ int main(void)
 	/* First call allocates */
 	ret = bbulk_set(&txt);
 	assert(ret == 0);
-	assert(bb->reqs && bb->prev && bb->damages && bb->damage_rects);
+	assert(bb->reqs && bb->prev && bb->damaged && bb->damage_rects);
 	unsigned int prev_cells = bb->cells;
+	uint8_t *arrays = bb->arrays;
 
 	bbulk_unset(&txt);
 
@@ -166,9 +369,10 @@ int main(void)
 	ret = bbulk_set(&txt);
 	assert(ret == 0);
 	assert(bb->cells == prev_cells);
+	assert(bb->arrays == arrays);
 	assert(bb->reqs != NULL);
 	assert(bb->prev != NULL);
-	assert(bb->damages != NULL);
+	assert(bb->damaged != NULL);
 	assert(bb->damage_rects != NULL);
 	/* All cells should be marked damaged */
 	for (unsigned i = 0; i < bb->cells; ++i)
@@ -183,11 +387,345 @@ int main(void)
 	assert(ret == 0);
 	assert(bb->damage_rect_len > 0);
 
+	/* A full frame on the pool blends every cell exactly once */
+	static struct kmscon_glyph glyph = {.buf = {.width = FAKE_CELL_W, .height = FAKE_CELL_H}};
+	ret = kmscon_text_bbulk_set_threads(4);
+	assert(ret == 0 && blend_pool);
+	memset(blended, 0, sizeof(blended));
+	for (unsigned i = 0; i < bb->cells; ++i) {
+		bb->reqs[i].buf = &glyph.buf;
+		bb->reqs[i].x = (i % txt.cols) * FAKE_CELL_W;
+		bb->reqs[i].y = (i / txt.cols) * FAKE_CELL_H;
+	}
+	bb->req_len = bb->cells;
+	ret = bbulk_render(&txt);
+	assert(ret == 0 && bb->band_reqs);
+	for (unsigned i = 0; i < bb->cells; ++i)
+		assert(blended[i / txt.cols][i % txt.cols] == 1);
+
+	/* the memory report counts the requests of that frame and the arrays */
+	struct kmscon_text_memory mem = {0};
+	bbulk_get_memory(&txt, &mem);
+	assert(mem.reqs == bb->cells);
+	assert(mem.bytes >= bb->arrays_size + bb->req_total_len * sizeof(*bb->band_reqs));
+
+	/* the pointer overlaps cells of any band, it is blended after them */
+	bb->req_len = bb->cells;
+	ret = bbulk_draw_pointer(&txt, 0, 0);
+	assert(ret == 0);
+	ret = bbulk_render(&txt);
+	assert(ret == 0 && bb->req_len == bb->cells + 1);
+	assert(blend_last == &bb->reqs[bb->cells] && blend_last_num == 1);
+	bb->pointer = false;
+
+	/* displays that cannot blend on several threads get the whole frame at once */
+	threaded_blend = false;
+	blend_calls = 0;
+	bb->req_len = bb->cells;
+	ret = bbulk_render(&txt);
+	assert(ret == 0 && blend_calls == 1 && blend_last_num == bb->cells);
+	threaded_blend = true;
+
+	/* start over from the first frame */
+	bbulk_unset(&txt);
+	ret = bbulk_set(&txt);
+	assert(ret == 0);
+	ret = bbulk_prepare(&txt, &attr);
+	assert(ret == 0);
+	ret = bbulk_render(&txt);
+	assert(ret == 0);
+
+	ret = kmscon_text_bbulk_set_threads(0);
+	assert(ret == 0 && !blend_pool);
+
+	/* Once prev is valid, scrolling up moves lines instead of blending them */
+	draw_rows(&txt, 100);
+	/* the other buffer gets the changes copied instead of blended again */
+	copied = 0;
+	draw_rows(&txt, 100);
+	assert(bb->req_len == 0 && copied == bb->cells * FAKE_CELL_W * FAKE_CELL_H);
+	assert(bb->copy_len == txt.rows);
+	copied = 0;
+	draw_rows(&txt, 100);
+	assert(bb->req_len == 0 && moves == 0 && copied == 0);
+	draw_rows(&txt, 102);
+	assert(moves == 1);
+	assert(move_src == bb->off_y + 2 * FAKE_CELL_H && move_dst == bb->off_y);
+	assert(move_height == (txt.rows - 2) * FAKE_CELL_H);
+	/* only the two new lines are blended, each one as a single span */
+	assert(bb->req_len == 2 && drawn_cells(bb) == 2 * txt.cols);
+	for (unsigned i = 0; i < bb->req_len; ++i) {
+		assert(bb->reqs[i].y >= (txt.rows - 2) * FAKE_CELL_H);
+		assert(bb->reqs[i].flags == UTERM_BLEND_SPAN && !bb->reqs[i].buf);
+		assert(bb->reqs[i].width == txt.cols * FAKE_CELL_W);
+		assert(bb->reqs[i].bufs[txt.cols - 1] && bb->reqs[i].x == bb->off_x);
+	}
+
+	/* a change that isn't a scroll is drawn as usual */
+	draw_rows(&txt, 5000);
+	assert(moves == 1 && drawn_cells(bb) == bb->cells);
+
+	/* scrolling down above a fixed status line only moves the region */
+	uint64_t ids[480 / FAKE_CELL_H];
+	for (unsigned y = 0; y < txt.rows; ++y)
+		ids[y] = y + 1 < txt.rows ? 7000 + y : 9999;
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	assert(bb->req_len == 0);
+	for (unsigned y = txt.rows - 2; y > 0; --y)
+		ids[y] = ids[y - 1];
+	ids[0] = 8888;
+	draw_ids(&txt, ids);
+	assert(moves == 2);
+	assert(move_src == bb->off_y && move_dst == bb->off_y + FAKE_CELL_H);
+	assert(move_height == (txt.rows - 2) * FAKE_CELL_H);
+	assert(bb->req_len == 1 && drawn_cells(bb) == txt.cols);
+	assert(bb->reqs[0].y == bb->off_y);
+
+	/* with three buffers, a new background reaches the two older ones, too */
+	buffer_age = 3;
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	clears = 0;
+	bb->redraw = true;
+	draw_ids(&txt, ids);
+	assert(clears == 1 && drawn_cells(bb) == bb->cells);
+	copied = 0;
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	assert(clears == 3 && bb->req_len == 0);
+	assert(copied == 2 * bb->cells * FAKE_CELL_W * FAKE_CELL_H);
+	/* the first buffer got everything, so the text layer may skip cells again */
+	txt.buffer_age = 0;
+	draw_ids(&txt, ids);
+	assert(clears == 3 && bb->req_len == 0 && txt.buffer_age == 3);
+
+	/* a resize by rows moves the rows that stay along with the border */
+	buffer_age = 2;
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	unsigned int rows = txt.rows, off_y = bb->off_y, m = moves;
+	bbulk_resize(&txt, txt.cols, rows - 2);
+	assert(bb->off_y == off_y + FAKE_CELL_H);
+	clears = 0;
+	draw_ids(&txt, ids);
+	assert(clears == 1 && moves == m + 1 && bb->req_len == 0);
+	assert(move_src == off_y && move_dst == bb->off_y);
+	assert(move_height == (rows - 2) * FAKE_CELL_H);
+	/* the other buffer is cleared and gets the cells copied */
+	copied = 0;
+	draw_ids(&txt, ids);
+	assert(clears == 2 && moves == m + 1 && bb->req_len == 0);
+	assert(copied == txt.cols * txt.rows * FAKE_CELL_W * FAKE_CELL_H);
+	/* growing only draws the new rows */
+	bbulk_resize(&txt, txt.cols, rows);
+	draw_ids(&txt, ids);
+	assert(moves == m + 2 && move_dst == off_y && drawn_cells(bb) == 2 * txt.cols);
+	/* other resizes move the cells sideways and redraw everything */
+	bbulk_resize(&txt, txt.cols - 1, rows);
+	draw_ids(&txt, ids);
+	assert(moves == m + 2 && drawn_cells(bb) == txt.cols * txt.rows);
+	bbulk_resize(&txt, txt.max_cols, txt.max_rows);
+	draw_ids(&txt, ids);
+
+	/* runs of blank cells of one color are filled with a single request */
+	buffer_age = 1;
+	memset(&attr, 0, sizeof(attr));
+	assert(bbulk_prepare(&txt, &attr) == 0);
+	/* libtsm's characters stay valid until the frame is rendered */
+	static const uint32_t x_ch = 'x', blank_ch = ' ';
+	for (unsigned y = 0; y < txt.rows; ++y) {
+		for (unsigned x = 0; x < txt.cols; ++x) {
+			const uint32_t *ch = x == 3 ? &x_ch : &blank_ch;
+
+			attr.bb = x < 10 ? 0 : 1;
+			assert(bbulk_draw(&txt, *ch, ch, 1, 1, x, y, &attr) == 0);
+		}
+	}
+	assert(bbulk_render(&txt) == 0);
+	assert(bb->req_len == 4 * txt.rows);
+	for (unsigned i = 0; i < bb->req_len; ++i) {
+		struct uterm_video_blend_req *req = &bb->reqs[i];
+
+		if (i % 4 == 1) {
+			assert(req->buf && !req->flags);
+			continue;
+		}
+		assert(!req->buf && req->flags == UTERM_BLEND_FILL);
+		assert(req->height == FAKE_CELL_H && req->y == bb->off_y + i / 4 * FAKE_CELL_H);
+		if (i % 4 == 0)
+			assert(req->width == 3 * FAKE_CELL_W && req->bb == 0);
+		else if (i % 4 == 2)
+			assert(req->width == 6 * FAKE_CELL_W && req->bb == 0);
+		else
+			assert(req->width == (txt.cols - 10) * FAKE_CELL_W && req->bb == 1);
+	}
+
+	/*
+	 * cells of an inline image copy its tiles, plane 16 text of an id the
+	 * terminal did not place is drawn as text
+	 */
+	kmscon_image_set_cache_size(1024 * 1024);
+	assert(!kmscon_image_parser_new(&images, &image_ops, NULL));
+	kmscon_image_parser_set_cell(images, FAKE_CELL_W, FAKE_CELL_H, 0, 0, 0);
+	kmscon_image_parser_input(images, "\033Pq!16~\033\\", 9);
+	assert(image_id);
+	txt.images = images;
+	memset(&attr, 0, sizeof(attr));
+	assert(bbulk_prepare(&txt, &attr) == 0);
+	static const uint32_t image_ch[3] = {KMSCON_IMAGE_CP_BASE, KMSCON_IMAGE_CP_BASE + 1,
+					     KMSCON_IMAGE_CP_BASE};
+	attr.fccode = -1;
+	for (unsigned x = 0; x < 3; ++x) {
+		attr.fb = x < 2 ? image_id : image_id + 1;
+		assert(bbulk_draw(&txt, image_ch[x], &image_ch[x], 1, 1, x, 0, &attr) == 0);
+	}
+	assert(bbulk_render(&txt) == 0);
+	assert(bb->req_len == 3);
+	for (unsigned x = 0; x < 2; ++x) {
+		struct kmscon_glyph *restored;
+
+		assert(bb->reqs[x].flags == UTERM_BLEND_XRGB32);
+		assert(bb->reqs[x].buf->width == FAKE_CELL_W);
+		assert(bb->reqs[x].x == bb->off_x + x * FAKE_CELL_W);
+		assert(!cell_restorable(&txt, x, &restored));
+	}
+	assert(bb->reqs[2].buf && !bb->reqs[2].flags);
+	assert(bb->reqs[2].x == bb->off_x + 2 * FAKE_CELL_W);
+
+	/* those of a dropped one are filled */
+	kmscon_image_set_cache_size(0);
+	assert(bbulk_prepare(&txt, &attr) == 0);
+	attr.fb = image_id;
+	assert(bbulk_draw(&txt, image_ch[0], &image_ch[0], 1, 1, 3, 0, &attr) == 0);
+	assert(bbulk_render(&txt) == 0);
+	assert(bb->req_len == 1 && bb->reqs[0].flags == UTERM_BLEND_FILL);
+	txt.images = NULL;
+	kmscon_image_parser_free(images);
+	kmscon_image_set_cache_size(1024 * 1024);
+
+	/* the pointer is a tile over the cells, they are blended again once it moves */
+	buffer_age = 2;
+	for (unsigned y = 0; y < txt.rows; ++y)
+		ids[y] = 300 + y;
+	draw_ids(&txt, ids);
+	draw_ids(&txt, ids);
+	txt.buffer_age = 0;
+	draw_pointer_frame(&txt, 3 * FAKE_CELL_W, 3 * FAKE_CELL_H);
+	assert(bb->req_len == 1 && bb->restore_len == 0 && txt.buffer_age == 2);
+	for (unsigned i = 0; i < bb->cells; ++i)
+		assert(bb->prev[i].id != ID_DAMAGED);
+	txt.buffer_age = 0;
+	draw_pointer_frame(&txt, 10 * FAKE_CELL_W, 10 * FAKE_CELL_H);
+	assert(bb->restore_len == 4 && bb->req_len == 5 && txt.buffer_age == 2);
+	/* the other buffer shows the first pointer, the last one the second */
+	draw_pointer_frame(&txt, 10 * FAKE_CELL_W, 10 * FAKE_CELL_H);
+	assert(bb->restore_len == 8 && bb->req_len == 9 && txt.buffer_age == 2);
+	for (unsigned i = 0; i < 8; ++i) {
+		unsigned int off = bb->restore[i].off;
+
+		assert(bb->reqs[i].buf == &bb->restore[i].glyph->buf);
+		assert(bb->reqs[i].x == bb->off_x + off % txt.cols * FAKE_CELL_W);
+		assert(bb->reqs[i].y == bb->off_y + off / txt.cols * FAKE_CELL_H);
+	}
+
+	/* the cell cache blends each glyph and color pair once */
+	bbulk_unset(&txt);
+	kmscon_text_bbulk_set_cell_cache(64 * 1024);
+	assert(!bbulk_set(&txt) && bb->tiles);
+	buffer_age = 1;
+	for (unsigned y = 0; y < txt.rows; ++y)
+		ids[y] = 42;
+	draw_ids(&txt, ids);
+	assert(bb->req_len == bb->cells && tiles_blended == 1);
+	assert(bb->tiles->hits == bb->cells - 1 && bb->tiles->misses == 1);
+	for (unsigned i = 0; i < bb->req_len; ++i)
+		assert(bb->reqs[i].flags == UTERM_BLEND_XRGB32 && bb->reqs[i].buf != &glyph.buf);
+
+	/* tiles used by the frame in progress are never evicted */
+	bbulk_unset(&txt);
+	size_t tile_size = sizeof(struct cell_tile) + FAKE_CELL_W * FAKE_CELL_W * 4;
+	kmscon_text_bbulk_set_cell_cache(4 * tile_size);
+	assert(!bbulk_set(&txt) && bb->tiles);
+	tiles_blended = 0;
+	draw_rows(&txt, 100);
+	assert(tiles_blended == 4 && bb->tiles->size == 4 * tile_size);
+	/* rows that didn't fit miss on every cell */
+	assert(bb->tiles->misses == 4 + (txt.rows - 4) * txt.cols && !bb->tiles->evictions);
+	for (unsigned i = 0; i < bb->req_len; ++i)
+		assert((bb->reqs[i].flags == UTERM_BLEND_XRGB32) == (bb->reqs[i].y < 4 * FAKE_CELL_H));
+	/* in the next frame, old tiles make room */
+	draw_rows(&txt, 200);
+	assert(tiles_blended == 8 && bb->tiles->evictions == 4);
+	kmscon_text_bbulk_set_cell_cache(0);
+
+	/* rotating keeps the glyph cache, cached glyphs are rotated from it */
+	uint32_t ch = 0x2603;
+	struct tsm_screen_attr plain;
+	memset(&plain, 0, sizeof(plain));
+	renders = 0;
+	assert(find_glyph(&txt, ch, &ch, 1, &plain) && renders == 1);
+	assert(bbulk_rotate(&txt, OR_RIGHT) == 0);
+	assert(find_glyph(&txt, ch, &ch, 1, &plain) && renders == 1);
+	assert(bbulk_rotate(&txt, OR_NORMAL) == 0);
+	assert(find_glyph(&txt, ch, &ch, 1, &plain) && renders == 1);
+
+	/* cells remember the attributes that make a difference on screen */
+	struct tsm_screen_attr a, b;
+	memset(&a, 0, sizeof(a));
+	a.fr = 1, a.fg = 2, a.fb = 3, a.br = 4, a.bg = 5, a.bb = 6;
+	a.bold = a.underline = a.inverse = 1;
+	unpack_attr(&b, pack_attr(&a));
+	assert(!memcmp(&a, &b, sizeof(a)));
+	assert(!(pack_attr(&a) & ~CELL_ATTR));
+	b.fccode = 3;
+	b.protect = 1;
+	assert(pack_attr(&a) == pack_attr(&b));
+
+	/* damaged cells close to each other in a row share a rectangle */
+	reset_damaged(bb);
+	bb->damage_rect_len = 0;
+	mark_damaged(bb, 1);
+	mark_damaged(bb, 4);
+	mark_damaged(bb, 9);
+	mark_damaged(bb, txt.cols);
+	bbulk_compute_damage(&txt);
+	struct uterm_video_rect *rects = bb->damage_rects;
+	assert(bb->damage_rect_len == 3);
+	assert(rects[0].x2 - rects[0].x1 == 4 * FAKE_CELL_W);
+	assert(rects[1].x1 - rects[0].x1 == 8 * FAKE_CELL_W && rects[1].y1 == rects[0].y1);
+	assert(rects[2].x1 == rects[0].x1 - FAKE_CELL_W && rects[2].y1 == rects[0].y1 + FAKE_CELL_H);
+	/* the same columns in consecutive lines make a single rect */
+	reset_damaged(bb);
+	bb->damage_rect_len = 0;
+	for (unsigned y = 0; y < 3; ++y) {
+		mark_damaged(bb, 2 + y * txt.cols);
+		mark_damaged(bb, 3 + y * txt.cols);
+	}
+	mark_damaged(bb, 2 + 4 * txt.cols);
+	bbulk_compute_damage(&txt);
+	assert(bb->damage_rect_len == 2);
+	assert(rects[0].x2 - rects[0].x1 == 2 * FAKE_CELL_W);
+	assert(rects[0].y2 - rects[0].y1 == 3 * FAKE_CELL_H);
+	/* beyond the budget, neighbors are joined into bounding boxes */
+	kmscon_text_bbulk_set_damage_rects(1);
+	bb->damage_rect_len = 0;
+	bbulk_compute_damage(&txt);
+	assert(bb->damage_rect_len == 1);
+	assert(rects[0].y2 - rects[0].y1 == 5 * FAKE_CELL_H);
+	kmscon_text_bbulk_set_damage_rects(32);
+
+	/* only the damaged words are cleared, which are all that were set */
+	reset_damaged(bb);
+	for (unsigned i = 0; i < bb->damaged_len; ++i)
+		assert(!bb->damaged[i]);
+	assert(!bb->damaged_words[0]);
+
+	/* the arrays are kept until the renderer is destroyed */
 	bbulk_unset(&txt);
-	assert(bb->reqs == NULL);
-	assert(bb->prev == NULL);
-	assert(bb->damages == NULL);
-	assert(bb->damage_rects == NULL);
+	assert(bb->arrays && !bb->glyphs);
 	kmscon_text_bbulk_ops.destroy(&txt);
 	return 0;
 }
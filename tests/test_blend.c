@@ -0,0 +1,506 @@
+/*
+ * Check that the vectorized blend kernels match the scalar fallback, that
+ * blending and filling through tiles and blend tables gives the same picture as
+ * doing it line by line, and that the tables are kept in LRU order. Mono
+ * kernels have to match the scalar kernel on the unpacked glyph, color kernels
+ * have to draw premultiplied pixels over the background exactly.
+ * We include the implementation to access the static kernels.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/shl_misc.h"
+#include "../src/uterm_blend.c"
+
+#define MAX_WIDTH 133
+
+static void check_kernel(const char *name, blend_line_fn fn)
+{
+	struct uterm_video_blend_req req;
+	uint8_t src[MAX_WIDTH];
+	uint32_t ref[MAX_WIDTH + 1], out[MAX_WIDTH + 1];
+	unsigned int width, round, i;
+
+	srand(42);
+	for (round = 0; round < 64; ++round) {
+		memset(&req, 0, sizeof(req));
+		req.fr = rand() & 0xff;
+		req.fg = rand() & 0xff;
+		req.fb = rand() & 0xff;
+		req.br = rand() & 0xff;
+		req.bg = rand() & 0xff;
+		req.bb = rand() & 0xff;
+
+		for (i = 0; i < MAX_WIDTH; ++i) {
+			/* mix empty, full and partial coverage runs */
+			if (round % 4 == 0)
+				src[i] = 0;
+			else if (round % 4 == 1)
+				src[i] = 255;
+			else
+				src[i] = rand() & 0xff;
+		}
+
+		for (width = 0; width <= MAX_WIDTH; ++width) {
+			memset(ref, 0xaa, sizeof(ref));
+			memset(out, 0xaa, sizeof(out));
+			blend_line_scalar(ref, src, width, &req);
+			fn(out, src, width, &req);
+			if (memcmp(ref, out, sizeof(ref))) {
+				fprintf(stderr, "%s: mismatch at width %u round %u\n", name, width,
+					round);
+				abort();
+			}
+		}
+	}
+}
+
+#define SCREEN_W 600
+#define SCREEN_H 80
+
+static struct uterm_video_buffer *new_buf(unsigned int width, unsigned int height,
+					  unsigned int stride)
+{
+	struct uterm_video_buffer *buf;
+	unsigned int i;
+
+	buf = malloc(sizeof(*buf) + stride * height);
+	assert(buf);
+	memset(buf, 0, sizeof(*buf));
+	buf->width = width;
+	buf->height = height;
+	buf->stride = stride;
+	for (i = 0; i < stride * height; ++i)
+		buf->data[i] = rand() & 0xff;
+	return buf;
+}
+
+typedef void (*blend_mono_fn)(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      uint32_t fval, uint32_t bval);
+
+static void check_mono_kernel(const char *name, blend_mono_fn fn)
+{
+	struct uterm_video_blend_req req;
+	struct uterm_video_buffer *mono;
+	uint8_t alpha[MAX_WIDTH];
+	uint32_t ref[MAX_WIDTH + 1], out[MAX_WIDTH + 1];
+	unsigned int width, round, i;
+
+	srand(43);
+	mono = new_buf(MAX_WIDTH, 1, (MAX_WIDTH + 7) / 8);
+	mono->format = UTERM_FORMAT_MONO;
+	for (round = 0; round < 64; ++round) {
+		memset(&req, 0, sizeof(req));
+		req.fr = rand() & 0xff;
+		req.fb = rand() & 0xff;
+		req.bg = rand() & 0xff;
+		req.bb = rand() & 0xff;
+
+		/* empty, full and mixed bytes */
+		for (i = 0; i < mono->stride; ++i)
+			mono->data[i] = (round % 4 < 2) ? -(round % 4) : rand() & 0xff;
+
+		for (width = 0; width <= MAX_WIDTH; ++width) {
+			mono->width = width;
+			uterm_video_buffer_unpack(alpha, mono, 0);
+			memset(ref, 0xaa, sizeof(ref));
+			memset(out, 0xaa, sizeof(out));
+			blend_line_scalar(ref, alpha, width, &req);
+			fn(out, mono->data, width, req_fg(&req), req_bg(&req));
+			if (memcmp(ref, out, sizeof(ref))) {
+				fprintf(stderr, "%s: mismatch at width %u round %u\n", name, width,
+					round);
+				abort();
+			}
+		}
+	}
+	free(mono);
+}
+
+typedef void (*blend_argb_fn)(uint32_t *dst, const uint8_t *src, unsigned int width,
+			      uint32_t bval);
+
+static void check_argb_kernel(const char *name, blend_argb_fn fn)
+{
+	uint32_t src[MAX_WIDTH], ref[MAX_WIDTH + 1], out[MAX_WIDTH + 1];
+	uint32_t a, c, bval, val;
+	unsigned int width, round, i, shift;
+
+	srand(44);
+	for (round = 0; round < 64; ++round) {
+		bval = rand() & 0xffffff;
+
+		/* empty, opaque and translucent pixels, premultiplied */
+		for (i = 0; i < MAX_WIDTH; ++i) {
+			a = (round % 4 == 0) ? 0 : (round % 4 == 1) ? 255 : rand() & 0xff;
+			src[i] = a << 24;
+			for (shift = 0; shift < 24; shift += 8)
+				src[i] |= (a ? rand() % (a + 1) : 0) << shift;
+		}
+
+		memset(ref, 0xaa, sizeof(ref));
+		for (i = 0; i < MAX_WIDTH; ++i) {
+			a = src[i] >> 24;
+			val = 0;
+			for (shift = 0; shift < 24; shift += 8) {
+				c = (((bval >> shift) & 0xff) * (255 - a) + 127) / 255;
+				val |= (c + ((src[i] >> shift) & 0xff)) << shift;
+			}
+			ref[i] = val;
+		}
+
+		for (width = 0; width <= MAX_WIDTH; ++width) {
+			memset(out, 0xaa, sizeof(out));
+			fn(out, (const uint8_t *)src, width, bval);
+			if (memcmp(ref, out, width * 4) || out[width] != 0xaaaaaaaa) {
+				fprintf(stderr, "%s: mismatch at width %u round %u\n", name, width,
+					round);
+				abort();
+			}
+		}
+	}
+}
+
+/* color glyphs go through tiles and spans like the others */
+static void check_argb_tiled(struct uterm_display *disp)
+{
+	static uint32_t ref[SCREEN_W * SCREEN_H], out[SCREEN_W * SCREEN_H];
+	const struct uterm_video_buffer *spans[2];
+	struct uterm_video_blend_req reqs[2];
+	struct uterm_video_buffer *buf;
+	const uint8_t *row;
+	unsigned int y;
+
+	srand(8);
+	buf = new_buf(16, 16, 16 * 4);
+	buf->format = UTERM_FORMAT_ARGB32;
+	spans[0] = spans[1] = buf;
+
+	memset(reqs, 0, sizeof(reqs));
+	reqs[0].buf = buf;
+	reqs[0].x = 4;
+	reqs[0].y = 2;
+	reqs[0].fr = 255;
+	reqs[0].br = 10;
+	reqs[0].bb = 200;
+	reqs[1] = reqs[0];
+	reqs[1].buf = NULL;
+	reqs[1].flags = UTERM_BLEND_SPAN;
+	reqs[1].bufs = spans;
+	reqs[1].buf_num = 2;
+	reqs[1].width = 32;
+	reqs[1].height = 16;
+	reqs[1].x = 20;
+	reqs[1].bg = 99;
+
+	memset(ref, 0, sizeof(ref));
+	memset(out, 0, sizeof(out));
+	for (y = 0; y < 16; ++y) {
+		row = &buf->data[y * buf->stride];
+		blend_argb_scalar(&ref[(2 + y) * SCREEN_W + 4], row, 16, req_bg(&reqs[0]));
+		blend_argb_scalar(&ref[(2 + y) * SCREEN_W + 20], row, 16, req_bg(&reqs[1]));
+		blend_argb_scalar(&ref[(2 + y) * SCREEN_W + 36], row, 16, req_bg(&reqs[1]));
+	}
+	assert(!uterm_blend_xrgb32v(disp, (uint8_t *)out, SCREEN_W * 4, SCREEN_W, SCREEN_H, reqs,
+				    2));
+	assert(!memcmp(ref, out, sizeof(ref)));
+	free(buf);
+}
+
+static void check_tiled(struct uterm_display *disp)
+{
+	static uint32_t ref[SCREEN_W * SCREEN_H], out[SCREEN_W * SCREEN_H];
+	struct uterm_video_buffer *bufs[4];
+	const struct uterm_video_buffer *spans[40];
+	struct uterm_video_blend_req reqs[128], *req;
+	uint8_t alpha[SCREEN_W];
+	unsigned int i, x, y, n = 0;
+
+	srand(7);
+	bufs[0] = new_buf(8, 16, 8);
+	bufs[1] = new_buf(16, 16, 20);
+	bufs[2] = new_buf(130, 70, 130); /* bigger than a tile */
+	bufs[3] = new_buf(16, 16, 3);	 /* mono, as wide as bufs[1] */
+	bufs[3]->format = UTERM_FORMAT_MONO;
+
+	/* two rows of cells with gaps, longer than a tile and cut off at the right edge */
+	for (y = 0; y < 32; y += 16) {
+		for (x = 0; x < SCREEN_W; x += 8 * (1 + (n % 2))) {
+			req = &reqs[n++];
+			memset(req, 0, sizeof(*req));
+			req->buf = (n % 7) ? bufs[(n % 6 == 3) ? 3 : n % 2] : NULL;
+			req->x = x;
+			req->y = y;
+			req->fr = n * 13;
+			req->bb = n * 29;
+			if (!(n % 5)) {
+				req->buf = NULL;
+				req->flags = UTERM_BLEND_FILL;
+				req->width = 8;
+				req->height = 16;
+			}
+		}
+	}
+	req = &reqs[n++];
+	memset(req, 0, sizeof(*req));
+	req->buf = bufs[2];
+	req->y = 8;
+	req->fg = 200;
+	/* a fill bigger than a tile */
+	req = &reqs[n++];
+	memset(req, 0, sizeof(*req));
+	req->flags = UTERM_BLEND_FILL;
+	req->x = 200;
+	req->y = 40;
+	req->width = 300;
+	req->height = 40;
+	req->br = 77;
+	/* spans, one of them bigger than a tile and cut off at the right edge */
+	for (i = 0; i < 40; ++i)
+		spans[i] = bufs[(i % 3) ? ((i % 4) ? 1 : 3) : 0];
+	req = &reqs[n++];
+	memset(req, 0, sizeof(*req));
+	req->flags = UTERM_BLEND_SPAN;
+	req->bufs = spans;
+	req->buf_num = 3;
+	req->width = 8 + 16 + 16;
+	req->height = 16;
+	req->y = 60;
+	req->fb = 99;
+	req = &reqs[n++];
+	*req = reqs[n - 2];
+	req->buf_num = 40;
+	req->width = 14 * 8 + 26 * 16;
+	req->x = 40;
+	req->y = 50;
+	req->br = 44;
+
+	memset(ref, 0, sizeof(ref));
+	memset(out, 0, sizeof(out));
+	for (i = 0; i < n; ++i) {
+		req = &reqs[i];
+		if (req->flags & UTERM_BLEND_FILL) {
+			for (y = 0; y < req->height; ++y)
+				for (x = 0; x < min(req->width, SCREEN_W - req->x); ++x)
+					ref[(req->y + y) * SCREEN_W + req->x + x] =
+						(req->br << 16) | (req->bg << 8) | req->bb;
+			continue;
+		}
+		if (req->flags & UTERM_BLEND_SPAN) {
+			unsigned int off = req->x, j;
+
+			for (j = 0; j < req->buf_num && off < SCREEN_W; off += req->bufs[j++]->width)
+				for (y = 0; y < req->height; ++y) {
+					uterm_video_buffer_unpack(alpha, req->bufs[j], y);
+					blend_line_scalar(&ref[(req->y + y) * SCREEN_W + off], alpha,
+							  min(req->bufs[j]->width, SCREEN_W - off), req);
+				}
+			continue;
+		}
+		if (!req->buf)
+			continue;
+		for (y = 0; y < req->buf->height && req->y + y < SCREEN_H; ++y) {
+			uterm_video_buffer_unpack(alpha, req->buf, y);
+			blend_line_scalar(&ref[(req->y + y) * SCREEN_W + req->x], alpha,
+					  min(req->buf->width, SCREEN_W - req->x), req);
+		}
+	}
+
+	assert(!uterm_blend_xrgb32v(disp, (uint8_t *)out, SCREEN_W * 4, SCREEN_W, SCREEN_H, reqs,
+				    n));
+	assert(!memcmp(ref, out, sizeof(ref)));
+
+	/* requests outside of the buffer are refused */
+	reqs[0].buf = bufs[0];
+	reqs[0].x = SCREEN_W;
+	assert(uterm_blend_xrgb32v(disp, (uint8_t *)out, SCREEN_W * 4, SCREEN_W, SCREEN_H, reqs,
+				   1) == -EINVAL);
+
+	/* so is a fill */
+	reqs[0].flags = UTERM_BLEND_FILL;
+	reqs[0].buf = NULL;
+	assert(uterm_blend_xrgb32v(disp, (uint8_t *)out, SCREEN_W * 4, SCREEN_W, SCREEN_H, reqs,
+				   1) == -EINVAL);
+
+	/* clearing fills every pixel of the rectangle and nothing else */
+	memset(out, 0, sizeof(out));
+	uterm_blend_fill_xrgb32((uint8_t *)&out[SCREEN_W + 3], SCREEN_W * 4, SCREEN_W - 5, 2,
+				0x123456);
+	for (y = 0; y < SCREEN_H; ++y)
+		for (x = 0; x < SCREEN_W; ++x)
+			assert(out[y * SCREEN_W + x] ==
+			       ((y == 1 || y == 2) && x >= 3 && x < SCREEN_W - 2 ? 0x123456 : 0));
+
+	for (i = 0; i < 4; ++i)
+		free(bufs[i]);
+}
+
+static unsigned int converted;
+
+static void count_convert(struct uterm_display *disp, uint32_t *pix)
+{
+	++converted;
+}
+
+/* threads blending into one display each find their colors in the tables */
+static void *lut_thread(void *data)
+{
+	struct uterm_display *disp = data;
+	struct uterm_video_blend_req req;
+	const uint32_t *lut;
+	unsigned int i;
+
+	memset(&req, 0, sizeof(req));
+	req.fr = 255;
+	for (i = 0; i < 20000; ++i) {
+		req.bg = i % (2 * UTERM_BLEND_LUT_MAX);
+		lut = uterm_blend_get_lut(disp, &req);
+		assert(lut && lut[0] == blend_pixel(&req, 0) && lut[255] == blend_pixel(&req, 255));
+		uterm_blend_put_lut(disp, lut);
+	}
+
+	return NULL;
+}
+
+static void check_luts(struct uterm_display *disp)
+{
+	struct uterm_video_blend_req req;
+	const uint32_t *lut, *first, *pinned[UTERM_BLEND_LUT_MAX + 1];
+	pthread_t threads[4];
+	uint32_t line[256];
+	uint8_t src[256];
+	unsigned int i;
+
+	for (i = 0; i < 256; ++i)
+		src[i] = i;
+
+	/* a table blends like the kernel, and is filled once */
+	memset(&req, 0, sizeof(req));
+	req.fr = 10;
+	req.fg = 200;
+	req.bb = 77;
+	disp->blend_lut_convert = count_convert;
+	first = uterm_blend_get_lut(disp, &req);
+	assert(first && converted == 1);
+	blend_line_scalar(line, src, 256, &req);
+	assert(!memcmp(line, first, sizeof(line)));
+	uterm_blend_put_lut(disp, first);
+	assert(uterm_blend_get_lut(disp, &req) == first && converted == 1);
+	uterm_blend_put_lut(disp, first);
+
+	/* the least recently used table is replaced once all are taken */
+	for (i = 1; i < UTERM_BLEND_LUT_MAX; ++i) {
+		req.bg = i;
+		lut = uterm_blend_get_lut(disp, &req);
+		assert(lut);
+		uterm_blend_put_lut(disp, lut);
+	}
+	assert(disp->blend_lut_num == UTERM_BLEND_LUT_MAX);
+	req.bg = 0;
+	assert(uterm_blend_get_lut(disp, &req) == first);
+	uterm_blend_put_lut(disp, first);
+	req.bg = UTERM_BLEND_LUT_MAX;
+	converted = 0;
+	lut = uterm_blend_get_lut(disp, &req);
+	assert(lut && lut != first && converted == 1);
+	uterm_blend_put_lut(disp, lut);
+	assert(disp->blend_lut_num == UTERM_BLEND_LUT_MAX);
+	req.bg = 0;
+	assert(uterm_blend_get_lut(disp, &req) == first && converted == 1);
+	uterm_blend_put_lut(disp, first);
+	req.bg = 1;
+	lut = uterm_blend_get_lut(disp, &req);
+	assert(lut && converted == 2);
+	uterm_blend_put_lut(disp, lut);
+
+	/* a pinned table is not refilled, the others are; extra tables go once unused */
+	req.bg = 0;
+	assert(uterm_blend_get_lut(disp, &req) == first);
+	for (i = 1; i <= UTERM_BLEND_LUT_MAX; ++i) {
+		req.br = i;
+		lut = uterm_blend_get_lut(disp, &req);
+		assert(lut && lut != first);
+		uterm_blend_put_lut(disp, lut);
+	}
+	req.br = 0;
+	assert(uterm_blend_get_lut(disp, &req) == first && converted == 2 + UTERM_BLEND_LUT_MAX);
+	uterm_blend_put_lut(disp, first);
+	uterm_blend_put_lut(disp, first);
+	for (i = 0; i <= UTERM_BLEND_LUT_MAX; ++i) {
+		req.br = 100 + i;
+		pinned[i] = uterm_blend_get_lut(disp, &req);
+		assert(pinned[i]);
+	}
+	assert(disp->blend_lut_num == UTERM_BLEND_LUT_MAX + 1);
+	for (i = 0; i <= UTERM_BLEND_LUT_MAX; ++i)
+		uterm_blend_put_lut(disp, pinned[i]);
+	assert(disp->blend_lut_num == UTERM_BLEND_LUT_MAX);
+
+	disp->blend_lut_convert = NULL;
+	for (i = 0; i < 4; ++i)
+		assert(!pthread_create(&threads[i], NULL, lut_thread, disp));
+	for (i = 0; i < 4; ++i)
+		assert(!pthread_join(threads[i], NULL));
+	assert(disp->blend_lut_num == UTERM_BLEND_LUT_MAX);
+
+	uterm_blend_flush_luts(disp);
+	assert(shl_dlist_empty(&disp->blend_luts) && !disp->blend_lut_num);
+}
+
+int main(void)
+{
+	struct uterm_display disp;
+	struct uterm_video_blend_req req;
+	uint32_t i;
+
+	/* the scalar kernel divides by 255 exactly */
+	memset(&req, 0, sizeof(req));
+	req.fr = req.fg = req.fb = 255;
+	for (i = 0; i < 256; ++i)
+		assert(blend_pixel(&req, i) == ((i << 16) | (i << 8) | i));
+
+#ifdef HAVE_SSE2_KERNEL
+	check_kernel("sse2", blend_line_sse2);
+#endif
+#ifdef HAVE_AVX2_KERNEL
+	if (__builtin_cpu_supports("avx2"))
+		check_kernel("avx2", blend_line_avx2);
+#endif
+#ifdef HAVE_NEON_KERNEL
+	check_kernel("neon", blend_line_neon);
+#endif
+	check_kernel("dispatch", uterm_blend_xrgb32_line);
+	check_mono_kernel("mono scalar", blend_mono_scalar);
+#ifdef HAVE_SSE2_KERNEL
+	check_mono_kernel("mono sse2", blend_mono_sse2);
+#endif
+#ifdef HAVE_NEON_KERNEL
+	check_mono_kernel("mono neon", blend_mono_neon);
+#endif
+	check_argb_kernel("argb scalar", blend_argb_scalar);
+#ifdef HAVE_SSE2_KERNEL
+	check_argb_kernel("argb sse2", blend_argb_sse2);
+#endif
+	check_tiled(NULL);
+
+	memset(&disp, 0, sizeof(disp));
+	pthread_mutex_init(&disp.blend_lut_lock, NULL);
+	shl_dlist_init(&disp.blend_luts);
+	check_luts(&disp);
+
+	/* tables replace the scalar kernel only */
+	check_tiled(&disp);
+	assert(!disp.blend_lut_num);
+	blend_line = blend_line_scalar;
+	check_tiled(&disp);
+	assert(disp.blend_lut_num);
+	uterm_blend_flush_luts(&disp);
+	check_argb_tiled(&disp);
+	uterm_blend_flush_luts(&disp);
+
+	return 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * Check that a dispatch handles ready fds by priority, lets high priority fds
+ * cut in a limited number of times, handles every ready fd at once, polls again
+ * for edge-triggered fds and runs idle sources added while dispatching at its
+ * end, and that it dispatches fds queued with ev_fd_repoll() again without a
+ * new event. Also check that readers deliver data in order, yield, report EOF and can
+ * be removed with a read in flight, with io_uring and with read().
+ * Callbacks queued from another thread run in order and wake the eloop up, and
+ * the status of a child reaped by one eloop reaches the others.
+ * We include the implementation to access the internal state.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../src/eloop.c"
+
+#define FD_NUM 100
+
+static char order[16];
+static unsigned int order_len;
+
+static void drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void prio_cb(struct ev_fd *fd, int mask, void *data)
+{
+	order[order_len++] = *(const char *)data;
+	drain(fd->fd);
+}
+
+static unsigned int called;
+
+static void count_cb(struct ev_fd *fd, int mask, void *data)
+{
+	++called;
+	drain(fd->fd);
+}
+
+/* becomes ready once more while it is dispatched */
+static void et_cb(struct ev_fd *fd, int mask, void *data)
+{
+	int *pipe = data;
+
+	drain(fd->fd);
+	if (!called++)
+		assert(write(pipe[1], "x", 1) == 1);
+}
+
+/* makes the high priority pipe ready while a normal fd is dispatched */
+static void wake_cb(struct ev_fd *fd, int mask, void *data)
+{
+	int *pipe = data;
+
+	order[order_len++] = 'n';
+	drain(fd->fd);
+	assert(write(pipe[1], "x", 1) == 1);
+}
+
+static void high_cb(struct ev_fd *fd, int mask, void *data)
+{
+	++called;
+	drain(fd->fd);
+}
+
+static unsigned int idled;
+
+static void idle_cb(struct ev_eloop *loop, void *unused, void *data)
+{
+	++idled;
+}
+
+static void defer_cb(struct ev_fd *fd, int mask, void *data)
+{
+	drain(fd->fd);
+	assert(!ev_eloop_register_idle_cb(fd->loop, idle_cb, NULL, EV_ONESHOT));
+}
+
+/* handles one byte per dispatch of an edge-triggered fd */
+static void repoll_cb(struct ev_fd *fd, int mask, void *data)
+{
+	char c;
+
+	++called;
+	assert(mask == EV_READABLE);
+	if (read(fd->fd, &c, 1) == 1)
+		assert(!ev_fd_repoll(fd, EV_READABLE));
+}
+
+static void new_pipe(int *p)
+{
+	assert(!pipe(p));
+	assert(!fcntl(p[0], F_SETFL, O_NONBLOCK));
+}
+
+static char got[64];
+static size_t got_len;
+static unsigned int eofs;
+static bool yielding;
+
+static void reader_cb(struct ev_reader *rd, const char *buf, ssize_t len, void *data)
+{
+	if (len <= 0) {
+		assert(!buf && !len);
+		++eofs;
+		return;
+	}
+
+	assert(got_len + len <= sizeof(got));
+	memcpy(&got[got_len], buf, len);
+	got_len += len;
+	if (yielding)
+		ev_reader_yield(rd);
+}
+
+static void rm_reader_cb(struct ev_reader *rd, const char *buf, ssize_t len, void *data)
+{
+	++called;
+	ev_eloop_rm_reader(rd);
+}
+
+static void test_reader(struct ev_eloop *loop, bool uring)
+{
+	static const char msg[] = "0123456789abcdef";
+	struct ev_reader *rd;
+	unsigned int i;
+	int p[2];
+
+	loop->uring_broken = !uring;
+	got_len = 0;
+	eofs = 0;
+	called = 0;
+
+	/* chunks arrive in order and yielding leaves the rest for later */
+	new_pipe(p);
+	assert(!ev_eloop_new_reader(loop, &rd, p[0], 1, reader_cb, NULL));
+	assert(rd->uring == (uring && loop->uring));
+	yielding = true;
+	assert(write(p[1], msg, 16) == 16);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(got_len && got_len <= EV_ELOOP_ROUNDS);
+	for (i = 0; i < 64 && got_len < 16; ++i)
+		assert(!ev_eloop_dispatch(loop, 0));
+	assert(got_len == 16 && !memcmp(got, msg, 16));
+	yielding = false;
+
+	/* EOF is reported once */
+	close(p[1]);
+	for (i = 0; i < 4; ++i)
+		assert(!ev_eloop_dispatch(loop, 0));
+	assert(eofs == 1);
+	ev_eloop_rm_reader(rd);
+	close(p[0]);
+
+	/* a reader can remove itself */
+	new_pipe(p);
+	assert(!ev_eloop_new_reader(loop, &rd, p[0], 4, rm_reader_cb, NULL));
+	assert(write(p[1], msg, 16) == 16);
+	for (i = 0; i < 4; ++i)
+		assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == 1);
+	close(p[0]);
+	close(p[1]);
+	assert(!loop->fd_num);
+}
+
+static void queued_cb(struct ev_eloop *loop, void *unused, void *data)
+{
+	order[order_len++] = *(char *)data;
+}
+
+static void *queue_thread(void *data)
+{
+	static char names[] = "abc";
+	struct ev_eloop *loop = data;
+	unsigned int i;
+
+	for (i = 0; i < 3; ++i)
+		assert(!ev_eloop_queue_cb(loop, queued_cb, &names[i]));
+
+	return NULL;
+}
+
+static pid_t reaped[2];
+static int reaped_status[2];
+
+static void child_cb(struct ev_eloop *loop, struct ev_child_data *chld, void *data)
+{
+	int *idx = data;
+
+	reaped[*idx] = chld->pid;
+	reaped_status[*idx] = chld->status;
+}
+
+static void test_queue(struct ev_eloop *loop)
+{
+	static int idx[2] = {0, 1};
+	struct ev_eloop *other;
+	pthread_t thread;
+	unsigned int i;
+	pid_t pid;
+
+	/* queued callbacks wake up a blocking dispatch and run in order */
+	order_len = 0;
+	assert(!pthread_create(&thread, NULL, queue_thread, loop));
+	for (i = 0; i < 100 && order_len < 3; ++i)
+		assert(!ev_eloop_dispatch(loop, 1000));
+	assert(!pthread_join(thread, NULL));
+	assert(order_len == 3 && !memcmp(order, "abc", 3) && !loop->queued);
+
+	/* whichever eloop reaps the child, both get its status */
+	assert(!ev_eloop_new(&other));
+	assert(!ev_eloop_register_child_cb(loop, child_cb, &idx[0]));
+	assert(!ev_eloop_register_child_cb(other, child_cb, &idx[1]));
+	pid = fork();
+	assert(pid >= 0);
+	if (!pid)
+		_exit(7);
+	for (i = 0; i < 100 && (!reaped[0] || !reaped[1]); ++i) {
+		assert(!ev_eloop_dispatch(loop, 10));
+		assert(!ev_eloop_dispatch(other, 10));
+	}
+	assert(reaped[0] == pid && reaped[1] == pid);
+	assert(WIFEXITED(reaped_status[1]) && WEXITSTATUS(reaped_status[1]) == 7);
+	ev_eloop_unregister_child_cb(other, child_cb, &idx[1]);
+	ev_eloop_unregister_child_cb(loop, child_cb, &idx[0]);
+	assert(shl_dlist_empty(&chld_loops));
+
+	/* callbacks still queued when the eloop goes away are dropped */
+	assert(!ev_eloop_queue_cb(other, queued_cb, NULL));
+	ev_eloop_unref(other);
+}
+
+int main(void)
+{
+	static const int masks[] = {
+		EV_READABLE | EV_PRIO_LOW,
+		EV_READABLE,
+		EV_READABLE | EV_PRIO_HIGH,
+	};
+	static char names[] = "lnh";
+	struct ev_eloop *loop;
+	struct ev_fd *fds[FD_NUM];
+	struct ev_reader *rd;
+	struct pollfd pfd;
+	int pipes[FD_NUM][2];
+	unsigned int i;
+
+	assert(!ev_eloop_new(&loop));
+
+	/* high priority first, no matter in which order they were added */
+	for (i = 0; i < 3; ++i) {
+		new_pipe(pipes[i]);
+		assert(!ev_eloop_new_fd(loop, &fds[i], pipes[i][0], masks[i], prio_cb, &names[i]));
+		assert(write(pipes[i][1], "x", 1) == 1);
+	}
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(order_len == 3 && !memcmp(order, "hnl", 3));
+	assert(loop->stats.wakeups == 1 && loop->stats.events == 3);
+	for (i = 0; i < 3; ++i)
+		ev_eloop_rm_fd(fds[i]);
+
+	/* a high priority fd cuts in between the others, but not forever */
+	called = 0;
+	order_len = 0;
+	new_pipe(pipes[0]);
+	assert(!ev_eloop_new_fd(loop, &fds[0], pipes[0][0], EV_READABLE | EV_PRIO_HIGH, high_cb,
+				NULL));
+	assert(loop->hi_num == 1);
+	for (i = 1; i <= EV_ELOOP_PREEMPT + 2; ++i) {
+		new_pipe(pipes[i]);
+		assert(!ev_eloop_new_fd(loop, &fds[i], pipes[i][0], EV_READABLE, wake_cb, pipes[0]));
+		assert(write(pipes[i][1], "x", 1) == 1);
+	}
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(order_len == EV_ELOOP_PREEMPT + 2 && called == EV_ELOOP_PREEMPT);
+	assert(loop->stats.preempted == EV_ELOOP_PREEMPT);
+	assert(ev_eloop_high_pending(loop));
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == EV_ELOOP_PREEMPT + 1 && !ev_eloop_high_pending(loop));
+
+	/* moving an fd between priorities keeps it registered */
+	assert(!ev_fd_update(fds[0], EV_READABLE));
+	assert(!loop->hi_num);
+	assert(write(pipes[0][1], "x", 1) == 1);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == EV_ELOOP_PREEMPT + 2);
+	for (i = 0; i <= EV_ELOOP_PREEMPT + 2; ++i) {
+		ev_eloop_rm_fd(fds[i]);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+
+	/* nothing ready */
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(loop->stats.empty_wakeups == 1);
+
+	/* many ready fds are handled in a single dispatch */
+	called = 0;
+	for (i = 0; i < FD_NUM; ++i) {
+		new_pipe(pipes[i]);
+		assert(!ev_eloop_new_fd(loop, &fds[i], pipes[i][0], EV_READABLE, count_cb, NULL));
+		assert(write(pipes[i][1], "x", 1) == 1);
+	}
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == FD_NUM && loop->cur_fds_size > FD_NUM);
+	for (i = 0; i < FD_NUM; ++i) {
+		ev_eloop_rm_fd(fds[i]);
+		close(pipes[i][1]);
+	}
+	assert(!loop->fd_num);
+
+	/* an edge-triggered fd that got ready again is handled in the same dispatch */
+	called = 0;
+	new_pipe(pipes[0]);
+	assert(!ev_eloop_new_fd(loop, &fds[0], pipes[0][0], EV_READABLE | EV_ET, et_cb, pipes[0]));
+	assert(write(pipes[0][1], "x", 1) == 1);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == 2 && loop->stats.extra_rounds == 1);
+	ev_eloop_rm_fd(fds[0]);
+
+	/* a repolled fd is dispatched again until drained, a parent loop sees it */
+	called = 0;
+	assert(!ev_eloop_new_fd(loop, &fds[0], pipes[0][0], EV_READABLE | EV_ET, repoll_cb, NULL));
+	assert(write(pipes[0][1], "xxxxxxxx", 8) == 8);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == EV_ELOOP_ROUNDS && loop->stats.repolls == EV_ELOOP_ROUNDS - 1);
+	pfd.fd = ev_eloop_get_fd(loop);
+	pfd.events = POLLIN;
+	assert(poll(&pfd, 1, 0) == 1);
+	for (i = 0; i < 4; ++i)
+		assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == 9 && !loop->idle_armed);
+
+	/* a disabled fd is dropped from the queue */
+	assert(write(pipes[0][1], "xxxxxxxx", 8) == 8);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == 9 + EV_ELOOP_ROUNDS);
+	ev_fd_disable(fds[0]);
+	assert(shl_dlist_empty(&loop->repoll_list));
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(called == 9 + EV_ELOOP_ROUNDS);
+	ev_eloop_rm_fd(fds[0]);
+	drain(pipes[0][0]);
+
+	/* an idle source added by a callback runs before the dispatch returns */
+	assert(!ev_eloop_new_fd(loop, &fds[0], pipes[0][0], EV_READABLE, defer_cb, NULL));
+	assert(write(pipes[0][1], "x", 1) == 1);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(idled == 1 && loop->stats.idle_coalesced == 1 && !loop->idle_armed);
+	ev_eloop_rm_fd(fds[0]);
+	close(pipes[0][0]);
+	close(pipes[0][1]);
+
+	/* outside of a dispatch, the eventfd wakes up the next one */
+	assert(!ev_eloop_register_idle_cb(loop, idle_cb, NULL, EV_ONESHOT));
+	assert(loop->idle_armed);
+	assert(!ev_eloop_dispatch(loop, 0));
+	assert(idled == 2 && !loop->idle_armed);
+
+	test_reader(loop, true);
+	test_reader(loop, false);
+	assert(!loop->uring);
+
+	/* removing a reader with a read in flight */
+	loop->uring_broken = false;
+	new_pipe(pipes[0]);
+	assert(!ev_eloop_new_reader(loop, &rd, pipes[0][0], 4, reader_cb, NULL));
+	assert(!loop->uring || rd->armed);
+	ev_eloop_rm_reader(rd);
+	close(pipes[0][0]);
+	close(pipes[0][1]);
+
+	test_queue(loop);
+
+	ev_eloop_unref(loop);
+	return 0;
+}
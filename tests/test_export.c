@@ -0,0 +1,209 @@
+/*
+ * Check the frame export on the memory video backend: a client gets the buffer
+ * on connect, the whole first frame and then only the damage of each frame,
+ * and the buffer holds the frame that was swapped. A screenshot is a sealed
+ * copy of the last frame on this backend. Nothing is mirrored once the last
+ * client left.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "eloop.h"
+#include "kmscon_export.h"
+#include "uterm_video.h"
+
+#define SCREEN_W 64
+#define SCREEN_H 32
+
+static struct uterm_display *display;
+
+static void video_event(struct uterm_video *video, struct uterm_video_hotplug *ev, void *data)
+{
+	if (ev->action == UTERM_NEW)
+		display = ev->display;
+	else if (ev->action == UTERM_GONE)
+		display = NULL;
+}
+
+struct msg {
+	struct kmscon_export_msg hdr;
+	union {
+		struct uterm_video_rect rects[4];
+		struct kmscon_export_shot shot;
+	};
+};
+
+/* dispatch until the client got a message, which returns its memfd, if any */
+static int receive(struct ev_eloop *eloop, int fd, struct msg *msg)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {msg, sizeof(*msg)};
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int memfd = -1;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	while ((len = recvmsg(fd, &mh, MSG_DONTWAIT)) < 0) {
+		assert(errno == EAGAIN);
+		assert(!ev_eloop_dispatch(eloop, 10));
+	}
+	if (msg->hdr.type == KMSCON_EXPORT_SCREENSHOT)
+		assert(len == sizeof(msg->hdr) + sizeof(msg->shot));
+	else
+		assert(len == sizeof(msg->hdr) + msg->hdr.num * sizeof(msg->rects[0]));
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg)
+		memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+	return memfd;
+}
+
+static int connect_client(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	assert(fd >= 0);
+	assert(!connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+	return fd;
+}
+
+static void fill(struct ev_eloop *eloop, unsigned int x, unsigned int y, unsigned int w,
+		 unsigned int h, uint32_t val)
+{
+	struct uterm_video_blend_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.flags = UTERM_BLEND_FILL;
+	req.x = x;
+	req.y = y;
+	req.width = w;
+	req.height = h;
+	req.br = val >> 16;
+	req.bg = val >> 8;
+	req.bb = val;
+	assert(!uterm_display_fake_blendv(display, &req, 1));
+}
+
+static void swap(struct ev_eloop *eloop)
+{
+	while (uterm_display_is_swapping(display))
+		assert(!ev_eloop_dispatch(eloop, 10));
+	assert(!uterm_display_swap(display));
+}
+
+int main(void)
+{
+	char path[] = "/tmp/test_export-XXXXXX";
+	struct uterm_video_rect damage = {8, 4, 16, 8};
+	struct kmscon_export *exp;
+	struct uterm_video *video;
+	struct ev_eloop *eloop;
+	const uint32_t *pix;
+	struct msg msg;
+	int fd, memfd, shot;
+	uint32_t val;
+
+	assert(mkdtemp(path));
+	strcat(path, "/x.sock");
+
+	assert(!ev_eloop_new(&eloop));
+	uterm_register_memory();
+	assert(!uterm_video_new(&video, eloop, "64x32@1000", "memory", 0, 0, false));
+	assert(!uterm_video_register_cb(video, video_event, NULL));
+	assert(!uterm_video_wake_up(video));
+	while (!display)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+
+	assert(!kmscon_export_new(&exp, eloop, display, path));
+
+	/* nobody watches, so nothing is mirrored */
+	assert(!uterm_display_clear(display, 0, 0, 0x40));
+	swap(eloop);
+
+	fd = connect_client(path);
+	memfd = receive(eloop, fd, &msg);
+	assert(memfd >= 0);
+	assert(msg.hdr.type == KMSCON_EXPORT_MODE);
+	assert(msg.hdr.width == SCREEN_W && msg.hdr.height == SCREEN_H);
+	assert(msg.hdr.stride == SCREEN_W * 4);
+	pix = mmap(NULL, SCREEN_W * SCREEN_H * 4, PROT_READ, MAP_SHARED, memfd, 0);
+	assert(pix != MAP_FAILED);
+
+	/* the first frame is sent whole */
+	swap(eloop);
+	assert(receive(eloop, fd, &msg) < 0);
+	assert(msg.hdr.type == KMSCON_EXPORT_FRAME);
+	assert(msg.hdr.num == 1);
+	assert(msg.rects[0].x2 == SCREEN_W && msg.rects[0].y2 == SCREEN_H);
+	assert(pix[0] == 0x40 && pix[SCREEN_W * SCREEN_H - 1] == 0x40);
+
+	/* then only its damage */
+	fill(eloop, 8, 4, 8, 4, 0xff0000);
+	uterm_display_set_damage(display, 1, &damage);
+	swap(eloop);
+	assert(receive(eloop, fd, &msg) < 0);
+	assert(msg.hdr.type == KMSCON_EXPORT_FRAME);
+	assert(msg.hdr.num == 1);
+	assert(!memcmp(&msg.rects[0], &damage, sizeof(damage)));
+	assert((pix[4 * SCREEN_W + 8] & 0xffffff) == 0xff0000);
+	assert(pix[4 * SCREEN_W + 7] == 0x40);
+
+	/* a change outside the damage is not copied */
+	fill(eloop, 0, 0, 1, 1, 0x00ff00);
+	uterm_display_set_damage(display, 1, &damage);
+	swap(eloop);
+	assert(receive(eloop, fd, &msg) < 0);
+	assert(pix[0] == 0x40);
+
+	/* a screenshot is the frame on screen, which the client can't change */
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.type = KMSCON_EXPORT_SCREENSHOT;
+	assert(send(fd, &msg.hdr, sizeof(msg.hdr), 0) == sizeof(msg.hdr));
+	shot = receive(eloop, fd, &msg);
+	assert(shot >= 0);
+	assert(msg.hdr.type == KMSCON_EXPORT_SCREENSHOT);
+	assert(msg.hdr.width == SCREEN_W && msg.hdr.height == SCREEN_H);
+	assert(msg.shot.format == UTERM_FOURCC_XRGB8888 && !msg.shot.dmabuf);
+	assert(pread(shot, &val, sizeof(val), 0) == sizeof(val) && val == 0x40);
+	assert(pread(shot, &val, sizeof(val), (4 * SCREEN_W + 8) * 4) == sizeof(val));
+	assert((val & 0xffffff) == 0xff0000);
+	assert(pwrite(shot, &val, sizeof(val), 0) < 0);
+	assert(mmap(NULL, 4096, PROT_WRITE, MAP_SHARED, shot, 0) == MAP_FAILED);
+	close(shot);
+
+	/* the last client leaving drops the mirror */
+	close(fd);
+	munmap((void *)pix, SCREEN_W * SCREEN_H * 4);
+	close(memfd);
+	assert(!ev_eloop_dispatch(eloop, 10));
+	swap(eloop);
+
+	kmscon_export_free(exp);
+	assert(access(path, F_OK));
+	uterm_video_unref(video);
+	ev_eloop_unref(eloop);
+	*strrchr(path, '/') = 0;
+	rmdir(path);
+	printf("export test passed\n");
+	return 0;
+}
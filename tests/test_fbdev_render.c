@@ -0,0 +1,334 @@
+/*
+ * Check that the per-format fbdev blend loops and their color tables give the
+ * same pixels as converting each blended pixel on its own, with and without
+ * dithering. Fills and spans are checked the same way, and all of it again
+ * with one bit per pixel glyphs and with color glyphs. Last, flushing the
+ * shadow buffer must copy only the damage.
+ * We include the implementation to access the static helpers.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/uterm_fbdev_render.c"
+
+/* no frames are exported here, uterm_video.c isn't linked */
+int uterm_video_export_copy(struct uterm_video_export *out, const uint8_t *src,
+			    unsigned int stride, unsigned int width, unsigned int height)
+{
+	return -EOPNOTSUPP;
+}
+
+#define SCREEN_W 96
+#define SCREEN_H 64
+#define GLYPH_W 8
+#define GLYPH_H 16
+/* more color pairs than tables, so they get replaced */
+#define PAIRS (UTERM_BLEND_LUT_MAX + 4)
+
+static struct fbdev_display fbdev;
+static struct uterm_display disp = {.data = &fbdev};
+
+static void set_format(unsigned int Bpp, unsigned int len_r, unsigned int len_g,
+		       unsigned int len_b, unsigned int off_r, unsigned int off_g,
+		       unsigned int off_b, bool dither)
+{
+	fbdev.Bpp = Bpp;
+	fbdev.stride = SCREEN_W * Bpp;
+	fbdev.xres = SCREEN_W;
+	fbdev.yres = SCREEN_H;
+	fbdev.len_r = len_r;
+	fbdev.len_g = len_g;
+	fbdev.len_b = len_b;
+	fbdev.off_r = off_r;
+	fbdev.off_g = off_g;
+	fbdev.off_b = off_b;
+	fbdev.rgb16 = Bpp == 2 && len_r == 5 && len_g == 6 && len_b == 5 && off_r == 11;
+	fbdev.xrgb32 = false;
+	disp.flags = dither ? DISPLAY_DITHERING : 0;
+	uterm_fbdev_display_setup_blend(&disp);
+}
+
+static void store(uint8_t *dst, unsigned int Bpp, uint_fast32_t val)
+{
+	if (Bpp == 2)
+		*(uint16_t *)dst = val;
+	else if (Bpp == 3)
+		write_24bit(dst, val);
+	else
+		*(uint32_t *)dst = val;
+}
+
+/* row @y of @buf blended to XRGB32 */
+static void ref_line(uint32_t *line, const struct uterm_video_buffer *buf, unsigned int y,
+		     unsigned int width, const struct uterm_video_blend_req *req)
+{
+	uint8_t alpha[GLYPH_W];
+
+	if (buf->format == UTERM_FORMAT_ARGB32) {
+		uterm_blend_argb32_line(line, &buf->data[y * buf->stride], width,
+					(req->br << 16) | (req->bg << 8) | req->bb);
+		return;
+	}
+
+	uterm_video_buffer_unpack(alpha, buf, y);
+	uterm_blend_xrgb32_line(line, alpha, width, req);
+}
+
+/* blend every pixel to XRGB32 and convert it on its own */
+static void blend_ref(uint8_t *map, const struct uterm_video_blend_req *req, size_t num)
+{
+	uint32_t line[GLYPH_W];
+	unsigned int width, height, x, y, j, off;
+	size_t i;
+
+	for (i = 0; i < num; ++i, ++req) {
+		if (req->flags & UTERM_BLEND_FILL) {
+			for (y = 0; y < req->height; ++y)
+				for (x = 0; x < req->width; ++x)
+					store(&map[(req->y + y) * fbdev.stride +
+						   (req->x + x) * fbdev.Bpp],
+					      fbdev.Bpp,
+					      xrgb32_to_device(&disp, (req->br << 16) |
+									 (req->bg << 8) | req->bb));
+			continue;
+		}
+		if (req->flags & UTERM_BLEND_SPAN) {
+			for (y = 0; y < req->height; ++y) {
+				for (j = 0, off = req->x; j < req->buf_num; off += req->bufs[j++]->width) {
+					width = min(req->bufs[j]->width, SCREEN_W - off);
+					ref_line(line, req->bufs[j], y, width, req);
+					for (x = 0; x < width; ++x)
+						store(&map[(req->y + y) * fbdev.stride +
+							   (off + x) * fbdev.Bpp],
+						      fbdev.Bpp, xrgb32_to_device(&disp, line[x]));
+				}
+			}
+			continue;
+		}
+		width = min(req->buf->width, SCREEN_W - req->x);
+		height = min(req->buf->height, SCREEN_H - req->y);
+		for (y = 0; y < height; ++y) {
+			ref_line(line, req->buf, y, width, req);
+			for (x = 0; x < width; ++x)
+				store(&map[(req->y + y) * fbdev.stride + (req->x + x) * fbdev.Bpp],
+				      fbdev.Bpp, xrgb32_to_device(&disp, line[x]));
+		}
+	}
+}
+
+static void check_format(const char *name, const struct uterm_video_blend_req *req, size_t num)
+{
+	static uint8_t ref[SCREEN_W * SCREEN_H * 4], out[SCREEN_W * SCREEN_H * 4];
+	unsigned int round;
+
+	assert(fbdev.blend_line && fbdev.blend_mono);
+
+	memset(ref, 0, sizeof(ref));
+	fbdev.dither_r = fbdev.dither_g = fbdev.dither_b = 0;
+	blend_ref(ref, req, num);
+
+	/* a second round runs with the tables already filled */
+	memset(out, 0, sizeof(out));
+	fbdev.dither_r = fbdev.dither_g = fbdev.dither_b = 0;
+	fbdev.map = out;
+	for (round = 0; round < 2; ++round) {
+		assert(!uterm_fbdev_display_fake_blendv(&disp, req, num));
+		if (memcmp(ref, out, sizeof(out))) {
+			fprintf(stderr, "%s: mismatch in round %u\n", name, round);
+			abort();
+		}
+		memset(out, 0, sizeof(out));
+		fbdev.dither_r = fbdev.dither_g = fbdev.dither_b = 0;
+	}
+}
+
+static void check_formats(const struct uterm_video_blend_req *reqs, size_t num)
+{
+	set_format(2, 5, 6, 5, 11, 5, 0, false);
+	assert(fbdev.lut_device && fbdev.blend_line == blend_line_lut16);
+	assert(fbdev.blend_mono == blend_mono_lut16);
+	check_format("rgb565", reqs, num);
+
+	set_format(2, 5, 6, 5, 11, 5, 0, true);
+	assert(!fbdev.lut_device && fbdev.blend_line == blend_line_dither_rgb16);
+	assert(fbdev.blend_mono == blend_mono_dither_rgb16);
+	check_format("rgb565 dithered", reqs, num);
+
+	set_format(2, 5, 5, 5, 10, 5, 0, true);
+	assert(!fbdev.lut_device && fbdev.blend_line == blend_line_dither16);
+	check_format("xrgb1555 dithered", reqs, num);
+
+	/* dithering 8bit channels changes nothing, so the tables are used */
+	set_format(3, 8, 8, 8, 0, 8, 16, true);
+	assert(fbdev.lut_device && fbdev.blend_line == blend_line_lut24);
+	check_format("bgr888", reqs, num);
+
+	set_format(4, 8, 8, 8, 0, 8, 16, true);
+	assert(fbdev.lut_device && fbdev.blend_line == blend_line_lut32);
+	check_format("xbgr8888", reqs, num);
+
+	set_format(4, 6, 6, 6, 12, 6, 0, true);
+	assert(!fbdev.lut_device && fbdev.blend_line == blend_line_dither32);
+	check_format("rgb666 dithered", reqs, num);
+
+	set_format(1, 3, 3, 2, 5, 2, 0, false);
+	assert(!fbdev.blend_line && !fbdev.blend_mono);
+	assert(uterm_fbdev_display_fake_blendv(&disp, reqs, num) == -EFAULT);
+}
+
+static void check_flush(void)
+{
+	static uint8_t shadow[SCREEN_W * SCREEN_H * 4], map[SCREEN_W * SCREEN_H * 4];
+	struct uterm_video_rect rects[2] = {
+		{.x1 = 8, .y1 = 4, .x2 = 24, .y2 = 12},
+		{.x1 = -4, .y1 = SCREEN_H - 2, .x2 = SCREEN_W + 4, .y2 = SCREEN_H + 4},
+	};
+	unsigned int x, y;
+	bool inside;
+
+	set_format(4, 8, 8, 8, 16, 8, 0, false);
+	memset(shadow, 0xaa, sizeof(shadow));
+	memset(map, 0, sizeof(map));
+	fbdev.map = map;
+	fbdev.shadow = shadow;
+	fbdev.damage = rects;
+	fbdev.damage_len = 2;
+	fbdev.damage_set = true;
+
+	uterm_fbdev_display_flush(&disp);
+	assert(!fbdev.damage_set);
+	for (y = 0; y < SCREEN_H; ++y) {
+		for (x = 0; x < SCREEN_W; ++x) {
+			inside = (x >= 8 && x < 24 && y >= 4 && y < 12) || y >= SCREEN_H - 2;
+			assert(map[(y * SCREEN_W + x) * 4] == (inside ? 0xaa : 0));
+		}
+	}
+
+	/* without damage, everything is copied */
+	uterm_fbdev_display_flush(&disp);
+	assert(!memcmp(map, shadow, sizeof(map)));
+
+	fbdev.shadow = NULL;
+	fbdev.damage = NULL;
+}
+
+int main(void)
+{
+	struct uterm_video_buffer *buf, *mono, *color;
+	const struct uterm_video_buffer *spans[3];
+	struct uterm_video_blend_req reqs[SCREEN_W / GLYPH_W * SCREEN_H / GLYPH_H + 3], *req;
+	uint8_t colors[PAIRS][6];
+	unsigned int i, x, y;
+	size_t num = 0;
+
+	pthread_mutex_init(&disp.blend_lut_lock, NULL);
+	shl_dlist_init(&disp.blend_luts);
+	buf = malloc(sizeof(*buf) + GLYPH_W * GLYPH_H);
+	assert(buf);
+	memset(buf, 0, sizeof(*buf));
+	buf->width = GLYPH_W;
+	buf->height = GLYPH_H;
+	buf->stride = GLYPH_W;
+
+	spans[0] = spans[1] = spans[2] = buf;
+	srand(42);
+	for (i = 0; i < GLYPH_W * GLYPH_H; ++i)
+		buf->data[i] = (i % 3) ? rand() & 0xff : (i % 2) * 255;
+	for (i = 0; i < PAIRS; ++i) {
+		for (x = 0; x < 6; ++x)
+			colors[i][x] = rand() & 0xff;
+	}
+
+	/* rows of cells, the last one cut off at the right and bottom edge */
+	for (y = 0; y < SCREEN_H; y += GLYPH_H) {
+		for (x = 0; x < SCREEN_W; x += GLYPH_W) {
+			req = &reqs[num];
+			memset(req, 0, sizeof(*req));
+			req->buf = buf;
+			req->x = x;
+			req->y = y;
+			req->fr = colors[num % PAIRS][0];
+			req->fg = colors[num % PAIRS][1];
+			req->fb = colors[num % PAIRS][2];
+			req->br = colors[num % PAIRS][3];
+			req->bg = colors[num % PAIRS][4];
+			req->bb = colors[num % PAIRS][5];
+			++num;
+		}
+	}
+	reqs[num] = reqs[0];
+	reqs[num].x = SCREEN_W - GLYPH_W / 2;
+	reqs[num].y = SCREEN_H - GLYPH_H / 2;
+	++num;
+	/* a run of blank cells */
+	req = &reqs[num++];
+	memset(req, 0, sizeof(*req));
+	req->flags = UTERM_BLEND_FILL;
+	req->x = GLYPH_W;
+	req->y = GLYPH_H;
+	req->width = 5 * GLYPH_W;
+	req->height = GLYPH_H;
+	req->br = 0x80;
+	req->bg = 0x41;
+	req->bb = 0xc3;
+	/* and a span of three glyphs */
+	req = &reqs[num++];
+	*req = reqs[0];
+	req->buf = NULL;
+	req->flags = UTERM_BLEND_SPAN;
+	req->bufs = spans;
+	req->buf_num = 3;
+	req->width = 3 * GLYPH_W;
+	req->height = GLYPH_H;
+	req->x = 7 * GLYPH_W;
+	req->y = 2 * GLYPH_H;
+
+	check_formats(reqs, num);
+
+	/* the same with a mono glyph, which has a byte per row */
+	mono = malloc(sizeof(*mono) + GLYPH_H);
+	assert(mono);
+	memset(mono, 0, sizeof(*mono));
+	mono->width = GLYPH_W;
+	mono->height = GLYPH_H;
+	mono->stride = 1;
+	mono->format = UTERM_FORMAT_MONO;
+	for (i = 0; i < GLYPH_H; ++i)
+		mono->data[i] = (i % 4) ? rand() & 0xff : (i % 8) ? 0xff : 0x00;
+	for (i = 0; i < num; ++i) {
+		if (reqs[i].buf)
+			reqs[i].buf = mono;
+	}
+	spans[0] = spans[1] = spans[2] = mono;
+	check_formats(reqs, num);
+
+	/* and with a color glyph, a word per pixel drawn over the background */
+	color = malloc(sizeof(*color) + GLYPH_W * GLYPH_H * 4);
+	assert(color);
+	memset(color, 0, sizeof(*color));
+	color->width = GLYPH_W;
+	color->height = GLYPH_H;
+	color->stride = GLYPH_W * 4;
+	color->format = UTERM_FORMAT_ARGB32;
+	for (i = 0; i < GLYPH_W * GLYPH_H; ++i) {
+		x = (i % 3) ? rand() & 0xff : (i % 2) * 255;
+		((uint32_t *)color->data)[i] = x << 24 | (x / 2) << 16 | (x / 3) << 8 | x;
+	}
+	for (i = 0; i < num; ++i) {
+		if (reqs[i].buf)
+			reqs[i].buf = color;
+	}
+	spans[0] = spans[1] = spans[2] = color;
+	check_formats(reqs, num);
+	check_flush();
+
+	uterm_blend_flush_luts(&disp);
+	free(color);
+	free(mono);
+	free(buf);
+	return 0;
+}
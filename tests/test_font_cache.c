@@ -0,0 +1,311 @@
+/*
+ * Check lookups, eviction, frame pinning and batches, sharing, persistence and
+ * prerendering of the glyph cache, and the glyph coverage of fonts.
+ * We include the implementation to access the internal state.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/font_cache.c"
+
+#define GLYPH_W 8
+#define GLYPH_H 16
+
+static struct kmscon_glyph *new_glyph(unsigned int width, uint8_t fill)
+{
+	struct kmscon_glyph *g;
+	size_t size = sizeof(*g) + width * GLYPH_H;
+
+	g = malloc(size);
+	assert(g);
+	memset(g, 0, size);
+	g->buf.width = width;
+	g->buf.height = GLYPH_H;
+	g->buf.stride = width;
+	memset(g->buf.data, fill, width * GLYPH_H);
+	return g;
+}
+
+static void *get_shared_thread(void *data)
+{
+	struct kmscon_glyph_cache *cache = NULL;
+
+	assert(!kmscon_glyph_cache_get_shared(&cache, data, 100, sizeof(struct kmscon_glyph) + 64));
+	return cache;
+}
+
+static void test_shared(void)
+{
+	static const struct kmscon_font_ops ops = { .name = "test" };
+	struct kmscon_font font = { .ops = &ops }, other;
+	struct kmscon_glyph_cache *a, *b, *c, *d;
+	pthread_t thread;
+	int ret;
+
+	strcpy(font.attr.name, "monospace");
+	font.attr.width = GLYPH_W;
+	font.attr.height = GLYPH_H;
+	other = font;
+	other.attr.height = 2 * GLYPH_H;
+
+	ret = kmscon_glyph_cache_get_shared(&a, &font, 100, sizeof(struct kmscon_glyph) + 64);
+	assert(!ret);
+	assert(kmscon_glyph_cache_insert(a, 'x', 0, new_glyph(GLYPH_W, 7)));
+
+	/* same face and size, bold doesn't matter; the cache grows on demand */
+	font.attr.bold = true;
+	ret = kmscon_glyph_cache_get_shared(&b, &font, 1000, sizeof(struct kmscon_glyph) + 64);
+	assert(!ret && b == a && a->ref == 2 && a->max_entries == 1000);
+	assert(kmscon_glyph_cache_get(b, 'x', 0)->buf.data[0] == 7);
+
+	/* another size gets its own cache */
+	ret = kmscon_glyph_cache_get_shared(&c, &other, 100, sizeof(struct kmscon_glyph) + 64);
+	assert(!ret && c != a);
+
+	/* caches are not locked, so other threads get their own */
+	assert(!pthread_create(&thread, NULL, get_shared_thread, &font));
+	assert(!pthread_join(thread, (void **)&d));
+	assert(d && d != a && d->ref == 1);
+	kmscon_glyph_cache_unref(d);
+
+	kmscon_glyph_cache_unref(a);
+	assert(b->ref == 1);
+	kmscon_glyph_cache_unref(b);
+	kmscon_glyph_cache_unref(c);
+	assert(shl_dlist_empty(&shared_caches));
+}
+
+static char face_file[] = "/tmp/test_font_cache_XXXXXX";
+
+static const char *test_get_file(const struct kmscon_font *font, bool bold)
+{
+	return face_file;
+}
+
+static void test_store(void)
+{
+	static const struct kmscon_font_ops ops = {
+		.name = "test",
+		.get_file = test_get_file,
+	};
+	struct kmscon_font font = {.ops = &ops};
+	struct kmscon_glyph_cache *cache;
+	struct kmscon_glyph *g;
+	char dir[] = "/tmp/test_font_cache_dir_XXXXXX";
+	char path[PATH_MAX];
+	unsigned int i;
+	int fd, ret;
+
+	fd = mkstemp(face_file);
+	assert(fd >= 0);
+	close(fd);
+	assert(mkdtemp(dir));
+	assert(!kmscon_glyph_cache_set_dir(dir));
+
+	strcpy(font.attr.name, "monospace");
+	font.attr.width = GLYPH_W;
+	font.attr.height = GLYPH_H;
+
+	ret = kmscon_glyph_cache_get_shared(&cache, &font, 100, sizeof(struct kmscon_glyph) + 64);
+	assert(!ret && !cache->index_num);
+	for (i = 0; i < 50; ++i)
+		assert(kmscon_glyph_cache_insert(cache, 'a' + i, i % 2, new_glyph(GLYPH_W, i)));
+	/* large glyphs are saved, too */
+	assert(kmscon_glyph_cache_insert(cache, 0x4e00, 0, new_glyph(2 * GLYPH_W, 99)));
+	kmscon_glyph_cache_unref(cache);
+	store_path(path, sizeof(path), dir, store_key(&font), "");
+	assert(!access(path, R_OK));
+
+	/* the next cache finds all glyphs in the mapped file */
+	ret = kmscon_glyph_cache_get_shared(&cache, &font, 100, sizeof(struct kmscon_glyph) + 64);
+	assert(!ret && cache->index_num == 51);
+	for (i = 0; i < 50; ++i) {
+		g = kmscon_glyph_cache_get(cache, 'a' + i, i % 2);
+		assert(g && g->buf.data[GLYPH_W * GLYPH_H - 1] == i);
+		assert((uint8_t *)g >= cache->map && (uint8_t *)g < cache->map + cache->map_size);
+	}
+	g = kmscon_glyph_cache_get(cache, 0x4e00, 0);
+	assert(g && g->buf.width == 2 * GLYPH_W && g->buf.data[0] == 99);
+	assert(!kmscon_glyph_cache_get(cache, 'a', 1));
+	kmscon_glyph_cache_unref(cache);
+
+	/* changing the face file invalidates the cache */
+	fd = open(face_file, O_WRONLY | O_APPEND);
+	assert(fd >= 0 && write(fd, "x", 1) == 1);
+	close(fd);
+	ret = kmscon_glyph_cache_get_shared(&cache, &font, 100, sizeof(struct kmscon_glyph) + 64);
+	assert(!ret && !cache->index_num && !kmscon_glyph_cache_get(cache, 'a', 0));
+	kmscon_glyph_cache_unref(cache);
+
+	unlink(path);
+	unlink(face_file);
+	rmdir(dir);
+	kmscon_glyph_cache_set_dir(NULL);
+}
+
+static struct kmscon_glyph *prerender_render(struct kmscon_font *font, uint64_t id,
+					     const uint32_t *ch, size_t len, unsigned int style)
+{
+	return new_glyph(GLYPH_W, style & KMSCON_GLYPH_BOLD ? 0x80 | *ch : *ch);
+}
+
+/* the warmup only asks for codepoints below this one */
+#define ASKED_CH 0x1f600
+static unsigned int asked;
+
+static bool prerender_has_glyph(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				unsigned int style)
+{
+	if (*ch == ASKED_CH)
+		++asked;
+	return *ch != 'x' && *ch != ASKED_CH;
+}
+
+static int prerender_init(struct kmscon_font *out, const struct kmscon_font_attr *attr)
+{
+	kmscon_copy_attr(&out->attr, attr);
+	out->attr.width = GLYPH_W;
+	out->attr.height = GLYPH_H;
+	return 0;
+}
+
+static void test_prerender(void)
+{
+	static const struct kmscon_font_ops ops = {
+		.name = "prerender",
+		.init = prerender_init,
+		.has_glyph = prerender_has_glyph,
+		.render = prerender_render,
+	};
+	struct kmscon_font_attr attr = {.name = "monospace", .height = GLYPH_H};
+	struct kmscon_font *font;
+	struct kmscon_glyph_cache *cache;
+	struct kmscon_glyph *g;
+	uint32_t ch;
+
+	assert(!kmscon_font_register(&ops));
+	assert(!kmscon_font_find(&font, &attr, "prerender"));
+	assert(!kmscon_glyph_cache_prerender(&cache, font, &attr));
+	assert(cache->warm);
+
+	/* the worker never blocks lookups, wait for it to publish */
+	while (!__atomic_load_n(&cache->warm->done, __ATOMIC_ACQUIRE))
+		usleep(1000);
+
+	/* a glyph the main thread rendered itself is kept */
+	assert(kmscon_glyph_cache_insert(cache, 'a', 0, new_glyph(GLYPH_W, 1)));
+
+	g = kmscon_glyph_cache_get(cache, 'b', 0);
+	assert(!cache->warm);
+	assert(g && g->buf.data[0] == 'b');
+	assert(kmscon_glyph_cache_get(cache, 'a', 0)->buf.data[0] == 1);
+	assert(kmscon_glyph_cache_get(cache, 'b', KMSCON_GLYPH_BOLD)->buf.data[0] == (0x80 | 'b'));
+	for (ch = 0xa0; ch <= 0xff; ++ch)
+		assert(kmscon_glyph_cache_get(cache, ch, 0));
+	assert(!kmscon_glyph_cache_get(cache, 'x', 0));
+	assert(!kmscon_glyph_cache_get(cache, 0x100, 0));
+
+	kmscon_glyph_cache_unref(cache);
+
+	/* the font asks its backend once per codepoint, regular and bold */
+	ch = ASKED_CH;
+	assert(!kmscon_font_has_glyph(font, &ch, 1));
+	assert(!kmscon_font_has_glyph(font, &ch, 1));
+	assert(asked == 1 && font->coverage[0][1] && !font->coverage[1][1]);
+	assert(!kmscon_font_has_glyph_styled(font, &ch, 1, KMSCON_GLYPH_BOLD));
+	assert(!kmscon_font_has_glyph_styled(font, &ch, 1, KMSCON_GLYPH_BOLD | KMSCON_GLYPH_ITALIC));
+	assert(asked == 2);
+	ch = 'y';
+	assert(kmscon_font_has_glyph(font, &ch, 1) && kmscon_font_has_glyph(font, &ch, 1));
+
+	/* the style is passed along, the shared font is left alone */
+	g = kmscon_font_render_styled(font, 'y', &ch, 1, KMSCON_GLYPH_BOLD);
+	assert(g && g->buf.data[0] == (0x80 | 'y') && !font->attr.bold);
+	free(g);
+
+	/* dropping the cache while the worker runs is fine, too */
+	assert(!kmscon_glyph_cache_prerender(&cache, font, &attr));
+	kmscon_glyph_cache_unref(cache);
+
+	kmscon_font_unref(font);
+	kmscon_font_unregister("prerender");
+}
+
+int main(void)
+{
+	struct kmscon_glyph_cache *cache;
+	struct kmscon_glyph *g, *pinned;
+	unsigned int i, found;
+	int ret;
+
+	ret = kmscon_glyph_cache_new(&cache, 300, sizeof(*g) + GLYPH_W * GLYPH_H);
+	assert(!ret);
+
+	/* lookups are keyed on id and flags */
+	g = kmscon_glyph_cache_insert(cache, 'a', 0, new_glyph(GLYPH_W, 1));
+	assert(g && g->buf.data[0] == 1);
+	g = kmscon_glyph_cache_insert(cache, 'a', KMSCON_GLYPH_BOLD, new_glyph(GLYPH_W, 2));
+	assert(g && g->buf.data[0] == 2);
+	assert(kmscon_glyph_cache_get(cache, 'a', 0)->buf.data[0] == 1);
+	assert(kmscon_glyph_cache_get(cache, 'a', KMSCON_GLYPH_BOLD)->buf.data[0] == 2);
+	assert(!kmscon_glyph_cache_get(cache, 'b', 0));
+
+	/* glyphs that don't fit a slab slot are kept on their own */
+	g = kmscon_glyph_cache_insert(cache, 'w', 0, new_glyph(2 * GLYPH_W, 3));
+	assert(g && g->buf.data[2 * GLYPH_W * GLYPH_H - 1] == 3);
+
+	/* glyphs used in the current frame are never evicted */
+	kmscon_glyph_cache_next_frame(cache);
+	pinned = kmscon_glyph_cache_get(cache, 'a', 0);
+	for (i = 0; i < 310; ++i) {
+		g = kmscon_glyph_cache_insert(cache, 1000 + i, 0, new_glyph(GLYPH_W, i));
+		if (i < 299) {
+			/* free slots first, then the two glyphs of the old frame */
+			assert(g);
+		} else {
+			/* everything else got pinned by this frame */
+			assert(!g);
+		}
+	}
+	assert(kmscon_glyph_cache_get(cache, 'a', 0) == pinned);
+
+	/* in a new frame, old glyphs get evicted and the table stays consistent */
+	for (i = 0; i < 5000; ++i) {
+		if (!(i % 100))
+			kmscon_glyph_cache_next_frame(cache);
+		g = kmscon_glyph_cache_insert(cache, 10000 + i, i % 2, new_glyph(GLYPH_W, i));
+		assert(g && g->buf.data[0] == (uint8_t)i);
+	}
+	assert(cache->num == 300);
+
+	found = 0;
+	for (i = 0; i < 5000; ++i) {
+		g = kmscon_glyph_cache_get(cache, 10000 + i, i % 2);
+		if (g) {
+			assert(g->buf.data[0] == (uint8_t)i);
+			++found;
+		}
+	}
+	assert(found == 300);
+
+	/* in a batch, only the first renderer starts a new frame */
+	kmscon_glyph_cache_begin_batch();
+	kmscon_glyph_cache_next_frame(cache);
+	i = cache->frame;
+	kmscon_glyph_cache_next_frame(cache);
+	assert(cache->frame == i);
+	kmscon_glyph_cache_end_batch();
+	kmscon_glyph_cache_next_frame(cache);
+	assert(cache->frame == i + 1);
+
+	kmscon_glyph_cache_unref(cache);
+
+	test_shared();
+	test_store();
+	test_prerender();
+	return 0;
+}
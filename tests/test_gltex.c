@@ -0,0 +1,604 @@
+/*
+ * Test of the glyph atlases of the gltex renderer: packing glyphs into shelves,
+ * evicting the least recently drawn glyph once the atlases are over budget,
+ * grouping the quads of a frame by atlas and dropping an emptied atlas.
+ * OpenGL is stubbed out, so only the bookkeeping is checked.
+ * We include the implementation to access static helpers.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/text_gltex.c"
+
+#define FAKE_CELL_W 8
+#define FAKE_CELL_H 16
+#define FAKE_TEX_SIZE 64
+
+/* ---- Stubs for OpenGL, only texture names are handed out ---- */
+
+static GLuint next_tex = 1;
+
+void gl_tex_new(GLuint *tex, size_t num)
+{
+	while (num--)
+		*tex++ = next_tex++;
+}
+
+void gl_tex_free(GLuint *tex, size_t num)
+{
+	(void)tex;
+	(void)num;
+}
+
+static int fake_shader;
+
+int gl_shader_new_cached(struct gl_shader **out, const char *cache_dir, const char *vert,
+			 int vert_len, const char *frag, int frag_len, char **attr,
+			 size_t attr_count)
+{
+	(void)cache_dir;
+	(void)vert;
+	(void)vert_len;
+	(void)frag;
+	(void)frag_len;
+	(void)attr;
+	(void)attr_count;
+	*out = (struct gl_shader *)&fake_shader;
+	return 0;
+}
+
+void gl_shader_unref(struct gl_shader *shader)
+{
+	(void)shader;
+}
+
+GLuint gl_shader_get_uniform(struct gl_shader *shader, const char *name)
+{
+	(void)shader;
+	(void)name;
+	return 0;
+}
+
+void gl_shader_use(struct gl_shader *shader)
+{
+	(void)shader;
+}
+
+void gl_clear_error()
+{
+}
+
+bool gl_has_error(struct gl_shader *shader)
+{
+	(void)shader;
+	return false;
+}
+
+const char *gl_err_to_str(GLenum err)
+{
+	(void)err;
+	return "";
+}
+
+GLenum glGetError(void)
+{
+	return GL_NO_ERROR;
+}
+
+void glGetIntegerv(GLenum pname, GLint *data)
+{
+	(void)pname;
+	*data = FAKE_TEX_SIZE;
+}
+
+const GLubyte *glGetString(GLenum name)
+{
+	(void)name;
+	return NULL;
+}
+
+void glGenBuffers(GLsizei n, GLuint *buffers)
+{
+	while (n--)
+		*buffers++ = 1;
+}
+
+void glDeleteBuffers(GLsizei n, const GLuint *buffers)
+{
+	(void)n;
+	(void)buffers;
+}
+
+void glBindBuffer(GLenum target, GLuint buffer)
+{
+	(void)target;
+	(void)buffer;
+}
+
+void glBufferData(GLenum target, GLsizeiptr size, const void *data, GLenum usage)
+{
+	(void)target;
+	(void)size;
+	(void)data;
+	(void)usage;
+}
+
+static unsigned int uploaded_vertices;
+
+void glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+{
+	(void)target;
+	(void)offset;
+	(void)data;
+	uploaded_vertices += size / sizeof(struct vertex);
+}
+
+void glBindTexture(GLenum target, GLuint texture)
+{
+	(void)target;
+	(void)texture;
+}
+
+void glTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height,
+		  GLint border, GLenum format, GLenum type, const void *pixels)
+{
+	(void)target;
+	(void)level;
+	(void)internalformat;
+	(void)width;
+	(void)height;
+	(void)border;
+	(void)format;
+	(void)type;
+	(void)pixels;
+}
+
+void glTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width,
+		     GLsizei height, GLenum format, GLenum type, const void *pixels)
+{
+	(void)target;
+	(void)level;
+	(void)xoffset;
+	(void)yoffset;
+	(void)format;
+	(void)type;
+	(void)pixels;
+	assert(width == FAKE_CELL_W || width == 2 * FAKE_CELL_W);
+	assert(height == FAKE_CELL_H);
+}
+
+void glPixelStorei(GLenum pname, GLint param)
+{
+	(void)pname;
+	(void)param;
+}
+
+static unsigned int draws, drawn_vertices;
+
+void glDrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+	(void)mode;
+	(void)first;
+	++draws;
+	drawn_vertices += count;
+}
+
+void glViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	(void)x;
+	(void)y;
+	(void)width;
+	(void)height;
+}
+
+void glScissor(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	(void)x;
+	(void)y;
+	(void)width;
+	(void)height;
+}
+
+void glClearColor(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
+{
+	(void)red;
+	(void)green;
+	(void)blue;
+	(void)alpha;
+}
+
+void glClear(GLbitfield mask)
+{
+	(void)mask;
+}
+
+void glEnable(GLenum cap)
+{
+	(void)cap;
+}
+
+void glDisable(GLenum cap)
+{
+	(void)cap;
+}
+
+void glActiveTexture(GLenum texture)
+{
+	(void)texture;
+}
+
+void glUniform1i(GLint location, GLint v0)
+{
+	(void)location;
+	(void)v0;
+}
+
+void glUniform1f(GLint location, GLfloat v0)
+{
+	(void)location;
+	(void)v0;
+}
+
+void glUniform2f(GLint location, GLfloat v0, GLfloat v1)
+{
+	(void)location;
+	(void)v0;
+	(void)v1;
+}
+
+void glUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value)
+{
+	(void)location;
+	(void)count;
+	(void)transpose;
+	(void)value;
+}
+
+void glEnableVertexAttribArray(GLuint index)
+{
+	(void)index;
+}
+
+void glDisableVertexAttribArray(GLuint index)
+{
+	(void)index;
+}
+
+void glVertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized,
+			   GLsizei stride, const void *pointer)
+{
+	(void)index;
+	(void)size;
+	(void)type;
+	(void)normalized;
+	(void)stride;
+	(void)pointer;
+}
+
+/* ---- Stubs for the display, 16x4 cells ---- */
+
+bool uterm_display_has_opengl(struct uterm_display *disp)
+{
+	(void)disp;
+	return true;
+}
+
+int uterm_display_use(struct uterm_display *disp)
+{
+	(void)disp;
+	return 0;
+}
+
+unsigned int uterm_display_get_width(struct uterm_display *disp)
+{
+	(void)disp;
+	return 16 * FAKE_CELL_W;
+}
+
+unsigned int uterm_display_get_height(struct uterm_display *disp)
+{
+	(void)disp;
+	return 4 * FAKE_CELL_H;
+}
+
+const char *uterm_display_get_shader_cache(struct uterm_display *disp)
+{
+	(void)disp;
+	return NULL;
+}
+
+int uterm_display_get_buffer_age(struct uterm_display *disp)
+{
+	(void)disp;
+	return 0;
+}
+
+bool uterm_display_need_redraw(struct uterm_display *disp)
+{
+	(void)disp;
+	return false;
+}
+
+void uterm_display_set_cursor_offset(struct uterm_display *disp, int32_t x, int32_t y)
+{
+	(void)disp;
+	(void)x;
+	(void)y;
+}
+
+void uterm_display_set_damage(struct uterm_display *disp, size_t n_rect,
+			      struct uterm_video_rect *damages)
+{
+	(void)disp;
+	(void)n_rect;
+	(void)damages;
+}
+
+void uterm_video_buffer_unpack(uint8_t *dst, const struct uterm_video_buffer *buf,
+			       unsigned int line)
+{
+	memcpy(dst, buf->data + line * buf->stride, buf->width);
+}
+
+/* ---- Stubs for the font, characters from 0x1100 on are double width ---- */
+
+static struct kmscon_glyph *rendered[256];
+static unsigned int rendered_num;
+
+struct kmscon_glyph *kmscon_font_render_styled(struct kmscon_font *font, uint64_t id,
+					       const uint32_t *ch, size_t len, unsigned int style)
+{
+	struct kmscon_glyph *g;
+	unsigned int width = ch[0] >= 0x1100 ? 2 * FAKE_CELL_W : FAKE_CELL_W;
+	size_t size = sizeof(*g) + width * FAKE_CELL_H;
+
+	(void)font;
+	(void)id;
+	(void)len;
+	(void)style;
+	assert(rendered_num < sizeof(rendered) / sizeof(*rendered));
+	g = malloc(size);
+	memset(g, 0x80, size);
+	g->double_width = width > FAKE_CELL_W;
+	g->buf.width = width;
+	g->buf.height = FAKE_CELL_H;
+	g->buf.stride = width;
+	g->buf.format = UTERM_FORMAT_GREY;
+	rendered[rendered_num++] = g;
+	return g;
+}
+
+bool kmscon_font_has_glyph_styled(struct kmscon_font *font, const uint32_t *ch, size_t len,
+				  unsigned int style)
+{
+	(void)font;
+	(void)ch;
+	(void)len;
+	(void)style;
+	return true;
+}
+
+/* ---- Stubs for the glyph cache, every lookup misses ---- */
+
+int kmscon_glyph_cache_get_shared(struct kmscon_glyph_cache **out, const struct kmscon_font *font,
+				  unsigned int max_entries, size_t max_glyph_size)
+{
+	(void)font;
+	(void)max_entries;
+	(void)max_glyph_size;
+	*out = NULL;
+	return 0;
+}
+
+void kmscon_glyph_cache_unref(struct kmscon_glyph_cache *cache)
+{
+	(void)cache;
+}
+
+struct kmscon_glyph *kmscon_glyph_cache_get(struct kmscon_glyph_cache *cache, uint64_t id,
+					    uint32_t flags)
+{
+	(void)cache;
+	(void)id;
+	(void)flags;
+	return NULL;
+}
+
+struct kmscon_glyph *kmscon_glyph_cache_insert(struct kmscon_glyph_cache *cache, uint64_t id,
+					       uint32_t flags, struct kmscon_glyph *glyph)
+{
+	(void)cache;
+	(void)id;
+	(void)flags;
+	return glyph;
+}
+
+/* ---- Helpers ---- */
+
+static struct kmscon_font fake_font;
+static struct tsm_screen_attr attr;
+
+static void init_fake_txt(struct kmscon_text *txt)
+{
+	memset(txt, 0, sizeof(*txt));
+	fake_font.attr.width = FAKE_CELL_W;
+	fake_font.attr.height = FAKE_CELL_H;
+	txt->font = &fake_font;
+	txt->disp = (struct uterm_display *)0x1;
+	txt->orientation = OR_NORMAL;
+}
+
+static int draw(struct kmscon_text *txt, uint32_t ch, unsigned int pos)
+{
+	unsigned int width = ch >= 0x1100 ? 2 : 1;
+
+	return gltex_draw(txt, ch, &ch, 1, width, pos % txt->cols, pos / txt->cols, &attr);
+}
+
+static struct gl_glyph *lookup(struct gltex *gt, uint32_t ch)
+{
+	struct gl_glyph *glyph;
+
+	if (!shl_hashtable_find(gt->glyphs[0], (void **)&glyph, ch))
+		return NULL;
+	return glyph;
+}
+
+static unsigned int count_atlases(struct gltex *gt)
+{
+	struct shl_dlist *iter;
+	unsigned int num = 0;
+
+	shl_dlist_for_each(iter, &gt->atlases)
+		++num;
+	return num;
+}
+
+static struct atlas *nth_atlas(struct gltex *gt, unsigned int n)
+{
+	struct shl_dlist *iter;
+
+	shl_dlist_for_each(iter, &gt->atlases) {
+		if (!n--)
+			return shl_dlist_entry(iter, struct atlas, list);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	struct kmscon_text txt;
+	struct gltex *gt;
+	struct gl_glyph *glyph, *wide;
+	struct atlas *first, *second;
+	unsigned int i, slot;
+	uint64_t allocs;
+	int ret;
+
+	init_fake_txt(&txt);
+	ret = kmscon_text_gltex_ops.init(&txt);
+	assert(ret == 0);
+	gt = txt.data;
+
+	ret = gltex_set(&txt);
+	assert(ret == 0);
+	assert(txt.cols == 16 && txt.rows == 4);
+
+	/* each 64x64 atlas holds 8x4 glyphs, allow two of them */
+	gt->atlas_budget = 2 * FAKE_TEX_SIZE * FAKE_TEX_SIZE;
+
+	/* 64 glyphs fill both atlases, shelf after shelf */
+	ret = gltex_prepare(&txt, &attr);
+	assert(ret == 0);
+	for (i = 0; i < 64; ++i) {
+		ret = draw(&txt, 'A' + i, i);
+		assert(ret == 0);
+	}
+	assert(count_atlases(gt) == 2);
+	first = nth_atlas(gt, 0);
+	second = nth_atlas(gt, 1);
+	assert(first->width == FAKE_TEX_SIZE && first->height == FAKE_TEX_SIZE);
+	assert(first->cols == 8 && first->shelves == 4);
+	assert(first->used == 32 && second->used == 32);
+	assert(gt->atlas_mem == gt->atlas_budget);
+	glyph = lookup(gt, 'A' + 9);
+	assert(glyph && glyph->atlas == first && glyph->slot == 9);
+	glyph = lookup(gt, 'A' + 40);
+	assert(glyph && glyph->atlas == second && glyph->slot == 8);
+
+	/* the quads of this frame are drawn with one call per atlas */
+	draws = drawn_vertices = uploaded_vertices = 0;
+	ret = gltex_render(&txt);
+	assert(ret == 0);
+	assert(draws == 2 && drawn_vertices == 64 * 6);
+	assert(uploaded_vertices == 64 * 6);
+	assert(first->first == 0 && first->num == 32);
+	assert(second->first == 32 && second->num == 32);
+
+	/* nothing of this frame may be evicted, so a new glyph does not fit */
+	ret = draw(&txt, 'A' + 64, 0);
+	assert(ret == -ENOMEM);
+	assert(!lookup(gt, 'A' + 64));
+
+	/* an unchanged frame uploads no vertices and allocates nothing */
+	allocs = gt->glyph_pool.allocs + gt->frame_arena.allocs;
+	ret = gltex_prepare(&txt, &attr);
+	assert(ret == 0);
+	for (i = 0; i < 64; ++i) {
+		ret = draw(&txt, 'A' + i, i);
+		assert(ret == 0);
+	}
+	uploaded_vertices = 0;
+	ret = gltex_render(&txt);
+	assert(ret == 0);
+	assert(uploaded_vertices == 0);
+	assert(gt->glyph_pool.allocs + gt->frame_arena.allocs == allocs);
+
+	/* in the next frame, a new glyph takes the slot of the least recently
+	 * drawn one; the others were drawn again after it */
+	ret = gltex_prepare(&txt, &attr);
+	assert(ret == 0);
+	for (i = 1; i < 64; ++i) {
+		ret = draw(&txt, 'A' + i, i);
+		assert(ret == 0);
+	}
+	ret = draw(&txt, 'A' + 64, 0);
+	assert(ret == 0);
+	assert(!lookup(gt, 'A'));
+	glyph = lookup(gt, 'A' + 64);
+	assert(glyph && glyph->atlas == first && glyph->slot == 0);
+	assert(count_atlases(gt) == 2);
+
+	/* a double-width glyph needs two free slots in one shelf; 'A' + 1 is
+	 * evicted next but frees a single slot only, so 'A' + 2 goes too */
+	ret = gltex_prepare(&txt, &attr);
+	assert(ret == 0);
+	ret = draw(&txt, 0x4e00, 0);
+	assert(ret == 0);
+	wide = lookup(gt, 0x4e00);
+	assert(wide && wide->double_width);
+	assert(wide->atlas == first && wide->slot == 1);
+	assert(first->slots[1] == wide && first->slots[2] == wide);
+	assert(!lookup(gt, 'A' + 1) && !lookup(gt, 'A' + 2));
+	draws = drawn_vertices = 0;
+	ret = gltex_render(&txt);
+	assert(ret == 0);
+	assert(draws == 1 && drawn_vertices == 6);
+
+	/* once the glyphs of the second atlas are gone, its leftovers move to
+	 * the room in the first one and the second atlas is dropped */
+	for (slot = 0; slot < 24; ++slot) {
+		glyph = second->slots[slot];
+		if (glyph && glyph->slot == slot)
+			evict_glyph(gt, glyph);
+	}
+	for (slot = 0; slot < 8; ++slot) {
+		glyph = first->slots[24 + slot];
+		if (glyph && glyph->slot == 24 + slot)
+			evict_glyph(gt, glyph);
+	}
+	assert(first->used == 24 && second->used == 8);
+	compact_atlases(&txt, false);
+	assert(count_atlases(gt) == 1);
+	assert(nth_atlas(gt, 0) == first);
+	assert(gt->atlas_mem == FAKE_TEX_SIZE * FAKE_TEX_SIZE);
+	assert(!lookup(gt, 'A' + 63));
+
+	/* evicted glyphs are rendered into reused slots again */
+	ret = gltex_prepare(&txt, &attr);
+	assert(ret == 0);
+	ret = draw(&txt, 'A' + 63, 0);
+	assert(ret == 0);
+	glyph = lookup(gt, 'A' + 63);
+	assert(glyph && glyph->atlas == first && glyph->slot == 24);
+
+	gltex_unset(&txt);
+	kmscon_text_gltex_ops.destroy(&txt);
+
+	for (i = 0; i < rendered_num; ++i)
+		free(rendered[i]);
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Check that the compiled grab table finds the same grab as matching every
+ * grab one by one in the old order, for the default grabs and for grabs with
+ * more than one keysym.
+ * We include the implementation to access the static helpers.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/kmscon_conf.c"
+
+/* linear reference, the way seat and terminal matched grabs before */
+static enum kmscon_grab find_linear(const struct kmscon_conf_t *conf, enum kmscon_grab first,
+				    enum kmscon_grab last, unsigned int mods,
+				    unsigned int num_syms, const uint32_t *syms)
+{
+	struct conf_grab *grabs[KMSCON_GRAB_NUM];
+	unsigned int g;
+
+	get_grabs(conf, grabs);
+	for (g = first; g <= last; ++g) {
+		if (grabs[g] && conf_grab_matches(grabs[g], mods, num_syms, syms))
+			return g;
+	}
+
+	return KMSCON_GRAB_NONE;
+}
+
+static void check_all(const struct kmscon_conf_t *conf)
+{
+	static const uint32_t keysyms[] = {
+		XKB_KEY_Up,	   XKB_KEY_Down,   XKB_KEY_Prior, XKB_KEY_Next,	     XKB_KEY_plus,
+		XKB_KEY_equal,	   XKB_KEY_minus,  XKB_KEY_Right, XKB_KEY_Left,	     XKB_KEY_Escape,
+		XKB_KEY_BackSpace, XKB_KEY_Return, XKB_KEY_a,	  XKB_KEY_Delete,
+	};
+	static const enum kmscon_grab ranges[][2] = {
+		{KMSCON_GRAB_SEAT_FIRST, KMSCON_GRAB_SEAT_LAST},
+		{KMSCON_GRAB_TERMINAL_FIRST, KMSCON_GRAB_TERMINAL_LAST},
+	};
+	uint32_t pair[2];
+	unsigned int mods, i, j, r;
+
+	for (r = 0; r < 2; ++r) {
+		for (mods = 0; mods < 32; ++mods) {
+			for (i = 0; i < sizeof(keysyms) / sizeof(*keysyms); ++i) {
+				assert(kmscon_conf_find_grab(conf, ranges[r][0], ranges[r][1], mods,
+							     1, &keysyms[i]) ==
+				       find_linear(conf, ranges[r][0], ranges[r][1], mods, 1,
+						   &keysyms[i]));
+
+				for (j = 0; j < sizeof(keysyms) / sizeof(*keysyms); ++j) {
+					pair[0] = keysyms[i];
+					pair[1] = keysyms[j];
+					assert(kmscon_conf_find_grab(conf, ranges[r][0], ranges[r][1],
+								     mods, 2, pair) ==
+					       find_linear(conf, ranges[r][0], ranges[r][1], mods,
+							   2, pair));
+				}
+			}
+		}
+	}
+}
+
+/* one grab with two keysyms and one with a single keysym */
+static struct conf_grab reboot = {
+	.num = 2,
+	.mods = (unsigned int[]){SHL_ALT_MASK, SHL_CONTROL_MASK | SHL_ALT_MASK},
+	.num_syms = (unsigned int[]){2, 1},
+	.keysyms = (uint32_t *[]){(uint32_t[]){XKB_KEY_Delete, XKB_KEY_a},
+				  (uint32_t[]){XKB_KEY_Delete}},
+};
+
+int main(void)
+{
+	static const uint32_t up = XKB_KEY_Up, equal = XKB_KEY_equal;
+	struct kmscon_conf_t *conf;
+	struct conf_ctx *ctx;
+
+	assert(!kmscon_conf_new(&ctx));
+	conf = conf_ctx_get_mem(ctx);
+	assert(!grab_table_new(&conf->grab_table, conf));
+
+	/* modifiers on top of those of the grab are fine */
+	assert(kmscon_conf_find_grab(conf, KMSCON_GRAB_TERMINAL_FIRST, KMSCON_GRAB_TERMINAL_LAST,
+				     SHL_SHIFT_MASK | SHL_CONTROL_MASK, 1,
+				     &up) == KMSCON_GRAB_SCROLL_UP);
+	assert(kmscon_conf_find_grab(conf, KMSCON_GRAB_TERMINAL_FIRST, KMSCON_GRAB_TERMINAL_LAST, 0,
+				     1, &up) == KMSCON_GRAB_NONE);
+	/* zoom-in comes before rotate-cw, both match */
+	assert(kmscon_conf_find_grab(conf, KMSCON_GRAB_TERMINAL_FIRST, KMSCON_GRAB_TERMINAL_LAST,
+				     SHL_CONTROL_MASK | SHL_LOGO_MASK, 1,
+				     &equal) == KMSCON_GRAB_ZOOM_IN);
+	/* the seat does not see terminal grabs */
+	assert(kmscon_conf_find_grab(conf, KMSCON_GRAB_SEAT_FIRST, KMSCON_GRAB_SEAT_LAST,
+				     SHL_SHIFT_MASK, 1, &up) == KMSCON_GRAB_NONE);
+	check_all(conf);
+
+	grab_table_free(conf->grab_table);
+	conf->grab_reboot = &reboot;
+	assert(!grab_table_new(&conf->grab_table, conf));
+	assert(conf->grab_table->others_num == 1);
+	check_all(conf);
+
+	/* not allocated by the parser */
+	conf->grab_reboot = NULL;
+	kmscon_conf_free(ctx);
+	return 0;
+}
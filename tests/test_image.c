@@ -0,0 +1,254 @@
+/*
+ * Check the inline image parser and cache: output around image sequences is
+ * passed on as it is, also when split at any byte, sixel and kitty images are
+ * decoded into tiles of one cell on the background, kitty commands are
+ * answered, the least recently drawn image is dropped when the cache is full,
+ * and a terminal only draws the images it placed.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmscon_image.h"
+
+#define CELL_W 4
+#define CELL_H 6
+#define BG 0x000010
+
+static char text[4096];
+static size_t text_len;
+static char reply[256];
+static size_t reply_len;
+static uint32_t placed_id;
+static unsigned int placed_cols;
+static unsigned int placed_rows;
+static enum kmscon_image_cursor placed_cursor;
+static unsigned int placed;
+
+static void on_text(void *data, const char *buf, size_t len)
+{
+	assert(text_len + len <= sizeof(text));
+	memcpy(&text[text_len], buf, len);
+	text_len += len;
+}
+
+static void on_place(void *data, uint32_t id, unsigned int cols, unsigned int rows,
+		     enum kmscon_image_cursor cursor)
+{
+	placed_id = id;
+	placed_cols = cols;
+	placed_rows = rows;
+	placed_cursor = cursor;
+	++placed;
+}
+
+static void on_reply(void *data, const char *buf, size_t len)
+{
+	assert(reply_len + len <= sizeof(reply));
+	memcpy(&reply[reply_len], buf, len);
+	reply_len += len;
+}
+
+static const struct kmscon_image_ops ops = {
+	.text = on_text,
+	.place = on_place,
+	.reply = on_reply,
+};
+
+static void reset(void)
+{
+	text_len = 0;
+	reply_len = 0;
+	placed = 0;
+}
+
+static void input(struct kmscon_image_parser *p, const char *s)
+{
+	kmscon_image_parser_input(p, s, strlen(s));
+}
+
+/* a pixel of a tile, or 0xffffffff if the tile is gone */
+static uint32_t pixel(struct kmscon_image_parser *p, uint32_t id, unsigned int col,
+		      unsigned int row, unsigned int x, unsigned int y)
+{
+	const struct uterm_video_buffer *tile;
+	uint32_t val = 0xffffffff;
+
+	kmscon_image_lock();
+	tile = kmscon_image_get_tile(p, id, col, row);
+	if (tile) {
+		assert(tile->width == CELL_W && tile->height == CELL_H);
+		val = ((const uint32_t *)&tile->data[y * tile->stride])[x];
+	}
+	kmscon_image_unlock();
+	return val;
+}
+
+static void test_passthrough(struct kmscon_image_parser *p)
+{
+	static const char in[] = "ab\033[1mc\033P0;1q#1;2;100;0;0#1~\033\\"
+				 "d\033Pzz\033\\e\033_x\033\\";
+	static const char out[] = "ab\033[1mcd\033Pzz\033\\e\033_x\033\\";
+	size_t i;
+
+	/* split in two at every byte */
+	for (i = 0; i <= sizeof(in) - 1; ++i) {
+		reset();
+		kmscon_image_parser_input(p, in, i);
+		kmscon_image_parser_input(p, &in[i], sizeof(in) - 1 - i);
+		assert(text_len == sizeof(out) - 1);
+		assert(!memcmp(text, out, text_len));
+		assert(placed == 1);
+		assert(placed_cols == 1 && placed_rows == 1);
+	}
+}
+
+static void test_sixel(struct kmscon_image_parser *p)
+{
+	reset();
+	/* 6 columns of red over two bands, then one blue column on the first */
+	input(p, "\033Pq#1;2;100;0;0#2;2;0;0;100#1!6~-!6~$#2~\033\\");
+	assert(placed == 1);
+	assert(placed_cursor == KMSCON_IMAGE_BELOW);
+	assert(placed_cols == 2 && placed_rows == 2);
+	assert(!text_len);
+
+	assert(pixel(p, placed_id, 0, 0, 0, 0) == 0xff0000);
+	assert(pixel(p, placed_id, 1, 1, 1, 5) == 0xff0000);
+	assert(pixel(p, placed_id, 0, 1, 0, 0) == 0x0000ff);
+	/* beyond the 6 pixels drawn, the last cell shows the background */
+	assert(pixel(p, placed_id, 1, 0, 2, 0) == BG);
+	assert(pixel(p, placed_id, 2, 0, 0, 0) == 0xffffffff);
+}
+
+static void test_kitty(struct kmscon_image_parser *p)
+{
+	uint32_t id;
+
+	/* two RGB pixels in two chunks, "/wAAAP8A" and "AAD/" */
+	reset();
+	input(p, "\033_Ga=T,f=24,s=3,v=1,i=7,m=1;/wAAAP8A\033\\");
+	assert(!placed && !reply_len);
+	input(p, "\033_Gm=0;AAD/\033\\");
+	assert(placed == 1);
+	assert(placed_cursor == KMSCON_IMAGE_AFTER);
+	assert(placed_cols == 1 && placed_rows == 1);
+	assert(reply_len == strlen("\033_Gi=7;OK\033\\"));
+	assert(!memcmp(reply, "\033_Gi=7;OK\033\\", reply_len));
+	id = placed_id;
+	assert(pixel(p, id, 0, 0, 0, 0) == 0xff0000);
+	assert(pixel(p, id, 0, 0, 1, 0) == 0x00ff00);
+	assert(pixel(p, id, 0, 0, 2, 0) == 0x0000ff);
+	assert(pixel(p, id, 0, 0, 3, 0) == BG);
+	assert(pixel(p, id, 0, 0, 0, 1) == BG);
+
+	/* a transparent RGBA pixel is the background, quiet and kept in place */
+	reset();
+	input(p, "\033_Ga=T,s=1,v=1,i=8,q=1,C=1;/wAAAA==\033\\");
+	assert(placed == 1 && placed_cursor == KMSCON_IMAGE_STAY);
+	assert(!reply_len);
+	assert(pixel(p, placed_id, 0, 0, 0, 0) == BG);
+
+	/* put an image again, by its client id */
+	reset();
+	input(p, "\033_Ga=p,i=7\033\\");
+	assert(placed == 1 && placed_id == id);
+	reset();
+	input(p, "\033_Ga=p,i=9\033\\");
+	assert(!placed);
+	assert(!strncmp(reply, "\033_Gi=9;ENOENT", strlen("\033_Gi=9;ENOENT")));
+
+	reset();
+	input(p, "\033_Ga=q,i=1,f=100\033\\");
+	assert(!strncmp(reply, "\033_Gi=1;ENOTSUP", strlen("\033_Gi=1;ENOTSUP")));
+
+	/* deleting with a capital letter frees the data */
+	reset();
+	input(p, "\033_Ga=d,d=I,i=7\033\\");
+	assert(pixel(p, id, 0, 0, 0, 0) == 0xffffffff);
+	input(p, "\033_Ga=p,i=7\033\\");
+	assert(!placed);
+}
+
+static void test_evict(struct kmscon_image_parser *p)
+{
+	uint32_t first, second, third;
+
+	/* room for two images of 16 cells, whatever else there is */
+	kmscon_image_set_cache_size(4096);
+	reset();
+	input(p, "\033Pq!64~\033\\");
+	first = placed_id;
+	input(p, "\033Pq!64~\033\\");
+	second = placed_id;
+
+	/* drawing the first one makes the second the least recently used */
+	assert(pixel(p, first, 0, 0, 0, 0) != 0xffffffff);
+	input(p, "\033Pq!64~\033\\");
+	third = placed_id;
+	assert(placed == 3);
+	assert(pixel(p, first, 0, 0, 0, 0) != 0xffffffff);
+	assert(pixel(p, second, 0, 0, 0, 0) == 0xffffffff);
+	assert(pixel(p, third, 15, 0, 0, 0) != 0xffffffff);
+
+	/* too large for the cache */
+	reset();
+	input(p, "\033Pq!64~-!64~-!64~\033\\");
+	assert(!placed);
+	kmscon_image_set_cache_size(1024 * 1024);
+}
+
+static void test_owner(struct kmscon_image_parser *p)
+{
+	struct kmscon_image_parser *q;
+	uint32_t id;
+
+	reset();
+	input(p, "\033Pq~\033\\");
+	id = placed_id;
+	assert(placed == 1 && kmscon_image_placed(p, id));
+	assert(!kmscon_image_placed(NULL, id));
+
+	/* another terminal neither draws the image nor takes its id for one */
+	assert(!kmscon_image_parser_new(&q, &ops, NULL));
+	kmscon_image_parser_set_cell(q, CELL_W, CELL_H, BG >> 16, BG >> 8, BG);
+	assert(!kmscon_image_placed(q, id));
+	assert(pixel(q, id, 0, 0, 0, 0) == 0xffffffff);
+	assert(pixel(p, id, 0, 0, 0, 0) != 0xffffffff);
+
+	/* kitty images that were only transmitted were never placed */
+	reset();
+	input(q, "\033_Ga=t,f=24,s=1,v=1,i=3;/wAA\033\\");
+	assert(!placed && !kmscon_image_placed(q, id + 1));
+	assert(pixel(q, id + 1, 0, 0, 0, 0) == 0xff0000);
+	kmscon_image_parser_free(q);
+}
+
+int main(void)
+{
+	struct kmscon_image_parser *p;
+	unsigned int images, num;
+	size_t size, max_size;
+
+	kmscon_image_set_cache_size(1024 * 1024);
+	assert(!kmscon_image_parser_new(&p, &ops, NULL));
+	kmscon_image_parser_set_cell(p, CELL_W, CELL_H, BG >> 16, BG >> 8, BG);
+
+	test_passthrough(p);
+	test_sixel(p);
+	test_kitty(p);
+	test_evict(p);
+	test_owner(p);
+
+	/* the images go with their terminal */
+	kmscon_image_get_cache_usage(&images, &size, &max_size);
+	assert(images);
+	kmscon_image_parser_free(p);
+	kmscon_image_get_cache_usage(&num, &size, &max_size);
+	assert(!num && !size);
+
+	printf("image test passed\n");
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Check the memory video backend: the display shows up with the mode of its
+ * node, swapping shows the drawn frame, a second swap before the simulated
+ * vblank is busy and only the damage of a frame reaches the screen. The
+ * checksums are compared with ones of frames drawn by hand, and the buffers are
+ * dropped while asleep.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eloop.h"
+#include "uterm_video.h"
+
+#define SCREEN_W 64
+#define SCREEN_H 32
+
+static struct uterm_display *display;
+static unsigned int flips;
+
+static void video_event(struct uterm_video *video, struct uterm_video_hotplug *ev, void *data)
+{
+	if (ev->action == UTERM_NEW)
+		display = ev->display;
+	else if (ev->action == UTERM_GONE)
+		display = NULL;
+}
+
+static void display_event(struct uterm_display *disp, struct uterm_display_event *ev, void *data)
+{
+	if (ev->action == UTERM_PAGE_FLIP) {
+		assert(ev->time);
+		++flips;
+	}
+}
+
+static uint64_t checksum(const uint32_t *pix)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	for (i = 0; i < SCREEN_W * SCREEN_H; ++i) {
+		hash ^= pix[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void fill(uint32_t *pix, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+		 uint32_t val)
+{
+	unsigned int i, j;
+
+	for (j = y; j < y + h; ++j)
+		for (i = x; i < x + w; ++i)
+			pix[j * SCREEN_W + i] = val;
+}
+
+static void fill_req(struct uterm_video_blend_req *req, unsigned int x, unsigned int y,
+		     unsigned int w, unsigned int h, uint32_t val)
+{
+	memset(req, 0, sizeof(*req));
+	req->flags = UTERM_BLEND_FILL;
+	req->x = x;
+	req->y = y;
+	req->width = w;
+	req->height = h;
+	req->br = val >> 16;
+	req->bg = val >> 8;
+	req->bb = val;
+}
+
+static void wait_flip(struct ev_eloop *eloop)
+{
+	unsigned int old = flips;
+
+	while (flips == old)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+	assert(!uterm_display_is_swapping(display));
+}
+
+int main(void)
+{
+	static uint32_t screen[SCREEN_W * SCREEN_H];
+	struct uterm_video_buffer *buf;
+	struct uterm_video_blend_req reqs[2];
+	struct uterm_video_rect damage = {8, 4, 24, 12};
+	struct ev_eloop *eloop;
+	struct uterm_video *video;
+	uint64_t sum;
+	unsigned int i;
+
+	assert(!ev_eloop_new(&eloop));
+	uterm_register_memory();
+	assert(uterm_video_new(&video, eloop, "64", "memory", 0, 0, false) == -EINVAL);
+	assert(!uterm_video_new(&video, eloop, "64x32@1000", "memory", 0, 0, false));
+	assert(!uterm_video_register_cb(video, video_event, NULL));
+	assert(!uterm_video_wake_up(video));
+	while (!display)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+
+	assert(uterm_display_get_width(display) == SCREEN_W);
+	assert(uterm_display_get_height(display) == SCREEN_H);
+	assert(uterm_display_supports_damage(display));
+	assert(!uterm_display_register_cb(display, display_event, NULL));
+
+	/* the first frame is shown as a whole */
+	assert(!uterm_display_clear(display, 0x10, 0x20, 0x30));
+	fill(screen, 0, 0, SCREEN_W, SCREEN_H, 0x102030);
+	fill_req(&reqs[0], 4, 2, 20, 10, 0xff0000);
+	fill(screen, 4, 2, 20, 10, 0xff0000);
+
+	buf = malloc(sizeof(*buf) + 8 * 4 * 4);
+	assert(buf);
+	buf->width = 8;
+	buf->height = 4;
+	buf->stride = 8 * 4;
+	buf->format = UTERM_FORMAT_GREY;
+	for (i = 0; i < 8 * 4; ++i)
+		((uint32_t *)buf->data)[i] = 0x010101 * i;
+	memset(&reqs[1], 0, sizeof(reqs[1]));
+	reqs[1].buf = buf;
+	reqs[1].x = 40;
+	reqs[1].y = 20;
+	reqs[1].flags = UTERM_BLEND_XRGB32;
+	for (i = 0; i < 8 * 4; ++i)
+		screen[(20 + i / 8) * SCREEN_W + 40 + i % 8] = 0x010101 * i;
+
+	assert(!uterm_display_fake_blendv(display, reqs, 2));
+	assert(!uterm_display_swap(display));
+	assert(uterm_display_is_swapping(display));
+	assert(uterm_display_swap(display) == -EBUSY);
+	assert(!uterm_memory_checksum(display, &sum));
+	assert(sum == checksum(screen));
+	wait_flip(eloop);
+	assert(flips == 1);
+	assert(uterm_memory_frames(display) == 1);
+
+	/* only the damage reaches the screen */
+	fill_req(&reqs[0], 0, 0, 32, 16, 0x00ff00);
+	assert(!uterm_display_fake_blendv(display, reqs, 1));
+	fill(screen, 8, 4, 16, 8, 0x00ff00);
+	uterm_display_set_damage(display, 1, &damage);
+	assert(uterm_display_has_damage(display));
+	assert(!uterm_display_swap(display));
+	assert(!uterm_display_has_damage(display));
+	assert(!uterm_memory_checksum(display, &sum));
+	assert(sum == checksum(screen));
+	wait_flip(eloop);
+
+	/* without damage, the rest of the last frame follows */
+	assert(!uterm_display_swap(display));
+	fill(screen, 0, 0, 32, 16, 0x00ff00);
+	assert(!uterm_memory_checksum(display, &sum));
+	assert(sum == checksum(screen));
+	wait_flip(eloop);
+	assert(uterm_memory_frames(display) == 3);
+
+	uterm_video_sleep(video);
+	assert(uterm_memory_checksum(display, &sum) == -EINVAL);
+	assert(!uterm_video_wake_up(video));
+	assert(uterm_display_get_width(display) == SCREEN_W);
+	assert(uterm_memory_frames(display) == 0);
+	memset(screen, 0, sizeof(screen));
+	assert(!uterm_memory_checksum(display, &sum));
+	assert(sum == checksum(screen));
+
+	free(buf);
+	uterm_video_unref(video);
+	assert(!display);
+	ev_eloop_unref(eloop);
+	printf("memory video test passed\n");
+	return 0;
+}
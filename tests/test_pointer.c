@@ -0,0 +1,99 @@
+/*
+ * Check that pointer motion is sent once per evdev frame, that buttons and the
+ * wheel still see the position they were pressed at and that the inactivity
+ * timer is not re-armed on every frame.
+ * We include the implementation to access the internal state.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/uterm_input_pointer.c"
+
+static char events[32];
+static unsigned int events_len;
+static int32_t last_x, last_y;
+static unsigned int armed;
+
+int ev_timer_update(struct ev_timer *timer, const struct itimerspec *spec)
+{
+	++armed;
+	return 0;
+}
+
+static void pointer_cb(struct uterm_input *input, struct uterm_input_pointer_event *ev,
+		       void *data)
+{
+	static const char names[] = {
+		[UTERM_MOVED] = 'm',
+		[UTERM_BUTTON] = 'b',
+		[UTERM_WHEEL] = 'w',
+		[UTERM_SYNC] = 's',
+	};
+
+	events[events_len++] = names[ev->event];
+	if (ev->event == UTERM_MOVED) {
+		last_x = ev->pointer_x;
+		last_y = ev->pointer_y;
+	}
+}
+
+static void check(const char *expected)
+{
+	assert(events_len == strlen(expected) && !memcmp(events, expected, events_len));
+	events_len = 0;
+}
+
+int main(void)
+{
+	struct uterm_input input;
+	struct uterm_input_dev dev;
+	unsigned int i;
+
+	memset(&input, 0, sizeof(input));
+	memset(&dev, 0, sizeof(dev));
+	input.pointer_max_x = 1000;
+	input.pointer_max_y = 1000;
+	assert(!shl_hook_new(&input.pointer_hook));
+	assert(!shl_hook_add_cast(input.pointer_hook, pointer_cb, NULL, false));
+	dev.input = &input;
+	dev.pointer.kind = POINTER_MOUSE;
+	dev.pointer.pressed_button = BUTTON_NONE;
+	dev.event.time = 5000000;
+
+	/* X and Y of one frame give a single move */
+	pointer_dev_rel(&dev, REL_X, 10);
+	pointer_dev_rel(&dev, REL_Y, 20);
+	check("");
+	pointer_dev_sync(&dev);
+	check("ms");
+	assert(last_x == 10 && last_y == 20 && armed == 1);
+
+	/* a click right after motion happens at the new position */
+	pointer_dev_rel(&dev, REL_X, 5);
+	pointer_dev_button(&dev, BTN_LEFT, 1);
+	check("mb");
+	assert(last_x == 15);
+	pointer_dev_sync(&dev);
+	check("s");
+
+	pointer_dev_rel(&dev, REL_Y, -5);
+	pointer_dev_rel(&dev, REL_WHEEL, 1);
+	pointer_dev_sync(&dev);
+	check("mws");
+	assert(last_y == 15);
+
+	/* a 1000 Hz mouse re-arms the timer once a second */
+	for (i = 0; i < 999; ++i) {
+		dev.event.time += 1000;
+		pointer_dev_rel(&dev, REL_X, 0);
+		pointer_dev_sync(&dev);
+	}
+	assert(armed == 1);
+	dev.event.time += 1000;
+	pointer_dev_sync(&dev);
+	assert(armed == 2);
+
+	shl_hook_free(input.pointer_hook);
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Check that a recording is played back in order, with the recorded gaps or
+ * all at once in fast mode, that pausing doesn't skip recorded time, and that
+ * a cut-off last chunk is dropped. The chunks are written in the same format
+ * as the pty records them.
+ */
+
+#include <assert.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "eloop.h"
+#include "kmscon_replay.h"
+#include "shl_timer.h"
+
+static char out[64];
+static size_t out_len;
+static bool ended;
+
+static void write_chunk(FILE *f, uint64_t usecs, const char *u8)
+{
+	uint32_t hdr[3];
+
+	hdr[0] = htole32(1700000000 + usecs / 1000000);
+	hdr[1] = htole32(usecs % 1000000);
+	hdr[2] = htole32(strlen(u8));
+	assert(fwrite(hdr, sizeof(hdr), 1, f) == 1);
+	assert(fwrite(u8, 1, strlen(u8), f) == strlen(u8));
+}
+
+static void replay_cb(struct kmscon_replay *rp, const char *u8, size_t len, void *data)
+{
+	if (!len) {
+		ended = true;
+		return;
+	}
+
+	assert(out_len + len < sizeof(out));
+	memcpy(&out[out_len], u8, len);
+	out_len += len;
+}
+
+static void reset(void)
+{
+	memset(out, 0, sizeof(out));
+	out_len = 0;
+	ended = false;
+}
+
+static uint64_t play(struct ev_eloop *eloop, const char *file, bool fast,
+		     struct kmscon_replay_stats *rs)
+{
+	struct kmscon_replay *rp;
+	uint64_t start;
+
+	reset();
+	assert(!kmscon_replay_new(&rp, eloop, file, fast, replay_cb, NULL));
+	start = shl_timer_now();
+	assert(!kmscon_replay_start(rp));
+	while (!ended)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+	start = shl_timer_now() - start;
+
+	assert(kmscon_replay_is_done(rp));
+	kmscon_replay_get_stats(rp, rs);
+	kmscon_replay_free(rp);
+	return start;
+}
+
+int main(void)
+{
+	char file[] = "/tmp/test_replay-XXXXXX";
+	struct kmscon_replay_stats rs;
+	struct kmscon_replay *rp;
+	struct ev_eloop *eloop;
+	uint64_t time;
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(file);
+	assert(fd >= 0);
+	f = fdopen(fd, "w");
+	assert(f);
+	write_chunk(f, 0, "hello ");
+	write_chunk(f, 50000, "world");
+	write_chunk(f, 100000, "\r\n");
+	write_chunk(f, 100000, "");
+	/* a header cut off after the seconds, like after a crash */
+	assert(fwrite("\x10\0\0\0", 4, 1, f) == 1);
+	fclose(f);
+
+	assert(!ev_eloop_new(&eloop));
+	assert(kmscon_replay_new(&rp, eloop, "/nonexistent", false, replay_cb, NULL) < 0);
+
+	time = play(eloop, file, false, &rs);
+	assert(!strcmp(out, "hello world\r\n"));
+	assert(rs.chunks == 4);
+	assert(rs.bytes == 13);
+	assert(rs.recorded == 100000);
+	assert(time >= 100000);
+	assert(rs.elapsed >= 100000);
+
+	time = play(eloop, file, true, &rs);
+	assert(!strcmp(out, "hello world\r\n"));
+	assert(time < 100000);
+
+	/* the second chunk stays 50 ms after the first despite the pause */
+	reset();
+	assert(!kmscon_replay_new(&rp, eloop, file, false, replay_cb, NULL));
+	assert(!kmscon_replay_start(rp));
+	while (out_len < 6)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+	kmscon_replay_stop(rp);
+	usleep(80000);
+	assert(!ev_eloop_dispatch(eloop, 0));
+	assert(out_len == 6);
+	time = shl_timer_now();
+	assert(!kmscon_replay_start(rp));
+	while (out_len < 11)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+	assert(shl_timer_now() - time >= 40000);
+	while (!ended)
+		assert(!ev_eloop_dispatch(eloop, 1000));
+	kmscon_replay_get_stats(rp, &rs);
+	assert(rs.elapsed < 180000);
+	kmscon_replay_free(rp);
+
+	ev_eloop_unref(eloop);
+	unlink(file);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Check that the scrollback search finds the last match before a line, ignores
+ * ASCII case, counts columns in characters and finds nothing in lines the
+ * byte pair index rules out.
+ * We include the implementation to access the internal state.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/kmscon_search.c"
+
+static void set(struct kmscon_search *search, const char *str)
+{
+	char *text = strdup(str);
+
+	assert(text);
+	kmscon_search_set_text(search, text, strlen(str));
+}
+
+int main(void)
+{
+	struct kmscon_search search;
+	unsigned int col;
+	size_t line;
+
+	memset(&search, 0, sizeof(search));
+	assert(kmscon_search_find(&search, "a", 1, -1, &line, &col) == -ENOENT);
+
+	set(&search, "make all\nerror: foo\n  Error in bar\n\xc3\xa4\xc3\xb6 error\nlast");
+	assert(!search.indexed);
+	assert(!kmscon_search_find(&search, "error", 5, -1, &line, &col));
+	assert(search.indexed && search.num_lines == 5);
+	/* the column of a match after two 2-byte characters */
+	assert(line == 3 && col == 3);
+	assert(!kmscon_search_find(&search, "error", 5, line, &line, &col));
+	assert(line == 2 && col == 2);
+	assert(!kmscon_search_find(&search, "ERROR", 5, line, &line, &col));
+	assert(line == 1 && col == 0);
+	assert(kmscon_search_find(&search, "error", 5, line, &line, &col) == -ENOENT);
+
+	/* the last line has no \n and a match may end the text */
+	assert(!kmscon_search_find(&search, "st", 2, -1, &line, &col));
+	assert(line == 4 && col == 2);
+	/* matches don't span lines */
+	assert(kmscon_search_find(&search, "all\nerror", 9, -1, &line, &col) == -ENOENT);
+	assert(kmscon_search_find(&search, "rorr", 4, -1, &line, &col) == -ENOENT);
+
+	/* new text is indexed again */
+	set(&search, "\n\nfoo\n");
+	assert(!search.indexed);
+	assert(!kmscon_search_find(&search, "o", 1, -1, &line, &col));
+	assert(search.num_lines == 4 && line == 2 && col == 2);
+
+	kmscon_search_clear(&search);
+	assert(kmscon_search_find(&search, "o", 1, -1, &line, &col) == -ENOENT);
+	kmscon_search_destroy(&search);
+	return 0;
+}
@@ -23,7 +23,13 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "shl_arena.h"
+#include "shl_log.h"
 #include "shl_misc.h"
+#include "shl_ring.h"
 #include "test_common.h"
 
 #define check_assert_string_list_eq(X, Y)                                                          \
@@ -165,8 +171,212 @@ START_TEST(test_split_command_string)
 }
 END_TEST
 
+START_TEST(test_ring)
+{
+	struct shl_ring *ring;
+	struct iovec vec[2];
+	char data[10000];
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = i * 7;
+
+	ret = shl_ring_new(&ring);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(shl_ring_is_empty(ring));
+	ck_assert_uint_eq(shl_ring_peek(ring, vec), 0);
+
+	/* content that wraps around the end is peeked in two pieces */
+	ret = shl_ring_write(ring, data, 3000);
+	ck_assert_int_eq(ret, 0);
+	shl_ring_drop(ring, 2500);
+	ret = shl_ring_write(ring, &data[3000], 2000);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_uint_eq(shl_ring_peek(ring, vec), 2);
+	ck_assert_uint_eq(vec[0].iov_len, SHL_RING_SIZE - 2500);
+	ck_assert_uint_eq(vec[0].iov_len + vec[1].iov_len, 2500);
+	ck_assert(!memcmp(vec[0].iov_base, &data[2500], vec[0].iov_len));
+	ck_assert(!memcmp(vec[1].iov_base, &data[2500 + vec[0].iov_len], vec[1].iov_len));
+
+	/* growing keeps the content in order */
+	ret = shl_ring_write(ring, &data[5000], 5000);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_uint_eq(shl_ring_peek(ring, vec), 1);
+	ck_assert_uint_eq(vec[0].iov_len, 7500);
+	ck_assert(!memcmp(vec[0].iov_base, &data[2500], 7500));
+
+	/* writes beyond the limit fail as a whole */
+	shl_ring_set_max(ring, 8000);
+	ret = shl_ring_write(ring, data, 501);
+	ck_assert_int_eq(ret, -ENOBUFS);
+	ret = shl_ring_write(ring, data, 500);
+	ck_assert_int_eq(ret, 0);
+
+	/* appending ignores the limit and doesn't count against it */
+	ret = shl_ring_append(ring, data, 1000);
+	ck_assert_int_eq(ret, 0);
+	ret = shl_ring_write(ring, data, 1);
+	ck_assert_int_eq(ret, -ENOBUFS);
+	shl_ring_drop(ring, 8000);
+	ret = shl_ring_write(ring, data, 8000);
+	ck_assert_int_eq(ret, 0);
+
+	shl_ring_drop(ring, 9000);
+	ck_assert(shl_ring_is_empty(ring));
+
+	/* typing during a paste larger than the limit still gets through */
+	shl_ring_set_max(ring, 100);
+	ret = shl_ring_append(ring, data, 5000);
+	ck_assert_int_eq(ret, 0);
+	ret = shl_ring_write(ring, data, 60);
+	ck_assert_int_eq(ret, 0);
+	ret = shl_ring_write(ring, data, 60);
+	ck_assert_int_eq(ret, -ENOBUFS);
+	shl_ring_drop(ring, 4000);
+	ret = shl_ring_write(ring, data, 40);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_uint_eq(shl_ring_peek(ring, vec), 1);
+	ck_assert_uint_eq(vec[0].iov_len, 1100);
+
+	shl_ring_flush(ring);
+	ck_assert(shl_ring_is_empty(ring));
+	shl_ring_free(ring);
+}
+END_TEST
+
+START_TEST(test_arena)
+{
+	struct shl_arena arena;
+	struct shl_pool pool;
+	void *objs[SHL_POOL_SLAB + 1];
+	unsigned int i, frame;
+	uint8_t *p;
+
+	/* a frame that outgrows the first chunk takes more of them, the next
+	 * one fits into a single chunk again */
+	shl_arena_init(&arena);
+	for (i = 0; i < 10; ++i) {
+		p = shl_arena_alloc(&arena, 1000);
+		ck_assert_ptr_nonnull(p);
+		ck_assert_uint_eq((uintptr_t)p % 16, 0);
+		memset(p, i, 1000);
+	}
+	ck_assert_uint_gt(arena.allocs, 1);
+	shl_arena_reset(&arena);
+	arena.allocs = 0;
+	for (frame = 0; frame < 100; ++frame) {
+		for (i = 0; i < 10; ++i)
+			ck_assert_ptr_nonnull(shl_arena_zalloc(&arena, 1000));
+		shl_arena_reset(&arena);
+	}
+	ck_assert_uint_eq(arena.allocs, 0);
+	shl_arena_deinit(&arena);
+
+	/* freed objects are handed out again before a new slab is taken */
+	shl_pool_init(&pool, 24);
+	for (i = 0; i < SHL_POOL_SLAB + 1; ++i)
+		objs[i] = shl_pool_alloc(&pool);
+	ck_assert_uint_eq(pool.allocs, 2);
+	shl_pool_free(&pool, objs[3]);
+	ck_assert_ptr_eq(shl_pool_alloc(&pool), objs[3]);
+	for (i = 0; i < SHL_POOL_SLAB + 1; ++i)
+		shl_pool_free(&pool, objs[i]);
+	for (i = 0; i < SHL_POOL_SLAB + 1; ++i)
+		ck_assert_ptr_nonnull(shl_pool_alloc(&pool));
+	ck_assert_uint_eq(pool.allocs, 2);
+
+	/* clearing keeps the slabs */
+	shl_pool_clear(&pool);
+	for (i = 0; i < 2 * SHL_POOL_SLAB; ++i)
+		ck_assert_ptr_nonnull(shl_pool_alloc(&pool));
+	ck_assert_uint_eq(pool.allocs, 2);
+	shl_pool_deinit(&pool);
+}
+END_TEST
+
+static void *log_thread(void *data)
+{
+	log_notice("from thread");
+	return NULL;
+}
+
+/* logs while the writer is stopped, every message must still come out once */
+static void *log_racer(void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < 40; ++i) {
+		log_notice("racing %u", i);
+		sched_yield();
+	}
+	return NULL;
+}
+
+static unsigned int count_lines(const char *buf, const char *str)
+{
+	unsigned int num = 0;
+
+	for (buf = strstr(buf, str); buf; buf = strstr(buf + 1, str))
+		++num;
+	return num;
+}
+
+START_TEST(test_log_writer)
+{
+	static char buf[65536];
+	pthread_t thread;
+	unsigned int i;
+	ssize_t len;
+	int ret, fds[2], saved;
+
+	ret = pipe(fds);
+	ck_assert_int_eq(ret, 0);
+	saved = dup(STDERR_FILENO);
+	ck_assert_int_ge(saved, 0);
+	dup2(fds[1], STDERR_FILENO);
+	close(fds[1]);
+
+	ret = log_start_writer();
+	ck_assert_int_eq(ret, 0);
+
+	/* a single call site is limited to a burst of 50 messages */
+	for (i = 0; i < 60; ++i)
+		log_notice("burst %u", i);
+	log_info("disabled");
+
+	ret = pthread_create(&thread, NULL, log_thread, NULL);
+	ck_assert_int_eq(ret, 0);
+	pthread_join(thread, NULL);
+
+	ret = pthread_create(&thread, NULL, log_racer, NULL);
+	ck_assert_int_eq(ret, 0);
+	log_stop_writer();
+	pthread_join(thread, NULL);
+	log_notice("after stop");
+
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+	len = read(fds[0], buf, sizeof(buf) - 1);
+	close(fds[0]);
+	ck_assert_int_gt(len, 0);
+	buf[len] = 0;
+
+	ck_assert_uint_eq(count_lines(buf, "NOTICE: burst "), 50);
+	ck_assert(strstr(buf, "burst 49 ("));
+	ck_assert(!strstr(buf, "disabled"));
+	ck_assert_uint_eq(count_lines(buf, "from thread"), 1);
+	ck_assert_uint_eq(count_lines(buf, "NOTICE: racing "), 40);
+	ck_assert(strstr(buf, "after stop") > strstr(buf, "from thread"));
+	ck_assert_int_eq(buf[len - 1], '\n');
+}
+END_TEST
+
 TEST_DEFINE_CASE(misc)
 TEST(test_split_command_string)
+TEST(test_ring)
+TEST(test_arena)
+TEST(test_log_writer)
 TEST_END_CASE
 
 TEST_DEFINE(TEST_SUITE(shl, TEST_CASE(misc), TEST_END))
@@ -0,0 +1,62 @@
+/*
+ * Check that the latency statistics follow one key through the stages in
+ * order, drop keys that never show up and compute the percentiles.
+ * We include the implementation to access the internal state.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/kmscon_stats.c"
+
+int main(void)
+{
+	struct kmscon_stats stats;
+	struct kmscon_stats_hist *hist = stats.hist;
+	uint64_t now;
+	unsigned int i;
+
+	memset(&stats, 0, sizeof(stats));
+
+	/* nothing is recorded without a key */
+	kmscon_stats_mark(&stats, KMSCON_STATS_WRITE, 0);
+	assert(!hist[KMSCON_STATS_WRITE].count);
+
+	/* stages count from the key press and only in order */
+	now = shl_timer_now();
+	kmscon_stats_input(&stats, now - 100);
+	kmscon_stats_mark(&stats, KMSCON_STATS_READ, now);
+	assert(!hist[KMSCON_STATS_READ].count);
+	kmscon_stats_mark(&stats, KMSCON_STATS_WRITE, now);
+	kmscon_stats_mark(&stats, KMSCON_STATS_READ, now + 900);
+	/* a second key before the echo doesn't restart */
+	kmscon_stats_input(&stats, now + 1000);
+	kmscon_stats_mark(&stats, KMSCON_STATS_RENDER, now + 2900);
+	kmscon_stats_mark(&stats, KMSCON_STATS_FLIP, now + 9900);
+	assert(hist[KMSCON_STATS_WRITE].sum == 100);
+	assert(hist[KMSCON_STATS_READ].sum == 1000);
+	assert(hist[KMSCON_STATS_RENDER].sum == 3000);
+	assert(hist[KMSCON_STATS_FLIP].sum == 10000 && !stats.start);
+
+	/* timestamps of another clock are replaced */
+	kmscon_stats_input(&stats, UINT64_MAX);
+	assert(stats.start && stats.start <= shl_timer_now());
+
+	/* a key without echo is dropped */
+	kmscon_stats_mark(&stats, KMSCON_STATS_WRITE, stats.start + KMSCON_STATS_TIMEOUT);
+	assert(!stats.start && hist[KMSCON_STATS_WRITE].count == 1);
+
+	/* percentiles are bucket bounds */
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < 98; ++i)
+		hist_add(&hist[0], 300);
+	hist_add(&hist[0], 5000);
+	hist_add(&hist[0], 70000);
+	assert(kmscon_stats_percentile(&hist[0], 50) == 512);
+	assert(kmscon_stats_percentile(&hist[0], 99) == 8192);
+	assert(kmscon_stats_percentile(&hist[0], 100) == 131072);
+	assert(hist[0].max == 70000);
+
+	kmscon_stats_log(&stats);
+	return 0;
+}
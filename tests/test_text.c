@@ -1,5 +1,6 @@
 /*
- * Lightweight test for kmscon_text_set / kmscon_text_unset.
+ * Lightweight test for kmscon_text_set / kmscon_text_unset, for batching
+ * the cells of a row into a single draw_row call and for shaping its runs.
  * We avoid linking the whole tree by stubbing external deps.
  */
 
@@ -15,6 +16,28 @@ void kmscon_font_unref(struct kmscon_font *font) {}
 void uterm_display_ref(struct uterm_display *disp) {}
 void uterm_display_unref(struct uterm_display *disp) {}
 
+/* pretends "->" is a ligature and remembers the runs it was given */
+static unsigned int shape_calls;
+static size_t shape_num[4];
+
+int kmscon_font_shape(struct kmscon_font *font, const uint32_t *ch, size_t num, unsigned int style,
+		      uint64_t *ids)
+{
+	size_t i;
+
+	assert(shape_calls < 4);
+	shape_num[shape_calls++] = num;
+	for (i = 0; i < num; ++i) {
+		if (i + 1 < num && ch[i] == '-' && ch[i + 1] == '>')
+			ids[i] = KMSCON_GLYPH_RUN_ID | i;
+		else if (i && ch[i - 1] == '-' && ch[i] == '>')
+			ids[i] = KMSCON_GLYPH_RUN_ID | i;
+		else
+			ids[i] = 0;
+	}
+	return 0;
+}
+
 static int dummy_set_calls;
 static int dummy_unset_calls;
 static int dummy_set(struct kmscon_text *txt)
@@ -36,6 +59,169 @@ static struct kmscon_text_ops dummy_ops = {
 	.unset = dummy_unset,
 };
 
+/* rows passed to row_draw_row(), cells flattened */
+static unsigned int row_calls;
+static unsigned int row_posy[4];
+static size_t row_num[4];
+static uint32_t row_ch[16];
+static unsigned int row_cells;
+
+static int row_draw_row(struct kmscon_text *txt, unsigned int posy,
+			const struct kmscon_text_cell *cells, size_t num)
+{
+	size_t i;
+
+	assert(row_calls < 4);
+	row_posy[row_calls] = posy;
+	row_num[row_calls++] = num;
+	for (i = 0; i < num; ++i) {
+		assert(cells[i].len == 1 && cells[i].posx == i);
+		row_ch[row_cells++] = *cells[i].ch;
+	}
+	return 0;
+}
+
+static struct kmscon_text_ops row_ops = {
+	.name = "rowtest",
+	.draw_row = row_draw_row,
+};
+
+static void test_draw_row(struct kmscon_font *font, struct uterm_display *disp)
+{
+	struct kmscon_text txt;
+	struct tsm_screen_attr attr;
+	unsigned int x, y;
+	uint32_t ch;
+
+	memset(&txt, 0, sizeof(txt));
+	memset(&attr, 0, sizeof(attr));
+	txt.ops = &row_ops;
+	assert(kmscon_text_set(&txt, font, disp) == 0);
+	txt.cols = 4;
+	txt.rows = 2;
+
+	assert(kmscon_text_prepare(&txt, &attr) == 0);
+	for (y = 0; y < 2; ++y) {
+		for (x = 0; x < 4; ++x) {
+			/* the codepoint is gone once the callback returns */
+			ch = 'a' + y * 4 + x;
+			assert(kmscon_text_draw_cb(NULL, ch, &ch, 1, 1, x, y, &attr, 0, &txt) == 0);
+		}
+		/* a row is passed on once the next one starts */
+		assert(row_calls == y);
+	}
+	assert(kmscon_text_render(&txt) == 0);
+
+	assert(row_calls == 2);
+	assert(row_posy[0] == 0 && row_num[0] == 4);
+	assert(row_posy[1] == 1 && row_num[1] == 4);
+	for (x = 0; x < 8; ++x)
+		assert(row_ch[x] == 'a' + x);
+
+	kmscon_text_unset(&txt);
+	free(txt.row_chars);
+	free(txt.row);
+}
+
+static int shape_font_shape(struct kmscon_font *font, const uint32_t *ch, size_t num,
+			    unsigned int style, uint64_t *ids)
+{
+	return 0;
+}
+
+static const struct kmscon_font_ops shape_font_ops = {
+	.name = "shapetest",
+	.shape = shape_font_shape,
+};
+
+static int shape_prepare(struct kmscon_text *txt, struct tsm_screen_attr *attr)
+{
+	txt->buffer_age = 1;
+	return 0;
+}
+
+/* ids of the cells of the first row passed to shape_draw_row() */
+static unsigned int shape_rows;
+static uint64_t shape_ids[6];
+
+static int shape_draw_row(struct kmscon_text *txt, unsigned int posy,
+			  const struct kmscon_text_cell *cells, size_t num)
+{
+	size_t i;
+
+	assert(num == 6);
+	++shape_rows;
+	for (i = 0; posy == 0 && i < num; ++i)
+		shape_ids[cells[i].posx] = cells[i].id;
+	return 0;
+}
+
+static struct kmscon_text_ops shape_ops = {
+	.name = "shapetest",
+	.prepare = shape_prepare,
+	.draw_row = shape_draw_row,
+};
+
+static void draw_line(struct kmscon_text *txt, const char *line, unsigned int posy,
+		      const tsm_age_t *ages)
+{
+	struct tsm_screen_attr attr;
+	unsigned int x;
+	uint32_t ch;
+
+	memset(&attr, 0, sizeof(attr));
+	for (x = 0; line[x]; ++x) {
+		ch = line[x];
+		assert(kmscon_text_draw_cb(NULL, ch, &ch, 1, 1, x, posy, &attr, ages[x], txt) ==
+		       0);
+	}
+}
+
+static void test_shape_row(struct uterm_display *disp)
+{
+	static const tsm_age_t old[6] = { 1, 1, 1, 1, 1, 1 };
+	static const tsm_age_t typed[6] = { 1, 1, 1, 2, 1, 1 };
+	struct kmscon_font font;
+	struct kmscon_text txt;
+	struct tsm_screen_attr attr;
+
+	memset(&font, 0, sizeof(font));
+	font.ops = &shape_font_ops;
+	memset(&txt, 0, sizeof(txt));
+	memset(&attr, 0, sizeof(attr));
+	txt.ops = &shape_ops;
+	assert(kmscon_text_set(&txt, &font, disp) == 0);
+	txt.cols = 6;
+	txt.rows = 2;
+
+	/* spaces end a run and a single cell isn't shaped */
+	assert(kmscon_text_prepare(&txt, &attr) == 0);
+	draw_line(&txt, "a->b c", 0, old);
+	assert(shape_calls == 0);
+	draw_line(&txt, "xxxxxx", 1, old);
+	assert(shape_calls == 1 && shape_num[0] == 4);
+	assert(shape_ids[0] == 'a' && shape_ids[3] == 'b' && shape_ids[5] == 'c');
+	assert(shape_ids[1] == (KMSCON_GLYPH_RUN_ID | 1));
+	assert(shape_ids[2] == (KMSCON_GLYPH_RUN_ID | 2));
+	assert(kmscon_text_render(&txt) == 0);
+	assert(shape_rows == 2 && shape_calls == 2 && shape_num[1] == 6);
+
+	/* one changed cell brings its whole row, the unchanged row is skipped */
+	shape_rows = 0;
+	memset(shape_ids, 0, sizeof(shape_ids));
+	assert(kmscon_text_prepare(&txt, &attr) == 0);
+	draw_line(&txt, "a->x c", 0, typed);
+	draw_line(&txt, "xxxxxx", 1, old);
+	assert(kmscon_text_render(&txt) == 0);
+	assert(shape_rows == 1 && shape_calls == 3 && shape_num[2] == 4);
+	assert(shape_ids[0] == 'a' && shape_ids[3] == 'x' && shape_ids[5] == 'c');
+	assert(shape_ids[1] == (KMSCON_GLYPH_RUN_ID | 1));
+
+	kmscon_text_unset(&txt);
+	free(txt.row_chars);
+	free(txt.row);
+}
+
 int main(void)
 {
 	struct kmscon_text txt;
@@ -65,5 +251,8 @@ int main(void)
 	assert(ret == -EINVAL);
 	assert(dummy_set_calls == 1); /* not called again */
 
+	test_draw_row(&fake_font, fake_disp);
+	test_shape_row(fake_disp);
+
 	return 0;
 }
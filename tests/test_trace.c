@@ -0,0 +1,71 @@
+/*
+ * Check that the startup trace sums the spans of each phase, ignores spans
+ * outside of tracing and writes a trace-event file with escaped names.
+ * We include the implementation to access the internal state.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/shl_trace.c"
+
+int main(void)
+{
+	char buf[512], file[] = "/tmp/test_trace.XXXXXX";
+	uint64_t now;
+	size_t len;
+	FILE *f;
+	int fd;
+
+	/* nothing is recorded before tracing starts */
+	shl_trace_span("video", NULL, 0);
+	assert(!trace_num);
+
+	shl_trace_begin();
+	now = trace_start;
+	shl_trace_span("video", "/dev/dri/card0", now);
+	shl_trace_span("font", NULL, now);
+	shl_trace_span("video", "\"quoted\"\n", now);
+	assert(trace_num == 3);
+
+	/* phases are summed in the order they showed up */
+	trace_spans[0].end = now + 1000;
+	trace_spans[1].end = now + 2500;
+	trace_spans[2].end = now + 4000;
+	format_summary(buf, sizeof(buf));
+	assert(!strcmp(buf, "video 5.0, font 2.5"));
+
+	/* spans that started before tracing count from its start */
+	shl_trace_span("conf", NULL, 0);
+	assert(trace_spans[3].start == now);
+
+	fd = mkstemp(file);
+	assert(fd >= 0);
+	close(fd);
+	assert(!shl_trace_set_file(file));
+	shl_trace_finish(now + 10000);
+
+	/* the trace is written once and later spans are dropped */
+	assert(!trace_start && !trace_file);
+	shl_trace_span("draw", NULL, now);
+	assert(trace_num == 4);
+
+	f = fopen(file, "r");
+	assert(f);
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[len] = 0;
+	fclose(f);
+	unlink(file);
+
+	assert(!strncmp(buf, "{\"traceEvents\":[\n", 17));
+	assert(strstr(buf, "{\"name\":\"/dev/dri/card0\",\"cat\":\"video\",\"ph\":\"X\",\"ts\":0,"
+			   "\"dur\":1000,"));
+	assert(strstr(buf, "{\"name\":\"\\\"quoted\\\"\\u000a\",\"cat\":\"video\","));
+	assert(strstr(buf, "{\"name\":\"font\",\"cat\":\"font\","));
+	assert(strstr(buf, "\"ph\":\"i\",\"s\":\"g\",\"ts\":10000,"));
+	assert(!strcmp(&buf[len - 3], "]}\n"));
+
+	return 0;
+}